@@ -10,6 +10,7 @@
 #include <lua_util.h>
 #include <lauxlib.h>
 #include <string.h> 
+#include <errno.h>
 #include <ifaddrs.h>
 #include <netinet/in.h> 
 #include <net/if.h>
@@ -20,6 +21,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <network_ipc.h>
 #include <stdlib.h>
 
@@ -54,6 +56,8 @@
 static int progress(lua_State *L);
 static int progress_connect(lua_State *L);
 static int progress_receive(lua_State *L);
+static int progress_messages(lua_State *L);
+static int progress_getfd(lua_State *L);
 static int progress_close(lua_State *L);
 
 static int ctrl(lua_State *L);
@@ -61,6 +65,7 @@ static int ctrl_connect(lua_State *L);
 static int ctrl_write(lua_State *L);
 static int ctrl_close(lua_State *L);
 static int ctrl_close_socket(lua_State *L);
+static int ctrl_getfd(lua_State *L);
 
 int luaopen_lua_swupdate(lua_State *L);
 
@@ -118,6 +123,7 @@ static luaL_Reg ctrl_methods[] = {
 	{"connect",    ctrl_connect},
 	{"write",      ctrl_write},
 	{"close",      ctrl_close},
+	{"getfd",      ctrl_getfd},
 	{NULL,         NULL}
 };
 
@@ -218,10 +224,16 @@ static int ipc_wait_get_msg(ipc_message *msg)
  * @brief Close connection to SWUpdate control socket.
  *
  * @param  [Lua] The swupdate_control class instance.
+ * @param  [Lua] Optional, false to return at once instead of waiting
+ *               for the end of the update (followed by the progress
+ *               interface then, the post-install command is not run).
  * @return [Lua] True, or, in case of errors, nil plus an error message.
  */
 static int ctrl_close(lua_State *L) {
 	struct ctrl_obj *p = (struct ctrl_obj *) auxiliar_checkclass(L, "swupdate_control", 1);
+	bool wait = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+
+	lua_settop(L, 1);
 	if (p->socket == -1) {
 		lua_pop(L, 1);
 		lua_pushboolean(L, true);
@@ -230,6 +242,11 @@ static int ctrl_close(lua_State *L) {
 	}
 
 	(void)ctrl_close_socket(L);
+	if (!wait) {
+		lua_pushboolean(L, true);
+		lua_pushnil(L);
+		return 2;
+	}
 
 	if ((RECOVERY_STATUS)ipc_wait_for_complete(ipc_wait_get_msg) == FAILURE) {
 		lua_pushnil(L);
@@ -252,6 +269,25 @@ static int ctrl_close(lua_State *L) {
 	return 2;
 }
 
+/**
+ * @brief Return the file descriptor of the control socket, e.g., to
+ *        wait until it is writable in an event loop.
+ *
+ * @param  [Lua] The swupdate_control class instance.
+ * @return [Lua] The file descriptor, or nil if not connected.
+ */
+static int ctrl_getfd(lua_State *L) {
+	struct ctrl_obj *p = (struct ctrl_obj *) auxiliar_checkclass(L, "swupdate_control", 1);
+
+	lua_pop(L, 1);
+	if (p->socket == -1)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, p->socket);
+
+	return 1;
+}
+
 static int ctrl(lua_State *L) {
 	/* allocate control object */
 	struct ctrl_obj *p = (struct ctrl_obj *) lua_newuserdata(L, sizeof(*p));
@@ -276,6 +312,8 @@ static luaL_Reg progress_methods[] = {
     {"close",       progress_close},
     {"connect",     progress_connect},
     {"receive",     progress_receive},
+    {"messages",    progress_messages},
+    {"getfd",       progress_getfd},
     {NULL,          NULL}
 };
 
@@ -312,10 +350,48 @@ static int progress_close(lua_State __attribute__ ((__unused__)) *L) {
 	return 1;
 }
 
+/*
+ * Wait until a message can be read, at most timeout seconds
+ * if timeout is not negative. Returns 0 on timeout.
+ */
+static int progress_wait(int fd, double timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int ret;
+
+	if (timeout < 0)
+		return 1;
+	do {
+		ret = poll(&pfd, 1, (int)(timeout * 1000));
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+/**
+ * @brief Receive a message from SWUpdate progress socket.
+ *
+ * @param  [Lua] The swupdate_progress class instance.
+ * @param  [Lua] Optional timeout in seconds, 0 to return at once.
+ *               Without it, receive() waits for the next message.
+ * @return [Lua] The message as table, or nil plus "timeout" if none
+ *               arrived in time.
+ */
 static int progress_receive(lua_State *L) {
 	struct prog_obj *p = (struct prog_obj *) auxiliar_checkclass(L, "swupdate_progress", 1);
+	double timeout = luaL_optnumber(L, 2, -1);
 	int connfd = p->socket;
-	if (progress_ipc_receive(&connfd, &p->msg) <= 0) {
+	int ret;
+
+	lua_settop(L, 1);
+	ret = connfd < 0 ? -1 : progress_wait(connfd, timeout);
+	if (ret == 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, "timeout");
+		return 2;
+	}
+	if (ret < 0 || progress_ipc_receive(&connfd, &p->msg) <= 0) {
+		p->socket = connfd;
         	lua_pushnil(L);
 		return 2;
 	};
@@ -337,6 +413,53 @@ static int progress_receive(lua_State *L) {
 	return 1;
 }
 
+static int progress_next(lua_State *L) {
+	lua_settop(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	if (progress_receive(L) != 1)
+		lua_pushnil(L);
+
+	return 1;
+}
+
+/**
+ * @brief Iterate over the progress messages, as in
+ *        "for msg in progress:messages(0) do ... end".
+ *
+ * @param  [Lua] The swupdate_progress class instance.
+ * @param  [Lua] Optional timeout in seconds for each message, 0 to
+ *               get the pending messages only. Without it, the
+ *               iteration waits for each message.
+ * @return [Lua] The iterator, it ends on timeout or on a broken connection.
+ */
+static int progress_messages(lua_State *L) {
+	auxiliar_checkclass(L, "swupdate_progress", 1);
+	lua_pushnumber(L, luaL_optnumber(L, 2, -1));
+	lua_pushcclosure(L, progress_next, 1);
+	lua_pushvalue(L, 1);
+
+	return 2;
+}
+
+/**
+ * @brief Return the file descriptor of the progress socket, to wait
+ *        for messages in an event loop and then call receive(0).
+ *
+ * @param  [Lua] The swupdate_progress class instance.
+ * @return [Lua] The file descriptor, or nil if not connected.
+ */
+static int progress_getfd(lua_State *L) {
+	struct prog_obj *p = (struct prog_obj *) auxiliar_checkclass(L, "swupdate_progress", 1);
+
+	lua_pop(L, 1);
+	if (p->socket == -1)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, p->socket);
+
+	return 1;
+}
+
 static int progress(lua_State *L) {
 	/* allocate progress object */
 	struct prog_obj *p = (struct prog_obj *) lua_newuserdata(L, sizeof(*p));
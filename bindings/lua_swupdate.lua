@@ -87,10 +87,32 @@ lua_swupdate.progress = function()
 
         --- Receive data from SWUpdate's progress socket.
         --
-        --- @param  self  table                        This `lua_swupdate.progress` instance
+        --- @param  self     table                     This `lua_swupdate.progress` instance
+        --- @param  timeout  number | nil              Seconds to wait for a message, 0 to not wait, nil to wait until one arrives
         --- @return table | lua_swupdate.progress_msg  # This `lua_swupdate.progress` instance on error or the received progress message
-        --- @return nil                                # nil in case of error
-        receive = function(self) end,
+        --- @return nil | string                       # nil in case of error or "timeout" if no message arrived in time
+        receive = function(self, timeout) end,
+
+        --- Iterate over the messages received from SWUpdate's progress socket.
+        --
+        -- The iteration ends on timeout or if the connection is broken,
+        -- e.g., `for msg in progress:messages(0) do ... end` handles the
+        -- pending messages only.
+        --
+        --- @param  self     table         This `lua_swupdate.progress` instance
+        --- @param  timeout  number | nil  Seconds to wait for each message, 0 to not wait, nil to wait until one arrives
+        --- @return function               # Iterator returning `lua_swupdate.progress_msg` tables
+        --- @return table                  # This `lua_swupdate.progress` instance
+        messages = function(self, timeout) end,
+
+        --- Get the file descriptor of SWUpdate's progress socket.
+        --
+        -- It becomes readable when a message arrives, for event loops
+        -- that call `receive(0)` then.
+        --
+        --- @param  self  table   This `lua_swupdate.progress` instance
+        --- @return number | nil  # The file descriptor or nil if not connected
+        getfd = function(self) end,
 
         --- Close connection to SWUpdate's progress socket.
         --
@@ -125,10 +147,17 @@ lua_swupdate.control = function()
 
         --- Close connection to SWUpdate's control socket.
         --
-        --- @param  self  table    This `lua_swupdate.control` instance
-        --- @return boolean | nil  # true or nil in case of error
-        --- @return nil | string   # nil or an error message in case of error
-        close = function(self) end,
+        --- @param  self  table     This `lua_swupdate.control` instance
+        --- @param  wait  boolean?  false to return at once instead of waiting for the update to finish (default true)
+        --- @return boolean | nil   # true or nil in case of error
+        --- @return nil | string    # nil or an error message in case of error
+        close = function(self, wait) end,
+
+        --- Get the file descriptor of SWUpdate's control socket.
+        --
+        --- @param  self  table   This `lua_swupdate.control` instance
+        --- @return number | nil  # The file descriptor or nil if not connected
+        getfd = function(self) end,
     }
 end
 
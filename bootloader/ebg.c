@@ -101,11 +101,28 @@ static struct {
 static ebgenv_t ebgenv = { 0 };
 static bool inflight = false;
 
+/*
+ * Inside a transaction started by do_env_begin(), the environment is
+ * kept open and written by do_env_commit(): env_close() is the only
+ * call of libebgenv that writes and syncs the FAT-hosted files.
+ */
+static bool batch = false;
+static bool close_pending = false;
+
 static inline bool is(const char *s1, const char *s2)
 {
 	return strcmp(s1, s2) == 0;
 }
 
+static int env_persist(void)
+{
+	if (batch) {
+		close_pending = true;
+		return 0;
+	}
+	return libebg.env_close(&ebgenv);
+}
+
 static char *_env_get(const char *name)
 {
 	/*
@@ -387,7 +404,7 @@ static int do_env_set(const char *name, const char *value)
 				return result;
 			}
 
-			if ((result = libebg.env_close(&ebgenv)) != 0) {
+			if ((result = env_persist()) != 0) {
 				ERROR("Error persisting environment: %s",
 				      strerror(result));
 				return -result;
@@ -413,7 +430,7 @@ static int do_env_set(const char *name, const char *value)
 		 * the new current boot path; Does *NOT* write to the current
 		 * boot path.
 		 */
-		if ((result = libebg.env_close(&ebgenv)) != 0) {
+		if ((result = env_persist()) != 0) {
 			ERROR("Error persisting environment: %s", strerror(result));
 			return -result;
 		}
@@ -502,11 +519,48 @@ static int do_apply_list(const char *filename)
 	return result;
 }
 
+static int do_env_begin(void)
+{
+	if (batch) {
+		ERROR("EFI Boot Guard environment transaction already started");
+		return -EBUSY;
+	}
+	batch = true;
+	return 0;
+}
+
+static int do_env_commit(bool apply)
+{
+	int result = 0;
+
+	batch = false;
+	if (!close_pending)
+		return 0;
+	close_pending = false;
+
+	if (!apply) {
+		/*
+		 * libebgenv cannot reload the environment from disk, the
+		 * changes stay in the working copy until it is written.
+		 */
+		WARN("EFI Boot Guard environment changes cannot be dropped");
+		return 0;
+	}
+
+	if ((result = libebg.env_close(&ebgenv)) != 0) {
+		ERROR("Error persisting environment: %s", strerror(result));
+		return -result;
+	}
+	return 0;
+}
+
 static bootloader ebg = {
 	.env_get = &do_env_get,
 	.env_set = &do_env_set,
 	.env_unset = &do_env_unset,
-	.apply_list = &do_apply_list
+	.apply_list = &do_apply_list,
+	.env_begin = &do_env_begin,
+	.env_commit = &do_env_commit
 };
 
 static bootloader *probe(void)
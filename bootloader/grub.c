@@ -5,6 +5,7 @@
  * SPDX-License-Identifier:     GPL-2.0-only
  */
 
+#include <pthread.h>
 #include "bootloader.h"
 #include "grub.h"
 
@@ -262,92 +263,148 @@ static inline void grubenv_close(struct grubenv_t *grubenv)
 	dict_drop_db(&grubenv->vars);
 }
 
+/*
+ * Inside a transaction, the environment is read once by do_env_begin()
+ * and written once by do_env_commit(), all changes in between are
+ * done on the copy in RAM.
+ */
+static struct grubenv_t txn;
+static bool txn_open;
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* get the environment to work on, read from storage if not in a transaction */
+static int grubenv_acquire(struct grubenv_t **grubenv, struct grubenv_t *local)
+{
+	pthread_mutex_lock(&txn_lock);
+	if (txn_open) {
+		*grubenv = &txn;
+		return 0;
+	}
+
+	*grubenv = local;
+	return grubenv_open(local);
+}
+
+/* save the environment (unless err is set) if not in a transaction */
+static int grubenv_release(struct grubenv_t *grubenv, int err)
+{
+	if (grubenv != &txn) {
+		if (!err)
+			err = grubenv_write(grubenv);
+		grubenv_close(grubenv);
+	}
+	pthread_mutex_unlock(&txn_lock);
+
+	return err;
+}
+
 /* I feel that '#' and '=' characters should be forbidden. Although it's not
  * explicitly mentioned in original grub env code, they may cause unexpected
  * behavior */
 static int do_env_set(const char *name, const char *value)
 {
 	static struct grubenv_t grubenv;
+	struct grubenv_t *env;
 	int ret;
 
 	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
-		goto cleanup;
+	ret = grubenv_acquire(&env, &grubenv);
 
 	/* set new variable or change value of existing one */
-	if ((ret = dict_set_value(&grubenv.vars, (char *)name, (char *)value)))
-		goto cleanup;
+	if (!ret)
+		ret = dict_set_value(&env->vars, (char *)name, (char *)value);
 
 	/* form grubenv format out of dictionary list and save it to file */
-	if ((ret = grubenv_write(&grubenv)))
-		goto cleanup;
-
-cleanup:
-	grubenv_close(&grubenv);
-	return ret;
+	return grubenv_release(env, ret);
 }
 
 static int do_env_unset(const char *name)
 {
 	static struct grubenv_t grubenv;
-	int ret = 0;
+	struct grubenv_t *env;
+	int ret;
 
 	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
-		goto cleanup;
+	ret = grubenv_acquire(&env, &grubenv);
 
 	/* remove entry from dictionary list */
-	dict_remove(&grubenv.vars, (char *)name);
+	if (!ret)
+		dict_remove(&env->vars, (char *)name);
 
 	/* form grubenv format out of dictionary list and save it to file */
-	if ((ret = grubenv_write(&grubenv)))
-		goto cleanup;
-
-cleanup:
-	grubenv_close(&grubenv);
-	return ret;
+	return grubenv_release(env, ret);
 }
 
 static char *do_env_get(const char *name)
 {
 	static struct grubenv_t grubenv;
+	struct grubenv_t *env;
 	char *value = NULL, *var;
-	int ret = 0;
 
 	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
-		goto cleanup;
+	if (!grubenv_acquire(&env, &grubenv)) {
+		/* retrieve value of given variable from dictionary list */
+		var = dict_get_value(&env->vars, (char *)name);
+		if (var)
+			value = strdup(var);
+	}
 
-	/* retrieve value of given variable from dictionary list */
-	var = dict_get_value(&grubenv.vars, (char *)name);
+	/* nothing to save */
+	grubenv_release(env, -1);
 
-	if (var)
-		value = strdup(var);
-cleanup:
-	grubenv_close(&grubenv);
 	return value;
-
 }
 
 static int do_apply_list(const char *script)
 {
 	static struct grubenv_t grubenv;
-	int ret = 0;
+	struct grubenv_t *env;
+	int ret;
 
 	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
-		goto cleanup;
+	ret = grubenv_acquire(&env, &grubenv);
 
 	/* add variables from sw-description into dictionary list */
-	if ((ret = grubenv_parse_script(&grubenv, script)))
-		goto cleanup;
+	if (!ret)
+		ret = grubenv_parse_script(env, script);
 
 	/* form grubenv format out of dictionary list and save it to file */
-	if ((ret = grubenv_write(&grubenv)))
-		goto cleanup;
+	return grubenv_release(env, ret);
+}
+
+static int do_env_begin(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&txn_lock);
+	if (txn_open) {
+		ERROR("grubenv transaction already started");
+		ret = -EBUSY;
+	} else {
+		ret = grubenv_open(&txn);
+		if (ret)
+			grubenv_close(&txn);
+		else
+			txn_open = true;
+	}
+	pthread_mutex_unlock(&txn_lock);
+
+	return ret;
+}
+
+static int do_env_commit(bool apply)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&txn_lock);
+	if (txn_open) {
+		if (apply)
+			ret = grubenv_write(&txn);
+		grubenv_close(&txn);
+		txn_open = false;
+	}
+	pthread_mutex_unlock(&txn_lock);
 
-cleanup:
-	grubenv_close(&grubenv);
 	return ret;
 }
 
@@ -355,7 +412,9 @@ static bootloader grub = {
 	.env_get = &do_env_get,
 	.env_set = &do_env_set,
 	.env_unset = &do_env_unset,
-	.apply_list = &do_apply_list
+	.apply_list = &do_apply_list,
+	.env_begin = &do_env_begin,
+	.env_commit = &do_env_commit
 };
 
 __attribute__((constructor))
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "generated/autoconf.h"
 #include "util.h"
 #include "dlfcn.h"
@@ -58,21 +59,48 @@ static int bootloader_initialize(struct uboot_ctx **ctx)
 	return 0;
 }
 
+/*
+ * Inside a transaction, the context opened by do_env_begin() is kept
+ * and the environment is stored only by do_env_commit()
+ */
+static struct uboot_ctx *txn;
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bootloader_acquire(struct uboot_ctx **ctx)
+{
+	pthread_mutex_lock(&txn_lock);
+	if (txn) {
+		*ctx = txn;
+		return 0;
+	}
+
+	*ctx = NULL;
+	return bootloader_initialize(ctx);
+}
+
+static int bootloader_release(struct uboot_ctx *ctx, int err)
+{
+	if (ctx != txn) {
+		if (!err)
+			err = libuboot.env_store(ctx);
+		libuboot.close(ctx);
+		libuboot.exit(ctx);
+	}
+	pthread_mutex_unlock(&txn_lock);
+
+	return err;
+}
+
 static int do_env_set(const char *name, const char *value)
 {
 	int ret;
-	struct uboot_ctx *ctx = NULL;
+	struct uboot_ctx *ctx;
 
-	ret = bootloader_initialize(&ctx);
-	if (!ret) {
+	ret = bootloader_acquire(&ctx);
+	if (!ret)
 		libuboot.set_env(ctx, name, value);
-		ret = libuboot.env_store(ctx);
-	}
 
-	libuboot.close(ctx);
-	libuboot.exit(ctx);
-
-	return ret;
+	return bootloader_release(ctx, ret);
 }
 
 static int do_env_unset(const char *name)
@@ -84,41 +112,77 @@ static int do_env_unset(const char *name)
 static int do_apply_list(const char *filename)
 {
 	int ret;
-	struct uboot_ctx *ctx = NULL;
+	struct uboot_ctx *ctx;
 
-	ret = bootloader_initialize(&ctx);
-	if (!ret) {
+	ret = bootloader_acquire(&ctx);
+	if (!ret)
 		libuboot.load_file(ctx, filename);
-		ret = libuboot.env_store(ctx);
-	}
-
-	libuboot.close(ctx);
-	libuboot.exit(ctx);
 
-	return ret;
+	return bootloader_release(ctx, ret);
 }
 
 static char *do_env_get(const char *name)
 {
 	int ret;
-	struct uboot_ctx *ctx = NULL;
+	struct uboot_ctx *ctx;
 	char *value = NULL;
 
-	ret = bootloader_initialize(&ctx);
-	if (!ret) {
+	ret = bootloader_acquire(&ctx);
+	if (!ret)
 		value = libuboot.get_env(ctx, name);
-	}
-	libuboot.close(ctx);
-	libuboot.exit(ctx);
+
+	bootloader_release(ctx, -1);
 
 	return value;
 }
 
+static int do_env_begin(void)
+{
+	struct uboot_ctx *ctx = NULL;
+	int ret;
+
+	pthread_mutex_lock(&txn_lock);
+	if (txn) {
+		ERROR("U-Boot environment transaction already started");
+		ret = -EBUSY;
+	} else {
+		ret = bootloader_initialize(&ctx);
+		if (ret && ctx) {
+			libuboot.close(ctx);
+			libuboot.exit(ctx);
+		} else if (!ret) {
+			txn = ctx;
+		}
+	}
+	pthread_mutex_unlock(&txn_lock);
+
+	return ret;
+}
+
+static int do_env_commit(bool apply)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&txn_lock);
+	if (txn) {
+		if (apply)
+			ret = libuboot.env_store(txn);
+		libuboot.close(txn);
+		libuboot.exit(txn);
+		txn = NULL;
+	}
+	pthread_mutex_unlock(&txn_lock);
+
+	return ret;
+}
+
 static bootloader uboot = {
 	.env_get = &do_env_get,
 	.env_set = &do_env_set,
 	.env_unset = &do_env_unset,
-	.apply_list = &do_apply_list
+	.apply_list = &do_apply_list,
+	.env_begin = &do_env_begin,
+	.env_commit = &do_env_commit
 };
 
 static bootloader* probe(void)
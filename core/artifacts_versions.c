@@ -159,36 +159,38 @@ void get_sw_versions(swupdate_cfg_handle  __attribute__ ((__unused__))*handle,
  */
 static bool version_to_number(const char *version_string, __u64 *version_number)
 {
-	char **versions = NULL;
-	char **ver;
+	const char *ver = version_string;
+	char *end;
 	unsigned int count = 0;
-	bool valid = false;
 	__u64 version = 0;
 
-	versions = string_split(version_string, '.');
-	for (ver = versions; *ver != NULL && count < 4; ver++, count++) {
-		unsigned long int fld = strtoul(*ver, NULL, 10);
+	/* empty fields are skipped, as string_split() does */
+	while (count < 4) {
+		while (*ver == '.')
+			ver++;
+		if (!*ver)
+			break;
+		unsigned long int fld = strtoul(ver, &end, 10);
 		/* check for return of strtoul, mandatory */
 		if (fld > 0xffff) {
 			DEBUG("Version %s had an element > 65535, falling back to semver",
 			      version_string);
-			goto out;
+			return false;
 		}
 		version = (version << 16) | fld;
+		count++;
+		ver = end;
 	}
 	if (count >= 4) {
-		DEBUG("Version %s had more than 4 numbers, trailing numbers will be ignored",
-		      version_string);
+		if (strspn(ver, ".") != strlen(ver))
+			DEBUG("Version %s had more than 4 numbers, trailing numbers will be ignored",
+			      version_string);
 	} else if (count > 0) {
 		version <<= 16 * (4 - count);
 	}
 	*version_number = version;
-	valid = true;
-
-out:
-	free_string_array(versions);
 
-	return valid;
+	return true;
 }
 
 static const char ACCEPTED_CHARS[] = "0123456789.";
@@ -205,6 +207,65 @@ static bool is_oldstyle_version(const char *version_string, __u64 *version_numbe
 	return version_to_number(version_string, version_number);;
 }
 
+/*
+ * A version string parsed once in all the representations
+ * compare_versions() tries. Prerelease and metadata of the
+ * semantic version point into buf, so that neither parsing
+ * nor comparing allocates memory.
+ */
+struct version_key {
+	const char *str;
+	__u64 number;
+	semver_t sem;
+	bool is_number;
+	bool is_semver;
+	char buf[SWUPDATE_GENERAL_STRING_SIZE];
+};
+
+static void version_key_parse(const char *version, struct version_key *key)
+{
+	memset(&key->sem, 0, sizeof(key->sem));
+	key->str = version;
+	key->is_number = is_oldstyle_version(version, &key->number);
+	key->is_semver = false;
+
+	if (strlen(version) >= sizeof(key->buf))
+		return;
+	strlcpy(key->buf, version, sizeof(key->buf));
+	key->is_semver = !semver_parse_inplace(key->buf, &key->sem);
+}
+
+static int version_key_compare(const struct version_key *left,
+			       const struct version_key *right)
+{
+	if (left->is_number && right->is_number) {
+		DEBUG("Comparing old-style versions '%s' <-> '%s'",
+		      left->str, right->str);
+		TRACE("Parsed: '%llu' <-> '%llu'", left->number, right->number);
+
+		if (left->number < right->number)
+			return -1;
+		else if (left->number > right->number)
+			return 1;
+		else
+			return 0;
+	}
+
+	/*
+	 * Check if semantic version is possible
+	 */
+	if (left->is_semver && right->is_semver) {
+		DEBUG("Comparing semantic versions '%s' <-> '%s'", left->str, right->str);
+		return semver_compare(left->sem, right->sem);
+	}
+
+	/*
+	 * Last attempt: just compare the two strings
+	 */
+	DEBUG("Comparing lexicographically '%s' <-> '%s'", left->str, right->str);
+	return strcmp(left->str, right->str);
+}
+
 /*
  * Compare 2 versions.
  *
@@ -218,57 +279,111 @@ static bool is_oldstyle_version(const char *version_string, __u64 *version_numbe
  */
 int compare_versions(const char* left_version, const char* right_version)
 {
+	struct version_key left, right;
 
-	__u64 left_u64;
-	__u64 right_u64;
+	version_key_parse(left_version, &left);
+	version_key_parse(right_version, &right);
 
-	if (is_oldstyle_version(left_version, &left_u64)
-	    && is_oldstyle_version(right_version, &right_u64))
-	{
-		DEBUG("Comparing old-style versions '%s' <-> '%s'",
-		      left_version, right_version);
-		TRACE("Parsed: '%llu' <-> '%llu'", left_u64, right_u64);
+	return version_key_compare(&left, &right);
+}
 
-		if (left_u64 < right_u64)
-			return -1;
-		else if (left_u64 > right_u64)
-			return 1;
-		else
-			return 0;
+/*
+ * The installed versions are parsed once into a table hashed
+ * by name, each image is then compared with the entries of
+ * the same name only.
+ */
+struct version_entry {
+	struct version_entry *next;
+	struct sw_version *swver;
+	struct version_key key;
+};
+
+struct sw_versions_index {
+	unsigned int size;
+	struct version_entry **buckets;
+	struct version_entry entries[];
+};
+
+static unsigned int version_hash(const char *name)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
 	}
 
-	semver_t left_sem = {};
-	semver_t right_sem = {};
-	int comparison;
+	return hash;
+}
 
-	/*
-	 * Check if semantic version is possible
-	 */
-	if (!semver_parse(left_version, &left_sem) && !semver_parse(right_version, &right_sem)) {
-		DEBUG("Comparing semantic versions '%s' <-> '%s'", left_version, right_version);
-		if (loglevel >= TRACELEVEL)
-		{
-			char left_rendered[SWUPDATE_GENERAL_STRING_SIZE];
-			char right_rendered[SWUPDATE_GENERAL_STRING_SIZE];
-
-			left_rendered[0] = right_rendered[0] = '\0';
-
-			semver_render(&left_sem, left_rendered);
-			semver_render(&right_sem, right_rendered);
-			TRACE("Parsed: '%s' <-> '%s'", left_rendered, right_rendered);
+static struct sw_versions_index *index_sw_versions(struct swver *list)
+{
+	struct sw_versions_index *idx;
+	struct sw_version *swver;
+	unsigned int count = 0, size = 16, i = 0, h;
+
+	LIST_FOREACH(swver, list, next)
+		count++;
+	while (size < count * 2)
+		size <<= 1;
+
+	idx = calloc(1, sizeof(*idx) + count * sizeof(idx->entries[0]));
+	if (!idx)
+		return NULL;
+	idx->buckets = calloc(size, sizeof(*idx->buckets));
+	if (!idx->buckets) {
+		free(idx);
+		return NULL;
+	}
+	idx->size = size;
+
+	LIST_FOREACH(swver, list, next) {
+		struct version_entry *e = &idx->entries[i++];
+
+		e->swver = swver;
+		version_key_parse(swver->version, &e->key);
+		h = version_hash(swver->name) & (size - 1);
+		e->next = idx->buckets[h];
+		idx->buckets[h] = e;
+	}
+
+	return idx;
+}
+
+/*
+ * Check an artifact against the installed versions: returns true if one
+ * with the same name has the same version or, if higher is set, the same
+ * or a higher version.
+ */
+bool is_version_installed(struct swupdate_cfg *sw, const char *name,
+			  const char *version, bool higher)
+{
+	struct version_key key;
+	struct version_entry *e;
+	int cmp;
+
+	if (LIST_EMPTY(&sw->installed_sw_list))
+		return false;
+
+	if (!sw->installed_sw_index) {
+		sw->installed_sw_index = index_sw_versions(&sw->installed_sw_list);
+		if (!sw->installed_sw_index) {
+			ERROR("Cannot index the installed versions, no memory");
+			return false;
 		}
+	}
 
-		comparison = semver_compare(left_sem, right_sem);
-		semver_free(&left_sem);
-		semver_free(&right_sem);
-		return comparison;
+	version_key_parse(version, &key);
+	e = sw->installed_sw_index->buckets[version_hash(name) &
+					    (sw->installed_sw_index->size - 1)];
+	for (; e; e = e->next) {
+		if (strcmp(name, e->swver->name))
+			continue;
+		cmp = version_key_compare(&key, &e->key);
+		if (cmp == 0 || (higher && cmp < 0))
+			return true;
 	}
-	semver_free(&left_sem);
-	semver_free(&right_sem);
 
-	/*
-	 * Last attempt: just compare the two strings
-	 */
-	DEBUG("Comparing lexicographically '%s' <-> '%s'", left_version, right_version);
-	return strcmp(left_version, right_version);
+	return false;
 }
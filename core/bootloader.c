@@ -6,8 +6,11 @@
  */
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <util.h>
+#include <pctl.h>
 #include <bootloader.h>
+#include <swupdate_dict.h>
 
 int   (*bootloader_env_set)(const char *, const char *);
 int   (*bootloader_env_unset)(const char *);
@@ -23,6 +26,68 @@ static entry *current = NULL;
 static entry *available = NULL;
 static unsigned int num_available = 0;
 
+/*
+ * The main process keeps the values it has read, so that reading a
+ * variable again does not load the environment from its storage.
+ * Any write drops the whole cache: a bootloader may map a variable
+ * to others (see ebg.c).
+ */
+static struct dict env_cache;
+static pthread_mutex_t env_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bootloader_env_invalidate(void)
+{
+	pthread_mutex_lock(&env_cache_lock);
+	dict_drop_db(&env_cache);
+	pthread_mutex_unlock(&env_cache_lock);
+}
+
+static char *cached_env_get(const char *name)
+{
+	char *value;
+
+	/* subprocesses cannot see the writes of the main process */
+	if (pid)
+		return current->funcs->env_get(name);
+
+	pthread_mutex_lock(&env_cache_lock);
+	value = dict_get_value(&env_cache, name);
+	if (value) {
+		value = strdup(value);
+	} else {
+		value = current->funcs->env_get(name);
+		if (value)
+			dict_set_value(&env_cache, name, value);
+	}
+	pthread_mutex_unlock(&env_cache_lock);
+
+	return value;
+}
+
+static int cached_env_set(const char *name, const char *value)
+{
+	int ret = current->funcs->env_set(name, value);
+
+	bootloader_env_invalidate();
+	return ret;
+}
+
+static int cached_env_unset(const char *name)
+{
+	int ret = current->funcs->env_unset(name);
+
+	bootloader_env_invalidate();
+	return ret;
+}
+
+static int cached_apply_list(const char *filename)
+{
+	int ret = current->funcs->apply_list(filename);
+
+	bootloader_env_invalidate();
+	return ret;
+}
+
 int register_bootloader(const char *name, bootloader *bl)
 {
 	entry *tmp = realloc(available, (num_available + 1) * sizeof(entry));
@@ -44,10 +109,11 @@ int set_bootloader(const char *name)
 	for (unsigned int i = 0; i < num_available; i++) {
 		if (available[i].funcs &&
 		    (strcmp(available[i].name, name) == 0)) {
-			bootloader_env_set = available[i].funcs->env_set;
-			bootloader_env_get = available[i].funcs->env_get;
-			bootloader_env_unset = available[i].funcs->env_unset;
-			bootloader_apply_list = available[i].funcs->apply_list;
+			bootloader_env_invalidate();
+			bootloader_env_set = cached_env_set;
+			bootloader_env_get = cached_env_get;
+			bootloader_env_unset = cached_env_unset;
+			bootloader_apply_list = cached_apply_list;
 			current = &available[i];
 			return 0;
 		}
@@ -67,6 +133,25 @@ const char* get_bootloader(void)
 	return current ? current->name : NULL;
 }
 
+int bootloader_env_begin(void)
+{
+	if (!current || !current->funcs->env_begin)
+		return 0;
+	return current->funcs->env_begin();
+}
+
+int bootloader_env_commit(bool apply)
+{
+	int ret;
+
+	if (!current || !current->funcs->env_commit)
+		return 0;
+	ret = current->funcs->env_commit(apply);
+	bootloader_env_invalidate();
+
+	return ret;
+}
+
 void print_registered_bootloaders(void)
 {
 	TRACE("Registered bootloaders:");
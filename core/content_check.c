@@ -0,0 +1,420 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "sslapi.h"
+#include "handler.h"
+#include "content_check.h"
+
+#define CONTENT_BUFSIZE		(256 * 1024)
+
+struct content_dest {
+	char path[PATH_MAX];
+	unsigned long long offset;
+	unsigned long long size;
+	char stamp[128];	/* empty if the state cannot be identified */
+};
+
+static char *cache_path;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void content_check_set_cache(const char *path)
+{
+	free(cache_path);
+	cache_path = path && strlen(path) ? strdup(path) : NULL;
+}
+
+static int read_sysfs(const char *fname, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -EIO;
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/* sectors written, the 7th field of the statistics of a block device */
+static unsigned long long sectors_written(const char *dir)
+{
+	unsigned long long v[7] = { 0 };
+	char fname[PATH_MAX], buf[256];
+
+	snprintf(fname, sizeof(fname), "%s/stat", dir);
+	if (read_sysfs(fname, buf, sizeof(buf)) ||
+	    sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2],
+		   &v[3], &v[4], &v[5], &v[6]) != 7)
+		return ULLONG_MAX;
+
+	return v[6];
+}
+
+/*
+ * A block device did not change as long as nothing was written to it
+ * or to the disk it belongs to during this boot
+ */
+static void block_stamp(const char *dev, char *stamp, size_t len)
+{
+	char bootid[64], dir[PATH_MAX], fname[PATH_MAX], *real;
+	unsigned long long part, disk = 0;
+
+	stamp[0] = '\0';
+	if (read_sysfs("/proc/sys/kernel/random/boot_id", bootid, sizeof(bootid)))
+		return;
+	real = realpath(dev, NULL);
+	if (!real)
+		return;
+	snprintf(dir, sizeof(dir), "/sys/class/block/%s", basename(real));
+	free(real);
+
+	part = sectors_written(dir);
+	if (part == ULLONG_MAX)
+		return;
+	snprintf(fname, sizeof(fname), "%s/partition", dir);
+	if (!access(fname, F_OK)) {
+		snprintf(fname, sizeof(fname), "%s/..", dir);
+		disk = sectors_written(fname);
+		if (disk == ULLONG_MAX)
+			return;
+	}
+	snprintf(stamp, len, "b:%s:%llu:%llu", bootid, part, disk);
+}
+
+/*
+ * The times of a file have the granularity of the clock tick, so a
+ * hash measured on a file changed in the last second is not cached:
+ * a write right after it could leave the times unchanged. A file
+ * that SWUpdate installed is stamped once the handler has written
+ * and closed it, after the last write, and is cached at once.
+ */
+static void file_stamp(const struct stat *st, bool installed, char *stamp, size_t len)
+{
+	stamp[0] = '\0';
+	if (!installed && st->st_ctim.tv_sec + 1 >= time(NULL))
+		return;
+	snprintf(stamp, len, "f:%llu:%llu:%lld.%09ld:%lld.%09ld",
+		 (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+		 (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		 (long long)st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+}
+
+/*
+ * UBI does not count what is written to a volume: only the state that
+ * SWUpdate recorded after installing the volume is trusted. The ubivol
+ * handler drops it before it writes, removes or creates a volume.
+ */
+static void ubi_stamp(const char *dir, const char *volname, char *stamp, size_t len)
+{
+	char fname[PATH_MAX], type[32], bytes[32], ebs[32], buf[32];
+
+	stamp[0] = '\0';
+	snprintf(fname, sizeof(fname), "%s/upd_marker", dir);
+	if (read_sysfs(fname, buf, sizeof(buf)) || strcmp(buf, "0"))
+		return;
+	snprintf(fname, sizeof(fname), "%s/corrupted", dir);
+	if (read_sysfs(fname, buf, sizeof(buf)) || strcmp(buf, "0"))
+		return;
+	snprintf(fname, sizeof(fname), "%s/type", dir);
+	if (read_sysfs(fname, type, sizeof(type)))
+		return;
+	snprintf(fname, sizeof(fname), "%s/data_bytes", dir);
+	if (read_sysfs(fname, bytes, sizeof(bytes)))
+		return;
+	snprintf(fname, sizeof(fname), "%s/reserved_ebs", dir);
+	if (read_sysfs(fname, ebs, sizeof(ebs)))
+		return;
+	snprintf(stamp, len, "u:%s:%s:%s:%s", volname, type, bytes, ebs);
+}
+
+/*
+ * The volume must be found on a single UBI device. A hash measured on
+ * a volume is not cached, the one of an installed volume is.
+ */
+static int ubi_volume_dest(const char *volname, bool installed, struct content_dest *d)
+{
+	char fname[PATH_MAX], dir[PATH_MAX], buf[128];
+	struct dirent *de;
+	unsigned int found = 0;
+	DIR *dirp;
+
+	dirp = opendir("/sys/class/ubi");
+	if (!dirp)
+		return -ENODEV;
+	while ((de = readdir(dirp))) {
+		if (strncmp(de->d_name, "ubi", 3) || !strchr(de->d_name, '_'))
+			continue;
+		snprintf(fname, sizeof(fname), "/sys/class/ubi/%s/name", de->d_name);
+		if (read_sysfs(fname, buf, sizeof(buf)) || strcmp(buf, volname))
+			continue;
+		if (found++)
+			break;
+		snprintf(d->path, sizeof(d->path), "/dev/%s", de->d_name);
+		snprintf(dir, sizeof(dir), "/sys/class/ubi/%s", de->d_name);
+		/* a static volume holds exactly the image */
+		snprintf(fname, sizeof(fname), "%s/type", dir);
+		if (!d->size && !read_sysfs(fname, buf, sizeof(buf)) && !strcmp(buf, "static")) {
+			snprintf(fname, sizeof(fname), "%s/data_bytes", dir);
+			if (!read_sysfs(fname, buf, sizeof(buf)))
+				d->size = strtoull(buf, NULL, 10);
+		}
+	}
+	closedir(dirp);
+
+	if (found != 1)
+		return found ? -EEXIST : -ENOENT;
+	if (installed)
+		ubi_stamp(dir, volname, d->stamp, sizeof(d->stamp));
+
+	return d->size ? 0 : -EINVAL;
+}
+
+static int content_dest(struct img_type *img, bool installed, struct content_dest *d)
+{
+	struct stat st;
+
+	memset(d, 0, sizeof(*d));
+	d->size = img->content_size;
+
+	if (!strcmp(img->type, "ubivol") && img->volname)
+		return ubi_volume_dest(img->volname, installed, d);
+
+	if (!strcmp(img->type, "rawfile")) {
+		/* a file on a filesystem mounted for the update is not checked */
+		if (strlen(img->device) || img->filesystem)
+			return -EOPNOTSUPP;
+		strlcpy(d->path, img->path, sizeof(d->path));
+		if (stat(d->path, &st) < 0)
+			return -ENOENT;
+		if (!S_ISREG(st.st_mode) || (d->size && d->size != (unsigned long long)st.st_size))
+			return -ENODATA;
+		d->size = st.st_size;
+		file_stamp(&st, installed, d->stamp, sizeof(d->stamp));
+		return 0;
+	}
+
+	if (!strcmp(img->type, "raw") && strlen(img->device)) {
+		strlcpy(d->path, img->device, sizeof(d->path));
+		d->offset = img->seek;
+		if (stat(d->path, &st) < 0)
+			return -ENOENT;
+		if (S_ISBLK(st.st_mode))
+			block_stamp(d->path, d->stamp, sizeof(d->stamp));
+		else if (S_ISREG(st.st_mode))
+			file_stamp(&st, installed, d->stamp, sizeof(d->stamp));
+		return d->size ? 0 : -EINVAL;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+/* Lines are "<stamp> <offset> <size> <sha256> <path>" */
+static bool cache_lookup(const struct content_dest *d, unsigned char *hash)
+{
+	char stamp[sizeof(d->stamp)], ascii[2 * SHA256_HASH_LENGTH + 1];
+	unsigned long long offset, size;
+	char *line = NULL;
+	size_t len = 0;
+	bool found = false;
+	int pathpos;
+	FILE *fp;
+
+	if (!cache_path || !strlen(d->stamp))
+		return false;
+
+	pthread_mutex_lock(&cache_lock);
+	fp = fopen(cache_path, "r");
+	while (fp && !found && getline(&line, &len, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%127s %llu %llu %64s %n", stamp, &offset, &size, ascii,
+			   &pathpos) != 4)
+			continue;
+		found = !strcmp(line + pathpos, d->path) && !strcmp(stamp, d->stamp) &&
+			offset == d->offset && size == d->size && !ascii_to_hash(hash, ascii);
+	}
+	if (fp)
+		fclose(fp);
+	free(line);
+	pthread_mutex_unlock(&cache_lock);
+
+	return found;
+}
+
+/* The entry of the destination is replaced, or dropped without hash */
+static void cache_store(const struct content_dest *d, const unsigned char *hash)
+{
+	char stamp[sizeof(d->stamp)], tmp[PATH_MAX], ascii[2 * SHA256_HASH_LENGTH + 1];
+	unsigned long long offset;
+	char *line = NULL;
+	size_t len = 0;
+	int pathpos;
+	FILE *in, *out;
+
+	if (!cache_path || (hash && !strlen(d->stamp)))
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+	pthread_mutex_lock(&cache_lock);
+	out = fopen(tmp, "w");
+	if (!out) {
+		pthread_mutex_unlock(&cache_lock);
+		WARN("Cannot write the content cache %s", cache_path);
+		return;
+	}
+	in = fopen(cache_path, "r");
+	while (in && getline(&line, &len, in) > 0) {
+		char *end = line + strcspn(line, "\n");
+		char saved = *end;
+
+		*end = '\0';
+		if (sscanf(line, "%127s %llu %*u %*s %n", stamp, &offset, &pathpos) == 2 &&
+		    !strcmp(line + pathpos, d->path) && offset == d->offset)
+			continue;
+		*end = saved;
+		fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+	free(line);
+	if (hash) {
+		hash_to_ascii(hash, ascii);
+		fprintf(out, "%s %llu %llu %s %s\n", d->stamp, d->offset, d->size, ascii,
+			d->path);
+	}
+	if (fclose(out) || rename(tmp, cache_path)) {
+		WARN("Cannot write the content cache %s", cache_path);
+		unlink(tmp);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int hash_dest(const struct content_dest *d, unsigned char *hash)
+{
+	unsigned long long done = 0;
+	unsigned int mdlen;
+	unsigned char *buf;
+	void *dgst;
+	ssize_t n;
+	int fd, ret = 0;
+
+	fd = open(d->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	buf = malloc(CONTENT_BUFSIZE);
+	dgst = swupdate_HASH_init("sha256");
+	if (!buf || !dgst) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	(void)posix_fadvise(fd, d->offset, d->size, POSIX_FADV_SEQUENTIAL);
+
+	while (done < d->size) {
+		size_t len = d->size - done < CONTENT_BUFSIZE ? d->size - done : CONTENT_BUFSIZE;
+
+		n = pread(fd, buf, len, d->offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			/* shorter than the image, it cannot be identical */
+			ret = n < 0 ? -errno : -ENODATA;
+			goto out;
+		}
+		if (swupdate_HASH_update(dgst, buf, n) < 0) {
+			ret = -EFAULT;
+			goto out;
+		}
+		done += n;
+	}
+	if (swupdate_HASH_final(dgst, hash, &mdlen) < 0)
+		ret = -EFAULT;
+
+out:
+	if (dgst)
+		swupdate_HASH_cleanup(dgst);
+	free(buf);
+	close(fd);
+
+	return ret;
+}
+
+bool content_check_identical(struct img_type *img)
+{
+	unsigned char hash[SHA256_HASH_LENGTH];
+	struct content_dest d;
+	int ret;
+
+	if (!img->install_if_content_different)
+		return false;
+
+	if (!(get_handler_mask(img) & SKIP_UNCHANGED_HANDLER))
+		ret = -EOPNOTSUPP;
+	else
+		ret = content_dest(img, false, &d);
+	if (ret == -EOPNOTSUPP || ret == -EINVAL || ret == -EEXIST) {
+		WARN("%s: content of the destination cannot be checked%s", img->fname,
+		     ret == -EINVAL ? ", content-size is missing" : "");
+		return false;
+	}
+	if (ret)
+		return false;
+
+	if (cache_lookup(&d, hash)) {
+		TRACE("%s: hash of %s taken from the content cache", img->fname, d.path);
+	} else {
+		if (hash_dest(&d, hash))
+			return false;
+		cache_store(&d, hash);
+	}
+
+	if (memcmp(hash, img->content_sha256, sizeof(hash)))
+		return false;
+	INFO("%s: %s has already the same content, skipping", img->fname, d.path);
+
+	return true;
+}
+
+void content_check_installed(struct img_type *img)
+{
+	struct content_dest d;
+
+	if (!img->install_if_content_different || !cache_path)
+		return;
+	if (!content_dest(img, true, &d))
+		cache_store(&d, img->content_sha256);
+}
+
+void content_check_invalidate(const char *path)
+{
+	struct content_dest d;
+
+	if (!cache_path)
+		return;
+	memset(&d, 0, sizeof(d));
+	strlcpy(d.path, path, sizeof(d.path));
+	cache_store(&d, NULL);
+}
@@ -0,0 +1,567 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * io_uring engine of the copy pipeline. liburing is not required:
+ * only a few operations are used, so the rings are set up with the
+ * system calls. The buffers are registered when the kernel allows
+ * it, else the vectored operations of the first io_uring kernels
+ * are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "util.h"
+#include "swupdate_membudget.h"
+#include "cpio_uring.h"
+
+/* requests in flight for each direction */
+#define URING_DEPTH	4
+
+struct uring {
+	int fd;
+	unsigned int depth;
+	bool fixed;		/* the buffers are registered */
+	unsigned int inflight;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	struct io_uring_cqe *cqes;
+
+	uint8_t *buffers;
+	size_t bufsize;
+	struct iovec iov[URING_DEPTH];
+	size_t reserved;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint8_t *slot_buffer(struct uring *u, unsigned int slot)
+{
+	return u->buffers + (size_t)slot * u->bufsize;
+}
+
+static void uring_teardown(struct uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ptr && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_size);
+	if (u->sq_ptr)
+		munmap(u->sq_ptr, u->sq_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u->buffers);
+	membudget_release(u->reserved);
+}
+
+static int uring_setup(struct uring *u, unsigned int depth, size_t bufsize)
+{
+	struct io_uring_params p;
+	void *buffers;
+	int ret;
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	u->depth = depth;
+	u->bufsize = bufsize;
+
+	if (!membudget_reserve(depth * bufsize))
+		return -ENOMEM;
+	u->reserved = depth * bufsize;
+	if (posix_memalign(&buffers, getpagesize(), depth * bufsize)) {
+		uring_teardown(u);
+		return -ENOMEM;
+	}
+	u->buffers = buffers;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = sys_io_uring_setup(depth, &p);
+	if (u->fd < 0) {
+		ret = -errno;
+		uring_teardown(u);
+		return ret;
+	}
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sq_size = u->cq_size = max(u->sq_size, u->cq_size);
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		u->sq_ptr = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	u->sq_head = (unsigned int *)((uint8_t *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((uint8_t *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((uint8_t *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((uint8_t *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned int *)((uint8_t *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((uint8_t *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((uint8_t *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ptr + p.cq_off.cqes);
+
+	for (unsigned int i = 0; i < depth; i++) {
+		u->iov[i].iov_base = slot_buffer(u, i);
+		u->iov[i].iov_len = bufsize;
+	}
+	/* it fails if the buffers exceed RLIMIT_MEMLOCK on older kernels */
+	u->fixed = !sys_io_uring_register(u->fd, IORING_REGISTER_BUFFERS,
+					  u->iov, depth);
+
+	return 0;
+
+fail:
+	ret = -errno;
+	uring_teardown(u);
+	return ret;
+}
+
+/* Queues a transfer of len bytes at boff in the buffer of slot */
+static int uring_submit(struct uring *u, bool write, int fd, unsigned int slot,
+			off_t offset, size_t len, size_t boff)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->user_data = slot;
+	if (u->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)(slot_buffer(u, slot) + boff);
+		sqe->len = len;
+		sqe->buf_index = slot;
+	} else {
+		u->iov[slot].iov_base = slot_buffer(u, slot) + boff;
+		u->iov[slot].iov_len = len;
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t)&u->iov[slot];
+		sqe->len = 1;
+	}
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(u->fd, 1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		ret = -errno;
+		/* take the request back, the kernel has not consumed it */
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+		return ret;
+	}
+	u->inflight++;
+
+	return 0;
+}
+
+/* Waits for a completion, returns the slot of the request */
+static int uring_wait(struct uring *u, int *res)
+{
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	for (;;) {
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		if (head != tail)
+			break;
+		ret = sys_io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	cqe = &u->cqes[head & *u->cq_mask];
+	*res = cqe->res;
+	ret = (int)cqe->user_data;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	u->inflight--;
+
+	return ret;
+}
+
+static bool seekable(int fd, off_t *pos)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+		return false;
+	*pos = lseek(fd, 0, SEEK_CUR);
+
+	return *pos >= 0;
+}
+
+struct uring_rslot {
+	off_t offset;
+	size_t len;
+	size_t filled;
+	size_t pos;
+	int error;
+	bool busy;
+	bool done;
+};
+
+struct uring_reader {
+	struct uring u;
+	int fd;
+	off_t start;
+	off_t next;
+	size_t remaining;	/* not requested yet */
+	size_t consumed;
+	unsigned int head;
+	unsigned int nslots;
+	struct uring_rslot slots[URING_DEPTH];
+};
+
+static void reader_fill_slot(struct uring_reader *r, unsigned int i)
+{
+	struct uring_rslot *s = &r->slots[i];
+	size_t len = min(r->u.bufsize, r->remaining);
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	if (!len)
+		return;
+	s->offset = r->next;
+	s->len = len;
+	s->busy = true;
+	r->next += len;
+	r->remaining -= len;
+
+	ret = uring_submit(&r->u, false, r->fd, i, s->offset, len, 0);
+	if (ret) {
+		s->error = ret;
+		s->done = true;
+	}
+}
+
+static void reader_complete(struct uring_reader *r, unsigned int i, int res)
+{
+	struct uring_rslot *s = &r->slots[i];
+	int ret;
+
+	if (res == -EINTR || res == -EAGAIN) {
+		res = 0;
+	} else if (res < 0) {
+		s->error = res;
+		s->done = true;
+		return;
+	} else if (res == 0) {
+		/* the file is shorter than expected */
+		s->done = true;
+		return;
+	}
+
+	s->filled += res;
+	if (s->filled == s->len) {
+		s->done = true;
+		return;
+	}
+	ret = uring_submit(&r->u, false, r->fd, i, s->offset + s->filled,
+			   s->len - s->filled, s->filled);
+	if (ret) {
+		s->error = ret;
+		s->done = true;
+	}
+}
+
+struct uring_reader *uring_reader_start(int fd, size_t total, size_t bufsize)
+{
+	struct uring_reader *r;
+	off_t pos;
+
+	/* a single request in flight is not better than read() */
+	if (total <= bufsize || !seekable(fd, &pos))
+		return NULL;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->nslots = min((size_t)URING_DEPTH, (total + bufsize - 1) / bufsize);
+	if (uring_setup(&r->u, r->nslots, bufsize)) {
+		free(r);
+		return NULL;
+	}
+	r->fd = fd;
+	r->start = r->next = pos;
+	r->remaining = total;
+
+	for (unsigned int i = 0; i < r->nslots; i++)
+		reader_fill_slot(r, i);
+
+	return r;
+}
+
+ssize_t uring_reader_read(struct uring_reader *r, void *buf, size_t len)
+{
+	struct uring_rslot *s = &r->slots[r->head];
+	size_t n;
+	int slot, res;
+
+	if (!s->busy)
+		return 0;
+
+	while (!s->done) {
+		slot = uring_wait(&r->u, &res);
+		if (slot < 0) {
+			errno = -slot;
+			return -1;
+		}
+		reader_complete(r, slot, res);
+	}
+	if (s->error) {
+		errno = -s->error;
+		return -1;
+	}
+
+	n = min(len, s->filled - s->pos);
+	memcpy(buf, slot_buffer(&r->u, r->head) + s->pos, n);
+	s->pos += n;
+	r->consumed += n;
+
+	if (s->pos == s->filled) {
+		if (s->filled < s->len) {
+			/* end of file, nothing more can be read */
+			r->remaining = 0;
+		}
+		reader_fill_slot(r, r->head);
+		r->head = (r->head + 1) % r->nslots;
+	}
+
+	return n;
+}
+
+void uring_reader_stop(struct uring_reader *r)
+{
+	int res;
+
+	if (!r)
+		return;
+
+	while (r->u.inflight && uring_wait(&r->u, &res) >= 0)
+		;
+	/* the data read ahead is given back */
+	if (lseek(r->fd, r->start + r->consumed, SEEK_SET) < 0)
+		ERROR("Cannot restore the position of the input: %s", strerror(errno));
+	uring_teardown(&r->u);
+	free(r);
+}
+
+struct uring_wslot {
+	off_t offset;
+	size_t len;
+	size_t written;
+	bool busy;
+};
+
+struct uring_writer {
+	struct uring u;
+	int fd;
+	off_t next;
+	unsigned int cur;
+	size_t fill;
+	int error;
+	struct uring_wslot slots[URING_DEPTH];
+};
+
+static void writer_complete(struct uring_writer *w, unsigned int i, int res)
+{
+	struct uring_wslot *s = &w->slots[i];
+	int ret;
+
+	if (res == -EINTR || res == -EAGAIN) {
+		res = 0;
+	} else if (res < 0 || (res == 0 && s->len)) {
+		if (!w->error) {
+			w->error = res < 0 ? res : -EIO;
+			ERROR("cannot write %zu bytes: %s", s->len - s->written,
+			      strerror(-w->error));
+		}
+		s->busy = false;
+		return;
+	}
+
+	s->written += res;
+	if (s->written == s->len) {
+		s->busy = false;
+		return;
+	}
+	ret = uring_submit(&w->u, true, w->fd, i, s->offset + s->written,
+			   s->len - s->written, s->written);
+	if (ret) {
+		if (!w->error)
+			w->error = ret;
+		s->busy = false;
+	}
+}
+
+static int writer_wait(struct uring_writer *w)
+{
+	int slot, res;
+
+	slot = uring_wait(&w->u, &res);
+	if (slot < 0)
+		return slot;
+	writer_complete(w, slot, res);
+
+	return 0;
+}
+
+static void writer_flush(struct uring_writer *w)
+{
+	struct uring_wslot *s = &w->slots[w->cur];
+	int ret;
+
+	if (!w->fill)
+		return;
+
+	s->offset = w->next;
+	s->len = w->fill;
+	s->written = 0;
+	s->busy = true;
+	w->next += w->fill;
+	w->fill = 0;
+	w->cur = (w->cur + 1) % w->u.depth;
+
+	ret = uring_submit(&w->u, true, w->fd, s - w->slots, s->offset, s->len, 0);
+	if (ret) {
+		if (!w->error)
+			w->error = ret;
+		s->busy = false;
+	}
+}
+
+struct uring_writer *uring_writer_start(int fd, size_t bufsize)
+{
+	struct uring_writer *w;
+	off_t pos;
+	int flags = fcntl(fd, F_GETFL);
+
+	/* with O_APPEND, the offset of the requests is ignored */
+	if (flags < 0 || (flags & O_APPEND) || !seekable(fd, &pos))
+		return NULL;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	if (uring_setup(&w->u, URING_DEPTH, bufsize)) {
+		free(w);
+		return NULL;
+	}
+	w->fd = fd;
+	w->next = pos;
+
+	return w;
+}
+
+int uring_writer_write(struct uring_writer *w, const void *buf, size_t len)
+{
+	struct uring_wslot *s;
+	size_t n;
+	int ret;
+
+	while (len && !w->error) {
+		s = &w->slots[w->cur];
+		while (s->busy) {
+			ret = writer_wait(w);
+			if (ret) {
+				w->error = ret;
+				return -1;
+			}
+		}
+		n = min(w->u.bufsize - w->fill, len);
+		memcpy(slot_buffer(&w->u, w->cur) + w->fill, buf, n);
+		w->fill += n;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		if (w->fill == w->u.bufsize)
+			writer_flush(w);
+	}
+
+	return w->error ? -1 : 0;
+}
+
+int uring_writer_stop(struct uring_writer *w)
+{
+	int ret;
+
+	if (!w)
+		return 0;
+
+	if (!w->error)
+		writer_flush(w);
+	while (w->u.inflight) {
+		ret = writer_wait(w);
+		if (ret) {
+			if (!w->error)
+				w->error = ret;
+			break;
+		}
+	}
+	if (lseek(w->fd, w->next, SEEK_SET) < 0 && !w->error)
+		w->error = -errno;
+	ret = w->error ? -1 : 0;
+
+	uring_teardown(&w->u);
+	free(w);
+
+	return ret;
+}
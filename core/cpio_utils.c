@@ -11,11 +11,26 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+#include <pthread.h>
 #ifdef CONFIG_GUNZIP
 #include <zlib.h>
 #endif
 #ifdef CONFIG_ZSTD
 #include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef CONFIG_XZ
+#include <lzma.h>
 #endif
 
 #include "generated/autoconf.h"
@@ -23,10 +38,28 @@
 #include "util.h"
 #include "sslapi.h"
 #include "progress.h"
+#include "swupdate_metrics.h"
+#include "swupdate_profile.h"
+#include "swupdate_probes.h"
+#include "installer.h"
+#include "swupdate_membudget.h"
+#include "cpio_uring.h"
+#include "ipc_ring.h"
+#include "pctl.h"
 
 #define MODULE_NAME "cpio"
 
+#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_LZ4) || \
+	defined(CONFIG_XZ)
+#define DECOMPRESS_STEPS
+#endif
+
 #define BUFF_SIZE	 16384
+#define BUFF_SIZE_MIN	 4096
+#define BUFF_SIZE_MAX	 (16 * 1024 * 1024)
+#define KERNEL_COPY_CHUNK	(4 * 1024 * 1024)
+#define BUFF_SIZE_AUTO_MAX	 (1024 * 1024)
+#define PIPELINE_THREADED_MIN	 (256 * 1024)	/* smaller buffers are copied in the caller */
 
 #define NPAD_BYTES(o) ((4 - (o % 4)) % 4)
 
@@ -58,15 +91,55 @@ int get_cpiohdr(unsigned char *buf, struct filehdr *fhdr)
 	return 0;
 }
 
-static int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned long *offs,
-	uint32_t *checksum, void *dgst)
+/*
+ * Sum of the bytes for the "crc" cpio format. The bytes are added a
+ * word at a time in 16 bit lanes, which are folded before they can
+ * overflow (128 words add at most 128 * 2 * 255 to a lane).
+ */
+static uint32_t cpio_sum_bytes(uint32_t sum, const unsigned char *buf, size_t len)
+{
+	const uint64_t mask = 0x00ff00ff00ff00ffULL;
+	uint64_t word, lanes;
+	size_t i = 0, n;
+
+	while (len - i >= sizeof(word)) {
+		lanes = 0;
+		for (n = 0; n < 128 && len - i >= sizeof(word); n++, i += sizeof(word)) {
+			memcpy(&word, buf + i, sizeof(word));
+			lanes += (word & mask) + ((word >> 8) & mask);
+		}
+		lanes = (lanes & 0x0000ffff0000ffffULL) + ((lanes >> 16) & 0x0000ffff0000ffffULL);
+		sum += (uint32_t)lanes + (uint32_t)(lanes >> 32);
+	}
+	for (; i < len; i++)
+		sum += buf[i];
+
+	return sum;
+}
+
+/* Blocks small enough to be still in the cache for the hash */
+#define FILL_BLOCK_SIZE	4096
+
+static ssize_t read_input(int fd, struct uring_reader *ring, void *buf, size_t nbytes)
+{
+#ifdef CONFIG_CPIO_IO_URING
+	if (ring)
+		return uring_reader_read(ring, buf, nbytes);
+#else
+	(void)ring;
+#endif
+	return ipc_ring_read(fd, buf, nbytes);
+}
+
+static int fill_buffer_from(int fd, struct uring_reader *ring, unsigned char *buf,
+	unsigned int nbytes, unsigned long *offs, uint32_t *checksum, void *dgst)
 {
 	ssize_t len;
 	unsigned long count = 0;
-	int i;
+	size_t off, block;
 
 	while (nbytes > 0) {
-		len = read(fd, buf, nbytes);
+		len = read_input(fd, ring, buf, nbytes);
 		if (len < 0) {
 			ERROR("Failure in stream %d: %s", fd, strerror(errno));
 			return -EFAULT;
@@ -74,13 +147,24 @@ static int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned
 		if (len == 0) {
 			return 0;
 		}
-		if (checksum)
-			for (i = 0; i < len; i++)
-				*checksum += buf[i];
+		if (checksum && dgst) {
+			uint64_t start = metrics_now();
+
+			for (off = 0; off < (size_t)len; off += block) {
+				block = min((size_t)len - off, (size_t)FILL_BLOCK_SIZE);
+				*checksum = cpio_sum_bytes(*checksum, buf + off, block);
+				if (swupdate_HASH_update(dgst, buf + off, block) < 0)
+					return -EFAULT;
+			}
+			metrics_stage(METRICS_STAGE_HASH, len, start);
+		} else if (checksum) {
+			*checksum = cpio_sum_bytes(*checksum, buf, len);
+		} else if (dgst) {
+			uint64_t start = metrics_now();
 
-		if (dgst) {
 			if (swupdate_HASH_update(dgst, buf, len) < 0)
 				return -EFAULT;
+			metrics_stage(METRICS_STAGE_HASH, len, start);
 		}
 		buf += len;
 		count += len;
@@ -91,6 +175,12 @@ static int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned
 	return count;
 }
 
+static int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned long *offs,
+	uint32_t *checksum, void *dgst)
+{
+	return fill_buffer_from(fd, NULL, buf, nbytes, offs, checksum, dgst);
+}
+
 /*
  * Read padding that could exists between the cpio trailer and the end-of-file.
  * cpio aligns the file to 512 bytes
@@ -107,7 +197,7 @@ void extract_padding(int fd, unsigned long *offset)
     padding = (512 - (*offset % 512)) % 512;
     if (padding) {
         TRACE("Expecting %d padding bytes at end-of-file", padding);
-        len = read(fd, buf, padding);
+        len = ipc_ring_read(fd, buf, padding);
         if (len < 0) {
             DEBUG("Failure while reading padding %d: %s", fd, strerror(errno));
             return;
@@ -155,6 +245,31 @@ int copy_write(void *out, const void *buf, size_t len)
 	return 0;
 }
 
+/*
+ * Multi-sink output: one pass of the pipeline feeds
+ * all the file descriptors of the tee
+ */
+int copy_write_tee(void *out, const void *buf, size_t len)
+{
+	struct copy_tee *tee = out;
+
+	if (!tee) {
+		ERROR("Output file descriptor invalid !");
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < tee->count; i++) {
+#if defined(__FreeBSD__)
+		if (copy_write_padded(&tee->fds[i], buf, len) < 0)
+#else
+		if (copy_write(&tee->fds[i], buf, len) < 0)
+#endif
+			return -1;
+	}
+
+	return 0;
+}
+
 #if defined(__FreeBSD__)
 /*
  * FreeBSD likes to have multiples of 512 bytes written
@@ -180,6 +295,308 @@ int copy_write_padded(void *out, const void *buf, size_t len)
 }
 #endif
 
+#if defined(__linux__)
+#define KERNEL_COPY_PIPE_SIZE	(1024 * 1024)
+
+/*
+ * Errors meaning that the kernel cannot move data between
+ * this pair of file descriptors, not that the copy failed
+ */
+static bool kernel_copy_unsupported(int err)
+{
+	return err == EINVAL || err == ENOSYS || err == EXDEV ||
+		err == EOPNOTSUPP || err == EBADF || err == ESPIPE;
+}
+
+static ssize_t kernel_copy_file_range(int fdin, int fdout, size_t len)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, fdin, NULL, fdout, NULL, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * The data is already consumed from the input: if the output cannot
+ * be spliced, the pipe must be drained through userspace.
+ */
+static int kernel_copy_drain(int pipefd, int fdout, size_t len)
+{
+	uint8_t buf[4096];
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(pipefd, buf, min(len, sizeof(buf)));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -EIO;
+		if (copy_write(&fdout, buf, n) < 0)
+			return -EIO;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Move nbytes from fdin to fdout without copying them through
+ * userspace, with copy_file_range() between regular files and with
+ * splice() over a pipe otherwise. Both descriptors are used at their
+ * current position. Returns 0 when nbytes are moved or at EOF,
+ * -EOPNOTSUPP when the kernel cannot (or cannot anymore) do it, so that
+ * the caller copies the rest, and a negative errno on failure.
+ * *copied is always set to the number of bytes moved.
+ */
+int copy_in_kernel(int fdin, int fdout, size_t nbytes, size_t *copied)
+{
+	int pipefd[2] = { -1, -1 };
+	bool use_splice = false;
+	ssize_t n, m;
+	int ret = 0;
+
+	*copied = 0;
+	/* the data of a shared ring or read ahead is not in the connection */
+	if (ipc_ring_attached(fdin) || ipc_ring_pending(fdin))
+		return -EOPNOTSUPP;
+	while (*copied < nbytes) {
+		size_t len = min(nbytes - *copied, (size_t)SSIZE_MAX);
+
+		if (!use_splice) {
+			n = kernel_copy_file_range(fdin, fdout, len);
+			if (n > 0) {
+				*copied += n;
+				continue;
+			}
+			if (n == 0)
+				break;
+			if (errno == EINTR)
+				continue;
+			if (!kernel_copy_unsupported(errno)) {
+				ret = -errno;
+				break;
+			}
+			/* Nothing was moved, retry with splice() */
+			if (pipe2(pipefd, O_CLOEXEC) < 0) {
+				ret = -EOPNOTSUPP;
+				break;
+			}
+			(void)fcntl(pipefd[1], F_SETPIPE_SZ, KERNEL_COPY_PIPE_SIZE);
+			use_splice = true;
+		}
+
+		n = splice(fdin, NULL, pipefd[1], NULL, min(len, (size_t)KERNEL_COPY_PIPE_SIZE),
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ret = kernel_copy_unsupported(errno) ? -EOPNOTSUPP : -errno;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		while (n > 0) {
+			m = splice(pipefd[0], NULL, fdout, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				if (m < 0 && !kernel_copy_unsupported(errno)) {
+					ret = -errno;
+					break;
+				}
+				ret = kernel_copy_drain(pipefd[0], fdout, n);
+				if (!ret) {
+					*copied += n;
+					ret = -EOPNOTSUPP;
+				}
+				break;
+			}
+			*copied += m;
+			n -= m;
+		}
+		if (ret)
+			break;
+	}
+
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	if (ret < 0 && ret != -EOPNOTSUPP)
+		ERROR("Kernel copy failed: %s", strerror(-ret));
+
+	return ret;
+}
+#else
+int copy_in_kernel(int __attribute__ ((__unused__)) fdin,
+		   int __attribute__ ((__unused__)) fdout,
+		   size_t __attribute__ ((__unused__)) nbytes, size_t *copied)
+{
+	*copied = 0;
+	return -EOPNOTSUPP;
+}
+#endif
+
+/*
+ * Select the size of the buffers used in the copy pipeline.
+ * A size explicitly requested (per image) takes precedence over
+ * the global setting in the configuration file. If none is set,
+ * the size is derived from the optimal I/O size of the output,
+ * rounded up to a multiple of it not smaller than the default.
+ */
+size_t copy_buffer_size(int fdout, size_t requested)
+{
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+	struct stat st;
+	size_t optimal = 0;
+
+	if (!requested && cfg)
+		requested = cfg->copy_buffer_size;
+
+	if (requested) {
+		requested = max(requested, (size_t)BUFF_SIZE_MIN);
+		return min(requested, (size_t)BUFF_SIZE_MAX);
+	}
+
+	if (fdout < 0 || fstat(fdout, &st) < 0)
+		return BUFF_SIZE;
+
+	optimal = st.st_blksize;
+#ifdef BLKIOOPT
+	if (S_ISBLK(st.st_mode)) {
+		unsigned int ioopt = 0;
+		if (!ioctl(fdout, BLKIOOPT, &ioopt) && ioopt > 0)
+			optimal = ioopt;
+	}
+#endif
+	if (!optimal || optimal > BUFF_SIZE_AUTO_MAX)
+		return BUFF_SIZE;
+
+	return ((BUFF_SIZE + optimal - 1) / optimal) * optimal;
+}
+
+/*
+ * Controlled writeback of the output: every "writeback-chunk" bytes the
+ * last chunk is handed to the kernel for writeback, and the chunk before
+ * it is waited for and dropped from the page cache. Dirty memory stays
+ * bounded by two chunks instead of being flushed at once at the end.
+ */
+struct WritebackState {
+	int fd;			/* -1 if disabled */
+	size_t chunk;
+	off_t flushed;		/* begin of the chunk being written back */
+	off_t start;		/* begin of the range not handed to the kernel */
+	off_t pos;		/* write cursor */
+};
+
+static void writeback_start(struct WritebackState *wb, int fd)
+{
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+	struct stat st;
+
+	wb->fd = -1;
+	if (!cfg || !cfg->writeback_chunk || fd < 0)
+		return;
+	if (fstat(fd, &st) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+		return;
+	wb->pos = lseek(fd, 0, SEEK_CUR);
+	if (wb->pos < 0)
+		return;
+	wb->fd = fd;
+	wb->chunk = cfg->writeback_chunk;
+	wb->flushed = wb->start = wb->pos;
+}
+
+static int writeback_range(struct WritebackState *wb, bool wait)
+{
+	off_t len = wb->pos - wb->start;
+
+#if defined(__linux__)
+	if (len && sync_file_range(wb->fd, wb->start, len, SYNC_FILE_RANGE_WRITE))
+		goto failed;
+	if (wb->start > wb->flushed) {
+		unsigned int flags = SYNC_FILE_RANGE_WAIT_BEFORE |
+				     SYNC_FILE_RANGE_WRITE |
+				     SYNC_FILE_RANGE_WAIT_AFTER;
+
+		if (sync_file_range(wb->fd, wb->flushed, wb->start - wb->flushed, flags))
+			goto failed;
+		(void)posix_fadvise(wb->fd, wb->flushed, wb->start - wb->flushed,
+				    POSIX_FADV_DONTNEED);
+		wb->flushed = wb->start;
+	}
+	wb->start = wb->pos;
+	if (!wait)
+		return 0;
+	len = wb->start - wb->flushed;
+	if (len && sync_file_range(wb->fd, wb->flushed, len,
+				   SYNC_FILE_RANGE_WAIT_BEFORE |
+				   SYNC_FILE_RANGE_WAIT_AFTER))
+		goto failed;
+#else
+	(void)wait;
+	(void)len;
+	if (fdatasync(wb->fd))
+		goto failed;
+#endif
+	(void)posix_fadvise(wb->fd, wb->flushed, wb->pos - wb->flushed,
+			    POSIX_FADV_DONTNEED);
+	wb->flushed = wb->start = wb->pos;
+
+	return 0;
+
+failed:
+	if (errno == EIO || errno == ENOSPC) {
+		ERROR("Writeback of the output failed: %s", strerror(errno));
+		return -EIO;
+	}
+	/* the output does not support it, go on without */
+	DEBUG("Writeback disabled: %s", strerror(errno));
+	wb->fd = -1;
+	return 0;
+}
+
+static int writeback_account(struct WritebackState *wb, size_t len)
+{
+	if (wb->fd < 0)
+		return 0;
+	wb->pos += len;
+	if ((size_t)(wb->pos - wb->start) < wb->chunk)
+		return 0;
+
+	return writeback_range(wb, false);
+}
+
+/* The output is complete, wait for it and drop it from the cache */
+static int writeback_finish(struct WritebackState *wb)
+{
+	int ret;
+
+	if (wb->fd < 0)
+		return 0;
+	ret = writeback_range(wb, true);
+	wb->fd = -1;
+
+	return ret;
+}
+
+/*
+ * Buffers are page aligned, so that they can be passed
+ * to interfaces with alignment constraints
+ */
+static void *pipeline_buffer_alloc(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, getpagesize(), size))
+		return NULL;
+
+	return buf;
+}
+
 /*
  * Pipeline description
  *
@@ -192,6 +609,174 @@ int copy_write_padded(void *out, const void *buf, size_t len)
 
 typedef int (*PipelineStep)(void *state, void *buffer, size_t size);
 
+/*
+ * Optional hash tree of an artifact: the data in the SWU is split in
+ * blocks of block_size bytes (the last one can be shorter), each block
+ * has its own sha256 and the root is the sha256 of all block hashes.
+ * A corrupted block stops the copy when it is read, instead of at the
+ * end of the artifact.
+ */
+struct HashTree
+{
+	const char *fname;
+	size_t block_size;
+	unsigned int nblocks;
+	unsigned char (*hashes)[SHA256_HASH_LENGTH];
+	void *dgst;	/* hash of the current block */
+	size_t filled;
+	unsigned int block;
+};
+
+static void hash_tree_free(struct HashTree *tree)
+{
+	if (tree->dgst)
+		swupdate_HASH_cleanup(tree->dgst);
+	free(tree->hashes);
+	memset(tree, 0, sizeof(*tree));
+}
+
+/*
+ * Read the tree from the properties of the image,
+ * returns 0 if there is none, 1 if it was loaded
+ */
+static int hash_tree_load(struct img_type *img, struct HashTree *tree)
+{
+	struct dict_list *list = dict_get_list(&img->properties, "hash-tree");
+	const char *bs = dict_get_value(&img->properties, "hash-tree-block-size");
+	const char *root = dict_get_value(&img->properties, "hash-tree-root");
+	unsigned char roothash[SHA256_HASH_LENGTH], md_value[64];
+	struct dict_list_elem *elem;
+	unsigned int md_len, i;
+	void *dgst;
+	int ret = -EINVAL;
+
+	memset(tree, 0, sizeof(*tree));
+	if (!list || !LIST_FIRST(list))
+		return 0;
+
+	tree->fname = img->fname;
+	tree->block_size = bs ? ustrtoull(bs, NULL, 0) : 0;
+	if (!tree->block_size || !root || ascii_to_hash(roothash, root) < 0) {
+		ERROR("%s: hash-tree needs hash-tree-block-size and hash-tree-root",
+			img->fname);
+		return -EINVAL;
+	}
+
+	LIST_FOREACH(elem, list, next)
+		tree->nblocks++;
+	if (tree->nblocks != (img->size + tree->block_size - 1) / tree->block_size) {
+		ERROR("%s: %u block hashes for %llu bytes in blocks of %zu",
+			img->fname, tree->nblocks, (unsigned long long)img->size,
+			tree->block_size);
+		return -EINVAL;
+	}
+	tree->hashes = calloc(tree->nblocks, SHA256_HASH_LENGTH);
+	if (!tree->hashes)
+		return -ENOMEM;
+
+	/* the list keeps the last value first */
+	i = tree->nblocks;
+	LIST_FOREACH(elem, list, next) {
+		if (ascii_to_hash(tree->hashes[--i], elem->value) < 0) {
+			ERROR("%s: invalid block hash %s", img->fname, elem->value);
+			goto out;
+		}
+	}
+
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst) {
+		ERROR("%s: hash-tree cannot be verified", img->fname);
+		goto out;
+	}
+	ret = swupdate_HASH_update(dgst, tree->hashes[0],
+				   tree->nblocks * SHA256_HASH_LENGTH);
+	if (!ret)
+		ret = swupdate_HASH_final(dgst, md_value, &md_len);
+	swupdate_HASH_cleanup(dgst);
+	if (ret < 0 || md_len != SHA256_HASH_LENGTH ||
+	    swupdate_HASH_compare(roothash, md_value)) {
+		ERROR("%s: block hashes do not match hash-tree-root", img->fname);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	return 1;
+
+out:
+	hash_tree_free(tree);
+	return ret < 0 ? ret : -EINVAL;
+}
+
+static int hash_tree_end_block(struct HashTree *tree)
+{
+	unsigned char md_value[64];
+	unsigned int md_len;
+	int ret;
+
+	if (tree->block >= tree->nblocks) {
+		ERROR("%s: more data than block hashes", tree->fname);
+		return -EFAULT;
+	}
+	ret = swupdate_HASH_final(tree->dgst, md_value, &md_len);
+	swupdate_HASH_cleanup(tree->dgst);
+	tree->dgst = NULL;
+	if (ret < 0 || md_len != SHA256_HASH_LENGTH ||
+	    swupdate_HASH_compare(tree->hashes[tree->block], md_value)) {
+		ERROR("%s: block %u (offset %llu) is corrupted, aborting",
+			tree->fname, tree->block,
+			(unsigned long long)tree->block * tree->block_size);
+		return -EFAULT;
+	}
+	tree->block++;
+	tree->filled = 0;
+
+	return 0;
+}
+
+static int hash_tree_update(struct HashTree *tree, const unsigned char *buf, size_t len)
+{
+	size_t n;
+	int ret;
+
+	while (len) {
+		if (!tree->dgst) {
+			tree->dgst = swupdate_HASH_init(SHA_DEFAULT);
+			if (!tree->dgst)
+				return -EFAULT;
+		}
+		n = min(len, tree->block_size - tree->filled);
+		if (swupdate_HASH_update(tree->dgst, buf, n) < 0)
+			return -EFAULT;
+		tree->filled += n;
+		buf += n;
+		len -= n;
+		if (tree->filled == tree->block_size) {
+			ret = hash_tree_end_block(tree);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int hash_tree_finish(struct HashTree *tree)
+{
+	int ret;
+
+	if (tree->filled) {
+		ret = hash_tree_end_block(tree);
+		if (ret)
+			return ret;
+	}
+	if (tree->block != tree->nblocks) {
+		ERROR("%s: data shorter than the hash tree", tree->fname);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
 struct InputState
 {
 	int fdin;
@@ -201,52 +786,85 @@ struct InputState
 	size_t nbytes;
 	unsigned long *offs;
 	void *dgst;	/* use a private context for HASH */
+	bool sum;	/* the cpio checksum is requested */
 	uint32_t checksum;
+	struct HashTree *tree;
+	struct uring_reader *ring;	/* reads in flight, if any */
 };
 
-static int input_step(void *state, void *buffer, size_t size)
+/*
+ * The bodies of the steps are inlined with the source of the input,
+ * the options and the upstream step known at build time for the
+ * specialised steps below: the generic steps pass the runtime values.
+ */
+#define PIPELINE_INLINE	static inline __attribute__((always_inline))
+
+PIPELINE_INLINE int input_read(struct InputState *s, void *buffer, size_t size,
+			       input_type_t source, bool hashed, bool with_tree)
 {
-	struct InputState *s = (struct InputState *)state;
 	int ret = 0;
 	if (size >= s->nbytes) {
 		size = s->nbytes;
 	}
-	switch (s->source) {
+	switch (source) {
 	case INPUT_FROM_FD:
-		ret = fill_buffer(s->fdin, buffer, size, s->offs, &s->checksum, s->dgst);
+		ret = fill_buffer_from(s->fdin, s->ring, buffer, size, s->offs,
+				       s->sum ? &s->checksum : NULL,
+				       hashed ? s->dgst : NULL);
 		if (ret < 0) {
 			return ret;
 		}
 		break;
 	case INPUT_FROM_MEMORY:
 		memcpy(buffer, &s->inbuf[s->pos], size);
-		if (s->dgst) {
+		if (hashed) {
+			uint64_t start = metrics_now();
+
 			if (swupdate_HASH_update(s->dgst, &s->inbuf[s->pos], size) < 0)
 				return -EFAULT;
+			metrics_stage(METRICS_STAGE_HASH, size, start);
 		}
 		ret = size;
 		s->pos += size;
 		break;
 	}
-	s->nbytes -= ret;
+	if (with_tree && ret > 0) {
+		uint64_t start = metrics_now();
+		int err = hash_tree_update(s->tree, buffer, ret);
+
+		if (err)
+			return err;
+		metrics_stage(METRICS_STAGE_HASH, ret, start);
+	}
+	SWU_PROBE2(copy_chunk, PROBE_COPY_INPUT, ret);
+	/* read by the consumer for the progress when the stages are threaded */
+	__atomic_store_n(&s->nbytes, s->nbytes - ret, __ATOMIC_RELAXED);
 	return ret;
 }
 
+static int input_step(void *state, void *buffer, size_t size)
+{
+	struct InputState *s = (struct InputState *)state;
+
+	return input_read(s, buffer, size, s->source, s->dgst != NULL, s->tree != NULL);
+}
+
 struct DecryptState
 {
 	PipelineStep upstream_step;
 	void *upstream_state;
 
 	void *dcrypt;	/* use a private context for decryption */
-	uint8_t input[BUFF_SIZE];
-	uint8_t output[BUFF_SIZE + AES_BLK_SIZE];
+	uint8_t *input;
+	uint8_t *output;	/* bufsize + AES_BLK_SIZE */
+	size_t bufsize;
 	int outlen;
 	bool eof;
 };
 
-static int decrypt_step(void *state, void *buffer, size_t size)
+PIPELINE_INLINE int decrypt_read(struct DecryptState *s, void *buffer, size_t size,
+				 PipelineStep upstream_step)
 {
-	struct DecryptState *s = (struct DecryptState *)state;
 	int ret;
 	int inlen;
 
@@ -260,7 +878,7 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 		return size;
 	}
 
-	ret = s->upstream_step(s->upstream_state, s->input, sizeof s->input);
+	ret = upstream_step(s->upstream_state, s->input, s->bufsize);
 	if (ret < 0) {
 		return ret;
 	}
@@ -268,6 +886,8 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 	inlen = ret;
 
 	if (!s->eof) {
+		uint64_t start = metrics_now();
+
 		if (inlen != 0) {
 			ret = swupdate_DECRYPT_update(s->dcrypt,
 				s->output, &s->outlen, s->input, inlen);
@@ -281,6 +901,8 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 				s->output, &s->outlen);
 			s->eof = true;
 		}
+		metrics_stage(METRICS_STAGE_DECRYPT, inlen, start);
+		SWU_PROBE2(copy_chunk, PROBE_COPY_DECRYPT, inlen);
 		if (ret < 0) {
 			return ret;
 		}
@@ -299,14 +921,22 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 	return 0;
 }
 
-#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD)
+static int decrypt_step(void *state, void *buffer, size_t size)
+{
+	struct DecryptState *s = (struct DecryptState *)state;
+
+	return decrypt_read(s, buffer, size, s->upstream_step);
+}
+
+#ifdef DECOMPRESS_STEPS
 typedef int (*DecompressStep)(void *state, void *buffer, size_t size);
 
 struct DecompressState {
 	PipelineStep upstream_step;
 	void *upstream_state;
 	void *impl_state;
-	uint8_t input[BUFF_SIZE];
+	uint8_t *input;
+	size_t bufsize;
 	bool eof;
 };
 #endif
@@ -318,9 +948,9 @@ struct GunzipState {
 	bool initialized;
 };
 
-static int gunzip_step(void *state, void *buffer, size_t size)
+PIPELINE_INLINE int gunzip_read(struct DecompressState *ds, void *buffer, size_t size,
+				PipelineStep upstream_step)
 {
-	struct DecompressState *ds = (struct DecompressState *)state;
 	struct GunzipState *s = (struct GunzipState *)ds->impl_state;
 	int ret;
 	int outlen = 0;
@@ -329,7 +959,7 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 	s->strm.avail_out = size;
 	while (outlen == 0) {
 		if (s->strm.avail_in == 0) {
-			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
+			ret = upstream_step(ds->upstream_state, ds->input, ds->bufsize);
 			if (ret < 0) {
 				return ret;
 			} else if (ret == 0) {
@@ -342,7 +972,11 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 			break;
 		}
 
+		uint64_t start = metrics_now();
+		unsigned int avail = s->strm.avail_out;
+
 		ret = inflate(&s->strm, Z_NO_FLUSH);
+		metrics_stage(METRICS_STAGE_DECOMPRESS, avail - s->strm.avail_out, start);
 		outlen = size - s->strm.avail_out;
 		if (ret == Z_STREAM_END) {
 			ds->eof = true;
@@ -356,60 +990,1112 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 	return outlen;
 }
 
+static int gunzip_step(void *state, void *buffer, size_t size)
+{
+	struct DecompressState *ds = (struct DecompressState *)state;
+
+	return gunzip_read(ds, buffer, size, ds->upstream_step);
+}
+
 #endif
 
-#ifdef CONFIG_ZSTD
+#ifdef CONFIG_LZ4
 
-struct ZstdState {
-	ZSTD_DStream* dctx;
-	ZSTD_inBuffer input_view;
+struct Lz4State {
+	LZ4F_dctx *dctx;
+	const uint8_t *next_in;
+	size_t avail_in;
+	size_t hint;		/* 0 at the end of a frame */
 };
 
-static int zstd_step(void* state, void* buffer, size_t size)
+static int lz4_step(void *state, void *buffer, size_t size)
+{
+	struct DecompressState *ds = (struct DecompressState *)state;
+	struct Lz4State *s = (struct Lz4State *)ds->impl_state;
+	size_t dstsize, srcsize;
+	int ret;
+
+	do {
+		if (s->avail_in == 0 && !ds->eof) {
+			ret = ds->upstream_step(ds->upstream_state, ds->input, ds->bufsize);
+			if (ret < 0) {
+				return ret;
+			} else if (ret == 0) {
+				ds->eof = true;
+			}
+			s->avail_in = ret;
+			s->next_in = ds->input;
+		}
+
+		/*
+		 * A complete frame has no output left, afterwards the
+		 * decoder just waits for the header of the next frame
+		 */
+		if (ds->eof && s->avail_in == 0 && s->hint == 0)
+			return 0;
+
+		uint64_t start = metrics_now();
+
+		dstsize = size;
+		srcsize = s->avail_in;
+		s->hint = LZ4F_decompress(s->dctx, buffer, &dstsize, s->next_in,
+					  &srcsize, NULL);
+		metrics_stage(METRICS_STAGE_DECOMPRESS, dstsize, start);
+		if (LZ4F_isError(s->hint)) {
+			ERROR("LZ4F_decompress failed: %s", LZ4F_getErrorName(s->hint));
+			return -1;
+		}
+		s->next_in += srcsize;
+		s->avail_in -= srcsize;
+
+		if (!dstsize && ds->eof && s->avail_in == 0) {
+			ERROR("lz4 stream is truncated");
+			return -1;
+		}
+	} while (dstsize == 0);
+
+	return dstsize;
+}
+
+#endif
+
+#ifdef CONFIG_XZ
+
+struct XzState {
+	lzma_stream strm;
+	bool initialized;
+	bool done;
+};
+
+static int xz_step(void *state, void *buffer, size_t size)
+{
+	struct DecompressState *ds = (struct DecompressState *)state;
+	struct XzState *s = (struct XzState *)ds->impl_state;
+	lzma_ret lret;
+	int ret;
+
+	s->strm.next_out = buffer;
+	s->strm.avail_out = size;
+	while (!s->done && s->strm.avail_out == size) {
+		if (s->strm.avail_in == 0 && !ds->eof) {
+			ret = ds->upstream_step(ds->upstream_state, ds->input, ds->bufsize);
+			if (ret < 0) {
+				return ret;
+			} else if (ret == 0) {
+				ds->eof = true;
+			}
+			s->strm.avail_in = ret;
+			s->strm.next_in = ds->input;
+		}
+
+		uint64_t start = metrics_now();
+
+		/*
+		 * Concatenated streams are accepted, the decoder knows
+		 * that the input is over only with LZMA_FINISH
+		 */
+		lret = lzma_code(&s->strm, ds->eof ? LZMA_FINISH : LZMA_RUN);
+		metrics_stage(METRICS_STAGE_DECOMPRESS, size - s->strm.avail_out, start);
+		if (lret == LZMA_STREAM_END) {
+			s->done = true;
+		} else if (lret != LZMA_OK) {
+			ERROR("lzma_code failed (returned %d)", lret);
+			return -1;
+		}
+	}
+
+	return size - s->strm.avail_out;
+}
+
+#endif
+
+#ifdef CONFIG_ZSTD
+
+struct ZstdState {
+	ZSTD_DStream* dctx;
+	ZSTD_inBuffer input_view;
+	const ZSTD_DDict *ddict;
+};
+
+PIPELINE_INLINE int zstd_decode_from(struct DecompressState *ds, struct ZstdState *s,
+				     void *buffer, size_t size, PipelineStep upstream_step)
+{
+	size_t decompress_ret;
+	int ret;
+	ZSTD_outBuffer output = { buffer, size, 0 };
+
+	do {
+		if (s->input_view.pos == s->input_view.size) {
+			ret = upstream_step(ds->upstream_state, ds->input, ds->bufsize);
+			if (ret < 0) {
+				return ret;
+			} else if (ret == 0) {
+				ds->eof = true;
+			}
+			s->input_view.src = ds->input;
+			s->input_view.size = ret;
+			s->input_view.pos = 0;
+		}
+
+		do {
+			uint64_t start = metrics_now();
+			size_t pos = output.pos;
+
+			decompress_ret = ZSTD_decompressStream(s->dctx, &output, &s->input_view);
+			metrics_stage(METRICS_STAGE_DECOMPRESS, output.pos - pos, start);
+
+			if (ZSTD_isError(decompress_ret)) {
+				ERROR("ZSTD_decompressStream failed: %s",
+				      ZSTD_getErrorName(decompress_ret));
+				return -1;
+			}
+
+			if (output.pos == output.size) {
+				break;
+			}
+		} while (s->input_view.pos < s->input_view.size);
+	} while (output.pos == 0 && !ds->eof);
+
+	return output.pos;
+}
+
+static int zstd_decode(struct DecompressState *ds, struct ZstdState *s,
+		       void *buffer, size_t size)
+{
+	return zstd_decode_from(ds, s, buffer, size, ds->upstream_step);
+}
+
+static int zstd_step(void *state, void *buffer, size_t size)
+{
+	struct DecompressState *ds = (struct DecompressState *)state;
+
+	return zstd_decode(ds, (struct ZstdState *)ds->impl_state, buffer, size);
+}
+
+#endif
+
+/*
+ * Specialised steps
+ *
+ * Any combination of steps can be chained, so each step calls its
+ * upstream step through a pointer and checks the options of the copy
+ * for each buffer. The most common shapes of a pipeline running in the
+ * thread of the caller have their own steps: the upstream step is
+ * called directly and the options are constant, so that the compiler
+ * merges the chain into a single loop.
+ */
+#define INPUT_STEP(name, source, hashed)					\
+static int name(void *state, void *buffer, size_t size)			\
+{									\
+	return input_read((struct InputState *)state, buffer, size,	\
+			  source, hashed, false);			\
+}
+
+#define DECRYPT_STEP(name, upstream)					\
+static int name(void *state, void *buffer, size_t size)			\
+{									\
+	return decrypt_read((struct DecryptState *)state, buffer, size,	\
+			    upstream);					\
+}
+
+#define GUNZIP_STEP(name, upstream)					\
+static int name(void *state, void *buffer, size_t size)			\
+{									\
+	return gunzip_read((struct DecompressState *)state, buffer,	\
+			   size, upstream);				\
+}
+
+#define ZSTD_STEP(name, upstream)					\
+static int name(void *state, void *buffer, size_t size)			\
+{									\
+	struct DecompressState *ds = (struct DecompressState *)state;	\
+									\
+	return zstd_decode_from(ds, (struct ZstdState *)ds->impl_state,	\
+				buffer, size, upstream);		\
+}
+
+INPUT_STEP(input_fd_step, INPUT_FROM_FD, false)
+INPUT_STEP(input_mem_step, INPUT_FROM_MEMORY, false)
+INPUT_STEP(input_fd_hash_step, INPUT_FROM_FD, true)
+INPUT_STEP(input_mem_hash_step, INPUT_FROM_MEMORY, true)
+#ifdef CONFIG_GUNZIP
+GUNZIP_STEP(gunzip_fd_hash_step, input_fd_hash_step)
+GUNZIP_STEP(gunzip_mem_hash_step, input_mem_hash_step)
+#endif
+#ifdef CONFIG_ZSTD
+DECRYPT_STEP(decrypt_fd_hash_step, input_fd_hash_step)
+DECRYPT_STEP(decrypt_mem_hash_step, input_mem_hash_step)
+ZSTD_STEP(zstd_fd_hash_step, input_fd_hash_step)
+ZSTD_STEP(zstd_mem_hash_step, input_mem_hash_step)
+ZSTD_STEP(zstd_aes_fd_hash_step, decrypt_fd_hash_step)
+ZSTD_STEP(zstd_aes_mem_hash_step, decrypt_mem_hash_step)
+#endif
+
+struct PipelineShape {
+	PipelineStep decompress;	/* generic step it replaces, NULL if none */
+	bool encrypted;
+	bool hashed;
+	PipelineStep step[2];		/* indexed by input_type_t */
+};
+
+static const struct PipelineShape pipeline_shapes[] = {
+	{ NULL, false, false, { input_fd_step, input_mem_step } },
+	{ NULL, false, true, { input_fd_hash_step, input_mem_hash_step } },
+#ifdef CONFIG_GUNZIP
+	{ gunzip_step, false, true, { gunzip_fd_hash_step, gunzip_mem_hash_step } },
+#endif
+#ifdef CONFIG_ZSTD
+	{ zstd_step, false, true, { zstd_fd_hash_step, zstd_mem_hash_step } },
+	{ zstd_step, true, true, { zstd_aes_fd_hash_step, zstd_aes_mem_hash_step } },
+#endif
+};
+
+/*
+ * Returns the specialised last step of the pipeline, or NULL if
+ * the generic steps must be used
+ */
+static PipelineStep pipeline_specialize(PipelineStep decompress, bool encrypted,
+					bool hashed, input_type_t source)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pipeline_shapes); i++) {
+		const struct PipelineShape *shape = &pipeline_shapes[i];
+
+		if (shape->decompress == decompress && shape->encrypted == encrypted &&
+		    shape->hashed == hashed)
+			return shape->step[source];
+	}
+
+	return NULL;
+}
+
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+/*
+ * Threaded step
+ *
+ * A threaded step runs its upstream step in a dedicated worker thread.
+ * The worker fills a ring of buffers and the downstream step consumes
+ * them, so that reading / hashing, decryption, decompression and the
+ * final write callback can run concurrently on different cores.
+ * The ring is bounded: the worker blocks when all slots are filled.
+ */
+#define PIPELINE_RING_SLOTS	4
+#define PIPELINE_MAX_STAGES	3	/* input, decrypt, decompress */
+
+struct PipelineSlot {
+	uint8_t *buf;
+	int len;
+};
+
+struct ThreadedState {
+	PipelineStep upstream_step;
+	void *upstream_state;
+
+	pthread_t worker;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	struct PipelineSlot slot[PIPELINE_RING_SLOTS];
+	size_t bufsize;
+	unsigned int head;	/* next slot to be consumed */
+	unsigned int count;	/* number of filled slots */
+	size_t pos;		/* consumed bytes in the head slot */
+	bool done;		/* worker has produced EOF or an error */
+	bool abort;		/* consumer is not interested anymore */
+};
+
+static void *threaded_worker(void *data)
+{
+	struct ThreadedState *s = (struct ThreadedState *)data;
+	struct PipelineSlot *slot;
+	int ret;
+
+	do {
+		pthread_mutex_lock(&s->lock);
+		while (s->count == PIPELINE_RING_SLOTS && !s->abort)
+			pthread_cond_wait(&s->drained, &s->lock);
+		if (s->abort) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		slot = &s->slot[(s->head + s->count) % PIPELINE_RING_SLOTS];
+		pthread_mutex_unlock(&s->lock);
+
+		/*
+		 * The slot is not visible to the consumer until count
+		 * is incremented, so it can be filled without the lock
+		 */
+		ret = s->upstream_step(s->upstream_state, slot->buf, s->bufsize);
+
+		pthread_mutex_lock(&s->lock);
+		slot->len = ret;
+		s->count++;
+		if (ret <= 0)
+			s->done = true;
+		pthread_cond_signal(&s->filled);
+		pthread_mutex_unlock(&s->lock);
+	} while (ret > 0);
+
+	return NULL;
+}
+
+static int threaded_step(void *state, void *buffer, size_t size)
+{
+	struct ThreadedState *s = (struct ThreadedState *)state;
+	struct PipelineSlot *slot;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->count == 0)
+		pthread_cond_wait(&s->filled, &s->lock);
+	slot = &s->slot[s->head];
+	pthread_mutex_unlock(&s->lock);
+
+	/*
+	 * EOF and errors are sticky: the last slot is never released
+	 * and returned again if the consumer asks for more data
+	 */
+	if (slot->len <= 0)
+		return slot->len;
+
+	ret = min(size, slot->len - s->pos);
+	memcpy(buffer, slot->buf + s->pos, ret);
+	s->pos += ret;
+
+	if (s->pos == (size_t)slot->len) {
+		s->pos = 0;
+		pthread_mutex_lock(&s->lock);
+		s->head = (s->head + 1) % PIPELINE_RING_SLOTS;
+		s->count--;
+		pthread_cond_signal(&s->drained);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return ret;
+}
+
+static int threaded_start(struct ThreadedState *s, PipelineStep upstream_step,
+			  void *upstream_state, size_t bufsize)
+{
+	unsigned int i;
+
+	for (i = 0; i < PIPELINE_RING_SLOTS; i++) {
+		s->slot[i].buf = pipeline_buffer_alloc(bufsize);
+		if (!s->slot[i].buf)
+			return -ENOMEM;
+	}
+	s->bufsize = bufsize;
+	s->upstream_step = upstream_step;
+	s->upstream_state = upstream_state;
+	s->head = s->count = 0;
+	s->pos = 0;
+	s->done = s->abort = false;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->filled, NULL);
+	pthread_cond_init(&s->drained, NULL);
+
+	if (start_worker_thread(&s->worker, threaded_worker, s)) {
+		ERROR("Cannot start pipeline thread");
+		return -EFAULT;
+	}
+	s->started = true;
+
+	return 0;
+}
+
+/*
+ * Stop the worker and wait for its termination. The upstream state
+ * can be accessed again by the caller only after this returns.
+ */
+static void threaded_stop(struct ThreadedState *s)
+{
+	unsigned int i;
+
+	if (s->started) {
+		pthread_mutex_lock(&s->lock);
+		s->abort = true;
+		pthread_cond_signal(&s->drained);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->worker, NULL);
+
+		pthread_cond_destroy(&s->drained);
+		pthread_cond_destroy(&s->filled);
+		pthread_mutex_destroy(&s->lock);
+		s->started = false;
+	}
+
+	for (i = 0; i < PIPELINE_RING_SLOTS; i++) {
+		free(s->slot[i].buf);
+		s->slot[i].buf = NULL;
+	}
+}
+
+/*
+ * Insert a threaded step downstream of the given step.
+ * The chain must be stopped from the tail to the head, because
+ * an upstream worker can block until the downstream one drains it.
+ */
+static int threaded_chain(struct ThreadedState *s, PipelineStep *step, void **state,
+			  size_t bufsize)
+{
+	int ret = threaded_start(s, *step, *state, bufsize);
+
+	if (ret)
+		return ret;
+	*step = &threaded_step;
+	*state = s;
+
+	return 0;
+}
+
+static void threaded_stop_all(struct ThreadedState *threads, unsigned int nthreads)
+{
+	if (!threads)
+		return;
+	while (nthreads > 0)
+		threaded_stop(&threads[--nthreads]);
+}
+#endif
+
+#if defined(CONFIG_ZSTD) && defined(CONFIG_CPIO_PIPELINE_THREADS)
+/*
+ * Parallel zstd decoder
+ *
+ * zstd frames are independent: an artifact made of several frames
+ * (pzstd, seekable zstd, concatenated zstd files) is split at the
+ * frame boundaries and the frames are decoded by a pool of workers,
+ * while the output is returned in order. Frames are buffered in
+ * memory, so a frame that exceeds the limits below makes the decoder
+ * continue sequentially with zstd_decode(), as for a single frame.
+ */
+#define ZSTD_MT_MAX_WORKERS	8
+#define ZSTD_MT_MAX_FRAME	(8 * 1024 * 1024)	/* compressed frame */
+#define ZSTD_MT_MAX_OUTPUT	(32 * 1024 * 1024)	/* decompressed frame */
+#define ZSTD_MT_SLOTS		(ZSTD_MT_MAX_WORKERS + 2)
+
+enum zstd_job_state {
+	ZSTD_JOB_QUEUED,
+	ZSTD_JOB_RUNNING,
+	ZSTD_JOB_DONE,
+	ZSTD_JOB_STREAM		/* output too large, decoded by the consumer */
+};
+
+struct ZstdJob {
+	enum zstd_job_state state;
+	int err;
+	uint8_t *in;
+	size_t inlen, insize;
+	uint8_t *out;
+	size_t outlen, outsize;
+};
+
+struct ZstdMtState;
+
+struct ZstdWorker {
+	struct ZstdMtState *mt;
+	ZSTD_DCtx *dctx;
+	pthread_t thread;
+};
+
+struct ZstdMtState {
+	struct ZstdState *seq;	/* sequential decoder, NULL if not initialized */
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	struct ZstdWorker worker[ZSTD_MT_MAX_WORKERS];
+	unsigned int nworkers;
+	unsigned int started;
+	struct ZstdJob job[ZSTD_MT_SLOTS];
+	unsigned int nslots;
+	unsigned int head;	/* next job to be returned */
+	unsigned int count;	/* queued jobs */
+	size_t pos;		/* consumed output of the head job */
+	ZSTD_inBuffer view;	/* input of the head job in stream mode */
+	uint8_t *pending;	/* input not yet split into frames */
+	size_t pendlen, pendsize;
+	bool sequential;
+	bool stop;
+};
+
+/*
+ * The buffers are charged to the memory budget, -ENOBUFS means
+ * that it is exhausted and the frame should be decoded sequentially
+ */
+static int zstd_mt_reserve(uint8_t **buf, size_t *size, size_t need)
+{
+	uint8_t *p;
+	size_t newsize;
+
+	if (*size >= need)
+		return 0;
+	newsize = max(need, 2 * *size);
+	if (!membudget_reserve(newsize - *size)) {
+		newsize = need;
+		if (!membudget_reserve(newsize - *size))
+			return -ENOBUFS;
+	}
+	p = realloc(*buf, newsize);
+	if (!p) {
+		membudget_release(newsize - *size);
+		return -ENOMEM;
+	}
+	*buf = p;
+	*size = newsize;
+
+	return 0;
+}
+
+static int zstd_mt_decode(ZSTD_DCtx *dctx, struct ZstdJob *j)
+{
+	unsigned long long fcs = ZSTD_getFrameContentSize(j->in, j->inlen);
+	ZSTD_inBuffer in = { j->in, j->inlen, 0 };
+	ZSTD_outBuffer out;
+	size_t ret;
+
+	j->outlen = 0;
+	if (fcs != ZSTD_CONTENTSIZE_UNKNOWN) {
+		/* the dispatcher has already checked the size */
+		if (zstd_mt_reserve(&j->out, &j->outsize, fcs))
+			return -EFBIG;
+		ret = ZSTD_decompressDCtx(dctx, j->out, fcs, j->in, j->inlen);
+		if (ZSTD_isError(ret)) {
+			ERROR("ZSTD_decompressDCtx failed: %s", ZSTD_getErrorName(ret));
+			return -EFAULT;
+		}
+		j->outlen = ret;
+		return 0;
+	}
+
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	do {
+		if (j->outlen == j->outsize) {
+			if (j->outsize >= ZSTD_MT_MAX_OUTPUT)
+				return -EFBIG;
+			if (zstd_mt_reserve(&j->out, &j->outsize,
+					    min(j->outsize + ZSTD_DStreamOutSize(),
+						ZSTD_MT_MAX_OUTPUT)))
+				return -EFBIG;
+		}
+		out.dst = j->out;
+		out.size = j->outsize;
+		out.pos = j->outlen;
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret)) {
+			ERROR("ZSTD_decompressStream failed: %s", ZSTD_getErrorName(ret));
+			return -EFAULT;
+		}
+		j->outlen = out.pos;
+		if (ret && in.pos == in.size && out.pos < out.size) {
+			ERROR("zstd frame is truncated");
+			return -EFAULT;
+		}
+	} while (ret);
+
+	return 0;
+}
+
+static void *zstd_mt_worker(void *data)
+{
+	struct ZstdWorker *w = (struct ZstdWorker *)data;
+	struct ZstdMtState *s = w->mt;
+	struct ZstdJob *j;
+	unsigned int i;
+	uint64_t start;
+	int err;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop) {
+		j = NULL;
+		for (i = 0; i < s->count; i++) {
+			if (s->job[(s->head + i) % s->nslots].state == ZSTD_JOB_QUEUED) {
+				j = &s->job[(s->head + i) % s->nslots];
+				break;
+			}
+		}
+		if (!j) {
+			pthread_cond_wait(&s->queued, &s->lock);
+			continue;
+		}
+		j->state = ZSTD_JOB_RUNNING;
+		pthread_mutex_unlock(&s->lock);
+
+		start = metrics_now();
+		err = zstd_mt_decode(w->dctx, j);
+		metrics_stage(METRICS_STAGE_DECOMPRESS, j->outlen, start);
+
+		pthread_mutex_lock(&s->lock);
+		j->err = err;
+		j->state = ZSTD_JOB_DONE;
+		pthread_cond_signal(&s->done);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static int zstd_mt_start(struct ZstdMtState *s)
+{
+	while (s->started < s->nworkers) {
+		struct ZstdWorker *w = &s->worker[s->started];
+
+		w->mt = s;
+		w->dctx = ZSTD_createDCtx();
+		if (!w->dctx) {
+			ERROR("ZSTD_createDCtx failed");
+			return -ENOMEM;
+		}
+		if (s->seq->ddict &&
+		    ZSTD_isError(ZSTD_DCtx_refDDict(w->dctx, s->seq->ddict))) {
+			ZSTD_freeDCtx(w->dctx);
+			w->dctx = NULL;
+			ERROR("ZSTD_DCtx_refDDict failed");
+			return -EFAULT;
+		}
+		if (start_worker_thread(&w->thread, zstd_mt_worker, w)) {
+			ZSTD_freeDCtx(w->dctx);
+			w->dctx = NULL;
+			ERROR("Cannot start zstd decoder thread");
+			return -EFAULT;
+		}
+		s->started++;
+	}
+
+	return 0;
+}
+
+static void zstd_mt_set_state(struct ZstdMtState *s, struct ZstdJob *j,
+			      enum zstd_job_state state)
+{
+	pthread_mutex_lock(&s->lock);
+	j->state = state;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * The rest of the input, starting with the pending bytes,
+ * is passed to the sequential decoder
+ */
+static void zstd_mt_sequential(struct ZstdMtState *s)
+{
+	s->sequential = true;
+	s->seq->input_view.src = s->pending;
+	s->seq->input_view.size = s->pendlen;
+	s->seq->input_view.pos = 0;
+}
+
+static int zstd_mt_read(struct DecompressState *ds, struct ZstdMtState *s)
+{
+	int ret;
+
+	ret = zstd_mt_reserve(&s->pending, &s->pendsize, s->pendlen + ds->bufsize);
+	if (ret)
+		return ret;
+	ret = ds->upstream_step(ds->upstream_state, s->pending + s->pendlen,
+				ds->bufsize);
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		ds->eof = true;
+	s->pendlen += ret;
+
+	return 0;
+}
+
+/*
+ * Split the input into frames and queue them until all slots are used,
+ * the input is over or a frame cannot be decoded in parallel.
+ */
+static int zstd_mt_fill(struct DecompressState *ds, struct ZstdMtState *s)
+{
+	unsigned long long fcs;
+	struct ZstdJob *j;
+	uint8_t *tmp;
+	size_t len, tmpsize;
+	uint32_t magic;
+	int ret;
+
+	while (!s->sequential && s->count < s->nslots) {
+		if (ds->eof && !s->pendlen)
+			return 0;
+
+		len = ZSTD_findFrameCompressedSize(s->pending, s->pendlen);
+		if (ZSTD_isError(len)) {
+			/*
+			 * Anything but an incomplete frame is reported
+			 * by the sequential decoder
+			 */
+			if (ZSTD_getErrorCode(len) != ZSTD_error_srcSize_wrong) {
+				zstd_mt_sequential(s);
+				break;
+			}
+			if (ds->eof) {
+				ERROR("zstd frame is truncated");
+				return -EFAULT;
+			}
+			fcs = ZSTD_getFrameContentSize(s->pending, s->pendlen);
+			if (s->pendlen >= ZSTD_MT_MAX_FRAME ||
+			    (fcs != ZSTD_CONTENTSIZE_UNKNOWN &&
+			     fcs != ZSTD_CONTENTSIZE_ERROR && fcs > ZSTD_MT_MAX_OUTPUT)) {
+				zstd_mt_sequential(s);
+				break;
+			}
+			ret = zstd_mt_read(ds, s);
+			if (ret == -ENOBUFS) {
+				zstd_mt_sequential(s);
+				break;
+			}
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		magic = s->pending[0] | s->pending[1] << 8 |
+			s->pending[2] << 16 | (uint32_t)s->pending[3] << 24;
+		if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START) {
+			s->pendlen -= len;
+			memmove(s->pending, s->pending + len, s->pendlen);
+			continue;
+		}
+
+		fcs = ZSTD_getFrameContentSize(s->pending, len);
+		if (fcs == ZSTD_CONTENTSIZE_ERROR ||
+		    (fcs != ZSTD_CONTENTSIZE_UNKNOWN && fcs > ZSTD_MT_MAX_OUTPUT)) {
+			zstd_mt_sequential(s);
+			break;
+		}
+
+		ret = zstd_mt_start(s);
+		if (ret < 0)
+			return ret;
+
+		/*
+		 * The job takes over the pending buffer, the bytes after
+		 * the frame are moved into the previous buffer of the job
+		 */
+		j = &s->job[(s->head + s->count) % s->nslots];
+		tmp = j->in;
+		tmpsize = j->insize;
+		ret = zstd_mt_reserve(&tmp, &tmpsize, s->pendlen - len + 1);
+		if (ret == -ENOBUFS) {
+			zstd_mt_sequential(s);
+			break;
+		}
+		if (ret < 0)
+			return ret;
+		memcpy(tmp, s->pending + len, s->pendlen - len);
+		j->in = s->pending;
+		j->insize = s->pendsize;
+		j->inlen = len;
+		s->pending = tmp;
+		s->pendsize = tmpsize;
+		s->pendlen -= len;
+
+		pthread_mutex_lock(&s->lock);
+		j->state = ZSTD_JOB_QUEUED;
+		j->err = 0;
+		s->count++;
+		pthread_cond_signal(&s->queued);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return 0;
+}
+
+/* Decode the frame of the head job with the sequential decoder */
+static int zstd_mt_stream(struct ZstdMtState *s, struct ZstdJob *j,
+			  void *buffer, size_t size)
+{
+	ZSTD_outBuffer out = { buffer, size, 0 };
+	size_t ret;
+
+	while (out.pos < out.size) {
+		ret = ZSTD_decompressStream(s->seq->dctx, &out, &s->view);
+		if (ZSTD_isError(ret)) {
+			ERROR("ZSTD_decompressStream failed: %s", ZSTD_getErrorName(ret));
+			return -EFAULT;
+		}
+		if (!ret) {
+			j->outlen = 0;
+			zstd_mt_set_state(s, j, ZSTD_JOB_DONE);
+			break;
+		}
+		if (s->view.pos == s->view.size && out.pos < out.size) {
+			ERROR("zstd frame is truncated");
+			return -EFAULT;
+		}
+	}
+
+	return out.pos;
+}
+
+static int zstd_mt_step(void *state, void *buffer, size_t size)
+{
+	struct DecompressState *ds = (struct DecompressState *)state;
+	struct ZstdMtState *s = (struct ZstdMtState *)ds->impl_state;
+	struct ZstdJob *j;
+	size_t n;
+	int ret;
+
+	ret = zstd_mt_fill(ds, s);
+	if (ret < 0)
+		return ret;
+
+	while (s->count) {
+		j = &s->job[s->head];
+		if (j->state == ZSTD_JOB_STREAM) {
+			ret = zstd_mt_stream(s, j, buffer, size);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		while (j->state != ZSTD_JOB_DONE)
+			pthread_cond_wait(&s->done, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+
+		if (j->err == -EFBIG) {
+			s->view.src = j->in;
+			s->view.size = j->inlen;
+			s->view.pos = 0;
+			ZSTD_DCtx_reset(s->seq->dctx, ZSTD_reset_session_only);
+			j->err = 0;
+			zstd_mt_set_state(s, j, ZSTD_JOB_STREAM);
+			continue;
+		}
+		if (j->err)
+			return j->err;
+
+		if (s->pos < j->outlen) {
+			n = min(size, j->outlen - s->pos);
+			memcpy(buffer, j->out + s->pos, n);
+			s->pos += n;
+			return n;
+		}
+
+		s->pos = 0;
+		pthread_mutex_lock(&s->lock);
+		s->head = (s->head + 1) % s->nslots;
+		s->count--;
+		pthread_mutex_unlock(&s->lock);
+
+		ret = zstd_mt_fill(ds, s);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (s->sequential)
+		return zstd_decode(ds, s->seq, buffer, size);
+
+	return 0;
+}
+
+/*
+ * Returns true if the artifact should be decoded by zstd_mt_step(),
+ * the workers are started when the first frame is found.
+ */
+static bool zstd_mt_init(struct ZstdMtState *s, struct ZstdState *seq)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 2)
+		return false;
+
+	s->nworkers = min(cpus, ZSTD_MT_MAX_WORKERS);
+	s->nslots = s->nworkers + 2;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->queued, NULL);
+	pthread_cond_init(&s->done, NULL);
+	s->seq = seq;
+
+	return true;
+}
+
+static void zstd_mt_cleanup(struct ZstdMtState *s)
+{
+	unsigned int i;
+
+	if (!s->seq)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->queued);
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < s->started; i++) {
+		pthread_join(s->worker[i].thread, NULL);
+		ZSTD_freeDCtx(s->worker[i].dctx);
+	}
+
+	for (i = 0; i < ZSTD_MT_SLOTS; i++) {
+		membudget_release(s->job[i].insize + s->job[i].outsize);
+		free(s->job[i].in);
+		free(s->job[i].out);
+	}
+	membudget_release(s->pendsize);
+	free(s->pending);
+	pthread_cond_destroy(&s->done);
+	pthread_cond_destroy(&s->queued);
+	pthread_mutex_destroy(&s->lock);
+	s->seq = NULL;
+}
+#endif
+
+/*
+ * Contexts kept by each thread between two copies
+ *
+ * With many small artifacts, setting up the decompressors and the
+ * digest costs more than processing the data. Each thread keeps them
+ * after a copy, resets them for the next one and releases them when
+ * it exits. A nested copy (from a write callback) gets new contexts.
+ */
+struct CopyContexts {
+	bool busy;
+	struct swupdate_digest *dgst;
+	const char *dgst_alg;	/* algorithm of dgst, NULL for SHA-256 */
+#ifdef CONFIG_GUNZIP
+	struct GunzipState gunzip;
+#endif
+#ifdef CONFIG_ZSTD
+	ZSTD_DStream *dctx;
+#endif
+};
+
+static pthread_key_t copy_contexts_key;
+static pthread_once_t copy_contexts_once = PTHREAD_ONCE_INIT;
+static bool copy_contexts_ready;
+
+static void copy_contexts_free(void *data)
+{
+	struct CopyContexts *c = (struct CopyContexts *)data;
+
+	if (c->dgst) {
+		swupdate_HASH_cleanup(c->dgst);
+	}
+#ifdef CONFIG_GUNZIP
+	if (c->gunzip.initialized) {
+		inflateEnd(&c->gunzip.strm);
+	}
+#endif
+#ifdef CONFIG_ZSTD
+	ZSTD_freeDStream(c->dctx);
+#endif
+	free(c);
+}
+
+static void copy_contexts_init(void)
+{
+	copy_contexts_ready = !pthread_key_create(&copy_contexts_key,
+						  copy_contexts_free);
+}
+
+/* Returns NULL if the contexts of the thread are not available */
+static struct CopyContexts *copy_contexts_get(void)
+{
+	struct CopyContexts *c;
+
+	pthread_once(&copy_contexts_once, copy_contexts_init);
+	if (!copy_contexts_ready)
+		return NULL;
+
+	c = (struct CopyContexts *)pthread_getspecific(copy_contexts_key);
+	if (!c) {
+		c = (struct CopyContexts *)calloc(1, sizeof(*c));
+		if (!c)
+			return NULL;
+		if (pthread_setspecific(copy_contexts_key, c)) {
+			free(c);
+			return NULL;
+		}
+	}
+	if (c->busy)
+		return NULL;
+	c->busy = true;
+
+	return c;
+}
+
+static void copy_contexts_put(struct CopyContexts *c)
 {
-	struct DecompressState *ds = (struct DecompressState *)state;
-	struct ZstdState *s = (struct ZstdState *)ds->impl_state;
-	size_t decompress_ret;
-	int ret;
-	ZSTD_outBuffer output = { buffer, size, 0 };
+	if (c)
+		c->busy = false;
+}
 
-	do {
-		if (s->input_view.pos == s->input_view.size) {
-			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
-			if (ret < 0) {
-				return ret;
-			} else if (ret == 0) {
-				ds->eof = true;
-			}
-			s->input_view.size = ret;
-			s->input_view.pos = 0;
+/*
+ * Reserve the pipeline buffers in the memory budget. If it is short,
+ * the buffers are made smaller, then the stages run in the thread of
+ * the caller. The smallest pipeline is charged anyway.
+ */
+static size_t copy_budget_reserve(size_t *bufsize, unsigned int nbuffers,
+				  unsigned int nstages, bool *threaded)
+{
+	size_t size = *bufsize;
+	size_t need;
+
+	for (;;) {
+		need = size * nbuffers;
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+		if (*threaded)
+			need += size * nstages * PIPELINE_RING_SLOTS;
+#else
+		(void)nstages;
+#endif
+		if (membudget_reserve(need))
+			break;
+		if (size > BUFF_SIZE_MIN) {
+			size = max(size / 2, (size_t)BUFF_SIZE_MIN);
+			continue;
 		}
+		if (*threaded) {
+			*threaded = false;
+			size = *bufsize;
+			continue;
+		}
+		WARN("Memory budget exceeded, %zu bytes are used", membudget_used());
+		membudget_charge(need);
+		break;
+	}
 
-		do {
-			decompress_ret = ZSTD_decompressStream(s->dctx, &output, &s->input_view);
+	if (size != *bufsize)
+		TRACE("Memory budget: copy buffers reduced to %zu bytes", size);
+	*bufsize = size;
 
-			if (ZSTD_isError(decompress_ret)) {
-				ERROR("ZSTD_decompressStream failed: %s",
-				      ZSTD_getErrorName(decompress_ret));
-				return -1;
-			}
+	return need;
+}
 
-			if (output.pos == output.size) {
-				break;
-			}
-		} while (s->input_view.pos < s->input_view.size);
-	} while (output.pos == 0 && !ds->eof);
+/*
+ * The counter is read by the progress thread, without a counter
+ * the progress is reported for each percent
+ */
+static void copy_progress(struct progress_counter *pcount, unsigned long long nbytes,
+			  unsigned long long left, unsigned long long written,
+			  unsigned int *prevpercent)
+{
+	unsigned int percent;
 
-	return output.pos;
+	if (pcount) {
+		swupdate_progress_counter_update(pcount, nbytes - left, written);
+		return;
+	}
+	percent = (unsigned)(100ULL * (nbytes - left) / nbytes);
+	swupdate_progress_stats(nbytes - left, nbytes, written);
+	if (percent != *prevpercent) {
+		*prevpercent = percent;
+		swupdate_progress_update(percent);
+	}
 }
 
-#endif
-
 static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nbytes, unsigned long *offs, unsigned long long seek,
 	int skip_file, int __attribute__ ((__unused__)) compressed,
-	uint32_t *checksum, unsigned char *hash, bool encrypted, const char *imgivt, writeimage callback)
+	uint32_t *checksum, unsigned char *hash, const char *hashalg, int encrypted,
+	const char *imgivt, writeimage callback,
+	size_t bufsize, struct HashTree *tree, const void __attribute__ ((__unused__)) *dict)
 {
-	unsigned int percent, prevpercent = 0;
+	unsigned int prevpercent = 0;
+	unsigned long long written = 0;
+	struct progress_counter *pcount = NULL;
 	int ret = 0;
 	int len;
 	unsigned char md_value[64]; /*
@@ -429,19 +2115,23 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 		.nbytes = nbytes,
 		.offs = offs,
 		.dgst = NULL,
-		.checksum = 0
+		.sum = false,
+		.checksum = 0,
+		.tree = tree,
+		.ring = NULL
 	};
 
 	struct DecryptState decrypt_state = {
 		.upstream_step = NULL, .upstream_state = NULL,
 		.dcrypt = NULL,
+		.input = NULL, .output = NULL,
 		.outlen = 0, .eof = false
 	};
 
-#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD)
+#ifdef DECOMPRESS_STEPS
 	struct DecompressState decompress_state = {
 		.upstream_step = NULL, .upstream_state = NULL,
-		.impl_state = NULL
+		.impl_state = NULL, .input = NULL
 	};
 
 	DecompressStep decompress_step = NULL;
@@ -455,11 +2145,27 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 		.initialized = false,
 	};
 #endif
+#ifdef CONFIG_LZ4
+	struct Lz4State lz4_state = {
+		.dctx = NULL,
+		.next_in = NULL, .avail_in = 0,
+	};
+#endif
+#ifdef CONFIG_XZ
+	struct XzState xz_state = {
+		.strm = LZMA_STREAM_INIT,
+		.initialized = false, .done = false,
+	};
+#endif
 #ifdef CONFIG_ZSTD
 	struct ZstdState zstd_state = {
 		.dctx = NULL,
 		.input_view = { NULL, 0, 0 },
+		.ddict = NULL,
 	};
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	struct ZstdMtState zstd_mt_state = { .seq = NULL };
+#endif
 #endif
 #endif
 
@@ -473,20 +2179,93 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 
 	PipelineStep step = NULL;
 	void *state = NULL;
-	uint8_t buffer[BUFF_SIZE];
+	uint8_t *buffer = NULL;
+	struct CopyContexts *cache = NULL;
+	size_t reserved;
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	bool threaded = true;
+#else
+	bool threaded = false;
+#endif
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	struct ThreadedState *threads = NULL;
+	unsigned int nthreads = 0;
+#endif
+#ifdef CONFIG_CPIO_IO_URING
+	struct uring_writer *writer = NULL;
+#endif
+	struct WritebackState writeback = { .fd = -1 };
+
+	/*
+	 * The optimal I/O size can be detected only if
+	 * out is known to be a file descriptor
+	 */
+	bufsize = copy_buffer_size((out && (!callback || callback == copy_write)) ?
+					*(int *)out : -1, bufsize);
+
+	/* starting the stage threads costs more than a small copy */
+	if (inbuf && nbytes <= PIPELINE_THREADED_MIN)
+		threaded = false;
+
+	reserved = copy_budget_reserve(&bufsize,
+				       1 + (encrypted ? 2 : 0) + (compressed ? 1 : 0),
+				       1 + !!encrypted + !!compressed, &threaded);
 
 	if (!callback) {
 		callback = copy_write;
 	}
 
-	if (checksum)
+	if (checksum) {
 		*checksum = 0;
+		input_state.sum = true;
+	}
+
+	cache = copy_contexts_get();
 
 	if (IsValidHash(hash)) {
-		input_state.dgst = swupdate_HASH_init(SHA_DEFAULT);
-		if (!input_state.dgst)
-			return -EFAULT;
+		if (cache) {
+			if (cache->dgst && (cache->dgst_alg != hashalg ||
+					    swupdate_HASH_reset(cache->dgst))) {
+				swupdate_HASH_cleanup(cache->dgst);
+				cache->dgst = NULL;
+			}
+			if (!cache->dgst) {
+				cache->dgst = swupdate_HASH_init(hashalg ? hashalg : SHA_DEFAULT);
+				cache->dgst_alg = hashalg;
+			}
+			input_state.dgst = cache->dgst;
+		} else
+			input_state.dgst = swupdate_HASH_init(hashalg ? hashalg : SHA_DEFAULT);
+		if (!input_state.dgst) {
+			ret = -EFAULT;
+			goto copyfile_exit;
+		}
+	}
+
+	buffer = pipeline_buffer_alloc(bufsize);
+	if (!buffer) {
+		ret = -ENOMEM;
+		goto copyfile_exit;
+	}
+	if (encrypted) {
+		decrypt_state.bufsize = bufsize;
+		decrypt_state.input = pipeline_buffer_alloc(bufsize);
+		decrypt_state.output = pipeline_buffer_alloc(bufsize + AES_BLK_SIZE);
+		if (!decrypt_state.input || !decrypt_state.output) {
+			ret = -ENOMEM;
+			goto copyfile_exit;
+		}
+	}
+#ifdef DECOMPRESS_STEPS
+	if (compressed) {
+		decompress_state.bufsize = bufsize;
+		decompress_state.input = pipeline_buffer_alloc(bufsize);
+		if (!decompress_state.input) {
+			ret = -ENOMEM;
+			goto copyfile_exit;
+		}
 	}
+#endif
 
 	if (encrypted) {
 		aes_key = get_aes_key();
@@ -494,7 +2273,12 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 			ivt = ivtbuf;
 		} else
 			ivt = get_aes_ivt();
-		decrypt_state.dcrypt = swupdate_DECRYPT_init(aes_key, get_aes_keylen(), ivt);
+		if (encrypted == ENCRYPTED_AES_CTR)
+			decrypt_state.dcrypt = swupdate_DECRYPT_init_ctr(aes_key,
+						get_aes_keylen(), ivt, 0);
+		else
+			decrypt_state.dcrypt = swupdate_DECRYPT_init(aes_key,
+						get_aes_keylen(), ivt);
 		if (!decrypt_state.dcrypt) {
 			ERROR("decrypt initialization failure, aborting");
 			ret = -EFAULT;
@@ -508,30 +2292,84 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 		}
 #ifdef CONFIG_GUNZIP
 		if (compressed == COMPRESSED_ZLIB || compressed == COMPRESSED_TRUE) {
+			struct GunzipState *gz = cache ? &cache->gunzip : &gunzip_state;
+
+			if (gz->initialized) {
+				if (inflateReset(&gz->strm) != Z_OK) {
+					ERROR("inflateReset failed");
+					ret = -EFAULT;
+					goto copyfile_exit;
+				}
+				gz->strm.avail_in = 0;
+				gz->strm.next_in = Z_NULL;
 			/*
 			 * 16 + MAX_WBITS means that Zlib should expect and decode a
 			 * gzip header.
 			 */
-			if (inflateInit2(&gunzip_state.strm, 16 + MAX_WBITS) != Z_OK) {
+			} else if (inflateInit2(&gz->strm, 16 + MAX_WBITS) != Z_OK) {
 				ERROR("inflateInit2 failed");
 				ret = -EFAULT;
 				goto copyfile_exit;
 			}
-			gunzip_state.initialized = true;
+			gz->initialized = true;
 			decompress_step = &gunzip_step;
-			decompress_state.impl_state = &gunzip_state;
+			decompress_state.impl_state = gz;
 		} else
 #endif
 #ifdef CONFIG_ZSTD
 		if (compressed == COMPRESSED_ZSTD) {
-			if ((zstd_state.dctx = ZSTD_createDStream()) == NULL) {
+			if (cache && cache->dctx) {
+				/* the dictionary is dropped with the parameters */
+				zstd_state.dctx = cache->dctx;
+				ZSTD_DCtx_reset(zstd_state.dctx,
+						ZSTD_reset_session_and_parameters);
+			} else if ((zstd_state.dctx = ZSTD_createDStream()) == NULL) {
 				ERROR("ZSTD_createDStream failed");
 				ret = -EFAULT;
 				goto copyfile_exit;
+			} else if (cache) {
+				cache->dctx = zstd_state.dctx;
+			}
+			if (dict && ZSTD_isError(ZSTD_DCtx_refDDict(zstd_state.dctx, dict))) {
+				ERROR("ZSTD_DCtx_refDDict failed");
+				ret = -EFAULT;
+				goto copyfile_exit;
 			}
+			zstd_state.ddict = dict;
 			zstd_state.input_view.src = decompress_state.input;
 			decompress_step = &zstd_step;
 			decompress_state.impl_state = &zstd_state;
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+			if (zstd_mt_init(&zstd_mt_state, &zstd_state)) {
+				decompress_step = &zstd_mt_step;
+				decompress_state.impl_state = &zstd_mt_state;
+			}
+#endif
+		} else
+#endif
+#ifdef CONFIG_LZ4
+		if (compressed == COMPRESSED_LZ4) {
+			if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4_state.dctx,
+									  LZ4F_VERSION))) {
+				ERROR("LZ4F_createDecompressionContext failed");
+				ret = -EFAULT;
+				goto copyfile_exit;
+			}
+			decompress_step = &lz4_step;
+			decompress_state.impl_state = &lz4_state;
+		} else
+#endif
+#ifdef CONFIG_XZ
+		if (compressed == COMPRESSED_XZ) {
+			if (lzma_auto_decoder(&xz_state.strm, UINT64_MAX,
+					      LZMA_CONCATENATED) != LZMA_OK) {
+				ERROR("lzma_auto_decoder failed");
+				ret = -EFAULT;
+				goto copyfile_exit;
+			}
+			xz_state.initialized = true;
+			decompress_step = &xz_step;
+			decompress_state.impl_state = &xz_state;
 		} else
 #endif
 		{
@@ -542,51 +2380,133 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 	}
 
 	if (seek) {
-		int fdout = (out != NULL) ? *(int *)out : -1;
-		if (fdout < 0) {
+		struct copy_tee single = {
+			.fds = (int *)out,
+			.count = 1,
+		};
+		struct copy_tee *outputs = &single;
+
+		if (out && callback == copy_write_tee)
+			outputs = (struct copy_tee *)out;
+		if (!out || !outputs->count) {
 			ERROR("out argument: invalid fd or pointer");
 			ret = -EFAULT;
 			goto copyfile_exit;
 		}
 
 		TRACE("offset has been defined: %llu bytes", seek);
-		if (lseek(fdout, seek, SEEK_SET) < 0) {
-			ERROR("offset argument: seek failed");
-			ret = -EFAULT;
+		for (unsigned int i = 0; i < outputs->count; i++) {
+			if (outputs->fds[i] < 0) {
+				ERROR("out argument: invalid fd or pointer");
+				ret = -EFAULT;
+				goto copyfile_exit;
+			}
+			if (lseek(outputs->fds[i], seek, SEEK_SET) < 0) {
+				ERROR("offset argument: seek failed");
+				ret = -EFAULT;
+				goto copyfile_exit;
+			}
+		}
+	}
+
+	if (!skip_file && out && callback == copy_write)
+		writeback_start(&writeback, *(int *)out);
+	pcount = swupdate_progress_counter_start(nbytes);
+
+	/*
+	 * Nothing to be done on the data: let the kernel move it
+	 * and fall back to the pipeline for the rest if it cannot.
+	 */
+	if (!inbuf && !skip_file && !encrypted && !compressed && !checksum &&
+	    !input_state.dgst && !tree && out && callback == copy_write) {
+		size_t chunk = KERNEL_COPY_CHUNK, copied;
+
+		while (input_state.nbytes > 0) {
+			ret = copy_in_kernel(fdin, *(int *)out,
+					     min(input_state.nbytes, chunk), &copied);
+			*offs += copied;
+			input_state.nbytes -= copied;
+			metrics_count(METRICS_WRITTEN_BYTES, copied);
+			profile_count_written(copied);
+			if (ret < 0 || !copied)
+				break;
+			ret = writeback_account(&writeback, copied);
+			if (ret < 0)
+				goto copyfile_exit;
+			copy_progress(pcount, nbytes, input_state.nbytes,
+				      nbytes - input_state.nbytes, &prevpercent);
+		}
+		if (ret < 0 && ret != -EOPNOTSUPP)
+			goto copyfile_exit;
+		ret = 0;
+	}
+
+#ifdef CONFIG_CPIO_IO_URING
+	/* files and block devices only, else the engines are not started */
+	if (!inbuf && input_state.nbytes)
+		input_state.ring = uring_reader_start(fdin, input_state.nbytes, bufsize);
+	if (!skip_file && out && callback == copy_write)
+		writer = uring_writer_start(*(int *)out, bufsize);
+#endif
+
+	step = &input_step;
+	state = &input_state;
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	if (threaded) {
+		threads = (struct ThreadedState *)calloc(PIPELINE_MAX_STAGES, sizeof(*threads));
+		if (!threads) {
+			ERROR("OOM allocating pipeline stages");
+			ret = -ENOMEM;
 			goto copyfile_exit;
 		}
+		if ((ret = threaded_chain(&threads[nthreads++], &step, &state, bufsize)) < 0)
+			goto copyfile_exit;
+	}
+#endif
+
+	if (encrypted) {
+		decrypt_state.upstream_step = step;
+		decrypt_state.upstream_state = state;
+		step = &decrypt_step;
+		state = &decrypt_state;
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+		if (threaded &&
+		    (ret = threaded_chain(&threads[nthreads++], &step, &state, bufsize)) < 0)
+			goto copyfile_exit;
+#endif
 	}
 
-#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD)
+#ifdef DECOMPRESS_STEPS
 	if (compressed) {
-		if (encrypted) {
-			decrypt_state.upstream_step = &input_step;
-			decrypt_state.upstream_state = &input_state;
-			decompress_state.upstream_step = &decrypt_step;
-			decompress_state.upstream_state = &decrypt_state;
-		} else {
-			decompress_state.upstream_step = &input_step;
-			decompress_state.upstream_state = &input_state;
-		}
+		decompress_state.upstream_step = step;
+		decompress_state.upstream_state = state;
 		step = decompress_step;
 		state = &decompress_state;
-	} else {
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+		if (threaded &&
+		    (ret = threaded_chain(&threads[nthreads++], &step, &state, bufsize)) < 0)
+			goto copyfile_exit;
 #endif
-		if (encrypted) {
-			decrypt_state.upstream_step = &input_step;
-			decrypt_state.upstream_state = &input_state;
-			step = &decrypt_step;
-			state = &decrypt_state;
-		} else {
-			step = &input_step;
-			state = &input_state;
-		}
-#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD)
 	}
 #endif
 
+	if (!threaded && !tree) {
+		PipelineStep fast = pipeline_specialize(
+#ifdef DECOMPRESS_STEPS
+					compressed ? decompress_step : NULL,
+#else
+					NULL,
+#endif
+					encrypted != 0, input_state.dgst != NULL,
+					input_state.source);
+
+		if (fast)
+			step = fast;
+	}
+
+	SWU_PROBE3(copy_start, nbytes, compressed, encrypted);
 	for (;;) {
-		ret = step(state, buffer, sizeof buffer);
+		ret = step(state, buffer, bufsize);
 		if (ret < 0) {
 			goto copyfile_exit;
 		}
@@ -603,16 +2523,55 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 		 * results corrupted. This lets the cleanup routine
 		 * to remove it
 		 */
-		if (callback(out, buffer, len) < 0) {
+#ifdef CONFIG_CPIO_IO_URING
+		if (writer)
+			ret = uring_writer_write(writer, buffer, len);
+		else
+#endif
+			ret = callback(out, buffer, len);
+		if (ret < 0) {
 			ret = -ENOSPC;
 			goto copyfile_exit;
 		}
+		SWU_PROBE2(copy_chunk, PROBE_COPY_WRITE, len);
+		ret = writeback_account(&writeback, len);
+		if (ret < 0)
+			goto copyfile_exit;
 
-		percent = (unsigned)(100ULL * (nbytes - input_state.nbytes) / nbytes);
-		if (percent != prevpercent) {
-			prevpercent = percent;
-			swupdate_progress_update(percent);
-		}
+		/*
+		 * With threaded stages, nbytes is updated by the reader
+		 * thread: the value is just used as estimation
+		 */
+		written += len;
+		copy_progress(pcount, nbytes, __atomic_load_n(&input_state.nbytes, __ATOMIC_RELAXED),
+			      written, &prevpercent);
+	}
+
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	/*
+	 * All stages have reached EOF, wait for the workers before
+	 * accessing the digest and the input file descriptor again
+	 */
+	threaded_stop_all(threads, nthreads);
+#endif
+#ifdef CONFIG_CPIO_IO_URING
+	uring_reader_stop(input_state.ring);
+	input_state.ring = NULL;
+	ret = uring_writer_stop(writer);
+	writer = NULL;
+	if (ret < 0) {
+		ret = -ENOSPC;
+		goto copyfile_exit;
+	}
+#endif
+	ret = writeback_finish(&writeback);
+	if (ret < 0)
+		goto copyfile_exit;
+
+	if (tree) {
+		ret = hash_tree_finish(tree);
+		if (ret)
+			goto copyfile_exit;
 	}
 
 	if (IsValidHash(hash)) {
@@ -650,13 +2609,30 @@ static int __swupdate_copy(int fdin, unsigned char *inbuf, void *out, size_t nby
 		*checksum = input_state.checksum;
 	}
 
+	metrics_count(METRICS_WRITTEN_BYTES, written);
+	profile_count_written(written);
 	ret = 0;
 
 copyfile_exit:
+	swupdate_progress_counter_end(pcount);
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	threaded_stop_all(threads, nthreads);
+	free(threads);
+#endif
+#ifdef CONFIG_CPIO_IO_URING
+	uring_reader_stop(input_state.ring);
+	(void)uring_writer_stop(writer);
+#endif
 	if (decrypt_state.dcrypt) {
 		swupdate_DECRYPT_cleanup(decrypt_state.dcrypt);
 	}
-	if (input_state.dgst) {
+	free(decrypt_state.input);
+	free(decrypt_state.output);
+#ifdef DECOMPRESS_STEPS
+	free(decompress_state.input);
+#endif
+	free(buffer);
+	if (input_state.dgst && !cache) {
 		swupdate_HASH_cleanup(input_state.dgst);
 	}
 #ifdef CONFIG_GUNZIP
@@ -664,18 +2640,35 @@ copyfile_exit:
 		inflateEnd(&gunzip_state.strm);
 	}
 #endif
+#ifdef CONFIG_LZ4
+	if (lz4_state.dctx != NULL) {
+		LZ4F_freeDecompressionContext(lz4_state.dctx);
+	}
+#endif
+#ifdef CONFIG_XZ
+	if (xz_state.initialized) {
+		lzma_end(&xz_state.strm);
+	}
+#endif
 #ifdef CONFIG_ZSTD
-	if (zstd_state.dctx != NULL) {
+#ifdef CONFIG_CPIO_PIPELINE_THREADS
+	zstd_mt_cleanup(&zstd_mt_state);
+#endif
+	if (zstd_state.dctx != NULL && !cache) {
 		ZSTD_freeDStream(zstd_state.dctx);
 	}
 #endif
+	copy_contexts_put(cache);
+	membudget_release(reserved);
+	SWU_PROBE2(copy_done, written, ret);
 
 	return ret;
 }
 
-int copyfile(int fdin, void *out, size_t nbytes, unsigned long *offs, unsigned long long seek,
+int copyfile_hash(int fdin, void *out, size_t nbytes, unsigned long *offs, unsigned long long seek,
 	int skip_file, int __attribute__ ((__unused__)) compressed,
-	uint32_t *checksum, unsigned char *hash, bool encrypted, const char *imgivt, writeimage callback)
+	uint32_t *checksum, unsigned char *hash, const char *hashalg, int encrypted,
+	const char *imgivt, writeimage callback)
 {
 	return __swupdate_copy(fdin,
 				NULL,
@@ -687,13 +2680,25 @@ int copyfile(int fdin, void *out, size_t nbytes, unsigned long *offs, unsigned l
 				compressed,
 				checksum,
 				hash,
+				hashalg,
 				encrypted,
 				imgivt,
-				callback);
+				callback,
+				0,
+				NULL,
+				NULL);
+}
+
+int copyfile(int fdin, void *out, size_t nbytes, unsigned long *offs, unsigned long long seek,
+	int skip_file, int __attribute__ ((__unused__)) compressed,
+	uint32_t *checksum, unsigned char *hash, int encrypted, const char *imgivt, writeimage callback)
+{
+	return copyfile_hash(fdin, out, nbytes, offs, seek, skip_file, compressed,
+			     checksum, hash, NULL, encrypted, imgivt, callback);
 }
 
 int copybuffer(unsigned char *inbuf, void *out, size_t nbytes, int __attribute__ ((__unused__)) compressed,
-	unsigned char *hash, bool encrypted, const char *imgivt, writeimage callback)
+	unsigned char *hash, int encrypted, const char *imgivt, writeimage callback)
 {
 	return __swupdate_copy(-1,
 				inbuf,
@@ -705,25 +2710,193 @@ int copybuffer(unsigned char *inbuf, void *out, size_t nbytes, int __attribute__
 				compressed,
 				NULL,
 				hash,
+				NULL,
 				encrypted,
 				imgivt,
-				callback);
+				callback,
+				0,
+				NULL,
+				NULL);
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * zstd dictionaries
+ *
+ * An artifact compressed with a dictionary names it with the
+ * "zstd-dictionary" property. The dictionary is another artifact
+ * of the SWU: it is read and verified the first time it is used,
+ * and the digested dictionary is kept until the end of the update.
+ */
+#define ZSTD_DICT_MAX_SIZE	(16 * 1024 * 1024)
+
+struct ZstdDict {
+	char fname[MAX_IMAGE_FNAME];
+	ZSTD_DDict *ddict;
+	LIST_ENTRY(ZstdDict) next;
+};
+
+static LIST_HEAD(, ZstdDict) zstd_dicts = LIST_HEAD_INITIALIZER(zstd_dicts);
+static pthread_mutex_t zstd_dicts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct DictBuffer {
+	uint8_t *buf;
+	size_t len;
+};
+
+static int copy_to_dict(void *out, const void *buf, size_t len)
+{
+	struct DictBuffer *b = (struct DictBuffer *)out;
+	uint8_t *p;
+
+	if (b->len + len > ZSTD_DICT_MAX_SIZE) {
+		ERROR("zstd dictionary larger than %d bytes", ZSTD_DICT_MAX_SIZE);
+		return -EFBIG;
+	}
+	p = realloc(b->buf, b->len + len);
+	if (!p)
+		return -ENOMEM;
+	memcpy(p + b->len, buf, len);
+	b->buf = p;
+	b->len += len;
+
+	return 0;
+}
+
+static ZSTD_DDict *zstd_dict_load(const char *fname)
+{
+	struct swupdate_cfg *sw = get_swupdate_cfg();
+	struct DictBuffer b = { .buf = NULL, .len = 0 };
+	struct img_type *dimg;
+	ZSTD_DDict *ddict = NULL;
+	unsigned long offset;
+	int fd, ret;
+
+	LIST_FOREACH(dimg, &sw->images, next) {
+		if (!strcmp(dimg->fname, fname))
+			break;
+	}
+	if (!dimg) {
+		ERROR("zstd dictionary %s is not in sw-description", fname);
+		return NULL;
+	}
+
+	fd = open_image_data(sw, dimg);
+	if (fd < 0)
+		return NULL;
+	offset = dimg->offset;
+	ret = __swupdate_copy(fd, NULL, &b, dimg->size, &offset, 0, 0,
+			      dimg->compressed, NULL,
+			      dimg->hash_verified ? NULL : dimg->sha256,
+			      dimg->hashalg,
+			      dimg->is_encrypted, dimg->ivt_ascii, copy_to_dict,
+			      0, NULL, NULL);
+	close(fd);
+
+	if (!ret) {
+		ddict = ZSTD_createDDict(b.buf, b.len);
+		if (!ddict)
+			ERROR("zstd dictionary %s cannot be loaded", fname);
+		else
+			TRACE("zstd dictionary %s loaded, id %u", fname,
+			      ZSTD_getDictID_fromDDict(ddict));
+	}
+	free(b.buf);
+
+	return ddict;
+}
+
+static const ZSTD_DDict *zstd_dict_get(const char *fname)
+{
+	struct ZstdDict *d;
+	ZSTD_DDict *ddict = NULL;
+
+	/* images of different install groups can share a dictionary */
+	pthread_mutex_lock(&zstd_dicts_lock);
+	LIST_FOREACH(d, &zstd_dicts, next) {
+		if (!strcmp(d->fname, fname)) {
+			ddict = d->ddict;
+			break;
+		}
+	}
+	if (!ddict) {
+		ddict = zstd_dict_load(fname);
+		d = ddict ? calloc(1, sizeof(*d)) : NULL;
+		if (d) {
+			strlcpy(d->fname, fname, sizeof(d->fname));
+			d->ddict = ddict;
+			LIST_INSERT_HEAD(&zstd_dicts, d, next);
+		} else if (ddict) {
+			ZSTD_freeDDict(ddict);
+			ddict = NULL;
+		}
+	}
+	pthread_mutex_unlock(&zstd_dicts_lock);
+
+	return ddict;
+}
+#endif
+
+void free_zstd_dictionaries(void)
+{
+#ifdef CONFIG_ZSTD
+	struct ZstdDict *d, *tmp;
+
+	pthread_mutex_lock(&zstd_dicts_lock);
+	LIST_FOREACH_SAFE(d, &zstd_dicts, next, tmp) {
+		LIST_REMOVE(d, next);
+		ZSTD_freeDDict(d->ddict);
+		free(d);
+	}
+	pthread_mutex_unlock(&zstd_dicts_lock);
+#endif
 }
 
 int copyimage(void *out, struct img_type *img, writeimage callback)
 {
-	return copyfile(img->fdin,
+	const char *bufsize = dict_get_value(&img->properties, "copy-buffer-size");
+	const char *dictname = dict_get_value(&img->properties, "zstd-dictionary");
+	const void *dict = NULL;
+	struct HashTree tree;
+	int ret;
+
+	if (dictname) {
+#ifdef CONFIG_ZSTD
+		if (img->compressed == COMPRESSED_ZSTD)
+			dict = zstd_dict_get(dictname);
+#endif
+		if (!dict) {
+			ERROR("%s: zstd dictionary %s cannot be used", img->fname,
+			      dictname);
+			return -EINVAL;
+		}
+	}
+
+	ret = hash_tree_load(img, &tree);
+	if (ret < 0)
+		return ret;
+
+	ret = __swupdate_copy(img->fdin,
+			NULL,
 			out,
 			img->size,
 			(unsigned long *)&img->offset,
 			img->seek,
 			0, /* no skip */
 			img->compressed,
-			&img->checksum,
-			img->sha256,
+			/* the cpio checksum is verified during extraction */
+			img->sum_checksum ? &img->checksum : NULL,
+			img->hash_verified ? NULL : img->sha256,
+			img->hashalg,
 			img->is_encrypted,
 			img->ivt_ascii,
-			callback);
+			callback,
+			bufsize ? ustrtoull(bufsize, NULL, 0) : 0,
+			ret ? &tree : NULL,
+			dict);
+	hash_tree_free(&tree);
+
+	return ret;
 }
 
 int extract_cpio_header(int fd, struct filehdr *fhdr, unsigned long *offset)
@@ -802,7 +2975,8 @@ off_t extract_next_file(int fd, int fdout, off_t start, int compressed,
 		return ret;
 	}
 
-	ret = copyfile(fd, &fdout, fdh.size, &offset, 0, 0, compressed, &checksum, hash, encrypted, ivt, NULL);
+	ret = copyfile(fd, &fdout, fdh.size, &offset, 0, 0, compressed,
+		       cpio_chksum_ptr(&fdh, &checksum), hash, encrypted, ivt, NULL);
 	if (ret < 0) {
 		ERROR("Error copying extracted file");
 		return ret;
@@ -826,7 +3000,7 @@ int cpio_scan(int fd, struct swupdate_cfg *cfg, off_t start)
 	struct filehdr fdh;
 	unsigned long offset = start;
 	int file_listed;
-	uint32_t checksum;
+	uint32_t checksum = 0;
 
 	while (1) {
 		file_listed = 0;
@@ -839,9 +3013,12 @@ int cpio_scan(int fd, struct swupdate_cfg *cfg, off_t start)
 		}
 
 		struct img_type *img = NULL;
-		SEARCH_FILE(img, cfg->images, file_listed, start);
-		SEARCH_FILE(img, cfg->scripts, file_listed, start);
-		SEARCH_FILE(img, cfg->bootscripts, file_listed, start);
+		img = artifact_provided(cfg, &cfg->images, &fdh, start);
+		if (!img)
+			img = artifact_provided(cfg, &cfg->scripts, &fdh, start);
+		if (!img)
+			img = artifact_provided(cfg, &cfg->bootscripts, &fdh, start);
+		file_listed = img != NULL;
 
 		TRACE("Found file:\n\tfilename %s\n\tsize %lu\n\t%s",
 			fdh.filename,
@@ -852,7 +3029,8 @@ int cpio_scan(int fd, struct swupdate_cfg *cfg, off_t start)
 		 * use copyfile for checksum and hash verification, as we skip file
 		 * we do not have to provide fdout
 		 */
-		if (copyfile(fd, NULL, fdh.size, &offset, 0, 1, 0, &checksum, img ? img->sha256 : NULL,
+		if (copyfile_hash(fd, NULL, fdh.size, &offset, 0, 1, 0, cpio_chksum_ptr(&fdh, &checksum),
+				img ? img->sha256 : NULL, img ? img->hashalg : NULL,
 				false, NULL, NULL) != 0) {
 			ERROR("invalid archive");
 			return -1;
@@ -873,6 +3051,72 @@ int cpio_scan(int fd, struct swupdate_cfg *cfg, off_t start)
 	return 0;
 }
 
+/*
+ * Build an index of the archive with a single walk through the headers,
+ * from the current position of fd (start is its offset in the archive)
+ * up to the trailer. The data of the entries is not read, the archive
+ * must be seekable.
+ */
+int cpio_index(int fd, off_t start, struct cpio_index *idx)
+{
+	struct filehdr fdh;
+	struct cpio_entry *entries;
+	unsigned long offset = start;
+	unsigned int allocated = 0;
+	struct stat st;
+
+	idx->entries = NULL;
+	idx->count = 0;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	for (;;) {
+		if (extract_cpio_header(fd, &fdh, &offset))
+			goto index_error;
+		if (strcmp("TRAILER!!!", fdh.filename) == 0)
+			break;
+
+		if ((off_t)(offset + fdh.size) > st.st_size) {
+			ERROR("CPIO file truncated: %s exceeds the archive",
+			      fdh.filename);
+			goto index_error;
+		}
+
+		if (idx->count == allocated) {
+			allocated = allocated ? allocated * 2 : 16;
+			entries = realloc(idx->entries, allocated * sizeof(*entries));
+			if (!entries)
+				goto index_error;
+			idx->entries = entries;
+		}
+		idx->entries[idx->count].hdr = fdh;
+		idx->entries[idx->count].offset = offset;
+		idx->count++;
+
+		/* Next header must be 4-bytes aligned */
+		offset += fdh.size;
+		offset += NPAD_BYTES(offset);
+		if (lseek(fd, offset, SEEK_SET) < 0) {
+			ERROR("CPIO file corrupted : %s", strerror(errno));
+			goto index_error;
+		}
+	}
+
+	return 0;
+
+index_error:
+	cpio_index_free(idx);
+	return -EINVAL;
+}
+
+void cpio_index_free(struct cpio_index *idx)
+{
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->count = 0;
+}
+
 bool swupdate_verify_chksum(const uint32_t chk1, struct filehdr *fhdr) {
 	bool ret = (chk1 == fhdr->chksum);
 	if (fhdr->format == CPIO_NEWASCII)
@@ -18,26 +18,57 @@
 #include "util.h"
 
 #define MAX_INSTALLER_HANDLER	64
+#define MAX_COMMIT_HOOKS	8
+/* open addressing, handlers are never removed */
+#define HANDLER_BUCKETS		(2 * MAX_INSTALLER_HANDLER)
 struct installer_handler supported_types[MAX_INSTALLER_HANDLER];
 static unsigned long nr_installers = 0;
 static unsigned long handler_index = ULONG_MAX;
+/* index + 1 in supported_types, 0 if free */
+static unsigned char handler_buckets[HANDLER_BUCKETS];
+static commit_hook commit_hooks[MAX_COMMIT_HOOKS];
+static unsigned int nr_commit_hooks;
+
+static unsigned int handler_hash(const char *desc)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (*desc) {
+		hash ^= (unsigned char)*desc++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Returns the bucket of desc, or the free one where it goes */
+static unsigned int handler_bucket(const char *desc)
+{
+	unsigned int i = handler_hash(desc) & (HANDLER_BUCKETS - 1);
+
+	while (handler_buckets[i] &&
+	       strcmp(desc, supported_types[handler_buckets[i] - 1].desc))
+		i = (i + 1) & (HANDLER_BUCKETS - 1);
+
+	return i;
+}
 
 int register_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data)
 {
-	int i;
+	unsigned int bucket;
 
-	if ((nr_installers > MAX_INSTALLER_HANDLER - 1) || !desc)
+	if ((nr_installers > MAX_INSTALLER_HANDLER - 1) || !desc ||
+	    strlen(desc) >= sizeof(supported_types[0].desc))
 		return -1;
 
 	/*
 	 * Do not register the same handler twice
 	 */
-	for (i = 0; i < nr_installers; i++) {
-		if ((strlen(desc) == strlen(supported_types[i].desc)) &&
-			strcmp(desc, supported_types[i].desc) == 0)
-			return -1;
-	}
+	bucket = handler_bucket(desc);
+	if (handler_buckets[bucket])
+		return -1;
 
 	strlcpy(supported_types[nr_installers].desc, desc,
 		      sizeof(supported_types[nr_installers].desc));
@@ -45,6 +76,7 @@ int register_handler(const char *desc,
 	supported_types[nr_installers].data = data;
 	supported_types[nr_installers].mask = mask;
 	nr_installers++;
+	handler_buckets[bucket] = nr_installers;
 
 	return 0;
 }
@@ -62,19 +94,18 @@ void print_registered_handlers(void)
 	}
 }
 
-struct installer_handler *find_handler(struct img_type *img)
+struct installer_handler *find_handler_by_name(const char *desc)
 {
-	unsigned int i;
+	unsigned int bucket = handler_bucket(desc);
 
-	for (i = 0; i < nr_installers; i++) {
-		if ((strlen(img->type) == strlen(supported_types[i].desc)) &&
-			strcmp(img->type,
-				supported_types[i].desc) == 0)
-			break;
-	}
-	if (i >= nr_installers)
+	if (!handler_buckets[bucket])
 		return NULL;
-	return &supported_types[i];
+	return &supported_types[handler_buckets[bucket] - 1];
+}
+
+struct installer_handler *find_handler(struct img_type *img)
+{
+	return find_handler_by_name(img->type);
 }
 
 struct installer_handler *get_next_handler(void)
@@ -101,3 +132,31 @@ unsigned int get_handler_mask(struct img_type *img)
 
 	return mask;
 }
+
+int register_commit_hook(commit_hook hook)
+{
+	if (nr_commit_hooks >= MAX_COMMIT_HOOKS || !hook)
+		return -1;
+
+	commit_hooks[nr_commit_hooks++] = hook;
+
+	return 0;
+}
+
+/*
+ * Called once at the end of an installation: with apply set when
+ * all images and postinstall scripts succeeded, otherwise the hooks
+ * must drop what they deferred.
+ */
+int run_commit_hooks(bool apply)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < nr_commit_hooks; i++) {
+		if (commit_hooks[i](apply && !ret))
+			ret = -1;
+	}
+
+	return ret;
+}
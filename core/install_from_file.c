@@ -20,7 +20,7 @@
 
 static pthread_mutex_t install_file_mutex;
 
-static char buf[16 * 1024];
+static char buf[64 * 1024];
 static int fd = STDIN_FILENO;
 static int end_status = EXIT_SUCCESS;
 static pthread_cond_t cv_end = PTHREAD_COND_INITIALIZER;
@@ -89,9 +89,17 @@ int install_from_file(const char *filename, bool check)
 	if (check)
 		req.dry_run = RUN_DRYRUN;
 
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
 	pthread_mutex_init(&install_file_mutex, NULL);
 	pthread_mutex_lock(&install_file_mutex);
-	while (timeout_cnt > 0) {
+
+	/*
+	 * Let the installer read the file itself, and copy it
+	 * through the socket only if this is not possible
+	 */
+	rc = swupdate_async_start_fd(fd, NULL, endupdate, &req, sizeof(req));
+	while (rc < 0 && timeout_cnt > 0) {
 		rc = swupdate_async_start(readimage, NULL,
 					  endupdate, &req, sizeof(req));
 		if (rc >= 0)
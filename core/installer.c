@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
@@ -20,6 +21,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <pthread.h>
 
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
@@ -31,8 +33,158 @@
 #include "cpiohdr.h"
 #include "parsers.h"
 #include "bootloader.h"
+#include "state.h"
 #include "progress.h"
 #include "pctl.h"
+#include "swupdate_arena.h"
+#include "swupdate_staging.h"
+#include "swupdate_timeline.h"
+#include "swupdate_metrics.h"
+#include "swupdate_profile.h"
+#include "swupdate_probes.h"
+#include "lua_util.h"
+#include "blkdev_cache.h"
+#include "content_check.h"
+#include "network_ipc.h"
+
+/*
+ * Once the description is parsed, the artifacts of the lists are
+ * hashed by their file name: for each file of the SWU, only the
+ * images referencing it are looked at. The entries of a bucket are
+ * in the order of the lists.
+ */
+struct artifact_entry {
+	struct artifact_entry *next;
+	const struct imglist *list;
+	struct img_type *img;
+};
+
+struct artifact_index {
+	unsigned int size;
+	struct artifact_entry **buckets;
+	struct artifact_entry entries[];
+};
+
+static unsigned int artifact_hash(const char *fname)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (*fname) {
+		hash ^= (unsigned char)*fname++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+int artifact_index_build(struct swupdate_cfg *sw)
+{
+	struct imglist *list[] = {&sw->images,
+				  &sw->scripts,
+				  &sw->bootscripts};
+	struct artifact_index *idx;
+	struct img_type *img;
+	unsigned int count = 0, size = 16, n = 0, h;
+
+	artifact_index_free(sw);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(list); i++)
+		LIST_FOREACH(img, list[i], next)
+			count++;
+	while (size < count * 2)
+		size <<= 1;
+
+	idx = calloc(1, sizeof(*idx) + count * sizeof(idx->entries[0]));
+	if (!idx)
+		return -ENOMEM;
+	idx->buckets = calloc(size, sizeof(*idx->buckets));
+	if (!idx->buckets) {
+		free(idx);
+		return -ENOMEM;
+	}
+	idx->size = size;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(list); i++) {
+		LIST_FOREACH(img, list[i], next) {
+			idx->entries[n].list = list[i];
+			idx->entries[n++].img = img;
+		}
+	}
+	/* inserted from the last, so that the buckets keep the order */
+	while (n--) {
+		h = artifact_hash(idx->entries[n].img->fname) & (size - 1);
+		idx->entries[n].next = idx->buckets[h];
+		idx->buckets[h] = &idx->entries[n];
+	}
+	sw->artifact_index = idx;
+
+	return 0;
+}
+
+void artifact_index_free(struct swupdate_cfg *sw)
+{
+	struct artifact_index *idx = sw->artifact_index;
+
+	sw->artifact_index = NULL;
+	if (idx) {
+		free(idx->buckets);
+		free(idx);
+	}
+}
+
+/*
+ * Next image of the list after prev (or the first one with
+ * prev NULL) for the file name. Without index, the list is
+ * searched.
+ */
+struct img_type *artifact_next(struct swupdate_cfg *sw, const struct imglist *list,
+			       const char *fname, struct img_type *prev)
+{
+	struct artifact_index *idx = sw->artifact_index;
+	struct artifact_entry *e;
+	struct img_type *img;
+
+	if (!idx) {
+		for (img = prev ? LIST_NEXT(prev, next) : LIST_FIRST(list); img;
+		     img = LIST_NEXT(img, next))
+			if (!strcmp(img->fname, fname))
+				return img;
+		return NULL;
+	}
+
+	e = idx->buckets[artifact_hash(fname) & (idx->size - 1)];
+	if (prev) {
+		while (e && e->img != prev)
+			e = e->next;
+		if (e)
+			e = e->next;
+	}
+	for (; e; e = e->next)
+		if (e->list == list && !strcmp(e->img->fname, fname))
+			return e->img;
+
+	return NULL;
+}
+
+/*
+ * The images of list requiring the file are found at offset
+ * in the SWU. It returns the last of them, NULL if none.
+ */
+struct img_type *artifact_provided(struct swupdate_cfg *sw, struct imglist *list,
+				   struct filehdr *fdh, off_t offset)
+{
+	struct img_type *img, *found = NULL;
+
+	ARTIFACT_FOREACH(img, sw, list, fdh->filename) {
+		img->offset = offset;
+		img->provided = 1;
+		img->size = fdh->size;
+		found = img;
+	}
+
+	return found;
+}
 
 /*
  * function returns:
@@ -41,8 +193,8 @@
  * 2 = install directly (stream to the handler)
  * -1= error found
  */
-swupdate_file_t check_if_required(struct imglist *list, struct filehdr *pfdh,
-				const char *destdir,
+swupdate_file_t check_if_required(struct swupdate_cfg *sw, struct imglist *list,
+				struct filehdr *pfdh, const char *destdir,
 				struct img_type **pimg)
 {
 	swupdate_file_t skip = SKIP_FILE;
@@ -53,40 +205,56 @@ swupdate_file_t check_if_required(struct imglist *list, struct filehdr *pfdh,
 	 */
 	int install_direct = 0;
 
-	LIST_FOREACH(img, list, next) {
-		if (strcmp(pfdh->filename, img->fname) == 0) {
-			skip = COPY_FILE;
-			img->provided = 1;
-			img->size = (unsigned int)pfdh->size;
-
-			if (snprintf(img->extract_file,
-				     sizeof(img->extract_file), "%s%s",
-				     destdir, pfdh->filename) >= (int)sizeof(img->extract_file)) {
-				ERROR("Path too long: %s%s", destdir, pfdh->filename);
-				return -EBADF;
-			}
-			/*
-			 *  Streaming is possible to only one handler
-			 *  If more img requires the same file,
-			 *  sw-description contains an error
-			 */
-			if (install_direct) {
-				ERROR("sw-description: stream to several handlers unsupported");
-				return -EINVAL;
-			}
+	ARTIFACT_FOREACH(img, sw, list, pfdh->filename) {
+		skip = COPY_FILE;
+		img->provided = 1;
+		img->size = (unsigned int)pfdh->size;
 
-			if (img->install_directly) {
-				skip = INSTALL_FROM_STREAM;
-				install_direct++;
-			}
+		if (snprintf(img->extract_file,
+			     sizeof(img->extract_file), "%s%s",
+			     destdir, pfdh->filename) >= (int)sizeof(img->extract_file)) {
+			ERROR("Path too long: %s%s", destdir, pfdh->filename);
+			return -EBADF;
+		}
+		/*
+		 *  Streaming is possible to only one handler
+		 *  If more img requires the same file,
+		 *  sw-description contains an error
+		 */
+		if (install_direct) {
+			ERROR("sw-description: stream to several handlers unsupported");
+			return -EINVAL;
+		}
 
-			*pimg = img;
+		if (img->install_directly) {
+			skip = INSTALL_FROM_STREAM;
+			install_direct++;
 		}
+
+		*pimg = img;
 	}
 
 	return skip;
 }
 
+/*
+ * Artifacts skipped by the parser (installed-if-different, ...)
+ * are not in the lists anymore
+ */
+bool artifact_required(struct swupdate_cfg *sw, const char *fname)
+{
+	struct imglist *list[] = {&sw->images,
+				  &sw->scripts,
+				  &sw->bootscripts};
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(list); i++) {
+		if (artifact_next(sw, list[i], fname, NULL))
+			return true;
+	}
+
+	return false;
+}
+
 
 /*
  * Extract all scripts from a list from the image
@@ -140,10 +308,11 @@ static int extract_scripts(struct imglist *head)
 			return -ENOENT;
 		}
 
-		ret = copyfile(fdin, &fdout, script->size, &offset, 0, 0,
+		ret = copyfile_hash(fdin, &fdout, script->size, &offset, 0, 0,
 				script->compressed,
 				&checksum,
-				script->sha256,
+				script->hash_verified ? NULL : script->sha256,
+				script->hashalg,
 				script->is_encrypted,
 				script->ivt_ascii,
 				NULL);
@@ -156,12 +325,66 @@ static int extract_scripts(struct imglist *head)
 	return 0;
 }
 
+/*
+ * Set the transaction and the update state markers, inside the
+ * transaction of the caller if any
+ */
+static bool set_transaction_markers(struct swupdate_cfg *software,
+				    update_state_t newstate)
+{
+	bool ret = true;
+
+	if (software->bootloader_transaction_marker) {
+		if (newstate == STATE_INSTALLED)
+			bootloader_env_unset(BOOTVAR_TRANSACTION);
+		else
+			bootloader_env_set(BOOTVAR_TRANSACTION, get_state_string(newstate));
+	}
+	if (software->bootloader_state_marker
+	    && save_state(newstate) != SERVER_OK) {
+		WARN("Cannot persistently store %s update state.", get_state_string(newstate));
+		ret = false;
+	}
+
+	return ret;
+}
+
+bool update_transaction_state(struct swupdate_cfg *software, update_state_t newstate)
+{
+	bool ret;
+
+	if (software->parms.dry_run)
+		return true;
+
+	/* already stored, e.g. with the environment of the update */
+	if (software->stored_state == newstate) {
+		TRACE("Update state %s already stored", get_state_string(newstate));
+		return true;
+	}
+
+	/* Both markers are stored with a single write of the environment */
+	bool txn = software->bootloader_transaction_marker &&
+		   software->bootloader_state_marker &&
+		   !bootloader_env_begin();
+
+	ret = set_transaction_markers(software, newstate);
+	if (txn && bootloader_env_commit(true)) {
+		WARN("Cannot persistently store %s update state.", get_state_string(newstate));
+		ret = false;
+	}
+	software->stored_state = ret ? newstate : STATE_NOT_AVAILABLE;
+
+	return ret;
+}
+
 static int update_bootloader_env(struct swupdate_cfg *cfg, const char *script)
 {
 	int fd;
 	int ret = 0;
 	struct dict_entry *bootvar;
 	char buf[MAX_BOOT_SCRIPT_LINE_LENGTH];
+	struct timeline_span span;
+	bool installed = false;
 
 	fd = openfileoutput(script);
 	if (fd < 0)
@@ -182,55 +405,239 @@ static int update_bootloader_env(struct swupdate_cfg *cfg, const char *script)
 	}
 	close(fd);
 
-	if ((ret = bootloader_apply_list(script)) < 0) {
+	timeline_begin(&span);
+	SWU_PROBE(bootloader_commit_start);
+	ret = bootloader_env_begin();
+	if (!ret) {
+		ret = bootloader_apply_list(script);
+		/*
+		 * The images are installed: the update state goes into
+		 * the same write as the variables of the update. EFI Boot
+		 * Guard commits its own transaction on this state instead.
+		 */
+		if (ret >= 0 && !is_bootloader(BOOTLOADER_EBG) &&
+		    (cfg->bootloader_transaction_marker || cfg->bootloader_state_marker)) {
+			if (set_transaction_markers(cfg, STATE_INSTALLED))
+				installed = true;
+		}
+		if (ret < 0)
+			bootloader_env_commit(false);
+		else
+			ret = bootloader_env_commit(true);
+	}
+	if (installed && !ret)
+		cfg->stored_state = STATE_INSTALLED;
+	if (ret < 0) {
 		ERROR("Bootloader-specific error %d updating its environment", ret);
 	}
+	SWU_PROBE1(bootloader_commit_done, ret);
+	timeline_end(&span, "bootloader", "environment");
 	return ret;
 }
 
-static int run_prepost_scripts(struct imglist *list, script_fn type)
+/*
+ * Bootloader variables of the SWUs of a bundle but the last,
+ * they are written with the ones of the last SWU
+ */
+static struct dict bundle_bootenv;
+
+static int bundle_defer_bootenv(struct swupdate_cfg *cfg)
+{
+	struct dict_entry *bootvar;
+
+	LIST_FOREACH(bootvar, &cfg->bootloader, next) {
+		char *key = dict_entry_get_key(bootvar);
+		char *value = dict_entry_get_value(bootvar);
+
+		if (!key || !value)
+			continue;
+		if (dict_set_value(&bundle_bootenv, key, value))
+			return -ENOMEM;
+	}
+	if (!LIST_EMPTY(&cfg->bootloader))
+		TRACE("Bootloader environment deferred to the last SWU of the bundle");
+
+	return 0;
+}
+
+/* the variables of the last SWU override the deferred ones */
+static int bundle_merge_bootenv(struct swupdate_cfg *cfg)
+{
+	struct dict_entry *bootvar;
+	int ret = 0;
+
+	LIST_FOREACH(bootvar, &bundle_bootenv, next) {
+		char *key = dict_entry_get_key(bootvar);
+		char *value = dict_entry_get_value(bootvar);
+
+		if (!key || !value || dict_get_list(&cfg->bootloader, key))
+			continue;
+		if (dict_set_value(&cfg->bootloader, key, value)) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	bundle_drop();
+
+	return ret;
+}
+
+void bundle_drop(void)
 {
+	dict_drop_db(&bundle_bootenv);
+}
+
+static int run_script(struct img_type *img, struct installer_handler *hnd,
+		      script_fn type)
+{
+	struct script_handler_data data = {
+		.scriptfn = type,
+		.data = hnd->data
+	};
+	struct timeline_span span;
+	struct profile_sample sample;
+	uint64_t start;
+	int ret;
+
+	swupdate_progress_inc_step(img->fname, hnd->desc);
+	swupdate_progress_update(0);
+	timeline_begin(&span);
+	start = metrics_now();
+	profile_handler_begin(&sample);
+	SWU_PROBE2(handler_start, hnd->desc, img->fname);
+	ret = hnd->installer(img, &data);
+	SWU_PROBE3(handler_done, hnd->desc, img->fname, ret);
+	profile_handler_end(&sample, hnd->desc, img);
+	metrics_handler_duration(hnd->desc, start);
+	timeline_end(&span, type == PREINSTALL ? "preinstall" : "postinstall",
+		     img->fname);
+	swupdate_progress_update(100);
+	swupdate_progress_step_completed();
+
+	return ret;
+}
+
+/*
+ * Consecutive scripts with the "parallel" property set to "true"
+ * run at the same time. A script without it waits until they
+ * are done, and the scripts after it run only after it.
+ */
+struct script_job {
+	struct img_type *img;
+	struct installer_handler *hnd;
+	script_fn type;
+	pthread_t id;
+	bool started;
 	int ret;
+};
+
+static void *script_thread(void *data)
+{
+	struct script_job *job = (struct script_job *)data;
+
+	job->ret = run_script(job->img, job->hnd, job->type);
+	if (job->ret)
+		ERROR("Script %s failed", job->img->fname);
+
+	return NULL;
+}
+
+static int run_script_jobs(struct script_job **jobs, unsigned int *njobs)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (*njobs > 1)
+		TRACE("Running %u scripts in parallel", *njobs);
+
+	for (i = 0; i < *njobs; i++) {
+		struct script_job *job = &(*jobs)[i];
+
+		job->started = !pthread_create(&job->id, NULL, script_thread, job);
+		if (!job->started)
+			script_thread(job);
+	}
+
+	for (i = 0; i < *njobs; i++) {
+		struct script_job *job = &(*jobs)[i];
+
+		if (job->started)
+			pthread_join(job->id, NULL);
+		if (job->ret && !ret)
+			ret = job->ret;
+	}
+
+	free(*jobs);
+	*jobs = NULL;
+	*njobs = 0;
+
+	return ret;
+}
+
+static int run_prepost_scripts(struct imglist *list, script_fn type)
+{
+	int ret = 0;
 	struct img_type *img;
 	struct installer_handler *hnd;
+	struct script_job *jobs = NULL, *job;
+	unsigned int njobs = 0;
 
 	/* Scripts must be run before installing images */
 	LIST_FOREACH(img, list, next) {
 		if (!img->is_script)
 			continue;
 		hnd = find_handler(img);
-		if (hnd) {
-			struct script_handler_data data = {
-				.scriptfn = type,
-				.data = hnd->data
-			};
-
-			swupdate_progress_inc_step(img->fname, hnd->desc);
-			swupdate_progress_update(0);
-			ret = hnd->installer(img, &data);
-			swupdate_progress_update(100);
-			swupdate_progress_step_completed();
-			if (ret)
-				return ret;
+		if (!hnd)
+			continue;
+
+		if (strtobool(dict_get_value(&img->properties, "parallel"))) {
+			job = realloc(jobs, (njobs + 1) * sizeof(*job));
+			if (!job) {
+				ret = -ENOMEM;
+				break;
+			}
+			jobs = job;
+			job = &jobs[njobs++];
+			memset(job, 0, sizeof(*job));
+			job->img = img;
+			job->hnd = hnd;
+			job->type = type;
+			continue;
 		}
+
+		ret = run_script_jobs(&jobs, &njobs);
+		if (ret)
+			break;
+		ret = run_script(img, hnd, type);
+		if (ret)
+			break;
 	}
 
-	return 0;
+	if (!ret)
+		return run_script_jobs(&jobs, &njobs);
+
+	free(jobs);
+	return ret;
 }
 
 int install_single_image(struct img_type *img, bool dry_run)
 {
 	struct installer_handler *hnd;
+	struct timeline_span span;
+	struct profile_sample sample;
+	uint64_t start;
 	int ret;
 
 	/*
 	 * in case of dry run, replace the handler
-	 * with a dummy doing nothing
+	 * with a dummy doing nothing, unless it checks
+	 * the image without installing it
 	 */
-	if (dry_run)
-		strcpy(img->type, "dummy");
-
 	hnd = find_handler(img);
+	if (dry_run && (!hnd || !(hnd->mask & DRYRUN_HANDLER))) {
+		strcpy(img->type, "dummy");
+		hnd = find_handler(img);
+	}
 	if (!hnd) {
 		TRACE("Image Type %s not supported", img->type);
 		return -1;
@@ -240,17 +647,236 @@ int install_single_image(struct img_type *img, bool dry_run)
 	swupdate_progress_inc_step(img->fname, hnd->desc);
 
 	/* TODO : check callback to push results / progress */
+	timeline_begin(&span);
+	start = metrics_now();
+	profile_handler_begin(&sample);
+	SWU_PROBE2(handler_start, hnd->desc, img->fname);
 	ret = hnd->installer(img, hnd->data);
+	SWU_PROBE3(handler_done, hnd->desc, img->fname, ret);
+	profile_handler_end(&sample, hnd->desc, img);
+	metrics_handler_duration(hnd->desc, start);
+	timeline_end(&span, hnd->desc, img->fname);
+	/* what was probed on the device before is not valid anymore */
+	if (strlen(img->device) && !dry_run)
+		blkdev_cache_invalidate(img->device);
 	if (ret != 0) {
 		TRACE("Installer for %s not successful !",
 			hnd->desc);
-	}
+	} else if (!dry_run)
+		content_check_installed(img);
 
 	swupdate_progress_step_completed();
 
 	return ret;
 }
 
+/*
+ * Images with the same "install-group" property are installed
+ * in order by the same thread, different groups concurrently.
+ * The images of a batch are installed when an image without
+ * group is found, or at the end of the list. A group with a
+ * handler that is not registered with PARALLEL_HANDLER is
+ * installed alone, after the other groups.
+ */
+struct install_group {
+	const char *name;
+	struct img_type **imgs;
+	unsigned int nimgs;
+	bool dry_run;
+	bool serial;
+	pthread_t id;
+	bool started;
+	int ret;
+};
+
+struct install_batch {
+	struct install_group *groups;
+	unsigned int ngroups;
+};
+
+static void *install_group_thread(void *data)
+{
+	struct install_group *group = (struct install_group *)data;
+	unsigned int i;
+
+	for (i = 0; i < group->nimgs; i++) {
+		struct img_type *img = group->imgs[i];
+
+		if (!group->ret) {
+			group->ret = install_single_image(img, group->dry_run);
+			if (group->ret)
+				ERROR("Installing %s in group %s failed",
+				      img->fname, group->name);
+		}
+		close(img->fdin);
+		staging_release(img);
+	}
+
+	return NULL;
+}
+
+static int install_batch_add(struct install_batch *batch, const char *name,
+			     struct img_type *img, bool dry_run)
+{
+	struct install_group *group = NULL;
+	struct img_type **imgs;
+	unsigned int i;
+
+	for (i = 0; i < batch->ngroups; i++) {
+		if (!strcmp(batch->groups[i].name, name)) {
+			group = &batch->groups[i];
+			break;
+		}
+	}
+	if (!group) {
+		group = realloc(batch->groups, (batch->ngroups + 1) * sizeof(*group));
+		if (!group)
+			return -ENOMEM;
+		batch->groups = group;
+		group = &batch->groups[batch->ngroups++];
+		memset(group, 0, sizeof(*group));
+		group->name = name;
+		group->dry_run = dry_run;
+	}
+
+	imgs = realloc(group->imgs, (group->nimgs + 1) * sizeof(*imgs));
+	if (!imgs)
+		return -ENOMEM;
+	group->imgs = imgs;
+	group->imgs[group->nimgs++] = img;
+	if (!group->serial && !(get_handler_mask(img) & PARALLEL_HANDLER)) {
+		TRACE("Group %s is installed alone, %s cannot run in parallel",
+		      name, img->type);
+		group->serial = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Run all groups of the batch and wait until they are done.
+ * If a thread cannot be started, the group is installed
+ * by the caller, as the serial groups are.
+ */
+static int install_batch_run(struct install_batch *batch)
+{
+	unsigned int i, parallel = 0;
+	int ret = 0;
+
+	for (i = 0; i < batch->ngroups; i++)
+		parallel += !batch->groups[i].serial;
+	if (parallel)
+		TRACE("Installing %u groups in parallel", parallel);
+
+	for (i = 0; i < batch->ngroups; i++) {
+		struct install_group *group = &batch->groups[i];
+
+		if (group->serial)
+			continue;
+		group->started = !pthread_create(&group->id, NULL,
+						 install_group_thread, group);
+		if (!group->started)
+			install_group_thread(group);
+	}
+
+	for (i = 0; i < batch->ngroups; i++) {
+		struct install_group *group = &batch->groups[i];
+
+		if (group->started)
+			pthread_join(group->id, NULL);
+		if (group->ret && !ret)
+			ret = group->ret;
+	}
+
+	/* after an error, the images are only closed */
+	for (i = 0; i < batch->ngroups; i++) {
+		struct install_group *group = &batch->groups[i];
+
+		if (group->serial) {
+			group->ret = ret;
+			install_group_thread(group);
+			if (group->ret && !ret)
+				ret = group->ret;
+		}
+		free(group->imgs);
+	}
+
+	free(batch->groups);
+	batch->groups = NULL;
+	batch->ngroups = 0;
+
+	return ret;
+}
+
+/*
+ * Open the copy of the image in TMPDIR
+ */
+static int open_tmp_image(struct img_type *img)
+{
+	const char* TMPDIR = get_tmpdir();
+	char *filename;
+	struct stat buf;
+	int fd;
+
+	fd = staging_open(img);
+	if (fd != -ENOENT)
+		return fd;
+
+	if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
+			ENOMEM_ASPRINTF) {
+		ERROR("Path too long: %s%s", TMPDIR, img->fname);
+		return -1;
+	}
+
+	if (stat(filename, &buf)) {
+		TRACE("%s not found or wrong", filename);
+		free(filename);
+		return -1;
+	}
+	img->size = buf.st_size;
+	fd = open(filename, O_RDONLY);
+	free(filename);
+	if (fd < 0)
+		ERROR("Image %s cannot be opened", img->fname);
+
+	return fd;
+}
+
+/*
+ * Open the image where it was indexed in the SWU: each image
+ * gets its own file description, so that images can be read
+ * concurrently and in any order
+ */
+static int open_indexed_image(struct swupdate_cfg *sw, struct img_type *img)
+{
+	char path[32];
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", sw->swu_fd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR("Image %s cannot be opened: %s", img->fname, strerror(errno));
+		return -1;
+	}
+	if (lseek(fd, img->offset, SEEK_SET) < 0) {
+		ERROR("Image %s cannot be reached in SWU: %s", img->fname,
+		      strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Open the data of an image that is not streamed, from TMPDIR
+ * or from the SWU if the images were indexed
+ */
+int open_image_data(struct swupdate_cfg *sw, struct img_type *img)
+{
+	return sw->swu_fd >= 0 ? open_indexed_image(sw, img) : open_tmp_image(img);
+}
+
 /*
  * streamfd: file descriptor if it is required to extract
  *           images from the stream (update from file)
@@ -261,11 +887,12 @@ int install_images(struct swupdate_cfg *sw)
 {
 	int ret;
 	struct img_type *img, *tmp;
-	char *filename;
-	struct stat buf;
 	const char* TMPDIR = get_tmpdir();
 	bool dry_run = sw->parms.dry_run;
+	bool indexed = sw->swu_fd >= 0;
 	bool dropimg;
+	struct install_batch batch = { .groups = NULL, .ngroups = 0 };
+	const char *group;
 
 	/* Extract all scripts, preinstall scripts must be run now */
 	const char* tmpdir_scripts = get_tmpdirscripts();
@@ -296,36 +923,23 @@ int install_images(struct swupdate_cfg *sw)
 		 *  This does not make sense when installed from file,
 		 *  because images are seekd (no streaming)
 		 */
-		if (img->install_directly)
+		if (img->install_directly && !indexed)
 			continue;
 
-		if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
-				ENOMEM_ASPRINTF) {
-				ERROR("Path too long: %s%s", TMPDIR, img->fname);
-				return -1;
-		}
-
-		ret = stat(filename, &buf);
-		if (ret) {
-			TRACE("%s not found or wrong", filename);
-			free(filename);
-			return -1;
-		}
-		img->size = buf.st_size;
-		img->fdin = open(filename, O_RDONLY);
-		free(filename);
+		img->fdin = open_image_data(sw, img);
 		if (img->fdin < 0) {
-			ERROR("Image %s cannot be opened",
-			img->fname);
+			install_batch_run(&batch);
 			return -1;
 		}
 
-		if ((strlen(img->path) > 0) &&
+		if (!indexed && (strlen(img->path) > 0) &&
 			(strlen(img->extract_file) > 0) &&
 			(strncmp(img->path, img->extract_file, sizeof(img->path)) == 0)){
 			struct img_type *tmpimg;
 			WARN("Temporary and final location for %s is identical, skip "
 			     "processing.", img->path);
+			/* the index must not refer to a dropped image */
+			artifact_index_free(sw);
 			LIST_REMOVE(img, next);
 			LIST_FOREACH(tmpimg, &sw->images, next) {
 				if (strncmp(tmpimg->fname, img->fname, sizeof(img->fname)) == 0) {
@@ -336,19 +950,37 @@ int install_images(struct swupdate_cfg *sw)
 			}
 			dropimg = true;
 			ret = 0;
+		} else if ((group = dict_get_value(&img->properties, "install-group"))) {
+			/* installed and closed later by the group thread */
+			ret = install_batch_add(&batch, group, img, dry_run);
+			if (ret) {
+				close(img->fdin);
+				install_batch_run(&batch);
+				return ret;
+			}
+			continue;
 		} else {
-			ret = install_single_image(img, dry_run);
+			/* Images without group must wait for the previous ones */
+			ret = install_batch_run(&batch);
+			if (!ret)
+				ret = install_single_image(img, dry_run);
 		}
 
 		close(img->fdin);
 
 		if (dropimg)
 			free_image(img);
+		else if (!indexed)
+			staging_release(img);
 
 		if (ret)
 			return ret;
 	}
 
+	ret = install_batch_run(&batch);
+	if (ret)
+		return ret;
+
 	/*
 	 * Skip scripts in dry-run mode
 	 */
@@ -362,7 +994,24 @@ int install_images(struct swupdate_cfg *sw)
 		return ret;
 	}
 
-	if (!LIST_EMPTY(&sw->bootloader)) {
+	/* Apply what the handlers deferred to the end */
+	ret = run_commit_hooks(true);
+	if (ret) {
+		ERROR("committing the installed images failed");
+		return ret;
+	}
+
+	if (sw->bundle == BUNDLE_NEXT) {
+		ret = bundle_defer_bootenv(sw);
+		if (ret)
+			return ret;
+	} else if (sw->bundle == BUNDLE_LAST) {
+		ret = bundle_merge_bootenv(sw);
+		if (ret)
+			return ret;
+	}
+
+	if (sw->bundle != BUNDLE_NEXT && !LIST_EMPTY(&sw->bootloader)) {
 		char* bootscript = alloca(strlen(TMPDIR)+strlen(BOOT_SCRIPT_SUFFIX)+1);
 		sprintf(bootscript, "%s%s", TMPDIR, BOOT_SCRIPT_SUFFIX);
 		ret = update_bootloader_env(sw, bootscript);
@@ -401,9 +1050,84 @@ static void cleaup_img_entry(struct img_type *img)
 	}
 }
 
+/*
+ * Images are owned by the running update and released
+ * at once in cleanup_files()
+ */
+static struct arena update_arena = ARENA_INITIALIZER;
+
+struct img_type *alloc_image(void)
+{
+	return (struct img_type *)arena_alloc(&update_arena, sizeof(struct img_type));
+}
+
+/* the strings of struct img_type set with img_set_string() */
+static const size_t img_strings[] = {
+	offsetof(struct img_type, volname),
+	offsetof(struct img_type, mtdname),
+	offsetof(struct img_type, type_data),
+	offsetof(struct img_type, filesystem),
+};
+
+#define IMG_STRING_FIELD(img, i) ((const char **)((char *)(img) + img_strings[i]))
+
 void free_image(struct img_type *img) {
+	const char *s;
+
 	dict_drop_db(&img->properties);
-	free(img);
+	for (unsigned int i = 0; i < ARRAY_SIZE(img_strings); i++) {
+		s = *IMG_STRING_FIELD(img, i);
+		if (s && !arena_owns(&update_arena, s))
+			free((char *)s);
+	}
+	if (!arena_owns(&update_arena, img))
+		free(img);
+}
+
+/*
+ * Like the images, the strings are released with the update.
+ * An empty value is not stored.
+ */
+int img_set_string(const char **field, const char *value)
+{
+	char *s = NULL;
+
+	if (value && *value) {
+		s = arena_strdup(&update_arena, value);
+		if (!s)
+			return -ENOMEM;
+	}
+	*field = s;
+
+	return 0;
+}
+
+/*
+ * dst is a copy of src, its strings are duplicated. An image
+ * outliving the update has them on the heap.
+ */
+int img_copy_strings(struct img_type *dst, const struct img_type *src, bool heap)
+{
+	const char *s;
+	const char **d;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(img_strings); i++)
+		*IMG_STRING_FIELD(dst, i) = NULL;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(img_strings); i++) {
+		s = *IMG_STRING_FIELD(src, i);
+		d = IMG_STRING_FIELD(dst, i);
+		if (!s)
+			continue;
+		if (heap)
+			*d = strdup(s);
+		else
+			img_set_string(d, s);
+		if (!*d)
+			return -ENOMEM;
+	}
+
+	return 0;
 }
 
 void cleanup_files(struct swupdate_cfg *software) {
@@ -415,6 +1139,12 @@ void cleanup_files(struct swupdate_cfg *software) {
 	const char* TMPDIR = get_tmpdir();
 	struct imglist *list[] = {&software->scripts, &software->bootscripts};
 
+	free_zstd_dictionaries();
+	staging_cleanup();
+	blkdev_cache_free();
+	img_free_space_reset();
+	artifact_index_free(software);
+
 	LIST_FOREACH_SAFE(img, &software->images, next, img_tmp) {
 		if (img->fname[0]) {
 			if (asprintf(&fn, "%s%s", TMPDIR,
@@ -438,6 +1168,12 @@ void cleanup_files(struct swupdate_cfg *software) {
 	}
 
 	dict_drop_db(&software->bootloader);
+	software->stored_state = STATE_NOT_AVAILABLE;
+
+	if (software->swu_fd >= 0) {
+		close(software->swu_fd);
+		software->swu_fd = -1;
+	}
 
 	if (asprintf(&fn, "%s%s", TMPDIR, BOOT_SCRIPT_SUFFIX) != ENOMEM_ASPRINTF) {
 		remove_sw_file(fn);
@@ -458,6 +1194,11 @@ void cleanup_files(struct swupdate_cfg *software) {
 		free(fn);
 	}
 #endif
+
+	lua_scripts_release();
+
+	TRACE("Releasing %zu bytes of update memory", update_arena.allocated);
+	arena_release(&update_arena);
 }
 
 int preupdatecmd(struct swupdate_cfg *swcfg)
@@ -465,6 +1206,8 @@ int preupdatecmd(struct swupdate_cfg *swcfg)
 	if (swcfg) {
 		if (swcfg->parms.dry_run) {
 			DEBUG("Dry run, skipping Pre-update command");
+		} else if (swcfg->in_bundle) {
+			DEBUG("Pre-update command already run for the bundle");
 		} else {
 			DEBUG("Running Pre-update command");
 			return run_system_cmd(swcfg->preupdatecmd);
@@ -0,0 +1,355 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "util.h"
+#include "pctl.h"
+#include "swupdate_membudget.h"
+#include "swupdate_metrics.h"
+#include "ipc_ring.h"
+
+/*
+ * Only one update runs at a time, so only one connection has a ring.
+ * The tail is the one of SWUpdate, the copy in the ring is for the client.
+ */
+static struct {
+	int fd;
+	struct ipc_ring *ring;
+	uint32_t tail;
+} attached = { .fd = -1 };
+
+/*
+ * Reader of a connection without ring: a thread drains it into a
+ * bounded buffer ahead of the installer, ipc_ring_read() takes the data
+ * from there. head and tail count the bytes written and read, the
+ * thread fills only what is free and the installer copies only what
+ * is filled, the lock protects the counters.
+ */
+static struct {
+	int fd;
+	int stopfd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t freed;
+	bool running;		/* the thread is not joined yet */
+	bool stopping;
+	bool done;		/* nothing more is read from fd */
+	unsigned char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	size_t peak;
+	int error;		/* returned once the data is consumed */
+} ahead = {
+	.fd = -1,
+	.stopfd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.filled = PTHREAD_COND_INITIALIZER,
+	.freed = PTHREAD_COND_INITIALIZER
+};
+
+static bool client_alive(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = 0 };
+
+	return poll(&pfd, 1, 0) >= 0 && !(pfd.revents & (POLLHUP | POLLERR));
+}
+
+int ipc_ring_attach(int connfd)
+{
+	size_t len = ipc_ring_len(IPC_RING_SIZE);
+	struct ipc_ring *ring;
+	int fd;
+
+	if (attached.ring)
+		return -EBUSY;
+
+	/*
+	 * The size is sealed before the fd is passed: the client cannot
+	 * shrink the memory under the mapping of the installer
+	 */
+	fd = memfd_create("swupdate-ipc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 || ftruncate(fd, len) < 0 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		WARN("Memory cannot be shared with the client: %s", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -ENOMEM;
+	}
+	ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		WARN("Memory cannot be shared with the client: %s", strerror(errno));
+		close(fd);
+		return -ENOMEM;
+	}
+
+	/* a new memfd is zeroed, counters start from 0 */
+	ring->size = IPC_RING_SIZE;
+	ring->magic = IPC_RING_MAGIC;
+
+	attached.fd = connfd;
+	attached.ring = ring;
+	attached.tail = 0;
+
+	return fd;
+}
+
+bool ipc_ring_attached(int fd)
+{
+	return fd >= 0 && fd == attached.fd;
+}
+
+static void readahead_level(size_t level)
+{
+	metrics_set_gauge(METRICS_STREAM_BUFFERED, level);
+	if (level > ahead.peak) {
+		ahead.peak = level;
+		metrics_set_gauge(METRICS_STREAM_BUFFER_PEAK, level);
+	}
+}
+
+static void *readahead_thread(void __attribute__ ((__unused__)) *data)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = ahead.fd, .events = POLLIN },
+		{ .fd = ahead.stopfd, .events = POLLIN }
+	};
+	size_t off, room;
+	ssize_t n;
+	int error = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ahead.lock);
+		while (ahead.head - ahead.tail == ahead.size && !ahead.stopping)
+			pthread_cond_wait(&ahead.freed, &ahead.lock);
+		off = ahead.head % ahead.size;
+		room = min(ahead.size - (ahead.head - ahead.tail), ahead.size - off);
+		pthread_mutex_unlock(&ahead.lock);
+
+		/* the installer is never kept waiting for a read in progress */
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error = errno;
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (!pfd[0].revents)
+			continue;
+		n = read(ahead.fd, ahead.buf + off, room);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n < 0)
+			error = errno;
+		if (n <= 0)
+			break;
+
+		pthread_mutex_lock(&ahead.lock);
+		ahead.head += n;
+		readahead_level(ahead.head - ahead.tail);
+		pthread_cond_signal(&ahead.filled);
+		pthread_mutex_unlock(&ahead.lock);
+	}
+
+	pthread_mutex_lock(&ahead.lock);
+	ahead.error = error;
+	ahead.done = true;
+	pthread_cond_signal(&ahead.filled);
+	pthread_mutex_unlock(&ahead.lock);
+
+	return NULL;
+}
+
+static void readahead_release(void)
+{
+	free(ahead.buf);
+	membudget_release(ahead.size);
+	if (ahead.stopfd >= 0)
+		close(ahead.stopfd);
+	ahead.buf = NULL;
+	ahead.size = ahead.head = ahead.tail = 0;
+	ahead.stopping = ahead.done = false;
+	ahead.error = 0;
+	ahead.stopfd = -1;
+	ahead.fd = -1;
+	metrics_set_gauge(METRICS_STREAM_BUFFERED, 0);
+}
+
+int ipc_ring_readahead(int fd, size_t max)
+{
+	struct stat st;
+
+	/* a ring already buffers, a file does not need it */
+	if (fd < 0 || ipc_ring_attached(fd) || fstat(fd, &st) < 0 ||
+	    S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+		return -EOPNOTSUPP;
+	if (ahead.fd >= 0)
+		return -EBUSY;
+	if (!max || !membudget_reserve(max))
+		return -ENOMEM;
+
+	ahead.size = max;
+	ahead.buf = malloc(max);
+	ahead.stopfd = eventfd(0, EFD_CLOEXEC);
+	ahead.fd = fd;
+	ahead.peak = 0;
+	metrics_set_gauge(METRICS_STREAM_BUFFER_PEAK, 0);
+	if (!ahead.buf || ahead.stopfd < 0 ||
+	    start_worker_thread(&ahead.thread, readahead_thread, NULL)) {
+		readahead_release();
+		return -ENOMEM;
+	}
+	ahead.running = true;
+
+	return 0;
+}
+
+void ipc_ring_readahead_stop(int fd)
+{
+	uint64_t one = 1;
+
+	if (fd < 0 || fd != ahead.fd || !ahead.running)
+		return;
+	pthread_mutex_lock(&ahead.lock);
+	ahead.stopping = true;
+	pthread_cond_signal(&ahead.freed);
+	pthread_mutex_unlock(&ahead.lock);
+	if (write(ahead.stopfd, &one, sizeof(one)) < 0)
+		WARN("Reader of the stream cannot be stopped: %s", strerror(errno));
+	pthread_join(ahead.thread, NULL);
+	ahead.running = false;
+	TRACE("Up to %zu bytes of the stream were buffered", ahead.peak);
+}
+
+bool ipc_ring_pending(int fd)
+{
+	return fd >= 0 && fd == ahead.fd;
+}
+
+static ssize_t readahead_read(void *buf, size_t count)
+{
+	size_t avail, off, n;
+	int error;
+
+	if (!count)
+		return 0;
+
+	pthread_mutex_lock(&ahead.lock);
+	while (ahead.head == ahead.tail && !ahead.done)
+		pthread_cond_wait(&ahead.filled, &ahead.lock);
+	avail = ahead.head - ahead.tail;
+	error = ahead.error;
+	if (!avail)
+		ahead.error = 0;
+	pthread_mutex_unlock(&ahead.lock);
+	if (!avail) {
+		if (!error)
+			return 0;
+		errno = error;
+		return -1;
+	}
+
+	/* the thread does not write what is not read yet */
+	n = min(count, avail);
+	off = ahead.tail % ahead.size;
+	if (n > ahead.size - off) {
+		memcpy(buf, ahead.buf + off, ahead.size - off);
+		memcpy((unsigned char *)buf + ahead.size - off, ahead.buf,
+		       n - (ahead.size - off));
+	} else
+		memcpy(buf, ahead.buf + off, n);
+
+	pthread_mutex_lock(&ahead.lock);
+	ahead.tail += n;
+	metrics_set_gauge(METRICS_STREAM_BUFFERED, ahead.head - ahead.tail);
+	pthread_cond_signal(&ahead.freed);
+	pthread_mutex_unlock(&ahead.lock);
+
+	return n;
+}
+
+/*
+ * The stream ends when the client says so or closes the connection,
+ * as with the socket
+ */
+ssize_t ipc_ring_read(int fd, void *buf, size_t count)
+{
+	struct ipc_ring *ring = attached.ring;
+	uint32_t tail = attached.tail;
+	uint32_t seen, avail, off, n;
+
+	if (ipc_ring_pending(fd))
+		return readahead_read(buf, count);
+	if (!ipc_ring_attached(fd))
+		return read(fd, buf, count);
+	if (!count)
+		return 0;
+
+	/* the event is read first, a later change of head bumps it */
+	for (;;) {
+		seen = ipc_ring_get(&ring->filled);
+		avail = ipc_ring_get(&ring->head) - tail;
+		if (avail || ipc_ring_get(&ring->eof))
+			break;
+		if (ipc_ring_wait(&ring->filled, seen) == ETIMEDOUT &&
+		    !client_alive(fd))
+			break;
+	}
+	if (!avail)
+		return 0;
+	if (avail > IPC_RING_SIZE) {
+		ERROR("Shared memory of the client is corrupted");
+		errno = EIO;
+		return -1;
+	}
+
+	/* the client does not write what is not read yet */
+	n = count < avail ? count : avail;
+	off = tail % IPC_RING_SIZE;
+	if (n > IPC_RING_SIZE - off) {
+		memcpy(buf, ring->data + off, IPC_RING_SIZE - off);
+		memcpy((unsigned char *)buf + IPC_RING_SIZE - off, ring->data,
+		       n - (IPC_RING_SIZE - off));
+	} else
+		memcpy(buf, ring->data + off, n);
+
+	attached.tail = tail + n;
+	ipc_ring_set(&ring->tail, attached.tail);
+	ipc_ring_post(&ring->freed);
+
+	return n;
+}
+
+void ipc_ring_detach(int fd)
+{
+	struct ipc_ring *ring = attached.ring;
+
+	if (ipc_ring_pending(fd)) {
+		ipc_ring_readahead_stop(fd);
+		readahead_release();
+	}
+	if (!ipc_ring_attached(fd))
+		return;
+	ipc_ring_set(&ring->closed, 1);
+	ipc_ring_post(&ring->freed);
+	munmap(ring, ipc_ring_len(IPC_RING_SIZE));
+	attached.ring = NULL;
+	attached.fd = -1;
+}
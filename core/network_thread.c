@@ -18,10 +18,13 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 
 #include "bsdqueue.h"
 #include "util.h"
@@ -33,6 +36,12 @@
 #include "pctl.h"
 #include "generated/autoconf.h"
 #include "state.h"
+#include "swupdate_timeline.h"
+#include "swupdate_metrics.h"
+#include "swupdate_profile.h"
+#include "swupdate_probes.h"
+#include "swupdate_priority.h"
+#include "ipc_ring.h"
 
 #ifdef CONFIG_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -60,6 +69,7 @@ static pthread_mutex_t msglock = PTHREAD_MUTEX_INITIALIZER;
 struct subprocess_msg_elem {
 	ipc_message message;
 	int client;
+	int version;
 	SIMPLEQ_ENTRY(subprocess_msg_elem) next;
 };
 
@@ -70,13 +80,74 @@ static pthread_t subprocess_ipc_handler_thread_id;
 static pthread_mutex_t subprocess_msg_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t subprocess_wkup = PTHREAD_COND_INITIALIZER;
 
+#define NOTIFY_RING_SIZE	(32 * 1024)
+
 struct notify_conn {
 	SIMPLEQ_ENTRY(notify_conn) next;
 	int sockfd;
+	int version;
+	char *ring;		/* packed messages to be sent */
+	size_t head;		/* written by the notifier */
+	size_t tail;		/* written by the sender thread */
+	unsigned long dropped;	/* since the last notice */
+	unsigned long total_dropped;
 };
 
 SIMPLEQ_HEAD(connections, notify_conn);
 static struct connections notify_conns;
+static int notify_wakeup[2] = {-1, -1};
+
+#define CTRL_MAX_CONNS		256
+#define CTRL_MAX_EVENTS		32
+
+/* Client of the control socket whose request is not complete yet */
+struct ctrl_conn {
+	int fd;
+	int passedfd;
+	time_t start;
+	size_t len;
+	char buf[sizeof(ipc_message) + 16];
+	LIST_ENTRY(ctrl_conn) next;
+};
+
+static LIST_HEAD(, ctrl_conn) ctrl_conns = LIST_HEAD_INITIALIZER(ctrl_conns);
+static unsigned int nctrl_conns;
+
+#ifdef CONFIG_METRICS
+/*
+ * Sample the depth of the IPC queues and write
+ * a snapshot of the metrics to TMPDIR
+ */
+static int write_metrics(char *path, size_t len)
+{
+	struct notify_conn *conn;
+	struct subprocess_msg_elem *elem;
+	uint64_t subscribers = 0, queued = 0, dropped = 0, pending = 0;
+
+	pthread_mutex_lock(&msglock);
+	SIMPLEQ_FOREACH(conn, &notify_conns, next) {
+		subscribers++;
+		queued += __atomic_load_n(&conn->head, __ATOMIC_ACQUIRE) -
+			  __atomic_load_n(&conn->tail, __ATOMIC_ACQUIRE);
+		dropped += conn->total_dropped;
+	}
+	metrics_set_gauge(METRICS_CACHED_MESSAGES, nrmsgs);
+	pthread_mutex_unlock(&msglock);
+
+	pthread_mutex_lock(&subprocess_msg_lock);
+	SIMPLEQ_FOREACH(elem, &subprocess_messages, next)
+		pending++;
+	pthread_mutex_unlock(&subprocess_msg_lock);
+
+	metrics_set_gauge(METRICS_NOTIFY_SUBSCRIBERS, subscribers);
+	metrics_set_gauge(METRICS_NOTIFY_QUEUED_BYTES, queued);
+	metrics_set_gauge(METRICS_NOTIFY_DROPPED, dropped);
+	metrics_set_gauge(METRICS_SUBPROCESS_QUEUE, pending);
+
+	snprintf(path, len, "%s%s", get_tmpdir(), METRICS_FILENAME);
+	return metrics_write(path);
+}
+#endif
 
 static bool is_selection_allowed(const char *software_set, char *running_mode,
 				 struct dict const *acceptedlist)
@@ -125,51 +196,195 @@ static void clean_msg(char *msg, char drop)
 	}
 }
 
-static int write_notify_msg(ipc_message *msg, int sockfd)
+/*
+ * Each subscriber has its own ring of packed messages. The notifier
+ * queues the messages (under msglock, it is called from any thread)
+ * and the sender thread, the only consumer, writes them without
+ * blocking. If a subscriber does not read fast enough, new messages
+ * are dropped and a notice with their number is queued as soon as
+ * there is room again: the installer is never slowed down by a client.
+ */
+static void notify_conn_wakeup(void)
 {
-	void *buf;
-	size_t count;
-	ssize_t n;
-	int ret = 0;
+	char c = 0;
 
-	buf = msg;
-	count = sizeof(*msg);
-	while (count > 0) {
-		n = send(sockfd, buf, count, MSG_NOSIGNAL);
-		if (n <= 0) {
-			/*
-			 * We can't use the notify methods for error logging here as it will cause a deadlock.
-			 */
-			if (n == 0) {
-				fprintf(stderr, "Error: A status client is not responding, removing it.\n");
-			}
-			ret = -1;
-			break;
-		}
-		count -= (size_t)n;
-		buf = (char*)buf + n;
+	if (write(notify_wakeup[1], &c, 1) < 0) {
+		/* the pipe is full, the sender is going to run anyway */
 	}
-	return ret;
+}
+
+static bool notify_ring_put(struct notify_conn *conn, const char *buf, size_t len)
+{
+	size_t tail = __atomic_load_n(&conn->tail, __ATOMIC_ACQUIRE);
+	size_t head = conn->head;
+	size_t pos, first;
+
+	if (NOTIFY_RING_SIZE - (head - tail) < len)
+		return false;
+
+	pos = head % NOTIFY_RING_SIZE;
+	first = min(len, NOTIFY_RING_SIZE - pos);
+	memcpy(conn->ring + pos, buf, first);
+	memcpy(conn->ring, buf + first, len - first);
+	__atomic_store_n(&conn->head, head + len, __ATOMIC_RELEASE);
+
+	return true;
 }
 
 /*
  * This must be called after acquiring the mutex
  * for the msglock structure
  */
+static void notify_conn_push(struct notify_conn *conn, ipc_message *msg)
+{
+	char buf[sizeof(ipc_message) + 3 * sizeof(int)];
+	ipc_message notice;
+	int len;
+
+	if (conn->dropped) {
+		memset(&notice, 0, sizeof(notice));
+		notice.magic = IPC_MAGIC;
+		notice.type = NOTIFY_STREAM;
+		notice.data.notify.status = msg->data.notify.status;
+		notice.data.notify.level = WARNLEVEL;
+		snprintf(notice.data.notify.msg, sizeof(notice.data.notify.msg),
+			 "%lu notifications dropped", conn->dropped);
+		len = ipc_pack_msg(&notice, conn->version, buf, sizeof(buf));
+		if (len < 0 || !notify_ring_put(conn, buf, len)) {
+			conn->dropped++;
+			conn->total_dropped++;
+			return;
+		}
+		conn->dropped = 0;
+	}
+
+	len = ipc_pack_msg(msg, conn->version, buf, sizeof(buf));
+	if (len < 0 || !notify_ring_put(conn, buf, len)) {
+		conn->dropped++;
+		conn->total_dropped++;
+	}
+}
+
 static void send_notify_msg(ipc_message *msg)
 {
-	struct notify_conn *conn, *tmp;
-	int ret;
+	struct notify_conn *conn;
+
+	SIMPLEQ_FOREACH(conn, &notify_conns, next) {
+		notify_conn_push(conn, msg);
+	}
+	notify_conn_wakeup();
+}
+
+static void notify_conn_close(struct notify_conn *conn)
+{
+	pthread_mutex_lock(&msglock);
+	SIMPLEQ_REMOVE(&notify_conns, conn, notify_conn, next);
+	pthread_mutex_unlock(&msglock);
+
+	/*
+	 * We can't use the notify methods for error logging here as it will cause a deadlock.
+	 */
+	if (conn->total_dropped)
+		fprintf(stderr, "Status client removed, %lu notifications were dropped.\n",
+			conn->total_dropped);
+	close(conn->sockfd);
+	free(conn->ring);
+	free(conn);
+}
+
+/*
+ * Returns false if the subscriber must be removed
+ */
+static bool notify_conn_flush(struct notify_conn *conn)
+{
+	size_t head = __atomic_load_n(&conn->head, __ATOMIC_ACQUIRE);
+	size_t tail = conn->tail;
+	size_t pos, len;
+	ssize_t n;
+
+	while (head != tail) {
+		pos = tail % NOTIFY_RING_SIZE;
+		len = min(head - tail, NOTIFY_RING_SIZE - pos);
+		n = send(conn->sockfd, conn->ring + pos, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return false;
+		}
+		if (n == 0)
+			return false;
+		tail += n;
+		__atomic_store_n(&conn->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+static void *notify_sender_thread(void __attribute__ ((__unused__)) *data)
+{
+	struct pollfd *fds = NULL;
+	struct notify_conn **conns = NULL;
+	struct notify_conn *conn;
+	unsigned int nfds, size = 0, i;
+	char buf[64];
+
+	thread_ready();
+
+	while (1) {
+		pthread_mutex_lock(&msglock);
+		nfds = 1;
+		SIMPLEQ_FOREACH(conn, &notify_conns, next) {
+			nfds++;
+		}
+		if (nfds > size) {
+			struct pollfd *newfds = realloc(fds, nfds * sizeof(*fds));
+			struct notify_conn **newconns = realloc(conns, nfds * sizeof(*conns));
+
+			if (newfds)
+				fds = newfds;
+			if (newconns)
+				conns = newconns;
+			if (!newfds || !newconns) {
+				pthread_mutex_unlock(&msglock);
+				sleep(1);
+				continue;
+			}
+			size = nfds;
+		}
+		fds[0].fd = notify_wakeup[0];
+		fds[0].events = POLLIN;
+		nfds = 1;
+		SIMPLEQ_FOREACH(conn, &notify_conns, next) {
+			conns[nfds] = conn;
+			fds[nfds].fd = conn->sockfd;
+			/* Hangups are reported even without pending data */
+			fds[nfds].events = conn->head != conn->tail ? POLLOUT : 0;
+			nfds++;
+		}
+		pthread_mutex_unlock(&msglock);
+
+		if (poll(fds, nfds, -1) < 0)
+			continue;
 
-	SIMPLEQ_FOREACH_SAFE(conn, &notify_conns, next, tmp) {
-		ret = write_notify_msg(msg, conn->sockfd);
-		if (ret < 0) {
-			close(conn->sockfd);
-			SIMPLEQ_REMOVE(&notify_conns, conn,
-						   notify_conn, next);
-			free(conn);
+		if (fds[0].revents & POLLIN) {
+			while (read(notify_wakeup[0], buf, sizeof(buf)) > 0);
+		}
+
+		/*
+		 * Only this thread removes subscribers, conns[] is valid
+		 */
+		for (i = 1; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+			if ((fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ||
+			    !notify_conn_flush(conns[i]))
+				notify_conn_close(conns[i]);
 		}
 	}
+
+	return NULL;
 }
 
 static void network_notifier(RECOVERY_STATUS status, int error, int level, const char *msg)
@@ -327,9 +542,13 @@ static void unlink_socket(void)
 static void send_subprocess_reply(
 		const struct subprocess_msg_elem *const subprocess_msg)
 {
-	if (write(subprocess_msg->client, &subprocess_msg->message,
-			sizeof(subprocess_msg->message)) < 0)
-		ERROR("Error writing on ctrl socket: %s", strerror(errno));
+	int ret = ipc_send_msg(subprocess_msg->client, &subprocess_msg->message,
+			       subprocess_msg->version);
+
+	SWU_PROBE3(ipc_send, subprocess_msg->message.type,
+		   subprocess_msg->client, ret);
+	if (ret)
+		ERROR("Error writing on ctrl socket: %s", strerror(-ret));
 }
 
 static void handle_subprocess_ipc(struct subprocess_msg_elem *subprocess_msg)
@@ -436,21 +655,436 @@ static void *subprocess_thread (void *data)
 	return NULL;
 }
 
-void *network_thread (void *data)
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC	0
+#endif
+
+static time_t ctrl_now(void)
 {
-	struct installer *instp = (struct installer *)data;
-	int ctrllisten, ctrlconnfd;
-	socklen_t clilen;
-	struct sockaddr_un cliaddr;
-	ipc_message msg;
-	int nread;
-	struct msg_elem *notification, *tmp;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static int ctrl_epoll_add(int epfd, int fd, struct ctrl_conn *c)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = c
+	};
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void ctrl_conn_free(int epfd, struct ctrl_conn *c)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	if (c->passedfd >= 0)
+		close(c->passedfd);
+	LIST_REMOVE(c, next);
+	nctrl_conns--;
+	free(c);
+}
+
+static void ctrl_accept(int epfd, int ctrllisten)
+{
+	struct ctrl_conn *c;
+	int fd;
+
+	fd = accept4(ctrllisten, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			TRACE("Accept returns: %s", strerror(errno));
+		return;
+	}
+	if (nctrl_conns >= CTRL_MAX_CONNS) {
+		WARN("Too many IPC clients, connection refused");
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		ERROR("Out of memory, skipping...");
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->passedfd = -1;
+	c->start = ctrl_now();
+	if (ctrl_epoll_add(epfd, fd, c) < 0) {
+		ERROR("Cannot poll IPC client: %s", strerror(errno));
+		close(fd);
+		free(c);
+		return;
+	}
+	LIST_INSERT_HEAD(&ctrl_conns, c, next);
+	nctrl_conns++;
+}
+
+/*
+ * Read what the client has sent without blocking, never past the end of
+ * the request because an installation may stream the SWU after it.
+ * Returns the protocol version once the request is complete, 0 if more
+ * data is needed.
+ */
+static int ctrl_conn_read(struct ctrl_conn *c, ipc_message *msg)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t n;
+	int len, rfd;
+
+	while ((len = ipc_msg_len(c->buf, c->len)) > 0 && (size_t)len > c->len) {
+		if ((size_t)len > sizeof(c->buf))
+			return -EMSGSIZE;
+		iov.iov_base = c->buf + c->len;
+		iov.iov_len = len - c->len;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+
+		n = recvmsg(c->fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (n == 0)
+			return -EPIPE;
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			memcpy(&rfd, CMSG_DATA(cmsg), sizeof(rfd));
+			if (c->passedfd < 0)
+				c->passedfd = rfd;
+			else
+				close(rfd);
+		}
+		c->len += n;
+	}
+	if (len < 0)
+		return len;
+
+	if (ipc_unpack_msg(c->buf, c->len, msg) <= 0)
+		return -EPROTO;
+
+	return *(int *)c->buf == IPC_MAGIC ? IPC_PROTO_V1 : IPC_PROTO_V2;
+}
+
+/*
+ * Answer a request of a client of the control socket. The connection
+ * is closed, unless it is handed over to the installer, to the
+ * subprocess thread or to the notification sender.
+ */
+static void ctrl_handle_msg(struct installer *instp, int ctrlconnfd,
+			    ipc_message *req, int version, int passedfd)
+{
+	ipc_message msg = *req;
+	struct msg_elem *notification;
 	struct notify_conn *conn;
 	int ret;
 	update_state_t value;
 	struct subprocess_msg_elem *subprocess_msg;
 	bool should_close_socket;
 	struct swupdate_cfg *cfg;
+	int shmfd = -1;
+
+	should_close_socket = true;
+	pthread_mutex_lock(&stream_mutex);
+	if (msg.magic == IPC_MAGIC)  {
+		switch (msg.type) {
+		case POST_UPDATE:
+			if (postupdate(get_swupdate_cfg(),
+						   msg.data.procmsg.len > 0 ? msg.data.procmsg.buf : NULL) == 0) {
+				msg.type = ACK;
+				sprintf(msg.data.msg, "Post-update actions successfully executed.");
+			} else {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "Post-update actions failed.");
+			}
+			break;
+		case SWUPDATE_SUBPROCESS:
+			subprocess_msg = (struct subprocess_msg_elem*)malloc(
+					sizeof(struct subprocess_msg_elem));
+			if (subprocess_msg == NULL) {
+				ERROR("Cannot handle subprocess IPC because of OOM.");
+				msg.type = NACK;
+				break;
+			}
+
+			should_close_socket = false;
+			subprocess_msg->client = ctrlconnfd;
+			subprocess_msg->version = version;
+			subprocess_msg->message = msg;
+
+			pthread_mutex_lock(&subprocess_msg_lock);
+			SIMPLEQ_INSERT_TAIL(&subprocess_messages, subprocess_msg, next);
+			pthread_cond_signal(&subprocess_wkup);
+			pthread_mutex_unlock(&subprocess_msg_lock);
+			/*
+			 * ACK/NACK will be inserted by the called SUBPROCESS
+			 * It should not be touched here.
+			 * We leave the type as is and delegate the socket to a
+			 * dedicated processing thread.
+			 */
+
+			break;
+		case REQ_INSTALL_FD:
+			if (passedfd < 0) {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "No file descriptor");
+				break;
+			}
+			/* fallthrough */
+		case REQ_INSTALL_SHM:
+		case REQ_INSTALL:
+			TRACE("Incoming network request: processing...");
+			if (instp->status == IDLE) {
+				bool from_fd = msg.type == REQ_INSTALL_FD;
+				bool from_shm = msg.type == REQ_INSTALL_SHM;
+
+				instp->fd = from_fd ? passedfd : ctrlconnfd;
+				instp->req = msg.data.instmsg.req;
+				if ((instp->req.apiversion == SWUPDATE_API_VERSION) &&
+				    (is_selection_allowed(instp->req.software_set,
+							  instp->req.running_mode,
+							  &instp->software->accepted_set))) {
+					/*
+					 * The client writes into a ring passed with
+					 * the answer, the connection stays open
+					 */
+					if (from_shm) {
+						shmfd = ipc_ring_attach(ctrlconnfd);
+						if (shmfd < 0) {
+							msg.type = NACK;
+							sprintf(msg.data.msg, "No shared memory");
+							break;
+						}
+					}
+					/*
+					 * Prepare answer
+					 */
+					msg.type = ACK;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+					/*
+					 * The installer reads the passed file,
+					 * the connection is not needed anymore
+					 */
+					if (from_fd) {
+						posix_fadvise(passedfd, 0, 0,
+							      POSIX_FADV_SEQUENTIAL);
+						passedfd = -1;
+					} else
+						should_close_socket = false;
+
+					/* Drop all old notification from last run */
+					cleanum_msg_list();
+
+					/* Wake-up the installer */
+					pthread_cond_signal(&stream_wkup);
+				} else {
+					msg.type = NACK;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+				}
+			} else {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "Installation in progress");
+			}
+			break;
+		case GET_STATUS:
+			msg.type = ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			msg.data.status.current = instp->status;
+			msg.data.status.last_result = instp->last_install;
+			msg.data.status.error = instp->last_error;
+
+			/* Get first notification from the queue */
+			pthread_mutex_lock(&msglock);
+			notification = SIMPLEQ_FIRST(&notifymsgs);
+			if (notification) {
+				SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
+				nrmsgs--;
+				strncpy(msg.data.status.desc, notification->msg,
+					sizeof(msg.data.status.desc) - 1);
+#ifdef DEBUG_IPC
+				DEBUG("GET STATUS: %s\n", msg.data.status.desc);
+#endif
+				msg.data.status.current = notification->status;
+				msg.data.status.error = notification->error;
+			}
+			pthread_mutex_unlock(&msglock);
+
+			break;
+		case NOTIFY_STREAM:
+			msg.type = ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			msg.data.status.current = instp->status;
+			msg.data.status.last_result = instp->last_install;
+			msg.data.status.error = instp->last_error;
+
+			ret = ipc_send_msg(ctrlconnfd, &msg, version);
+			SWU_PROBE3(ipc_send, msg.type, ctrlconnfd, ret);
+			msg.type = NOTIFY_STREAM;
+			if (ret < 0) {
+				ERROR("Error write notify ack on socket ctrl");
+				close(ctrlconnfd);
+				break;
+			}
+
+			/*
+			 * Save the new connection to send notifications to
+			 */
+			conn = (struct notify_conn *)calloc(1, sizeof(*conn));
+			if (conn)
+				conn->ring = malloc(NOTIFY_RING_SIZE);
+			if (!conn || !conn->ring) {
+				free(conn);
+				ERROR("Out of memory, skipping...");
+				close(ctrlconnfd);
+				pthread_mutex_unlock(&stream_mutex);
+				return;
+			}
+			conn->sockfd = ctrlconnfd;
+			conn->version = version;
+
+			/* Queue notify history */
+			pthread_mutex_lock(&msglock);
+			SIMPLEQ_FOREACH(notification, &notifymsgs, next) {
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
+
+				strncpy(msg.data.notify.msg, notification->msg,
+						sizeof(msg.data.notify.msg) - 1);
+				msg.data.notify.status = notification->status;
+				msg.data.notify.error = notification->error;
+				msg.data.notify.level = notification->level;
+
+				notify_conn_push(conn, &msg);
+			}
+			SIMPLEQ_INSERT_TAIL(&notify_conns, conn, next);
+			pthread_mutex_unlock(&msglock);
+			notify_conn_wakeup();
+
+			break;
+		case SET_AES_KEY:
+#ifndef CONFIG_PKCS11
+			msg.type = ACK;
+			if (set_aes_key(msg.data.aeskeymsg.key_ascii, msg.data.aeskeymsg.ivt_ascii))
+#endif
+				msg.type = NACK;
+			break;
+		case SET_VERSIONS_RANGE:
+			msg.type = ACK;
+			set_version_range(msg.data.versions.minimum_version,
+					  msg.data.versions.maximum_version,
+					  msg.data.versions.current_version);
+			break;
+		case SET_INSTALL_PRIORITY:
+			msg.data.msg[sizeof(msg.data.msg) - 1] = '\0';
+			msg.type = install_priority_set_profile(msg.data.msg) ?
+				NACK : ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			break;
+		case REFRESH_ROOT_DEVICE:
+			refresh_root_device();
+			msg.type = ACK;
+			break;
+		case GET_ARTIFACT_REQUIRED:
+			if (instp->status != RUN) {
+				msg.type = NACK;
+				break;
+			}
+			msg.data.artifact.filename[sizeof(msg.data.artifact.filename) - 1] = '\0';
+			msg.data.artifact.required = !instp->described ? -EAGAIN :
+				artifact_required(instp->software,
+						  msg.data.artifact.filename);
+			msg.type = ACK;
+			break;
+		case GET_TIMELINE:
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			snprintf(msg.data.msg, sizeof(msg.data.msg), "%s%s",
+				 get_tmpdir(), TIMELINE_FILENAME);
+			msg.type = access(msg.data.msg, R_OK) ? NACK : ACK;
+			break;
+#ifdef CONFIG_METRICS
+		case GET_METRICS:
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			msg.type = write_metrics(msg.data.msg, sizeof(msg.data.msg)) ?
+				NACK : ACK;
+			break;
+#endif
+#ifdef CONFIG_PROFILE
+		case GET_PROFILE:
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			msg.type = profile_write(msg.data.msg, sizeof(msg.data.msg)) ?
+				NACK : ACK;
+			break;
+#endif
+		case GET_HW_REVISION:
+			cfg = get_swupdate_cfg();
+			if (get_hw_revision(&cfg->hw) < 0) {
+				msg.type = NACK;
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
+				break;
+			}
+			msg.type = ACK;
+			memset(msg.data.revisions.boardname, 0, sizeof(msg.data.revisions.boardname));
+			strncpy(msg.data.revisions.boardname, cfg->hw.boardname,
+				sizeof(msg.data.revisions.boardname) - 1);
+			memset(msg.data.revisions.revision, 0, sizeof(msg.data.revisions.revision));
+			strncpy(msg.data.revisions.revision, cfg->hw.revision,
+				sizeof(msg.data.revisions.revision) - 1);
+			break;
+		case SET_UPDATE_STATE:
+			value = *(update_state_t *)msg.data.msg;
+			msg.type = (is_valid_state(value) &&
+				    save_state(value) == SERVER_OK)
+				       ? ACK
+				       : NACK;
+			break;
+		case GET_UPDATE_STATE:
+			msg.data.msg[0] = get_state();
+			msg.type = ACK;
+			break;
+		default:
+			msg.type = NACK;
+		}
+	} else {
+		/* Wrong request */
+		msg.type = NACK;
+		sprintf(msg.data.msg, "Wrong request: aborting");
+	}
+
+	if (msg.type == ACK || msg.type == NACK) {
+		ret = ipc_send_msg_fd(ctrlconnfd, &msg, version, shmfd);
+		SWU_PROBE3(ipc_send, msg.type, ctrlconnfd, ret);
+		if (ret < 0)
+			ERROR("Error write on socket ctrl");
+
+		if (should_close_socket == true)
+			close(ctrlconnfd);
+	}
+	if (shmfd >= 0)
+		close(shmfd);
+	if (passedfd >= 0)
+		close(passedfd);
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+void *network_thread (void *data)
+{
+	struct installer *instp = (struct installer *)data;
+	struct epoll_event events[CTRL_MAX_EVENTS];
+	struct ctrl_conn *c, *tmp;
+	int ctrllisten, epfd;
+	ipc_message msg;
+	int version, n;
 
 	if (!instp) {
 		TRACE("Fatal error: Network thread aborting...");
@@ -460,6 +1094,13 @@ void *network_thread (void *data)
 	SIMPLEQ_INIT(&notifymsgs);
 	SIMPLEQ_INIT(&notify_conns);
 	SIMPLEQ_INIT(&subprocess_messages);
+	if (pipe(notify_wakeup) < 0 ||
+	    fcntl(notify_wakeup[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(notify_wakeup[1], F_SETFL, O_NONBLOCK) < 0) {
+		ERROR("Cannot create notification pipe: %s", strerror(errno));
+		exit(2);
+	}
+	start_thread(notify_sender_thread, NULL);
 	register_notifier(network_notifier);
 
 	subprocess_ipc_handler_thread_id = start_thread(subprocess_thread, NULL);
@@ -476,236 +1117,65 @@ void *network_thread (void *data)
 			  get_ctrl_socket());
 	}
 
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0 || ctrl_epoll_add(epfd, ctrllisten, NULL) < 0) {
+		ERROR("Cannot poll the IPC control socket: %s", strerror(errno));
+		exit(2);
+	}
+
 	thread_ready();
 	do {
-		clilen = sizeof(cliaddr);
-		if ( (ctrlconnfd = accept(ctrllisten, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
-			if (errno == EINTR)
-				continue;
-			else {
-				TRACE("Accept returns: %s", strerror(errno));
-				continue;
-			}
-		}
-		if (fcntl(ctrlconnfd, F_SETFD, FD_CLOEXEC) < 0)
-			WARN("Could not set %d as cloexec: %s", ctrlconnfd, strerror(errno));
-
-		nread = read(ctrlconnfd, (void *)&msg, sizeof(msg));
-
-		if (nread != sizeof(msg)) {
-			TRACE("IPC message too short: fragmentation not supported (read %d bytes, expected %zu bytes)",
-				nread, sizeof(msg));
-			close(ctrlconnfd);
+		/* wake up once per second to drop stale clients */
+		n = epoll_wait(epfd, events, CTRL_MAX_EVENTS,
+			       LIST_EMPTY(&ctrl_conns) ? -1 : 1000);
+		if (n < 0) {
+			if (errno != EINTR)
+				TRACE("epoll_wait returns: %s", strerror(errno));
 			continue;
 		}
-#ifdef DEBUG_IPC
-		TRACE("request header: magic[0x%08X] type[0x%08X]", msg.magic, msg.type);
-#endif
-
-		should_close_socket = true;
-		pthread_mutex_lock(&stream_mutex);
-		if (msg.magic == IPC_MAGIC)  {
-			switch (msg.type) {
-			case POST_UPDATE:
-				if (postupdate(get_swupdate_cfg(),
-							   msg.data.procmsg.len > 0 ? msg.data.procmsg.buf : NULL) == 0) {
-					msg.type = ACK;
-					sprintf(msg.data.msg, "Post-update actions successfully executed.");
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Post-update actions failed.");
-				}
-				break;
-			case SWUPDATE_SUBPROCESS:
-				subprocess_msg = (struct subprocess_msg_elem*)malloc(
-						sizeof(struct subprocess_msg_elem));
-				if (subprocess_msg == NULL) {
-					ERROR("Cannot handle subprocess IPC because of OOM.");
-					msg.type = NACK;
-					break;
-				}
-
-				should_close_socket = false;
-				subprocess_msg->client = ctrlconnfd;
-				subprocess_msg->message = msg;
-
-				pthread_mutex_lock(&subprocess_msg_lock);
-				SIMPLEQ_INSERT_TAIL(&subprocess_messages, subprocess_msg, next);
-				pthread_cond_signal(&subprocess_wkup);
-				pthread_mutex_unlock(&subprocess_msg_lock);
-				/*
-				 * ACK/NACK will be inserted by the called SUBPROCESS
-				 * It should not be touched here.
-				 * We leave the type as is and delegate the socket to a
-				 * dedicated processing thread.
-				 */
 
-				break;
-			case REQ_INSTALL:
-				TRACE("Incoming network request: processing...");
-				if (instp->status == IDLE) {
-					instp->fd = ctrlconnfd;
-					instp->req = msg.data.instmsg.req;
-					if ((instp->req.apiversion == SWUPDATE_API_VERSION) &&
-					    (is_selection_allowed(instp->req.software_set,
-								  instp->req.running_mode,
-								  &instp->software->accepted_set))) {
-						/*
-						 * Prepare answer
-						 */
-						msg.type = ACK;
-						memset(msg.data.msg, 0, sizeof(msg.data.msg));
-						should_close_socket = false;
-
-						/* Drop all old notification from last run */
-						cleanum_msg_list();
+		for (int i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (!c) {
+				ctrl_accept(epfd, ctrllisten);
+				continue;
+			}
 
-						/* Wake-up the installer */
-						pthread_cond_signal(&stream_wkup);
-					} else {
-						msg.type = NACK;
-						memset(msg.data.msg, 0, sizeof(msg.data.msg));
-					}
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Installation in progress");
-				}
-				break;
-			case GET_STATUS:
-				msg.type = ACK;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
-
-				/* Get first notification from the queue */
-				pthread_mutex_lock(&msglock);
-				notification = SIMPLEQ_FIRST(&notifymsgs);
-				if (notification) {
-					SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-					nrmsgs--;
-					strncpy(msg.data.status.desc, notification->msg,
-						sizeof(msg.data.status.desc) - 1);
+			version = ctrl_conn_read(c, &msg);
+			if (!version)
+				continue;
+			if (version == -EPROTO) {
+				/* Answered as wrong request */
+				version = IPC_PROTO_V1;
+				msg.magic = 0;
+			} else if (version < 0) {
+				if (version != -EPIPE)
+					TRACE("IPC message cannot be read: %s",
+					      strerror(-version));
+				close(c->fd);
+				ctrl_conn_free(epfd, c);
+				continue;
+			}
 #ifdef DEBUG_IPC
-					DEBUG("GET STATUS: %s\n", msg.data.status.desc);
+			TRACE("request header: magic[0x%08X] type[0x%08X]", msg.magic, msg.type);
 #endif
-					msg.data.status.current = notification->status;
-					msg.data.status.error = notification->error;
-				}
-				pthread_mutex_unlock(&msglock);
+			/* the request is complete, the connection is not polled anymore */
+			int connfd = c->fd, passedfd = c->passedfd;
 
-				break;
-			case NOTIFY_STREAM:
-				msg.type = ACK;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
-
-				ret = write(ctrlconnfd, &msg, sizeof(msg));
-				msg.type = NOTIFY_STREAM;
-				if (ret < 0) {
-					ERROR("Error write notify ack on socket ctrl");
-					close(ctrlconnfd);
-					break;
-				}
-
-				/* Get first notification from the queue */
-				pthread_mutex_lock(&msglock);
-				notification = SIMPLEQ_FIRST(&notifymsgs);
-
-				/* Send notify history */
-				SIMPLEQ_FOREACH_SAFE(notification, &notifymsgs, next, tmp) {
-					memset(msg.data.msg, 0, sizeof(msg.data.msg));
-
-					strncpy(msg.data.notify.msg, notification->msg,
-							sizeof(msg.data.notify.msg) - 1);
-					msg.data.notify.status = notification->status;
-					msg.data.notify.error = notification->error;
-					msg.data.notify.level = notification->level;
-
-					ret = write_notify_msg(&msg, ctrlconnfd);
-					if (ret < 0) {
-						pthread_mutex_unlock(&msglock);
-						ERROR("Error write notify history on socket ctrl");
-						close(ctrlconnfd);
-						break;
-					}
-				}
-
-				/*
-				 * Save the new connection to send notifications to
-				 */
-				conn = (struct notify_conn *)calloc(1, sizeof(*conn));
-				if (!conn) {
-					pthread_mutex_unlock(&msglock);
-					ERROR("Out of memory, skipping...");
-					close(ctrlconnfd);
-					pthread_mutex_unlock(&stream_mutex);
-					continue;
-				}
-				conn->sockfd = ctrlconnfd;
-				SIMPLEQ_INSERT_TAIL(&notify_conns, conn, next);
-				pthread_mutex_unlock(&msglock);
-
-				break;
-			case SET_AES_KEY:
-#ifndef CONFIG_PKCS11
-				msg.type = ACK;
-				if (set_aes_key(msg.data.aeskeymsg.key_ascii, msg.data.aeskeymsg.ivt_ascii))
-#endif
-					msg.type = NACK;
-				break;
-			case SET_VERSIONS_RANGE:
-				msg.type = ACK;
-				set_version_range(msg.data.versions.minimum_version,
-						  msg.data.versions.maximum_version,
-						  msg.data.versions.current_version);
-				break;
-			case GET_HW_REVISION:
-				cfg = get_swupdate_cfg();
-				if (get_hw_revision(&cfg->hw) < 0) {
-					msg.type = NACK;
-					memset(msg.data.msg, 0, sizeof(msg.data.msg));
-					break;
-				}
-				msg.type = ACK;
-				memset(msg.data.revisions.boardname, 0, sizeof(msg.data.revisions.boardname));
-				strncpy(msg.data.revisions.boardname, cfg->hw.boardname,
-					sizeof(msg.data.revisions.boardname) - 1);
-				memset(msg.data.revisions.revision, 0, sizeof(msg.data.revisions.revision));
-				strncpy(msg.data.revisions.revision, cfg->hw.revision,
-					sizeof(msg.data.revisions.revision) - 1);
-				break;
-			case SET_UPDATE_STATE:
-				value = *(update_state_t *)msg.data.msg;
-				msg.type = (is_valid_state(value) &&
-					    save_state(value) == SERVER_OK)
-					       ? ACK
-					       : NACK;
-				break;
-			case GET_UPDATE_STATE:
-				msg.data.msg[0] = get_state();
-				msg.type = ACK;
-				break;
-			default:
-				msg.type = NACK;
-			}
-		} else {
-			/* Wrong request */
-			msg.type = NACK;
-			sprintf(msg.data.msg, "Wrong request: aborting");
+			c->passedfd = -1;
+			ctrl_conn_free(epfd, c);
+			SWU_PROBE2(ipc_receive, msg.type, connfd);
+			ctrl_handle_msg(instp, connfd, &msg, version, passedfd);
 		}
 
-		if (msg.type == ACK || msg.type == NACK) {
-			ret = write(ctrlconnfd, &msg, sizeof(msg));
-			if (ret < 0)
-				ERROR("Error write on socket ctrl");
-
-			if (should_close_socket == true)
-				close(ctrlconnfd);
+		LIST_FOREACH_SAFE(c, &ctrl_conns, next, tmp) {
+			if (ctrl_now() - c->start < DEFAULT_INTERNAL_TIMEOUT)
+				continue;
+			TRACE("IPC client sent no complete request in %d seconds, closing",
+			      DEFAULT_INTERNAL_TIMEOUT);
+			close(c->fd);
+			ctrl_conn_free(epfd, c);
 		}
-		pthread_mutex_unlock(&stream_mutex);
 	} while (1);
 	return (void *)0;
 }
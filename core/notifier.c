@@ -18,6 +18,9 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/uio.h>
 
 #include "bsdqueue.h"
 #include "util.h"
@@ -65,6 +68,184 @@ static int notifyfd = -1;
 static bool console_priority_prefix = false;
 static bool console_ansi_colors = false;
 
+#ifdef CONFIG_NOTIFIER_ASYNC
+/*
+ * Asynchronous logging: the notifiers push the formatted
+ * messages into a lock-free stack (multiple producers), the
+ * notifier thread takes all of them at once, restores the
+ * order and writes them with writev().
+ * A record with fd < 0 is sent to syslog with priority prio.
+ */
+struct log_record {
+	struct log_record *next;
+	int fd;
+	int prio;
+	size_t len;
+	char buf[];
+};
+
+#define LOG_QUEUE_MAX	(1024 * 1024)
+#define LOG_BATCH	64
+
+static struct log_record *log_queue;	/* newest first */
+static size_t log_queued;
+static unsigned long log_dropped;
+static int log_wakeup[2] = {-1, -1};
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+static void log_queue_drain(void)
+{
+	struct log_record *list, *rec, *prev = NULL, *tmp;
+	struct iovec iov[LOG_BATCH];
+	unsigned long dropped;
+	size_t bytes = 0;
+	int cnt = 0, fd = -1;
+	char notice[64];
+
+	pthread_mutex_lock(&log_drain_lock);
+	list = __atomic_exchange_n(&log_queue, NULL, __ATOMIC_ACQUIRE);
+
+	/* restore the order of the messages */
+	while (list) {
+		tmp = list->next;
+		list->next = prev;
+		prev = list;
+		list = tmp;
+	}
+
+	/* stdio can be still used by someone else */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (rec = prev; rec; rec = rec->next) {
+		if (cnt && (rec->fd != fd || cnt == LOG_BATCH)) {
+			write_all(fd, iov, cnt);
+			cnt = 0;
+		}
+		if (rec->fd < 0) {
+			openlog("swupdate", 0, LOG_USER);
+			syslog(rec->prio, "%s", rec->buf);
+			closelog();
+			continue;
+		}
+		fd = rec->fd;
+		iov[cnt].iov_base = rec->buf;
+		iov[cnt].iov_len = rec->len;
+		cnt++;
+	}
+	if (cnt)
+		write_all(fd, iov, cnt);
+
+	for (rec = prev; rec; rec = tmp) {
+		tmp = rec->next;
+		bytes += rec->len;
+		free(rec);
+	}
+	__atomic_sub_fetch(&log_queued, bytes, __ATOMIC_RELAXED);
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		int len = snprintf(notice, sizeof(notice),
+				   "[WARN ] : %lu log messages dropped\n", dropped);
+		iov[0].iov_base = notice;
+		iov[0].iov_len = len;
+		write_all(STDOUT_FILENO, iov, 1);
+	}
+	pthread_mutex_unlock(&log_drain_lock);
+}
+
+/*
+ * Queue a message for the notifier thread; it is written
+ * directly if the queue is not available.
+ */
+void notifier_queue_log(int fd, int level, int prio, const char *buf, size_t len)
+{
+	struct log_record *rec, *head;
+	struct iovec iov;
+
+	if (log_wakeup[1] < 0)
+		goto direct;
+
+	if (__atomic_add_fetch(&log_queued, len, __ATOMIC_RELAXED) > LOG_QUEUE_MAX &&
+	    level > INFOLEVEL) {
+		__atomic_sub_fetch(&log_queued, len, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = malloc(sizeof(*rec) + len + 1);
+	if (!rec) {
+		__atomic_sub_fetch(&log_queued, len, __ATOMIC_RELAXED);
+		goto direct;
+	}
+	rec->fd = fd;
+	rec->prio = prio;
+	rec->len = len;
+	memcpy(rec->buf, buf, len);
+	rec->buf[len] = '\0';
+
+	head = __atomic_load_n(&log_queue, __ATOMIC_RELAXED);
+	do {
+		rec->next = head;
+	} while (!__atomic_compare_exchange_n(&log_queue, &head, rec, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* The thread is woken up once for each batch */
+	if (!head && write(log_wakeup[1], "", 1) < 0) {
+		/* pipe full, the thread has already something to do */
+	}
+	return;
+
+direct:
+	if (fd < 0) {
+		openlog("swupdate", 0, LOG_USER);
+		syslog(prio, "%s", buf);
+		closelog();
+		return;
+	}
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	write_all(fd, &iov, 1);
+}
+
+static void log_queue_init(void)
+{
+	if (pipe(log_wakeup) < 0) {
+		log_wakeup[0] = log_wakeup[1] = -1;
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(log_wakeup[i], F_SETFD, FD_CLOEXEC);
+		fcntl(log_wakeup[i], F_SETFL, O_NONBLOCK);
+	}
+	/* do not lose the last messages if SWUpdate exits */
+	atexit(log_queue_drain);
+}
+#endif
+
 /*
  * Escape sequences:
  * they are in the format <ESC>[{attr};{fg};{bg}m
@@ -254,6 +435,10 @@ static void console_notifier (RECOVERY_STATUS status, int error, int level, cons
 {
 	char current[80];
 	char color[32];
+	char line[NOTIFY_BUF_SIZE + 160];
+	const char *tag = "";
+	int len;
+
 	switch(status) {
 	case IDLE:
 		strncpy(current, "No SWUPDATE running : ", sizeof(current));
@@ -295,30 +480,38 @@ static void console_notifier (RECOVERY_STATUS status, int error, int level, cons
 
 	switch (level) {
 	case ERRORLEVEL:
-		fprintf(stderr, "%s%s[ERROR]", color,
-				console_priority_prefix ? "<3>" : "");
+		tag = console_priority_prefix ? "<3>[ERROR]" : "[ERROR]";
 		break;
 	case WARNLEVEL:
-		fprintf(stdout, "%s%s[WARN ]", color,
-				console_priority_prefix ? "<4>" : "");
+		tag = console_priority_prefix ? "<4>[WARN ]" : "[WARN ]";
 		break;
 	case INFOLEVEL:
-		fprintf(stdout, "%s%s[INFO ]", color,
-				console_priority_prefix ? "<6>" : "");
+		tag = console_priority_prefix ? "<6>[INFO ]" : "[INFO ]";
 		break;
 	case DEBUGLEVEL:
-		fprintf(stdout, "%s%s[DEBUG]", color,
-				console_priority_prefix ? "<7>" : "");
+		tag = console_priority_prefix ? "<7>[DEBUG]" : "[DEBUG]";
 		break;
 	case TRACELEVEL:
-		fprintf(stdout, "%s%s[TRACE]", color,
-				console_priority_prefix ? "<7>" : "");
+		tag = console_priority_prefix ? "<7>[TRACE]" : "[TRACE]";
 		break;
 	}
 
-	fprintf(level == ERRORLEVEL ? stderr : stdout,
-			" : %s %s%s\n", current, msg ? msg : "", console_ansi_colors ? "\x1b[0m" : "");
+	len = snprintf(line, sizeof(line), "%s%s : %s %s%s\n", color, tag,
+			current, msg ? msg : "", console_ansi_colors ? RESET_COLOR : "");
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+
+#ifdef CONFIG_NOTIFIER_ASYNC
+	notifier_queue_log(level == ERRORLEVEL ? STDERR_FILENO : STDOUT_FILENO,
+			   level, 0, line, len);
+#else
+	fputs(line, level == ERRORLEVEL ? stderr : stdout);
 	fflush(stdout);
+#endif
 }
 
 /*
@@ -464,6 +657,23 @@ static void *notifier_thread (void __attribute__ ((__unused__)) *data)
 
 	thread_ready();
 	do {
+#ifdef CONFIG_NOTIFIER_ASYNC
+		struct pollfd pfds[2] = {
+			{ .fd = serverfd, .events = POLLIN },
+			{ .fd = log_wakeup[0], .events = POLLIN },
+		};
+		char drain[64];
+
+		if (poll(pfds, log_wakeup[0] < 0 ? 1 : 2, -1) < 0)
+			continue;
+		if (pfds[1].revents & POLLIN) {
+			while (read(log_wakeup[0], drain, sizeof(drain)) > 0)
+				;
+			log_queue_drain();
+		}
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+#endif
 		len =  recvfrom(serverfd, &msg, sizeof(msg), 0, NULL, NULL);
 		/*
 		 * Force msg.buf to be Null Terminated
@@ -541,6 +751,9 @@ void notify_init(void)
 		addr_init(&notify_server, "NotifyServer");
 		STAILQ_INIT(&clients);
 		pthread_mutex_init(&clients_mutex, NULL);
+#ifdef CONFIG_NOTIFIER_ASYNC
+		log_queue_init();
+#endif
 		register_notifier(console_notifier);
 		register_notifier(process_notifier);
 		register_notifier(progress_notifier);
@@ -11,12 +11,16 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "swupdate.h"
 #include "parsers.h"
 #include "sslapi.h"
 #include "util.h"
 #include "progress.h"
 #include "handler.h"
+#include "swupdate_dict.h"
+#include "swupdate_timeline.h"
+#include "installer.h"
 
 static parser_fn parsers[] = {
 	parse_cfg,
@@ -24,6 +28,11 @@ static parser_fn parsers[] = {
 	parse_external
 };
 
+static parser_buffer_fn buffer_parsers[] = {
+	parse_cfg_buffer,
+	parse_json_buffer
+};
+
 typedef enum {
 	IS_IMAGE_FILE,
 	IS_SCRIPT,
@@ -105,6 +114,14 @@ static int check_handler(struct img_type *item, unsigned int mask, const char *d
 		return -EINVAL;
 	}
 
+	if (item->seek && !(hnd->mask & SEEKABLE_HANDLER))
+		WARN("'%s' does not support an offset, it is ignored for '%s'",
+		     item->type, item->fname);
+	if (strtobool(dict_get_value(&item->properties, "direct-io")) &&
+	    !(hnd->mask & DIRECTIO_HANDLER))
+		WARN("'%s' does not support direct-io, it is ignored for '%s'",
+		     item->type, item->fname);
+
 	return 0;
 }
 
@@ -130,22 +147,291 @@ static int check_handler_list(struct imglist *list,
 	return 0;
 }
 
-int parse(struct swupdate_cfg *sw, const char *descfile)
+#ifdef CONFIG_PARSER_CACHE
+/*
+ * Result of the last dry run. An update is often checked with
+ * a dry run and then sent again to be installed: if sw-description,
+ * its signature and the selection are the same, the verification and
+ * the parsing (including the embedded Lua script) are not repeated.
+ * The content itself is the key, sw-description is small.
+ */
+static struct {
+	char *desc;
+	size_t desclen;
+	char *sig;
+	size_t siglen;
+	char boardname[SWUPDATE_GENERAL_STRING_SIZE];
+	struct swupdate_parms parms;
+	char description[SWUPDATE_UPDATE_DESCRIPTION_STRING_SIZE];
+	char version[SWUPDATE_GENERAL_STRING_SIZE];
+	char output[SWUPDATE_GENERAL_STRING_SIZE];
+	bool bootloader_transaction_marker;
+	bool bootloader_state_marker;
+	struct imglist images;
+	struct imglist scripts;
+	struct imglist bootscripts;
+	struct dict bootloader;
+} parse_cache;
+
+static char *load_file(const char *fname, size_t *len)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return NULL;
+	}
+
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	*len = st.st_size;
+
+	return buf;
+}
+
+static void free_image_list(struct imglist *list)
+{
+	struct img_type *img, *tmp;
+
+	LIST_FOREACH_SAFE(img, list, next, tmp) {
+		LIST_REMOVE(img, next);
+		free_image(img);
+	}
+}
+
+/*
+ * The cache outlives the update, its copies are not
+ * allocated with the images of the update
+ */
+static int copy_image_list(struct imglist *dst, struct imglist *src,
+			   struct dict *bootloader)
+{
+	struct img_type *img, *copy, *last = NULL;
+	bool cached = bootloader == &parse_cache.bootloader;
+
+	LIST_FOREACH(img, src, next) {
+		copy = cached ? (struct img_type *)malloc(sizeof(*copy)) : alloc_image();
+		if (!copy)
+			return -ENOMEM;
+		memcpy(copy, img, sizeof(*copy));
+		LIST_INIT(&copy->properties);
+		if (img_copy_strings(copy, img, cached)) {
+			free_image(copy);
+			return -ENOMEM;
+		}
+		if (img->bootloader)
+			copy->bootloader = bootloader;
+		if (last)
+			LIST_INSERT_AFTER(last, copy, next);
+		else
+			LIST_INSERT_HEAD(dst, copy, next);
+		last = copy;
+		if (dict_copy(&copy->properties, &img->properties))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void parse_cache_drop(void)
+{
+	free(parse_cache.desc);
+	free(parse_cache.sig);
+	free_image_list(&parse_cache.images);
+	free_image_list(&parse_cache.scripts);
+	free_image_list(&parse_cache.bootscripts);
+	dict_drop_db(&parse_cache.bootloader);
+	memset(&parse_cache, 0, sizeof(parse_cache));
+}
+
+static char *dup_buffer(const char *buf, size_t len)
+{
+	char *copy = malloc(len + 1);
+
+	if (copy) {
+		memcpy(copy, buf, len);
+		copy[len] = '\0';
+	}
+
+	return copy;
+}
+
+static bool parse_cache_match(struct swupdate_cfg *sw, const char *desc,
+			      size_t desclen, const char *sig, size_t siglen)
+{
+	if (!parse_cache.desc)
+		return false;
+
+	if (strcmp(parse_cache.boardname, sw->hw.boardname) ||
+	    strcmp(parse_cache.parms.software_set, sw->parms.software_set) ||
+	    strcmp(parse_cache.parms.running_mode, sw->parms.running_mode))
+		return false;
+
+	return desc && desclen == parse_cache.desclen &&
+		!memcmp(desc, parse_cache.desc, desclen) &&
+		siglen == parse_cache.siglen &&
+		(!siglen || (sig && !memcmp(sig, parse_cache.sig, siglen)));
+}
+
+static int parse_cache_restore(struct swupdate_cfg *sw, const char *desc,
+			       size_t desclen, const char *sig, size_t siglen)
+{
+	bool match = parse_cache_match(sw, desc, desclen, sig, siglen);
+
+	if (match) {
+		strlcpy(sw->description, parse_cache.description, sizeof(sw->description));
+		strlcpy(sw->version, parse_cache.version, sizeof(sw->version));
+		strlcpy(sw->output, parse_cache.output, sizeof(sw->output));
+		sw->bootloader_transaction_marker = parse_cache.bootloader_transaction_marker;
+		sw->bootloader_state_marker = parse_cache.bootloader_state_marker;
+		sw->embscript = NULL;
+		if (copy_image_list(&sw->images, &parse_cache.images, &sw->bootloader) ||
+		    copy_image_list(&sw->scripts, &parse_cache.scripts, &sw->bootloader) ||
+		    copy_image_list(&sw->bootscripts, &parse_cache.bootscripts, &sw->bootloader) ||
+		    dict_copy(&sw->bootloader, &parse_cache.bootloader)) {
+			ERROR("No memory to restore parsed %s", SW_DESCRIPTION_FILENAME);
+			parse_cache_drop();
+			return -ENOMEM;
+		}
+		INFO("%s already verified and parsed in dry run, reusing it",
+		     SW_DESCRIPTION_FILENAME);
+	}
+
+	/*
+	 * A real installation changes the versions and the bootloader
+	 * environment the parsing depends on
+	 */
+	if (!sw->parms.dry_run)
+		parse_cache_drop();
+
+	return match ? 0 : -ENOENT;
+}
+
+static void parse_cache_store(struct swupdate_cfg *sw, const char *desc,
+			      size_t desclen, const char *sig, size_t siglen)
+{
+	parse_cache_drop();
+	if (!sw->parms.dry_run || !desc)
+		return;
+
+	parse_cache.desc = dup_buffer(desc, desclen);
+	parse_cache.desclen = desclen;
+	if (sig) {
+		parse_cache.sig = dup_buffer(sig, siglen);
+		parse_cache.siglen = siglen;
+	}
+	if (!parse_cache.desc || (sig && !parse_cache.sig)) {
+		parse_cache_drop();
+		return;
+	}
+
+	strlcpy(parse_cache.boardname, sw->hw.boardname, sizeof(parse_cache.boardname));
+	parse_cache.parms = sw->parms;
+	strlcpy(parse_cache.description, sw->description, sizeof(parse_cache.description));
+	strlcpy(parse_cache.version, sw->version, sizeof(parse_cache.version));
+	strlcpy(parse_cache.output, sw->output, sizeof(parse_cache.output));
+	parse_cache.bootloader_transaction_marker = sw->bootloader_transaction_marker;
+	parse_cache.bootloader_state_marker = sw->bootloader_state_marker;
+	if (copy_image_list(&parse_cache.images, &sw->images, &parse_cache.bootloader) ||
+	    copy_image_list(&parse_cache.scripts, &sw->scripts, &parse_cache.bootloader) ||
+	    copy_image_list(&parse_cache.bootscripts, &sw->bootscripts, &parse_cache.bootloader) ||
+	    dict_copy(&parse_cache.bootloader, &sw->bootloader)) {
+		WARN("No memory to cache parsed %s", SW_DESCRIPTION_FILENAME);
+		parse_cache_drop();
+	}
+}
+
+static int parse_cache_restore_file(struct swupdate_cfg *sw, const char *descfile,
+				    const char *sigfile)
+{
+	char *desc, *sig = NULL;
+	size_t desclen = 0, siglen = 0;
+	int ret;
+
+	desc = load_file(descfile, &desclen);
+	if (sigfile)
+		sig = load_file(sigfile, &siglen);
+	ret = parse_cache_restore(sw, desc, desclen, sig, siglen);
+	free(desc);
+	free(sig);
+
+	return ret;
+}
+
+static void parse_cache_store_file(struct swupdate_cfg *sw, const char *descfile,
+				   const char *sigfile)
+{
+	char *desc, *sig = NULL;
+	size_t desclen = 0, siglen = 0;
+
+	if (!sw->parms.dry_run) {
+		parse_cache_drop();
+		return;
+	}
+	desc = load_file(descfile, &desclen);
+	if (sigfile && !(sig = load_file(sigfile, &siglen))) {
+		free(desc);
+		parse_cache_drop();
+		return;
+	}
+	parse_cache_store(sw, desc, desclen, sig, siglen);
+	free(desc);
+	free(sig);
+}
+#else
+static inline int parse_cache_restore(struct swupdate_cfg __attribute__ ((__unused__)) *sw,
+				      const char __attribute__ ((__unused__)) *desc,
+				      size_t __attribute__ ((__unused__)) desclen,
+				      const char __attribute__ ((__unused__)) *sig,
+				      size_t __attribute__ ((__unused__)) siglen)
+{
+	return -ENOENT;
+}
+
+static inline void parse_cache_store(struct swupdate_cfg __attribute__ ((__unused__)) *sw,
+				     const char __attribute__ ((__unused__)) *desc,
+				     size_t __attribute__ ((__unused__)) desclen,
+				     const char __attribute__ ((__unused__)) *sig,
+				     size_t __attribute__ ((__unused__)) siglen)
+{
+}
+
+static inline int parse_cache_restore_file(struct swupdate_cfg __attribute__ ((__unused__)) *sw,
+					   const char __attribute__ ((__unused__)) *descfile,
+					   const char __attribute__ ((__unused__)) *sigfile)
+{
+	return -ENOENT;
+}
+
+static inline void parse_cache_store_file(struct swupdate_cfg __attribute__ ((__unused__)) *sw,
+					  const char __attribute__ ((__unused__)) *descfile,
+					  const char __attribute__ ((__unused__)) *sigfile)
+{
+}
+#endif
+
+static int parse_descfile(struct swupdate_cfg *sw, const char *descfile,
+			  const char __attribute__ ((__unused__)) *sigfile)
 {
 	int ret = -1;
 	parser_fn current;
 #ifdef CONFIG_SIGNED_IMAGES
-	char *sigfile;
-
-	sigfile = malloc(strlen(descfile) + strlen(".sig") + 1);
-	if (!sigfile)
-		return -ENOMEM;
-	strcpy(sigfile, descfile);
-	strcat(sigfile, ".sig");
+	struct timeline_span span;
 
+	timeline_begin(&span);
 	ret = swupdate_verify_file(sw->dgst, sigfile, descfile,
 				   sw->forced_signer_name);
-	free(sigfile);
+	timeline_end(&span, "verify", SW_DESCRIPTION_FILENAME);
 
 	if (ret)
 		return ret;
@@ -165,6 +451,81 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 		return ret;
 	}
 
+	parse_cache_store_file(sw, descfile, sigfile);
+
+	return 0;
+}
+
+#ifdef CONFIG_LUAEXTERNAL
+static int save_descfile(const char *fname, const char *buf, size_t len)
+{
+	int fd, ret;
+
+	fd = openfileoutput(fname);
+	if (fd < 0)
+		return fd;
+	ret = copy_write(&fd, buf, len);
+	close(fd);
+
+	return ret;
+}
+#endif
+
+static int parse_descbuffer(struct swupdate_cfg *sw, const char *desc,
+			    size_t desclen, const char *sig, size_t siglen)
+{
+	int ret = -1;
+	parser_buffer_fn current;
+#ifdef CONFIG_SIGNED_IMAGES
+	struct timeline_span span;
+
+	timeline_begin(&span);
+	ret = swupdate_verify_buffer(sw->dgst, sig, siglen, desc, desclen,
+				     sw->forced_signer_name);
+	timeline_end(&span, "verify", SW_DESCRIPTION_FILENAME);
+
+	if (ret)
+		return ret;
+
+#endif
+	for (unsigned int i = 0; i < ARRAY_SIZE(buffer_parsers); i++) {
+		current = buffer_parsers[i];
+
+		ret = current(sw, desc, desclen);
+
+		if (ret == 0)
+			break;
+	}
+
+#ifdef CONFIG_LUAEXTERNAL
+	/* The external parser reads a file */
+	if (ret != 0) {
+		char *descfile = NULL;
+
+		if (asprintf(&descfile, "%s%s", get_tmpdir(),
+			     SW_DESCRIPTION_FILENAME) == ENOMEM_ASPRINTF)
+			return -ENOMEM;
+		ret = save_descfile(descfile, desc, desclen);
+		if (!ret)
+			ret = parse_external(sw, descfile);
+		free(descfile);
+	}
+#endif
+
+	if (ret != 0) {
+		ERROR("no parser available to parse " SW_DESCRIPTION_FILENAME "!");
+		return ret;
+	}
+
+	parse_cache_store(sw, desc, desclen, sig, siglen);
+
+	return 0;
+}
+
+static int check_parsed(struct swupdate_cfg *sw)
+{
+	int ret;
+
 	ret = check_handler_list(&sw->scripts, SCRIPT_HANDLER, IS_SCRIPT, "scripts");
 	ret |= check_handler_list(&sw->images, IMAGE_HANDLER | FILE_HANDLER, IS_IMAGE_FILE,
 					"images / files");
@@ -179,11 +540,9 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 	 *  Bootloader is slightly different, it has no image
 	 *  but a list of variables
 	 */
-	struct img_type item_uboot = {.type = "uboot"};
-	struct img_type item_bootloader = {.type = "bootenv"};
 	if (!LIST_EMPTY(&sw->bootloader) &&
-			(!find_handler(&item_uboot) &&
-			 !find_handler(&item_bootloader))) {
+			(!find_handler_by_name("uboot") &&
+			 !find_handler_by_name("bootenv"))) {
 		ERROR("bootloader support absent but %s has bootloader section!",
 		      SW_DESCRIPTION_FILENAME);
 		return -EINVAL;
@@ -257,6 +616,9 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 	TRACE("Number of scripts: %d", count_elem_list(&sw->scripts));
 	TRACE("Number of steps to be run: %d", totalsteps);
 
+	/* each file of the SWU is then looked up by its name */
+	if (!ret && artifact_index_build(sw))
+		ret = -ENOMEM;
 
 	/*
 	 * Send the version string as first message to progress interface
@@ -271,3 +633,41 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 
 	return ret;
 }
+
+int parse(struct swupdate_cfg *sw, const char *descfile)
+{
+	char *sigfile = NULL;
+	int ret;
+
+#ifdef CONFIG_SIGNED_IMAGES
+	sigfile = malloc(strlen(descfile) + strlen(".sig") + 1);
+	if (!sigfile)
+		return -ENOMEM;
+	strcpy(sigfile, descfile);
+	strcat(sigfile, ".sig");
+#endif
+	ret = parse_cache_restore_file(sw, descfile, sigfile);
+	if (ret == -ENOENT)
+		ret = parse_descfile(sw, descfile, sigfile);
+	free(sigfile);
+
+	if (ret)
+		return ret;
+
+	return check_parsed(sw);
+}
+
+int parse_buffer(struct swupdate_cfg *sw, const char *desc, size_t desclen,
+		 const char *sig, size_t siglen)
+{
+	int ret;
+
+	ret = parse_cache_restore(sw, desc, desclen, sig, siglen);
+	if (ret == -ENOENT)
+		ret = parse_descbuffer(sw, desc, desclen, sig, siglen);
+
+	if (ret)
+		return ret;
+
+	return check_parsed(sw);
+}
@@ -186,12 +186,21 @@ void *get_node(parsertype p, void *root, const char **nodes)
 	return NULL;
 }
 
-void get_hash_value(parsertype p, void *elem, unsigned char *hash)
+void get_hash_value(parsertype p, void *elem, unsigned char *hash,
+		    const char **hashalg)
 {
 	char hash_ascii[80];
 
 	memset(hash_ascii, 0, sizeof(hash_ascii));
-	GET_FIELD_STRING(p, elem, "sha256", hash_ascii);
+	*hashalg = NULL;
+#ifdef CONFIG_HASH_SHA512_256
+	/* sha256 can be kept for older versions, the faster one wins */
+	GET_FIELD_STRING(p, elem, SHA512_256, hash_ascii);
+	if (strlen(hash_ascii))
+		*hashalg = SHA512_256;
+	else
+#endif
+		GET_FIELD_STRING(p, elem, "sha256", hash_ascii);
 
 	ascii_to_hash(hash, hash_ascii);
 }
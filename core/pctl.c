@@ -10,13 +10,17 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdlib.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
 #endif
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
 #include <pthread.h>
 #include <network_ipc.h>
 #include <pctl.h>
@@ -25,11 +29,17 @@
 #include <sys/wait.h>
 #include <parselib.h>
 #include <swupdate_settings.h>
+#include <swupdate_priority.h>
 
 #ifndef WAIT_ANY
 #define WAIT_ANY (-1)
 #endif
 
+/* output of a command is read in chunks of this size */
+#define CMD_OUTPUT_BUFFER_SIZE	(16 * 1024)
+/* without pidfd, the exit of a command is checked this often */
+#define CMD_EXIT_POLL_MS	50
+
 /* the array contains the pid of the subprocesses */
 #define MAX_PROCESSES	10
 static struct swupdate_task procs[MAX_PROCESSES];
@@ -47,10 +57,36 @@ int pid = 0;
 
 /*
  * The sw_sockfd is used for internal ipc
- * with SWUpdate processes
+ * with SWUpdate processes. It is per thread, because
+ * subprocesses can run as threads of SWUpdate.
+ */
+
+__thread int sw_sockfd = -1;
+
+/*
+ * Run the subprocesses as threads of SWUpdate when they do not
+ * need other privileges, see start_swupdate_subprocess()
  */
+static bool subprocess_threads = false;
 
-int sw_sockfd = -1;
+struct subprocess_thread {
+	const char *name;
+	const char *cfgname;
+	int argc;
+	char **argv;
+	swupdate_process start;
+	int sockfd;
+};
+
+/*
+ * The subprocesses parse their command line with getopt(), that
+ * is not reentrant: a new thread is started when the previous one
+ * has called subprocess_ready()
+ */
+static __thread bool subprocess_starting = false;
+static bool subprocess_released;
+static pthread_mutex_t subprocess_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t subprocess_cond = PTHREAD_COND_INITIALIZER;
 
 /*
  * This allows waiting for initial threads to be ready before spawning subprocesses
@@ -67,22 +103,47 @@ static void parent_dead_handler(int __attribute__ ((__unused__)) dummy)
 #endif
 
 /*
- * This is used to spawn internal threads
+ * The threads get the CPU set and the scheduling of the
+ * install-priority section
  */
-pthread_t start_thread(void *(* start_routine) (void *), void *arg)
+int start_worker_thread(pthread_t *id, void *(* start_routine) (void *), void *arg)
 {
-	int ret;
-	pthread_t id;
 	pthread_attr_t attr;
+	bool sched;
+	int ret;
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	sched = install_priority_thread_attr(&attr);
+	ret = pthread_create(id, &attr, start_routine, arg);
+	pthread_attr_destroy(&attr);
+	if (ret == EPERM && sched) {
+		install_priority_sched_denied();
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+		(void)install_priority_thread_attr(&attr);
+		ret = pthread_create(id, &attr, start_routine, arg);
+		pthread_attr_destroy(&attr);
+	}
+	if (!ret)
+		install_priority_thread_started(*id);
+
+	return ret;
+}
+
+/*
+ * This is used to spawn internal threads
+ */
+pthread_t start_thread(void *(* start_routine) (void *), void *arg)
+{
+	int ret;
+	pthread_t id;
 
 	pthread_mutex_lock(&threads_towait_lock);
 	threads_towait++;
 	pthread_mutex_unlock(&threads_towait_lock);
 
-	ret = pthread_create(&id, &attr, start_routine, arg);
+	ret = start_worker_thread(&id, start_routine, arg);
 	if (ret) {
 		exit(1);
 	}
@@ -113,6 +174,154 @@ void wait_threads_ready(void)
 	pthread_mutex_unlock(&threads_towait_lock);
 }
 
+void subprocess_set_threads(bool enable)
+{
+	subprocess_threads = enable;
+}
+
+void subprocess_ready(void)
+{
+	if (!subprocess_starting)
+		return;
+	subprocess_starting = false;
+
+	pthread_mutex_lock(&subprocess_lock);
+	subprocess_released = true;
+	pthread_cond_broadcast(&subprocess_cond);
+	pthread_mutex_unlock(&subprocess_lock);
+}
+
+/*
+ * Send SIGTERM to all subprocesses but the one that has
+ * exited and then to SWUpdate itself. It is called from
+ * the SIGCHLD handler, too.
+ */
+static void stop_subprocesses(pid_t exited)
+{
+	int i;
+
+	signal(SIGCHLD, SIG_IGN);
+	for (i = 0; i < nprocs; i++) {
+		/* threads stop with the process */
+		if (procs[i].pid && procs[i].pid != exited)
+			kill(procs[i].pid, SIGTERM);
+	}
+
+	/*
+	 * exit() it not safe to call from a signal handler because of atexit()
+	 * handlers, so send SIGTERM to ourself instead
+	 */
+	kill(getpid(), SIGTERM);
+}
+
+static void free_subprocess_thread(struct subprocess_thread *t)
+{
+	int i;
+
+	if (t->argv) {
+		for (i = 0; i < t->argc; i++)
+			free(t->argv[i]);
+		free(t->argv);
+	}
+	free(t);
+}
+
+static void *subprocess_thread(void *data)
+{
+	struct subprocess_thread *t = (struct subprocess_thread *)data;
+	int ret;
+
+	sw_sockfd = t->sockfd;
+	subprocess_starting = true;
+#if defined(__linux__)
+	prctl(PR_SET_NAME, t->name);
+#endif
+
+	ret = (*t->start)(t->cfgname, t->argc, t->argv);
+
+	/* it has not reached subprocess_ready(), release the caller */
+	subprocess_ready();
+
+	/* same as a subprocess that has exited */
+	printf("Thread %s exited, status=%d\n", t->name, ret);
+	exit_code = ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	free_subprocess_thread(t);
+	stop_subprocesses(0);
+
+	return NULL;
+}
+
+/*
+ * spawn_thread starts the subprocess as a thread
+ * of SWUpdate, sharing the libraries already initialized
+ */
+static int spawn_thread(struct swupdate_task *task,
+			const char *cfgname,
+			int ac, char **av,
+			swupdate_process start)
+{
+	struct subprocess_thread *t;
+	pthread_attr_t attr;
+	pthread_t id;
+	int sockfd[2];
+	int i;
+
+	t = (struct subprocess_thread *)calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	/*
+	 * The caller frees the arguments after the start,
+	 * the thread gets its own copy
+	 */
+	t->argv = (char **)calloc(ac + 1, sizeof(char *));
+	if (!t->argv) {
+		free_subprocess_thread(t);
+		return -ENOMEM;
+	}
+	for (i = 0; i < ac; i++) {
+		t->argv[i] = strdup(av[i]);
+		if (!t->argv[i]) {
+			free_subprocess_thread(t);
+			return -ENOMEM;
+		}
+		t->argc++;
+	}
+	t->name = task->name;
+	t->cfgname = cfgname;
+	t->start = start;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0) {
+		ERROR("socketpair fails : %s", strerror(errno));
+		free_subprocess_thread(t);
+		return -1;
+	}
+	t->sockfd = sockfd[1];
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&subprocess_lock);
+	subprocess_released = false;
+	if (pthread_create(&id, &attr, subprocess_thread, t)) {
+		pthread_mutex_unlock(&subprocess_lock);
+		ERROR("Cannot start thread for %s", task->name);
+		close(sockfd[0]);
+		close(sockfd[1]);
+		free_subprocess_thread(t);
+		return -1;
+	}
+	while (!subprocess_released)
+		pthread_cond_wait(&subprocess_cond, &subprocess_lock);
+	pthread_mutex_unlock(&subprocess_lock);
+
+	/* pid 0 marks a task running as thread */
+	task->pid = 0;
+	task->pipe = sockfd[0];
+
+	return 0;
+}
+
 /*
  * spawn_process forks and start a new process
  * under a new user
@@ -208,14 +417,30 @@ static void start_swupdate_subprocess(sourcetype type, const char *name,
 			swupdate_process start,
 			const char *cmdline)
 {
+	int ret;
+
 	procs[nprocs].name = name;
 	procs[nprocs].type = type;
-	if (spawn_process(&procs[nprocs], run_as_userid, run_as_groupid, cfgfile, argc, argv, start, cmdline) < 0) {
+
+	/*
+	 * Privileges are dropped for the whole process, a thread
+	 * can be used only if the ids do not change
+	 */
+	if (subprocess_threads && start &&
+	    (getuid() != 0 ||
+	     (run_as_userid == getuid() && run_as_groupid == getgid())))
+		ret = spawn_thread(&procs[nprocs], cfgfile, argc, argv, start);
+	else
+		ret = spawn_process(&procs[nprocs], run_as_userid, run_as_groupid, cfgfile, argc, argv, start, cmdline);
+	if (ret < 0) {
 		ERROR("Spawning %s failed, exiting process...", name);
 		exit(1);
 	}
 
-	TRACE("Started %s with pid %d and fd %d", name, procs[nprocs].pid, procs[nprocs].pipe);
+	if (procs[nprocs].pid)
+		TRACE("Started %s with pid %d and fd %d", name, procs[nprocs].pid, procs[nprocs].pipe);
+	else
+		TRACE("Started %s as thread with fd %d", name, procs[nprocs].pipe);
 	nprocs++;
 }
 
@@ -239,6 +464,62 @@ void start_subprocess(sourcetype type, const char *name,
 	start_swupdate_subprocess(type, name, run_as_userid, run_as_groupid, cfgfile, argc, argv, start, NULL);
 }
 
+/*
+ * The command is started with posix_spawn(): the child does not get a
+ * copy of the page tables of SWUpdate (vfork semantics), so the cost
+ * does not depend on the memory used by the daemon and the installer
+ * does not take copy-on-write faults while the command starts.
+ * The write ends of the pipes become stdout, stderr, 3 and 4.
+ */
+static int spawn_cmd(const char *cmd, int (*pipes)[2], int npipes, pid_t *child)
+{
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { (char *)"sh", (char *)"-c", (char *)cmd, NULL };
+	char **envp = NULL;
+	int fds[npipes];
+	size_t n = 0, j = 0;
+	int ret = 0, i;
+
+	/* moved above the targets, no pipe is then already at its number */
+	for (i = 0; i < npipes; i++) {
+		fds[i] = fcntl(pipes[i][1], F_DUPFD_CLOEXEC, 10);
+		if (fds[i] < 0 && !ret)
+			ret = errno;
+	}
+
+	/* posix sh cannot use fd >= 10, the numbers are passed in the environment */
+	while (environ[n])
+		n++;
+	envp = calloc(n + 3, sizeof(*envp));
+	if (!envp && !ret)
+		ret = ENOMEM;
+	if (ret)
+		goto out;
+	for (size_t k = 0; k < n; k++) {
+		if (strncmp(environ[k], "SWUPDATE_INFO_FD=", 17) &&
+		    strncmp(environ[k], "SWUPDATE_WARN_FD=", 17))
+			envp[j++] = environ[k];
+	}
+	envp[j++] = (char *)"SWUPDATE_INFO_FD=3";
+	envp[j++] = (char *)"SWUPDATE_WARN_FD=4";
+
+	posix_spawn_file_actions_init(&actions);
+	for (i = 0; i < npipes && !ret; i++)
+		ret = posix_spawn_file_actions_adddup2(&actions, fds[i], i + 1);
+	if (!ret)
+		ret = posix_spawn(child, "/bin/sh", &actions, NULL, argv, envp);
+	posix_spawn_file_actions_destroy(&actions);
+
+out:
+	free(envp);
+	for (i = 0; i < npipes; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	return ret;
+}
+
 /*
  * run_system_cmd executes a shell script in background and intercepts
  * stdout and stderr of the script, writing then to TRACE and ERROR
@@ -255,6 +536,17 @@ int run_system_cmd(const char *cmd)
 	int const PIPE_READ = 0;
 	int const PIPE_WRITE = 1;
 	int wstatus, i;
+	/* the last entry waits for the exit of the command */
+	struct pollfd fds[npipes + 1];
+	int pidfd = -1;
+	pid_t w = 0;
+	/*
+	 * Use buffers (for stdout and stdin) to collect data from
+	 * the cmd. Data can contain multiple lines or just a part
+	 * of a line and must be parsed
+	 */
+	char *buf[npipes];
+	int cindex[npipes];
 
 	if (!strnlen(cmd, SWUPDATE_GENERAL_STRING_SIZE))
 		return 0;
@@ -267,144 +559,118 @@ int run_system_cmd(const char *cmd)
 
 	/*
 	 * Creates pipes to intercept stdout and stderr of the
-	 * child process
+	 * child process. They are not inherited by commands
+	 * started at the same time by other threads.
 	 */
 	for (i = 0; i < npipes; i++) {
-		if (pipe(pipes[i]) < 0) {
+		if (pipe2(pipes[i], O_CLOEXEC) < 0) {
 			ERROR("Could not create pipes for subprocess, existing...");
 			break;
 		}
 	}
 	if (i < npipes) {
-		while (i >= 0) {
+		while (--i >= 0) {
 			close(pipes[i][0]);
 			close(pipes[i][1]);
-			i--;
 		}
 		return -EFAULT;
 	}
 
-	process_id = fork();
-	/* Child process, this runs the shell command */
-	if (process_id == 0) {
-		if (dup2(pipes[0][PIPE_WRITE], STDOUT_FILENO) < 0)
-			exit(errno);
-		if (dup2(pipes[1][PIPE_WRITE], STDERR_FILENO) < 0)
-			exit(errno);
-		/* posix sh cannot use fd >= 10, so dup these to lower
-		 * numbers for convenience */
-		if (dup2(pipes[2][PIPE_WRITE], 3) < 0)
-			exit(errno);
-		setenv("SWUPDATE_INFO_FD", "3", 1);
-		if (dup2(pipes[3][PIPE_WRITE], 4) < 0)
-			exit(errno);
-		setenv("SWUPDATE_WARN_FD", "4", 1);
-
-		/* close all pipes, not used anymore */
+	ret = spawn_cmd(cmd, pipes, npipes, &process_id);
+	if (ret) {
+		ERROR("Process %s cannot be started: %s", cmd, strerror(ret));
 		for (i = 0; i < npipes; i++) {
 			close(pipes[i][PIPE_READ]);
 			close(pipes[i][PIPE_WRITE]);
 		}
+		return -EFAULT;
+	}
+
+	for (i = 0; i < npipes; i++) {
+		close(pipes[i][PIPE_WRITE]);
+		fds[i].fd = pipes[i][PIPE_READ];
+		fds[i].events = POLLIN;
+		buf[i] = malloc(CMD_OUTPUT_BUFFER_SIZE);
+		if (!buf[i])
+			fds[i].fd = -1;
+		cindex[i] = 0;
+	}
 
-		ret = execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
-		if (ret) {
-			ERROR("Process %s cannot be started: %s", cmd, strerror(errno));
-			exit(1);
+#if defined(SYS_pidfd_open)
+	pidfd = syscall(SYS_pidfd_open, process_id, 0);
+#endif
+	fds[npipes].fd = pidfd;
+	fds[npipes].events = POLLIN;
+
+	/*
+	 * Now waits until the child process exits and forwards its
+	 * output: data from stdout as TRACE and from stderr (of the
+	 * child process) as ERROR. The end is given by the exit of
+	 * the child, processes started in background by the command
+	 * can keep the pipes open. Without pidfd, the exit is
+	 * checked at each timeout.
+	 */
+	while (w != process_id) {
+		ret = poll(fds, npipes + 1, pidfd < 0 ? CMD_EXIT_POLL_MS : -1);
+		if (ret < 0 && errno != EINTR) {
+			ERROR("Error from poll(), waiting for %s", cmd);
+			w = waitpid(process_id, &wstatus, 0);
+			break;
 		}
-	} else {
-		int fds[npipes];
-		int fdmax = 0;
-		pid_t w;
-		/*
-		 * Use buffers (for stdout and stdin) to collect data from
-		 * the cmd. Data can contain multiple lines or just a part
-		 * of a line and must be parsed
-		 */
-		char buf[npipes][SWUPDATE_GENERAL_STRING_SIZE];
-		int cindex[npipes];
 
-		for (i = 0; i < npipes; i++) {
-			close(pipes[i][PIPE_WRITE]);
-			fds[i] = pipes[i][PIPE_READ];
-			memset(buf[i], 0, sizeof(buf[i]));
-			cindex[i] = 0;
-			if (fds[i] > fdmax) fdmax = fds[i];
+		for (i = 0; ret > 0 && i < npipes; i++) {
+			if (fds[i].fd < 0 || !fds[i].revents)
+				continue;
+			if (read_lines_notify(fds[i].fd, buf[i], CMD_OUTPUT_BUFFER_SIZE,
+					      &cindex[i], levels[i]) <= 0)
+				fds[i].fd = -1;	/* closed by the child */
 		}
 
-		/*
-		 * Now waits until the child process exits and checks
-		 * for the output. Forward data from stdout as TRACE
-		 * and from stderr (of the child process) as ERROR
-		 */
-		do {
-			int n1 = 0;
-			struct timeval tv;
-			fd_set readfds;
-			int n;
-
-			w = waitpid(process_id, &wstatus, WNOHANG);
-			if (w == -1) {
-				ERROR("Error from waitpid() !!");
-				close(pipes[0][PIPE_READ]);
-				close(pipes[1][PIPE_READ]);
-				return -EFAULT;
-			}
+		w = waitpid(process_id, &wstatus, WNOHANG);
+		if (w == -1) {
+			ERROR("Error from waitpid() !!");
+			break;
+		}
+	}
 
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-
-			/* Check if the child has sent something */
-			do {
-				FD_ZERO(&readfds);
-				for (i = 0; i < npipes; i++)
-					FD_SET(fds[i], &readfds);
-
-				n1 = 0;
-				ret = select(fdmax + 1, &readfds, NULL, NULL, &tv);
-				if (ret <= 0)
-					break;
-
-				for (i = 0; i < npipes ; i++) {
-					char *pbuf = buf[i];
-					int *c = &cindex[i];
-					LOGLEVEL level = levels[i];
-
-					if (FD_ISSET(fds[i], &readfds)) {
-						n = read_lines_notify(fds[i], pbuf, SWUPDATE_GENERAL_STRING_SIZE,
-								      c, level);
-						if (n < 0)
-							continue;
-						n1 += n;
-					}
-				}
-			} while (ret > 0 && n1 > 0);
-		} while (w != process_id);
+	for (i = 0; i < npipes; i++) {
+		/* read what was written before the exit */
+		if (fds[i].fd >= 0 && w == process_id &&
+		    !fcntl(fds[i].fd, F_SETFL, O_NONBLOCK)) {
+			while (read_lines_notify(fds[i].fd, buf[i], CMD_OUTPUT_BUFFER_SIZE,
+						 &cindex[i], levels[i]) > 0)
+				;
+		}
 
 		/* print any unfinished line */
-		for (i = 0; i < npipes; i++) {
-			if (cindex[i]) {
-				switch(i) {
-				case 0:
-					TRACE("%s", buf[i]);
-					break;
-				case 1:
-					ERROR("%s", buf[i]);
-					break;
-				}
+		if (cindex[i]) {
+			switch(i) {
+			case 0:
+				TRACE("%s", buf[i]);
+				break;
+			case 1:
+				ERROR("%s", buf[i]);
+				break;
 			}
-			close(pipes[i][PIPE_READ]);
 		}
+		close(pipes[i][PIPE_READ]);
+		free(buf[i]);
+	}
+	if (pidfd >= 0)
+		close(pidfd);
 
-		if (WIFEXITED(wstatus)) {
-			ret = WEXITSTATUS(wstatus);
-			TRACE("%s command returned %d", cmd, ret);
-		} else if (WIFSIGNALED(wstatus)) {
-			TRACE("(%s) killed by signal %d\n", cmd, WTERMSIG(wstatus));
-			ret = -1;
-		} else {
-			TRACE("(%s) not exited nor killed!\n", cmd);
-			ret = -1;
-		}
+	if (w != process_id)
+		return -EFAULT;
+
+	if (WIFEXITED(wstatus)) {
+		ret = WEXITSTATUS(wstatus);
+		TRACE("%s command returned %d", cmd, ret);
+	} else if (WIFSIGNALED(wstatus)) {
+		TRACE("(%s) killed by signal %d\n", cmd, WTERMSIG(wstatus));
+		ret = -1;
+	} else {
+		TRACE("(%s) not exited nor killed!\n", cmd);
+		ret = -1;
 	}
 
 	return ret;
@@ -428,6 +694,9 @@ void sigchld_handler (int __attribute__ ((__unused__)) signum)
 	 * One process stops, find who is
 	 */
 	for (i = 0; i < nprocs; i++) {
+		/* waitpid(0) would reap any child */
+		if (!procs[i].pid)
+			continue;
 		childpid = waitpid (procs[i].pid, &status, WNOHANG);
 		if (childpid < 0) {
 			perror ("waitpid, no child");
@@ -460,20 +729,8 @@ void sigchld_handler (int __attribute__ ((__unused__)) signum)
 	 * Communicate to all other processes that something happened
 	 * and exit
 	 */
-	if (hasdied) {
-		signal(SIGCHLD, SIG_IGN);
-		for (i = 0; i < nprocs; i++) {
-			if (procs[i].pid != childpid) {
-				kill(procs[i].pid, SIGTERM);
-			}
-		}
-
-		/*
-		 * exit() it not safe to call from a signal handler because of atexit()
-		 * handlers, so send SIGTERM to ourself instead
-		 */
-		kill(getpid(), SIGTERM);
-	}
+	if (hasdied)
+		stop_subprocesses(childpid);
 
 	errno = serrno;
 }
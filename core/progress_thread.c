@@ -16,11 +16,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/un.h>
 #include <sys/select.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "swupdate.h"
 #include <handler.h>
@@ -35,9 +37,23 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+/* Interval to compute the instantaneous throughput */
+#define PROGRESS_RATE_INTERVAL_MS	500
+/* The byte counters of the copy loops are summed this often */
+#define PROGRESS_TICK_MS		100
+#define PROGRESS_COUNTERS		32
+
 struct progress_conn {
 	SIMPLEQ_ENTRY(progress_conn) next;
 	int sockfd;
+	bool ext;	/* client requested extended messages */
+	/*
+	 * Message a slow client could not take yet, replaced
+	 * by newer ones until its first byte is sent
+	 */
+	char pending[sizeof(struct progress_msg_ext)];
+	size_t pending_len;
+	size_t pending_off;
 };
 
 SIMPLEQ_HEAD(connections, progress_conn);
@@ -52,38 +68,212 @@ struct swupdate_progress {
 	const handler *curhnd;
 	struct connections conns;
 	pthread_mutex_t lock;
-	bool step_running;
+	unsigned int steps_running;	/* with install-group, they overlap */
+	struct progress_stats stats;
+	struct timespec step_start;
+	struct timespec last_sample;
+	unsigned long long last_written;
+	/* rate limit of the percentage updates */
+	unsigned int min_interval_ms;
+	unsigned int min_delta;
+	unsigned int sent_percent;
+	unsigned int sent_dwl_percent;
+	struct timespec last_sent;
+	bool coalesced;
+	struct progress_snapshot *snapshot;
+	/*
+	 * Counters of the running copies; the ones that ended while
+	 * others were running are kept in done_* until all are ended
+	 */
+	struct progress_counter counters[PROGRESS_COUNTERS];
+	unsigned int ncounters;
+	uint64_t done_total, done_read, done_written;
+	struct timespec counters_start;
+	pthread_cond_t tick;
 };
-static struct swupdate_progress progress;
+static struct swupdate_progress progress = {
+	.min_delta = 1,
+};
+
+static unsigned long long elapsed_ms(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000ULL +
+		(to->tv_nsec - from->tv_nsec) / 1000000LL;
+}
+
+/*
+ * Clients can ask for extended messages at any time after
+ * connecting, check for the request without blocking.
+ */
+static void check_ext_request(struct progress_conn *conn)
+{
+	struct progress_request req;
+
+	if (conn->ext)
+		return;
+	if (recv(conn->sockfd, &req, sizeof(req), MSG_DONTWAIT) != sizeof(req))
+		return;
+	if (req.magic == PROGRESS_EXT_MAGIC && req.version >= 2)
+		conn->ext = true;
+}
+
+/*
+ * Send a message to a client. Non urgent messages do not block:
+ * what the client cannot take is kept as pending and replaced by
+ * the next message, unless it was already partially written.
+ * Returns false if the client must be removed.
+ */
+static bool send_to_conn(struct progress_conn *conn, const void *buf, size_t count,
+			 bool urgent)
+{
+	int flags = MSG_NOSIGNAL | (urgent ? 0 : MSG_DONTWAIT);
+	ssize_t n;
+
+	/* A message already started must be completed first */
+	while (conn->pending_off && conn->pending_off < conn->pending_len) {
+		n = send(conn->sockfd, conn->pending + conn->pending_off,
+			 conn->pending_len - conn->pending_off, flags);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;	/* still busy, this update is skipped */
+		if (n <= 0)
+			return false;
+		conn->pending_off += (size_t)n;
+	}
+
+	memcpy(conn->pending, buf, count);
+	conn->pending_len = count;
+	conn->pending_off = 0;
+	while (conn->pending_off < conn->pending_len) {
+		n = send(conn->sockfd, conn->pending + conn->pending_off,
+			 conn->pending_len - conn->pending_off, flags);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+			return false;
+		conn->pending_off += (size_t)n;
+	}
+
+	return true;
+}
 
 /*
  * This must be called after acquiring the mutex
- * for the progress structure
+ * for the progress structure.
+ * Urgent messages (status and step transitions) are delivered to
+ * every client; the percentages are dropped for clients that are
+ * not reading, they get the latest state instead.
  */
-static void send_progress_msg(void)
+static void fill_ext_msg(struct progress_msg_ext *ext)
+{
+	struct swupdate_progress *pprog = &progress;
+
+	memcpy(&ext->msg, &pprog->msg, sizeof(ext->msg));
+	ext->msg.magic = PROGRESS_EXT_MAGIC;
+	ext->version = PROGRESS_API_VERSION;
+	ext->size = sizeof(*ext) - sizeof(ext->msg);
+	ext->stats = pprog->stats;
+}
+
+/*
+ * Update the shared memory snapshot with the seqlock protocol,
+ * readers retry while seq is odd or if it has changed
+ */
+static void publish_snapshot(const struct progress_msg_ext *ext)
+{
+	struct progress_snapshot *snap = progress.snapshot;
+	unsigned int seq;
+
+	if (!snap)
+		return;
+
+	seq = snap->seq;
+	__atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&snap->msg, ext, sizeof(snap->msg));
+	__atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void update_snapshot(void)
+{
+	struct progress_msg_ext ext;
+
+	if (!progress.snapshot)
+		return;
+	fill_ext_msg(&ext);
+	publish_snapshot(&ext);
+}
+
+static void send_progress_msg_type(bool urgent)
 {
 	struct progress_conn *conn, *tmp;
 	struct swupdate_progress *pprog = &progress;
+	struct progress_msg_ext ext;
 	void *buf;
 	size_t count;
-	ssize_t n;
+
+	fill_ext_msg(&ext);
+	publish_snapshot(&ext);
 
 	SIMPLEQ_FOREACH_SAFE(conn, &pprog->conns, next, tmp) {
-		buf = &pprog->msg;
-		count = sizeof(pprog->msg);
-		while (count > 0) {
-			n = send(conn->sockfd, buf, count, MSG_NOSIGNAL);
-			if (n <= 0) {
-				close(conn->sockfd);
-				SIMPLEQ_REMOVE(&pprog->conns, conn,
-					       	progress_conn, next);
-				free(conn);
-				break;
-			}
-			count -= (size_t)n;
-			buf = (char*)buf + n;
+		check_ext_request(conn);
+		if (conn->ext) {
+			buf = &ext;
+			count = sizeof(ext);
+		} else {
+			buf = &pprog->msg;
+			count = sizeof(pprog->msg);
 		}
+		if (!send_to_conn(conn, buf, count, urgent)) {
+			close(conn->sockfd);
+			SIMPLEQ_REMOVE(&pprog->conns, conn,
+				       progress_conn, next);
+			free(conn);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &pprog->last_sent);
+	pprog->sent_percent = pprog->msg.cur_percent;
+	pprog->sent_dwl_percent = pprog->msg.dwl_percent;
+	pprog->coalesced = false;
+}
+
+static void send_progress_msg(void)
+{
+	send_progress_msg_type(true);
+}
+
+/*
+ * Percentage updates are sent only if they are far enough
+ * from the last one sent, in time or in value. The last
+ * one (100%) is always sent.
+ */
+static bool progress_rate_limited(unsigned int perc, unsigned int sent)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct timespec now;
+	unsigned int delta = perc > sent ? perc - sent : sent - perc;
+
+	if (perc == 100)
+		return false;
+	if (delta < pprog->min_delta)
+		return true;
+	if (pprog->min_interval_ms) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed_ms(&pprog->last_sent, &now) < pprog->min_interval_ms)
+			return true;
 	}
+
+	return false;
+}
+
+void swupdate_progress_set_rate(unsigned int interval_ms, unsigned int delta)
+{
+	struct swupdate_progress *pprog = &progress;
+
+	pthread_mutex_lock(&pprog->lock);
+	pprog->min_interval_ms = interval_ms;
+	pprog->min_delta = delta ? delta : 1;
+	pthread_mutex_unlock(&pprog->lock);
 }
 
 static void _swupdate_download_update(unsigned int perc, unsigned long long totalbytes)
@@ -98,7 +288,11 @@ static void _swupdate_download_update(unsigned int perc, unsigned long long tota
 		pprog->msg.status = DOWNLOAD;
 		pprog->msg.dwl_percent = perc;
 		pprog->msg.dwl_bytes = totalbytes;
-		send_progress_msg();
+		if (progress_rate_limited(perc, pprog->sent_dwl_percent)) {
+			pprog->coalesced = true;
+			update_snapshot();
+		} else
+			send_progress_msg_type(false);
 	}
 	pthread_mutex_unlock(&pprog->lock);
 }
@@ -123,14 +317,187 @@ void swupdate_progress_update(unsigned int perc)
 {
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
-	if (perc != pprog->msg.cur_percent && pprog->step_running) {
+	if (perc != pprog->msg.cur_percent && pprog->steps_running) {
 		pprog->msg.status = PROGRESS;
 		pprog->msg.cur_percent = perc;
-		send_progress_msg();
+		if (progress_rate_limited(perc, pprog->sent_percent)) {
+			pprog->coalesced = true;
+			update_snapshot();
+		} else
+			send_progress_msg_type(false);
 	}
 	pthread_mutex_unlock(&pprog->lock);
 }
 
+/*
+ * Called by the copy pipeline, the values are sent together
+ * with the next progress message
+ */
+void swupdate_progress_stats(unsigned long long bytes_read,
+			     unsigned long long bytes_total,
+			     unsigned long long bytes_written)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct progress_stats *stats = &pprog->stats;
+	struct timespec now;
+	unsigned long long interval;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&pprog->lock);
+	if (!pprog->steps_running) {
+		pthread_mutex_unlock(&pprog->lock);
+		return;
+	}
+	stats->bytes_read = bytes_read;
+	stats->bytes_total = bytes_total;
+	stats->bytes_written = bytes_written;
+	stats->elapsed_ms = elapsed_ms(&pprog->step_start, &now);
+
+	interval = elapsed_ms(&pprog->last_sample, &now);
+	if (interval >= PROGRESS_RATE_INTERVAL_MS && bytes_written >= pprog->last_written) {
+		stats->throughput = (bytes_written - pprog->last_written) * 1000ULL / interval;
+		pprog->last_sample = now;
+		pprog->last_written = bytes_written;
+	}
+
+	if (bytes_read && bytes_total > bytes_read)
+		stats->eta_ms = (bytes_total - bytes_read) * stats->elapsed_ms / bytes_read;
+	else
+		stats->eta_ms = 0;
+	pthread_mutex_unlock(&pprog->lock);
+}
+
+/*
+ * Sum of the counters, called with the lock held. The percentage
+ * is the one of all bytes copied since the first of the running
+ * copies started.
+ */
+static void aggregate_counters(void)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct progress_stats *stats = &pprog->stats;
+	uint64_t total = pprog->done_total, read = pprog->done_read;
+	uint64_t written = pprog->done_written;
+	unsigned long long interval;
+	struct timespec now;
+	unsigned int perc;
+
+	if (!pprog->ncounters)
+		return;
+
+	for (unsigned int i = 0; i < PROGRESS_COUNTERS; i++) {
+		struct progress_counter *c = &pprog->counters[i];
+
+		if (!c->used)
+			continue;
+		total += c->total;
+		read += __atomic_load_n(&c->read, __ATOMIC_RELAXED);
+		written += __atomic_load_n(&c->written, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->bytes_read = read;
+	stats->bytes_total = total;
+	stats->bytes_written = written;
+	stats->elapsed_ms = elapsed_ms(&pprog->counters_start, &now);
+	interval = elapsed_ms(&pprog->last_sample, &now);
+	if (interval >= PROGRESS_RATE_INTERVAL_MS && written >= pprog->last_written) {
+		stats->throughput = (written - pprog->last_written) * 1000ULL / interval;
+		pprog->last_sample = now;
+		pprog->last_written = written;
+	}
+	if (read && total > read)
+		stats->eta_ms = (total - read) * stats->elapsed_ms / read;
+	else
+		stats->eta_ms = 0;
+
+	perc = total ? (unsigned int)(100ULL * (read < total ? read : total) / total) : 0;
+	if (perc != pprog->msg.cur_percent && pprog->steps_running) {
+		pprog->msg.status = PROGRESS;
+		pprog->msg.cur_percent = perc;
+		if (progress_rate_limited(perc, pprog->sent_percent))
+			pprog->coalesced = true;
+		else {
+			send_progress_msg_type(false);
+			return;
+		}
+	}
+	update_snapshot();
+}
+
+struct progress_counter *swupdate_progress_counter_start(uint64_t total)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct progress_counter *c = NULL;
+
+	pthread_mutex_lock(&pprog->lock);
+	for (unsigned int i = 0; pprog->steps_running && i < PROGRESS_COUNTERS; i++) {
+		if (!pprog->counters[i].used) {
+			c = &pprog->counters[i];
+			break;
+		}
+	}
+	if (c) {
+		c->total = total;
+		c->read = 0;
+		c->written = 0;
+		c->used = true;
+		if (!pprog->ncounters++) {
+			pprog->done_total = 0;
+			pprog->done_read = 0;
+			pprog->done_written = 0;
+			clock_gettime(CLOCK_MONOTONIC, &pprog->counters_start);
+			pprog->last_sample = pprog->counters_start;
+			pprog->last_written = 0;
+			pthread_cond_signal(&pprog->tick);
+		}
+	}
+	pthread_mutex_unlock(&pprog->lock);
+
+	return c;
+}
+
+/* The final values are reported before the step is completed */
+void swupdate_progress_counter_end(struct progress_counter *c)
+{
+	struct swupdate_progress *pprog = &progress;
+
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&pprog->lock);
+	aggregate_counters();
+	pprog->done_total += c->total;
+	pprog->done_read += c->read;
+	pprog->done_written += c->written;
+	c->used = false;
+	pprog->ncounters--;
+	pthread_mutex_unlock(&pprog->lock);
+}
+
+static void *progress_tick_thread(void __attribute__ ((__unused__)) *data)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct timespec ts;
+
+	pthread_mutex_lock(&pprog->lock);
+	for (;;) {
+		while (!pprog->ncounters)
+			pthread_cond_wait(&pprog->tick, &pprog->lock);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += PROGRESS_TICK_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pprog->tick, &pprog->lock, &ts);
+		aggregate_counters();
+	}
+
+	return NULL;
+}
+
 void swupdate_download_update(unsigned int perc, unsigned long long totalbytes)
 {
 	char	info[PRINFOSIZE];   		/* info */
@@ -162,7 +529,11 @@ void swupdate_progress_inc_step(const char *image, const char *handler_name)
 	pprog->msg.cur_percent = 0;
 	strlcpy(pprog->msg.cur_image, image, sizeof(pprog->msg.cur_image));
 	strlcpy(pprog->msg.hnd_name, handler_name, sizeof(pprog->msg.hnd_name));
-	pprog->step_running = true;
+	pprog->steps_running++;
+	memset(&pprog->stats, 0, sizeof(pprog->stats));
+	clock_gettime(CLOCK_MONOTONIC, &pprog->step_start);
+	pprog->last_sample = pprog->step_start;
+	pprog->last_written = 0;
 	pprog->msg.status = RUN;
 	send_progress_msg();
 	pthread_mutex_unlock(&pprog->lock);
@@ -172,7 +543,11 @@ void swupdate_progress_step_completed(void)
 {
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
-	pprog->step_running = false;
+	/* Do not lose the last percentage of the step */
+	if (pprog->coalesced)
+		send_progress_msg();
+	if (pprog->steps_running)
+		pprog->steps_running--;
 	pprog->msg.status = IDLE;
 	pthread_mutex_unlock(&pprog->lock);
 }
@@ -181,7 +556,7 @@ void swupdate_progress_end(RECOVERY_STATUS status)
 {
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
-	pprog->step_running = false;
+	pprog->steps_running = 0;
 	pprog->msg.status = status;
 	send_progress_msg();
 	pprog->msg.nsteps = 0;
@@ -215,7 +590,7 @@ void swupdate_progress_done(const char *info)
 		snprintf(pprog->msg.info, sizeof(pprog->msg.info), "%s", info);
 		pprog->msg.infolen = strlen(pprog->msg.info);
 	}
-	pprog->step_running = false;
+	pprog->steps_running = 0;
 	pprog->msg.status = DONE;
 	send_progress_msg();
 	pprog->msg.infolen = 0;
@@ -224,6 +599,8 @@ void swupdate_progress_done(const char *info)
 
 static void unlink_socket(void)
 {
+	if (progress.snapshot)
+		unlink(get_prog_snapshot());
 #ifdef CONFIG_SYSTEMD
 	if (sd_booted()) {
 		/*
@@ -236,6 +613,57 @@ static void unlink_socket(void)
 	unlink(get_prog_socket());
 }
 
+/*
+ * The snapshot is optional, the clients connected
+ * to the socket do not depend on it. It is created under
+ * a temporary name and renamed, so that a file or a link
+ * planted at its path is replaced and never written.
+ */
+static void create_snapshot(struct swupdate_progress *pprog)
+{
+	struct progress_snapshot *snap;
+	const char *path = get_prog_snapshot();
+	char *tmp;
+	int fd;
+
+	if (!path)
+		return;
+	if (asprintf(&tmp, "%s.XXXXXX", path) == -1)
+		return;
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		WARN("Cannot create progress snapshot %s: %s", path, strerror(errno));
+		free(tmp);
+		return;
+	}
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, sizeof(*snap)) < 0) {
+		WARN("Cannot resize progress snapshot %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+	snap = mmap(NULL, sizeof(*snap), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (snap == MAP_FAILED || rename(tmp, path) < 0) {
+		WARN("Cannot map progress snapshot %s: %s", path, strerror(errno));
+		if (snap != MAP_FAILED)
+			munmap(snap, sizeof(*snap));
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+	free(tmp);
+
+	snap->version = PROGRESS_API_VERSION;
+	pthread_mutex_lock(&pprog->lock);
+	pprog->snapshot = snap;
+	update_snapshot();
+	pthread_mutex_unlock(&pprog->lock);
+	/* readers check the magic after mapping */
+	__atomic_store_n(&snap->magic, PROGRESS_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+}
+
 void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 {
 	int listen, connfd;
@@ -244,8 +672,17 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 	struct swupdate_progress *pprog = &progress;
 	struct progress_conn *conn;
 
+	pthread_condattr_t cattr;
+	pthread_t tick;
+
 	pthread_mutex_init(&pprog->lock, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pprog->tick, &cattr);
+	pthread_condattr_destroy(&cattr);
 	SIMPLEQ_INIT(&pprog->conns);
+	if (start_worker_thread(&tick, progress_tick_thread, NULL))
+		WARN("Progress of the copies is only reported when they end");
 
 	/* Initialize and bind to UDS */
 	listen = listener_create(get_prog_socket(), SOCK_STREAM);
@@ -259,6 +696,8 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 			get_prog_socket());
 	}
 
+	create_snapshot(pprog);
+
 	thread_ready();
 	do {
 		clilen = sizeof(cliaddr);
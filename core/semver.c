@@ -160,6 +160,67 @@ semver_parse (const char *str, semver_t *ver) {
   return res;
 }
 
+/*
+ * Split buf at the separator and return what follows it,
+ * without copying.
+ */
+static char *
+cut_slice (char *buf, char sep) {
+  char *pr;
+
+  pr = strchr(buf, sep);
+  if (pr == NULL) return NULL;
+  *pr = '\0';
+
+  return pr + 1;
+}
+
+/**
+ * Parses buf in place as semver expression: prerelease and
+ * metadata point into buf, that must live as long as ver.
+ * Nothing is allocated, do not call semver_free() on ver.
+ *
+ * Returns:
+ *
+ * `0` - Parsed successfully
+ * `-1` - In case of error
+ */
+
+int
+semver_parse_inplace (char *buf, semver_t *ver) {
+  if (!semver_is_valid(buf)) return -1;
+
+  ver->metadata = cut_slice(buf, MT_DELIMITER[0]);
+  ver->prerelease = cut_slice(buf, PR_DELIMITER[0]);
+
+  return semver_parse_version(buf, ver);
+}
+
+/**
+ * Compares two semver strings (x, y) without allocating memory.
+ * The precedence follows semver.org: build metadata is ignored.
+ *
+ * Returns:
+ *
+ * `0` - Both are valid, the comparison is stored in res
+ * `-1` - One of them is not a valid semver
+ */
+
+int
+semver_compare_str (const char *x, const char *y, int *res) {
+  char xbuf[SLICE_SIZE], ybuf[SLICE_SIZE];
+  semver_t xver = {0}, yver = {0};
+
+  if (strlen(x) >= sizeof(xbuf) || strlen(y) >= sizeof(ybuf)) return -1;
+  strcpy(xbuf, x);
+  strcpy(ybuf, y);
+  if (semver_parse_inplace(xbuf, &xver) || semver_parse_inplace(ybuf, &yver))
+    return -1;
+
+  *res = semver_compare(xver, yver);
+  return 0;
+}
+
 /**
  * Parses a given string as semver expression.
  *
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <errno.h>
 #include <util.h>
 #include <bootloader.h>
@@ -39,6 +40,22 @@ static int do_save_state(char *key, char* value)
 	if (c < STATE_OK || c > STATE_LAST)
 		return -EINVAL;
 
+	/*
+	 * Do not write the environment again for the same value.
+	 * EFI Boot Guard maps the state to its own variables and
+	 * commits transactions on it, so it is always set.
+	 */
+	if (!is_bootloader(BOOTLOADER_EBG)) {
+		char *cur = bootloader_env_get(key);
+		bool same = cur && !strcmp(cur, value);
+
+		free(cur);
+		if (same) {
+			TRACE("%s=%s already stored", key, value);
+			return 0;
+		}
+	}
+
 	return bootloader_env_set(key, value);
 }
 
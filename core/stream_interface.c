@@ -41,10 +41,16 @@
 #include "mongoose_interface.h"
 #include "installer.h"
 #include "installer_priv.h"
+#include "swupdate_staging.h"
 #include "progress.h"
 #include "pctl.h"
 #include "state.h"
 #include "bootloader.h"
+#include "swupdate_timeline.h"
+#include "swupdate_metrics.h"
+#include "swupdate_profile.h"
+#include "swupdate_priority.h"
+#include "ipc_ring.h"
 
 #define BUFF_SIZE	 4096
 #define PERCENT_LB_INDEX	4
@@ -73,13 +79,65 @@ pthread_cond_t stream_wkup = PTHREAD_COND_INITIALIZER;
 
 static struct installer inst;
 
-static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs, bool encrypted)
+/* Bytes of the images of the current update, by how they were handled */
+static struct {
+	unsigned long long streamed;
+	unsigned long long staged;
+	unsigned long long skipped;
+} transfer;
+
+/*
+ * With CONFIG_SWDESCRIPTION_IN_MEMORY, sw-description and its
+ * signature are not written to TMPDIR: they are verified and
+ * parsed from these buffers.
+ */
+struct desc_buffer {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+#ifdef CONFIG_SWDESCRIPTION_IN_MEMORY
+static struct desc_buffer desc_buf, sig_buf;
+#define DESC_BUFFER	(&desc_buf)
+#define SIG_BUFFER	(&sig_buf)
+#else
+#define DESC_BUFFER	NULL
+#define SIG_BUFFER	NULL
+#endif
+
+static int copy_to_buffer(void *out, const void *buf, size_t len)
+{
+	struct desc_buffer *mem = (struct desc_buffer *)out;
+
+	if (len > mem->size - mem->len) {
+		ERROR("Description file larger than announced");
+		return -EFBIG;
+	}
+	memcpy(mem->buf + mem->len, buf, len);
+	mem->len += len;
+
+	return 0;
+}
+
+static void free_desc_buffer(struct desc_buffer *mem)
+{
+	if (!mem)
+		return;
+	free(mem->buf);
+	memset(mem, 0, sizeof(*mem));
+}
+
+static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
+			       bool encrypted, struct desc_buffer *mem)
 {
 	char output_file[MAX_IMAGE_FNAME];
 	struct filehdr fdh;
-	int fdout;
-	uint32_t checksum;
+	int fdout = -1;
+	uint32_t checksum = 0;
 	const char* TMPDIR = get_tmpdir();
+	void *out = &fdout;
+	writeimage callback = NULL;
 
 	if (extract_cpio_header(fd, &fdh, poffs)) {
 		return -1;
@@ -98,49 +156,444 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 	TRACE("Found file");
 	TRACE("\tfilename %s", fdh.filename);
 	TRACE("\tsize %u", (unsigned int)fdh.size);
+	metrics_count(METRICS_RECEIVED_BYTES, fdh.size);
+
+	if (mem) {
+		free_desc_buffer(mem);
+		mem->buf = malloc(fdh.size + 1);
+		if (!mem->buf)
+			return -ENOMEM;
+		mem->size = fdh.size;
+		out = mem;
+		callback = copy_to_buffer;
+	} else {
+		fdout = openfileoutput(output_file);
+		if (fdout < 0)
+			return -1;
+	}
 
-	fdout = openfileoutput(output_file);
-	if (fdout < 0)
+	if (copyfile(fd, out, fdh.size, poffs, 0, 0, 0, cpio_chksum_ptr(&fdh, &checksum), NULL,
+		     encrypted, NULL, callback) < 0 ||
+	    !swupdate_verify_chksum(checksum, &fdh)) {
+		if (fdout >= 0)
+			close(fdout);
+		free_desc_buffer(mem);
 		return -1;
+	}
+	if (fdout >= 0)
+		close(fdout);
+	if (mem)
+		mem->buf[mem->len] = '\0';
 
-	if (copyfile(fd, &fdout, fdh.size, poffs, 0, 0, 0, &checksum, NULL,
-		     encrypted, NULL, NULL) < 0) {
+	return 0;
+}
+
+static int parse_description(struct swupdate_cfg *software, const char *descfile)
+{
+#ifdef CONFIG_SWDESCRIPTION_IN_MEMORY
+	int ret;
+
+	(void)descfile;
+	ret = parse_buffer(software, desc_buf.buf, desc_buf.len,
+			   sig_buf.buf, sig_buf.len);
+	free_desc_buffer(&desc_buf);
+	free_desc_buffer(&sig_buf);
+
+	return ret;
+#else
+	return parse(software, descfile);
+#endif
+}
+
+/*
+ * With "parallel-hash", the hashes of the artifacts copied to TMPDIR
+ * are verified by a pool of threads while the next artifacts are
+ * read from the stream.
+ */
+struct hash_job {
+	char file[MAX_IMAGE_FNAME];
+	unsigned char sha256[SHA256_HASH_LENGTH];
+	const char *hashalg;
+	SIMPLEQ_ENTRY(hash_job) next;
+};
+
+SIMPLEQ_HEAD(hash_jobs, hash_job);
+
+struct hash_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wkup;
+	struct hash_jobs jobs;
+	pthread_t *workers;
+	unsigned int nworkers;
+	bool done;
+	int ret;
+};
+
+static int verify_file_hash(const char *file, unsigned char *hash,
+			    const char *hashalg)
+{
+	struct stat st;
+	unsigned long offset = 0;
+	int fdin, fdout = -1;
+	int ret;
+
+	fdin = open(file, O_RDONLY);
+	if (fdin < 0) {
+		ERROR("%s cannot be opened: %s", file, strerror(errno));
+		return -ENOENT;
+	}
+	if (fstat(fdin, &st) < 0) {
+		ERROR("%s cannot be accessed: %s", file, strerror(errno));
+		close(fdin);
+		return -EFAULT;
+	}
+
+	/* skip_file: the data is just read and hashed */
+	ret = copyfile_hash(fdin, &fdout, st.st_size, &offset, 0, 1, 0, NULL, hash,
+			    hashalg, false, NULL, NULL);
+	close(fdin);
+	if (ret < 0)
+		ERROR("Hash verification of %s failed", file);
+
+	return ret;
+}
+
+static void *hash_worker(void *data)
+{
+	struct hash_pool *pool = (struct hash_pool *)data;
+	struct hash_job *job;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (SIMPLEQ_EMPTY(&pool->jobs) && !pool->done)
+			pthread_cond_wait(&pool->wkup, &pool->lock);
+		job = SIMPLEQ_FIRST(&pool->jobs);
+		if (job)
+			SIMPLEQ_REMOVE_HEAD(&pool->jobs, next);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!job)
+			break;
+
+		ret = verify_file_hash(job->file, job->sha256, job->hashalg);
+		free(job);
+		if (ret < 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->ret = ret;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static void hash_pool_init(struct hash_pool *pool)
+{
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wkup, NULL);
+	SIMPLEQ_INIT(&pool->jobs);
+}
+
+static void hash_pool_start(struct hash_pool *pool)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	if (ncpus < 1)
+		ncpus = 1;
+	pool->workers = calloc(ncpus, sizeof(*pool->workers));
+	if (!pool->workers)
+		return;
+	for (i = 0; i < (unsigned int)ncpus; i++) {
+		if (start_worker_thread(&pool->workers[i], hash_worker, pool))
+			break;
+	}
+	pool->nworkers = i;
+	TRACE("Verifying hashes with %u threads", pool->nworkers);
+}
+
+static int hash_pool_submit(struct hash_pool *pool, struct img_type *img)
+{
+	struct hash_job *job;
+
+	if (!pool->workers)
+		hash_pool_start(pool);
+	/* No thread could be started, verify synchronously */
+	if (!pool->nworkers)
+		return verify_file_hash(img->extract_file, img->sha256,
+					img->hashalg);
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	strlcpy(job->file, img->extract_file, sizeof(job->file));
+	memcpy(job->sha256, img->sha256, sizeof(job->sha256));
+	job->hashalg = img->hashalg;
+
+	pthread_mutex_lock(&pool->lock);
+	SIMPLEQ_INSERT_TAIL(&pool->jobs, job, next);
+	pthread_cond_signal(&pool->wkup);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*
+ * Wait until all hashes are verified, or drop the pending
+ * ones if an error was already found
+ */
+static int hash_pool_finish(struct hash_pool *pool, bool drop)
+{
+	struct hash_job *job;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->done = true;
+	while (drop && (job = SIMPLEQ_FIRST(&pool->jobs)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&pool->jobs, next);
+		free(job);
+	}
+	pthread_cond_broadcast(&pool->wkup);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i], NULL);
+	free(pool->workers);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wkup);
+
+	return pool->ret;
+}
+
+/*
+ * All images sharing the same artifact and the same hash
+ * do not need to verify it again during the installation
+ */
+static void set_hash_verified(struct swupdate_cfg *software, struct img_type *img)
+{
+	struct imglist *list[] = {&software->images,
+				  &software->scripts,
+				  &software->bootscripts};
+	struct img_type *p;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(list); i++) {
+		ARTIFACT_FOREACH(p, software, list[i], img->fname) {
+			if (p->hashalg == img->hashalg &&
+			    !memcmp(p->sha256, img->sha256, sizeof(p->sha256)))
+				p->hash_verified = true;
+		}
+	}
+}
+
+/*
+ * Once sw-description is parsed, a client can ask which artifacts
+ * are required (GET_ARTIFACT_REQUIRED) and not send the others
+ */
+static void set_described(bool described)
+{
+	pthread_mutex_lock(&stream_mutex);
+	inst.described = described;
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+/*
+ * With "auto-stream", an image is streamed to its handler when this is
+ * safe: the handler reads the image only once and in order, and the hash
+ * is verified while the image is copied. Images sharing their file,
+ * partitioners and images with auto-stream = "false" are staged.
+ */
+static void auto_stream_images(struct swupdate_cfg *software)
+{
+	struct img_type *img, *other;
+	const char *value;
+	bool shared;
+
+	LIST_FOREACH(img, &software->images, next) {
+		if (img->install_directly || img->is_partitioner || !img->fname[0])
+			continue;
+		if (!(get_handler_mask(img) & STREAM_HANDLER) ||
+		    !IsValidHash(img->sha256))
+			continue;
+		value = dict_get_value(&img->properties, "auto-stream");
+		if (value && !strtobool(value))
+			continue;
+
+		shared = false;
+		LIST_FOREACH(other, &software->images, next) {
+			if (other != img && !strcmp(other->fname, img->fname)) {
+				shared = true;
+				break;
+			}
+		}
+		if (shared)
+			continue;
+
+		TRACE("%s is streamed to the %s handler", img->fname, img->type);
+		img->install_directly = 1;
+	}
+}
+
+static void transfer_report(void)
+{
+	INFO("Artifacts: %llu bytes streamed, %llu bytes staged in TMPDIR, %llu bytes skipped",
+	     transfer.streamed, transfer.staged, transfer.skipped);
+	metrics_count(METRICS_STREAMED_BYTES, transfer.streamed);
+	metrics_count(METRICS_STAGED_BYTES, transfer.staged);
+}
+
+/*
+ * Copy a file of the archive into TMPDIR, verifying
+ * its checksum and hash
+ */
+static int extract_to_tmp(int fd, struct img_type *img, struct filehdr *fdh,
+			  struct swupdate_cfg *software, struct hash_pool *pool)
+{
+	unsigned long offset = 0;
+	uint32_t checksum = 0;
+	bool ram;
+	int fdout;
+
+	fdout = staging_create(software, img, fdh->size, &ram);
+	if (fdout < 0)
+		return -1;
+	if (!ram && !img_check_free_space(img, fdout)) {
 		close(fdout);
 		return -1;
 	}
-	if (!swupdate_verify_chksum(checksum, &fdh)) {
+	/* the pool verifies the copies in TMPDIR only */
+	if (copyfile_hash(fd, &fdout, fdh->size, &offset, 0, 0, 0, cpio_chksum_ptr(fdh, &checksum),
+			  pool && !ram ? NULL : img->sha256, img->hashalg, false, NULL, NULL) < 0) {
 		close(fdout);
 		return -1;
 	}
 	close(fdout);
+	if (!swupdate_verify_chksum(checksum, fdh))
+		return -1;
+	transfer.staged += fdh->size;
+	if (pool && IsValidHash(img->sha256)) {
+		if (!ram && hash_pool_submit(pool, img) < 0)
+			return -1;
+		set_hash_verified(software, img);
+	}
 
 	return 0;
 }
 
-static bool update_transaction_state(struct swupdate_cfg *software, update_state_t newstate)
+/*
+ * An SWU in a regular file can be read at any offset: keep an own
+ * open file description of it, the installer opens one for each
+ * image from it. Returns false if the stream must be read in order.
+ */
+static bool swu_open(int fd, struct swupdate_cfg *software)
 {
-	if (!software->parms.dry_run && software->bootloader_transaction_marker) {
-		if (newstate == STATE_INSTALLED)
-			bootloader_env_unset(BOOTVAR_TRANSACTION);
-		else
-			bootloader_env_set(BOOTVAR_TRANSACTION, get_state_string(newstate));
-	}
-	if (!software->parms.dry_run
-	    && software->bootloader_state_marker
-	    && save_state(newstate) != SERVER_OK) {
-		WARN("Cannot persistently store %s update state.", get_state_string(newstate));
+	char path[32];
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	software->swu_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (software->swu_fd < 0) {
+		TRACE("SWU cannot be reopened (%s), installing from stream",
+		      strerror(errno));
 		return false;
 	}
+
 	return true;
 }
 
-static int extract_files(int fd, struct swupdate_cfg *software)
+/*
+ * Index the remaining entries of the SWU with a single walk through
+ * the headers. Scripts are copied to TMPDIR, images are left in the SWU
+ * and the installer reads them at the indexed offsets, in the order of
+ * sw-description. Files that are not required are not read at all.
+ */
+static int extract_indexed(int fd, struct swupdate_cfg *software,
+			   struct hash_pool *pool)
+{
+	struct cpio_index idx;
+	struct img_type *img;
+	off_t start;
+	int ret = 0;
+
+	start = lseek(fd, 0, SEEK_CUR);
+	if (start < 0 || cpio_index(fd, start, &idx) < 0) {
+		ERROR("SWU cannot be indexed");
+		return -1;
+	}
+	TRACE("SWU indexed: %u files", idx.count);
+
+	for (unsigned int n = 0; n < idx.count && !ret; n++) {
+		struct filehdr fdh = idx.entries[n].hdr;
+		swupdate_file_t skip;
+
+		metrics_count(METRICS_RECEIVED_BYTES, fdh.size);
+
+		if (artifact_provided(software, &software->images, &fdh,
+				      idx.entries[n].offset)) {
+			TRACE("Indexed %s, %lu bytes at %lld", fdh.filename,
+			      fdh.size, (long long)idx.entries[n].offset);
+			transfer.streamed += fdh.size;
+			continue;
+		}
+
+		skip = check_if_required(software, &software->scripts, &fdh,
+					 get_tmpdir(), &img);
+		if (skip == SKIP_FILE)
+			skip = check_if_required(software, &software->bootscripts, &fdh,
+						 get_tmpdir(), &img);
+		switch (skip) {
+		case SKIP_FILE:
+			TRACE("%s not required: skipping", fdh.filename);
+			transfer.skipped += fdh.size;
+			break;
+		case COPY_FILE:
+		case INSTALL_FROM_STREAM:
+			if (lseek(fd, idx.entries[n].offset, SEEK_SET) < 0 ||
+			    extract_to_tmp(fd, img, &fdh, software, pool) < 0)
+				ret = -1;
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+	}
+
+	cpio_index_free(&idx);
+
+	return ret;
+}
+
+static int describe(struct swupdate_cfg *software, const char *descfile)
+{
+	struct timeline_span span;
+
+	timeline_begin(&span);
+	if (parse_description(software, descfile)) {
+		ERROR("Compatible SW not found");
+		return -1;
+	}
+	timeline_end(&span, "parse", SW_DESCRIPTION_FILENAME);
+
+	if (check_hw_compatibility(software)) {
+		ERROR("SW not compatible with hardware");
+		return -1;
+	}
+
+	return preupdatecmd(software) ? -1 : 0;
+}
+
+static int __extract_files(int fd, struct swupdate_cfg *software,
+			   struct hash_pool *pool)
 {
 	int status = STREAM_WAIT_DESCRIPTION;
 	unsigned long offset;
 	struct filehdr fdh;
 	swupdate_file_t skip;
-	uint32_t checksum;
+	uint32_t checksum = 0;
 	int fdout;
 	struct img_type *img, *part;
 	char output_file[MAX_IMAGE_FNAME];
@@ -155,6 +608,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 	/* preset the info about the install parts */
 
 	offset = 0;
+	memset(&transfer, 0, sizeof(transfer));
 
 #ifdef CONFIG_UBIVOL
 	mtd_init();
@@ -165,7 +619,8 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 		switch (status) {
 		/* Waiting for the first Header */
 		case STREAM_WAIT_DESCRIPTION:
-			if (extract_file_to_tmp(fd, SW_DESCRIPTION_FILENAME, &offset, encrypted_sw_desc) < 0 )
+			if (extract_file_to_tmp(fd, SW_DESCRIPTION_FILENAME, &offset, encrypted_sw_desc,
+						DESC_BUFFER) < 0)
 				return -1;
 
 			status = STREAM_WAIT_SIGNATURE;
@@ -174,23 +629,21 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 		case STREAM_WAIT_SIGNATURE:
 #ifdef CONFIG_SIGNED_IMAGES
 			snprintf(output_file, sizeof(output_file), "%s.sig", SW_DESCRIPTION_FILENAME);
-			if (extract_file_to_tmp(fd, output_file, &offset, false) < 0 )
+			if (extract_file_to_tmp(fd, output_file, &offset, false, SIG_BUFFER) < 0)
 				return -1;
 #endif
 			snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME);
-			if (parse(software, output_file)) {
-				ERROR("Compatible SW not found");
+			if (describe(software, output_file))
 				return -1;
-			}
-
-			if (check_hw_compatibility(software)) {
-				ERROR("SW not compatible with hardware");
-				return -1;
-			}
-			if (preupdatecmd(software)) {
-				return -1;
-			}
+			set_described(true);
 			status = STREAM_DATA;
+			if (software->indexed_install && swu_open(fd, software)) {
+				if (extract_indexed(fd, software, pool) < 0)
+					return -1;
+				status = STREAM_END;
+			} else if (software->auto_stream) {
+				auto_stream_images(software);
+			}
 			break;
 
 		case STREAM_DATA:
@@ -198,6 +651,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				ERROR("CPIO HEADER");
 				return -1;
 			}
+			metrics_count(METRICS_RECEIVED_BYTES, fdh.size);
 			if (strcmp("TRAILER!!!", fdh.filename) == 0) {
  				/*
 			 	 * Keep reading the cpio padding, if any, up
@@ -214,7 +668,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 						  &software->bootscripts};
 
 			for (unsigned int i = 0; i < ARRAY_SIZE(list); i++) {
-				skip = check_if_required(list[i], &fdh,
+				skip = check_if_required(software, list[i], &fdh,
 						get_tmpdir(),
 						&img);
 
@@ -236,31 +690,19 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 			 */
 			switch (skip) {
 			case COPY_FILE:
-				fdout = openfileoutput(img->extract_file);
-				if (fdout < 0)
+				if (extract_to_tmp(fd, img, &fdh, software, pool) < 0)
 					return -1;
-				if (!img_check_free_space(img, fdout)) {
-					close(fdout);
-					return -1;
-				}
-				if (copyfile(fd, &fdout, fdh.size, &offset, 0, 0, 0, &checksum, img->sha256, false, NULL, NULL) < 0) {
-					close(fdout);
-					return -1;
-				}
-				if (!swupdate_verify_chksum(checksum, &fdh)) {
-					close(fdout);
-					return -1;
-				}
-				close(fdout);
 				break;
 
 			case SKIP_FILE:
-				if (copyfile(fd, &fdout, fdh.size, &offset, 0, skip, 0, &checksum, NULL, false, NULL, NULL) < 0) {
+				if (copyfile(fd, &fdout, fdh.size, &offset, 0, skip, 0,
+					     cpio_chksum_ptr(&fdh, &checksum), NULL, false, NULL, NULL) < 0) {
 					return -1;
 				}
 				if (!swupdate_verify_chksum(checksum, &fdh)) {
 					return -1;
 				}
+				transfer.skipped += fdh.size;
 				break;
 			case INSTALL_FROM_STREAM:
 				TRACE("Installing STREAM %s, %lld bytes", img->fname, img->size);
@@ -282,9 +724,10 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				LIST_FOREACH(part, &software->images, next) {
 					if (!part->install_directly && part->is_partitioner) {
 						TRACE("Need to adjust partition %s before streaming %s",
-							part->volname, img->fname);
+							IMG_STRING(part->volname), img->fname);
 						if (install_single_image(part, software->parms.dry_run)) {
-							ERROR("Error adjusting partition %s", part->volname);
+							ERROR("Error adjusting partition %s",
+							      IMG_STRING(part->volname));
 							return -1;
 						}
 						/* Avoid trying to adjust again later */
@@ -296,6 +739,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 					ERROR("Error streaming %s", img->fname);
 					return -1;
 				}
+				transfer.streamed += fdh.size;
 				TRACE("END INSTALLING STREAMING");
 				break;
 			}
@@ -320,6 +764,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 					return -1;
 				}
 			}
+			transfer_report();
 			return 0;
 		default:
 			return -1;
@@ -327,14 +772,39 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 	}
 }
 
+static int extract_files(int fd, struct swupdate_cfg *software)
+{
+	struct hash_pool pool;
+	int ret;
+
+	if (!software->parallel_hash)
+		return __extract_files(fd, software, NULL);
+
+	hash_pool_init(&pool);
+	ret = __extract_files(fd, software, &pool);
+	if (hash_pool_finish(&pool, ret < 0) < 0) {
+		ERROR("Hash verification failed");
+		ret = -1;
+	}
+
+	return ret;
+}
+
 static int cpfiles(int fdin, int fdout, size_t max)
 {
 	char *buf;
-	const int bufsize = 16 * 1024;
+	const size_t bufsize = copy_buffer_size(fdout, 0);
 	int ret, len;
-	size_t maxread;
+	size_t maxread, copied;
 	bool cpyall = (max == 0);
 
+	/* Try first to move the data in kernel */
+	ret = copy_in_kernel(fdin, fdout, cpyall ? SIZE_MAX : max, &copied);
+	if (ret != -EOPNOTSUPP)
+		return ret < 0 ? -EIO : 0;
+	if (!cpyall)
+		max -= copied;
+
 	buf = (char *)malloc(bufsize);
 	if (!buf)
 		return -ENOMEM;
@@ -347,7 +817,7 @@ static int cpfiles(int fdin, int fdout, size_t max)
 		if (cpyall)
 			max =  2 * bufsize;
 		maxread = min(bufsize, max);
-		len = read(fdin, buf, maxread);
+		len = ipc_ring_read(fdin, buf, maxread);
 		if (len < 0) {
 			free(buf);
 			return -EIO;
@@ -374,7 +844,7 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 {
 	unsigned char *buf;
 	int fdout = -1, ret, len;
-	const int bufsize = 16 * 1024;
+	const size_t bufsize = copy_buffer_size(-1, 0);
 	int tmpfd = -1;
 	char tmpfilename[MAX_IMAGE_FNAME];
 	struct filehdr fdh;
@@ -410,7 +880,7 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 		ret = -EFAULT;
 		goto no_copy_output;
 	}
-	len = read(fdin, buf, bufsize);
+	len = ipc_ring_read(fdin, buf, bufsize);
 	if (len < 0) {
 		ERROR("Reading from file failed, error %d", errno);
 		ret = -EFAULT;
@@ -428,8 +898,8 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	 * So let a buffer just for the signature - tmpsize is enough for both
 	 * sw-description and sw-description.sig, if any.
 	 */
-	tmpsize = SWUPDATE_ALIGN(fdh.size + fdh.namesize + sizeof(struct new_ascii_header) + bufsize - len,
-			bufsize);
+	tmpsize = fdh.size + fdh.namesize + sizeof(struct new_ascii_header) + bufsize - len;
+	tmpsize = ((tmpsize + bufsize - 1) / bufsize) * bufsize;
 	ret = copy_write(&tmpfd, buf, len);  /* copy the first buffer */
 	if (ret < 0) {
 		ret =  -EIO;
@@ -447,14 +917,15 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	lseek(tmpfd, 0, SEEK_SET);
 	offset = 0;
 
-	if (extract_file_to_tmp(tmpfd, SW_DESCRIPTION_FILENAME, &offset, encrypted_sw_desc) < 0) {
+	if (extract_file_to_tmp(tmpfd, SW_DESCRIPTION_FILENAME, &offset, encrypted_sw_desc,
+				DESC_BUFFER) < 0) {
 		ERROR("%s cannot be extracted", SW_DESCRIPTION_FILENAME);
 		ret = -EINVAL;
 		goto no_copy_output;
 	}
 #ifdef CONFIG_SIGNED_IMAGES
 	snprintf(output_file, sizeof(output_file), "%s.sig", SW_DESCRIPTION_FILENAME);
-	if (extract_file_to_tmp(tmpfd, output_file, &offset, false) < 0 ) {
+	if (extract_file_to_tmp(tmpfd, output_file, &offset, false, SIG_BUFFER) < 0) {
 		ERROR("Signature cannot be extracted:%s", output_file);
 		ret = -EINVAL;
 		goto no_copy_output;
@@ -462,7 +933,7 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 
 #endif
 	snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME);
-	if (parse(software, output_file)) {
+	if (parse_description(software, output_file)) {
 		ERROR("Compatible SW not found");
 		ret = -1;
 		goto no_copy_output;
@@ -516,6 +987,8 @@ void *network_initializer(void *data)
 	struct swupdate_cfg *software = data;
 	struct swupdate_request *req;
 	struct swupdate_parms parms;
+	struct timeline_span update_span, span;
+	char bundle_state;
 
 	/* No installation in progress */
 	memset(&inst, 0, sizeof(inst));
@@ -539,6 +1012,11 @@ void *network_initializer(void *data)
 		pthread_mutex_unlock(&stream_mutex);
 		notify(START, RECOVERY_NO_ERROR, INFOLEVEL, "Software Update started !");
 		TRACE("Software update started");
+		timeline_start();
+		timeline_begin(&update_span);
+		profile_update_begin();
+		metrics_count(METRICS_UPDATES_STARTED, 1);
+		install_priority_begin();
 
 		/* Create directories for scripts/datadst */
 		swupdate_create_directory(SCRIPTS_DIR_SUFFIX);
@@ -546,6 +1024,19 @@ void *network_initializer(void *data)
 
 		req = &inst.req;
 
+		/*
+		 * An update that is not part of the open bundle ends it,
+		 * the bootloader variables of its SWUs are dropped
+		 */
+		if (software->in_bundle && req->bundle == BUNDLE_NONE) {
+			WARN("Bundle of SWUs not completed, its bootloader "
+			     "environment is dropped");
+			bundle_drop();
+			software->in_bundle = false;
+			software->stored_state = STATE_NOT_AVAILABLE;
+		}
+		software->bundle = req->bundle;
+
 		/*
 		 * Save default values, they can be changed by a
 		 * install request
@@ -574,11 +1065,21 @@ void *network_initializer(void *data)
 			strlcpy(software->parms.running_mode, req->running_mode, sizeof(software->parms.running_mode) - 1);
 		}
 
+		/*
+		 * The sender goes on while sw-description is parsed and
+		 * while a handler waits for its device
+		 */
+		if (software->stream_buffer &&
+		    ipc_ring_readahead(inst.fd, software->stream_buffer) == -ENOMEM)
+			WARN("No memory to buffer the stream, reading it as it is installed");
+
 		/*
 		 * Check if the stream should be saved
 		 */
 		if (!req->disable_store_swu  && strlen(software->output)) {
+			timeline_begin(&span);
 			ret = save_stream(inst.fd, software);
+			timeline_end(&span, "stream", "save");
 			if (ret < 0) {
 				notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL,
 					"Error saving stream, not installing ...");
@@ -588,6 +1089,7 @@ void *network_initializer(void *data)
 			 * now replace the file descriptor with
 			 * the saved file
 			 */
+			ipc_ring_detach(inst.fd);
 			if (!(inst.fd < 0))
 				close(inst.fd);
 			inst.fd = open(software->output, O_RDONLY,  S_IRUSR);
@@ -597,17 +1099,37 @@ void *network_initializer(void *data)
 			}
 		}
 
+		/* with deferred-init, the first update loads keys and handlers */
+		if (!ret && swupdate_deferred_init()) {
+			notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL,
+				"Initialization failed, not installing ...");
+			ret = -EINVAL;
+		}
+
 		if (!ret) {
 #ifdef CONFIG_MTD
+			/*
+			 * Forget the devices seen by the previous update,
+			 * they are scanned again when a handler asks for them
+			 */
 			mtd_cleanup();
-			scan_mtd_devices();
 #endif
+			/*
+			 * the environment may have changed since the last
+			 * update, but not since the previous SWU of a bundle
+			 */
+			if (!software->in_bundle)
+				bootloader_env_invalidate();
 			/*
 		 	 * extract the meta data and relevant parts
 		 	 * (flash images) from the install image
 		 	 */
+			timeline_begin(&span);
 			ret = extract_files(inst.fd, software);
+			timeline_end(&span, "stream", "extract");
+			set_described(false);
 		}
+		ipc_ring_detach(inst.fd);
 		if (!(inst.fd < 0))
 			close(inst.fd);
 
@@ -657,11 +1179,18 @@ void *network_initializer(void *data)
 			update_transaction_state(software, STATE_IN_PROGRESS);
 
 			notify(RUN, RECOVERY_NO_ERROR, INFOLEVEL, "Installation in progress");
+			timeline_begin(&span);
 			ret = install_images(software);
+			timeline_end(&span, "install", "images");
 			if (ret != 0) {
 				update_transaction_state(software, STATE_FAILED);
 				notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL, "Installation failed !");
 				inst.last_install = FAILURE;
+			} else if (software->bundle == BUNDLE_NEXT) {
+				/* the transaction goes on with the next SWU */
+				notify(SUCCESS, RECOVERY_NO_ERROR, INFOLEVEL,
+				       "SWU of the bundle installed, waiting for the next one");
+				inst.last_install = SUCCESS;
 			} else {
 				/*
 				 * Clear the recovery variable to indicate to bootloader
@@ -681,21 +1210,48 @@ void *network_initializer(void *data)
 			notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL, "Image invalid or corrupted. Not installing ...");
 		}
 
-		swupdate_progress_end(inst.last_install);
+		/*
+		 * A bundle goes on after a SWU sent with BUNDLE_NEXT,
+		 * the progress clients must not act on its end yet
+		 */
+		if (inst.last_install == SUCCESS && software->bundle == BUNDLE_NEXT) {
+			software->in_bundle = true;
+			swupdate_progress_end(DONE);
+		} else {
+			if (software->in_bundle)
+				bundle_drop();
+			software->in_bundle = false;
+			swupdate_progress_end(inst.last_install);
+		}
+
+		timeline_end(&update_span, "update",
+			     inst.last_install == SUCCESS ? "successful" : "failed");
+		metrics_count(inst.last_install == SUCCESS ? METRICS_UPDATES_SUCCEEDED :
+			      METRICS_UPDATES_FAILED, 1);
+		profile_update_end(software->version,
+				   inst.last_install == SUCCESS ? 0 : -1);
+		timeline_write();
 
 		/*
 		 * Reload default values for update
 		 */
 		software->parms = parms;
 
+		/* drop changes deferred by handlers if not applied */
+		run_commit_hooks(false);
+
 		/* release temp files we may have created */
+		bundle_state = software->stored_state;
 		cleanup_files(software);
+		if (software->in_bundle)
+			software->stored_state = bundle_state;
 
 #ifndef CONFIG_NOCLEANUP
 		swupdate_remove_directory(SCRIPTS_DIR_SUFFIX);
 		swupdate_remove_directory(DATADST_DIR_SUFFIX);
 #endif
 
+		install_priority_end();
 		pthread_mutex_lock(&stream_mutex);
 		inst.status = IDLE;
 		pthread_mutex_unlock(&stream_mutex);
@@ -11,6 +11,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <fnmatch.h>
@@ -45,9 +46,18 @@
 #include "progress.h"
 #include "parselib.h"
 #include "swupdate_settings.h"
+#include "swupdate_membudget.h"
+#include "content_check.h"
+#include "swupdate_staging.h"
+#include "swupdate_priority.h"
 #include "pctl.h"
 #include "state.h"
 #include "bootloader.h"
+#include "ipc_ring.h"
+#if defined(CONFIG_CHANNEL_CURL)
+#include "channel.h"
+extern channel_op_res_t channel_curl_init(void);
+#endif
 
 #ifdef CONFIG_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -192,6 +202,89 @@ struct swupdate_cfg *get_swupdate_cfg(void) {
 	return &swcfg;
 }
 
+/*
+ * Time spent in each startup step, reported at TRACE level
+ */
+static unsigned long long startup_begin, startup_last;
+
+static unsigned long long startup_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void startup_step(const char *step)
+{
+	unsigned long long now = startup_now_us();
+
+	TRACE("Startup: %s took %llu us, %llu us since start", step,
+	      now - startup_last, now - startup_begin);
+	startup_last = now;
+}
+
+/*
+ * Resources that are not needed before an update is installed.
+ * With "deferred-init" they are initialized when the first update
+ * starts, and again at the next update if this fails.
+ */
+static pthread_mutex_t deferred_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool deferred_init_done = false;
+
+static int init_update_resources(struct swupdate_cfg *sw)
+{
+	if (strlen(sw->publickeyfname)) {
+		if (swupdate_dgst_init(sw, sw->publickeyfname)) {
+			ERROR("Crypto cannot be initialized.");
+			return -EINVAL;
+		}
+	}
+
+	/*
+	 * If an AES key is passed, load it to allow
+	 * to decrypt images. A key set via IPC in the
+	 * meantime is not overwritten.
+	 */
+	if (strlen(sw->aeskeyfname) && !get_aes_key()) {
+		if (load_decryption_key(sw->aeskeyfname)) {
+			ERROR("Key file does not contain a valid AES key.");
+			return -EINVAL;
+		}
+	}
+
+#ifdef CONFIG_MTD
+	mtd_init();
+	ubi_init();
+#endif
+
+	lua_handlers_init();
+
+	print_registered_handlers();
+
+	return 0;
+}
+
+int swupdate_deferred_init(void)
+{
+	unsigned long long start;
+	int ret = 0;
+
+	pthread_mutex_lock(&deferred_init_lock);
+	if (!deferred_init_done) {
+		start = startup_now_us();
+		ret = init_update_resources(&swcfg);
+		if (!ret) {
+			deferred_init_done = true;
+			TRACE("Startup: update resources took %llu us",
+			      startup_now_us() - start);
+		}
+	}
+	pthread_mutex_unlock(&deferred_init_lock);
+
+	return ret;
+}
+
 /*
  * Extract board and revision number from command line
  * The parameter is in the format <board>:<revision>
@@ -260,11 +353,8 @@ static void swupdate_init(struct swupdate_cfg *sw)
 	LIST_INIT(&sw->bootloader);
 	LIST_INIT(&sw->extprocs);
 	sw->cert_purpose = SSL_PURPOSE_DEFAULT;
-
-#ifdef CONFIG_MTD
-	mtd_init();
-	ubi_init();
-#endif
+	sw->swu_fd = -1;
+	sw->stream_buffer = IPC_READAHEAD_SIZE;
 }
 
 static int parse_cert_purpose(const char *text)
@@ -329,6 +419,68 @@ static int read_globals_settings(void *elem, void *data)
 		sw->cert_purpose = parse_cert_purpose(tmp);
 	GET_FIELD_STRING(LIBCFG_PARSER, elem, "forced-signer-name",
 				sw->forced_signer_name);
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "hash-backend", tmp);
+	if (tmp[0] != '\0') {
+		if (swupdate_HASH_set_backend(tmp) != 0) {
+			ERROR("Hash backend '%s' is not supported.", tmp);
+			exit(EXIT_FAILURE);
+		}
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "decrypt-backend", tmp);
+	if (tmp[0] != '\0') {
+		if (swupdate_DECRYPT_set_backend(tmp) != 0) {
+			ERROR("Decryption backend '%s' is not supported.", tmp);
+			exit(EXIT_FAILURE);
+		}
+		tmp[0] = '\0';
+	}
+	get_field(LIBCFG_PARSER, elem, "parallel-hash", &sw->parallel_hash);
+	get_field(LIBCFG_PARSER, elem, "indexed-install", &sw->indexed_install);
+	get_field(LIBCFG_PARSER, elem, "auto-stream", &sw->auto_stream);
+	get_field(LIBCFG_PARSER, elem, "subprocess-threads", &sw->subprocess_threads);
+	get_field(LIBCFG_PARSER, elem, "deferred-init", &sw->deferred_init);
+	{
+		int interval = 0, delta = 1;
+
+		get_field(LIBCFG_PARSER, elem, "progress-interval", &interval);
+		get_field(LIBCFG_PARSER, elem, "progress-delta", &delta);
+		if (interval < 0 || delta < 0 || delta > 100) {
+			ERROR("Wrong progress-interval / progress-delta settings");
+			exit(EXIT_FAILURE);
+		}
+		swupdate_progress_set_rate(interval, delta);
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "copy-buffer-size", tmp);
+	if (tmp[0] != '\0') {
+		sw->copy_buffer_size = ustrtoull(tmp, NULL, 0);
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "writeback-chunk", tmp);
+	if (tmp[0] != '\0') {
+		sw->writeback_chunk = ustrtoull(tmp, NULL, 0);
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "stream-buffer", tmp);
+	if (tmp[0] != '\0') {
+		sw->stream_buffer = ustrtoull(tmp, NULL, 0);
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "staging-ram", tmp);
+	if (tmp[0] != '\0') {
+		staging_set_limit(ustrtoull(tmp, NULL, 0));
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "memory-budget", tmp);
+	if (tmp[0] != '\0') {
+		membudget_set_limit(ustrtoull(tmp, NULL, 0));
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "content-cache", tmp);
+	if (tmp[0] != '\0') {
+		content_check_set_cache(tmp);
+		tmp[0] = '\0';
+	}
 
 	char software_select[SWUPDATE_GENERAL_STRING_SIZE] = "";
 	GET_FIELD_STRING(LIBCFG_PARSER, elem, "select", software_select);
@@ -423,6 +575,9 @@ int main(int argc, char **argv)
 	char main_options[256];
 	unsigned int public_key_mandatory = 0;
 	struct sigaction sa;
+#ifdef CONFIG_SYSTEMD
+	bool systemd_ready = false;
+#endif
 #ifdef CONFIG_SURICATTA
 	int opt_u = 0;
 	char *suricattaoptions;
@@ -473,6 +628,8 @@ int main(int argc, char **argv)
 
 	memset(fname, 0, sizeof(fname));
 
+	startup_begin = startup_last = startup_now_us();
+
 	/* Initialize internal database */
 	swupdate_init(&swcfg);
 
@@ -556,6 +713,10 @@ int main(int argc, char **argv)
 		 */
 		(void)read_module_settings(&handle, "logcolors", read_console_settings, &swcfg);
 		(void)read_module_settings(&handle, "processes", read_processes_settings, &swcfg);
+		(void)read_module_settings(&handle, "install-priority",
+					   install_priority_settings, NULL);
+		(void)read_module_settings(&handle, "lua-handlers",
+					   lua_handlers_settings, NULL);
 	}
 
 	/*
@@ -759,20 +920,19 @@ int main(int argc, char **argv)
 	}
 #endif
 
-	swupdate_crypto_init();
+	startup_step("configuration");
 
-	if (strlen(swcfg.publickeyfname)) {
-		if (swupdate_dgst_init(&swcfg, swcfg.publickeyfname)) {
-			fprintf(stderr,
-				 "Error: Crypto cannot be initialized.\n");
-			exit(EXIT_FAILURE);
-		}
-	}
+	swupdate_crypto_init();
 
 	printf("%s\n", BANNER);
 	printf("Licensed under GPLv2. See source distribution for detailed "
 		"copyright notices.\n\n");
 
+	INFO("Using hash backend: %s", swupdate_HASH_backend_name());
+#ifdef CONFIG_ENCRYPTED_IMAGES
+	INFO("Using decryption backend: %s", swupdate_DECRYPT_backend_name());
+#endif
+
 	print_registered_bootloaders();
 	if (!get_bootloader()) {
 		if (set_bootloader(PREPROCVALUE(BOOTLOADER_DEFAULT)) != 0) {
@@ -786,6 +946,7 @@ int main(int argc, char **argv)
 	} else {
 		INFO("Using bootloader interface: %s", get_bootloader());
 	}
+	startup_step("bootloader");
 
 	/*
 	 * Install a child handler to check if a subprocess
@@ -799,24 +960,16 @@ int main(int argc, char **argv)
 		mtd_set_ubiblacklist(swcfg.mtdblacklist);
 #endif
 
-	/*
-	 * If an AES key is passed, load it to allow
-	 * to decrypt images
-	 */
-	if (strlen(swcfg.aeskeyfname)) {
-		if (load_decryption_key(swcfg.aeskeyfname)) {
-			fprintf(stderr,
-				"Error: Key file does not contain a valid AES key.\n");
+	if (!swcfg.deferred_init) {
+		if (init_update_resources(&swcfg))
 			exit(EXIT_FAILURE);
-		}
+		deferred_init_done = true;
+		startup_step("keys and handlers");
 	}
 
-	lua_handlers_init();
-
 	if(!get_hw_revision(&swcfg.hw))
 		INFO("Running on %s Revision %s", swcfg.hw.boardname, swcfg.hw.revision);
 
-	print_registered_handlers();
 	if (swcfg.syslog_enabled) {
 		if (syslog_init()) {
 			ERROR("failed to initialize syslog notifier");
@@ -838,6 +991,7 @@ int main(int argc, char **argv)
 
 	/* Read sw-versions */
 	get_sw_versions(&handle, &swcfg);
+	startup_step("hardware and versions");
 
 	/*
 	 *  Start daemon if just a check is required
@@ -849,6 +1003,28 @@ int main(int argc, char **argv)
 
 	/* wait for threads to be done before starting children */
 	wait_threads_ready();
+	startup_step("threads");
+
+#ifdef CONFIG_SYSTEMD
+	/*
+	 * The IPC is accepting requests, with deferred-init the
+	 * rest of the initialization does not delay the boot
+	 */
+	if (swcfg.deferred_init && !opt_i && sd_booted()) {
+		sd_notify(0, "READY=1");
+		systemd_ready = true;
+	}
+#endif
+
+	subprocess_set_threads(swcfg.subprocess_threads);
+#if defined(CONFIG_CHANNEL_CURL)
+	/*
+	 * Subprocesses running as threads share libcurl, the SSL
+	 * library and the connection cache, initialize them once
+	 */
+	if (swcfg.subprocess_threads && channel_curl_init() != CHANNEL_OK)
+		exit(EXIT_FAILURE);
+#endif
 
 	/* Start embedded web server */
 #if defined(CONFIG_MONGOOSE)
@@ -863,6 +1039,22 @@ int main(int argc, char **argv)
 	}
 #endif
 
+#ifdef CONFIG_DOWNLOAD
+	if (opt_d) {
+		uid_t uid;
+		gid_t gid;
+		read_settings_user_id(&handle, "download", &uid, &gid);
+		start_subprocess(SOURCE_DOWNLOADER, "download", uid, gid,
+				 cfgfname, dwlac,
+				 dwlav, start_download);
+		freeargs(dwlav);
+	}
+#endif
+
+	/*
+	 * Suricatta's servers parse the command line when they
+	 * start, suricatta must be the last one that has arguments
+	 */
 #if defined(CONFIG_SURICATTA)
 	if (opt_u) {
 		uid_t uid;
@@ -875,18 +1067,6 @@ int main(int argc, char **argv)
 		freeargs(argvalues);
 	}
 #endif
-
-#ifdef CONFIG_DOWNLOAD
-	if (opt_d) {
-		uid_t uid;
-		gid_t gid;
-		read_settings_user_id(&handle, "download", &uid, &gid);
-		start_subprocess(SOURCE_DOWNLOADER, "download", uid, gid,
-				 cfgfname, dwlac,
-				 dwlav, start_download);
-		freeargs(dwlav);
-	}
-#endif
 #if defined(CONFIG_DELTA)
 	{
 		uid_t uid;
@@ -919,12 +1099,20 @@ int main(int argc, char **argv)
 		freeargs(dwlav);
 	}
 
+	startup_step("subprocesses");
+
+	/*
+	 * The children keep their cgroup, only the installer
+	 * process is moved into the one of install-priority
+	 */
+	(void)install_priority_init();
+
 	if (opt_i) {
 		exit_code = install_from_file(fname, opt_c);
 	}
 
 #ifdef CONFIG_SYSTEMD
-	if (sd_booted()) {
+	if (!systemd_ready && sd_booted()) {
 		sd_notify(0, "READY=1");
 	}
 #endif
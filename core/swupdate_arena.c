@@ -0,0 +1,114 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "swupdate_arena.h"
+#include "swupdate_membudget.h"
+
+#define ARENA_CHUNK_SIZE	(256 * 1024)
+#define ARENA_ALIGN		16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+#define CHUNK_HEADER ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	size += CHUNK_HEADER;
+	if (size < ARENA_CHUNK_SIZE)
+		size = ARENA_CHUNK_SIZE;
+
+	chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+		return NULL;
+	/* the parsed description is needed whatever the budget */
+	membudget_charge(size);
+
+	chunk->size = size;
+	chunk->used = CHUNK_HEADER;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	return chunk;
+}
+
+/*
+ * Memory is zeroed, as returned by mmap() and never reused
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *ptr = NULL;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	pthread_mutex_lock(&arena->lock);
+	chunk = arena->chunks;
+	if (!chunk || chunk->size - chunk->used < size)
+		chunk = new_chunk(arena, size);
+	if (chunk) {
+		ptr = (char *)chunk + chunk->used;
+		chunk->used += size;
+		arena->allocated += size;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = arena_alloc(arena, len);
+
+	if (p)
+		memcpy(p, s, len);
+
+	return p;
+}
+
+bool arena_owns(struct arena *arena, const void *ptr)
+{
+	struct arena_chunk *chunk;
+	bool found = false;
+
+	pthread_mutex_lock(&arena->lock);
+	for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+		if ((uintptr_t)ptr >= (uintptr_t)chunk &&
+		    (uintptr_t)ptr < (uintptr_t)chunk + chunk->used) {
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return found;
+}
+
+void arena_release(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	pthread_mutex_lock(&arena->lock);
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		membudget_release(chunk->size);
+		munmap(chunk, chunk->size);
+	}
+	arena->chunks = NULL;
+	arena->allocated = 0;
+	pthread_mutex_unlock(&arena->lock);
+}
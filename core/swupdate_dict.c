@@ -17,6 +17,8 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
 #include "util.h"
@@ -54,26 +56,236 @@ static void remove_list(struct dict_list *list)
 	}
 }
 
+/*
+ * Dictionaries are switched to a hash index when they reach
+ * DICT_INDEX_MIN entries, smaller ones are just scanned.
+ */
+#define DICT_INDEX_MIN		16
+#define DICT_KEYS_MIN		64
+
+struct dict_index {
+	unsigned int size;
+	unsigned int count;
+	struct dict_entry **buckets;
+};
+
+/*
+ * The same keys (image properties, bootloader variables, headers)
+ * are used by many dictionaries, so they are shared among all
+ * of them and refcounted.
+ */
+struct dict_key {
+	struct dict_key *next;
+	unsigned int hash;
+	unsigned int refs;
+	char name[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned int size;
+	unsigned int count;
+	struct dict_key **buckets;
+} keys = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int dict_hash(const char *key)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void grow_keys(void)
+{
+	unsigned int size = keys.size ? keys.size * 2 : DICT_KEYS_MIN;
+	struct dict_key **buckets = calloc(size, sizeof(*buckets));
+	struct dict_key *k, *tmp;
+	unsigned int i;
+
+	/* Not fatal, chains just get longer */
+	if (!buckets)
+		return;
+
+	for (i = 0; i < keys.size; i++) {
+		for (k = keys.buckets[i]; k; k = tmp) {
+			tmp = k->next;
+			k->next = buckets[k->hash & (size - 1)];
+			buckets[k->hash & (size - 1)] = k;
+		}
+	}
+	free(keys.buckets);
+	keys.buckets = buckets;
+	keys.size = size;
+}
+
+static char *get_key(const char *key, unsigned int hash)
+{
+	struct dict_key *k = NULL;
+	size_t len;
+
+	pthread_mutex_lock(&keys.lock);
+	if (keys.count >= keys.size)
+		grow_keys();
+	if (!keys.size)
+		goto out;
+
+	for (k = keys.buckets[hash & (keys.size - 1)]; k; k = k->next) {
+		if (k->hash == hash && strcmp(k->name, key) == 0) {
+			k->refs++;
+			goto out;
+		}
+	}
+
+	len = strlen(key) + 1;
+	k = malloc(sizeof(*k) + len);
+	if (!k)
+		goto out;
+	memcpy(k->name, key, len);
+	k->hash = hash;
+	k->refs = 1;
+	k->next = keys.buckets[hash & (keys.size - 1)];
+	keys.buckets[hash & (keys.size - 1)] = k;
+	keys.count++;
+out:
+	pthread_mutex_unlock(&keys.lock);
+
+	return k ? k->name : NULL;
+}
+
+static void put_key(char *key)
+{
+	struct dict_key *k = (struct dict_key *)(key - offsetof(struct dict_key, name));
+	struct dict_key **p;
+
+	pthread_mutex_lock(&keys.lock);
+	if (--k->refs == 0) {
+		for (p = &keys.buckets[k->hash & (keys.size - 1)]; *p; p = &(*p)->next) {
+			if (*p == k) {
+				*p = k->next;
+				break;
+			}
+		}
+		keys.count--;
+		free(k);
+	}
+	pthread_mutex_unlock(&keys.lock);
+}
+
+static void index_add(struct dict_index *index, struct dict_entry *entry)
+{
+	struct dict_entry **bucket = &index->buckets[entry->hash & (index->size - 1)];
+
+	entry->index = index;
+	entry->hnext = *bucket;
+	*bucket = entry;
+	index->count++;
+}
+
+static void grow_index(struct dict_index *index)
+{
+	unsigned int size = index->size * 2;
+	struct dict_entry **buckets = calloc(size, sizeof(*buckets));
+	struct dict_entry *entry, *tmp;
+	unsigned int i;
+
+	if (!buckets)
+		return;
+
+	for (i = 0; i < index->size; i++) {
+		for (entry = index->buckets[i]; entry; entry = tmp) {
+			tmp = entry->hnext;
+			entry->hnext = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->size = size;
+}
+
+static void create_index(struct dict *dictionary)
+{
+	struct dict_index *index = calloc(1, sizeof(*index));
+	struct dict_entry *entry;
+
+	/* The dictionary is still usable without index */
+	if (!index)
+		return;
+
+	index->size = DICT_INDEX_MIN * 2;
+	index->buckets = calloc(index->size, sizeof(*index->buckets));
+	if (!index->buckets) {
+		free(index);
+		return;
+	}
+
+	LIST_FOREACH(entry, dictionary, next) {
+		index_add(index, entry);
+	}
+}
+
 static struct dict_entry *insert_entry(struct dict *dictionary, const char *key)
 {
+	struct dict_entry *first = LIST_FIRST(dictionary);
 	struct dict_entry *entry = (struct dict_entry *)malloc(sizeof(*entry));
 	if (!entry)
 		return NULL;
 
 	memset(entry, 0, sizeof(*entry));
-	entry->key = strdup(key);
+	entry->hash = dict_hash(key);
+	entry->key = get_key(key, entry->hash);
+	if (!entry->key) {
+		free(entry);
+		return NULL;
+	}
 
 	LIST_INSERT_HEAD(dictionary, entry, next);
 
+	if (first && first->index) {
+		index_add(first->index, entry);
+		if (first->index->count > first->index->size)
+			grow_index(first->index);
+	} else {
+		unsigned int count = 0;
+
+		LIST_FOREACH(first, dictionary, next) {
+			count++;
+		}
+		if (count >= DICT_INDEX_MIN)
+			create_index(dictionary);
+	}
+
 	return entry;
 }
 
 static struct dict_entry *get_entry(struct dict *dictionary, const char *key)
 {
-	struct dict_entry *entry;
+	struct dict_entry *entry = LIST_FIRST(dictionary);
+	unsigned int hash;
+
+	if (!entry)
+		return NULL;
+
+	hash = dict_hash(key);
+	if (entry->index) {
+		entry = entry->index->buckets[hash & (entry->index->size - 1)];
+		for (; entry; entry = entry->hnext) {
+			if (entry->hash == hash && strcmp(key, entry->key) == 0)
+				return entry;
+		}
+		return NULL;
+	}
 
 	LIST_FOREACH(entry, dictionary, next) {
-		if (strcmp(key, entry->key) == 0)
+		if (entry->hash == hash && strcmp(key, entry->key) == 0)
 			return entry;
 	}
 
@@ -82,8 +294,25 @@ static struct dict_entry *get_entry(struct dict *dictionary, const char *key)
 
 static void remove_entry(struct dict_entry *entry)
 {
+	struct dict_index *index = entry->index;
+
+	if (index) {
+		struct dict_entry **p = &index->buckets[entry->hash & (index->size - 1)];
+
+		for (; *p; p = &(*p)->hnext) {
+			if (*p == entry) {
+				*p = entry->hnext;
+				break;
+			}
+		}
+		if (--index->count == 0) {
+			free(index->buckets);
+			free(index);
+		}
+	}
+
 	LIST_REMOVE(entry, next);
-	free(entry->key);
+	put_key(entry->key);
 	remove_list(&entry->list);
 	free(entry);
 }
@@ -171,6 +400,43 @@ void dict_drop_db(struct dict *dictionary)
 	}
 }
 
+/*
+ * Entries and values are inserted at the head, so they
+ * are copied starting from the tail to keep the ordering
+ */
+static int copy_values(struct dict *dst, const char *key, struct dict_list_elem *elem)
+{
+	int ret;
+
+	if (!elem)
+		return 0;
+
+	ret = copy_values(dst, key, LIST_NEXT(elem, next));
+	if (ret)
+		return ret;
+
+	return dict_insert_value(dst, key, elem->value);
+}
+
+static int copy_entries(struct dict *dst, struct dict_entry *entry)
+{
+	int ret;
+
+	if (!entry)
+		return 0;
+
+	ret = copy_entries(dst, LIST_NEXT(entry, next));
+	if (ret)
+		return ret;
+
+	return copy_values(dst, entry->key, LIST_FIRST(&entry->list));
+}
+
+int dict_copy(struct dict *dst, struct dict *src)
+{
+	return copy_entries(dst, LIST_FIRST(src));
+}
+
 int dict_parse_script(struct dict *dictionary, const char *script)
 {
 	FILE *fp = NULL;
@@ -0,0 +1,80 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdint.h>
+#include "swupdate_membudget.h"
+
+static size_t budget_limit;
+static size_t budget_used;
+static size_t budget_peak;
+
+static void update_peak(size_t used)
+{
+	size_t peak = __atomic_load_n(&budget_peak, __ATOMIC_RELAXED);
+
+	while (used > peak &&
+	       !__atomic_compare_exchange_n(&budget_peak, &peak, used, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void membudget_set_limit(size_t limit)
+{
+	__atomic_store_n(&budget_limit, limit, __ATOMIC_RELAXED);
+}
+
+size_t membudget_limit(void)
+{
+	return __atomic_load_n(&budget_limit, __ATOMIC_RELAXED);
+}
+
+size_t membudget_used(void)
+{
+	return __atomic_load_n(&budget_used, __ATOMIC_RELAXED);
+}
+
+size_t membudget_peak(void)
+{
+	return __atomic_load_n(&budget_peak, __ATOMIC_RELAXED);
+}
+
+size_t membudget_available(void)
+{
+	size_t limit = membudget_limit();
+	size_t used = membudget_used();
+
+	if (!limit)
+		return SIZE_MAX;
+
+	return used < limit ? limit - used : 0;
+}
+
+bool membudget_reserve(size_t size)
+{
+	size_t limit = membudget_limit();
+	size_t used = __atomic_load_n(&budget_used, __ATOMIC_RELAXED);
+
+	do {
+		if (limit && (used > limit || size > limit - used))
+			return false;
+	} while (!__atomic_compare_exchange_n(&budget_used, &used, used + size,
+					      true, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	update_peak(used + size);
+
+	return true;
+}
+
+void membudget_charge(size_t size)
+{
+	update_peak(__atomic_add_fetch(&budget_used, size, __ATOMIC_RELAXED));
+}
+
+void membudget_release(size_t size)
+{
+	__atomic_sub_fetch(&budget_used, size, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,214 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "swupdate_metrics.h"
+
+#define METRICS_MAX_HANDLERS	32
+
+struct metric_desc {
+	const char *name;
+	const char *help;
+};
+
+static const struct metric_desc counter_desc[METRICS_COUNTERS] = {
+	[METRICS_UPDATES_STARTED] = {"swupdate_updates_started", "Updates started"},
+	[METRICS_UPDATES_SUCCEEDED] = {"swupdate_updates_succeeded", "Updates successfully installed"},
+	[METRICS_UPDATES_FAILED] = {"swupdate_updates_failed", "Updates failed"},
+	[METRICS_RECEIVED_BYTES] = {"swupdate_received_bytes", "Bytes of the SWU streams received"},
+	[METRICS_WRITTEN_BYTES] = {"swupdate_written_bytes", "Bytes written by the handlers and to TMPDIR"},
+	[METRICS_FLASH_PAGES_SKIPPED] = {"swupdate_flash_pages_skipped", "Empty flash pages not programmed"},
+	[METRICS_STREAMED_BYTES] = {"swupdate_streamed_bytes", "Bytes of images streamed to the handlers"},
+	[METRICS_STAGED_BYTES] = {"swupdate_staged_bytes", "Bytes of images copied to TMPDIR"},
+};
+
+static const char *stage_names[METRICS_STAGES] = {
+	[METRICS_STAGE_HASH] = "hash",
+	[METRICS_STAGE_DECRYPT] = "decrypt",
+	[METRICS_STAGE_DECOMPRESS] = "decompress",
+};
+
+static const struct metric_desc gauge_desc[METRICS_GAUGES] = {
+	[METRICS_NOTIFY_SUBSCRIBERS] = {"swupdate_ipc_notify_subscribers", "Clients subscribed to the notifications"},
+	[METRICS_NOTIFY_QUEUED_BYTES] = {"swupdate_ipc_notify_queued_bytes", "Notification bytes not yet sent to the subscribers"},
+	[METRICS_NOTIFY_DROPPED] = {"swupdate_ipc_notify_dropped", "Notifications dropped for the current subscribers"},
+	[METRICS_SUBPROCESS_QUEUE] = {"swupdate_ipc_subprocess_queue", "Messages waiting for a subprocess"},
+	[METRICS_CACHED_MESSAGES] = {"swupdate_ipc_cached_messages", "Notifications kept for new subscribers"},
+	[METRICS_STREAM_BUFFERED] = {"swupdate_stream_buffered_bytes", "Bytes of the SWU read but not yet installed"},
+	[METRICS_STREAM_BUFFER_PEAK] = {"swupdate_stream_buffer_peak_bytes", "Highest occupancy of the stream buffer in the last update"},
+};
+
+/* upper bounds of the buckets, in seconds */
+static const double duration_buckets[] = {
+	0.1, 0.5, 1, 5, 10, 30, 60, 120, 300, 600
+};
+
+struct handler_histogram {
+	char name[32];
+	uint64_t buckets[ARRAY_SIZE(duration_buckets)];
+	uint64_t count;
+	uint64_t sum_ns;
+};
+
+static uint64_t counters[METRICS_COUNTERS];
+static uint64_t stage_bytes[METRICS_STAGES];
+static uint64_t stage_ns[METRICS_STAGES];
+static uint64_t gauges[METRICS_GAUGES];
+static struct handler_histogram handlers[METRICS_MAX_HANDLERS];
+static unsigned int nhandlers;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void metrics_count(enum metrics_counter counter, uint64_t value)
+{
+	__atomic_add_fetch(&counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_stage(enum metrics_stage stage, uint64_t bytes, uint64_t start)
+{
+	__atomic_add_fetch(&stage_bytes[stage], bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stage_ns[stage], metrics_now() - start, __ATOMIC_RELAXED);
+}
+
+void metrics_set_gauge(enum metrics_gauge gauge, uint64_t value)
+{
+	__atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_get_totals(struct metrics_totals *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < METRICS_COUNTERS; i++)
+		t->counters[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	for (i = 0; i < METRICS_STAGES; i++) {
+		t->stage_bytes[i] = __atomic_load_n(&stage_bytes[i], __ATOMIC_RELAXED);
+		t->stage_ns[i] = __atomic_load_n(&stage_ns[i], __ATOMIC_RELAXED);
+	}
+}
+
+void metrics_handler_duration(const char *name, uint64_t start)
+{
+	uint64_t ns = metrics_now() - start;
+	struct handler_histogram *h = NULL;
+	unsigned int i;
+
+	if (!name)
+		return;
+
+	pthread_mutex_lock(&metrics_lock);
+	for (i = 0; i < nhandlers; i++) {
+		if (!strcmp(handlers[i].name, name)) {
+			h = &handlers[i];
+			break;
+		}
+	}
+	if (!h && nhandlers < METRICS_MAX_HANDLERS) {
+		h = &handlers[nhandlers++];
+		strlcpy(h->name, name, sizeof(h->name));
+	}
+	if (h) {
+		for (i = 0; i < ARRAY_SIZE(duration_buckets); i++) {
+			if (ns <= duration_buckets[i] * 1e9)
+				h->buckets[i]++;
+		}
+		h->count++;
+		h->sum_ns += ns;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static void write_label(FILE *fp, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if (*s == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*s, fp);
+	}
+}
+
+/*
+ * Write all metrics in the OpenMetrics text format. The file is
+ * replaced atomically, so it can be served while it is updated.
+ */
+int metrics_write(const char *path)
+{
+	char tmp[MAX_IMAGE_FNAME];
+	FILE *fp;
+	unsigned int i, j;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return -errno;
+
+	for (i = 0; i < METRICS_COUNTERS; i++) {
+		fprintf(fp, "# TYPE %s counter\n# HELP %s %s\n%s_total %llu\n",
+			counter_desc[i].name, counter_desc[i].name, counter_desc[i].help,
+			counter_desc[i].name,
+			(unsigned long long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+	}
+
+	fputs("# TYPE swupdate_stage_bytes counter\n"
+	      "# HELP swupdate_stage_bytes Bytes processed by hashing, decryption and decompression\n", fp);
+	for (i = 0; i < METRICS_STAGES; i++)
+		fprintf(fp, "swupdate_stage_bytes_total{stage=\"%s\"} %llu\n", stage_names[i],
+			(unsigned long long)__atomic_load_n(&stage_bytes[i], __ATOMIC_RELAXED));
+	fputs("# TYPE swupdate_stage_seconds counter\n"
+	      "# HELP swupdate_stage_seconds Time spent hashing, decrypting and decompressing\n", fp);
+	for (i = 0; i < METRICS_STAGES; i++)
+		fprintf(fp, "swupdate_stage_seconds_total{stage=\"%s\"} %.6f\n", stage_names[i],
+			__atomic_load_n(&stage_ns[i], __ATOMIC_RELAXED) / 1e9);
+
+	fputs("# TYPE swupdate_handler_duration_seconds histogram\n"
+	      "# HELP swupdate_handler_duration_seconds Duration of the handler calls\n", fp);
+	pthread_mutex_lock(&metrics_lock);
+	for (i = 0; i < nhandlers; i++) {
+		struct handler_histogram *h = &handlers[i];
+
+		for (j = 0; j < ARRAY_SIZE(duration_buckets); j++) {
+			fputs("swupdate_handler_duration_seconds_bucket{handler=\"", fp);
+			write_label(fp, h->name);
+			fprintf(fp, "\",le=\"%g\"} %llu\n", duration_buckets[j],
+				(unsigned long long)h->buckets[j]);
+		}
+		fputs("swupdate_handler_duration_seconds_bucket{handler=\"", fp);
+		write_label(fp, h->name);
+		fprintf(fp, "\",le=\"+Inf\"} %llu\n", (unsigned long long)h->count);
+		fputs("swupdate_handler_duration_seconds_count{handler=\"", fp);
+		write_label(fp, h->name);
+		fprintf(fp, "\"} %llu\n", (unsigned long long)h->count);
+		fputs("swupdate_handler_duration_seconds_sum{handler=\"", fp);
+		write_label(fp, h->name);
+		fprintf(fp, "\"} %.6f\n", h->sum_ns / 1e9);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	for (i = 0; i < METRICS_GAUGES; i++) {
+		fprintf(fp, "# TYPE %s gauge\n# HELP %s %s\n%s %llu\n",
+			gauge_desc[i].name, gauge_desc[i].name, gauge_desc[i].help,
+			gauge_desc[i].name,
+			(unsigned long long)__atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+	}
+	fputs("# EOF\n", fp);
+
+	if (fclose(fp) || rename(tmp, path)) {
+		unlink(tmp);
+		return -EFAULT;
+	}
+
+	return 0;
+}
@@ -0,0 +1,476 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "util.h"
+#include "parselib.h"
+#include "swupdate_settings.h"
+#include "swupdate_priority.h"
+
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS	1
+
+enum {
+	IOPRIO_CLASS_NONE,
+	IOPRIO_CLASS_RT,
+	IOPRIO_CLASS_BE,
+	IOPRIO_CLASS_IDLE
+};
+
+#define PRIO_UNSET	INT_MIN
+
+struct priority_profile {
+	int ioprio;
+	int nice;
+	char io_max[SWUPDATE_GENERAL_STRING_SIZE];
+	char cpu_max[64];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct priority_profile normal, peak;
+	const struct priority_profile *applied;	/* limits in the cgroup */
+	bool peak_load;
+	bool active;
+	bool all_tasks;		/* a profile was applied to every thread */
+	char cgroup[PATH_MAX];
+	int default_ioprio;
+	int default_nice;
+} prio = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.normal = { .ioprio = PRIO_UNSET, .nice = PRIO_UNSET },
+	.peak = { .ioprio = PRIO_UNSET, .nice = PRIO_UNSET },
+};
+
+/* CPU set and scheduling of the threads started by SWUpdate */
+static struct {
+	bool has_cpus;
+	cpu_set_t cpus;
+	int policy;
+	int priority;
+} worker = {
+	.policy = PRIO_UNSET,
+};
+
+static pid_t current_tid(void)
+{
+	return (pid_t)syscall(SYS_gettid);
+}
+
+/* "idle", "best-effort[:level]", "realtime[:level]" or "none" */
+static int parse_ioprio(const char *s, int *ioprio)
+{
+	const char *level = strchr(s, ':');
+	size_t len = level ? (size_t)(level - s) : strlen(s);
+	int class, data = 4;
+
+	if (len == 4 && !strncmp(s, "idle", len))
+		class = IOPRIO_CLASS_IDLE, data = 0;
+	else if (len == 11 && !strncmp(s, "best-effort", len))
+		class = IOPRIO_CLASS_BE;
+	else if (len == 8 && !strncmp(s, "realtime", len))
+		class = IOPRIO_CLASS_RT;
+	else if (len == 4 && !strncmp(s, "none", len))
+		class = IOPRIO_CLASS_NONE, data = 0;
+	else
+		return -EINVAL;
+
+	if (level) {
+		char *end;
+
+		if (class == IOPRIO_CLASS_IDLE || class == IOPRIO_CLASS_NONE)
+			return -EINVAL;
+		data = strtol(level + 1, &end, 10);
+		if (*end || data < 0 || data > 7)
+			return -EINVAL;
+	}
+	*ioprio = IOPRIO_PRIO_VALUE(class, data);
+
+	return 0;
+}
+
+static int read_profile(void *elem, const char *prefix,
+			struct priority_profile *p)
+{
+	char key[32], tmp[SWUPDATE_GENERAL_STRING_SIZE] = "";
+
+	snprintf(key, sizeof(key), "%sioprio", prefix);
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, key, tmp);
+	if (tmp[0] != '\0' && parse_ioprio(tmp, &p->ioprio)) {
+		ERROR("install-priority: %s = \"%s\" is not valid", key, tmp);
+		return -EINVAL;
+	}
+	snprintf(key, sizeof(key), "%snice", prefix);
+	get_field(LIBCFG_PARSER, elem, key, &p->nice);
+	if (p->nice != PRIO_UNSET && (p->nice < -20 || p->nice > 19)) {
+		ERROR("install-priority: %s = %d is not valid", key, p->nice);
+		return -EINVAL;
+	}
+	snprintf(key, sizeof(key), "%sio-max", prefix);
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, key, p->io_max);
+	snprintf(key, sizeof(key), "%scpu-max", prefix);
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, key, p->cpu_max);
+
+	return 0;
+}
+
+/* "0-1,4", the CPUs must be usable by SWUpdate */
+static int parse_cpus(const char *s, cpu_set_t *set)
+{
+	cpu_set_t allowed;
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	do {
+		first = strtoul(s, &end, 10);
+		if (end == s)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtoul(s, &end, 10);
+			if (end == s || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		s = end + 1;
+	} while (*end == ',');
+	if (*end)
+		return -EINVAL;
+
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		CPU_AND(set, set, &allowed);
+		if (!CPU_COUNT(set))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_policy(const char *s, int *policy)
+{
+	static const struct {
+		const char *name;
+		int policy;
+	} policies[] = {
+		{ "other", SCHED_OTHER },
+		{ "batch", SCHED_BATCH },
+		{ "idle", SCHED_IDLE },
+		{ "fifo", SCHED_FIFO },
+		{ "rr", SCHED_RR },
+	};
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(policies); i++) {
+		if (!strcmp(s, policies[i].name)) {
+			*policy = policies[i].policy;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int read_worker_settings(void *elem)
+{
+	char tmp[SWUPDATE_GENERAL_STRING_SIZE] = "";
+	int min, max;
+
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "worker-cpus", tmp);
+	if (tmp[0] != '\0') {
+		if (parse_cpus(tmp, &worker.cpus)) {
+			ERROR("install-priority: worker-cpus = \"%s\" is not valid", tmp);
+			return -EINVAL;
+		}
+		worker.has_cpus = true;
+		tmp[0] = '\0';
+	}
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "worker-policy", tmp);
+	if (tmp[0] != '\0' && parse_policy(tmp, &worker.policy)) {
+		ERROR("install-priority: worker-policy = \"%s\" is not valid", tmp);
+		return -EINVAL;
+	}
+	get_field(LIBCFG_PARSER, elem, "worker-priority", &worker.priority);
+	if (worker.policy == PRIO_UNSET)
+		return 0;
+	min = sched_get_priority_min(worker.policy);
+	max = sched_get_priority_max(worker.policy);
+	if (worker.priority < min || worker.priority > max) {
+		ERROR("install-priority: worker-priority = %d is not valid (%d..%d)",
+		      worker.priority, min, max);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int install_priority_settings(void *elem, void __attribute__ ((__unused__)) *data)
+{
+	if (read_worker_settings(elem))
+		return -EINVAL;
+
+	if (read_profile(elem, "", &prio.normal))
+		return -EINVAL;
+
+	/* the peak profile falls back to the normal one */
+	prio.peak = prio.normal;
+	if (read_profile(elem, "peak-", &prio.peak))
+		return -EINVAL;
+
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "cgroup", prio.cgroup);
+
+	return 0;
+}
+
+static int cgroup_write(const char *file, const char *value)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", prio.cgroup, file);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, value, strlen(value)) < 0) {
+		WARN("Cannot write \"%s\" to %s: %s", value, path, strerror(errno));
+		ret = -errno;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/*
+ * io.max takes one device per write, the entries are separated
+ * by ';'. The limits of a device are removed with "max".
+ */
+static void cgroup_set_io(const char *spec, bool reset)
+{
+	char buf[SWUPDATE_GENERAL_STRING_SIZE];
+	char line[SWUPDATE_GENERAL_STRING_SIZE];
+	char *entry, *saveptr;
+
+	strlcpy(buf, spec, sizeof(buf));
+	for (entry = strtok_r(buf, ";", &saveptr); entry;
+	     entry = strtok_r(NULL, ";", &saveptr)) {
+		while (*entry == ' ')
+			entry++;
+		if (!*entry)
+			continue;
+		if (reset) {
+			snprintf(line, sizeof(line),
+				 "%.*s rbps=max wbps=max riops=max wiops=max",
+				 (int)strcspn(entry, " "), entry);
+			cgroup_write("io.max", line);
+		} else
+			cgroup_write("io.max", entry);
+	}
+}
+
+static void cgroup_apply(const struct priority_profile *p)
+{
+	if (!strlen(prio.cgroup) || prio.applied == p)
+		return;
+
+	if (prio.applied) {
+		cgroup_set_io(prio.applied->io_max, true);
+		if (strlen(prio.applied->cpu_max))
+			cgroup_write("cpu.max", "max");
+	}
+	if (p) {
+		cgroup_set_io(p->io_max, false);
+		if (strlen(p->cpu_max))
+			cgroup_write("cpu.max", p->cpu_max);
+	}
+	prio.applied = p;
+}
+
+static void task_apply(pid_t tid, int ioprio, int nice)
+{
+	if (ioprio != PRIO_UNSET &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio) < 0)
+		WARN("Cannot set the I/O priority of %d: %s", tid, strerror(errno));
+	if (nice != PRIO_UNSET && setpriority(PRIO_PROCESS, tid, nice) < 0)
+		WARN("Cannot set the nice value of %d: %s", tid, strerror(errno));
+}
+
+/* Apply to every thread of the daemon but the caller */
+static void tasks_apply(int ioprio, int nice)
+{
+	pid_t self = current_tid();
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		pid_t tid = (pid_t)strtol(de->d_name, NULL, 10);
+
+		if (tid > 0 && tid != self)
+			task_apply(tid, ioprio, nice);
+	}
+	closedir(dir);
+}
+
+static const struct priority_profile *current_profile(void)
+{
+	return prio.peak_load ? &prio.peak : &prio.normal;
+}
+
+/* The default values are only restored for the settings that are used */
+static int restore_value(int normal, int peak, int def)
+{
+	return (normal == PRIO_UNSET && peak == PRIO_UNSET) ? PRIO_UNSET : def;
+}
+
+int install_priority_init(void)
+{
+	char pid[32];
+
+	prio.default_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (prio.default_ioprio < 0)
+		prio.default_ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+	errno = 0;
+	prio.default_nice = getpriority(PRIO_PROCESS, 0);
+	if (errno)
+		prio.default_nice = 0;
+
+	if (!strlen(prio.cgroup))
+		return 0;
+
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	if (cgroup_write("cgroup.procs", pid)) {
+		ERROR("SWUpdate cannot be moved into %s", prio.cgroup);
+		prio.cgroup[0] = '\0';
+		return -EINVAL;
+	}
+	INFO("SWUpdate runs in cgroup %s", prio.cgroup);
+
+	return 0;
+}
+
+/*
+ * Called by the installer thread when an update starts. The threads
+ * it creates afterwards inherit the I/O priority and the nice value.
+ */
+void install_priority_begin(void)
+{
+	const struct priority_profile *p;
+
+	pthread_mutex_lock(&prio.lock);
+	p = current_profile();
+	prio.active = true;
+	task_apply(current_tid(), p->ioprio, p->nice);
+	cgroup_apply(p);
+	pthread_mutex_unlock(&prio.lock);
+}
+
+void install_priority_end(void)
+{
+	int ioprio, nice;
+
+	pthread_mutex_lock(&prio.lock);
+	prio.active = false;
+	cgroup_apply(NULL);
+	ioprio = restore_value(prio.normal.ioprio, prio.peak.ioprio, prio.default_ioprio);
+	nice = restore_value(prio.normal.nice, prio.peak.nice, prio.default_nice);
+	if (prio.all_tasks)
+		tasks_apply(ioprio, nice);
+	prio.all_tasks = false;
+	task_apply(current_tid(), ioprio, nice);
+	pthread_mutex_unlock(&prio.lock);
+}
+
+/*
+ * Select the profile. During an update, it is applied at once to all
+ * threads of the daemon except the one serving the IPC request.
+ */
+int install_priority_set_profile(const char *name)
+{
+	const struct priority_profile *p;
+
+	if (!strcmp(name, "peak"))
+		p = &prio.peak;
+	else if (!strcmp(name, "normal"))
+		p = &prio.normal;
+	else
+		return -EINVAL;
+
+	pthread_mutex_lock(&prio.lock);
+	prio.peak_load = (p == &prio.peak);
+	if (prio.active) {
+		tasks_apply(p->ioprio, p->nice);
+		prio.all_tasks = true;
+		cgroup_apply(p);
+	}
+	pthread_mutex_unlock(&prio.lock);
+	TRACE("Install priority profile: %s", name);
+
+	return 0;
+}
+
+bool install_priority_thread_attr(pthread_attr_t *attr)
+{
+	struct sched_param param = { 0 };
+	bool sched;
+
+	if (worker.has_cpus)
+		pthread_attr_setaffinity_np(attr, sizeof(worker.cpus), &worker.cpus);
+
+	/* SCHED_BATCH and SCHED_IDLE are not accepted in the attributes */
+	pthread_mutex_lock(&prio.lock);
+	sched = worker.policy == SCHED_OTHER || worker.policy == SCHED_FIFO ||
+		worker.policy == SCHED_RR;
+	if (sched) {
+		param.sched_priority = worker.priority;
+		pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(attr, worker.policy);
+		pthread_attr_setschedparam(attr, &param);
+	}
+	pthread_mutex_unlock(&prio.lock);
+
+	return sched;
+}
+
+void install_priority_thread_started(pthread_t id)
+{
+	struct sched_param param = { 0 };
+	int policy;
+
+	pthread_mutex_lock(&prio.lock);
+	policy = worker.policy;
+	pthread_mutex_unlock(&prio.lock);
+	if ((policy == SCHED_BATCH || policy == SCHED_IDLE) &&
+	    pthread_setschedparam(id, policy, &param))
+		WARN("worker-policy cannot be applied to a thread");
+}
+
+void install_priority_sched_denied(void)
+{
+	pthread_mutex_lock(&prio.lock);
+	if (worker.policy != PRIO_UNSET)
+		WARN("worker-policy cannot be applied (CAP_SYS_NICE ?), threads "
+		     "inherit the scheduling of SWUpdate");
+	worker.policy = PRIO_UNSET;
+	pthread_mutex_unlock(&prio.lock);
+}
@@ -0,0 +1,470 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "swupdate.h"
+#include "swupdate_metrics.h"
+#include "swupdate_profile.h"
+
+/* records kept for a single update */
+#define PROFILE_MAX_RECORDS	1024
+#define PROFILE_SUMMARY_LEN	512
+
+struct profile_record {
+	char handler[32];
+	char image[64];
+	char device[64];	/* device or path of the image */
+	uint64_t compressed;	/* size in the SWU of a compressed image */
+	bool streamed;
+	struct profile_sample used;
+};
+
+struct profile_update {
+	time_t started;
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	char version[64];
+	int result;
+	bool running;
+	unsigned int nrecords;
+	unsigned int dropped;
+	struct profile_record *records;
+	struct metrics_totals totals;	/* at the start, then used */
+};
+
+/* what the report lists for each device and for each handler */
+struct profile_sum {
+	const char *name;
+	unsigned int runs;
+	uint64_t bytes;
+	uint64_t wall_ns;
+	uint64_t min_bps;
+};
+
+static __thread uint64_t thread_copied;
+
+/* updates[last] is the most recent one */
+static struct profile_update updates[PROFILE_UPDATES];
+static unsigned int nupdates;
+static unsigned int last;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void read_thread_io(struct profile_sample *s)
+{
+	char line[64];
+	unsigned long long val, syscr = 0, syscw = 0;
+	FILE *fp = fopen("/proc/thread-self/io", "r");
+
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "rchar: %llu", &val) == 1)
+			s->rchar = val;
+		else if (sscanf(line, "wchar: %llu", &val) == 1)
+			s->wchar = val;
+		else if (sscanf(line, "syscr: %llu", &val) == 1)
+			syscr = val;
+		else if (sscanf(line, "syscw: %llu", &val) == 1)
+			syscw = val;
+	}
+	fclose(fp);
+	s->syscalls = syscr + syscw;
+}
+
+static void take_sample(struct profile_sample *s)
+{
+	struct timespec ts;
+	struct rusage ru;
+
+	memset(s, 0, sizeof(*s));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s->wall_ns = ts_ns(&ts);
+	/* handlers of parallel groups run in their own thread */
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		s->cpu_ns = ts_ns(&ts);
+	if (!getrusage(RUSAGE_SELF, &ru))
+		s->maxrss = ru.ru_maxrss;
+	s->copied = thread_copied;
+	read_thread_io(s);
+}
+
+void profile_count_written(uint64_t bytes)
+{
+	thread_copied += bytes;
+}
+
+static void totals_since(struct metrics_totals *used, const struct metrics_totals *start)
+{
+	unsigned int i;
+
+	metrics_get_totals(used);
+	for (i = 0; i < METRICS_COUNTERS; i++)
+		used->counters[i] -= start->counters[i];
+	for (i = 0; i < METRICS_STAGES; i++) {
+		used->stage_bytes[i] -= start->stage_bytes[i];
+		used->stage_ns[i] -= start->stage_ns[i];
+	}
+}
+
+/*
+ * A new update starts, it takes the place of the oldest one
+ */
+void profile_update_begin(void)
+{
+	struct profile_update *u;
+	struct timespec ts;
+
+	pthread_mutex_lock(&profile_lock);
+	if (nupdates)
+		last = (last + 1) % PROFILE_UPDATES;
+	if (nupdates < PROFILE_UPDATES)
+		nupdates++;
+	u = &updates[last];
+	free(u->records);
+	memset(u, 0, sizeof(*u));
+	u->started = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	u->start_ns = ts_ns(&ts);
+	metrics_get_totals(&u->totals);
+	u->running = true;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * The file in TMPDIR always has the report of the last update, a
+ * client does not need to ask for it before the next one starts
+ */
+void profile_update_end(const char *version, int result)
+{
+	struct profile_update *u;
+	struct timespec ts;
+	char path[MAX_IMAGE_FNAME];
+	struct metrics_totals used;
+
+	pthread_mutex_lock(&profile_lock);
+	u = &updates[last];
+	if (nupdates && u->running) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		u->duration_ns = ts_ns(&ts) - u->start_ns;
+		strlcpy(u->version, version ? version : "", sizeof(u->version));
+		u->result = result;
+		totals_since(&used, &u->totals);
+		u->totals = used;
+		u->running = false;
+	}
+	pthread_mutex_unlock(&profile_lock);
+
+	(void)profile_write(path, sizeof(path));
+}
+
+void profile_handler_begin(struct profile_sample *s)
+{
+	take_sample(s);
+}
+
+void profile_handler_end(struct profile_sample *s, const char *hnd,
+			 const struct img_type *img)
+{
+	struct profile_update *u;
+	struct profile_sample now;
+	struct profile_record *r;
+
+	take_sample(&now);
+
+	pthread_mutex_lock(&profile_lock);
+	u = &updates[last];
+	if (!nupdates || !u->running) {
+		pthread_mutex_unlock(&profile_lock);
+		return;
+	}
+	if (u->nrecords == PROFILE_MAX_RECORDS) {
+		u->dropped++;
+		pthread_mutex_unlock(&profile_lock);
+		return;
+	}
+	if (!(u->nrecords % 32)) {
+		r = realloc(u->records, (u->nrecords + 32) * sizeof(*r));
+		if (!r) {
+			u->dropped++;
+			pthread_mutex_unlock(&profile_lock);
+			return;
+		}
+		u->records = r;
+	}
+	r = &u->records[u->nrecords++];
+	strlcpy(r->handler, hnd ? hnd : "", sizeof(r->handler));
+	strlcpy(r->image, img->fname, sizeof(r->image));
+	strlcpy(r->device, strlen(img->device) ? img->device : img->path,
+		sizeof(r->device));
+	r->compressed = img->compressed != COMPRESSED_FALSE && img->size > 0 ?
+		(uint64_t)img->size : 0;
+	r->streamed = img->install_directly;
+	r->used.wall_ns = now.wall_ns - s->wall_ns;
+	r->used.cpu_ns = now.cpu_ns - s->cpu_ns;
+	r->used.rchar = now.rchar - s->rchar;
+	r->used.wchar = now.wchar - s->wchar;
+	r->used.syscalls = now.syscalls - s->syscalls;
+	r->used.copied = now.copied - s->copied;
+	r->used.maxrss = now.maxrss - s->maxrss;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+static void write_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+static uint64_t rate(uint64_t bytes, uint64_t ns)
+{
+	return ns ? (uint64_t)((double)bytes * 1e9 / ns) : 0;
+}
+
+static double mib(uint64_t bytes)
+{
+	return (double)bytes / (1024 * 1024);
+}
+
+static void sum_add(struct profile_sum *sums, unsigned int *n, const char *name,
+		    const struct profile_record *r)
+{
+	struct profile_sum *sum = NULL;
+	uint64_t bps = rate(r->used.copied, r->used.wall_ns);
+	unsigned int i;
+
+	for (i = 0; i < *n; i++) {
+		if (!strcmp(sums[i].name, name)) {
+			sum = &sums[i];
+			break;
+		}
+	}
+	if (!sum) {
+		sum = &sums[(*n)++];
+		sum->name = name;
+	}
+	sum->runs++;
+	sum->bytes += r->used.copied;
+	sum->wall_ns += r->used.wall_ns;
+	if (r->used.copied && (!sum->min_bps || bps < sum->min_bps))
+		sum->min_bps = bps;
+}
+
+/* appended to a summary that is sent as it is, e.g. to hawkBit */
+static void summary_add(char *summary, const char *fmt, ...)
+{
+	size_t len = strlen(summary);
+	va_list ap;
+	char *p;
+
+	va_start(ap, fmt);
+	vsnprintf(summary + len, PROFILE_SUMMARY_LEN - len, fmt, ap);
+	va_end(ap);
+	for (p = summary + len; *p; p++) {
+		if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20)
+			*p = '_';
+	}
+}
+
+/*
+ * The report of an update: totals of the metrics, bytes written to each
+ * device, throughput of each handler and a summary in a single line
+ */
+static void write_report(FILE *fp, const struct profile_update *u)
+{
+	struct profile_sum *devices, *handlers;
+	unsigned int ndevices = 0, nhandlers = 0, i;
+	struct metrics_totals used;
+	uint64_t installed = 0, compressed = 0, decompressed, streamed, staged;
+	char summary[PROFILE_SUMMARY_LEN] = "";
+	uint64_t duration = u->duration_ns;
+	struct timespec ts;
+	const char *mode;
+	double ratio;
+
+	if (u->running) {
+		totals_since(&used, &u->totals);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		duration = ts_ns(&ts) - u->start_ns;
+	} else
+		used = u->totals;
+	devices = calloc(u->nrecords + 1, sizeof(*devices));
+	handlers = calloc(u->nrecords + 1, sizeof(*handlers));
+	for (i = 0; devices && handlers && i < u->nrecords; i++) {
+		const struct profile_record *r = &u->records[i];
+
+		installed += r->used.copied;
+		if (r->used.copied)
+			compressed += r->compressed;
+		if (strlen(r->device) && r->used.copied)
+			sum_add(devices, &ndevices, r->device, r);
+		sum_add(handlers, &nhandlers, r->handler, r);
+	}
+
+	decompressed = used.stage_bytes[METRICS_STAGE_DECOMPRESS];
+	ratio = compressed && decompressed ? (double)decompressed / compressed : 0;
+	streamed = used.counters[METRICS_STREAMED_BYTES];
+	staged = used.counters[METRICS_STAGED_BYTES];
+	if (streamed && staged)
+		mode = "mixed";
+	else if (streamed)
+		mode = "streamed";
+	else if (staged)
+		mode = "staged";
+	else
+		mode = "none";
+
+	fprintf(fp, ",\n  \"report\":{\"received_bytes\":%llu,\"installed_bytes\":%llu,"
+		"\"streamed_bytes\":%llu,\"staged_bytes\":%llu,\"mode\":\"%s\","
+		"\"hash_us\":%llu,\"hashed_bytes\":%llu,\"compressed_bytes\":%llu,"
+		"\"decompressed_bytes\":%llu,\"decompression_ratio\":%.2f,\"devices\":[",
+		(unsigned long long)used.counters[METRICS_RECEIVED_BYTES],
+		(unsigned long long)installed,
+		(unsigned long long)streamed, (unsigned long long)staged, mode,
+		(unsigned long long)(used.stage_ns[METRICS_STAGE_HASH] / 1000),
+		(unsigned long long)used.stage_bytes[METRICS_STAGE_HASH],
+		(unsigned long long)compressed, (unsigned long long)decompressed, ratio);
+	for (i = 0; i < ndevices; i++) {
+		fputs(i ? ",{\"device\":" : "{\"device\":", fp);
+		write_json_string(fp, devices[i].name);
+		fprintf(fp, ",\"bytes\":%llu}", (unsigned long long)devices[i].bytes);
+	}
+	fputs("],\"handlers\":[", fp);
+	for (i = 0; i < nhandlers; i++) {
+		fputs(i ? ",{\"handler\":" : "{\"handler\":", fp);
+		write_json_string(fp, handlers[i].name);
+		fprintf(fp, ",\"runs\":%u,\"bytes\":%llu,\"avg_bytes_per_s\":%llu,"
+			"\"min_bytes_per_s\":%llu}",
+			handlers[i].runs, (unsigned long long)handlers[i].bytes,
+			(unsigned long long)rate(handlers[i].bytes, handlers[i].wall_ns),
+			(unsigned long long)handlers[i].min_bps);
+	}
+
+	summary_add(summary, "%.1f s, received %.1f MiB, installed %.1f MiB",
+		    duration / 1e9, mib(used.counters[METRICS_RECEIVED_BYTES]),
+		    mib(installed));
+	for (i = 0; i < ndevices; i++)
+		summary_add(summary, "%s%s %.1f MiB", i ? ", " : " (", devices[i].name,
+			    mib(devices[i].bytes));
+	summary_add(summary, "%s, %s, hashing %.1f s", ndevices ? ")" : "", mode,
+		    used.stage_ns[METRICS_STAGE_HASH] / 1e9);
+	if (ratio)
+		summary_add(summary, ", decompression %.2f:1", ratio);
+	for (i = 0; i < nhandlers; i++) {
+		if (handlers[i].bytes)
+			summary_add(summary, ", %s %.1f MiB/s (min %.1f)", handlers[i].name,
+				    mib(rate(handlers[i].bytes, handlers[i].wall_ns)),
+				    mib(handlers[i].min_bps));
+	}
+	fputs("],\"summary\":", fp);
+	write_json_string(fp, summary);
+	fputc('}', fp);
+
+	free(devices);
+	free(handlers);
+}
+
+static void write_update(FILE *fp, const struct profile_update *u)
+{
+	unsigned int i;
+
+	fprintf(fp, "{\"started\":%lld,\"version\":", (long long)u->started);
+	write_json_string(fp, u->version);
+	fprintf(fp, ",\"result\":\"%s\",\"duration_us\":%llu,\"dropped\":%u,"
+		"\"handlers\":[",
+		u->running ? "running" : (u->result ? "failed" : "successful"),
+		(unsigned long long)(u->duration_ns / 1000), u->dropped);
+	for (i = 0; i < u->nrecords; i++) {
+		const struct profile_record *r = &u->records[i];
+
+		fputs(i ? ",\n  {\"handler\":" : "\n  {\"handler\":", fp);
+		write_json_string(fp, r->handler);
+		fputs(",\"image\":", fp);
+		write_json_string(fp, r->image);
+		fputs(",\"device\":", fp);
+		write_json_string(fp, r->device);
+		fprintf(fp, ",\"streamed\":%s,\"wall_us\":%llu,\"cpu_us\":%llu,"
+			"\"bytes_read\":%llu,\"bytes_written\":%llu,\"bytes_installed\":%llu,"
+			"\"syscalls\":%llu,\"peak_rss_delta_kb\":%ld}",
+			r->streamed ? "true" : "false",
+			(unsigned long long)(r->used.wall_ns / 1000),
+			(unsigned long long)(r->used.cpu_ns / 1000),
+			(unsigned long long)r->used.rchar,
+			(unsigned long long)r->used.wchar,
+			(unsigned long long)r->used.copied,
+			(unsigned long long)r->used.syscalls,
+			r->used.maxrss);
+	}
+	fputc(']', fp);
+	write_report(fp, u);
+	fputc('}', fp);
+}
+
+/*
+ * Write the profile of the last updates as JSON to TMPDIR,
+ * the oldest first. path is set to the name of the file.
+ */
+int profile_write(char *path, size_t len)
+{
+	char tmp[MAX_IMAGE_FNAME];
+	unsigned int i;
+	FILE *fp;
+
+	snprintf(path, len, "%s%s", get_tmpdir(), PROFILE_FILENAME);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		WARN("Cannot write the profile to %s", path);
+		return -EFAULT;
+	}
+
+	pthread_mutex_lock(&profile_lock);
+	fputs("{\"updates\":[\n", fp);
+	for (i = 0; i < nupdates; i++) {
+		unsigned int n = (last + PROFILE_UPDATES - nupdates + 1 + i) % PROFILE_UPDATES;
+
+		if (i)
+			fputs(",\n", fp);
+		write_update(fp, &updates[n]);
+	}
+	fputs("\n]}\n", fp);
+	pthread_mutex_unlock(&profile_lock);
+
+	if (fclose(fp) || rename(tmp, path)) {
+		WARN("Cannot write the profile to %s", path);
+		unlink(tmp);
+		return -EFAULT;
+	}
+
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "bsdqueue.h"
+#include "util.h"
+#include "swupdate_membudget.h"
+#include "swupdate_staging.h"
+
+struct staged_image {
+	char file[MAX_IMAGE_FNAME];	/* copy in TMPDIR, or name of the memfd */
+	int fd;				/* memfd, -1 if in TMPDIR */
+	size_t size;
+	unsigned int users;		/* images not installed yet */
+	LIST_ENTRY(staged_image) next;
+};
+
+static LIST_HEAD(, staged_image) staged = LIST_HEAD_INITIALIZER(staged);
+/* images of a group are installed and released by its own thread */
+static pthread_mutex_t staged_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t staging_limit;
+static size_t staging_used;
+
+void staging_set_limit(size_t limit)
+{
+	staging_limit = limit;
+}
+
+static struct staged_image *staged_find(struct img_type *img)
+{
+	struct staged_image *s;
+
+	LIST_FOREACH(s, &staged, next) {
+		if (!strcmp(s->file, img->extract_file))
+			return s;
+	}
+
+	return NULL;
+}
+
+static int staging_memfd(const char *name, size_t size)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	if (!staging_limit || size > staging_limit - staging_used)
+		return -1;
+	if (!membudget_reserve(size))
+		return -1;
+
+	int fd = memfd_create(name, MFD_CLOEXEC);
+
+	if (fd < 0) {
+		TRACE("memfd not available (%s), staging in %s",
+		      strerror(errno), get_tmpdir());
+		membudget_release(size);
+		return -1;
+	}
+	staging_used += size;
+
+	return fd;
+#else
+	(void)name;
+	(void)size;
+	return -1;
+#endif
+}
+
+static void staged_free(struct staged_image *s)
+{
+	LIST_REMOVE(s, next);
+	if (s->fd >= 0) {
+		close(s->fd);
+		staging_used -= s->size;
+		membudget_release(s->size);
+	} else {
+#ifndef CONFIG_NOCLEANUP
+		unlink(s->file);
+#endif
+	}
+	free(s);
+}
+
+int staging_create(struct swupdate_cfg *sw, struct img_type *img,
+		   size_t size, bool *ram)
+{
+	struct staged_image *s = NULL;
+	struct img_type *p;
+	unsigned int users = 0;
+	int fd = -1;
+
+	*ram = false;
+	LIST_FOREACH(p, &sw->images, next) {
+		if (!strcmp(p->fname, img->fname))
+			users++;
+	}
+	/*
+	 * Scripts are copied again before they run, and an
+	 * image whose path is TMPDIR must stay there
+	 */
+	if (!users || !strcmp(img->path, img->extract_file))
+		return openfileoutput(img->extract_file);
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+	strlcpy(s->file, img->extract_file, sizeof(s->file));
+	s->users = users;
+
+	pthread_mutex_lock(&staged_lock);
+	s->fd = staging_memfd(img->fname, size);
+	if (s->fd >= 0) {
+		s->size = size;
+		fd = dup(s->fd);
+		*ram = fd >= 0;
+	}
+	if (fd < 0)
+		fd = openfileoutput(img->extract_file);
+	if (fd < 0) {
+		if (s->fd >= 0) {
+			close(s->fd);
+			staging_used -= size;
+			membudget_release(size);
+		}
+		free(s);
+	} else
+		LIST_INSERT_HEAD(&staged, s, next);
+	pthread_mutex_unlock(&staged_lock);
+
+	if (*ram)
+		TRACE("%s staged in memory, %zu bytes", img->fname, size);
+
+	return fd;
+}
+
+int staging_open(struct img_type *img)
+{
+	struct staged_image *s;
+	char path[32];
+	int fd = -ENOENT;
+
+	pthread_mutex_lock(&staged_lock);
+	s = staged_find(img);
+	if (s && s->fd >= 0) {
+		/* own file description, images are read from the start */
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", s->fd);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fd = -errno;
+			ERROR("Image %s cannot be opened: %s", img->fname,
+			      strerror(errno));
+		} else
+			img->size = s->size;
+	}
+	pthread_mutex_unlock(&staged_lock);
+
+	return fd;
+}
+
+void staging_release(struct img_type *img)
+{
+	struct staged_image *s;
+
+	pthread_mutex_lock(&staged_lock);
+	s = staged_find(img);
+	if (s && !--s->users)
+		staged_free(s);
+	pthread_mutex_unlock(&staged_lock);
+}
+
+void staging_cleanup(void)
+{
+	pthread_mutex_lock(&staged_lock);
+	while (!LIST_EMPTY(&staged))
+		staged_free(LIST_FIRST(&staged));
+	pthread_mutex_unlock(&staged_lock);
+}
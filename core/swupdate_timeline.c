@@ -0,0 +1,143 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "swupdate_timeline.h"
+
+#define TIMELINE_MAX_EVENTS	4096
+
+struct timeline_event {
+	uint64_t ts;
+	uint64_t dur;
+	unsigned int tid;
+	char cat[16];
+	char name[64];
+};
+
+static struct timeline_event events[TIMELINE_MAX_EVENTS];
+static unsigned int nevents;
+static unsigned int dropped;
+static uint64_t origin;
+static unsigned int ntids;
+static __thread unsigned int tid;
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Reset the timeline, this is called when a new update starts
+ */
+void timeline_start(void)
+{
+	pthread_mutex_lock(&timeline_lock);
+	nevents = 0;
+	dropped = 0;
+	origin = now_us();
+	pthread_mutex_unlock(&timeline_lock);
+}
+
+void timeline_begin(struct timeline_span *span)
+{
+	span->start = now_us();
+}
+
+void timeline_end(struct timeline_span *span, const char *cat, const char *name)
+{
+	uint64_t end = now_us();
+	struct timeline_event *ev;
+
+	pthread_mutex_lock(&timeline_lock);
+	if (!tid)
+		tid = ++ntids;
+	if (nevents == TIMELINE_MAX_EVENTS || span->start < origin) {
+		dropped++;
+		pthread_mutex_unlock(&timeline_lock);
+		return;
+	}
+	ev = &events[nevents++];
+	ev->ts = span->start - origin;
+	ev->dur = end - span->start;
+	ev->tid = tid;
+	strlcpy(ev->cat, cat ? cat : "", sizeof(ev->cat));
+	strlcpy(ev->name, name ? name : "", sizeof(ev->name));
+	pthread_mutex_unlock(&timeline_lock);
+}
+
+static void write_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Write the timeline as JSON in the Chrome trace format,
+ * it can be loaded by chrome://tracing or Perfetto.
+ */
+int timeline_write(void)
+{
+	char path[MAX_IMAGE_FNAME], tmp[MAX_IMAGE_FNAME];
+	FILE *fp;
+	unsigned int i;
+
+	snprintf(path, sizeof(path), "%s%s", get_tmpdir(), TIMELINE_FILENAME);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		WARN("Cannot write install timeline to %s", path);
+		return -EFAULT;
+	}
+
+	pthread_mutex_lock(&timeline_lock);
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%u},\n"
+		"\"traceEvents\":[\n", dropped);
+	for (i = 0; i < nevents; i++) {
+		struct timeline_event *ev = &events[i];
+
+		fprintf(fp, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu,\"cat\":",
+			i ? ",\n" : "", ev->tid,
+			(unsigned long long)ev->ts, (unsigned long long)ev->dur);
+		write_json_string(fp, ev->cat);
+		fputs(",\"name\":", fp);
+		write_json_string(fp, ev->name);
+		fputc('}', fp);
+	}
+	fputs("\n]}\n", fp);
+	pthread_mutex_unlock(&timeline_lock);
+
+	if (fclose(fp) || rename(tmp, path)) {
+		WARN("Cannot write install timeline to %s", path);
+		unlink(tmp);
+		return -EFAULT;
+	}
+	TRACE("Install timeline written to %s", path);
+
+	return 0;
+}
@@ -35,8 +35,6 @@ void syslog_notifier(RECOVERY_STATUS status, int error, int level, const char *m
       default: return;
    }
 
-   openlog("swupdate", 0, LOG_USER);
-
    int logprio = LOG_INFO;
    switch (level) {
       case ERRORLEVEL: logprio = LOG_ERR; break;
@@ -46,8 +44,21 @@ void syslog_notifier(RECOVERY_STATUS status, int error, int level, const char *m
       case TRACELEVEL: logprio = LOG_DEBUG; break;
    }
 
+#ifdef CONFIG_NOTIFIER_ASYNC
+   char buf[NOTIFY_BUF_SIZE + 32];
+   int len = snprintf(buf, sizeof(buf), "%s%s %s\n",
+		      ((error != (int)RECOVERY_NO_ERROR) ? "FATAL_" : ""), statusMsg, msg);
+   if (len < 0)
+      return;
+   if ((size_t)len >= sizeof(buf))
+      len = sizeof(buf) - 1;
+   notifier_queue_log(-1, level, logprio, buf, len);
+#else
+   openlog("swupdate", 0, LOG_USER);
+
    syslog(logprio, "%s%s %s\n", ((error != (int)RECOVERY_NO_ERROR) ? "FATAL_" : ""), statusMsg, msg);
 
    closelog();
+#endif
 }
 
@@ -26,9 +26,12 @@
 #include <regex.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #if defined(__linux__)
 #include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #endif
 
 #include "swupdate.h"
@@ -1147,19 +1150,40 @@ out:
 	return root;
 }
 
+/*
+ * The detection scans sysfs and procfs, so it is done once and the
+ * result is kept until refresh_root_device() is called.
+ */
+static char *root_device;
+static pthread_mutex_t root_device_lock = PTHREAD_MUTEX_INITIALIZER;
+
 char *get_root_device(void)
 {
 	char *root = NULL;
 
-	root = get_root_from_partitions();
-	if (!root)
-		root = get_root_from_mountinfo();
-	if (!root)
-		root = get_root_from_cmdline();
+	pthread_mutex_lock(&root_device_lock);
+	if (!root_device) {
+		root_device = get_root_from_partitions();
+		if (!root_device)
+			root_device = get_root_from_mountinfo();
+		if (!root_device)
+			root_device = get_root_from_cmdline();
+	}
+	if (root_device)
+		root = strdup(root_device);
+	pthread_mutex_unlock(&root_device_lock);
 
 	return root;
 }
 
+void refresh_root_device(void)
+{
+	pthread_mutex_lock(&root_device_lock);
+	free(root_device);
+	root_device = NULL;
+	pthread_mutex_unlock(&root_device_lock);
+}
+
 int read_lines_notify(int fd, char *buf, int buf_size, int *buf_offset,
 		      LOGLEVEL level)
 {
@@ -1266,7 +1290,7 @@ long long get_output_size(struct img_type *img, bool strict)
 	return bytes;
 }
 
-static bool check_free_space(int fd, long long size, char *fname)
+static int read_free_space(int fd, unsigned long long *free_space)
 {
 	/* This needs OS-specific implementation because linux's statfs
 	 * f_bsize is optimal IO size vs. statvfs f_bsize fs block size,
@@ -1279,21 +1303,83 @@ static bool check_free_space(int fd, long long size, char *fname)
 #define fstatvfs fstatfs
 #endif
 	struct statvfs statvfs;
+
+	if (fstatvfs(fd, &statvfs))
+		return -errno;
+	*free_space = (unsigned long long)statvfs.f_bfree * statvfs.f_bsize;
+
+	return 0;
+}
+
+/*
+ * The free space of each filesystem is read once for an update and
+ * then decremented with the size of the images written to it, so
+ * that updates with many files do not call statfs for each of them.
+ * The space freed by overwritten files is not seen: the value is
+ * read again before a check fails.
+ */
+#define FREE_SPACE_CACHE_SIZE	16
+
+static struct {
+	dev_t dev;
 	unsigned long long free_space;
+} free_space_cache[FREE_SPACE_CACHE_SIZE];
+static unsigned int free_space_entries;
+static pthread_mutex_t free_space_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void img_free_space_reset(void)
+{
+	pthread_mutex_lock(&free_space_lock);
+	free_space_entries = 0;
+	pthread_mutex_unlock(&free_space_lock);
+}
 
-	if (fstatvfs(fd, &statvfs)) {
+static bool check_free_space(int fd, long long size, char *fname)
+{
+	unsigned long long free_space = 0;
+	unsigned int i;
+	struct stat st;
+	bool ret = true;
+
+	pthread_mutex_lock(&free_space_lock);
+	if (fstat(fd, &st))
+		st.st_dev = 0;
+	for (i = 0; i < free_space_entries; i++) {
+		if (free_space_cache[i].dev == st.st_dev)
+			break;
+	}
+
+	if (i < free_space_entries &&
+	    free_space_cache[i].free_space >= (unsigned long long)size) {
+		free_space_cache[i].free_space -= size;
+		goto out;
+	}
+
+	if (read_free_space(fd, &free_space)) {
 		ERROR("Statfs failed on %s, skipping free space check", fname);
-		return true;
+		goto out;
 	}
-	free_space = (unsigned long long)statvfs.f_bfree * statvfs.f_bsize;
 
-	if (free_space < size) {
+	if (free_space < (unsigned long long)size) {
 		ERROR("Not enough free space to extract %s (needed %llu, got %llu)",
 		       fname, size, free_space);
-		return false;
+		ret = false;
+		free_space = 0;
+	} else {
+		free_space -= size;
 	}
 
-	return true;
+	if (i == free_space_entries && st.st_dev &&
+	    free_space_entries < FREE_SPACE_CACHE_SIZE) {
+		free_space_cache[i].dev = st.st_dev;
+		free_space_entries++;
+	}
+	if (i < free_space_entries)
+		free_space_cache[i].free_space = free_space;
+out:
+	pthread_mutex_unlock(&free_space_lock);
+
+	return ret;
 }
 
 bool img_check_free_space(struct img_type *img, int fd)
@@ -1308,3 +1394,127 @@ bool img_check_free_space(struct img_type *img, int fd)
 
 	return check_free_space(fd, size, img->fname);
 }
+
+/*
+ * Reserve the blocks of a file before it is written, so that the
+ * filesystem can allocate them in a few extents instead of growing
+ * the file at each write. The size of the file is not changed, the
+ * blocks that are not written are released by ftruncate() when the
+ * file is completed.
+ */
+void preallocate_output(int fd, long long size)
+{
+#if defined(__linux__)
+	if (size <= 0)
+		return;
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) &&
+	    errno != EOPNOTSUPP && errno != ENOSYS)
+		DEBUG("Cannot preallocate %lld bytes: %s", size, strerror(errno));
+#else
+	(void)fd;
+	(void)size;
+#endif
+}
+
+/*
+ * Parse the "discard" property of an image:
+ *	"true"   - discard the target before writing
+ *	"secure" - like "true", but with BLKSECDISCARD
+ *	"tail"   - discard what is left after the written data
+ */
+int img_discard_mode(struct img_type *img)
+{
+	const char *mode = dict_get_value(&img->properties, "discard");
+
+	if (!mode || !strlen(mode) || !strcmp(mode, "false"))
+		return DISCARD_NONE;
+	if (strtobool(mode))
+		return DISCARD_FULL;
+	if (!strcmp(mode, "secure"))
+		return DISCARD_SECURE;
+	if (!strcmp(mode, "tail"))
+		return DISCARD_TAIL;
+
+	ERROR("%s: unknown discard mode \"%s\"", img->fname, mode);
+	return -EINVAL;
+}
+
+/*
+ * Discard len bytes starting at start on a block device,
+ * len = 0 means up to the end of the device. The range is shrunk
+ * to whole logical blocks. Devices that do not support discard
+ * are not an error, unless a secure discard was requested.
+ */
+int blkdev_discard(int fd, unsigned long long start,
+		   unsigned long long len, bool secure)
+{
+#if defined(BLKDISCARD) && defined(BLKSECDISCARD)
+	unsigned long long size, end;
+	uint64_t range[2];
+	struct stat st;
+	int blksz = 512;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+	if (!S_ISBLK(st.st_mode)) {
+		TRACE("Discard skipped, target is not a block device");
+		return 0;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		ERROR("Cannot get size of block device: %s", strerror(errno));
+		return -EIO;
+	}
+	if (ioctl(fd, BLKSSZGET, &blksz) < 0 || blksz <= 0)
+		blksz = 512;
+
+	end = (!len || len > size - min(start, size)) ? size : start + len;
+	start = ((start + blksz - 1) / blksz) * blksz;
+	end = (end / blksz) * blksz;
+	if (start >= end)
+		return 0;
+
+	range[0] = start;
+	range[1] = end - start;
+	if (ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, range) < 0) {
+		int err = errno;
+
+		if (!secure && (err == EOPNOTSUPP || err == ENOTTY)) {
+			WARN("Device does not support discard, skipped");
+			return 0;
+		}
+		ERROR("%s of %llu bytes at %llu failed: %s",
+		      secure ? "Secure discard" : "Discard",
+		      end - start, start, strerror(err));
+		return -err;
+	}
+	TRACE("%s %llu bytes at %llu", secure ? "Secure discarded" : "Discarded",
+	      end - start, start);
+
+	return 0;
+#else
+	(void)fd;
+	(void)start;
+	(void)len;
+	if (secure) {
+		ERROR("Secure discard is not supported on this system");
+		return -EOPNOTSUPP;
+	}
+	WARN("Discard is not supported on this system, skipped");
+	return 0;
+#endif
+}
+
+int blkdev_discard_device(const char *device, bool secure)
+{
+	int fd, ret;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		ERROR("%s cannot be opened: %s", device, strerror(errno));
+		return -ENODEV;
+	}
+	ret = blkdev_discard(fd, 0, 0, secure);
+	close(fd);
+
+	return ret;
+}
@@ -17,6 +17,12 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <dirent.h>
 #include <curl/curl.h>
 #include <generated/autoconf.h>
 #include <unistd.h>
@@ -27,6 +33,9 @@
 #include "channel.h"
 #include "channel_curl.h"
 #include "progress.h"
+#include "swupdate_membudget.h"
+#include "swupdate_probes.h"
+#include "pctl.h"
 #ifdef CONFIG_JSON
 #include <json-c/json.h>
 #endif
@@ -35,25 +44,102 @@
 #define SPEED_LOW_TIME_SEC 300
 #define KEEPALIVE_DELAY 204L
 #define KEEPALIVE_INTERVAL 120L
+#define SEGMENT_DEFAULT_SIZE (4 * 1024 * 1024)
+#define RESUME_STATE_SUFFIX ".dgst"
+#define RESUME_STATE_MAGIC 0x44575553
+#define RESUME_STATE_MAX_SIZE 512
+#define RESUME_STATE_INTERVAL (64ULL * 1024 * 1024)
+#define TLS_SESSIONS_MAGIC 0x53544c53
+#define TLS_SESSIONS_MAX_SIZE (64 * 1024)
+#define READAHEAD_DEFAULT_HIGH 90
+#define READAHEAD_DEFAULT_LOW 50
+#define PEER_TIMEOUT 5L
+#define REPLY_CACHE_ENTRIES 4
+#define RATE_BACKOFF 0.7
+#define RATE_STEPS 16
+#define RATE_MIN_BYTES_SEC 1024
+#define REPLY_MIN_ALLOC 4096
+#define REPLY_KEEP_MAX (64 * 1024)
 
 typedef struct {
 	char *memory;
 	size_t size;
+	size_t alloc;		/* allocated bytes */
+	size_t reserved;	/* bytes charged to the memory budget */
 } output_data_t;
 
+/*
+ * Last replies with an ETag, sent again by the server
+ * as 304 Not Modified if they did not change
+ */
+typedef struct {
+	char *url;
+	char *etag;
+	char *body;
+	size_t size;
+} reply_cache_t;
+
 typedef struct {
 	char *proxy;
 	char *effective_url;
 	char *redirect_url;
 	CURL *handle;
 	struct curl_slist *header;
+	reply_cache_t replies[REPLY_CACHE_ENTRIES];
+	unsigned int next_reply;
+	output_data_t reply;	/* reply buffer, kept for the next requests */
+	CURLSH *share;		/* TLS session cache */
+	char *tls_sessions;	/* file the TLS sessions are kept in */
+	unsigned int tls_session_lifetime;
+	char *tls_saved;	/* content of the file */
+	size_t tls_saved_len;
+#ifdef CONFIG_JSON
+	struct json_tokener *tokener;	/* reused for all replies */
+#endif
 } channel_curl_t;
 
+/*
+ * Read-ahead buffer between the network and the installer: curl
+ * writes into a ring buffer and a thread forwards the data to the
+ * IPC, so that a slow handler does not stall the connection. The
+ * download is paused when the buffer reaches the high water mark
+ * and goes on when the installer drains it below the low one.
+ */
+typedef struct {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t fill;
+	size_t high;
+	size_t low;
+	int fd;
+	bool paused;
+	bool done;
+	bool error;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct timespec paused_at;
+	/* metrics */
+	size_t peak;
+	unsigned long long bytes;
+	unsigned int stalls;
+	double stalled_sec;
+} readahead_t;
+
 typedef struct {
 	channel_data_t *channel_data;
 	int output;
 	output_data_t *outdata;
 	channel_t *this;
+	unsigned long long hashed;	/* bytes added to the digest */
+	unsigned long long prehashed;	/* bytes already in the restored digest */
+	unsigned long long checkpoint;	/* hashed bytes when state was saved */
+	readahead_t *ra;
+	int peerfd;			/* copy for the peer cache */
+	unsigned long long delivered;	/* bytes passed to the installer */
+	unsigned long long resumed;	/* offset the running request resumes at */
+	bool checked;			/* the running request was checked */
 } write_callback_t;
 
 typedef struct {
@@ -61,6 +147,40 @@ typedef struct {
 	uint8_t percent;
 } download_callback_data_t;
 
+typedef enum {
+	SEGMENT_PENDING,
+	SEGMENT_DONE,
+	SEGMENT_FAILED
+} segment_state_t;
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t filled;
+	segment_state_t state;
+	CURL *handle;		/* transfer filling the segment */
+} segment_t;
+
+/*
+ * Segmented download: workers fetch segments with range
+ * requests on own connections, the caller forwards them
+ * in order. At most window segments are kept in memory.
+ */
+typedef struct {
+	channel_data_t *channel_data;
+	unsigned long long offset;	/* first byte to be downloaded */
+	size_t segsize;
+	unsigned int count;
+	unsigned int window;
+	unsigned int next_assign;
+	unsigned int next_write;
+	bool abort;
+	bool norange;			/* server does not support ranges */
+	segment_t *seg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} segmented_dwl_t;
+
 
 /* Prototypes for "internal" functions */
 /* Note that they're not `static` so that they're callable from unit tests. */
@@ -74,6 +194,7 @@ channel_op_res_t channel_set_options(channel_t *this, channel_data_t *channel_da
 char *channel_get_redirect_url(channel_t *this);
 
 static void channel_log_effective_url(channel_t *this);
+static void output_data_free(output_data_t *outdata);
 
 /* Prototypes for "public" functions */
 static channel_op_res_t channel_close(channel_t *this);
@@ -84,6 +205,229 @@ static channel_op_res_t channel_put(channel_t *this, void *data);
 channel_op_res_t channel_curl_init(void);
 channel_t *channel_new(void);
 
+/*
+ * All channels in a process share DNS cache, TLS sessions
+ * and the connection pool, so that a new channel to the same
+ * server does not need a new TCP and TLS handshake.
+ */
+static CURLSH *curl_share;
+static pthread_mutex_t curl_share_lock[CURL_LOCK_DATA_LAST];
+
+static void channel_share_lock(CURL __attribute__ ((__unused__)) *handle,
+			       curl_lock_data data,
+			       curl_lock_access __attribute__ ((__unused__)) access,
+			       void __attribute__ ((__unused__)) *userptr)
+{
+	pthread_mutex_lock(&curl_share_lock[data]);
+}
+
+static void channel_share_unlock(CURL __attribute__ ((__unused__)) *handle,
+				 curl_lock_data data,
+				 void __attribute__ ((__unused__)) *userptr)
+{
+	pthread_mutex_unlock(&curl_share_lock[data]);
+}
+
+static void channel_share_init(void)
+{
+	unsigned int i;
+
+	if (curl_share)
+		return;
+
+	curl_share = curl_share_init();
+	if (!curl_share) {
+		WARN("Cannot share connections between channels");
+		return;
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&curl_share_lock[i], NULL);
+
+	if ((curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC,
+			       channel_share_lock) != CURLSHE_OK) ||
+	    (curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC,
+			       channel_share_unlock) != CURLSHE_OK) ||
+	    (curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+			       CURL_LOCK_DATA_DNS) != CURLSHE_OK)) {
+		WARN("Cannot share connections between channels");
+		curl_share_cleanup(curl_share);
+		curl_share = NULL;
+		return;
+	}
+	/* These are optional, not all libcurl builds support them */
+	if (curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+			      CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK)
+		DEBUG("TLS sessions are not shared between channels");
+#if LIBCURL_VERSION_NUM >= 0x073900
+	if (curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+			      CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+		DEBUG("Connections are not shared between channels");
+#endif
+}
+
+/*
+ * Download rate shaping. The limits are taken from the channel
+ * that starts the first transfer and can be changed at runtime
+ * with channel_set_download_speed(). They apply to the sum of all
+ * transfers running in the process, so that parallel segments or
+ * range requests do not exceed them together.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned int active;		/* running transfers */
+	bool runtime;			/* limits set at runtime */
+	unsigned int max;		/* bytes per second, 0 = unlimited */
+	unsigned int min;
+	bool adaptive;
+	double rate;			/* current limit, 0 = unlimited */
+	double tokens;
+	struct timespec last;
+	struct timespec probe;
+	unsigned long long probed_bytes;
+	unsigned int base_rtt;		/* lowest smoothed RTT seen, usec */
+} rate_shaper_t;
+
+static rate_shaper_t shaper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double elapsed_sec(struct timespec *from, struct timespec *to)
+{
+	return (double)(to->tv_sec - from->tv_sec) +
+		(double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void channel_set_download_speed(unsigned int max, unsigned int min, bool adaptive)
+{
+	pthread_mutex_lock(&shaper.lock);
+	shaper.runtime = true;
+	shaper.max = max;
+	shaper.min = (max && min > max) ? max : min;
+	shaper.adaptive = adaptive;
+	shaper.rate = max;
+	shaper.base_rtt = 0;
+	pthread_mutex_unlock(&shaper.lock);
+
+	TRACE("Download speed set to max %u, min %u bytes/sec%s",
+	      max, min, adaptive ? ", adaptive" : "");
+}
+
+static void channel_rate_start(channel_data_t *channel_data)
+{
+	pthread_mutex_lock(&shaper.lock);
+	if (!shaper.active++) {
+		if (!shaper.runtime) {
+			shaper.max = channel_data->max_download_speed;
+			shaper.min = channel_data->min_download_speed;
+			if (shaper.max && shaper.min > shaper.max)
+				shaper.min = shaper.max;
+			shaper.adaptive = channel_data->adaptive_speed;
+		}
+		shaper.rate = shaper.max;
+		shaper.tokens = 0;
+		shaper.base_rtt = 0;
+		shaper.probed_bytes = 0;
+		clock_gettime(CLOCK_MONOTONIC, &shaper.last);
+		shaper.probe = shaper.last;
+	}
+	pthread_mutex_unlock(&shaper.lock);
+}
+
+static void channel_rate_stop(void)
+{
+	pthread_mutex_lock(&shaper.lock);
+	if (shaper.active)
+		shaper.active--;
+	pthread_mutex_unlock(&shaper.lock);
+}
+
+/*
+ * Adaptive mode: the smoothed RTT of the connection is compared
+ * with the lowest one seen. A rising RTT means that queues on the
+ * path fill up, so the rate is reduced multiplicatively, otherwise
+ * it is increased again up to the configured maximum.
+ */
+static void channel_rate_adapt(CURL *handle, struct timespec *now)
+{
+#if defined(TCP_INFO) && LIBCURL_VERSION_NUM >= 0x072d00
+	curl_socket_t sock = CURL_SOCKET_BAD;
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	double interval = elapsed_sec(&shaper.probe, now);
+	double throughput;
+
+	if (interval < 1.0)
+		return;
+	throughput = shaper.probed_bytes / interval;
+	shaper.probe = *now;
+	shaper.probed_bytes = 0;
+
+	if (curl_easy_getinfo(handle, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK ||
+	    sock == CURL_SOCKET_BAD ||
+	    getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 ||
+	    !ti.tcpi_rtt)
+		return;
+
+	if (!shaper.base_rtt || ti.tcpi_rtt < shaper.base_rtt)
+		shaper.base_rtt = ti.tcpi_rtt;
+
+	if (ti.tcpi_rtt > shaper.base_rtt + shaper.base_rtt / 2) {
+		double rate = (shaper.rate ? shaper.rate : throughput) * RATE_BACKOFF;
+
+		shaper.rate = rate > shaper.min ? rate : shaper.min;
+		/* never switch back to unlimited */
+		if (shaper.rate < RATE_MIN_BYTES_SEC)
+			shaper.rate = RATE_MIN_BYTES_SEC;
+		DEBUG("RTT %u usec (base %u), download rate reduced to %.0f bytes/sec",
+		      ti.tcpi_rtt, shaper.base_rtt, shaper.rate);
+	} else if (shaper.rate) {
+		shaper.rate += shaper.max ? shaper.max / RATE_STEPS :
+				shaper.rate / RATE_STEPS;
+		if (shaper.max && shaper.rate > shaper.max)
+			shaper.rate = shaper.max;
+	}
+#else
+	(void)handle;
+	(void)now;
+#endif
+}
+
+/*
+ * Called for each block of received data: the caller sleeps
+ * until the transfer is back below the current rate.
+ */
+static void channel_rate_throttle(CURL *handle, size_t bytes)
+{
+	struct timespec now, delay;
+	double wait = 0;
+
+	pthread_mutex_lock(&shaper.lock);
+	if (!shaper.max && !shaper.adaptive && !shaper.rate) {
+		pthread_mutex_unlock(&shaper.lock);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	shaper.probed_bytes += bytes;
+	if (shaper.adaptive)
+		channel_rate_adapt(handle, &now);
+	if (shaper.rate) {
+		shaper.tokens += elapsed_sec(&shaper.last, &now) * shaper.rate;
+		/* allow a burst of one second at most */
+		if (shaper.tokens > shaper.rate)
+			shaper.tokens = shaper.rate;
+		shaper.tokens -= bytes;
+		if (shaper.tokens < 0)
+			wait = -shaper.tokens / shaper.rate;
+	}
+	shaper.last = now;
+	pthread_mutex_unlock(&shaper.lock);
+
+	if (wait > 0) {
+		delay.tv_sec = (time_t)wait;
+		delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+		nanosleep(&delay, NULL);
+	}
+}
 
 channel_op_res_t channel_curl_init(void)
 {
@@ -99,6 +443,7 @@ channel_op_res_t channel_curl_init(void)
 		return CHANNEL_EINIT;
 	}
 #undef CURL_FLAGS
+	channel_share_init();
 	return CHANNEL_OK;
 }
 
@@ -120,21 +465,367 @@ channel_t *channel_new(void)
 	return newchan;
 }
 
+static void free_reply_cache(reply_cache_t *reply)
+{
+	free(reply->url);
+	free(reply->etag);
+	free(reply->body);
+	memset(reply, 0, sizeof(*reply));
+}
+
+static reply_cache_t *find_reply_cache(channel_curl_t *channel_curl, const char *url)
+{
+	for (unsigned int i = 0; i < REPLY_CACHE_ENTRIES; i++) {
+		if (channel_curl->replies[i].url &&
+		    !strcmp(channel_curl->replies[i].url, url))
+			return &channel_curl->replies[i];
+	}
+
+	return NULL;
+}
+
+static void store_reply_cache(channel_curl_t *channel_curl, const char *url,
+			      output_data_t *outdata)
+{
+#if LIBCURL_VERSION_NUM >= 0x075300
+	struct curl_header *h;
+	reply_cache_t *reply;
+
+	if (curl_easy_header(channel_curl->handle, "ETag", 0, CURLH_HEADER, -1,
+			     &h) != CURLHE_OK)
+		return;
+
+	reply = find_reply_cache(channel_curl, url);
+	if (!reply) {
+		reply = &channel_curl->replies[channel_curl->next_reply];
+		channel_curl->next_reply = (channel_curl->next_reply + 1) % REPLY_CACHE_ENTRIES;
+	}
+	free_reply_cache(reply);
+	reply->url = strdup(url);
+	reply->etag = strdup(h->value);
+	reply->body = malloc(outdata->size + 1);
+	if (!reply->url || !reply->etag || !reply->body) {
+		free_reply_cache(reply);
+		return;
+	}
+	memcpy(reply->body, outdata->memory, outdata->size);
+	reply->body[outdata->size] = '\0';
+	reply->size = outdata->size;
+#else
+	(void)channel_curl;
+	(void)url;
+	(void)outdata;
+#endif
+}
+
+/*
+ * TLS sessions, as exported by libcurl, are stored after a magic
+ * number as records of a header, the key of the peer, its salted
+ * hash and the session data.
+ */
+typedef struct {
+	uint32_t key_len;	/* with the trailing '\0', 0 if none */
+	uint32_t shmac_len;
+	uint32_t sdata_len;
+	int64_t valid_until;
+} tls_session_hdr_t;
+
+typedef struct {
+	channel_curl_t *channel_curl;
+	char *buf;
+	size_t len;
+} tls_export_t;
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+/*
+ * Walk the records in buf, fn is called for each one
+ * until it returns false. Returns false for a corrupted buffer.
+ */
+static bool tls_sessions_walk(const char *buf, size_t len,
+			      bool (*fn)(const tls_session_hdr_t *hdr, const char *key,
+					 const unsigned char *shmac,
+					 const unsigned char *sdata, void *arg),
+			      void *arg)
+{
+	size_t off = sizeof(uint32_t);
+	tls_session_hdr_t hdr;
+
+	while (off < len) {
+		if (len - off < sizeof(hdr))
+			return false;
+		memcpy(&hdr, buf + off, sizeof(hdr));
+		off += sizeof(hdr);
+		if ((size_t)hdr.key_len + hdr.shmac_len + hdr.sdata_len > len - off ||
+		    (hdr.key_len && buf[off + hdr.key_len - 1] != '\0'))
+			return false;
+		if (!fn(&hdr, hdr.key_len ? buf + off : NULL,
+			(const unsigned char *)buf + off + hdr.key_len,
+			(const unsigned char *)buf + off + hdr.key_len + hdr.shmac_len,
+			arg))
+			break;
+		off += hdr.key_len + hdr.shmac_len + hdr.sdata_len;
+	}
+
+	return true;
+}
+
+typedef struct {
+	const unsigned char *sdata;
+	size_t sdata_len;
+	int64_t valid_until;
+} tls_session_find_t;
+
+static bool tls_session_find(const tls_session_hdr_t *hdr,
+			     const char __attribute__ ((__unused__)) *key,
+			     const unsigned char __attribute__ ((__unused__)) *shmac,
+			     const unsigned char *sdata, void *arg)
+{
+	tls_session_find_t *f = arg;
+
+	if (hdr->sdata_len != f->sdata_len || memcmp(sdata, f->sdata, f->sdata_len))
+		return true;
+	f->valid_until = hdr->valid_until;
+
+	return false;
+}
+
+static CURLcode tls_session_export(CURL __attribute__ ((__unused__)) *handle,
+				   void *userptr, const char *session_key,
+				   const unsigned char *shmac, size_t shmac_len,
+				   const unsigned char *sdata, size_t sdata_len,
+				   curl_off_t valid_until,
+				   int __attribute__ ((__unused__)) ietf_tls_id,
+				   const char __attribute__ ((__unused__)) *alpn,
+				   size_t __attribute__ ((__unused__)) earlydata_max)
+{
+	tls_export_t *e = userptr;
+	channel_curl_t *channel_curl = e->channel_curl;
+	tls_session_find_t f = { .sdata = sdata, .sdata_len = sdata_len };
+	tls_session_hdr_t hdr;
+	char *buf;
+
+	if (!shmac_len || !sdata_len)
+		return CURLE_OK;
+
+	/* a session keeps the lifetime it got when it was first saved */
+	if (channel_curl->tls_saved &&
+	    tls_sessions_walk(channel_curl->tls_saved, channel_curl->tls_saved_len,
+			      tls_session_find, &f) && f.valid_until)
+		valid_until = f.valid_until;
+	else if (channel_curl->tls_session_lifetime &&
+		 (valid_until <= 0 ||
+		  valid_until > time(NULL) + channel_curl->tls_session_lifetime))
+		valid_until = time(NULL) + channel_curl->tls_session_lifetime;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.key_len = session_key ? strlen(session_key) + 1 : 0;
+	hdr.shmac_len = shmac_len;
+	hdr.sdata_len = sdata_len;
+	hdr.valid_until = valid_until;
+	if (e->len + sizeof(hdr) + hdr.key_len + shmac_len + sdata_len > TLS_SESSIONS_MAX_SIZE)
+		return CURLE_OK;
+
+	buf = realloc(e->buf, e->len + sizeof(hdr) + hdr.key_len + shmac_len + sdata_len);
+	if (!buf)
+		return CURLE_OUT_OF_MEMORY;
+	e->buf = buf;
+	memcpy(e->buf + e->len, &hdr, sizeof(hdr));
+	e->len += sizeof(hdr);
+	if (hdr.key_len)
+		memcpy(e->buf + e->len, session_key, hdr.key_len);
+	e->len += hdr.key_len;
+	memcpy(e->buf + e->len, shmac, shmac_len);
+	e->len += shmac_len;
+	memcpy(e->buf + e->len, sdata, sdata_len);
+	e->len += sdata_len;
+
+	return CURLE_OK;
+}
+
+/*
+ * Write the TLS sessions of the channel if they changed,
+ * only the owner can read the file
+ */
+static void save_tls_sessions(channel_curl_t *channel_curl)
+{
+	tls_export_t e = { .channel_curl = channel_curl };
+	uint32_t magic = TLS_SESSIONS_MAGIC;
+	char *tmpfile = NULL;
+	CURLcode rc;
+	int fd = -1;
+
+	if (!channel_curl->tls_sessions)
+		return;
+
+	e.buf = malloc(sizeof(magic));
+	if (!e.buf)
+		return;
+	memcpy(e.buf, &magic, sizeof(magic));
+	e.len = sizeof(magic);
+	rc = curl_easy_ssls_export(channel_curl->handle, tls_session_export, &e);
+	if (rc == CURLE_NOT_BUILT_IN) {
+		WARN("libcurl is built without SSL session export, TLS sessions not kept");
+		free(channel_curl->tls_sessions);
+		channel_curl->tls_sessions = NULL;
+	}
+	if (rc != CURLE_OK ||
+	    (e.len == channel_curl->tls_saved_len &&
+	     !memcmp(e.buf, channel_curl->tls_saved, e.len))) {
+		free(e.buf);
+		return;
+	}
+
+	if (ENOMEM_ASPRINTF == asprintf(&tmpfile, "%s.tmp", channel_curl->tls_sessions)) {
+		free(e.buf);
+		return;
+	}
+	fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+		  S_IRUSR | S_IWUSR);
+	if (fd < 0 || write(fd, e.buf, e.len) != (ssize_t)e.len || fsync(fd) < 0 ||
+	    rename(tmpfile, channel_curl->tls_sessions) < 0) {
+		DEBUG("Cannot save TLS sessions in %s: %s", channel_curl->tls_sessions,
+		      strerror(errno));
+		unlink(tmpfile);
+		free(e.buf);
+	} else {
+		free(channel_curl->tls_saved);
+		channel_curl->tls_saved = e.buf;
+		channel_curl->tls_saved_len = e.len;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	free(tmpfile);
+}
+
+typedef struct {
+	channel_curl_t *channel_curl;
+	unsigned int count;
+} tls_import_t;
+
+static bool tls_session_import(const tls_session_hdr_t *hdr, const char *key,
+			       const unsigned char *shmac,
+			       const unsigned char *sdata, void *arg)
+{
+	tls_import_t *imp = arg;
+
+	if (hdr->valid_until > 0 && hdr->valid_until <= time(NULL))
+		return true;
+	if (curl_easy_ssls_import(imp->channel_curl->handle, key, shmac, hdr->shmac_len,
+				  sdata, hdr->sdata_len) == CURLE_OK)
+		imp->count++;
+
+	return true;
+}
+
+static void load_tls_sessions(channel_curl_t *channel_curl)
+{
+	tls_import_t imp = { .channel_curl = channel_curl };
+	struct stat st;
+	uint32_t magic;
+	char *buf;
+	int fd;
+
+	fd = open(channel_curl->tls_sessions, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(magic) ||
+	    st.st_size > TLS_SESSIONS_MAX_SIZE) {
+		close(fd);
+		return;
+	}
+	if (st.st_mode & (S_IRWXG | S_IRWXO))
+		WARN("%s can be read by other users", channel_curl->tls_sessions);
+
+	buf = malloc(st.st_size);
+	if (!buf || read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	memcpy(&magic, buf, sizeof(magic));
+	if (magic != TLS_SESSIONS_MAGIC ||
+	    !tls_sessions_walk(buf, st.st_size, tls_session_import, &imp)) {
+		WARN("%s is corrupted, TLS sessions not resumed", channel_curl->tls_sessions);
+		free(buf);
+		return;
+	}
+	TRACE("%u TLS sessions loaded from %s", imp.count, channel_curl->tls_sessions);
+	channel_curl->tls_saved = buf;
+	channel_curl->tls_saved_len = st.st_size;
+}
+#else
+static void save_tls_sessions(channel_curl_t __attribute__ ((__unused__)) *channel_curl)
+{
+}
+#endif
+
+/*
+ * Sessions are kept in a cache shared by the requests of the channel,
+ * so that they can be loaded before the first one
+ */
+static channel_op_res_t setup_tls_sessions(channel_curl_t *channel_curl,
+					   channel_data_t *channel_cfg)
+{
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	channel_curl->tls_sessions = strdup(channel_cfg->tls_sessions);
+	channel_curl->share = curl_share_init();
+	if (!channel_curl->tls_sessions || !channel_curl->share ||
+	    curl_share_setopt(channel_curl->share, CURLSHOPT_SHARE,
+			      CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK ||
+	    curl_easy_setopt(channel_curl->handle, CURLOPT_SHARE,
+			     channel_curl->share) != CURLE_OK) {
+		ERROR("Cannot set up the TLS session cache.");
+		return CHANNEL_EINIT;
+	}
+	channel_curl->tls_session_lifetime = channel_cfg->tls_session_lifetime;
+	load_tls_sessions(channel_curl);
+#else
+	(void)channel_curl;
+	WARN("TLS sessions in %s are not kept, libcurl >= 8.12 is required",
+	     channel_cfg->tls_sessions);
+#endif
+
+	return CHANNEL_OK;
+}
+
 channel_op_res_t channel_close(channel_t *this)
 {
 	channel_curl_t *channel_curl = this->priv;
 
+	if (channel_curl->handle != NULL)
+		save_tls_sessions(channel_curl);
+
 	if ((channel_curl->proxy != NULL) &&
 	    (channel_curl->proxy != USE_PROXY_ENV)) {
 		free(channel_curl->proxy);
 	}
 	if (channel_curl->redirect_url)
 		free(channel_curl->redirect_url);
-	if (channel_curl->handle == NULL) {
-		return CHANNEL_OK;
+	for (unsigned int i = 0; i < REPLY_CACHE_ENTRIES; i++)
+		free_reply_cache(&channel_curl->replies[i]);
+	output_data_free(&channel_curl->reply);
+	free(channel_curl->tls_sessions);
+	channel_curl->tls_sessions = NULL;
+	free(channel_curl->tls_saved);
+	channel_curl->tls_saved = NULL;
+	channel_curl->tls_saved_len = 0;
+#ifdef CONFIG_JSON
+	if (channel_curl->tokener) {
+		json_tokener_free(channel_curl->tokener);
+		channel_curl->tokener = NULL;
+	}
+#endif
+	if (channel_curl->handle != NULL) {
+		curl_easy_cleanup(channel_curl->handle);
+		channel_curl->handle = NULL;
+	}
+	if (channel_curl->share) {
+		curl_share_cleanup(channel_curl->share);
+		channel_curl->share = NULL;
 	}
-	curl_easy_cleanup(channel_curl->handle);
-	channel_curl->handle = NULL;
 
 	return CHANNEL_OK;
 }
@@ -161,9 +852,390 @@ channel_op_res_t channel_open(channel_t *this, void *cfg)
 		return CHANNEL_EINIT;
 	}
 
+	if ((channel_cfg != NULL) && (channel_cfg->tls_sessions != NULL))
+		return setup_tls_sessions(channel_curl, channel_cfg);
+
 	return CHANNEL_OK;
 }
 
+/*
+ * The digest of the downloaded data is saved from time to time
+ * next to the cache file, so that a resumed download does not
+ * need to hash again what is already in the cache file.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t len;			/* size of the digest state */
+	unsigned long long offset;	/* bytes in the digest */
+	char url[512];
+	unsigned char state[RESUME_STATE_MAX_SIZE];
+} resume_state_t;
+
+static char *resume_state_file(const char *fname)
+{
+	char *statefile;
+
+	if (ENOMEM_ASPRINTF == asprintf(&statefile, "%s%s", fname, RESUME_STATE_SUFFIX))
+		return NULL;
+	return statefile;
+}
+
+static void save_resume_state(write_callback_t *data)
+{
+	channel_data_t *channel_data = data->channel_data;
+	resume_state_t *rs;
+	char *statefile, *tmpfile = NULL;
+	size_t len = sizeof(rs->state);
+	int fd = -1;
+
+	rs = calloc(1, sizeof(*rs));
+	if (!rs)
+		return;
+	if (swupdate_HASH_save(channel_data->dgst, rs->state, &len) < 0) {
+		free(rs);
+		return;
+	}
+	rs->magic = RESUME_STATE_MAGIC;
+	rs->len = len;
+	rs->offset = data->hashed;
+	strlcpy(rs->url, channel_data->url ? channel_data->url : "", sizeof(rs->url));
+
+	statefile = resume_state_file(channel_data->cached_file);
+	if (!statefile ||
+	    ENOMEM_ASPRINTF == asprintf(&tmpfile, "%s.tmp", statefile)) {
+		tmpfile = NULL;
+		goto out;
+	}
+	fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0 || write(fd, rs, sizeof(*rs)) != sizeof(*rs) || fsync(fd) < 0 ||
+	    rename(tmpfile, statefile) < 0) {
+		DEBUG("Cannot save digest state in %s: %s", statefile, strerror(errno));
+		unlink(tmpfile);
+	}
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(tmpfile);
+	free(statefile);
+	free(rs);
+}
+
+/*
+ * Continue the digest from the saved state if it belongs to
+ * the same URL and the cache file contains all data hashed so far.
+ * It returns the number of bytes of the cache file that are
+ * already in the digest.
+ */
+static unsigned long long restore_resume_state(const char *fname, off_t size,
+						write_callback_t *data)
+{
+	channel_data_t *channel_data = data->channel_data;
+	unsigned long long offset = 0;
+	resume_state_t *rs;
+	char *statefile;
+	int fd;
+
+	statefile = resume_state_file(fname);
+	if (!statefile)
+		return 0;
+	rs = calloc(1, sizeof(*rs));
+	fd = open(statefile, O_RDONLY);
+	if (!rs || fd < 0)
+		goto out;
+
+	if (read(fd, rs, sizeof(*rs)) != sizeof(*rs) ||
+	    rs->magic != RESUME_STATE_MAGIC || rs->len > sizeof(rs->state) ||
+	    rs->offset > (unsigned long long)size ||
+	    strncmp(rs->url, channel_data->url ? channel_data->url : "", sizeof(rs->url))) {
+		DEBUG("Digest state in %s does not match, ignore it", statefile);
+		goto out;
+	}
+	if (swupdate_HASH_restore(channel_data->dgst, rs->state, rs->len) < 0) {
+		DEBUG("Digest state in %s cannot be restored", statefile);
+		goto out;
+	}
+	offset = rs->offset;
+	TRACE("Digest restored from %s, %llu bytes are not hashed again",
+	      statefile, offset);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	/* state is used once as the cache file */
+	unlink(statefile);
+	free(statefile);
+	free(rs);
+
+	return offset;
+}
+
+static void *readahead_writer(void *p)
+{
+	readahead_t *ra = (readahead_t *)p;
+	struct timespec now;
+	size_t n;
+
+	pthread_mutex_lock(&ra->lock);
+	for (;;) {
+		while (!ra->fill && !ra->done && !ra->error)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->error || !ra->fill)
+			break;
+		n = min(ra->fill, ra->size - ra->head);
+		pthread_mutex_unlock(&ra->lock);
+
+		/* the region is not touched by the producer until fill is reduced */
+		if (ipc_send_data(ra->fd, ra->buf + ra->head, (int)n) < 0) {
+			pthread_mutex_lock(&ra->lock);
+			ERROR("Writing into SWUpdate IPC stream failed.");
+			ra->error = true;
+			break;
+		}
+
+		pthread_mutex_lock(&ra->lock);
+		ra->head = (ra->head + n) % ra->size;
+		ra->fill -= n;
+		ra->bytes += n;
+		if (ra->paused && ra->fill <= ra->low) {
+			ra->paused = false;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ra->stalled_sec += elapsed_sec(&ra->paused_at, &now);
+		}
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+static readahead_t *readahead_start(int fd, channel_data_t *channel_data)
+{
+	readahead_t *ra;
+	unsigned int high = channel_data->readahead_high ? channel_data->readahead_high :
+				READAHEAD_DEFAULT_HIGH;
+	unsigned int low = channel_data->readahead_low ? channel_data->readahead_low :
+				READAHEAD_DEFAULT_LOW;
+
+	if (high > 100)
+		high = 100;
+	if (low >= high)
+		low = high / 2;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return NULL;
+	ra->buf = malloc(channel_data->readahead);
+	if (!ra->buf) {
+		free(ra);
+		return NULL;
+	}
+	ra->size = channel_data->readahead;
+	ra->high = ra->size / 100 * high;
+	ra->low = ra->size / 100 * low;
+	if (!ra->high)
+		ra->high = ra->size;
+	ra->fd = fd;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	if (pthread_create(&ra->thread, NULL, readahead_writer, ra)) {
+		pthread_mutex_destroy(&ra->lock);
+		pthread_cond_destroy(&ra->cond);
+		free(ra->buf);
+		free(ra);
+		return NULL;
+	}
+
+	return ra;
+}
+
+static int readahead_write(readahead_t *ra, const char *data, size_t len)
+{
+	size_t tail, n;
+	int ret = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	while (len) {
+		if (!ra->paused && ra->fill >= ra->high) {
+			ra->paused = true;
+			ra->stalls++;
+			clock_gettime(CLOCK_MONOTONIC, &ra->paused_at);
+		}
+		while (ra->paused && !ra->error)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->error) {
+			ret = -EIO;
+			break;
+		}
+		tail = (ra->head + ra->fill) % ra->size;
+		n = min(ra->size - ra->fill, ra->size - tail);
+		n = min(len, n);
+		memcpy(ra->buf + tail, data, n);
+		ra->fill += n;
+		if (ra->fill > ra->peak)
+			ra->peak = ra->fill;
+		data += n;
+		len -= n;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return ret;
+}
+
+/*
+ * Wait until the installer got all data (drain) or just stop
+ * the writer. It returns an error if not all data was forwarded.
+ */
+static int readahead_stop(readahead_t **pra, bool drain)
+{
+	readahead_t *ra = *pra;
+	int ret;
+
+	if (!ra)
+		return 0;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->done = true;
+	if (!drain)
+		ra->error = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, NULL);
+
+	ret = (ra->error || ra->fill) ? -EIO : 0;
+	INFO("Read-ahead: %llu bytes forwarded, peak %zu of %zu kB, "
+	     "download paused %u times for %.1f s",
+	     ra->bytes, ra->peak / 1024, ra->size / 1024,
+	     ra->stalls, ra->stalled_sec);
+
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra->buf);
+	free(ra);
+	*pra = NULL;
+
+	return ret;
+}
+
+/*
+ * Peer cache: a verified artifact is kept in peer_cache, named
+ * by its SHA1, and served to other devices by the webserver under
+ * /peer/<sha1>. A device looks for the artifact on the configured
+ * peers first. The data is verified as if it came from the server.
+ */
+static char *channel_find_peer(channel_data_t *channel_data)
+{
+	char *peers, *peer, *saveptr = NULL, *url = NULL;
+	CURL *handle;
+	CURLcode curlrc;
+	long http_code;
+
+	peers = strdup(channel_data->peers);
+	if (!peers)
+		return NULL;
+
+	for (peer = strtok_r(peers, ", ", &saveptr); peer;
+	     peer = strtok_r(NULL, ", ", &saveptr)) {
+		size_t len = strlen(peer);
+
+		while (len && peer[len - 1] == '/')
+			peer[--len] = '\0';
+		if (ENOMEM_ASPRINTF == asprintf(&url, "%s/peer/%s", peer,
+						channel_data->artifact_id)) {
+			url = NULL;
+			break;
+		}
+
+		handle = curl_easy_init();
+		if (!handle) {
+			free(url);
+			url = NULL;
+			break;
+		}
+		http_code = 0;
+		curlrc = CURLE_FAILED_INIT;
+		if ((curl_easy_setopt(handle, CURLOPT_URL, url) == CURLE_OK) &&
+		    (curl_easy_setopt(handle, CURLOPT_NOBODY, 1L) == CURLE_OK) &&
+		    (curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, PEER_TIMEOUT) == CURLE_OK) &&
+		    (curl_easy_setopt(handle, CURLOPT_TIMEOUT, PEER_TIMEOUT) == CURLE_OK)) {
+			curlrc = curl_easy_perform(handle);
+			curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+		}
+		curl_easy_cleanup(handle);
+		if (curlrc == CURLE_OK && http_code == 200)
+			break;
+		DEBUG("Artifact not available on peer %s", peer);
+		free(url);
+		url = NULL;
+	}
+	free(peers);
+
+	return url;
+}
+
+/*
+ * Only the last artifact is kept, older ones are dropped
+ * before a new one is stored.
+ */
+static int channel_peer_open(channel_data_t *channel_data, char **partfile)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int fd;
+
+	dir = opendir(channel_data->peer_cache);
+	if (!dir) {
+		WARN("Peer cache %s cannot be opened", channel_data->peer_cache);
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type == DT_REG)
+			unlinkat(dirfd(dir), entry->d_name, 0);
+	}
+	closedir(dir);
+
+	if (ENOMEM_ASPRINTF == asprintf(partfile, "%s/%s.part", channel_data->peer_cache,
+					channel_data->artifact_id)) {
+		*partfile = NULL;
+		return -1;
+	}
+	fd = open(*partfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		WARN("Artifact cannot be stored in %s: %s", *partfile, strerror(errno));
+		free(*partfile);
+		*partfile = NULL;
+	}
+
+	return fd;
+}
+
+static void channel_peer_close(write_callback_t *data, char *partfile, bool verified)
+{
+	channel_data_t *channel_data = data->channel_data;
+	char *artifact = NULL;
+
+	if (data->peerfd < 0)
+		return;
+
+	if (fsync(data->peerfd) < 0)
+		verified = false;
+	close(data->peerfd);
+	data->peerfd = -1;
+
+	if (verified &&
+	    ENOMEM_ASPRINTF != asprintf(&artifact, "%s/%s", channel_data->peer_cache,
+					channel_data->artifact_id) &&
+	    !rename(partfile, artifact)) {
+		TRACE("Artifact stored in %s for peers", artifact);
+	} else {
+		unlink(partfile);
+	}
+	if (artifact)
+		free(artifact);
+}
+
 static channel_op_res_t result_channel_callback_ipc;
 size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 				   write_callback_t *data)
@@ -176,19 +1248,35 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 	result_channel_callback_ipc = CHANNEL_OK;
 
 	if (data->channel_data->usessl) {
-		if (swupdate_HASH_update(data->channel_data->dgst,
-					 streamdata,
-					 size * nmemb) < 0) {
+		size_t len = size * nmemb;
+		size_t skip = data->prehashed < len ? data->prehashed : len;
+
+		data->prehashed -= skip;
+		if (len > skip &&
+		    swupdate_HASH_update(data->channel_data->dgst,
+					 (unsigned char *)streamdata + skip,
+					 len - skip) < 0) {
 			ERROR("Updating checksum of chunk failed.");
 			result_channel_callback_ipc = CHANNEL_EIO;
 			return 0;
 		}
+		data->hashed += len - skip;
+		if (data->channel_data->cached_file &&
+		    data->hashed - data->checkpoint >= RESUME_STATE_INTERVAL) {
+			save_resume_state(data);
+			data->checkpoint = data->hashed;
+		}
 	}
 
 	if (!data->channel_data->http_response_code)
 		channel_map_http_code(data->this, &data->channel_data->http_response_code);
 
-	if (!data->channel_data->noipc &&
+	if (data->ra) {
+		if (readahead_write(data->ra, streamdata, size * nmemb) < 0) {
+			result_channel_callback_ipc = CHANNEL_EIO;
+			return 0;
+		}
+	} else if (!data->channel_data->noipc &&
 		ipc_send_data(data->output, streamdata, (int)(size * nmemb)) <
 	    0) {
 		ERROR("Writing into SWUpdate IPC stream failed.");
@@ -196,6 +1284,14 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 		return 0;
 	}
 
+	if (data->peerfd >= 0 &&
+	    write(data->peerfd, streamdata, size * nmemb) != (ssize_t)(size * nmemb)) {
+		WARN("Artifact cannot be stored for peers: %s", strerror(errno));
+		close(data->peerfd);
+		data->peerfd = -1;
+	}
+	data->delivered += size * nmemb;
+
 	if (data->channel_data->dwlwrdata) {
 		return data->channel_data->dwlwrdata(streamdata, size, nmemb, data->channel_data);
 	}
@@ -215,6 +1311,7 @@ static unsigned long long int resume_cache_file(const char *fname,
 	int fdsw;
 	char *buf;
 	ssize_t cnt;
+	struct stat st;
 	unsigned long long processed = 0;
 
 	if (!fname || !strlen(fname))
@@ -222,6 +1319,10 @@ static unsigned long long int resume_cache_file(const char *fname,
 	fdsw = open(fname, O_RDONLY);
 	if (fdsw < 0)
 		return 0; /* ignore, load from network */
+	if (data->channel_data->usessl && !fstat(fdsw, &st)) {
+		data->prehashed = restore_resume_state(fname, st.st_size, data);
+		data->hashed = data->checkpoint = data->prehashed;
+	}
 	buf = calloc(1, BUFF_SIZE);
 	if (!buf) {
 		ERROR("Channel get operation failed with OOM");
@@ -248,6 +1349,71 @@ static unsigned long long int resume_cache_file(const char *fname,
 	return processed;
 }
 
+static size_t channel_callback_download(void *streamdata, size_t size, size_t nmemb,
+					write_callback_t *data)
+{
+	channel_curl_t *channel_curl = data->this->priv;
+	long code = 0;
+
+	/*
+	 * A resumed request must go on exactly where the installer
+	 * stopped, a server sending the whole file again would
+	 * corrupt the stream
+	 */
+	if (data->resumed && !data->checked) {
+		data->checked = true;
+		if (curl_easy_getinfo(channel_curl->handle, CURLINFO_RESPONSE_CODE,
+				      &code) != CURLE_OK || code != 206) {
+			ERROR("Server does not resume the download at %llu (HTTP %ld)",
+			      data->resumed, code);
+			result_channel_callback_ipc = CHANNEL_EIO;
+			return 0;
+		}
+	}
+
+	channel_rate_throttle(channel_curl->handle, size * nmemb);
+
+	return channel_callback_ipc(streamdata, size, nmemb, data);
+}
+
+/*
+ * Make room for needed bytes. The buffer is sized at once to the
+ * announced length of the reply, if known, and doubled otherwise,
+ * so that a large reply is not copied at each chunk.
+ */
+static bool output_data_grow(output_data_t *mem, size_t needed, curl_off_t hint)
+{
+	size_t alloc = mem->alloc ? mem->alloc : REPLY_MIN_ALLOC;
+	char *memory;
+
+	if (hint > 0 && (size_t)hint + 1 > alloc)
+		alloc = (size_t)hint + 1;
+	while (alloc < needed)
+		alloc *= 2;
+
+	if (alloc > mem->reserved && !membudget_reserve(alloc - mem->reserved)) {
+		/* not more than needed if the budget is tight */
+		alloc = needed;
+		if (alloc > mem->reserved && !membudget_reserve(alloc - mem->reserved)) {
+			ERROR("Channel reply exceeds the memory budget (%zu bytes)",
+			      membudget_limit());
+			return false;
+		}
+	}
+	if (alloc > mem->reserved)
+		mem->reserved = alloc;
+
+	memory = realloc(mem->memory, alloc);
+	if (!memory) {
+		ERROR("Channel get operation failed with OOM");
+		return false;
+	}
+	mem->memory = memory;
+	mem->alloc = alloc;
+
+	return true;
+}
+
 size_t channel_callback_membuffer(void *streamdata, size_t size, size_t nmemb,
 				  write_callback_t *data)
 {
@@ -261,10 +1427,19 @@ size_t channel_callback_membuffer(void *streamdata, size_t size, size_t nmemb,
 	size_t realsize = size * nmemb;
 	output_data_t *mem = data->outdata;
 
-	mem->memory = realloc(mem->memory, mem->size + realsize + 1);
-	if (mem->memory == NULL) {
-		ERROR("Channel get operation failed with OOM");
-		return 0;
+	if (mem->size + realsize + 1 > mem->alloc) {
+		curl_off_t length = -1;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+		if (data->this && data->this->priv) {
+			channel_curl_t *channel_curl = data->this->priv;
+
+			curl_easy_getinfo(channel_curl->handle,
+					  CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+		}
+#endif
+		if (!output_data_grow(mem, mem->size + realsize + 1, length))
+			return 0;
 	}
 	memcpy(&(mem->memory[mem->size]), streamdata, realsize);
 	mem->size += realsize;
@@ -272,6 +1447,25 @@ size_t channel_callback_membuffer(void *streamdata, size_t size, size_t nmemb,
 	return realsize;
 }
 
+static void output_data_free(output_data_t *outdata)
+{
+	free(outdata->memory);
+	outdata->memory = NULL;
+	outdata->size = 0;
+	outdata->alloc = 0;
+	membudget_release(outdata->reserved);
+	outdata->reserved = 0;
+}
+
+/* The buffer is kept for the next reply, unless it grew large */
+static void output_data_done(output_data_t *outdata)
+{
+	if (outdata->alloc > REPLY_KEEP_MAX)
+		output_data_free(outdata);
+	else
+		outdata->size = 0;
+}
+
 static void channel_log_effective_url(channel_t *this)
 {
 	channel_curl_t *channel_curl = this->priv;
@@ -296,6 +1490,35 @@ char *channel_get_redirect_url(channel_t *this)
 	return channel_curl->redirect_url;
 }
 
+#define RETRY_AFTER_MAX	(24 * 3600)
+
+static __thread unsigned int retry_after;
+
+unsigned int channel_retry_after(void)
+{
+	unsigned int delay = retry_after;
+
+	retry_after = 0;
+	return delay;
+}
+
+static void store_retry_after(channel_curl_t *channel_curl)
+{
+#if LIBCURL_VERSION_NUM >= 0x074200
+	curl_off_t delay;
+
+	if (curl_easy_getinfo(channel_curl->handle, CURLINFO_RETRY_AFTER,
+			      &delay) != CURLE_OK || delay <= 0)
+		return;
+	if (delay > RETRY_AFTER_MAX)
+		delay = RETRY_AFTER_MAX;
+	retry_after = (unsigned int)delay;
+	DEBUG("Server asked to retry after %u seconds", retry_after);
+#else
+	(void)channel_curl;
+#endif
+}
+
 channel_op_res_t channel_map_http_code(channel_t *this, long *http_response_code)
 {
 	char *url = NULL;
@@ -321,11 +1544,13 @@ channel_op_res_t channel_map_http_code(channel_t *this, long *http_response_code
 		}
 		DEBUG("No HTTP response code has been received yet!");
 		return CHANNEL_EBADMSG;
+	case 503: /* Service Unavailable */
+		store_retry_after(channel_curl);
+		return CHANNEL_EACCES;
 	case 401: /* Unauthorized. The request requires user authentication. */
 	case 403: /* Forbidden. */
 	case 405: /* Method not Allowed. */
 	case 407: /* Proxy Authentication Required */
-	case 503: /* Service Unavailable */
 		return CHANNEL_EACCES;
 	case 400: /* Bad Request, e.g., invalid parameters */
 	case 406: /* Not acceptable. Accept header is not response compliant */
@@ -335,8 +1560,10 @@ channel_op_res_t channel_map_http_code(channel_t *this, long *http_response_code
 	case 404: /* Wrong URL */
 		return CHANNEL_ENOTFOUND;
 	case 429: /* Bad Request, i.e., too many requests. Try again later. */
+		store_retry_after(channel_curl);
 		return CHANNEL_EAGAIN;
 	case 200:
+	case 204: /* No Content, e.g. long-poll expired */
 	case 206:
 	case 226:
 		return CHANNEL_OK;
@@ -562,6 +1789,63 @@ static channel_op_res_t channel_set_content_type(channel_t *this,
 	return result;
 }
 
+channel_http_version_t channel_http_version(const char *version)
+{
+	if (!version || !strlen(version))
+		return CHANNEL_HTTP_DEFAULT;
+	if (!strcmp(version, "1.1"))
+		return CHANNEL_HTTP_1_1;
+	if (!strcmp(version, "2"))
+		return CHANNEL_HTTP_2;
+	if (!strcmp(version, "3"))
+		return CHANNEL_HTTP_3;
+
+	WARN("Unknown HTTP version %s, use default", version);
+	return CHANNEL_HTTP_DEFAULT;
+}
+
+/*
+ * HTTP/2 is negotiated with ALPN and falls back to HTTP/1.1 if the
+ * server does not support it. HTTP/3 is tried first and falls back
+ * as well, but it needs a libcurl built with QUIC support.
+ */
+static channel_op_res_t channel_set_http_version(CURL *handle,
+						 channel_http_version_t version)
+{
+	long curl_version;
+
+	switch (version) {
+	case CHANNEL_HTTP_1_1:
+		curl_version = CURL_HTTP_VERSION_1_1;
+		break;
+	case CHANNEL_HTTP_2:
+#if LIBCURL_VERSION_NUM >= 0x072f00
+		curl_version = CURL_HTTP_VERSION_2TLS;
+#else
+		curl_version = CURL_HTTP_VERSION_2_0;
+#endif
+		break;
+	case CHANNEL_HTTP_3:
+#if LIBCURL_VERSION_NUM >= 0x074200
+		if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3) {
+			curl_version = CURL_HTTP_VERSION_3;
+			break;
+		}
+#endif
+		WARN("libcurl does not support HTTP/3, use HTTP/2");
+		return channel_set_http_version(handle, CHANNEL_HTTP_2);
+	default:
+		return CHANNEL_OK;
+	}
+
+	if (curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, curl_version) != CURLE_OK) {
+		ERROR("Set HTTP version failed.");
+		return CHANNEL_EINIT;
+	}
+
+	return CHANNEL_OK;
+}
+
 channel_op_res_t channel_set_options(channel_t *this, channel_data_t *channel_data)
 {
 	if (channel_data->low_speed_timeout == 0) {
@@ -607,6 +1891,28 @@ channel_op_res_t channel_set_options(channel_t *this, channel_data_t *channel_da
 		goto cleanup;
 	}
 
+	if (curl_share &&
+		(curl_easy_setopt(channel_curl->handle, CURLOPT_SHARE,
+		 curl_share) != CURLE_OK)) {
+		result = CHANNEL_EINIT;
+		goto cleanup;
+	}
+
+	if (channel_set_http_version(channel_curl->handle,
+				     channel_data->http_version) != CHANNEL_OK) {
+		result = CHANNEL_EINIT;
+		goto cleanup;
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x074100
+	if (channel_data->idle_timeout > 0 &&
+		(curl_easy_setopt(channel_curl->handle, CURLOPT_MAXAGE_CONN,
+		 (long)channel_data->idle_timeout) != CURLE_OK)) {
+		result = CHANNEL_EINIT;
+		goto cleanup;
+	}
+#endif
+
 	/* Check if sslkey or sslcert strings contains a pkcs11 URI
 	 * and set curl engine and types accordingly
 	 */
@@ -919,13 +2225,13 @@ static void channel_log_reply(channel_op_res_t result, channel_data_t *channel_d
 
 static channel_op_res_t setup_reply_buffer(CURL *handle, write_callback_t *wrdata)
 {
-	wrdata->outdata->memory = NULL;
 	wrdata->outdata->size = 0;
 
-	if ((wrdata->outdata->memory = malloc(1)) == NULL) {
+	if (!wrdata->outdata->memory && !output_data_grow(wrdata->outdata, 1, -1)) {
 		ERROR("Channel buffer reservation failed with OOM.");
 		return CHANNEL_ENOMEM;
 	}
+	wrdata->outdata->memory[0] = '\0';
 
 	if ((curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
 			      channel_callback_membuffer) != CURLE_OK) ||
@@ -937,7 +2243,8 @@ static channel_op_res_t setup_reply_buffer(CURL *handle, write_callback_t *wrdat
 	return CHANNEL_OK;
 }
 
-static channel_op_res_t parse_reply(channel_data_t *channel_data, output_data_t *chunk)
+static channel_op_res_t parse_reply(channel_curl_t __attribute__ ((__unused__)) *channel_curl,
+				    channel_data_t *channel_data, output_data_t *chunk)
 {
 	if (!chunk->memory) {
 		ERROR("Channel reply buffer was not filled.");
@@ -948,14 +2255,23 @@ static channel_op_res_t parse_reply(channel_data_t *channel_data, output_data_t
 	if (channel_data->format == CHANNEL_PARSE_JSON) {
 		assert(channel_data->json_reply == NULL);
 		enum json_tokener_error json_res;
-		struct json_tokener *json_tokenizer = json_tokener_new();
-		do {
-			channel_data->json_reply = json_tokener_parse_ex(
-			    json_tokenizer, chunk->memory, (int)chunk->size);
-		} while ((json_res = json_tokener_get_error(json_tokenizer)) ==
-			 json_tokener_continue);
-		/* json_tokenizer is not used for json_tokener_error_desc, hence can be freed here. */
-		json_tokener_free(json_tokenizer);
+
+		/* the tokener and its buffers are kept for the next replies */
+		if (!channel_curl->tokener) {
+			channel_curl->tokener = json_tokener_new();
+			if (!channel_curl->tokener) {
+				ERROR("Channel JSON parser allocation failed with OOM.");
+				return CHANNEL_ENOMEM;
+			}
+		} else {
+			json_tokener_reset(channel_curl->tokener);
+		}
+		channel_data->json_reply = json_tokener_parse_ex(
+		    channel_curl->tokener, chunk->memory, (int)chunk->size);
+		json_res = json_tokener_get_error(channel_curl->tokener);
+		/* the whole reply was passed, so it is not complete */
+		if (json_res == json_tokener_continue)
+			json_res = json_tokener_error_parse_eof;
 		if (json_res != json_tokener_success) {
 			ERROR("Error while parsing channel's returned JSON data: %s",
 			      json_tokener_error_desc(json_res));
@@ -986,8 +2302,8 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 
 	channel_op_res_t result = CHANNEL_OK;
 	channel_data_t *channel_data = (channel_data_t *)data;
-	output_data_t outdata = {};
-	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = &outdata };
+	output_data_t *outdata = &channel_curl->reply;
+	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = outdata };
 
 	if ((result = channel_set_content_type(this, channel_data)) !=
 	    CHANNEL_OK) {
@@ -1024,7 +2340,9 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 		TRACE("POSTed/PATCHed to %s: %s", channel_data->url, channel_data->request_body);
 	}
 
+	SWU_PROBE2(curl_request_start, channel_data->url, method);
 	CURLcode curlrc = curl_easy_perform(channel_curl->handle);
+	SWU_PROBE2(curl_request_done, channel_data->url, curlrc);
 	if (curlrc != CURLE_OK) {
 		ERROR("Channel POST/PATCH operation failed (%d): '%s'", curlrc,
 		      curl_easy_strerror(curlrc));
@@ -1033,20 +2351,21 @@ static channel_op_res_t channel_post_method(channel_t *this, void *data, int met
 	}
 
 	channel_log_effective_url(this);
+	save_tls_sessions(channel_curl);
 
 	result = channel_map_http_code(this, &channel_data->http_response_code);
 
 	if (channel_data->nocheckanswer)
 		goto cleanup_header;
 
-	channel_log_reply(result, channel_data, &outdata);
+	channel_log_reply(result, channel_data, outdata);
 
 	if (result == CHANNEL_OK) {
-	    result = parse_reply(channel_data, &outdata);
+	    result = parse_reply(channel_curl, channel_data, outdata);
 	}
 
 cleanup_header:
-	outdata.memory != NULL ? free(outdata.memory) : (void)0;
+	output_data_done(outdata);
 	curl_easy_reset(channel_curl->handle);
 	curl_slist_free_all(channel_curl->header);
 	channel_curl->header = NULL;
@@ -1063,8 +2382,8 @@ static channel_op_res_t channel_put_method(channel_t *this, void *data)
 	channel_op_res_t result = CHANNEL_OK;
 	channel_data_t *channel_data = (channel_data_t *)data;
 	channel_data->offs = 0;
-	output_data_t outdata = {};
-	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = &outdata };
+	output_data_t *outdata = &channel_curl->reply;
+	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = outdata };
 
 	if ((result = channel_set_content_type(this, channel_data)) !=
 	    CHANNEL_OK) {
@@ -1098,7 +2417,9 @@ static channel_op_res_t channel_put_method(channel_t *this, void *data)
 		goto cleanup_header;
 	}
 
+	SWU_PROBE2(curl_request_start, channel_data->url, CHANNEL_PUT);
 	CURLcode curlrc = curl_easy_perform(channel_curl->handle);
+	SWU_PROBE2(curl_request_done, channel_data->url, curlrc);
 	if (curlrc != CURLE_OK) {
 		ERROR("Channel put operation failed (%d): '%s'", curlrc,
 		      curl_easy_strerror(curlrc));
@@ -1107,6 +2428,7 @@ static channel_op_res_t channel_put_method(channel_t *this, void *data)
 	}
 
 	channel_log_effective_url(this);
+	save_tls_sessions(channel_curl);
 
 	result = channel_map_http_code(this, &channel_data->http_response_code);
 
@@ -1116,7 +2438,7 @@ static channel_op_res_t channel_put_method(channel_t *this, void *data)
 	channel_log_reply(result, channel_data, NULL);
 
 cleanup_header:
-	outdata.memory != NULL ? free(outdata.memory) : (void)0;
+	output_data_done(outdata);
 	curl_easy_reset(channel_curl->handle);
 	curl_slist_free_all(channel_curl->header);
 	channel_curl->header = NULL;
@@ -1143,16 +2465,259 @@ channel_op_res_t channel_put(channel_t *this, void *data)
 	}
 }
 
-channel_op_res_t channel_get_file(channel_t *this, void *data)
+static size_t channel_callback_segment(void *streamdata, size_t size, size_t nmemb,
+				       void *data)
+{
+	segment_t *seg = (segment_t *)data;
+	size_t len = size * nmemb;
+
+	/* More data than requested, server ignores the range */
+	if (seg->filled + len > seg->len)
+		return 0;
+	channel_rate_throttle(seg->handle, len);
+	memcpy(seg->buf + seg->filled, streamdata, len);
+	seg->filled += len;
+
+	return len;
+}
+
+static bool channel_download_segment(segmented_dwl_t *dwl, segment_t *seg,
+				     unsigned int idx)
+{
+	unsigned long long start = dwl->offset + (unsigned long long)idx * dwl->segsize;
+	channel_data_t segdata;
+	char range[64];
+	unsigned int try;
+
+	for (try = 0; try <= dwl->channel_data->retries; try++) {
+		channel_t *channel;
+		channel_curl_t *channel_curl;
+		CURLcode curlrc = CURLE_FAILED_INIT;
+		long http_code = 0;
+
+		if (try > 0) {
+			DEBUG("Segment at %llu interrupted, resume after %zu bytes",
+			      start, seg->filled);
+			sleep(dwl->channel_data->retry_sleep);
+		}
+		pthread_mutex_lock(&dwl->lock);
+		if (dwl->abort) {
+			pthread_mutex_unlock(&dwl->lock);
+			return false;
+		}
+		pthread_mutex_unlock(&dwl->lock);
+
+		channel = channel_new();
+		if (!channel)
+			return false;
+		if (channel_open(channel, dwl->channel_data) != CHANNEL_OK) {
+			free(channel);
+			return false;
+		}
+		channel_curl = channel->priv;
+
+		/* The callbacks of the caller are not thread safe */
+		segdata = *dwl->channel_data;
+		segdata.headers = NULL;
+		segdata.received_headers = NULL;
+		segdata.range = range;
+		snprintf(range, sizeof(range), "%llu-%llu", start + seg->filled,
+			 start + seg->len - 1);
+
+		if (((channel_curl->header = curl_slist_append(channel_curl->header,
+				"Accept: application/octet-stream")) != NULL) &&
+		    (channel_set_options(channel, &segdata) == CHANNEL_OK) &&
+		    (curl_easy_setopt(channel_curl->handle, CURLOPT_WRITEFUNCTION,
+				      channel_callback_segment) == CURLE_OK) &&
+		    (curl_easy_setopt(channel_curl->handle, CURLOPT_WRITEDATA,
+				      seg) == CURLE_OK)) {
+			seg->handle = channel_curl->handle;
+			SWU_PROBE2(curl_request_start, segdata.url, CHANNEL_GET);
+			curlrc = curl_easy_perform(channel_curl->handle);
+			SWU_PROBE2(curl_request_done, segdata.url, curlrc);
+			curl_easy_getinfo(channel_curl->handle, CURLINFO_RESPONSE_CODE,
+					  &http_code);
+		}
+
+		curl_slist_free_all(channel_curl->header);
+		channel_curl->header = NULL;
+		channel_close(channel);
+		free(channel);
+
+		if (curlrc == CURLE_OK && http_code == 206 && seg->filled == seg->len)
+			return true;
+		if (http_code && http_code != 206) {
+			/* Retrying does not help */
+			pthread_mutex_lock(&dwl->lock);
+			dwl->norange = (http_code == 200);
+			pthread_mutex_unlock(&dwl->lock);
+			if (http_code == 200)
+				WARN("Server does not support ranges, no segmented download");
+			else
+				ERROR("Segment at %llu returns HTTP %ld", start, http_code);
+			return false;
+		}
+	}
+
+	ERROR("Segment at %llu cannot be downloaded", start);
+	return false;
+}
+
+static void *channel_segment_worker(void *data)
+{
+	segmented_dwl_t *dwl = (segmented_dwl_t *)data;
+
+	for (;;) {
+		unsigned int idx;
+		segment_t *seg;
+		bool ok;
+
+		pthread_mutex_lock(&dwl->lock);
+		while (!dwl->abort && dwl->next_assign < dwl->count &&
+		       dwl->next_assign - dwl->next_write >= dwl->window)
+			pthread_cond_wait(&dwl->cond, &dwl->lock);
+		if (dwl->abort || dwl->next_assign >= dwl->count) {
+			pthread_mutex_unlock(&dwl->lock);
+			break;
+		}
+		idx = dwl->next_assign++;
+		pthread_mutex_unlock(&dwl->lock);
+
+		seg = &dwl->seg[idx];
+		seg->buf = malloc(seg->len);
+		ok = seg->buf && channel_download_segment(dwl, seg, idx);
+
+		pthread_mutex_lock(&dwl->lock);
+		seg->state = ok ? SEGMENT_DONE : SEGMENT_FAILED;
+		if (!ok)
+			dwl->abort = true;
+		pthread_cond_broadcast(&dwl->cond);
+		pthread_mutex_unlock(&dwl->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Download the file from offset with several connections
+ * and forward it in order to the IPC callback.
+ * If the server does not support ranges and nothing was
+ * forwarded, fallback is set and the caller downloads the
+ * file with a single connection.
+ */
+static channel_op_res_t channel_get_file_segmented(write_callback_t *wrdata,
+						   unsigned long long total,
+						   unsigned long long offset,
+						   download_callback_data_t *download_data,
+						   bool *fallback)
+{
+	channel_data_t *channel_data = wrdata->channel_data;
+	channel_op_res_t result = CHANNEL_OK;
+	unsigned int nthreads = channel_data->segments;
+	segmented_dwl_t dwl;
+	pthread_t *threads;
+	unsigned int i, started = 0;
+
+	*fallback = false;
+	memset(&dwl, 0, sizeof(dwl));
+	dwl.channel_data = channel_data;
+	dwl.offset = offset;
+	dwl.segsize = channel_data->segment_size ? channel_data->segment_size :
+						  SEGMENT_DEFAULT_SIZE;
+	dwl.count = (total - offset + dwl.segsize - 1) / dwl.segsize;
+	dwl.window = 2 * nthreads;
+	if (nthreads > dwl.count)
+		nthreads = dwl.count;
+
+	dwl.seg = calloc(dwl.count, sizeof(*dwl.seg));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!dwl.seg || !threads) {
+		ERROR("OOM allocating segments");
+		free(dwl.seg);
+		free(threads);
+		return CHANNEL_ENOMEM;
+	}
+	for (i = 0; i < dwl.count; i++)
+		dwl.seg[i].len = min((unsigned long long)dwl.segsize,
+				     total - offset - (unsigned long long)i * dwl.segsize);
+	pthread_mutex_init(&dwl.lock, NULL);
+	pthread_cond_init(&dwl.cond, NULL);
+
+	INFO("Segmented download with %u connections, %u segments of %zu bytes",
+	     nthreads, dwl.count, dwl.segsize);
+
+	for (i = 0; i < nthreads; i++) {
+		if (start_worker_thread(&threads[i], channel_segment_worker, &dwl))
+			break;
+		started++;
+	}
+	if (!started) {
+		ERROR("Cannot start threads for segmented download");
+		result = CHANNEL_EINIT;
+	}
+
+	/*
+	 * Forward segments in order as soon as they are complete
+	 */
+	for (i = 0; started && i < dwl.count; i++) {
+		segment_t *seg = &dwl.seg[i];
+
+		pthread_mutex_lock(&dwl.lock);
+		while (seg->state == SEGMENT_PENDING && !dwl.abort)
+			pthread_cond_wait(&dwl.cond, &dwl.lock);
+		if (seg->state != SEGMENT_DONE) {
+			*fallback = (i == 0 && dwl.norange && !offset);
+			dwl.abort = true;
+			pthread_cond_broadcast(&dwl.cond);
+			pthread_mutex_unlock(&dwl.lock);
+			result = CHANNEL_EIO;
+			break;
+		}
+		pthread_mutex_unlock(&dwl.lock);
+
+		if (channel_callback_ipc(seg->buf, seg->len, 1, wrdata) != seg->len) {
+			result = CHANNEL_EIO;
+		}
+		free(seg->buf);
+		seg->buf = NULL;
+		channel_callback_xferinfo(download_data, total,
+					  offset + (unsigned long long)i * dwl.segsize + seg->len,
+					  0, 0);
+
+		pthread_mutex_lock(&dwl.lock);
+		dwl.next_write++;
+		if (result != CHANNEL_OK)
+			dwl.abort = true;
+		pthread_cond_broadcast(&dwl.cond);
+		pthread_mutex_unlock(&dwl.lock);
+		if (result != CHANNEL_OK)
+			break;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < dwl.count; i++)
+		free(dwl.seg[i].buf);
+	pthread_cond_destroy(&dwl.cond);
+	pthread_mutex_destroy(&dwl.lock);
+	free(dwl.seg);
+	free(threads);
+
+	return result;
+}
+
+static channel_op_res_t channel_get_file_from_url(channel_t *this, void *data)
 {
 	channel_curl_t *channel_curl = this->priv;
 	int file_handle = -1;
+	char *partfile = NULL;
 	struct swupdate_request req;
 	assert(data != NULL);
 	assert(channel_curl->handle != NULL);
 
 	channel_op_res_t result = CHANNEL_OK;
 	channel_data_t *channel_data = (channel_data_t *)data;
+	bool shaping = false;
 	channel_data->http_response_code = 0;
 
 	if (channel_data->usessl) {
@@ -1181,14 +2746,8 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 		goto cleanup_header;
 	}
 
-	if (channel_data->max_download_speed &&
-			curl_easy_setopt(channel_curl->handle,
-				CURLOPT_MAX_RECV_SPEED_LARGE,
-				channel_data->max_download_speed) != CURLE_OK) {
-		ERROR("Set channel download speed limit failed.");
-		result = CHANNEL_EINIT;
-		goto cleanup_header;
-	}
+	channel_rate_start(channel_data);
+	shaping = true;
 
 	download_callback_data_t download_data;
 	/*
@@ -1213,12 +2772,13 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 		goto cleanup_header;
 	}
 
-	write_callback_t wrdata = { .this = this };
+	write_callback_t wrdata = { .this = this, .peerfd = -1 };
 	wrdata.channel_data = channel_data;
 	if (!channel_data->noipc) {
 		swupdate_prepare_req(&req);
 		req.dry_run = channel_data->dry_run;
 		req.source = channel_data->source;
+		req.bundle = channel_data->bundle;
 		if (channel_data->info) {
 			strncpy(req.info, channel_data->info,
 				sizeof(req.info) - 1 );
@@ -1239,8 +2799,18 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	wrdata.output = file_handle;
 	result_channel_callback_ipc = CHANNEL_OK;
 
+	if (channel_data->peer_cache && channel_data->artifact_id &&
+	    channel_data->usessl && !channel_data->range)
+		wrdata.peerfd = channel_peer_open(channel_data, &partfile);
+
+	if (file_handle >= 0 && channel_data->readahead) {
+		wrdata.ra = readahead_start(file_handle, channel_data);
+		if (!wrdata.ra)
+			WARN("Cannot allocate read-ahead buffer, data is sent directly");
+	}
+
 	if ((curl_easy_setopt(channel_curl->handle, CURLOPT_WRITEFUNCTION,
-			      channel_callback_ipc) != CURLE_OK) ||
+			      channel_callback_download) != CURLE_OK) ||
 	    (curl_easy_setopt(channel_curl->handle, CURLOPT_WRITEDATA,
 			      &wrdata) != CURLE_OK)) {
 		ERROR("Cannot setup file writer callback function.");
@@ -1254,9 +2824,10 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	 * (signed) long long, use unsigned here, but it wastes some
 	 * bits on 64-Bit.
 	 */
-	unsigned long long int total_bytes_downloaded = 0;
-	unsigned char try_count = 0;
+	unsigned long long int total_bytes_downloaded = 0, attempt_start;
+	unsigned int try_count = 0;
 	CURLcode curlrc = CURLE_OK;
+	bool fallback;
 
 	if (channel_data->cached_file) {
 
@@ -1270,11 +2841,32 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 			 * Simulate that a partial download was already done,
 			 * and tune parameters if retries is not set
 			 */
-			channel_data->retries++;
+			if (channel_data->retries != UINT_MAX)
+				channel_data->retries++;
 			try_count++;
 		}
 	}
 
+	/*
+	 * With a known size, the remaining data can be fetched
+	 * with parallel range requests
+	 */
+	if (channel_data->segments > 1 && !channel_data->range &&
+	    download_data.total_download_size > 0 &&
+	    (unsigned long long)download_data.total_download_size > total_bytes_downloaded) {
+		result = channel_get_file_segmented(&wrdata,
+						    download_data.total_download_size,
+						    total_bytes_downloaded,
+						    &download_data, &fallback);
+		if (!fallback) {
+			if (result != CHANNEL_OK)
+				goto cleanup_file;
+			total_bytes_downloaded = download_data.total_download_size;
+			channel_data->http_response_code = 200;
+			goto download_done;
+		}
+	}
+
 	/*
 	 * If there is a cache file, read data from cache first
 	 * and load from URL the remaining data
@@ -1298,6 +2890,10 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 				goto cleanup_file;
 			}
 
+			/* what the installer got, not what was received */
+			total_bytes_downloaded = wrdata.delivered;
+			wrdata.resumed = total_bytes_downloaded;
+			wrdata.checked = false;
 			DEBUG("Channel connection interrupted, trying resume "
 			      "after %llu bytes.",
 			      total_bytes_downloaded);
@@ -1319,7 +2915,10 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 			TRACE("Channel awakened from sleep.");
 		}
 
+		attempt_start = wrdata.delivered;
+		SWU_PROBE2(curl_request_start, channel_data->url, CHANNEL_GET);
 		curlrc = curl_easy_perform(channel_curl->handle);
+		SWU_PROBE2(curl_request_done, channel_data->url, curlrc);
 		result = channel_map_curl_error(curlrc);
 		if (result == CHANNEL_ENONET) {
 			WARN("Lost connection. Retrying after %d seconds.",
@@ -1347,9 +2946,14 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 		}
 		total_bytes_downloaded += bytes_downloaded;
 
+		/* the retries are counted from the last attempt that went on */
+		if (result != CHANNEL_OK && wrdata.delivered > attempt_start)
+			try_count = 0;
+
 	} while (++try_count && (result != CHANNEL_OK));
 
 	channel_log_effective_url(this);
+	save_tls_sessions(channel_curl);
 
 	DEBUG("Channel downloaded %llu bytes ~ %llu MiB.",
 	      total_bytes_downloaded, total_bytes_downloaded / 1024 / 1024);
@@ -1358,6 +2962,9 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 
 	channel_log_reply(result, channel_data, NULL);
 
+download_done:
+	if (readahead_stop(&wrdata.ra, true) < 0)
+		result_channel_callback_ipc = CHANNEL_EIO;
 	if (result_channel_callback_ipc != CHANNEL_OK) {
 		result = CHANNEL_EIO;
 		goto cleanup_file;
@@ -1380,6 +2987,11 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	}
 
 cleanup_file:
+	readahead_stop(&wrdata.ra, false);
+	channel_peer_close(&wrdata, partfile,
+			   result == CHANNEL_OK && channel_data->artifact_id &&
+			   !strcmp(channel_data->sha1hash, channel_data->artifact_id));
+	free(partfile);
 	/* NOTE ipc_end() calls close() but does not return its error code,
 	 *      so use close() here directly to issue an error in case.
 	 *      Also, for a given file handle, calling ipc_end() would make
@@ -1389,10 +3001,24 @@ cleanup_file:
 		      strerror(errno));
 	}
 	if (channel_data->dgst) {
+		/* keep the digest for the next attempt */
+		if (channel_data->cached_file && wrdata.hashed) {
+			if (result != CHANNEL_OK) {
+				save_resume_state(&wrdata);
+			} else {
+				char *statefile = resume_state_file(channel_data->cached_file);
+
+				if (statefile)
+					unlink(statefile);
+				free(statefile);
+			}
+		}
 		swupdate_HASH_cleanup(channel_data->dgst);
 	}
 
 cleanup_header:
+	if (shaping)
+		channel_rate_stop();
 	curl_easy_reset(channel_curl->handle);
 	curl_slist_free_all(channel_curl->header);
 	channel_curl->header = NULL;
@@ -1400,6 +3026,47 @@ cleanup_header:
 	return result;
 }
 
+channel_op_res_t channel_get_file(channel_t *this, void *data)
+{
+	channel_data_t *channel_data = (channel_data_t *)data;
+	channel_op_res_t result;
+	char *peer_url, *url, *auth, *auth_token;
+	struct dict *headers_to_send;
+
+	if (!channel_data->peers || !channel_data->artifact_id || channel_data->range)
+		return channel_get_file_from_url(this, data);
+
+	peer_url = channel_find_peer(channel_data);
+	if (!peer_url)
+		return channel_get_file_from_url(this, data);
+
+	/* credentials for the server are not sent to a peer */
+	url = channel_data->url;
+	auth = channel_data->auth;
+	auth_token = channel_data->auth_token;
+	headers_to_send = channel_data->headers_to_send;
+	channel_data->url = peer_url;
+	channel_data->auth = NULL;
+	channel_data->auth_token = NULL;
+	channel_data->headers_to_send = NULL;
+
+	INFO("Downloading artifact from peer %s", peer_url);
+	result = channel_get_file_from_url(this, data);
+
+	channel_data->url = url;
+	channel_data->auth = auth;
+	channel_data->auth_token = auth_token;
+	channel_data->headers_to_send = headers_to_send;
+	free(peer_url);
+
+	if (result != CHANNEL_OK) {
+		WARN("Download from peer failed, getting it from %s", url);
+		result = channel_get_file_from_url(this, data);
+	}
+
+	return result;
+}
+
 channel_op_res_t channel_get(channel_t *this, void *data)
 {
 	channel_curl_t *channel_curl = this->priv;
@@ -1409,8 +3076,9 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 	channel_op_res_t result = CHANNEL_OK;
 	channel_data_t *channel_data = (channel_data_t *)data;
 	channel_data->http_response_code = 0;
-	output_data_t outdata = {};
-	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = &outdata };
+	output_data_t *outdata = &channel_curl->reply;
+	write_callback_t wrdata = { .this = this, .channel_data = channel_data, .outdata = outdata };
+	reply_cache_t *reply = NULL;
 
 	if ((result = channel_set_content_type(this, channel_data)) !=
 	    CHANNEL_OK) {
@@ -1418,6 +3086,16 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 		goto cleanup_header;
 	}
 
+	if (channel_data->conditional_get &&
+	    (reply = find_reply_cache(channel_curl, channel_data->url)) != NULL) {
+		char *header;
+
+		if (ENOMEM_ASPRINTF != asprintf(&header, "If-None-Match: %s", reply->etag)) {
+			channel_curl->header = curl_slist_append(channel_curl->header, header);
+			free(header);
+		}
+	}
+
 	if ((result = channel_set_options(this, channel_data)) != CHANNEL_OK) {
 		ERROR("Set channel option failed.");
 		goto cleanup_header;
@@ -1430,6 +3108,15 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 		goto cleanup_header;
 	}
 
+	/* libcurl decodes the body with any encoding it supports */
+	if (channel_data->compress_replies &&
+	    curl_easy_setopt(channel_curl->handle, CURLOPT_ACCEPT_ENCODING, "") !=
+	    CURLE_OK) {
+		ERROR("Set accepted encodings failed.");
+		result = CHANNEL_EINIT;
+		goto cleanup_header;
+	}
+
 	if ((result = setup_reply_buffer(channel_curl->handle, &wrdata)) != CHANNEL_OK) {
 		goto cleanup_header;
 	}
@@ -1437,7 +3124,9 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 	if (channel_data->debug) {
 		DEBUG("Trying to GET %s", channel_data->url);
 	}
+	SWU_PROBE2(curl_request_start, channel_data->url, CHANNEL_GET);
 	CURLcode curlrc = curl_easy_perform(channel_curl->handle);
+	SWU_PROBE2(curl_request_done, channel_data->url, curlrc);
 	if (curlrc != CURLE_OK) {
 		ERROR("Channel get operation failed (%d): '%s'", curlrc,
 		      curl_easy_strerror(curlrc));
@@ -1446,20 +3135,41 @@ channel_op_res_t channel_get(channel_t *this, void *data)
 	}
 
 	channel_log_effective_url(this);
-
-	result = channel_map_http_code(this, &channel_data->http_response_code);
+	save_tls_sessions(channel_curl);
+
+	curl_easy_getinfo(channel_curl->handle, CURLINFO_RESPONSE_CODE,
+			  &channel_data->http_response_code);
+	if (reply && channel_data->http_response_code == 304) {
+		/* Not modified, answer with the cached reply */
+		if (channel_data->debug)
+			TRACE("%s not modified", channel_data->url);
+		outdata->size = 0;
+		if (reply->size + 1 > outdata->alloc &&
+		    !output_data_grow(outdata, reply->size + 1, -1)) {
+			result = CHANNEL_ENOMEM;
+			goto cleanup_header;
+		}
+		memcpy(outdata->memory, reply->body, reply->size);
+		outdata->memory[reply->size] = '\0';
+		outdata->size = reply->size;
+		result = CHANNEL_OK;
+	} else {
+		result = channel_map_http_code(this, &channel_data->http_response_code);
+		if (result == CHANNEL_OK && channel_data->conditional_get)
+			store_reply_cache(channel_curl, channel_data->url, outdata);
+	}
 
 	if (channel_data->nocheckanswer)
 		goto cleanup_header;
 
-	channel_log_reply(result, channel_data, &outdata);
+	channel_log_reply(result, channel_data, outdata);
 
 	if (result == CHANNEL_OK) {
-	    result = parse_reply(channel_data, &outdata);
+	    result = parse_reply(channel_curl, channel_data, outdata);
 	}
 
 cleanup_header:
-	outdata.memory != NULL ? free(outdata.memory) : (void)0;
+	output_data_done(outdata);
 	curl_easy_reset(channel_curl->handle);
 	curl_slist_free_all(channel_curl->header);
 	channel_curl->header = NULL;
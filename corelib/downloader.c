@@ -7,14 +7,19 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
+#include <unistd.h>
 
 #include "util.h"
+#include "pctl.h"
 #include "network_ipc.h"
 #include "download_interface.h"
 #include "channel.h"
 #include "channel_curl.h"
 #include "parselib.h"
+#include "parsers.h"
+#include "cpiohdr.h"
 #include "swupdate_settings.h"
 
 /*
@@ -26,13 +31,29 @@
 
 #define DL_DEFAULT_RETRIES	3
 
+/* A cpio header with the longest file name fits */
+#define RANGE_HEADER_SIZE	512
+#define RANGE_POLL_US		100000
+
 static struct option long_options[] = {
     {"url", required_argument, NULL, 'u'},
     {"retries", required_argument, NULL, 'r'},
+    {"retrywait", required_argument, NULL, 'w'},
     {"timeout", required_argument, NULL, 't'},
     {"authentication", required_argument, NULL, 'a'},
+    {"random-access", no_argument, NULL, 'R'},
     {NULL, 0, NULL, 0}};
 
+static bool random_access;
+
+struct range_data {
+	int fd;			/* IPC stream, -1 to store into buf */
+	unsigned char *buf;
+	size_t size;
+	size_t len;		/* bytes received by the request */
+	bool norange;		/* the server ignores range requests */
+};
+
 /*
  * This provides a pull from an external server
  * It is not thought to work with local (file://)
@@ -62,6 +83,227 @@ static RECOVERY_STATUS download_from_url(channel_data_t* channel_data)
 	return result;
 }
 
+/* cpio entries start at a multiple of 4 bytes */
+static inline unsigned long long cpio_align(unsigned long long off)
+{
+	return (off + 3) & ~3ULL;
+}
+
+static size_t range_callback(char *buffer, size_t size, size_t nmemb, void *data)
+{
+	channel_data_t *channel_data = (channel_data_t *)data;
+	struct range_data *rd = (struct range_data *)channel_data->user;
+	size_t nbytes = size * nmemb;
+
+	if (channel_data->http_response_code != 206) {
+		rd->norange = true;
+		return 0;
+	}
+	if (rd->fd >= 0) {
+		if (ipc_send_data(rd->fd, buffer, (int)nbytes) < 0) {
+			ERROR("Writing into SWUpdate IPC stream failed.");
+			return 0;
+		}
+	} else {
+		nbytes = min(nbytes, rd->size - rd->len);
+		memcpy(rd->buf + rd->len, buffer, nbytes);
+	}
+	rd->len += nbytes;
+
+	return size * nmemb;
+}
+
+/*
+ * Get len bytes at from, the answer can be shorter at the end of
+ * the SWU. An interrupted request goes on from the last byte
+ * received, up to retries times (0 = forever). Returns the number
+ * of bytes or a negative error.
+ */
+static ssize_t fetch_range(channel_t *channel, channel_data_t *cd,
+			   struct range_data *rd, unsigned long long from,
+			   size_t len, unsigned int retries)
+{
+	unsigned int tries = 0;
+	channel_op_res_t res;
+	char range[48];
+
+	rd->len = 0;
+	rd->norange = false;
+	do {
+		snprintf(range, sizeof(range), "%llu-%llu",
+			 from + rd->len, from + len - 1);
+		cd->range = range;
+		res = channel->get_file(channel, cd);
+		cd->range = NULL;
+		if (rd->norange)
+			return -EOPNOTSUPP;
+		if (res == CHANNEL_OK)
+			break;
+		if (retries && ++tries > retries) {
+			ERROR("Range %s cannot be downloaded", range);
+			return -EIO;
+		}
+		WARN("Range %s interrupted, retrying", range);
+		sleep(1);
+	} while (rd->len < len);
+
+	return rd->len;
+}
+
+/*
+ * Ask the installer if an entry is needed, the answer is known
+ * when sw-description has been parsed. If it is not within the
+ * timeout (the SWU is saved before it is parsed), it is sent.
+ */
+static int entry_required(const char *filename, unsigned int timeout)
+{
+	unsigned long long waited = 0;
+	int ret;
+
+	if (!strcmp(filename, "TRAILER!!!") ||
+	    !strncmp(filename, SW_DESCRIPTION_FILENAME,
+		     strlen(SW_DESCRIPTION_FILENAME)))
+		return 1;
+
+	while ((ret = ipc_artifact_required(filename)) == -EAGAIN) {
+		if (waited >= timeout * 1000000ULL) {
+			WARN("Required artifacts not known, sending %s", filename);
+			return 1;
+		}
+		usleep(RANGE_POLL_US);
+		waited += RANGE_POLL_US;
+	}
+
+	return ret;
+}
+
+/*
+ * Random access to the SWU: the cpio headers are read one after
+ * the other and the data of an entry is requested only if the
+ * installer needs it, all with the same connection. The installer
+ * gets a cpio archive with the required entries only, since each
+ * entry is aligned to 4 bytes, dropping some of them does not
+ * change the padding of the next ones.
+ * fallback is set if the server does not support ranges and
+ * nothing was sent yet.
+ */
+static RECOVERY_STATUS download_with_ranges(channel_data_t *channel_data,
+					    bool *fallback)
+{
+	unsigned char hdr[RANGE_HEADER_SIZE];
+	struct range_data rd = { .fd = -1 };
+	unsigned long long pos = 0, skipped = 0;
+	struct swupdate_request req;
+	RECOVERY_STATUS result = FAILURE;
+	struct filehdr fdh;
+	channel_data_t cd = *channel_data;
+	channel_t *channel;
+	int fd = -1;
+	ssize_t ret;
+
+	*fallback = false;
+	channel = channel_new();
+	if (!channel)
+		return FAILURE;
+	if (channel->open(channel, &cd) != CHANNEL_OK) {
+		free(channel);
+		return FAILURE;
+	}
+
+	/* Retries are done here, each one with the remaining range */
+	cd.retries = 0;
+	cd.noipc = true;
+	cd.dwlwrdata = range_callback;
+	cd.user = &rd;
+
+	TRACE("Image download with ranges started : %s", cd.url);
+
+	for (;;) {
+		unsigned long long hdrlen, datalen;
+		int required;
+
+		rd.fd = -1;
+		rd.buf = hdr;
+		rd.size = sizeof(hdr);
+		ret = fetch_range(channel, &cd, &rd, pos, sizeof(hdr),
+				  channel_data->retries);
+		if (ret == -EOPNOTSUPP && fd < 0) {
+			INFO("Server does not support ranges, downloading the whole SWU");
+			*fallback = true;
+			goto out;
+		}
+		if (ret < (ssize_t)sizeof(struct new_ascii_header) ||
+		    get_cpiohdr(hdr, &fdh) < 0 ||
+		    fdh.namesize >= sizeof(fdh.filename)) {
+			ERROR("CPIO header at %llu cannot be read", pos);
+			goto out;
+		}
+		hdrlen = cpio_align(sizeof(struct new_ascii_header) + fdh.namesize);
+		if (hdrlen > (unsigned long long)ret) {
+			ERROR("CPIO header at %llu cannot be read", pos);
+			goto out;
+		}
+		memcpy(fdh.filename, hdr + sizeof(struct new_ascii_header),
+		       fdh.namesize);
+		fdh.filename[fdh.namesize] = '\0';
+		datalen = cpio_align(hdrlen + fdh.size) - hdrlen;
+
+		if (fd < 0) {
+			swupdate_prepare_req(&req);
+			req.source = SOURCE_DOWNLOADER;
+			fd = ipc_inst_start_shm(&req, sizeof(req));
+			if (fd < 0) {
+				ERROR("Cannot open SWUpdate IPC stream: %s",
+				      strerror(errno));
+				goto out;
+			}
+		}
+
+		required = entry_required(fdh.filename, cd.low_speed_timeout);
+		if (required < 0) {
+			ERROR("Update is not running anymore");
+			goto out;
+		}
+		if (!required) {
+			TRACE("%s not required, %lu bytes not downloaded",
+			      fdh.filename, fdh.size);
+			skipped += hdrlen + datalen;
+			pos += hdrlen + datalen;
+			continue;
+		}
+
+		if (ipc_send_data(fd, (char *)hdr, (int)hdrlen) < 0) {
+			ERROR("Writing into SWUpdate IPC stream failed.");
+			goto out;
+		}
+		if (!strcmp(fdh.filename, "TRAILER!!!"))
+			break;
+
+		rd.fd = fd;
+		if (datalen && fetch_range(channel, &cd, &rd, pos + hdrlen, datalen,
+					   channel_data->retries) != (ssize_t)datalen) {
+			ERROR("%s cannot be downloaded", fdh.filename);
+			goto out;
+		}
+		pos += hdrlen + datalen;
+	}
+
+	INFO("SWU downloaded with ranges, %llu bytes skipped", skipped);
+	result = SUCCESS;
+
+out:
+	/* the installer sees the end of the stream */
+	if (fd >= 0) {
+		ipc_end(fd);
+		if (ipc_wait_for_complete(NULL) != SUCCESS)
+			result = FAILURE;
+	}
+	channel->close(channel);
+	free(channel);
+
+	return result;
+}
+
 static int download_settings(void *elem, void  __attribute__ ((__unused__)) *data)
 {
 	channel_data_t *opt = (channel_data_t *)data;
@@ -81,8 +323,41 @@ static int download_settings(void *elem, void  __attribute__ ((__unused__)) *dat
 
 	get_field(LIBCFG_PARSER, elem, "retries",
 		&opt->retries);
+	get_field(LIBCFG_PARSER, elem, "retrywait",
+		&opt->retry_sleep);
 	get_field(LIBCFG_PARSER, elem, "timeout",
 		&opt->low_speed_timeout);
+	get_field(LIBCFG_PARSER, elem, "idle-timeout",
+		&opt->idle_timeout);
+	get_field(LIBCFG_PARSER, elem, "segments",
+		&opt->segments);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "segment-size", tmp);
+	if (strlen(tmp))
+		opt->segment_size = (unsigned int)ustrtoull(tmp, NULL, 10);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "http-version", tmp);
+	if (strlen(tmp))
+		opt->http_version = channel_http_version(tmp);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "readahead", tmp);
+	if (strlen(tmp))
+		opt->readahead = (unsigned int)ustrtoull(tmp, NULL, 10);
+	get_field(LIBCFG_PARSER, elem, "readahead-high",
+		&opt->readahead_high);
+	get_field(LIBCFG_PARSER, elem, "readahead-low",
+		&opt->readahead_low);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "max-download-speed", tmp);
+	if (strlen(tmp))
+		opt->max_download_speed = (unsigned int)ustrtoull(tmp, NULL, 10);
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "min-download-speed", tmp);
+	if (strlen(tmp))
+		opt->min_download_speed = (unsigned int)ustrtoull(tmp, NULL, 10);
+	get_field(LIBCFG_PARSER, elem, "adaptive-speed",
+		&opt->adaptive_speed);
+	get_field(LIBCFG_PARSER, elem, "random-access",
+		&random_access);
 
 	return 0;
 }
@@ -95,15 +370,20 @@ void download_print_help(void)
 	    "\t  -u, --url <url>      * <url> is a link to the .swu update image\n"
 	    "\t  -r, --retries          number of retries (resumed download) if connection\n"
 	    "\t                         is broken (0 means indefinitely retries) (default: %d)\n"
+	    "\t  -w, --retrywait        time to wait prior to retry and resume the\n"
+	    "\t                         download (default: %d)\n"
 	    "\t  -t, --timeout          timeout to check if a connection is lost (default: %d)\n"
-	    "\t  -a, --authentication   authentication information as username:password\n",
-	    DL_DEFAULT_RETRIES, DL_LOWSPEED_TIME);
+	    "\t  -a, --authentication   authentication information as username:password\n"
+	    "\t  -R, --random-access    read the SWU with range requests and skip\n"
+	    "\t                         the artifacts that are not installed\n",
+	    DL_DEFAULT_RETRIES, CHANNEL_DEFAULT_RESUME_DELAY, DL_LOWSPEED_TIME);
 }
 
 static channel_data_t channel_options = {
 	.source = SOURCE_DOWNLOADER,
 	.debug = false,
 	.retries = DL_DEFAULT_RETRIES,
+	.retry_sleep = CHANNEL_DEFAULT_RESUME_DELAY,
 	.low_speed_timeout = DL_LOWSPEED_TIME,
 	.headers_to_send = NULL,
 	.max_download_speed = 0, /* Unlimited download speed is default. */
@@ -126,7 +406,7 @@ int start_download(const char *fname, int argc, char *argv[])
 	/* reset to optind=1 to parse download's argument vector */
 	optind = 1;
 	int choice = 0;
-	while ((choice = getopt_long(argc, argv, "t:u:r:a:",
+	while ((choice = getopt_long(argc, argv, "t:u:r:w:a:R",
 				     long_options, NULL)) != -1) {
 		switch (choice) {
 		case 't':
@@ -141,13 +421,33 @@ int start_download(const char *fname, int argc, char *argv[])
 		case 'r':
 			channel_options.retries = strtoul(optarg, NULL, 10);
 			break;
+		case 'w':
+			channel_options.retry_sleep = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			random_access = true;
+			break;
 		case '?':
 		default:
 			return -EINVAL;
 		}
 	}
+	subprocess_ready();
+
+	/*
+	 * The stream into the installer is resumed at the byte it
+	 * stopped at, the installation goes on. 0 retries is forever.
+	 */
+	if (!channel_options.retries)
+		channel_options.retries = UINT_MAX;
+
+	RECOVERY_STATUS result = FAILURE;
+	bool fallback = true;
 
-	RECOVERY_STATUS result = download_from_url(&channel_options);
+	if (random_access)
+		result = download_with_ranges(&channel_options, &fallback);
+	if (fallback)
+		result = download_from_url(&channel_options);
 	if (result != FAILURE) {
 		ipc_message msg;
 		msg.data.procmsg.len = 0;
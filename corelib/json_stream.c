@@ -0,0 +1,429 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * Look up values in a JSON reply by scanning the text, the parts
+ * outside the path are just skipped. This avoids to build the whole
+ * json-c tree of a large reply to read a couple of fields.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "json_stream.h"
+
+/* nesting of objects and arrays that is accepted */
+#define JSON_STREAM_MAX_DEPTH	64
+
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	return p;
+}
+
+/* p points to the opening quote, returns the end of the string */
+static const char *skip_string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\') {
+			p++;
+			continue;
+		}
+		if (*p == '"')
+			return p + 1;
+	}
+	return NULL;
+}
+
+static bool is_number_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '-' || c == '+' ||
+		c == '.' || c == 'e' || c == 'E';
+}
+
+static const char *skip_literal(const char *p, const char *end, const char *lit)
+{
+	size_t n = strlen(lit);
+
+	if ((size_t)(end - p) < n || memcmp(p, lit, n))
+		return NULL;
+	return p + n;
+}
+
+/* Returns the end of the value starting at p, NULL if malformed */
+static const char *skip_value(const char *p, const char *end)
+{
+	char stack[JSON_STREAM_MAX_DEPTH];
+	int depth = 0;
+
+	if (p >= end)
+		return NULL;
+
+	switch (*p) {
+	case '"':
+		return skip_string(p, end);
+	case 't':
+		return skip_literal(p, end, "true");
+	case 'f':
+		return skip_literal(p, end, "false");
+	case 'n':
+		return skip_literal(p, end, "null");
+	case '{':
+	case '[':
+		break;
+	default:
+		if (!is_number_char(*p))
+			return NULL;
+		while (p < end && is_number_char(*p))
+			p++;
+		return p;
+	}
+
+	while (p < end) {
+		switch (*p) {
+		case '"':
+			p = skip_string(p, end);
+			if (!p)
+				return NULL;
+			continue;
+		case '{':
+		case '[':
+			if (depth == JSON_STREAM_MAX_DEPTH)
+				return NULL;
+			stack[depth++] = (*p == '{') ? '}' : ']';
+			break;
+		case '}':
+		case ']':
+			if (!depth || stack[--depth] != *p)
+				return NULL;
+			if (!depth)
+				return p + 1;
+			break;
+		default:
+			break;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/* *pp points to '{', on success it points to the value of key */
+static int object_get(const char **pp, const char *end, const char *key)
+{
+	size_t keylen = strlen(key);
+	const char *p = skip_ws(*pp + 1, end);
+	const char *name;
+
+	if (p < end && *p == '}')
+		return -ENOENT;
+
+	while (p < end) {
+		if (*p != '"')
+			return -EINVAL;
+		name = p + 1;
+		p = skip_string(p, end);
+		if (!p)
+			return -EINVAL;
+		bool found = ((size_t)(p - 1 - name) == keylen &&
+			      !memcmp(name, key, keylen));
+		p = skip_ws(p, end);
+		if (p >= end || *p != ':')
+			return -EINVAL;
+		p = skip_ws(p + 1, end);
+		if (found) {
+			*pp = p;
+			return 0;
+		}
+		p = skip_value(p, end);
+		if (!p)
+			return -EINVAL;
+		p = skip_ws(p, end);
+		if (p < end && *p == '}')
+			return -ENOENT;
+		if (p >= end || *p != ',')
+			return -EINVAL;
+		p = skip_ws(p + 1, end);
+	}
+
+	return -EINVAL;
+}
+
+/* *pp points to '[', on success it points to the idx-th value */
+static int array_get(const char **pp, const char *end, unsigned long idx)
+{
+	const char *p = skip_ws(*pp + 1, end);
+
+	if (p < end && *p == ']')
+		return -ENOENT;
+
+	while (p < end) {
+		if (!idx--) {
+			*pp = p;
+			return 0;
+		}
+		p = skip_value(p, end);
+		if (!p)
+			return -EINVAL;
+		p = skip_ws(p, end);
+		if (p < end && *p == ']')
+			return -ENOENT;
+		if (p >= end || *p != ',')
+			return -EINVAL;
+		p = skip_ws(p + 1, end);
+	}
+
+	return -EINVAL;
+}
+
+int json_stream_find(const char *buf, size_t len, const char **path,
+		     json_stream_value *val)
+{
+	const char *end = buf + len;
+	const char *p, *next;
+	int ret;
+
+	if (!buf)
+		return -EINVAL;
+
+	p = skip_ws(buf, end);
+	for (; *path; path++) {
+		const char *elem = *path;
+
+		if (p >= end)
+			return -EINVAL;
+		if (elem[0] == '[') {
+			char *e;
+			unsigned long idx = strtoul(elem + 1, &e, 10);
+
+			if (e == elem + 1 || *e != ']')
+				return -EINVAL;
+			if (*p != '[')
+				return -ENOENT;
+			ret = array_get(&p, end, idx);
+		} else {
+			if (*p != '{')
+				return -ENOENT;
+			ret = object_get(&p, end, elem);
+		}
+		if (ret)
+			return ret;
+	}
+
+	next = skip_value(p, end);
+	if (!next)
+		return -EINVAL;
+
+	val->start = p;
+	val->len = next - p;
+	switch (*p) {
+	case '{':
+		val->type = JSON_STREAM_OBJECT;
+		break;
+	case '[':
+		val->type = JSON_STREAM_ARRAY;
+		break;
+	case '"':
+		val->type = JSON_STREAM_STRING;
+		val->start++;
+		val->len -= 2;
+		break;
+	case 't':
+	case 'f':
+		val->type = JSON_STREAM_BOOL;
+		break;
+	case 'n':
+		val->type = JSON_STREAM_NULL;
+		break;
+	default:
+		val->type = JSON_STREAM_NUMBER;
+		break;
+	}
+
+	return 0;
+}
+
+static int hex4(const char *s, unsigned int *cp)
+{
+	*cp = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = s[i];
+
+		*cp <<= 4;
+		if (c >= '0' && c <= '9')
+			*cp |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			*cp |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			*cp |= c - 'A' + 10;
+		else
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static int put_utf8(char *dst, size_t size, size_t *o, unsigned int cp)
+{
+	char b[4];
+	int n;
+
+	if (cp < 0x80) {
+		b[0] = cp;
+		n = 1;
+	} else if (cp < 0x800) {
+		b[0] = 0xc0 | (cp >> 6);
+		b[1] = 0x80 | (cp & 0x3f);
+		n = 2;
+	} else if (cp < 0x10000) {
+		b[0] = 0xe0 | (cp >> 12);
+		b[1] = 0x80 | ((cp >> 6) & 0x3f);
+		b[2] = 0x80 | (cp & 0x3f);
+		n = 3;
+	} else {
+		b[0] = 0xf0 | (cp >> 18);
+		b[1] = 0x80 | ((cp >> 12) & 0x3f);
+		b[2] = 0x80 | ((cp >> 6) & 0x3f);
+		b[3] = 0x80 | (cp & 0x3f);
+		n = 4;
+	}
+	if (*o + n >= size)
+		return -ENOSPC;
+	memcpy(dst + *o, b, n);
+	*o += n;
+
+	return 0;
+}
+
+static int unescape(const char *s, size_t len, char *dst, size_t size)
+{
+	size_t i = 0, o = 0;
+	unsigned int cp, low;
+
+	while (i < len) {
+		char c = s[i++];
+
+		if (c == '\\') {
+			if (i >= len)
+				return -EINVAL;
+			c = s[i++];
+			switch (c) {
+			case '"':
+			case '\\':
+			case '/':
+				break;
+			case 'b':
+				c = '\b';
+				break;
+			case 'f':
+				c = '\f';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'u':
+				if (len - i < 4 || hex4(s + i, &cp))
+					return -EINVAL;
+				i += 4;
+				/* surrogate pair */
+				if (cp >= 0xd800 && cp < 0xdc00 && len - i >= 6 &&
+				    s[i] == '\\' && s[i + 1] == 'u' &&
+				    !hex4(s + i + 2, &low) &&
+				    low >= 0xdc00 && low < 0xe000) {
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+					i += 6;
+				}
+				if (put_utf8(dst, size, &o, cp))
+					return -ENOSPC;
+				continue;
+			default:
+				return -EINVAL;
+			}
+		}
+		if (o + 1 >= size)
+			return -ENOSPC;
+		dst[o++] = c;
+	}
+	dst[o] = '\0';
+
+	return 0;
+}
+
+int json_stream_get_string(const char *buf, size_t len, const char **path,
+			   char *dst, size_t size)
+{
+	json_stream_value val;
+	int ret;
+
+	if (!size)
+		return -ENOSPC;
+	ret = json_stream_find(buf, len, path, &val);
+	if (ret)
+		return ret;
+
+	if (val.type == JSON_STREAM_STRING)
+		return unescape(val.start, val.len, dst, size);
+
+	if (val.len >= size)
+		return -ENOSPC;
+	memcpy(dst, val.start, val.len);
+	dst[val.len] = '\0';
+
+	return 0;
+}
+
+int json_stream_get_int(const char *buf, size_t len, const char **path,
+			long long *val)
+{
+	char num[32];
+	char *e;
+	int ret;
+
+	ret = json_stream_get_string(buf, len, path, num, sizeof(num));
+	if (ret)
+		return ret == -ENOSPC ? -EINVAL : ret;
+
+	errno = 0;
+	*val = strtoll(num, &e, 10);
+	if (e == num || errno)
+		return -EINVAL;
+
+	return 0;
+}
+
+int json_stream_array_length(const char *buf, size_t len, const char **path)
+{
+	json_stream_value val;
+	const char *p, *end;
+	int count = 0;
+	int ret;
+
+	ret = json_stream_find(buf, len, path, &val);
+	if (ret)
+		return ret;
+	if (val.type != JSON_STREAM_ARRAY)
+		return -EINVAL;
+
+	end = val.start + val.len - 1;
+	p = skip_ws(val.start + 1, end);
+	while (p < end) {
+		p = skip_value(p, end);
+		if (!p)
+			return -EINVAL;
+		count++;
+		p = skip_ws(p, end);
+		if (p < end && *p == ',')
+			p = skip_ws(p + 1, end);
+	}
+
+	return count;
+}
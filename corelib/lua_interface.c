@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 
@@ -23,6 +24,10 @@
 #include "handler.h"
 #include "bootloader.h"
 #include "progress.h"
+#include "swupdate_membudget.h"
+#include "swupdate_probes.h"
+#include "parselib.h"
+#include "swupdate_settings.h"
 
 #define LUA_TYPE_PEMBSCR 1
 #define LUA_TYPE_HANDLER 2
@@ -206,45 +211,227 @@ static void lua_report_exception(lua_State *L)
 }
 #endif
 
-int run_lua_script(const char *script, const char *function, char *parms)
+/*
+ * All Lua scripts of an update run in the same Lua state, with the
+ * standard libraries and the swupdate module already loaded. Every run
+ * gets its own table of globals (falling back to the shared ones), so
+ * a script does not see the functions defined by another one. The
+ * compiled chunks are kept in the registry, indexed by the content of
+ * the script, so that a script called for preinst and postinst is
+ * parsed once. lua_scripts_release() drops the state at the end of the
+ * update, nothing is shared between updates.
+ */
+#define SCRIPT_CHUNKS	"swupdate_script_chunks"
+
+static lua_State *scriptL;
+static pthread_mutex_t script_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The Lua heaps are charged to the memory budget. An allocation that
+ * does not fit makes Lua run an emergency collection before it gives
+ * up with a memory error.
+ */
+static void *lua_budget_alloc(void __attribute__ ((__unused__)) *ud,
+			      void *ptr, size_t osize, size_t nsize)
 {
-	int ret;
+	void *block;
+
+	if (!ptr)
+		osize = 0;
+	if (nsize == 0) {
+		free(ptr);
+		membudget_release(osize);
+		return NULL;
+	}
+	if (nsize > osize && !membudget_reserve(nsize - osize))
+		return NULL;
+	block = realloc(ptr, nsize);
+	if (!block) {
+		if (nsize > osize)
+			membudget_release(nsize - osize);
+		return NULL;
+	}
+	if (nsize < osize)
+		membudget_release(osize - nsize);
+
+	return block;
+}
+
+static int lua_budget_panic(lua_State *L)
+{
+	ERROR("Unprotected Lua error: %s", lua_tostring(L, -1));
+	return 0;
+}
+
+lua_State *lua_budget_newstate(void)
+{
+	lua_State *L = lua_newstate(lua_budget_alloc, NULL);
+
+	/* e.g. LuaJIT on 64 bit does not support custom allocators */
+	if (!L)
+		return luaL_newstate();
+	lua_atpanic(L, lua_budget_panic);
+
+	return L;
+}
+
+static lua_State *script_state(void)
+{
+	if (scriptL)
+		return scriptL;
+
+	scriptL = lua_budget_newstate(); /* opens Lua */
+	if (!scriptL)
+		return NULL;
+	luaL_openlibs(scriptL); /* opens the standard libraries */
+	luaL_requiref(scriptL, "swupdate", luaopen_swupdate, 1 );
+	lua_newtable(scriptL);
+	lua_setfield(scriptL, LUA_REGISTRYINDEX, SCRIPT_CHUNKS);
+	lua_settop(scriptL, 0);
+
+	return scriptL;
+}
+
+/*
+ * Set the table on top of the stack as environment
+ * of the chunk at index idx, and pop it
+ */
+static void script_set_env(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM > 501
+	lua_setupvalue(L, idx, 1);
+#else
+	lua_setfenv(L, idx);
+#endif
+}
+
+/*
+ * Push the compiled chunk for script, loading it if it
+ * is not in the cache yet
+ */
+static int script_load_chunk(lua_State *L, const char *script)
+{
+	struct stat st;
+	char *buf = NULL, *name = NULL;
+	size_t len = 0, off = 0;
+	int fd, ret = -1;
+
+	fd = open(script, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		goto out;
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		goto out;
+	while (len < (size_t)st.st_size) {
+		ssize_t n = read(fd, buf + len, st.st_size - len);
+
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	if (len != (size_t)st.st_size)
+		goto out;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, SCRIPT_CHUNKS);
+	lua_pushlstring(L, buf, len);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	if (lua_isfunction(L, -1)) {
+		ret = 0;
+		goto out;
+	}
+	lua_pop(L, 1);
+
+	/* skip a "#!" line as luaL_loadfile() does, keeping the newline */
+	if (len && buf[0] == '#')
+		while (off < len && buf[off] != '\n')
+			off++;
+	if (asprintf(&name, "@%s", script) == ENOMEM_ASPRINTF) {
+		name = NULL;
+		goto out;
+	}
+	if (luaL_loadbuffer(L, buf + off, len - off, name))
+		goto out;
+
+	/* chunks[content] = chunk */
+	lua_pushvalue(L, -1);
+	lua_insert(L, -3);
+	lua_rawset(L, -4);
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	free(name);
+	return ret;
+}
+
+int run_lua_script(const char *script, const char *function, const char *parms)
+{
+	int ret = -1;
+	int top, chunk = 0, env;
 	const char *output;
+	lua_State *L;
 
-	lua_State *L = luaL_newstate(); /* opens Lua */
-	luaL_openlibs(L); /* opens the standard libraries */
-	luaL_requiref(L, "swupdate", luaopen_swupdate, 1 );
+	pthread_mutex_lock(&script_lock);
+	L = script_state();
+	if (!L) {
+		ERROR("Lua state cannot be created for %s", script);
+		pthread_mutex_unlock(&script_lock);
+		return -1;
+	}
+	top = lua_gettop(L);
 
-	if (luaL_loadfile(L, script)) {
+	if (script_load_chunk(L, script)) {
 		ERROR("ERROR loading %s", script);
-		lua_close(L);
-		return -1;
+		goto out;
 	}
+	chunk = lua_gettop(L);
 
+	/* env = setmetatable({}, { __index = _G }) */
+	lua_newtable(L);
+	env = lua_gettop(L);
+	lua_newtable(L);
+#if LUA_VERSION_NUM > 501
+	lua_pushglobaltable(L);
+#else
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, env);
+	lua_pushvalue(L, env);
+	script_set_env(L, chunk);
+
+	lua_pushvalue(L, chunk);
 	ret = lua_pcall(L, 0, 0, 0);
 	if (ret) {
 		LUAstackDump(L);
 		ERROR("ERROR preparing Lua script %s %d",
 			script, ret);
-		lua_close(L);
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
-	lua_getglobal(L, function);
+	lua_pushstring(L, function);
+	lua_rawget(L, env);
 	if(!lua_isfunction(L,lua_gettop(L))) {
-		lua_close(L);
 		TRACE("Script : no %s in %s script, exiting", function, script);
-		return 0;
+		ret = 0;
+		goto out;
 	}
 
 	/* passing arguments */
 	lua_pushstring(L, parms);
 
-	if (lua_pcall(L, 1, 2, 0)) {
+	SWU_PROBE2(lua_start, script, function);
+	ret = lua_pcall(L, 1, 2, 0);
+	SWU_PROBE2(lua_done, function, ret);
+	if (ret) {
 		LUAstackDump(L);
 		ERROR("ERROR Calling Lua script %s", script);
-		lua_close(L);
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
 	ret = -1;
@@ -259,11 +446,33 @@ int run_lua_script(const char *script, const char *function, char *parms)
 		TRACE("Script output: %s script end", output);
 	}
 
-	lua_close(L);
+out:
+	/*
+	 * Detach the globals of this run from the cached chunk and
+	 * collect them, so that files left open by the script are
+	 * closed now as they were when every script had its own state.
+	 */
+	if (chunk) {
+		lua_newtable(L);
+		script_set_env(L, chunk);
+	}
+	lua_settop(L, top);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	pthread_mutex_unlock(&script_lock);
 
 	return ret;
 }
 
+void lua_scripts_release(void)
+{
+	pthread_mutex_lock(&script_lock);
+	if (scriptL) {
+		lua_close(scriptL);
+		scriptL = NULL;
+	}
+	pthread_mutex_unlock(&script_lock);
+}
+
 /**
  * @brief convert an image description struct to a lua table
  *
@@ -282,11 +491,25 @@ static void lua_string_to_img(struct img_type *img, const char *key,
 			img->compressed = COMPRESSED_ZLIB;
 		} else if (!strcmp(value, "zstd")) {
 			img->compressed = COMPRESSED_ZSTD;
+		} else if (!strcmp(value, "lz4")) {
+			img->compressed = COMPRESSED_LZ4;
+		} else if (!strcmp(value, "xz")) {
+			img->compressed = COMPRESSED_XZ;
 		} else {
 			ERROR("compressed argument: '%s' invalid", value);
 			img->compressed = COMPRESSED_FALSE;
 		}
 	}
+	if (!strcmp(key, "encrypted")) {
+		if (!strcmp(value, "aes-cbc")) {
+			img->is_encrypted = ENCRYPTED_AES_CBC;
+		} else if (!strcmp(value, "aes-ctr")) {
+			img->is_encrypted = ENCRYPTED_AES_CTR;
+		} else {
+			ERROR("encrypted argument: '%s' invalid", value);
+			img->is_encrypted = ENCRYPTED_FALSE;
+		}
+	}
 	if (!strcmp(key, "name")) {
 		strncpy(img->id.name, value,
 			sizeof(img->id.name));
@@ -300,8 +523,7 @@ static void lua_string_to_img(struct img_type *img, const char *key,
 			sizeof(img->fname));
 	}
 	if (!strcmp(key, "volume"))
-		strncpy(img->volname, value,
-			sizeof(img->volname));
+		img_set_string(&img->volname, value);
 	if (!strcmp(key, "type"))
 		strncpy(img->type, value,
 			sizeof(img->type));
@@ -309,19 +531,22 @@ static void lua_string_to_img(struct img_type *img, const char *key,
 		strncpy(img->device, value,
 			sizeof(img->device));
 	if (!strcmp(key, "mtdname"))
-		strncpy(img->mtdname, value,
-			sizeof(img->mtdname));
+		img_set_string(&img->mtdname, value);
 	if (!strcmp(key, "path"))
 		strncpy(img->path, value,
 			sizeof(img->path));
 	if (!strcmp(key, "data"))
-		strncpy(img->type_data, value,
-			sizeof(img->type_data));
+		img_set_string(&img->type_data, value);
 	if (!strcmp(key, "filesystem"))
-		strncpy(img->filesystem, value,
-			sizeof(img->filesystem));
-	if (!strcmp(key, "sha256"))
+		img_set_string(&img->filesystem, value);
+	if (!strcmp(key, "sha256") && !img->hashalg)
+		ascii_to_hash(img->sha256, value);
+#ifdef CONFIG_HASH_SHA512_256
+	if (!strcmp(key, SHA512_256)) {
 		ascii_to_hash(img->sha256, value);
+		img->hashalg = SHA512_256;
+	}
+#endif
 	if (!strcmp(key, "ivt"))
 		strncpy(img->ivt_ascii, value,
 			sizeof(img->ivt_ascii));
@@ -391,7 +616,7 @@ static int l_copy2file(lua_State *L)
 	uint32_t checksum = 0;
 
 	table2image(L, &img);
-	int ret = copyfile(img.fdin,
+	int ret = copyfile_hash(img.fdin,
 				 &fdout,
 				 img.size,
 				 (unsigned long *)&img.offset,
@@ -400,6 +625,7 @@ static int l_copy2file(lua_State *L)
 				 img.compressed,
 				 &checksum,
 				 img.sha256,
+				 img.hashalg,
 				 img.is_encrypted,
 				 img.ivt_ascii,
 				 NULL);
@@ -426,24 +652,160 @@ copyfile_exit:
 	return 2;
 }
 
-static int istream_read_callback(void *out, const void *buf, size_t len)
+/*
+ * image:read_buffer() passes to the callback always the same userdata,
+ * pointing to the buffer of the copy pipeline, instead of creating a
+ * new string for each chunk. It is valid only during the callback.
+ */
+#define LUA_CHUNK_TYPE "swupdate.buffer"
+
+struct lua_chunk {
+	const char *data;
+	size_t len;
+};
+
+struct istream_read_data {
+	int fd;		/* unused, copyfile() expects a fd first */
+	lua_State *L;
+	struct lua_chunk *chunk;
+	int chunk_idx;
+};
+
+static struct lua_chunk *check_chunk(lua_State *L)
 {
-	lua_State* L = (lua_State*)out;
-	if (len > LUAL_BUFFERSIZE) {
-		ERROR("I/O buffer size is larger than Lua's buffer size %d", LUAL_BUFFERSIZE);
-		return -1;
+	struct lua_chunk *chunk = (struct lua_chunk *)luaL_checkudata(L, 1, LUA_CHUNK_TYPE);
+
+	if (!chunk->data)
+		luaL_error(L, "buffer used outside of its read callback");
+	return chunk;
+}
+
+/* Lua's string.sub() rules: 1-based, negative positions from the end */
+static size_t chunk_pos(lua_Integer pos, size_t len)
+{
+	if (pos >= 0)
+		return ((size_t)pos > len) ? len + 1 : (size_t)pos;
+	if ((size_t)-pos > len)
+		return 0;
+	return len + pos + 1;
+}
+
+static int l_chunk_len(lua_State *L)
+{
+	lua_pushinteger(L, check_chunk(L)->len);
+	return 1;
+}
+
+static int l_chunk_tostring(lua_State *L)
+{
+	struct lua_chunk *chunk = check_chunk(L);
+
+	lua_pushlstring(L, chunk->data, chunk->len);
+	return 1;
+}
+
+static int l_chunk_sub(lua_State *L)
+{
+	struct lua_chunk *chunk = check_chunk(L);
+	size_t i = chunk_pos(luaL_optinteger(L, 2, 1), chunk->len);
+	size_t j = chunk_pos(luaL_optinteger(L, 3, -1), chunk->len);
+
+	if (i < 1)
+		i = 1;
+	if (j > chunk->len)
+		j = chunk->len;
+	if (i > j)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, chunk->data + i - 1, j - i + 1);
+	return 1;
+}
+
+static int l_chunk_byte(lua_State *L)
+{
+	struct lua_chunk *chunk = check_chunk(L);
+	size_t i = chunk_pos(luaL_optinteger(L, 2, 1), chunk->len);
+	size_t j;
+	int n = 0;
+
+	if (i < 1)
+		i = 1;
+	j = chunk_pos(luaL_optinteger(L, 3, i), chunk->len);
+	if (j > chunk->len)
+		j = chunk->len;
+	if (i > j)
+		return 0;
+	luaL_checkstack(L, j - i + 1, "buffer slice too long");
+	for (; i <= j; i++, n++)
+		lua_pushinteger(L, (unsigned char)chunk->data[i - 1]);
+	return n;
+}
+
+static int l_chunk_ptr(lua_State *L)
+{
+	struct lua_chunk *chunk = check_chunk(L);
+
+	lua_pushlightuserdata(L, (void *)chunk->data);
+	lua_pushinteger(L, chunk->len);
+	return 2;
+}
+
+static int l_chunk_write(lua_State *L)
+{
+	struct lua_chunk *chunk = check_chunk(L);
+	luaL_Stream *lstream = (luaL_Stream *)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+
+	if (!lstream->f || fwrite(chunk->data, 1, chunk->len, lstream->f) != chunk->len) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
 	}
+	lua_pushboolean(L, true);
+	return 1;
+}
 
-	luaL_checktype(L, 2, LUA_TFUNCTION);
-	lua_pushvalue(L, 2);
+static const luaL_Reg l_chunk_methods[] = {
+	{ "len", l_chunk_len },
+	{ "tostring", l_chunk_tostring },
+	{ "sub", l_chunk_sub },
+	{ "byte", l_chunk_byte },
+	{ "ptr", l_chunk_ptr },
+	{ "write", l_chunk_write },
+	{ NULL, NULL }
+};
+
+static void push_chunk_metatable(lua_State *L)
+{
+	if (luaL_newmetatable(L, LUA_CHUNK_TYPE)) {
+		luaL_newlib(L, l_chunk_methods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, l_chunk_len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, l_chunk_tostring);
+		lua_setfield(L, -2, "__tostring");
+	}
+}
 
-	luaL_Buffer lbuffer;
-	luaL_buffinit(L, &lbuffer);
-	char *buffer = luaL_prepbuffsize(&lbuffer, len);
-	memcpy(buffer, buf, len);
-	luaL_addsize(&lbuffer, len);
-	luaL_pushresult(&lbuffer);
-	if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+static int istream_read_callback(void *out, const void *buf, size_t len)
+{
+	struct istream_read_data *rd = (struct istream_read_data *)out;
+	lua_State *L = rd->L;
+	int ret;
+
+	lua_pushvalue(L, 2);
+	if (rd->chunk) {
+		rd->chunk->data = buf;
+		rd->chunk->len = len;
+		lua_pushvalue(L, rd->chunk_idx);
+	} else {
+		lua_pushlstring(L, buf, len);
+	}
+	ret = lua_pcall(L, 1, 0, 0);
+	if (rd->chunk) {
+		rd->chunk->data = NULL;
+		rd->chunk->len = 0;
+	}
+	if (ret != LUA_OK) {
 		ERROR("Lua error in callback: %s", lua_tostring(L, -1));
 		lua_pop(L, 1);
 		return -1;
@@ -451,20 +813,34 @@ static int istream_read_callback(void *out, const void *buf, size_t len)
 	return 0;
 }
 
-static int l_istream_read(lua_State* L)
+static int istream_read(lua_State* L, bool buffer)
 {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
 
 	struct img_type img = {};
 	uint32_t checksum = 0;
+	struct istream_read_data rd = {
+		.fd = -1,
+		.L = L,
+	};
+
+	if (buffer) {
+		rd.chunk = (struct lua_chunk *)lua_newuserdata(L, sizeof(*rd.chunk));
+		rd.chunk->data = NULL;
+		rd.chunk->len = 0;
+		push_chunk_metatable(L);
+		lua_setmetatable(L, -2);
+		rd.chunk_idx = lua_gettop(L);
+	}
 
 	lua_pushvalue(L, 1);
 	table2image(L, &img);
 	lua_pop(L, 1);
 
-	int ret = copyfile(img.fdin,
-				 L,
+	int ret = copyfile_hash(img.fdin,
+				 &rd,
 				 img.size,
 				 (unsigned long *)&img.offset,
 				 img.seek,
@@ -472,11 +848,12 @@ static int l_istream_read(lua_State* L)
 				 img.compressed,
 				 &checksum,
 				 img.sha256,
+				 img.hashalg,
 				 img.is_encrypted,
 				 img.ivt_ascii,
 				 istream_read_callback);
 
-	lua_pop(L, 1);
+	lua_settop(L, 1);
 	update_table(L, &img);
 	lua_pop(L, 1);
 
@@ -495,6 +872,16 @@ static int l_istream_read(lua_State* L)
 	lua_pushnil(L);
 	return 2;
 }
+
+static int l_istream_read(lua_State* L)
+{
+	return istream_read(L, false);
+}
+
+static int l_istream_read_buffer(lua_State* L)
+{
+	return istream_read(L, true);
+}
 #endif
 
 static void update_table(lua_State* L, struct img_type *img)
@@ -507,19 +894,18 @@ static void update_table(lua_State* L, struct img_type *img)
 		LUA_PUSH_IMG_STRING(img, "name", id.name);
 		LUA_PUSH_IMG_STRING(img, "version", id.version);
 		LUA_PUSH_IMG_STRING(img, "filename", fname);
-		LUA_PUSH_IMG_STRING(img, "volume", volname);
+		LUA_PUSH_IMG_STRING_VALUE(img, "volume", IMG_STRING(img->volname));
 		LUA_PUSH_IMG_STRING(img, "type", type);
 		LUA_PUSH_IMG_STRING(img, "device", device);
 		LUA_PUSH_IMG_STRING(img, "path", path);
-		LUA_PUSH_IMG_STRING(img, "mtdname", mtdname);
-		LUA_PUSH_IMG_STRING(img, "data", type_data);
-		LUA_PUSH_IMG_STRING(img, "filesystem", filesystem);
+		LUA_PUSH_IMG_STRING_VALUE(img, "mtdname", IMG_STRING(img->mtdname));
+		LUA_PUSH_IMG_STRING_VALUE(img, "data", IMG_STRING(img->type_data));
+		LUA_PUSH_IMG_STRING_VALUE(img, "filesystem", IMG_STRING(img->filesystem));
 		LUA_PUSH_IMG_STRING(img, "ivt", ivt_ascii);
 
 		LUA_PUSH_IMG_BOOL(img, "installed_directly", install_directly);
 		LUA_PUSH_IMG_BOOL(img, "install_if_different", id.install_if_different);
 		LUA_PUSH_IMG_BOOL(img, "install_if_higher", id.install_if_higher);
-		LUA_PUSH_IMG_BOOL(img, "encrypted", is_encrypted);
 		LUA_PUSH_IMG_BOOL(img, "partition", is_partitioner);
 		LUA_PUSH_IMG_BOOL(img, "script", is_script);
 		LUA_PUSH_IMG_BOOL(img, "preserve_attributes", preserve_attributes);
@@ -536,11 +922,29 @@ static void update_table(lua_State* L, struct img_type *img)
 			case COMPRESSED_ZSTD:
 				LUA_PUSH_IMG_STRING_VALUE(img, "compressed", "zstd");
 				break;
+			case COMPRESSED_LZ4:
+				LUA_PUSH_IMG_STRING_VALUE(img, "compressed", "lz4");
+				break;
+			case COMPRESSED_XZ:
+				LUA_PUSH_IMG_STRING_VALUE(img, "compressed", "xz");
+				break;
 			default:
 				LUA_PUSH_IMG_BOOL(img, "compressed", compressed);
 				break;
 		}
 
+		switch (img->is_encrypted) {
+			case ENCRYPTED_AES_CBC:
+				LUA_PUSH_IMG_STRING_VALUE(img, "encrypted", "aes-cbc");
+				break;
+			case ENCRYPTED_AES_CTR:
+				LUA_PUSH_IMG_STRING_VALUE(img, "encrypted", "aes-ctr");
+				break;
+			default:
+				LUA_PUSH_IMG_BOOL(img, "encrypted", is_encrypted);
+				break;
+		}
+
 		lua_pushstring(L, "properties");
 		lua_newtable (L);
 		LIST_FOREACH(property, &img->properties, next) {
@@ -572,6 +976,10 @@ static void update_table(lua_State* L, struct img_type *img)
 			lua_pushstring(L, "read");
 			lua_pushcfunction(L, &l_istream_read);
 			lua_settable(L, -3);
+
+			lua_pushstring(L, "read_buffer");
+			lua_pushcfunction(L, &l_istream_read_buffer);
+			lua_settable(L, -3);
 		}
 #endif
 
@@ -581,7 +989,7 @@ static void update_table(lua_State* L, struct img_type *img)
 
 		char *hashstring = alloca(2 * SHA256_HASH_LENGTH + 1);
 		hash_to_ascii(img->sha256, hashstring);
-		lua_pushstring(L, "sha256");
+		lua_pushstring(L, img->hashalg ? img->hashalg : "sha256");
 		lua_pushstring(L, hashstring);
 		lua_settable(L, -3);
 	}
@@ -1264,6 +1672,10 @@ static int luaopen_swupdate(lua_State *L)
 		lua_push_enum(L, "BOOTLOADER_HANDLER", BOOTLOADER_HANDLER);
 		lua_push_enum(L, "PARTITION_HANDLER", PARTITION_HANDLER);
 		lua_push_enum(L, "NO_DATA_HANDLER", NO_DATA_HANDLER);
+		lua_push_enum(L, "STREAM_HANDLER", STREAM_HANDLER);
+		lua_push_enum(L, "DRYRUN_HANDLER", DRYRUN_HANDLER);
+		lua_push_enum(L, "SEEKABLE_HANDLER", SEEKABLE_HANDLER);
+		lua_push_enum(L, "DIRECTIO_HANDLER", DIRECTIO_HANDLER);
 		lua_push_enum(L, "ANY_HANDLER", ANY_HANDLER);
 		lua_settable(L, -3);
 
@@ -1284,6 +1696,36 @@ static int luaopen_swupdate(lua_State *L)
 #ifdef CONFIG_HANDLER_IN_LUA
 static lua_State *gL = NULL;
 
+/*
+ * Handlers declared in the "lua-handlers" section of the configuration
+ * file: they are registered without a Lua function and the Lua state is
+ * created when one of them is called the first time.
+ */
+struct lua_declared_handler {
+	char *name;
+	unsigned int mask;
+};
+static struct lua_declared_handler *declared;
+static unsigned int nr_declared;
+
+/* recursive, a handler can be called while swupdate_handlers.lua runs */
+static pthread_mutex_t lua_load_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static bool lua_loaded;
+
+static int lua_handlers_load(void);
+
+static int lua_handlers_ready(void)
+{
+	pthread_mutex_lock(&lua_load_lock);
+	if (!lua_loaded) {
+		lua_loaded = true;
+		(void)lua_handlers_load();
+	}
+	pthread_mutex_unlock(&lua_load_lock);
+
+	return gL ? 0 : -1;
+}
+
 /**
  * @brief wrapper to call the Lua function
  *
@@ -1305,7 +1747,14 @@ static int l_handler_wrapper(struct img_type *img, void *data,
 	lua_Number result;
 	int l_func_ref;
 
-	if (!gL || !img || !data) {
+	if (lua_handlers_ready() || !img || !data) {
+		return -1;
+	}
+
+	l_func_ref = *((int*)data);
+	if (l_func_ref == LUA_NOREF) {
+		ERROR("Lua handler %s is declared, but swupdate_handlers.lua does not register it",
+		      img->type);
 		return -1;
 	}
 
@@ -1321,7 +1770,6 @@ static int l_handler_wrapper(struct img_type *img, void *data,
 		lua_pop(gL, 1);
 	}
 
-	l_func_ref = *((int*)data);
 	/* get the callback function */
 	lua_rawgeti(gL, LUA_REGISTRYINDEX, l_func_ref );
 	image2table(gL, img);
@@ -1406,12 +1854,34 @@ static int l_register_handler( lua_State *L ) {
 			return 0;
 		}
 
+		/* the Lua handlers share the state, they run one at a time */
+		mask &= ~(PARALLEL_HANDLER | SKIP_UNCHANGED_HANDLER);
+
 		const char *handler_desc = luaL_checkstring(L, 1);
 		/* store the callback function in registry */
 		*l_func_ref = luaL_ref (L, LUA_REGISTRYINDEX);
 		/* cleanup stack */
 		lua_pop (L, 1);
 
+		/* a declared handler gets its function */
+		struct installer_handler *hnd = find_handler_by_name(handler_desc);
+		if (hnd && (hnd->installer == l_script_handler_wrapper ||
+			    hnd->installer == l_other_handler_wrapper) &&
+		    *((int *)hnd->data) == LUA_NOREF) {
+			if ((hnd->mask & SCRIPT_HANDLER) != (mask & SCRIPT_HANDLER)) {
+				ERROR("Lua handler %s: declared and registered for different artifacts",
+				      handler_desc);
+				luaL_unref(L, LUA_REGISTRYINDEX, *l_func_ref);
+			} else {
+				if (hnd->mask != mask)
+					WARN("Lua handler %s: mask 0x%x registered, 0x%x declared is used",
+					     handler_desc, mask, hnd->mask);
+				*((int *)hnd->data) = *l_func_ref;
+			}
+			free(l_func_ref);
+			return 0;
+		}
+
 		register_handler(handler_desc,
 				 (mask & SCRIPT_HANDLER) ?
 				 l_script_handler_wrapper :
@@ -1440,6 +1910,8 @@ static int l_call_handler(lua_State *L)
 		return 2;
 	}
 	strlcpy(img.type, lua_tostring(L, 1), sizeof(img.type));
+	/* the table returned to the script carries the checksum */
+	img.sum_checksum = true;
 
 	if ((hnd = find_handler(&img)) == NULL) {
 		if (asprintf(&msg, "Image type %s not supported!", img.type) == -1) {
@@ -1470,7 +1942,7 @@ call_handler_exit:
 	return 2;
 }
 
-int lua_handlers_init(void)
+static int lua_handlers_load(void)
 {
 	static const char location[] =
 #if defined(CONFIG_EMBEDDED_LUA_HANDLER)
@@ -1480,7 +1952,7 @@ int lua_handlers_init(void)
 #endif
 	int ret = -1;
 
-	gL = luaL_newstate();
+	gL = lua_budget_newstate();
 	if (gL) {
 		/* prime gL as LUA_TYPE_HANDLER */
 		lua_pushlightuserdata(gL, (void*)LUA_TYPE_HANDLER);
@@ -1509,13 +1981,125 @@ int lua_handlers_init(void)
 
 	return ret;
 }
+
+static int lua_handler_mask(const char *name, const char *types, unsigned int *mask)
+{
+	static const struct {
+		const char *name;
+		unsigned int mask;
+	} masks[] = {
+		{ "image", IMAGE_HANDLER },
+		{ "file", FILE_HANDLER },
+		{ "script", SCRIPT_HANDLER },
+		{ "bootloader", BOOTLOADER_HANDLER },
+		{ "partition", PARTITION_HANDLER },
+		{ "no-data", NO_DATA_HANDLER },
+		{ "stream", STREAM_HANDLER },
+		{ "dryrun", DRYRUN_HANDLER },
+		{ "seekable", SEEKABLE_HANDLER },
+		{ "directio", DIRECTIO_HANDLER }
+	};
+	char *tmp = strdupa(types), *saveptr, *t;
+	unsigned int i;
+
+	*mask = 0;
+	for (t = strtok_r(tmp, ", ", &saveptr); t; t = strtok_r(NULL, ", ", &saveptr)) {
+		for (i = 0; i < ARRAY_SIZE(masks); i++)
+			if (!strcmp(t, masks[i].name))
+				break;
+		if (i == ARRAY_SIZE(masks)) {
+			ERROR("Lua handler %s: unknown type \"%s\"", name, t);
+			return -EINVAL;
+		}
+		*mask |= masks[i].mask;
+	}
+	if (!*mask)
+		*mask = ANY_HANDLER & ~SCRIPT_HANDLER;
+	if ((*mask & SCRIPT_HANDLER) &&
+	    (*mask & (IMAGE_HANDLER | FILE_HANDLER | BOOTLOADER_HANDLER | PARTITION_HANDLER))) {
+		ERROR("Lua handler %s: declared for scripts and non-scripts", name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int lua_handlers_settings(void *settings, void __attribute__ ((__unused__)) *data)
+{
+	char name[SWUPDATE_GENERAL_STRING_SIZE], types[SWUPDATE_GENERAL_STRING_SIZE];
+	struct lua_declared_handler *tmp;
+	unsigned int mask;
+	int count, i;
+	void *elem;
+
+	count = get_array_length(LIBCFG_PARSER, settings);
+	if (count <= 0)
+		return 0;
+	tmp = realloc(declared, (nr_declared + count) * sizeof(*declared));
+	if (!tmp)
+		return -ENOMEM;
+	declared = tmp;
+
+	for (i = 0; i < count; i++) {
+		elem = get_elem_from_idx(LIBCFG_PARSER, settings, i);
+		if (!elem || !exist_field_string(LIBCFG_PARSER, elem, "name"))
+			continue;
+
+		name[0] = types[0] = '\0';
+		GET_FIELD_STRING(LIBCFG_PARSER, elem, "name", name);
+		GET_FIELD_STRING(LIBCFG_PARSER, elem, "type", types);
+		/* not registered, the images using it are refused by the parser */
+		if (lua_handler_mask(name, types, &mask))
+			continue;
+
+		declared[nr_declared].name = strdup(name);
+		if (!declared[nr_declared].name)
+			return -ENOMEM;
+		declared[nr_declared++].mask = mask & ~(PARALLEL_HANDLER | SKIP_UNCHANGED_HANDLER);
+	}
+
+	return 0;
+}
+
+int lua_handlers_init(void)
+{
+	unsigned int i, registered = 0;
+	int *l_func_ref;
+
+	if (!nr_declared) {
+		lua_loaded = true;
+		return lua_handlers_load();
+	}
+
+	for (i = 0; i < nr_declared; i++) {
+		l_func_ref = malloc(sizeof(int));
+		if (!l_func_ref)
+			return -ENOMEM;
+		*l_func_ref = LUA_NOREF;
+		if (register_handler(declared[i].name,
+				     (declared[i].mask & SCRIPT_HANDLER) ?
+				     l_script_handler_wrapper :
+				     l_other_handler_wrapper,
+				     declared[i].mask, l_func_ref)) {
+			ERROR("Lua handler %s cannot be registered", declared[i].name);
+			free(l_func_ref);
+			continue;
+		}
+		registered++;
+	}
+	INFO("%u Lua handler(s) declared, loaded on first use", registered);
+
+	return 0;
+}
 #else
+int lua_handlers_settings(void __attribute__ ((__unused__)) *settings,
+			  void __attribute__ ((__unused__)) *data) {return 0;}
 int lua_handlers_init(void) {return 0;}
 #endif
 
 lua_State *lua_parser_init(const char *buf, struct dict *bootenv)
 {
-	lua_State *L = luaL_newstate(); /* opens Lua */
+	lua_State *L = lua_budget_newstate(); /* opens Lua */
 
 	if (!L)
 		return NULL;
@@ -1539,8 +2123,216 @@ lua_State *lua_parser_init(const char *buf, struct dict *bootenv)
 	return L;
 }
 
+/*
+ * Hooks listed in SWUPDATE_PURE_HOOKS by the embedded script depend
+ * only on the attributes of the entry, so that their result is reused
+ * for all entries with the same attributes:
+ *
+ *	SWUPDATE_PURE_HOOKS = { set_version = true }
+ */
+#define PARSER_MEMO "swupdate_parser_memo"
+#define PARSER_MEMO_DEPTH 4
+#define PARSER_MEMO_MISS (-2)
+
+struct memo_key {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static bool memo_key_add(struct memo_key *k, char type, const char *s, size_t len)
+{
+	char hdr[24];
+	int n = snprintf(hdr, sizeof(hdr), "%c%zu:", type, len);
+	char *buf;
+
+	if (k->len + n + len > k->size) {
+		size_t size = k->size ? k->size : 256;
+
+		while (k->len + n + len > size)
+			size *= 2;
+		buf = realloc(k->buf, size);
+		if (!buf)
+			return false;
+		k->buf = buf;
+		k->size = size;
+	}
+	memcpy(k->buf + k->len, hdr, n);
+	memcpy(k->buf + k->len + n, s, len);
+	k->len += n + len;
+
+	return true;
+}
+
+static int memo_key_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static bool memo_key_table(lua_State *L, int idx, struct memo_key *k, int depth);
+
+/* Add the value on top of the stack */
+static bool memo_key_value(lua_State *L, struct memo_key *k, int depth)
+{
+	const char *s;
+	size_t len;
+	bool ok;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TSTRING:
+		s = lua_tolstring(L, -1, &len);
+		return memo_key_add(k, 's', s, len);
+	case LUA_TNUMBER:
+		lua_pushvalue(L, -1);
+		s = lua_tolstring(L, -1, &len);
+		ok = memo_key_add(k, 'n', s, len);
+		lua_pop(L, 1);
+		return ok;
+	case LUA_TBOOLEAN:
+		return memo_key_add(k, 'b', lua_toboolean(L, -1) ? "1" : "0", 1);
+	case LUA_TTABLE:
+		return memo_key_add(k, '{', "", 0) &&
+			memo_key_table(L, lua_gettop(L), k, depth + 1) &&
+			memo_key_add(k, '}', "", 0);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Serialize the table at idx, the keys in order so that
+ * equal tables give the same key. Only string keys and
+ * sequences are supported.
+ */
+static bool memo_key_table(lua_State *L, int idx, struct memo_key *k, int depth)
+{
+	const char **keys = NULL, **tmp;
+	size_t nkeys = 0, nitems = 0;
+	bool ok = false;
+
+	if (depth > PARSER_MEMO_DEPTH)
+		return false;
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) == LUA_TNUMBER) {
+			nitems++;
+			continue;
+		}
+		if (lua_type(L, -1) != LUA_TSTRING)
+			goto out_pop;
+		tmp = realloc(keys, (nkeys + 1) * sizeof(*keys));
+		if (!tmp)
+			goto out_pop;
+		keys = tmp;
+		/* the table keeps the string */
+		keys[nkeys++] = lua_tostring(L, -1);
+	}
+	if (nitems != (size_t)lua_rawlen(L, idx))
+		goto out;
+
+	if (nkeys)
+		qsort(keys, nkeys, sizeof(*keys), memo_key_cmp);
+	for (size_t i = 0; i < nkeys; i++) {
+		if (!memo_key_add(k, 'k', keys[i], strlen(keys[i])))
+			goto out;
+		lua_pushstring(L, keys[i]);
+		lua_rawget(L, idx);
+		ok = memo_key_value(L, k, depth);
+		lua_pop(L, 1);
+		if (!ok)
+			goto out;
+	}
+	for (size_t i = 1; i <= nitems; i++) {
+		lua_rawgeti(L, idx, i);
+		ok = memo_key_value(L, k, depth);
+		lua_pop(L, 1);
+		if (!ok)
+			goto out;
+	}
+	ok = true;
+	goto out;
+
+out_pop:
+	lua_pop(L, 1);
+out:
+	free(keys);
+	return ok;
+}
+
+static bool parser_hook_is_pure(lua_State *L, const char *fcn)
+{
+	bool pure = false;
+
+	lua_getglobal(L, "SWUPDATE_PURE_HOOKS");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, fcn);
+		pure = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	return pure;
+}
+
+/*
+ * Apply the result of a previous call with the same key,
+ * return PARSER_MEMO_MISS if there is none
+ */
+static int memo_lookup(lua_State *L, struct memo_key *k, struct img_type *img)
+{
+	off_t offset = img->offset;
+	int ret;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, PARSER_MEMO);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return PARSER_MEMO_MISS;
+	}
+	lua_pushlstring(L, k->buf, k->len);
+	lua_rawget(L, -2);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 2);
+		return PARSER_MEMO_MISS;
+	}
+	lua_rawgeti(L, -1, 1);
+	ret = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	/* the returned table, the position in the SWU is not taken from it */
+	lua_rawgeti(L, -1, 2);
+	table2image(L, img);
+	img->offset = offset;
+	lua_pop(L, 3);
+
+	return ret;
+}
+
+/* Store the result of the hook, the returned table is on top */
+static void memo_store(lua_State *L, struct memo_key *k, int ret)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, PARSER_MEMO);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PARSER_MEMO);
+	}
+	lua_pushlstring(L, k->buf, k->len);
+	lua_createtable(L, 2, 0);
+	lua_pushinteger(L, ret);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, -4);
+	lua_rawseti(L, -2, 2);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
 int lua_parser_fn(lua_State *L, const char *fcn, struct img_type *img)
 {
+	struct memo_key key = { 0 };
+	int top = lua_gettop(L);
 	int ret = -1;
 
 	lua_getglobal(L, fcn);
@@ -1556,10 +2348,31 @@ int lua_parser_fn(lua_State *L, const char *fcn, struct img_type *img)
 	 */
 	image2table(L, img);
 
+	if (parser_hook_is_pure(L, fcn)) {
+		if (!memo_key_add(&key, 'f', fcn, strlen(fcn)) ||
+		    !memo_key_table(L, lua_gettop(L), &key, 0)) {
+			free(key.buf);
+			key.buf = NULL;
+		}
+		if (key.buf) {
+			ret = memo_lookup(L, &key, img);
+			if (ret != PARSER_MEMO_MISS) {
+				free(key.buf);
+				lua_settop(L, top);
+				TRACE("Script returns %d, as for the same attributes", ret);
+				return ret;
+			}
+		}
+	}
+
+	SWU_PROBE2(lua_start, "sw-description", fcn);
 	ret = lua_pcall(L, 1, 2, 0);
+	SWU_PROBE2(lua_done, fcn, ret);
 	if (ret || !lua_isboolean(L, -2)) {
 		LUAstackDump(L);
 		ERROR("ERROR Calling Lua %s", fcn);
+		free(key.buf);
+		lua_settop(L, top);
 		return -1;
 	}
 
@@ -1574,6 +2387,11 @@ int lua_parser_fn(lua_State *L, const char *fcn, struct img_type *img)
 
 	table2image(L, img);
 
+	if (key.buf) {
+		memo_store(L, &key, ret);
+		free(key.buf);
+	}
+
 	lua_pop(L, 2); /* clear stack */
 
 	TRACE("Script returns %d", ret);
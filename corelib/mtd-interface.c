@@ -16,19 +16,24 @@
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include "bsdqueue.h"
 #include "util.h"
 #include "flash.h"
 
 static char mtd_ubi_blacklist[100] = { 0 };
 
+/* handlers may look up devices from concurrent install groups */
+static pthread_mutex_t mtd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Note: the functions here are derived directly
  * with minor changes from mtd-utils.
  */
 #define EMPTY_BYTE	0xFF
 
-int flash_erase_sector(int mtdnum, off_t start, size_t size)
+/* The caller has checked that mtdnum is present and valid */
+static int erase_sectors(int mtdnum, off_t start, size_t size)
 {
 	int fd;
 	char mtd_device[80];
@@ -39,10 +44,6 @@ int flash_erase_sector(int mtdnum, off_t start, size_t size)
 	uint8_t *buf;
 	struct flash_description *flash = get_flash_info();
 
-	if  (!mtd_dev_present(flash->libmtd, mtdnum)) {
-			ERROR("MTD %d does not exist", mtdnum);
-			return -ENODEV;
-	}
 	mtd = &flash->mtd_info[mtdnum].mtd;
 	snprintf(mtd_device, sizeof(mtd_device), "/dev/mtd%d", mtdnum);
 
@@ -146,6 +147,18 @@ erase_out:
 	return ret;
 }
 
+int flash_erase_sector(int mtdnum, off_t start, size_t size)
+{
+	struct flash_description *flash = get_flash_info();
+
+	if  (!mtd_dev_present(flash->libmtd, mtdnum) || !mtd_get_device(mtdnum)) {
+			ERROR("MTD %d does not exist", mtdnum);
+			return -ENODEV;
+	}
+
+	return erase_sectors(mtdnum, start, size);
+}
+
 int flash_erase(int mtdnum)
 {
 	return flash_erase_sector(mtdnum, 0, 0);
@@ -204,13 +217,16 @@ int get_mtd_from_device(char *s) {
 int get_mtd_from_name(const char *s)
 {
 	struct flash_description *flash = get_flash_info();
-	struct mtd_dev_info *info;
+	struct mtd_ubi_info *info;
 	int i;
 
+	if (mtd_load_table())
+		return -1;
+
 	for (i = flash->mtd.lowest_mtd_num;
 	     i <= flash->mtd.highest_mtd_num; i++) {
-		info = &flash->mtd_info[i].mtd;
-		if (!strcmp(info->name, s))
+		info = mtd_get_device(i);
+		if (info && !strcmp(info->mtd.name, s))
 			return i;
 	}
 
@@ -292,39 +308,23 @@ static void scan_ubi_volumes(struct mtd_ubi_info *info)
 	info->scanned = 1;
 }
 
-static void scan_for_ubi_devices(void)
+/*
+ * Look for the UBI device attached to the MTD, if any
+ */
+static bool scan_attached_ubi(int mtd)
 {
 	struct flash_description *flash = get_flash_info();
-	libubi_t libubi = flash->libubi;
-	struct ubi_info ubi_info;
-	struct ubi_dev_info dev_info;
-	struct mtd_ubi_info *mtd_info;
-	int err, i, mtd;
+	struct mtd_ubi_info *mtd_info = &flash->mtd_info[mtd];
+	int dev_num;
 
-	if (!libubi)
-		return;
-	/*
-	 * if not yet an attached device, return and try later
-	 * to attach them
-	 */
-	err = ubi_get_info(libubi, &ubi_info);
-	if (err)
-		return;
+	if (mtd_num2ubi_dev(flash->libubi, mtd, &dev_num))
+		return false;
+	if (ubi_get_dev_info1(flash->libubi, dev_num, &mtd_info->dev_info))
+		return false;
 
-	for (i = ubi_info.lowest_dev_num;
-	     i <= ubi_info.highest_dev_num; i++) {
-		err = ubi_get_dev_info1(libubi, i, &dev_info);
-		if (err == -1) {
-			continue;
-		}
-		mtd = dev_info.mtd_num;
-		mtd_info = &flash->mtd_info[mtd];
-		if (mtd < 0 || flash->mtd_info[mtd].skipubi)
-			continue;
-		memcpy(&mtd_info->dev_info, &dev_info, sizeof(struct ubi_dev_info));
+	scan_ubi_volumes(mtd_info);
 
-		scan_ubi_volumes(mtd_info);
-	}
+	return true;
 }
 
 #if defined(CONFIG_UBIATTACH)
@@ -367,7 +367,7 @@ static void scan_ubi_partitions(int mtd)
 		if (err) {
 			if (mtd_info->has_ubi && !tryattach) {
 				TRACE("cannot attach mtd%d ..try erasing", mtd);
-				if (flash_erase(mtd)) {
+				if (erase_sectors(mtd, 0, 0)) {
 					ERROR("mtd%d cannot be erased", mtd);
 					return;
 				}
@@ -390,12 +390,16 @@ static void scan_ubi_partitions(int mtd)
 #endif
 #endif
 
-int scan_mtd_devices (void)
+/*
+ * Read the list of MTD devices and apply the UBI black- and whitelist.
+ * Information about each device and its UBI volumes is read later,
+ * the first time it is asked for.
+ */
+static int load_table(void)
 {
 	int err;
 	struct flash_description *flash = get_flash_info();
 	struct mtd_info *mtd_info = &flash->mtd;
-	struct mtd_ubi_info *mtd_ubi_info;
 	libmtd_t libmtd = flash->libmtd;
 	char list[100];
 	char *token;
@@ -403,15 +407,18 @@ int scan_mtd_devices (void)
 	int i, index;
 	bool black;
 
+	if (flash->mtd_info)
+		return 0;
+
 	if (!libmtd) {
 		WARN("MTD is not present on the target");
-		return -1;
+		return -ENODEV;
 	}
 	err = mtd_get_info(libmtd, mtd_info);
 	if (err) {
 		if (errno == ENODEV)
 			ERROR("MTD is not present on the board");
-		return 0;
+		return -ENODEV;
 	}
 
 	/* Allocate memory to store MTD infos */
@@ -423,6 +430,9 @@ int scan_mtd_devices (void)
 		return -ENOMEM;
 	}
 
+	for (i = 0; i <= mtd_info->highest_mtd_num; i++)
+		LIST_INIT(&flash->mtd_info[i].ubi_partitions);
+
 	for (i = 0; i < 2; i++) {
 		memset(list, 0, sizeof(list));
 		switch (i) {
@@ -463,42 +473,160 @@ int scan_mtd_devices (void)
 		}
 	}
 
-	for (i = mtd_info->lowest_mtd_num;
-	     i <= mtd_info->highest_mtd_num; i++) {
-		/* initialize data */
-		mtd_ubi_info = &flash->mtd_info[i];
-		LIST_INIT(&mtd_ubi_info->ubi_partitions);
-		if (!mtd_dev_present(libmtd, i))
-			continue;
-		err = mtd_get_dev_info1(libmtd, i, &flash->mtd_info[i].mtd);
-		if (err) {
-			TRACE("No information from MTD%d", i);
-			continue;
+	return 0;
+}
+
+static struct mtd_ubi_info *get_device(int mtdnum)
+{
+	struct flash_description *flash = get_flash_info();
+	struct mtd_ubi_info *mtd_ubi_info;
+
+	if (load_table())
+		return NULL;
+	if (mtdnum < flash->mtd.lowest_mtd_num ||
+	    mtdnum > flash->mtd.highest_mtd_num)
+		return NULL;
+
+	mtd_ubi_info = &flash->mtd_info[mtdnum];
+	if (!mtd_ubi_info->valid) {
+		if (!mtd_dev_present(flash->libmtd, mtdnum))
+			return NULL;
+		if (mtd_get_dev_info1(flash->libmtd, mtdnum, &mtd_ubi_info->mtd)) {
+			TRACE("No information from MTD%d", mtdnum);
+			return NULL;
 		}
+		mtd_ubi_info->valid = 1;
 	}
 
+	return mtd_ubi_info;
+}
+
+static struct mtd_ubi_info *get_ubi_device(int mtdnum)
+{
+	struct mtd_ubi_info *mtd_ubi_info = get_device(mtdnum);
 #if defined(CONFIG_UBIVOL)
-	/*
-	 * Now search for MTD that are already attached
-	 */
-	scan_for_ubi_devices();
+	struct flash_description *flash = get_flash_info();
+
+	if (!mtd_ubi_info || mtd_ubi_info->scanned ||
+	    mtd_ubi_info->skipubi || !flash->libubi)
+		return mtd_ubi_info;
 
-#if defined(CONFIG_UBIATTACH)
 	/*
-	 * Search for volumes in MTD that are not attached, default case
+	 * Discovery runs once until the device is invalidated,
+	 * even if the MTD has no UBI and cannot be attached.
 	 */
+	mtd_ubi_info->scanned = 1;
+	if (scan_attached_ubi(mtdnum))
+		return mtd_ubi_info;
 
-	for (i = mtd_info->lowest_mtd_num;
-	     i <= mtd_info->highest_mtd_num; i++) {
-		if (flash->libubi && !flash->mtd_info[i].skipubi &&
-				!flash->mtd_info[i].scanned &&
-				flash->mtd_info[i].mtd.type != MTD_UBIVOLUME)
-			scan_ubi_partitions(i);
-	}
+#if defined(CONFIG_UBIATTACH)
+	if (mtd_ubi_info->mtd.type != MTD_UBIVOLUME)
+		scan_ubi_partitions(mtdnum);
 #endif
 #endif
 
-	return mtd_info->mtd_dev_cnt;
+	return mtd_ubi_info;
+}
+
+static void invalidate(int mtdnum)
+{
+	struct flash_description *flash = get_flash_info();
+	struct mtd_ubi_info *mtd_ubi_info;
+	struct ubi_part *vol, *tmp;
+	int i;
+
+	if (!flash->mtd_info)
+		return;
+
+	for (i = flash->mtd.lowest_mtd_num; i <= flash->mtd.highest_mtd_num; i++) {
+		if (mtdnum >= 0 && i != mtdnum)
+			continue;
+		mtd_ubi_info = &flash->mtd_info[i];
+		LIST_FOREACH_SAFE(vol, &mtd_ubi_info->ubi_partitions, next, tmp) {
+			LIST_REMOVE(vol, next);
+			free(vol);
+		}
+		memset(&mtd_ubi_info->dev_info, 0, sizeof(mtd_ubi_info->dev_info));
+		mtd_ubi_info->scanned = 0;
+	}
+}
+
+int mtd_load_table(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&mtd_lock);
+	ret = load_table();
+	pthread_mutex_unlock(&mtd_lock);
+
+	return ret;
+}
+
+struct mtd_ubi_info *mtd_get_device(int mtdnum)
+{
+	struct mtd_ubi_info *mtd_ubi_info;
+
+	pthread_mutex_lock(&mtd_lock);
+	mtd_ubi_info = get_device(mtdnum);
+	pthread_mutex_unlock(&mtd_lock);
+
+	return mtd_ubi_info;
+}
+
+struct mtd_ubi_info *mtd_get_ubi_device(int mtdnum)
+{
+	struct mtd_ubi_info *mtd_ubi_info;
+
+	pthread_mutex_lock(&mtd_lock);
+	mtd_ubi_info = get_ubi_device(mtdnum);
+	pthread_mutex_unlock(&mtd_lock);
+
+	return mtd_ubi_info;
+}
+
+/*
+ * Drop what is known about the UBI volumes of a MTD, they are
+ * scanned again the next time they are asked for.
+ * A negative mtdnum forgets all devices.
+ */
+void mtd_invalidate(int mtdnum)
+{
+	pthread_mutex_lock(&mtd_lock);
+	invalidate(mtdnum);
+	pthread_mutex_unlock(&mtd_lock);
+}
+
+void ubi_invalidate(int dev_num)
+{
+	struct flash_description *flash = get_flash_info();
+	int i;
+
+	pthread_mutex_lock(&mtd_lock);
+	for (i = flash->mtd.lowest_mtd_num; i <= flash->mtd.highest_mtd_num; i++) {
+		if (flash->mtd_info[i].scanned &&
+		    flash->mtd_info[i].dev_info.dev_num == dev_num)
+			invalidate(i);
+	}
+	pthread_mutex_unlock(&mtd_lock);
+}
+
+/*
+ * Discover all MTD devices and their UBI volumes
+ */
+int scan_mtd_devices (void)
+{
+	struct flash_description *flash = get_flash_info();
+	int i, err;
+
+	err = mtd_load_table();
+	if (err)
+		return err;
+
+	for (i = flash->mtd.lowest_mtd_num;
+	     i <= flash->mtd.highest_mtd_num; i++)
+		mtd_get_ubi_device(i);
+
+	return flash->mtd.mtd_dev_cnt;
 }
 
 void ubi_mount(struct ubi_vol_info *vol, const char *mntpoint)
@@ -525,19 +653,11 @@ void ubi_umount(const char *mntpoint)
 
 void mtd_cleanup (void)
 {
-	int i;
-	struct ubilist *list;
-	struct ubi_part *vol, *tmp;
 	struct flash_description *flash = get_flash_info();
 
+	pthread_mutex_lock(&mtd_lock);
 	if (flash->mtd_info) {
-		for (i = flash->mtd.lowest_mtd_num; i <= flash->mtd.highest_mtd_num; i++) {
-			list = &flash->mtd_info[i].ubi_partitions;
-			LIST_FOREACH_SAFE(vol, list, next, tmp) {
-				LIST_REMOVE(vol, next);
-				free(vol);
-			}
-		}
+		invalidate(-1);
 		free(flash->mtd_info);
 		flash->mtd_info = NULL;
 	}
@@ -545,4 +665,5 @@ void mtd_cleanup (void)
 	/* Do not clear libraries handles */
 	memset(&flash->ubi_info, 0, sizeof(struct ubi_info));
 	memset(&flash->mtd, 0, sizeof(struct mtd_info));
+	pthread_mutex_unlock(&mtd_lock);
 }
@@ -76,6 +76,40 @@ enum state {
 	s_end
 };
 
+/*
+ * Skip part data up to the next CR that can start the delimiter
+ * (CR LF boundary): memchr() jumps over the body, candidates that do
+ * not match are skipped without leaving the fast path. A delimiter
+ * that crosses the end of the buffer is left to the state machine.
+ * Returns len if there is none.
+ */
+static size_t find_delimiter(multipart_parser *p, const char *buf,
+			     size_t i, size_t len)
+{
+	const char *cr;
+	size_t avail;
+
+	while (i < len) {
+		cr = memchr(buf + i, CR, len - i);
+		if (!cr)
+			return len;
+		i = cr - buf;
+		avail = len - i - 1;
+		if (!avail)
+			return i;
+		if (buf[i + 1] == LF) {
+			avail--;
+			if (avail > p->boundary_length)
+				avail = p->boundary_length;
+			if (!memcmp(buf + i + 2, p->multipart_boundary, avail))
+				return i;
+		}
+		i++;
+	}
+
+	return len;
+}
+
 multipart_parser *multipart_parser_init
     (const char *boundary, const multipart_parser_settings * settings) {
 
@@ -232,16 +266,19 @@ size_t multipart_parser_execute(multipart_parser * p, const char *buf,
 			/* fallthrough */
 		case s_part_data:
 			multipart_log("s_part_data");
-			if (c == CR) {
-				EMIT_DATA_CB(part_data, buf + mark, i - mark);
-				mark = i;
-				p->state = s_part_data_almost_boundary;
-				p->lookbehind[0] = CR;
-				break;
+			if (c != CR) {
+				i = find_delimiter(p, buf, i, len);
+				if (i == len) {
+					i--;
+					EMIT_DATA_CB(part_data, buf + mark,
+						     len - mark);
+					return len;
+				}
 			}
-			if (is_last)
-				EMIT_DATA_CB(part_data, buf + mark,
-					     (i - mark) + 1);
+			EMIT_DATA_CB(part_data, buf + mark, i - mark);
+			mark = i;
+			p->state = s_part_data_almost_boundary;
+			p->lookbehind[0] = CR;
 			break;
 
 		case s_part_data_almost_boundary:
@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "swupdate.h"
 #include "sslapi.h"
 #include "util.h"
@@ -72,8 +74,16 @@ static int cms_verify_callback(int ok, X509_STORE_CTX *ctx) {
 	return ok;
 }
 
+/*
+ * Load the certificates and the CRLs of a PEM file in one pass.
+ * If the file contains CRLs, the certificate of the signer is
+ * checked against them.
+ */
 X509_STORE *load_cert_chain(const char *file)
 {
+	STACK_OF(X509_INFO) *infos;
+	X509_INFO *info;
+	int crt_count = 0, crl_count = 0;
 	X509_STORE *castore = X509_STORE_new();
 	if (!castore) {
 		return NULL;
@@ -88,38 +98,120 @@ X509_STORE *load_cert_chain(const char *file)
 	BIO *castore_bio = BIO_new_file(file, "r");
 	if (!castore_bio) {
 		TRACE("failed: BIO_new_file(%s)", file);
+		X509_STORE_free(castore);
+		return NULL;
+	}
+
+	infos = PEM_X509_INFO_read_bio(castore_bio, NULL, NULL, NULL);
+	BIO_free(castore_bio);
+	if (!infos) {
+		X509_STORE_free(castore);
 		return NULL;
 	}
 
-	int crt_count = 0;
-	X509 *crt = NULL;
-	do {
-		crt = PEM_read_bio_X509(castore_bio, NULL, 0, NULL);
-		if (crt) {
+	for (int i = 0; i < sk_X509_INFO_num(infos); i++) {
+		info = sk_X509_INFO_value(infos, i);
+		if (info->x509) {
 			crt_count++;
-			char *subj = X509_NAME_oneline(X509_get_subject_name(crt), NULL, 0);
-			char *issuer = X509_NAME_oneline(X509_get_issuer_name(crt), NULL, 0);
+			char *subj = X509_NAME_oneline(X509_get_subject_name(info->x509), NULL, 0);
+			char *issuer = X509_NAME_oneline(X509_get_issuer_name(info->x509), NULL, 0);
 			TRACE("Read PEM #%d: %s %s", crt_count, issuer, subj);
 			free(subj);
 			free(issuer);
-			if (X509_STORE_add_cert(castore, crt) == 0) {
+			if (X509_STORE_add_cert(castore, info->x509) == 0) {
 				TRACE("Adding certificate to X509_STORE failed");
-				BIO_free(castore_bio);
-				X509_STORE_free(castore);
-				return NULL;
+				crt_count = 0;
+				break;
 			}
 		}
-	} while (crt);
-	BIO_free(castore_bio);
+		if (info->crl) {
+			crl_count++;
+			if (X509_STORE_add_crl(castore, info->crl) == 0) {
+				TRACE("Adding CRL to X509_STORE failed");
+				crt_count = 0;
+				break;
+			}
+		}
+	}
+	sk_X509_INFO_pop_free(infos, X509_INFO_free);
 
 	if (crt_count == 0) {
 		X509_STORE_free(castore);
 		return NULL;
 	}
 
+	if (crl_count) {
+		TRACE("%d CRLs loaded, checking revocation of the signer", crl_count);
+		X509_STORE_set_flags(castore, X509_V_FLAG_CRL_CHECK);
+	}
+
 	return castore;
 }
 
+/*
+ * Replace the store of dgst with the certificates of file,
+ * and remember the state of the file to notice if it changes.
+ */
+int cms_load_certs(struct swupdate_digest *dgst, const char *file, int purpose)
+{
+	X509_STORE *certs;
+	struct stat st;
+
+	if (stat(file, &st) < 0) {
+		ERROR("%s cannot be accessed: %s", file, strerror(errno));
+		return -ENOENT;
+	}
+
+	certs = load_cert_chain(file);
+	if (!certs) {
+		ERROR("Error loading certificate chain from %s", file);
+		return -EINVAL;
+	}
+
+	if (!X509_STORE_set_purpose(certs, purpose)) {
+		ERROR("failed to set purpose");
+		X509_STORE_free(certs);
+		return -EINVAL;
+	}
+
+	if (dgst->certfile != file) {
+		free(dgst->certfile);
+		dgst->certfile = strdup(file);
+	}
+	X509_STORE_free(dgst->certs);
+	dgst->certs = certs;
+	dgst->cert_purpose = purpose;
+	dgst->cert_dev = st.st_dev;
+	dgst->cert_ino = st.st_ino;
+	dgst->cert_size = st.st_size;
+	dgst->cert_mtime = st.st_mtim;
+
+	return 0;
+}
+
+/*
+ * The store is kept from one verification to the next one,
+ * it is loaded again only if the certificate file was changed.
+ */
+static int cms_refresh_certs(struct swupdate_digest *dgst)
+{
+	struct stat st;
+
+	if (!dgst->certfile)
+		return 0;
+
+	if (stat(dgst->certfile, &st) == 0 &&
+	    st.st_dev == dgst->cert_dev && st.st_ino == dgst->cert_ino &&
+	    st.st_size == dgst->cert_size &&
+	    st.st_mtim.tv_sec == dgst->cert_mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == dgst->cert_mtime.tv_nsec)
+		return 0;
+
+	INFO("%s changed, loading the certificates again", dgst->certfile);
+
+	return cms_load_certs(dgst, dgst->certfile, dgst->cert_purpose);
+}
+
 static inline int next_common_name(X509_NAME *subject, int i)
 {
 	return X509_NAME_get_index_by_NID(subject, NID_commonName, i);
@@ -229,23 +321,18 @@ static int check_verified_signer(CMS_ContentInfo* cms, X509_STORE* store)
 }
 #endif
 
-int swupdate_verify_file(struct swupdate_digest *dgst, const char *sigfile,
-		const char *file, const char *signer_name)
+static int cms_verify_bio(struct swupdate_digest *dgst, BIO *sig_bio,
+		const char *sigfile, BIO *content_bio, const char *signer_name)
 {
 	int status = -EFAULT;
 	CMS_ContentInfo *cms = NULL;
-	BIO *content_bio = NULL;
 
-	/* Open CMS blob that needs to be checked */
-	BIO *sigfile_bio = BIO_new_file(sigfile, "rb");
-	if (!sigfile_bio) {
-		ERROR("%s cannot be opened", sigfile);
-		status = -EBADF;
-		goto out;
-	}
+	/* A changed trust store must not be ignored */
+	if (cms_refresh_certs(dgst))
+		return -EFAULT;
 
 	/* Parse the DER-encoded CMS message */
-	cms = d2i_CMS_bio(sigfile_bio, NULL);
+	cms = d2i_CMS_bio(sig_bio, NULL);
 	if (!cms) {
 		ERROR("%s cannot be parsed as DER-encoded CMS signature blob", sigfile);
 		status = -EFAULT;
@@ -258,14 +345,6 @@ int swupdate_verify_file(struct swupdate_digest *dgst, const char *sigfile,
 		goto out;
 	}
 
-	/* Open the content file (data which was signed) */
-	content_bio = BIO_new_file(file, "rb");
-	if (!content_bio) {
-		ERROR("%s cannot be opened", file);
-		status = -EBADF;
-		goto out;
-	}
-
 	/* Then try to verify signature */
 	if (!CMS_verify(cms, NULL, dgst->certs, content_bio,
 			NULL, CMS_BINARY | VERIFY_UNKNOWN_SIGNER_FLAGS)) {
@@ -293,11 +372,50 @@ out:
 	if (cms) {
 		CMS_ContentInfo_free(cms);
 	}
-	if (content_bio) {
-		BIO_free(content_bio);
+	return status;
+}
+
+int swupdate_verify_file(struct swupdate_digest *dgst, const char *sigfile,
+		const char *file, const char *signer_name)
+{
+	int status;
+	BIO *content_bio = NULL;
+
+	/* Open CMS blob that needs to be checked */
+	BIO *sigfile_bio = BIO_new_file(sigfile, "rb");
+	if (!sigfile_bio) {
+		ERROR("%s cannot be opened", sigfile);
+		return -EBADF;
 	}
-	if (sigfile_bio) {
+
+	/* Open the content file (data which was signed) */
+	content_bio = BIO_new_file(file, "rb");
+	if (!content_bio) {
+		ERROR("%s cannot be opened", file);
 		BIO_free(sigfile_bio);
+		return -EBADF;
 	}
+
+	status = cms_verify_bio(dgst, sigfile_bio, sigfile, content_bio, signer_name);
+
+	BIO_free(content_bio);
+	BIO_free(sigfile_bio);
+	return status;
+}
+
+int swupdate_verify_buffer(struct swupdate_digest *dgst, const char *sig,
+		size_t siglen, const char *data, size_t len, const char *signer_name)
+{
+	int status = -ENOMEM;
+	BIO *sig_bio, *content_bio;
+
+	sig_bio = BIO_new_mem_buf(sig, (int)siglen);
+	content_bio = BIO_new_mem_buf(data, (int)len);
+	if (sig_bio && content_bio)
+		status = cms_verify_bio(dgst, sig_bio, "signature", content_bio,
+					signer_name);
+
+	BIO_free(content_bio);
+	BIO_free(sig_bio);
 	return status;
 }
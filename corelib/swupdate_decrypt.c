@@ -16,7 +16,8 @@
 #include "sslapi.h"
 #include "util.h"
 
-struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, unsigned char *iv)
+static struct swupdate_digest *decrypt_init(unsigned char *key, char keylen,
+					    unsigned char *iv, bool ctr)
 {
 	struct swupdate_digest *dgst;
 	const EVP_CIPHER *cipher;
@@ -29,13 +30,13 @@ struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, u
 
 	switch (keylen) {
 	case AES_128_KEY_LEN:
-		cipher = EVP_aes_128_cbc();
+		cipher = ctr ? EVP_aes_128_ctr() : EVP_aes_128_cbc();
 		break;
 	case AES_192_KEY_LEN:
-		cipher = EVP_aes_192_cbc();
+		cipher = ctr ? EVP_aes_192_ctr() : EVP_aes_192_cbc();
 		break;
 	case AES_256_KEY_LEN:
-		cipher = EVP_aes_256_cbc();
+		cipher = ctr ? EVP_aes_256_ctr() : EVP_aes_256_cbc();
 		break;
 	default:
 		return NULL;
@@ -46,6 +47,16 @@ struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, u
 		return NULL;
 	}
 
+#ifdef CONFIG_DECRYPT_AFALG
+	/* the kernel cipher is set up for cbc(aes) only */
+	if (!ctr && swupdate_DECRYPT_use_afalg()) {
+		dgst->afalg_dec = afalg_cipher_init(key, keylen, iv);
+		if (dgst->afalg_dec)
+			return dgst;
+		DEBUG("AF_ALG cannot decrypt, falling back to the SSL library");
+	}
+#endif
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 	EVP_CIPHER_CTX_init(&dgst->ctxdec);
 #else
@@ -78,9 +89,46 @@ struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, u
 	return dgst;
 }
 
+struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, unsigned char *iv)
+{
+	return decrypt_init(key, keylen, iv, false);
+}
+
+struct swupdate_digest *swupdate_DECRYPT_init_ctr(unsigned char *key, char keylen,
+						  unsigned char *iv,
+						  unsigned long long offset)
+{
+	struct swupdate_digest *dgst;
+	unsigned char counter[AES_BLK_SIZE];
+	unsigned char skip[AES_BLK_SIZE] = { 0 };
+	int len;
+
+	if (iv == NULL) {
+		ERROR("no IV provided for decryption!");
+		return NULL;
+	}
+
+	swupdate_DECRYPT_ctr_counter(counter, iv, offset);
+	dgst = decrypt_init(key, keylen, counter, true);
+	if (!dgst || !(offset % AES_BLK_SIZE))
+		return dgst;
+
+	/* drop the key stream before offset in the first block */
+	if (swupdate_DECRYPT_update(dgst, skip, &len, skip, offset % AES_BLK_SIZE)) {
+		swupdate_DECRYPT_cleanup(dgst);
+		return NULL;
+	}
+
+	return dgst;
+}
+
 int swupdate_DECRYPT_update(struct swupdate_digest *dgst, unsigned char *buf, 
 				int *outlen, const unsigned char *cryptbuf, int inlen)
 {
+#ifdef CONFIG_DECRYPT_AFALG
+	if (dgst->afalg_dec)
+		return afalg_cipher_update(dgst->afalg_dec, buf, outlen, cryptbuf, inlen);
+#endif
 	if (EVP_DecryptUpdate(SSL_GET_CTXDEC(dgst), buf, outlen, cryptbuf, inlen) != 1) {
 		const char *reason = ERR_reason_error_string(ERR_peek_error());
 		ERROR("Update: Decryption error 0x%lx, reason: %s", ERR_get_error(),
@@ -97,6 +145,10 @@ int swupdate_DECRYPT_final(struct swupdate_digest *dgst, unsigned char *buf,
 	if (!dgst)
 		return -EINVAL;
 
+#ifdef CONFIG_DECRYPT_AFALG
+	if (dgst->afalg_dec)
+		return afalg_cipher_final(dgst->afalg_dec, buf, outlen);
+#endif
 	if (EVP_DecryptFinal_ex(SSL_GET_CTXDEC(dgst), buf, outlen) != 1) {
 		const char *reason = ERR_reason_error_string(ERR_peek_error());
 		ERROR("Final: Decryption error 0x%lx, reason: %s", ERR_get_error(),
@@ -111,6 +163,13 @@ int swupdate_DECRYPT_final(struct swupdate_digest *dgst, unsigned char *buf,
 void swupdate_DECRYPT_cleanup(struct swupdate_digest *dgst)
 {
 	if (dgst) {
+#ifdef CONFIG_DECRYPT_AFALG
+		if (dgst->afalg_dec) {
+			afalg_cipher_cleanup(dgst->afalg_dec);
+			free(dgst);
+			return;
+		}
+#endif
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 		EVP_CIPHER_CTX_cleanup(SSL_GET_CTXDEC(dgst));
 #else
@@ -0,0 +1,295 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * Offload the AES-CBC decryption of the artifacts to the kernel
+ * crypto API via AF_ALG skcipher sockets, so that crypto engines
+ * (CAAM, ARM CE, ...) are used. The kernel does not handle the
+ * padding: the last block is kept back until the end of the artifact
+ * and the PKCS#7 padding is removed here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#include "sslapi.h"
+#include "util.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+/*
+ * Data sent to the kernel at once: the socket buffer is limited,
+ * a bigger request would block before the result is read back
+ */
+#define AFALG_CHUNK	(64 * 1024)
+
+struct afalg_cipher {
+	int opfd;
+	bool started;		/* operation and IV were sent */
+	unsigned char iv[AES_BLK_SIZE];
+	unsigned char pending[AES_BLK_SIZE];	/* incomplete input block */
+	int npending;
+	unsigned char last[AES_BLK_SIZE];	/* may contain the padding */
+	bool has_last;
+};
+
+static bool use_afalg = false;
+
+int swupdate_DECRYPT_set_backend(const char *name)
+{
+	if (!name || !strlen(name) || !strcmp(name, "default")) {
+		use_afalg = false;
+		return 0;
+	}
+	if (!strcmp(name, "afalg")) {
+		use_afalg = true;
+		return 0;
+	}
+
+	ERROR("Unknown decryption backend '%s'", name);
+	return -EINVAL;
+}
+
+bool swupdate_DECRYPT_use_afalg(void)
+{
+	return use_afalg;
+}
+
+const char *swupdate_DECRYPT_backend_name(void)
+{
+	return use_afalg ? "afalg" : "default";
+}
+
+/*
+ * Returns NULL if the kernel does not provide cbc(aes)
+ * for the key, the caller falls back to the SSL library
+ */
+struct afalg_cipher *afalg_cipher_init(const unsigned char *key, int keylen,
+				       const unsigned char *iv)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "skcipher",
+		.salg_name = "cbc(aes)",
+	};
+	struct afalg_cipher *c;
+	int tfmfd;
+
+	tfmfd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (tfmfd < 0) {
+		DEBUG("AF_ALG not available: %s", strerror(errno));
+		return NULL;
+	}
+	if (bind(tfmfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		DEBUG("AF_ALG does not provide cbc(aes): %s", strerror(errno));
+		close(tfmfd);
+		return NULL;
+	}
+	if (setsockopt(tfmfd, SOL_ALG, ALG_SET_KEY, key, keylen) < 0) {
+		DEBUG("AF_ALG does not accept the key: %s", strerror(errno));
+		close(tfmfd);
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(tfmfd);
+		return NULL;
+	}
+	c->opfd = accept4(tfmfd, NULL, 0, SOCK_CLOEXEC);
+	close(tfmfd);
+	if (c->opfd < 0) {
+		DEBUG("AF_ALG accept failed: %s", strerror(errno));
+		free(c);
+		return NULL;
+	}
+	memcpy(c->iv, iv, AES_BLK_SIZE);
+
+	return c;
+}
+
+/*
+ * The first message sets the operation and the IV, the following
+ * ones continue the same operation (MSG_MORE), so that the kernel
+ * chains the blocks across the requests.
+ */
+static int afalg_send(struct afalg_cipher *c, const unsigned char *buf, size_t len)
+{
+	char cbuf[CMSG_SPACE(sizeof(uint32_t)) +
+		  CMSG_SPACE(sizeof(struct af_alg_iv) + AES_BLK_SIZE)];
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	struct af_alg_iv *alg_iv;
+	ssize_t ret;
+
+	if (!c->started) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_ALG;
+		cmsg->cmsg_type = ALG_SET_OP;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+		*(uint32_t *)CMSG_DATA(cmsg) = ALG_OP_DECRYPT;
+
+		cmsg = CMSG_NXTHDR(&msg, cmsg);
+		cmsg->cmsg_level = SOL_ALG;
+		cmsg->cmsg_type = ALG_SET_IV;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + AES_BLK_SIZE);
+		alg_iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+		alg_iv->ivlen = AES_BLK_SIZE;
+		memcpy(alg_iv->iv, c->iv, AES_BLK_SIZE);
+	}
+
+	while (iov.iov_len) {
+		ret = sendmsg(c->opfd, &msg, MSG_MORE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("AF_ALG decryption failed: %s", strerror(errno));
+			return -EIO;
+		}
+		c->started = true;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		iov.iov_base = (char *)iov.iov_base + ret;
+		iov.iov_len -= ret;
+	}
+
+	return 0;
+}
+
+/* len must be a multiple of the block size */
+static int afalg_decrypt(struct afalg_cipher *c, const unsigned char *in,
+			 size_t len, unsigned char *out)
+{
+	size_t chunk, done;
+	ssize_t ret;
+
+	while (len) {
+		chunk = min(len, (size_t)AFALG_CHUNK);
+		if (afalg_send(c, in, chunk) < 0)
+			return -EIO;
+		for (done = 0; done < chunk; done += ret) {
+			ret = read(c->opfd, out + done, chunk - done);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0) {
+				ERROR("AF_ALG cannot read plaintext: %s",
+				      ret ? strerror(errno) : "no data");
+				return -EIO;
+			}
+		}
+		in += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Same contract as EVP_DecryptUpdate(): out must have room for
+ * inlen + AES_BLK_SIZE bytes
+ */
+int afalg_cipher_update(struct afalg_cipher *c, unsigned char *out, int *outlen,
+			const unsigned char *in, int inlen)
+{
+	unsigned char *o = out;
+	int n;
+
+	if (c->has_last) {
+		memcpy(o, c->last, AES_BLK_SIZE);
+		o += AES_BLK_SIZE;
+		c->has_last = false;
+	}
+
+	if (c->npending) {
+		n = min(AES_BLK_SIZE - c->npending, inlen);
+		memcpy(c->pending + c->npending, in, n);
+		c->npending += n;
+		in += n;
+		inlen -= n;
+		if (c->npending == AES_BLK_SIZE) {
+			if (afalg_decrypt(c, c->pending, AES_BLK_SIZE, o) < 0)
+				return -EFAULT;
+			o += AES_BLK_SIZE;
+			c->npending = 0;
+		}
+	}
+
+	n = inlen & ~(AES_BLK_SIZE - 1);
+	if (n) {
+		if (afalg_decrypt(c, in, n, o) < 0)
+			return -EFAULT;
+		o += n;
+		in += n;
+		inlen -= n;
+	}
+	if (inlen) {
+		memcpy(c->pending + c->npending, in, inlen);
+		c->npending += inlen;
+	}
+
+	/* the last block is returned by the next update or by final */
+	if (o - out >= AES_BLK_SIZE) {
+		o -= AES_BLK_SIZE;
+		memcpy(c->last, o, AES_BLK_SIZE);
+		c->has_last = true;
+	}
+	*outlen = o - out;
+
+	return 0;
+}
+
+/* Removes the PKCS#7 padding */
+int afalg_cipher_final(struct afalg_cipher *c, unsigned char *out, int *outlen)
+{
+	unsigned char pad = c->last[AES_BLK_SIZE - 1];
+
+	*outlen = 0;
+	if (c->npending || !c->has_last) {
+		ERROR("AES: encrypted data is not a multiple of the block size");
+		return -EFAULT;
+	}
+	if (pad == 0 || pad > AES_BLK_SIZE) {
+		ERROR("AES: Invalid PKCS#7 padding.");
+		return -EFAULT;
+	}
+	for (int i = 2; i <= pad; i++) {
+		if (c->last[AES_BLK_SIZE - i] != pad) {
+			ERROR("AES: Invalid PKCS#7 padding.");
+			return -EFAULT;
+		}
+	}
+
+	*outlen = AES_BLK_SIZE - pad;
+	memcpy(out, c->last, *outlen);
+	c->has_last = false;
+
+	return 0;
+}
+
+void afalg_cipher_cleanup(struct afalg_cipher *c)
+{
+	if (c) {
+		close(c->opfd);
+		free(c);
+	}
+}
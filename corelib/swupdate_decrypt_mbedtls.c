@@ -7,7 +7,8 @@
 #include "sslapi.h"
 #include "util.h"
 
-struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, unsigned char *iv)
+static struct swupdate_digest *decrypt_init(unsigned char *key, char keylen,
+					    unsigned char *iv, bool ctr)
 {
 	struct swupdate_digest *dgst;
 	mbedtls_cipher_type_t cipher_type;
@@ -22,15 +23,18 @@ struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, u
 
 	switch (keylen) {
 	case AES_128_KEY_LEN:
-		cipher_type = MBEDTLS_CIPHER_AES_128_CBC;
+		cipher_type = ctr ? MBEDTLS_CIPHER_AES_128_CTR :
+				    MBEDTLS_CIPHER_AES_128_CBC;
 		key_bitlen = 128;
 		break;
 	case AES_192_KEY_LEN:
-		cipher_type = MBEDTLS_CIPHER_AES_192_CBC;
+		cipher_type = ctr ? MBEDTLS_CIPHER_AES_192_CTR :
+				    MBEDTLS_CIPHER_AES_192_CBC;
 		key_bitlen = 192;
 		break;
 	case AES_256_KEY_LEN:
-		cipher_type = MBEDTLS_CIPHER_AES_256_CBC;
+		cipher_type = ctr ? MBEDTLS_CIPHER_AES_256_CTR :
+				    MBEDTLS_CIPHER_AES_256_CBC;
 		key_bitlen = 256;
 		break;
 	default:
@@ -75,6 +79,39 @@ fail:
 	return NULL;
 }
 
+struct swupdate_digest *swupdate_DECRYPT_init(unsigned char *key, char keylen, unsigned char *iv)
+{
+	return decrypt_init(key, keylen, iv, false);
+}
+
+struct swupdate_digest *swupdate_DECRYPT_init_ctr(unsigned char *key, char keylen,
+						  unsigned char *iv,
+						  unsigned long long offset)
+{
+	struct swupdate_digest *dgst;
+	unsigned char counter[AES_BLK_SIZE];
+	unsigned char skip[AES_BLK_SIZE] = { 0 };
+	int len = sizeof(skip);
+
+	if (iv == NULL) {
+		ERROR("no IV provided for decryption!");
+		return NULL;
+	}
+
+	swupdate_DECRYPT_ctr_counter(counter, iv, offset);
+	dgst = decrypt_init(key, keylen, counter, true);
+	if (!dgst || !(offset % AES_BLK_SIZE))
+		return dgst;
+
+	/* drop the key stream before offset in the first block */
+	if (swupdate_DECRYPT_update(dgst, skip, &len, skip, offset % AES_BLK_SIZE)) {
+		swupdate_DECRYPT_cleanup(dgst);
+		return NULL;
+	}
+
+	return dgst;
+}
+
 int swupdate_DECRYPT_update(struct swupdate_digest *dgst, unsigned char *buf,
 				int *outlen, const unsigned char *cryptbuf, int inlen)
 {
@@ -115,6 +115,16 @@ err_free:
 	return NULL;
 }
 
+struct swupdate_digest *swupdate_DECRYPT_init_ctr(unsigned char __attribute__ ((__unused__)) *uri,
+					char __attribute__ ((__unused__)) keylen,
+					unsigned char __attribute__ ((__unused__)) *iv,
+					unsigned long long __attribute__ ((__unused__)) offset)
+{
+	ERROR("AES-CTR is not supported with a PKCS#11 token");
+
+	return NULL;
+}
+
 int swupdate_DECRYPT_update(struct swupdate_digest *dgst, unsigned char *buf,
 				int *outlen, const unsigned char *cryptbuf, int inlen)
 {
@@ -0,0 +1,139 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * Offload the computation of hashes to the kernel crypto API
+ * via AF_ALG sockets. The kernel uses the drivers for crypto engines
+ * (CAAM, ARM CE, ...) if available, and its own software
+ * implementation otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#include "sslapi.h"
+#include "util.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+#define AFALG_MAX_DIGEST_SIZE	64
+
+static bool use_afalg = false;
+
+int swupdate_HASH_set_backend(const char *name)
+{
+	if (!name || !strlen(name) || !strcmp(name, "default")) {
+		use_afalg = false;
+		return 0;
+	}
+	if (!strcmp(name, "afalg")) {
+		use_afalg = true;
+		return 0;
+	}
+
+	ERROR("Unknown hash backend '%s'", name);
+	return -EINVAL;
+}
+
+bool swupdate_HASH_use_afalg(void)
+{
+	return use_afalg;
+}
+
+const char *swupdate_HASH_backend_name(void)
+{
+	return use_afalg ? "afalg" : "default";
+}
+
+/*
+ * Returns the operation socket, or -1 if the kernel
+ * does not provide the requested algorithm
+ */
+int afalg_hash_init(const char *algo)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+	};
+	int tfmfd, opfd;
+
+	strlcpy((char *)sa.salg_name, algo, sizeof(sa.salg_name));
+
+	tfmfd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (tfmfd < 0) {
+		DEBUG("AF_ALG not available: %s", strerror(errno));
+		return -1;
+	}
+	if (bind(tfmfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		DEBUG("AF_ALG does not provide %s: %s", algo, strerror(errno));
+		close(tfmfd);
+		return -1;
+	}
+	opfd = accept4(tfmfd, NULL, 0, SOCK_CLOEXEC);
+	close(tfmfd);
+	if (opfd < 0) {
+		DEBUG("AF_ALG accept failed: %s", strerror(errno));
+		return -1;
+	}
+
+	return opfd;
+}
+
+int afalg_hash_update(int opfd, const unsigned char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(opfd, buf, len, MSG_MORE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("AF_ALG hash update failed: %s", strerror(errno));
+			return -EIO;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 on success like EVP_DigestFinal_ex()
+ */
+int afalg_hash_final(int opfd, unsigned char *md_value, unsigned int *md_len)
+{
+	ssize_t ret;
+
+	/* a send without MSG_MORE terminates the message */
+	if (send(opfd, NULL, 0, 0) < 0) {
+		ERROR("AF_ALG hash final failed: %s", strerror(errno));
+		return -EIO;
+	}
+	do {
+		ret = read(opfd, md_value, AFALG_MAX_DIGEST_SIZE);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		ERROR("AF_ALG cannot read digest: %s", strerror(errno));
+		return -EIO;
+	}
+	if (md_len)
+		*md_len = ret;
+
+	return 1;
+}
+
+void afalg_hash_cleanup(int opfd)
+{
+	if (opfd >= 0)
+		close(opfd);
+}
@@ -190,5 +190,35 @@ out:
 	return status;
 }
 
+int swupdate_verify_buffer(struct swupdate_digest *dgst, const char *sig,
+		size_t siglen, const char *data, size_t len, const char *signer_name)
+{
+	int i;
+
+	(void)signer_name;
+	if (!dgst) {
+		ERROR("Wrong crypto initialization: did you pass the key ?");
+		return -ENOKEY;
+	}
 
+	if (!siglen || siglen > (size_t)EVP_PKEY_size(dgst->pkey)) {
+		ERROR("Wrong size of the signature: %zu", siglen);
+		return -ENOKEY;
+	}
 
+	if ((dgst_init(dgst, EVP_sha256()) < 0) || (dgst_verify_init(dgst) < 0))
+		return -ENOKEY;
+
+	if (verify_update(dgst, (char *)data, len) < 0)
+		return -EFAULT;
+
+	TRACE("Verify signed image: %zu bytes", len);
+	i = verify_final(dgst, (unsigned char *)sig, (unsigned int)siglen);
+	if (i > 0) {
+		TRACE("Verified OK");
+		return 0;
+	}
+
+	TRACE("Verification Failure");
+	return i == 0 ? -EBADMSG : -EFAULT;
+}
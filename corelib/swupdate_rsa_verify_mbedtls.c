@@ -88,3 +88,49 @@ int swupdate_verify_file(struct swupdate_digest *dgst, const char *sigfile,
 		signature, sizeof(signature)
 	);
 }
+
+int swupdate_verify_buffer(struct swupdate_digest *dgst, const char *sig,
+		size_t siglen, const char *data, size_t len, const char *signer_name)
+{
+	int error;
+	uint8_t hash_computed[32];
+	const mbedtls_md_info_t *md_info;
+	mbedtls_pk_type_t pk_type = MBEDTLS_PK_RSA;
+	void *pss_options = NULL;
+#if defined(CONFIG_SIGALG_RSAPSS)
+	pk_type = MBEDTLS_PK_RSASSA_PSS;
+	mbedtls_pk_rsassa_pss_options options = {
+		.mgf1_hash_id = MBEDTLS_MD_SHA256,
+		.expected_salt_len = MBEDTLS_RSA_SALT_LEN_ANY
+	};
+	pss_options = &options;
+#endif
+
+	(void)signer_name;
+
+	if (siglen != 256) {
+		ERROR("Wrong size of the signature: %zu", siglen);
+		return -EMSGSIZE;
+	}
+
+	md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+	if (!md_info) {
+		ERROR("mbedtls_md_info_from_type");
+		return -ENOENT;
+	}
+
+	assert(mbedtls_md_get_size(md_info) == sizeof(hash_computed));
+
+	error = mbedtls_md(md_info, (const unsigned char *)data, len, hash_computed);
+	if (error) {
+		ERROR("mbedtls_md: %d", error);
+		return error;
+	}
+
+	return mbedtls_pk_verify_ext(
+		pk_type, pss_options,
+		&dgst->mbedtls_pk_context, mbedtls_md_get_type(md_info),
+		hash_computed, sizeof(hash_computed),
+		(const unsigned char *)sig, siglen
+	);
+}
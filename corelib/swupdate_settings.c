@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <pthread.h>
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
 #include "util.h"
@@ -34,6 +35,27 @@ struct run_as {
 	gid_t groupid;
 };
 
+/*
+ * A configuration file is parsed once and the tree is shared by all
+ * handles reading it: modules, threads and forked subprocesses, which
+ * inherit it from the main process. It is parsed again if the file
+ * changed on disk.
+ */
+struct cfg_cache {
+	char *filename;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	config_t cfg;
+	unsigned int users;
+	bool stale;
+	LIST_ENTRY(cfg_cache) next;
+};
+
+static LIST_HEAD(, cfg_cache) cfg_cached = LIST_HEAD_INITIALIZER(cfg_cached);
+static pthread_mutex_t cfg_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static config_setting_t *find_settings_node(config_t *cfg,
 						const char *field)
 {
@@ -78,7 +100,10 @@ int read_module_settings(swupdate_cfg_handle *handle, const char *module, settin
 	if (handle == NULL || !fcn)
 		return -EINVAL;
 
-	elem = find_settings_node(&handle->cfg, module);
+	if (!handle->cfg)
+		return -ENODATA;
+
+	elem = find_settings_node(handle->cfg, module);
 
 	if (!elem) {
 		DEBUG("No config settings found for module %s", module);
@@ -154,31 +179,125 @@ int settings_into_dict(void *settings, void *data)
 	return 0;
 }
 
+static void cfg_cache_free(struct cfg_cache *c)
+{
+	LIST_REMOVE(c, next);
+	config_destroy(&c->cfg);
+	free(c->filename);
+	free(c);
+}
+
+static bool cfg_cache_valid(struct cfg_cache *c, const char *filename,
+			    struct stat *st)
+{
+	return !c->stale && !strcmp(c->filename, filename) &&
+		c->dev == st->st_dev && c->ino == st->st_ino &&
+		c->size == st->st_size &&
+		c->mtime.tv_sec == st->st_mtim.tv_sec &&
+		c->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct cfg_cache *cfg_cache_get(const char *filename)
+{
+	struct cfg_cache *c, *tmp;
+	struct stat st;
+
+	if (stat(filename, &st) < 0) {
+		ERROR("Configuration file %s cannot be read: %s", filename,
+		      strerror(errno));
+		return NULL;
+	}
+
+	LIST_FOREACH_SAFE(c, &cfg_cached, next, tmp) {
+		if (cfg_cache_valid(c, filename, &st))
+			return c;
+		if (!strcmp(c->filename, filename)) {
+			/* changed on disk, freed once not used anymore */
+			c->stale = true;
+			if (!c->users)
+				cfg_cache_free(c);
+		}
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->filename = strdup(filename);
+	if (!c->filename) {
+		free(c);
+		return NULL;
+	}
+	config_init(&c->cfg);
+	if (read_settings_file(&c->cfg, filename) != CONFIG_TRUE) {
+		config_destroy(&c->cfg);
+		free(c->filename);
+		free(c);
+		return NULL;
+	}
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	c->size = st.st_size;
+	c->mtime = st.st_mtim;
+	LIST_INSERT_HEAD(&cfg_cached, c, next);
+
+	return c;
+}
+
 /*
  * Initialize handle with the settings found in filename.
  * This allocates memory which needs to be released by calling swupdate_cfg_destroy().
  */
 void swupdate_cfg_init(swupdate_cfg_handle *handle)
 {
-	config_init(&handle->cfg);
+	handle->cfg = NULL;
+	handle->cache = NULL;
 }
 
 /*
- * Read all settings from filename.
+ * Read all settings from filename, the file
+ * is parsed only if it was not yet.
  */
 int swupdate_cfg_read_file(swupdate_cfg_handle *handle, const char *filename)
 {
-	if (read_settings_file(&handle->cfg, filename) != CONFIG_TRUE) {
+	struct cfg_cache *c;
+
+	if (!filename)
+		return -EINVAL;
+
+	swupdate_cfg_destroy(handle);
+
+	pthread_mutex_lock(&cfg_cache_lock);
+	c = cfg_cache_get(filename);
+	if (c)
+		c->users++;
+	pthread_mutex_unlock(&cfg_cache_lock);
+
+	if (!c) {
 		ERROR("Error reading configuration file %s", filename);
 		return -EINVAL;
 	}
+	handle->cfg = &c->cfg;
+	handle->cache = c;
+
 	return 0;
 }
 
 /*
- * This releases (internally) allocated memory by handle.
+ * This releases the handle. The parsed file is kept for
+ * the next reads, unless it changed in the meantime.
  */
 void swupdate_cfg_destroy(swupdate_cfg_handle *handle)
 {
-	config_destroy(&handle->cfg);
+	struct cfg_cache *c = handle->cache;
+
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&cfg_cache_lock);
+	if (!--c->users && c->stale)
+		cfg_cache_free(c);
+	pthread_mutex_unlock(&cfg_cache_lock);
+
+	handle->cfg = NULL;
+	handle->cache = NULL;
 }
@@ -18,6 +18,7 @@ EVP_PKEY *load_pubkey(const char *file);
 #ifdef CONFIG_SIGALG_CMS
 int check_code_sign(const X509_PURPOSE *xp, const X509 *crt, int ca);
 X509_STORE *load_cert_chain(const char *file);
+int cms_load_certs(struct swupdate_digest *dgst, const char *file, int purpose);
 #endif
 
 #endif
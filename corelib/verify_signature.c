@@ -42,10 +42,27 @@ struct swupdate_digest *swupdate_HASH_init(const char *SHAlength)
 		return NULL;
 	}
 
-	if ((!SHAlength) || strcmp(SHAlength, "sha1"))
-		md = EVP_sha256();
-	else
+#ifdef CONFIG_HASH_AFALG
+	/* The kernel crypto API has no SHA-512/256 */
+	if (swupdate_HASH_use_afalg() &&
+	    (!SHAlength || strcmp(SHAlength, SHA512_256))) {
+		dgst->afalg_fd = afalg_hash_init((!SHAlength) ? SHA_DEFAULT : SHAlength);
+		if (dgst->afalg_fd >= 0) {
+			dgst->afalg = true;
+			return dgst;
+		}
+		WARN("Kernel hash not available, falling back to software");
+	}
+#endif
+
+	if (SHAlength && !strcmp(SHAlength, "sha1"))
 		md = EVP_sha1();
+#ifdef CONFIG_HASH_SHA512_256
+	else if (SHAlength && !strcmp(SHAlength, SHA512_256))
+		md = EVP_sha512_256();
+#endif
+	else
+		md = EVP_sha256();
 
  	dgst->ctx = EVP_MD_CTX_create();
 	if(dgst->ctx == NULL) {
@@ -69,6 +86,11 @@ int swupdate_HASH_update(struct swupdate_digest *dgst, const unsigned char *buf,
 	if (!dgst)
 		return -EFAULT;
 
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return afalg_hash_update(dgst->afalg_fd, buf, len);
+#endif
+
 	if (EVP_DigestUpdate (dgst->ctx, buf, len) != 1)
 		return -EIO;
 
@@ -81,6 +103,11 @@ int swupdate_HASH_final(struct swupdate_digest *dgst, unsigned char *md_value,
 	if (!dgst)
 		return -EFAULT;
 
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return afalg_hash_final(dgst->afalg_fd, md_value, md_len);
+#endif
+
 	return EVP_DigestFinal_ex (dgst->ctx, md_value, md_len);
 
 }
@@ -88,12 +115,103 @@ int swupdate_HASH_final(struct swupdate_digest *dgst, unsigned char *md_value,
 void swupdate_HASH_cleanup(struct swupdate_digest *dgst)
 {
 	if (dgst) {
+#ifdef CONFIG_HASH_AFALG
+		if (dgst->afalg)
+			afalg_hash_cleanup(dgst->afalg_fd);
+		else
+#endif
 		EVP_MD_CTX_destroy(dgst->ctx);
 		free(dgst);
 		dgst = NULL;
 	}
 }
 
+/*
+ * Start a new digest with the same algorithm, so that a context
+ * can be reused without allocating and fetching it again
+ */
+int swupdate_HASH_reset(struct swupdate_digest *dgst)
+{
+	if (!dgst)
+		return -EFAULT;
+
+#ifdef CONFIG_HASH_AFALG
+	/* the socket cannot be reset if a digest was not finished */
+	if (dgst->afalg)
+		return -ENOTSUP;
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	return dgst_init(dgst, EVP_MD_CTX_get0_md(dgst->ctx));
+#else
+	return dgst_init(dgst, EVP_MD_CTX_md(dgst->ctx));
+#endif
+}
+
+/*
+ * Export the intermediate state of a digest, so that it can be
+ * continued later by another context. This is possible only if
+ * the state is kept by libcrypto itself: the providers of
+ * OpenSSL 3 and the kernel do not allow to access it.
+ */
+int swupdate_HASH_save(struct swupdate_digest *dgst, void *state, size_t *len)
+{
+	if (!dgst || !len)
+		return -EFAULT;
+
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return -ENOTSUP;
+#endif
+
+#if defined(CONFIG_SSL_IMPL_OPENSSL) && \
+	OPENSSL_VERSION_NUMBER >= 0x10100000L && OPENSSL_VERSION_NUMBER < 0x30000000L
+	void *md_data = EVP_MD_CTX_md_data(dgst->ctx);
+	int size = EVP_MD_meth_get_app_datasize(EVP_MD_CTX_md(dgst->ctx));
+
+	if (!md_data || size <= 0)
+		return -ENOTSUP;
+	if (*len < (size_t)size)
+		return -ENOSPC;
+	memcpy(state, md_data, size);
+	*len = size;
+
+	return 0;
+#else
+	(void)state;
+	return -ENOTSUP;
+#endif
+}
+
+int swupdate_HASH_restore(struct swupdate_digest *dgst, const void *state,
+			  size_t len)
+{
+	if (!dgst || !state)
+		return -EFAULT;
+
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return -ENOTSUP;
+#endif
+
+#if defined(CONFIG_SSL_IMPL_OPENSSL) && \
+	OPENSSL_VERSION_NUMBER >= 0x10100000L && OPENSSL_VERSION_NUMBER < 0x30000000L
+	void *md_data = EVP_MD_CTX_md_data(dgst->ctx);
+	int size = EVP_MD_meth_get_app_datasize(EVP_MD_CTX_md(dgst->ctx));
+
+	if (!md_data || size <= 0)
+		return -ENOTSUP;
+	if (len != (size_t)size)
+		return -EINVAL;
+	memcpy(md_data, state, size);
+
+	return 0;
+#else
+	(void)len;
+	return -ENOTSUP;
+#endif
+}
+
 /*
  * Just a wrap function to memcmp
  */
@@ -143,16 +261,6 @@ int swupdate_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 		goto dgst_init_error;
 	}
 #elif defined(CONFIG_SIGALG_CMS)
-	/*
-	 * Load certificate chain
-	 */
-	dgst->certs = load_cert_chain(keyfile);
-	if (!dgst->certs) {
-		ERROR("Error loading certificate chain from %s", keyfile);
-		ret = -EINVAL;
-		goto dgst_init_error;
-	}
-
 	{
 		static char code_sign_name[] = "Code signing";
 		static char code_sign_sname[] = "codesign";
@@ -166,11 +274,12 @@ int swupdate_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 		}
 	}
 
-	if (!X509_STORE_set_purpose(dgst->certs, sw->cert_purpose)) {
-		ERROR("failed to set purpose");
-		ret = -EINVAL;
+	/*
+	 * Load certificate chain, it is kept for all verifications
+	 */
+	ret = cms_load_certs(dgst, keyfile, sw->cert_purpose);
+	if (ret)
 		goto dgst_init_error;
-	}
 #else
 	TRACE("public key / cert %s ignored, you need to set SIGALG", keyfile);
 #endif
@@ -5,6 +5,10 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <mbedtls/sha1.h>
+#include <mbedtls/sha256.h>
 
 #include "sslapi.h"
 #include "util.h"
@@ -37,6 +41,17 @@ struct swupdate_digest *swupdate_HASH_init(const char *algo)
 		return NULL;
 	}
 
+#ifdef CONFIG_HASH_AFALG
+	if (swupdate_HASH_use_afalg()) {
+		dgst->afalg_fd = afalg_hash_init(algo);
+		if (dgst->afalg_fd >= 0) {
+			dgst->afalg = true;
+			return dgst;
+		}
+		WARN("Kernel hash not available, falling back to software");
+	}
+#endif
+
 	mbedtls_md_init(&dgst->mbedtls_md_context);
 
 	error = mbedtls_md_setup(&dgst->mbedtls_md_context, info, 0);
@@ -65,6 +80,11 @@ int swupdate_HASH_update(struct swupdate_digest *dgst, const unsigned char *buf,
 		return -EFAULT;
 	}
 
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return afalg_hash_update(dgst->afalg_fd, buf, len);
+#endif
+
 	const int error = mbedtls_md_update(&dgst->mbedtls_md_context, buf, len);
 	if (error) {
 		ERROR("mbedtls_md_update: %d", error);
@@ -81,6 +101,11 @@ int swupdate_HASH_final(struct swupdate_digest *dgst, unsigned char *md_value,
 		return -EFAULT;
 	}
 
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return afalg_hash_final(dgst->afalg_fd, md_value, md_len);
+#endif
+
 	int error = mbedtls_md_finish(&dgst->mbedtls_md_context, md_value);
 	if (error) {
 		return -EINVAL;
@@ -98,10 +123,96 @@ void swupdate_HASH_cleanup(struct swupdate_digest *dgst)
 		return;
 	}
 
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		afalg_hash_cleanup(dgst->afalg_fd);
+	else
+#endif
 	mbedtls_md_free(&dgst->mbedtls_md_context);
 	free(dgst);
 }
 
+int swupdate_HASH_reset(struct swupdate_digest *dgst)
+{
+	if (!dgst)
+		return -EFAULT;
+
+#ifdef CONFIG_HASH_AFALG
+	/* the socket cannot be reset if a digest was not finished */
+	if (dgst->afalg)
+		return -ENOTSUP;
+#endif
+
+	return mbedtls_md_starts(&dgst->mbedtls_md_context) ? -EINVAL : 0;
+}
+
+/*
+ * The contexts of the mbedTLS digests are plain structures,
+ * they can be exported and restored as they are.
+ */
+static size_t md_state_size(const mbedtls_md_info_t *info)
+{
+	switch (mbedtls_md_get_type(info)) {
+#ifdef MBEDTLS_SHA1_C
+	case MBEDTLS_MD_SHA1:
+		return sizeof(mbedtls_sha1_context);
+#endif
+#ifdef MBEDTLS_SHA256_C
+	case MBEDTLS_MD_SHA224:
+	case MBEDTLS_MD_SHA256:
+		return sizeof(mbedtls_sha256_context);
+#endif
+	default:
+		return 0;
+	}
+}
+
+int swupdate_HASH_save(struct swupdate_digest *dgst, void *state, size_t *len)
+{
+	size_t size;
+
+	if (!dgst || !len)
+		return -EFAULT;
+
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return -ENOTSUP;
+#endif
+
+	size = md_state_size(dgst->mbedtls_md_context.md_info);
+	if (!size)
+		return -ENOTSUP;
+	if (*len < size)
+		return -ENOSPC;
+	memcpy(state, dgst->mbedtls_md_context.md_ctx, size);
+	*len = size;
+
+	return 0;
+}
+
+int swupdate_HASH_restore(struct swupdate_digest *dgst, const void *state,
+			  size_t len)
+{
+	size_t size;
+
+	if (!dgst || !state)
+		return -EFAULT;
+
+#ifdef CONFIG_HASH_AFALG
+	if (dgst->afalg)
+		return -ENOTSUP;
+#endif
+
+	size = md_state_size(dgst->mbedtls_md_context.md_info);
+	if (!size)
+		return -ENOTSUP;
+	if (len != size)
+		return -EINVAL;
+	memcpy(dgst->mbedtls_md_context.md_ctx, state, size);
+
+	return 0;
+}
+
 /*
  * Just a wrap function to memcmp
  */
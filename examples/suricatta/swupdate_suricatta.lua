@@ -585,6 +585,7 @@ suricatta.server.register(send_target_data, suricatta.server.SEND_TARGET_DATA)
 --- @field cmd       number        Command number, one of `ipc_commands`'s values
 --- @field msg       string        String data sent via IPC
 --- @field json      table         If `msg` is JSON, JSON as Lua Table
+--- @field memory    suricatta.memory  Lua heap usage
 
 
 --- Handle IPC messages sent to Suricatta Lua module.
@@ -595,6 +596,10 @@ suricatta.server.register(send_target_data, suricatta.server.SEND_TARGET_DATA)
 --- @return string                # IPC reply string
 --- @return suricatta.status      # Suricatta return code
 function ipc(message)
+    if message and message.cmd == message.commands.GET_STATUS then
+        return string.format([[{ "lua": { "used": %d, "peak": %d, "limit": %d } }]],
+            message.memory.used, message.memory.peak, message.memory.limit), suricatta.status.OK
+    end
     if not (message or {}).json then
         return escape([[{ "request": "IPC requests must be JSON formatted" }]], { ['"'] = '"' }),
             suricatta.status.EBADMSG
@@ -0,0 +1,352 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * Cache of the filesystems found on the block devices. It replaces
+ * blkid_probe_all(), that opens every device of the system each time
+ * it is called, and the probe of a single device that each handler
+ * did again. A device is probed once for an update, the other ones
+ * are read from the udev database if it is available. The cache is
+ * dropped together with the images of the update.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <blkid/blkid.h>
+#include "bsdqueue.h"
+#include "util.h"
+#include "blkdev_cache.h"
+
+#define SYS_CLASS_BLOCK	"/sys/class/block"
+#define UDEV_DATA_DIR	"/run/udev/data"
+
+enum {
+	TAG_TYPE,
+	TAG_UUID,
+	TAG_LABEL,
+	NTAGS
+};
+
+static const char *tag_names[NTAGS] = {"TYPE", "UUID", "LABEL"};
+
+/* properties that udev stores like blkid reports them */
+static const char *udev_names[NTAGS] = {"ID_FS_TYPE", "ID_FS_UUID", NULL};
+
+struct blkdev_entry {
+	char *devname;
+	dev_t devno;		/* 0 if it is not a block device */
+	bool valid;		/* the tags are known */
+	bool probed;		/* the tags were read from the device */
+	bool written;		/* the udev database is outdated */
+	char *tags[NTAGS];
+	LIST_ENTRY(blkdev_entry) next;
+};
+
+LIST_HEAD(blkdev_list, blkdev_entry);
+
+static struct blkdev_list devices = LIST_HEAD_INITIALIZER(devices);
+static pthread_mutex_t blkdev_lock = PTHREAD_MUTEX_INITIALIZER;
+/* set when the partitions may have changed */
+static bool udev_outdated;
+
+static int tag_index(const char *tag)
+{
+	for (int i = 0; i < NTAGS; i++)
+		if (!strcmp(tag, tag_names[i]))
+			return i;
+	return -1;
+}
+
+static void clear_tags(struct blkdev_entry *e)
+{
+	for (int i = 0; i < NTAGS; i++) {
+		free(e->tags[i]);
+		e->tags[i] = NULL;
+	}
+	e->valid = false;
+	e->probed = false;
+}
+
+static void free_entries(void)
+{
+	struct blkdev_entry *e, *tmp;
+
+	LIST_FOREACH_SAFE(e, &devices, next, tmp) {
+		LIST_REMOVE(e, next);
+		clear_tags(e);
+		free(e->devname);
+		free(e);
+	}
+}
+
+static dev_t device_number(const char *device)
+{
+	struct stat st;
+
+	if (stat(device, &st) || !S_ISBLK(st.st_mode))
+		return 0;
+	return st.st_rdev;
+}
+
+static struct blkdev_entry *lookup(const char *device, dev_t devno)
+{
+	struct blkdev_entry *e;
+
+	LIST_FOREACH(e, &devices, next) {
+		if (devno ? e->devno == devno : !strcmp(e->devname, device))
+			return e;
+	}
+	return NULL;
+}
+
+static struct blkdev_entry *add_entry(const char *device, dev_t devno)
+{
+	struct blkdev_entry *e = calloc(1, sizeof(*e));
+
+	if (!e)
+		return NULL;
+	e->devname = strdup(device);
+	if (!e->devname) {
+		free(e);
+		return NULL;
+	}
+	e->devno = devno;
+	LIST_INSERT_HEAD(&devices, e, next);
+
+	return e;
+}
+
+static int probe_device(struct blkdev_entry *e, bool quiet)
+{
+	const char *value;
+	size_t len;
+	blkid_probe pr;
+
+	clear_tags(e);
+	pr = blkid_new_probe_from_filename(e->devname);
+	if (!pr) {
+		if (!quiet)
+			ERROR("%s: failed to create libblkid probe", e->devname);
+		return -ENODEV;
+	}
+
+	while (blkid_do_probe(pr) == 0) {
+		if (blkid_probe_lookup_value(pr, "TYPE", &value, &len)) {
+			ERROR("blkid_probe_lookup_value failed");
+			break;
+		}
+		if (len > 0) {
+			for (int i = 0; i < NTAGS; i++) {
+				if (!blkid_probe_lookup_value(pr, tag_names[i], &value, &len) &&
+				    len > 0)
+					e->tags[i] = strndup(value, len);
+			}
+			break;
+		}
+	}
+	blkid_free_probe(pr);
+
+	e->valid = true;
+	e->probed = true;
+
+	return 0;
+}
+
+/*
+ * Reads the tags from the database of udev, they are valid only if
+ * udev has found a filesystem on the device.
+ */
+static int read_udev_data(struct blkdev_entry *e)
+{
+	char path[64], line[256];
+	FILE *fp;
+	size_t len;
+
+	snprintf(path, sizeof(path), UDEV_DATA_DIR "/b%u:%u",
+		 major(e->devno), minor(e->devno));
+	fp = fopen(path, "r");
+	if (!fp)
+		return -ENOENT;
+
+	clear_tags(e);
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "E:", 2))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		for (int i = 0; i < NTAGS; i++) {
+			if (!udev_names[i] || e->tags[i])
+				continue;
+			len = strlen(udev_names[i]);
+			if (!strncmp(line + 2, udev_names[i], len) &&
+			    line[2 + len] == '=' && line[3 + len])
+				e->tags[i] = strdup(line + 3 + len);
+		}
+	}
+	fclose(fp);
+
+	if (!e->tags[TAG_TYPE]) {
+		clear_tags(e);
+		return -ENOENT;
+	}
+	e->valid = true;
+
+	return 0;
+}
+
+static int read_sysfs_value(const char *name, const char *attr,
+			    char *buf, size_t size)
+{
+	char path[128];
+	FILE *fp;
+	int ret = -ENOENT;
+
+	snprintf(path, sizeof(path), SYS_CLASS_BLOCK "/%s/%s", name, attr);
+	fp = fopen(path, "r");
+	if (!fp)
+		return ret;
+	if (fgets(buf, size, fp))
+		ret = 0;
+	fclose(fp);
+
+	return ret;
+}
+
+/* Adds the block devices of the system that are not known yet */
+static void scan_devices(void)
+{
+	struct blkdev_entry *e;
+	struct dirent *d;
+	char devname[sizeof("/dev/") + 256];
+	char buf[32];
+	unsigned int maj, min;
+	DIR *dir;
+
+	dir = opendir(SYS_CLASS_BLOCK);
+	if (!dir) {
+		WARN("Cannot read %s: %s", SYS_CLASS_BLOCK, strerror(errno));
+		return;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (read_sysfs_value(d->d_name, "dev", buf, sizeof(buf)) ||
+		    sscanf(buf, "%u:%u", &maj, &min) != 2)
+			continue;
+		/* empty loop devices, card readers without a card, ... */
+		if (read_sysfs_value(d->d_name, "size", buf, sizeof(buf)) ||
+		    !strtoull(buf, NULL, 10))
+			continue;
+
+		e = lookup(NULL, makedev(maj, min));
+		if (!e) {
+			snprintf(devname, sizeof(devname), "/dev/%s", d->d_name);
+			e = add_entry(devname, makedev(maj, min));
+			if (!e)
+				break;
+		}
+		if (e->valid)
+			continue;
+		if (!udev_outdated && !e->written && !read_udev_data(e))
+			continue;
+		probe_device(e, true);
+	}
+	closedir(dir);
+}
+
+char *blkdev_cache_get(const char *device, const char *tag)
+{
+	struct blkdev_entry *e;
+	dev_t devno = device_number(device);
+	int idx = tag_index(tag);
+	char *value = NULL;
+
+	if (idx < 0)
+		return NULL;
+
+	pthread_mutex_lock(&blkdev_lock);
+	e = lookup(device, devno);
+	if (!e)
+		e = add_entry(device, devno);
+	/* a decision is taken on this device, do not trust udev */
+	if (e && (e->probed || !probe_device(e, false)) && e->tags[idx])
+		value = strdup(e->tags[idx]);
+	pthread_mutex_unlock(&blkdev_lock);
+
+	return value;
+}
+
+int blkdev_cache_find(const char *tag, const char *value,
+		      blkdev_cache_fn fn, void *data)
+{
+	struct blkdev_entry *e;
+	int idx = tag_index(tag);
+	int count = 0, ret;
+
+	if (idx < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&blkdev_lock);
+	scan_devices();
+	LIST_FOREACH(e, &devices, next) {
+		if (!e->devno)
+			continue;
+		if (!e->valid || (!udev_names[idx] && !e->probed)) {
+			if (probe_device(e, true))
+				continue;
+		}
+		if (!e->tags[idx] || strcmp(e->tags[idx], value))
+			continue;
+		count++;
+		if (fn) {
+			ret = fn(e->devname, data);
+			if (ret < 0) {
+				count = ret;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&blkdev_lock);
+
+	return count;
+}
+
+void blkdev_cache_invalidate(const char *device)
+{
+	struct blkdev_entry *e;
+	dev_t devno;
+
+	pthread_mutex_lock(&blkdev_lock);
+	if (!device) {
+		free_entries();
+		udev_outdated = true;
+	} else {
+		devno = device_number(device);
+		e = lookup(device, devno);
+		if (!e)
+			e = add_entry(device, devno);
+		if (e) {
+			clear_tags(e);
+			e->written = true;
+		}
+	}
+	pthread_mutex_unlock(&blkdev_lock);
+}
+
+void blkdev_cache_free(void)
+{
+	pthread_mutex_lock(&blkdev_lock);
+	free_entries();
+	udev_outdated = false;
+	pthread_mutex_unlock(&blkdev_lock);
+}
@@ -9,24 +9,33 @@
 #include <stdio.h>
 #include <util.h>
 #include <handler.h>
-#include <blkid/blkid.h>
 #include <fs_interface.h>
+#include <blkdev_cache.h>
+
+#if defined(CONFIG_FAT_FILESYSTEM)
+static inline int fat_mkfs_short(const char *device_name, const char *fstype,
+				 unsigned int __attribute__ ((__unused__)) options)
+{
+	return fat_mkfs(device_name, fstype);
+}
+#endif
 
 #if defined(CONFIG_EXT_FILESYSTEM)
-static inline int ext_mkfs_short(const char *device_name, const char *fstype)
+static inline int ext_mkfs_short(const char *device_name, const char *fstype,
+				 unsigned int options)
 {
-	return ext_mkfs(device_name, fstype, 0, NULL);
+	return ext_mkfs(device_name, fstype, 0, NULL, options);
 }
 #endif
 
 struct supported_filesystems {
 	const char *fstype;
-	int (*mkfs)(const char *device_name, const char *fstype);
+	int (*mkfs)(const char *device_name, const char *fstype, unsigned int options);
 };
 
 static struct supported_filesystems fs[] = {
 #if defined(CONFIG_FAT_FILESYSTEM)
-	{"vfat", fat_mkfs},
+	{"vfat", fat_mkfs_short},
 #endif
 #if defined(CONFIG_EXT_FILESYSTEM)
 	{"ext2", ext_mkfs_short},
@@ -42,33 +51,7 @@ static struct supported_filesystems fs[] = {
 
 char *diskformat_fs_detect(char *device)
 {
-	const char *value;
-	char *s = NULL;
-	size_t len;
-	blkid_probe pr;
-
-	pr = blkid_new_probe_from_filename(device);
-
-	if (!pr) {
-		ERROR("%s: failed to create libblkid probe",
-			  device);
-		return NULL;
-	}
-
-	while (blkid_do_probe(pr) == 0) {
-		if (blkid_probe_lookup_value(pr, "TYPE", &value, &len)) {
-			ERROR("blkid_probe_lookup_value failed");
-			break;
-		}
-
-		if (len > 0) {
-			s = strndup(value, len);
-			break;
-		}
-	}
-	blkid_free_probe(pr);
-
-	return s;
+	return blkdev_cache_get(device, "TYPE");
 }
 
 int diskformat_fs_exists(char *device, char *fstype)
@@ -84,7 +67,25 @@ int diskformat_fs_exists(char *device, char *fstype)
 	return ret;
 }
 
-int diskformat_mkfs(char *device, char *fstype)
+/*
+ * Read the mkfs options from the properties of the image:
+ * "lazy-itable-init" and "lazy-journal-init"
+ */
+unsigned int diskformat_mkfs_options(struct img_type *img)
+{
+	const char *lazy_itable = dict_get_value(&img->properties, "lazy-itable-init");
+	unsigned int options = 0;
+
+	if (lazy_itable)
+		options |= strtobool(lazy_itable) ? MKFS_LAZY_ITABLE_INIT :
+						    MKFS_NO_LAZY_ITABLE_INIT;
+	if (strtobool(dict_get_value(&img->properties, "lazy-journal-init")))
+		options |= MKFS_LAZY_JOURNAL_INIT;
+
+	return options;
+}
+
+int diskformat_mkfs(char *device, char *fstype, unsigned int options)
 {
 	int index;
 	int ret = 0;
@@ -104,7 +105,8 @@ int diskformat_mkfs(char *device, char *fstype)
 	}
 
 	TRACE("Creating %s file system on %s", fstype, device);
-	ret = fs[index].mkfs(device, fstype);
+	ret = fs[index].mkfs(device, fstype, options);
+	blkdev_cache_invalidate(device);
 
 	if (ret) {
 		ERROR("creating %s file system on %s failed. %d",
@@ -20,9 +20,34 @@
 
 
 #define SECTOR_SIZE	512
+#define WRITE_BUF_SECTORS	512
 
 static int file_descriptor = -1;
 
+/*
+ * Writes to consecutive sectors are collected and issued
+ * as a single pwrite(), FatFs writes mostly sector by sector
+ */
+static BYTE *write_buf;
+static LBA_t write_start;
+static UINT write_count;
+
+static int disk_flush(void)
+{
+	size_t len = write_count * SECTOR_SIZE;
+
+	if (!write_count)
+		return 0;
+
+	write_count = 0;
+	if (pwrite(file_descriptor, write_buf, len, write_start * SECTOR_SIZE) != len) {
+		ERROR("Cannot write %zu bytes at sector %llu", len,
+		      (unsigned long long)write_start);
+		return -1;
+	}
+
+	return 0;
+}
 
 /*
  * Extension to FatFs library: fatfs_init associates the fatfs library with
@@ -47,6 +72,14 @@ int fatfs_init(const char *device)
 		return -1;
 	}
 
+	write_buf = malloc(WRITE_BUF_SECTORS * SECTOR_SIZE);
+	write_count = 0;
+	if (!write_buf) {
+		ERROR("OOM allocating write buffer");
+		fatfs_release();
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
@@ -56,9 +89,12 @@ int fatfs_init(const char *device)
 void fatfs_release(void)
 {
 	if (file_descriptor >= 0) {
+		(void)disk_flush();
 		(void)close(file_descriptor);
 		file_descriptor = -1;
 	}
+	free(write_buf);
+	write_buf = NULL;
 }
 
 DSTATUS disk_status(BYTE pdrv)
@@ -87,6 +123,9 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 	if (disk_status(pdrv))
 		return RES_NOTRDY;
 
+	if (disk_flush())
+		return RES_ERROR;
+
 	if (pread(file_descriptor, buff, count * SECTOR_SIZE, sector * SECTOR_SIZE) != count * SECTOR_SIZE)
 		return RES_ERROR;
 
@@ -104,8 +143,22 @@ DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
 	if (disk_status(pdrv))
 		return RES_NOTRDY;
 
-	if (pwrite(file_descriptor, buff, count * SECTOR_SIZE, sector * SECTOR_SIZE) != count * SECTOR_SIZE)
-		return RES_ERROR;
+	if (write_count && (sector != write_start + write_count ||
+			    write_count + count > WRITE_BUF_SECTORS)) {
+		if (disk_flush())
+			return RES_ERROR;
+	}
+
+	if (count > WRITE_BUF_SECTORS) {
+		if (pwrite(file_descriptor, buff, count * SECTOR_SIZE, sector * SECTOR_SIZE) != count * SECTOR_SIZE)
+			return RES_ERROR;
+		return RES_OK;
+	}
+
+	if (!write_count)
+		write_start = sector;
+	memcpy(write_buf + write_count * SECTOR_SIZE, buff, count * SECTOR_SIZE);
+	write_count += count;
 
 	return RES_OK;
 }
@@ -120,7 +173,7 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
 
 	switch (cmd) {
 	case CTRL_SYNC:
-		if (syncfs(file_descriptor) != 0)
+		if (disk_flush() || syncfs(file_descriptor) != 0)
 			return RES_ERROR;
 		break;
 	case GET_SECTOR_COUNT:
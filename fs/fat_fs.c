@@ -14,13 +14,19 @@
 
 #include "ff.h"
 
+/*
+ * f_mkfs() clears the FAT and the root directory in chunks of the
+ * size of the working buffer, a single sector would mean a write
+ * for each sector of the FAT
+ */
+#define FAT_MKFS_BUF_SIZE	(256 * 1024)
 
 int fat_mkfs(const char *device_name, const char __attribute__ ((__unused__)) *fstype)
 {
 	if (fatfs_init(device_name))
 		return -1;
 
-	void* working_buffer = malloc(FF_MAX_SS);
+	void* working_buffer = malloc(FAT_MKFS_BUF_SIZE);
 
 	if (!working_buffer) {
 		fatfs_release();
@@ -35,7 +41,7 @@ int fat_mkfs(const char *device_name, const char __attribute__ ((__unused__)) *f
 		.n_root = 0
 	};
 
-	FRESULT result = f_mkfs("", &mkfs_parm, working_buffer, FF_MAX_SS);
+	FRESULT result = f_mkfs("", &mkfs_parm, working_buffer, FAT_MKFS_BUF_SIZE);
 	free(working_buffer);
 
 	if (result != FR_OK) {
@@ -799,7 +799,7 @@ static void fix_cluster_bg_counts(ext2_filsys fs)
 }
 
 int ext_mkfs(const char *device_name, const char *fstype, unsigned long features,
-		const char *volume_label)
+		const char *volume_label, unsigned int options)
 {
 	errcode_t	retval = 0;
 	ext2_filsys	fs;
@@ -847,11 +847,12 @@ int ext_mkfs(const char *device_name, const char *fstype, unsigned long features
 	} else
 		fs_param.s_feature_compat = features;
 
-	TRACE("mke2fs parms for %s: compat 0x%x incompat 0x%x ro %x",
+	TRACE("mke2fs parms for %s: compat 0x%x incompat 0x%x ro %x options 0x%x",
 		fstype,
 		fs_param.s_feature_compat,
 		fs_param.s_feature_incompat,
-		fs_param.s_feature_ro_compat);
+		fs_param.s_feature_ro_compat,
+		options);
 
 	retval = mkfs_prepare(device_name, &fs_param);
 
@@ -880,10 +881,17 @@ int ext_mkfs(const char *device_name, const char *fstype, unsigned long features
 		return -EINVAL;
 	}
 
-	lazy_itable_init = 0;
-
-	if (access("/sys/fs/ext4/features/lazy_itable_init", R_OK) == 0)
+	/*
+	 * With lazy init, the inode tables are not zeroed here
+	 * but later by the kernel, after the file system is mounted
+	 */
+	if (options & MKFS_NO_LAZY_ITABLE_INIT)
+		lazy_itable_init = 0;
+	else if (options & MKFS_LAZY_ITABLE_INIT)
 		lazy_itable_init = 1;
+	else
+		lazy_itable_init = access("/sys/fs/ext4/features/lazy_itable_init",
+					  R_OK) == 0;
 
 	/* Calculate journal blocks */
 	if (journal_size ||
@@ -1022,6 +1030,8 @@ int ext_mkfs(const char *device_name, const char *fstype, unsigned long features
 	}
 
 	journal_flags |= EXT2_MKJOURNAL_NO_MNT_CHECK;
+	if (options & MKFS_LAZY_JOURNAL_INIT)
+		journal_flags |= EXT2_MKJOURNAL_LAZYINIT;
 
 	if ((journal_size) ||
 	   ext2fs_has_feature_journal(&fs_param)) {
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdbool.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -23,8 +24,8 @@
 #include "swupdate.h"
 #include "handler.h"
 #include "util.h"
-
-#define FIFO_FILE_NAME "archivfifo"
+#include "bsdqueue.h"
+#include "pctl.h"
 
 /* Just to turn on during development */
 static int debug = 0;
@@ -34,11 +35,375 @@ void archive_handler(void);
 
 pthread_t extract_thread;
 
+/*
+ * Regular files up to EXTRACT_JOB_MAX_SIZE are read into memory by the
+ * thread reading the archive and written by a pool of workers, each of
+ * them with its own archive_write_disk object. An entry is always
+ * assigned to the same worker for the same path, so that entries
+ * overwriting each other are still written in archive order.
+ * Hardlinks, symlinks, special files and big files are written by the
+ * reading thread after the workers are idle, because they can depend
+ * on anything that was extracted before.
+ */
+#define EXTRACT_MAX_WORKERS	16
+#define EXTRACT_JOB_MAX_SIZE	(1024 * 1024)
+#define EXTRACT_QUEUE_MAX_SIZE	(16 * 1024 * 1024)
+
+struct extract_job {
+	struct archive_entry *entry;
+	void *buf;
+	size_t size;
+	TAILQ_ENTRY(extract_job) next;
+};
+
+TAILQ_HEAD(extract_jobs, extract_job);
+
+struct extract_pool;
+
+struct extract_worker {
+	pthread_t thread;
+	struct extract_pool *pool;
+	struct extract_jobs jobs;
+	struct archive *ext;
+	bool started;
+};
+
+struct extract_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	struct extract_worker workers[EXTRACT_MAX_WORKERS];
+	unsigned int nworkers;
+	unsigned int pending;
+	size_t queued;
+	bool stop;
+	int error;
+#ifdef CONFIG_LOCALE
+	locale_t locale;
+#endif
+};
+
+/*
+ * The buffers written by copyimage() are handed to libarchive as they
+ * are: the writer waits until libarchive asks for the next block, that
+ * is until it does not use the previous one anymore.
+ */
+struct archive_stream {
+	int fd;		/* unused, copyimage() expects a fd first */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const void *buf;
+	size_t len;
+	bool taken;
+	bool eof;
+	bool closed;
+};
+
 struct extract_data {
 	int flags;
+	unsigned int workers;
+	struct archive_stream *stream;
 	int exitval;
 };
 
+static int archive_stream_write(void *out, const void *buf, size_t len)
+{
+	struct archive_stream *s = (struct archive_stream *)out;
+
+	if (!len)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	/*
+	 * If the extraction has stopped, the rest of the image is just
+	 * consumed, the error is reported by the extracting thread.
+	 */
+	if (!s->closed) {
+		s->buf = buf;
+		s->len = len;
+		s->taken = false;
+		pthread_cond_broadcast(&s->cond);
+		while (s->buf && !s->closed)
+			pthread_cond_wait(&s->cond, &s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+static ssize_t archive_stream_read(struct archive __attribute__ ((__unused__)) *a,
+				   void *p, const void **buf)
+{
+	struct archive_stream *s = (struct archive_stream *)p;
+	ssize_t len = 0;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->taken) {
+		s->buf = NULL;
+		s->taken = false;
+		pthread_cond_broadcast(&s->cond);
+	}
+	while (!s->buf && !s->eof)
+		pthread_cond_wait(&s->cond, &s->lock);
+	if (s->buf) {
+		*buf = s->buf;
+		len = s->len;
+		s->taken = true;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return len;
+}
+
+static void archive_stream_end(struct archive_stream *s, bool closed)
+{
+	pthread_mutex_lock(&s->lock);
+	if (closed) {
+		s->closed = true;
+		s->buf = NULL;
+	} else {
+		s->eof = true;
+	}
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int write_job(struct archive *ext, struct extract_job *job)
+{
+	const char *name = archive_entry_pathname(job->entry);
+	int r;
+
+	r = archive_write_header(ext, job->entry);
+	if (r != ARCHIVE_OK) {
+		ERROR("archive_write_header(): %s for '%s': %s",
+		      archive_error_string(ext), name,
+		      strerror(archive_errno(ext)));
+		return -EFAULT;
+	}
+
+	if (job->size && archive_write_data(ext, job->buf, job->size) !=
+			(ssize_t)job->size) {
+		ERROR("archive_write_data(): %s for '%s': %s",
+		      archive_error_string(ext), name,
+		      strerror(archive_errno(ext)));
+		return -EFAULT;
+	}
+
+	r = archive_write_finish_entry(ext);
+	if (r != ARCHIVE_OK) {
+		ERROR("archive_write_finish_entry(): %s for '%s': %s",
+		      archive_error_string(ext), name,
+		      strerror(archive_errno(ext)));
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static void free_job(struct extract_job *job)
+{
+	archive_entry_free(job->entry);
+	free(job->buf);
+	free(job);
+}
+
+static void *extract_worker_thread(void *p)
+{
+	struct extract_worker *w = (struct extract_worker *)p;
+	struct extract_pool *pool = w->pool;
+	struct extract_job *job;
+	int ret;
+
+#ifdef CONFIG_LOCALE
+	uselocale(pool->locale);
+#endif
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&w->jobs) && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		job = TAILQ_FIRST(&w->jobs);
+		if (!job)
+			break;
+		TAILQ_REMOVE(&w->jobs, job, next);
+		ret = pool->error;
+		pthread_mutex_unlock(&pool->lock);
+
+		/* after an error, the queued entries are just dropped */
+		if (!ret)
+			ret = write_job(w->ext, job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret && !pool->error)
+			pool->error = ret;
+		pool->queued -= job->size;
+		pool->pending--;
+		pthread_cond_broadcast(&pool->idle);
+		free_job(job);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static int extract_pool_stop(struct extract_pool *pool)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->nworkers; i++) {
+		struct extract_worker *w = &pool->workers[i];
+
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		if (w->ext && archive_write_free(w->ext) != ARCHIVE_OK) {
+			ERROR("archive_write_free(): %s: %s",
+			      archive_error_string(w->ext),
+			      strerror(archive_errno(w->ext)));
+			if (!pool->error)
+				pool->error = -EFAULT;
+		}
+	}
+
+	ret = pool->error;
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+
+	return ret;
+}
+
+static struct extract_pool *extract_pool_start(unsigned int nworkers, int flags)
+{
+	struct extract_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+#ifdef CONFIG_LOCALE
+	pool->locale = uselocale((locale_t)0);
+#endif
+	pool->nworkers = min(nworkers, (unsigned int)EXTRACT_MAX_WORKERS);
+
+	for (unsigned int i = 0; i < pool->nworkers; i++) {
+		struct extract_worker *w = &pool->workers[i];
+
+		w->pool = pool;
+		TAILQ_INIT(&w->jobs);
+		w->ext = archive_write_disk_new();
+		if (!w->ext)
+			goto fail;
+		archive_write_disk_set_options(w->ext, flags);
+		if (start_worker_thread(&w->thread, extract_worker_thread, w)) {
+			ERROR("Worker %u for archive extraction cannot be started", i);
+			goto fail;
+		}
+		w->started = true;
+	}
+
+	return pool;
+
+fail:
+	extract_pool_stop(pool);
+	return NULL;
+}
+
+/*
+ * Wait until all queued entries are written, returns the first
+ * error reported by a worker.
+ */
+static int extract_pool_drain(struct extract_pool *pool)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending && !pool->error)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	ret = pool->error;
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+static bool extract_pool_accepts(struct archive_entry *entry)
+{
+	return archive_entry_filetype(entry) == AE_IFREG &&
+		!archive_entry_hardlink(entry) &&
+		archive_entry_size_is_set(entry) &&
+		archive_entry_size(entry) <= EXTRACT_JOB_MAX_SIZE &&
+		!archive_entry_sparse_count(entry);
+}
+
+static int extract_pool_queue(struct extract_pool *pool, struct archive *a,
+			      struct archive_entry *entry)
+{
+	struct extract_job *job;
+	const char *name = archive_entry_pathname(entry);
+	unsigned int hash = 5381;
+	size_t len = 0;
+	ssize_t n;
+	int ret;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->size = archive_entry_size(entry);
+	job->entry = archive_entry_clone(entry);
+	if (job->size)
+		job->buf = malloc(job->size);
+	if (!job->entry || (job->size && !job->buf)) {
+		free_job(job);
+		return -ENOMEM;
+	}
+
+	while (len < job->size) {
+		n = archive_read_data(a, (char *)job->buf + len, job->size - len);
+		if (n < 0 && n != ARCHIVE_WARN) {
+			ERROR("archive_read_data(): %s for '%s': %s",
+			      archive_error_string(a), name,
+			      strerror(archive_errno(a)));
+			free_job(job);
+			return -EFAULT;
+		}
+		if (n == 0)
+			break;
+		if (n > 0)
+			len += n;
+	}
+	job->size = len;
+
+	for (const char *c = name; c && *c; c++)
+		hash = hash * 33 + (unsigned char)*c;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queued && pool->queued + job->size > EXTRACT_QUEUE_MAX_SIZE &&
+	       !pool->error)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	ret = pool->error;
+	if (!ret) {
+		TAILQ_INSERT_TAIL(&pool->workers[hash % pool->nworkers].jobs,
+				  job, next);
+		pool->queued += job->size;
+		pool->pending++;
+		pthread_cond_broadcast(&pool->work);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (ret)
+		free_job(job);
+
+	return ret;
+}
+
 static int
 copy_data(struct archive *ar, struct archive *aw, struct archive_entry *entry)
 {
@@ -87,12 +452,12 @@ extract(void *p)
 	struct archive *a;
 	struct archive *ext = NULL;
 	struct archive_entry *entry = NULL;
+	struct extract_pool *pool = NULL;
 	int r;
 	int flags;
 	struct extract_data *data = (struct extract_data *)p;
 	flags = data->flags;
 	int exitval = -EFAULT;
-	char *FIFO = NULL;
 
 #ifdef CONFIG_LOCALE
 	/*
@@ -135,18 +500,19 @@ extract(void *p)
 	 * Enabling bzip2 is more expensive because the libbz2 library
 	 * isn't very well factored.
 	 */
-	if  (asprintf(&FIFO, "%s%s", get_tmpdir(), FIFO_FILE_NAME) ==
-		ENOMEM_ASPRINTF) {
-		ERROR("Path too long: %s", get_tmpdir());
-		exitval = -ENOMEM;
+	if ((r = archive_read_open(a, data->stream, NULL,
+				   archive_stream_read, NULL))) {
+		ERROR("archive_read_open(): %s %d: %s",
+		    archive_error_string(a), r, strerror(archive_errno(a)));
 		goto out;
 	}
 
-	if ((r = archive_read_open_filename(a, FIFO, 4096))) {
-		ERROR("archive_read_open_filename(): %s %d: %s",
-		    archive_error_string(a), r, strerror(archive_errno(a)));
-		goto out;
+	if (data->workers > 1) {
+		pool = extract_pool_start(data->workers, flags);
+		if (!pool)
+			goto out;
 	}
+
 	for (;;) {
 		r = archive_read_next_header(a, &entry);
 		if (r != ARCHIVE_OK) {
@@ -167,6 +533,21 @@ extract(void *p)
 		if (debug)
 			TRACE("Extracting %s", archive_entry_pathname(entry));
 
+		if (pool && extract_pool_accepts(entry)) {
+			if (extract_pool_queue(pool, a, entry))
+				goto out;
+			continue;
+		}
+
+		/*
+		 * Directories do not need to wait: a worker creates the
+		 * missing parents of its files, and libarchive accepts a
+		 * directory that already exists.
+		 */
+		if (pool && archive_entry_filetype(entry) != AE_IFDIR &&
+		    extract_pool_drain(pool))
+			goto out;
+
 		r = archive_write_header(ext, entry);
 		if (r != ARCHIVE_OK) {
 			ERROR("archive_write_header(): %s: %s",
@@ -186,12 +567,17 @@ extract(void *p)
 			    strerror(archive_errno(ext)));
 			goto out;
 		}
-
 	}
 
+	if (pool && extract_pool_drain(pool))
+		goto out;
+
 	exitval = 0;
 
 out:
+	if (pool && extract_pool_stop(pool))
+		exitval = -EFAULT;
+
 	if (ext) {
 		r = archive_write_free(ext);
 		if (r) {
@@ -207,7 +593,7 @@ out:
 		archive_read_free(a);
 	}
 
-	free(FIFO);
+	archive_stream_end(data->stream, true);
 
 #ifdef CONFIG_LOCALE
 	uselocale(old_locale);
@@ -217,31 +603,53 @@ out:
 	pthread_exit(NULL);
 }
 
+/*
+ * Flush the filesystem of the current directory, where the archive
+ * was extracted, instead of all mounted filesystems.
+ */
+static void sync_destination(void)
+{
+#if defined(__linux__)
+	int fd = open(".", O_RDONLY | O_DIRECTORY);
+
+	if (fd >= 0) {
+		int ret = syncfs(fd);
+
+		close(fd);
+		if (!ret)
+			return;
+	}
+#endif
+	sync();
+}
+
 static int install_archive_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
 	char path[255];
-	int fdout = -1;
 	int ret = -1;
 	int thread_ret = -1;
 	char pwd[256] = "\0";
 	struct extract_data tf;
+	struct archive_stream stream = {
+		.fd = -1,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
 	pthread_attr_t attr;
-	int use_mount = (strlen(img->device) && strlen(img->filesystem)) ? 1 : 0;
+	int use_mount = (strlen(img->device) && img->filesystem) ? 1 : 0;
 	int is_mounted = 0;
+	bool extracted = false;
 	int exitval = -EFAULT;
 	char *DATADST_DIR = NULL;
-	char *FIFO = NULL;
 
 	if (strlen(img->path) == 0) {
 		ERROR("Missing path attribute");
 		return -EINVAL;
 	}
 
-	if ((asprintf(&DATADST_DIR, "%s%s", get_tmpdir(), DATADST_DIR_SUFFIX) ==
-		ENOMEM_ASPRINTF) ||
-		(asprintf(&FIFO, "%s%s", get_tmpdir(), FIFO_FILE_NAME) ==
-		ENOMEM_ASPRINTF)) {
+	if (asprintf(&DATADST_DIR, "%s%s", get_tmpdir(), DATADST_DIR_SUFFIX) ==
+		ENOMEM_ASPRINTF) {
 		ERROR("Path too long: %s", get_tmpdir());
 		exitval = -ENOMEM;
 		goto out;
@@ -273,13 +681,6 @@ static int install_archive_image(struct img_type *img,
 		}
 	}
 
-	unlink(FIFO);
-	ret = mkfifo(FIFO, 0600);
-	if (ret) {
-		ERROR("FIFO cannot be created in archive handler");
-		goto out;
-	}
-
 	if (!getcwd(pwd, sizeof(pwd))) {
 		ERROR("Failed to determine current working directory");
 		pwd[0] = '\0';
@@ -312,8 +713,14 @@ static int install_archive_image(struct img_type *img,
 		img->preserve_attributes ? "preserving" : "ignoring");
 
 	tf.flags = 0;
+	tf.workers = 1;
+	tf.stream = &stream;
 	tf.exitval = -EFAULT;
 
+	if (dict_get_value(&img->properties, "extract-workers"))
+		tf.workers = strtoul(dict_get_value(&img->properties,
+					"extract-workers"), NULL, 10);
+
 	if (img->preserve_attributes) {
 		tf.flags |= ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
 				ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_ACL |
@@ -326,14 +733,9 @@ static int install_archive_image(struct img_type *img,
 			 thread_ret);
 		goto out;
 	}
+	extracted = true;
 
-	fdout = open(FIFO, O_WRONLY);
-	if (fdout < 0) {
-		ERROR("Failed to open FIFO %s", FIFO);
-		goto out;
-	}
-
-	ret = copyimage(&fdout, img, NULL);
+	ret = copyimage(&stream, img, archive_stream_write);
 	if (ret < 0) {
 		ERROR("Error copying extracted file");
 		goto out;
@@ -342,16 +744,10 @@ static int install_archive_image(struct img_type *img,
 	exitval = 0;
 
 out:
-	if (fdout >= 0) {
-		ret = close(fdout);
-		if (ret) {
-			ERROR("failed to close FIFO %s", FIFO);
-		}
-	}
-
 	if (!thread_ret) {
 		void *status;
 
+		archive_stream_end(&stream, false);
 		ret = pthread_join(extract_thread, &status);
 		if (ret) {
 			ERROR("return code from pthread_join() is %d", ret);
@@ -363,6 +759,14 @@ out:
 		}
 	}
 
+	/*
+	 * A mounted destination is flushed by umount, else the
+	 * filesystem of the destination path is synced while it is
+	 * still the current directory.
+	 */
+	if (extracted && !is_mounted)
+		sync_destination();
+
 	if (pwd[0]) {
 		ret = chdir(pwd);
 		if (ret) {
@@ -370,19 +774,15 @@ out:
 		}
 	}
 
-	if (FIFO)
-		unlink(FIFO);
-
 	if (is_mounted) {
 		ret = swupdate_umount(DATADST_DIR);
 		if (ret) {
 			TRACE("Failed to unmount directory %s", DATADST_DIR);
+			sync();
 		}
 	}
 
-	sync();
 	free(DATADST_DIR);
-	free(FIFO);
 
 	return exitval;
 }
@@ -391,7 +791,7 @@ __attribute__((constructor))
 void archive_handler(void)
 {
 	register_handler("archive", install_archive_image,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+				IMAGE_HANDLER | FILE_HANDLER | STREAM_HANDLER, NULL);
 }
 
 /* This is an alias for the parsers */
@@ -399,5 +799,5 @@ __attribute__((constructor))
 void untar_handler(void)
 {
 	register_handler("tar", install_archive_image,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+				IMAGE_HANDLER | FILE_HANDLER | STREAM_HANDLER, NULL);
 }
@@ -7,6 +7,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -14,10 +17,24 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include "chained_handler.h"
+#include "handler.h"
 #include "installer.h"
+#include "progress.h"
+#include "swupdate_metrics.h"
 #include "pctl.h"
 #include "util.h"
 
+#define PIPE_READ  0
+#define PIPE_WRITE 1
+
+#define MAX_CHAIN_STREAMS	8
+
+static struct {
+	const char *desc;
+	const struct chain_stream_ops *ops;
+} chain_streams[MAX_CHAIN_STREAMS];
+static unsigned int nr_chain_streams;
+
 /*
  * Thread to start the chained handler.
  * This received from FIFO the reassembled stream with
@@ -45,4 +62,155 @@ void *chain_handler_thread(void *data)
 	return (void *)ret;
 }
 
+int register_chain_stream(const char *desc, const struct chain_stream_ops *ops)
+{
+	if (nr_chain_streams >= MAX_CHAIN_STREAMS || !ops)
+		return -1;
+
+	chain_streams[nr_chain_streams].desc = desc;
+	chain_streams[nr_chain_streams].ops = ops;
+	nr_chain_streams++;
+
+	return 0;
+}
+
+static const struct chain_stream_ops *find_chain_stream(const char *desc)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_chain_streams; i++)
+		if (!strcmp(chain_streams[i].desc, desc))
+			return chain_streams[i].ops;
+
+	return NULL;
+}
+
+/*
+ * Bookkeeping done by install_single_image() when the
+ * handler runs in its own thread
+ */
+static int chain_stream_start(struct chain_handler *chain,
+			      const struct chain_stream_ops *ops)
+{
+	struct img_type *img = &chain->data.img;
+	int ret;
+
+	/* transformations are done by the full handler only */
+	if (img->compressed || img->is_encrypted || IsValidHash(img->sha256))
+		return -EOPNOTSUPP;
+
+	ret = ops->open(img, &chain->ctx);
+	if (ret)
+		return ret;
+
+	chain->ops = ops;
+	chain->fd = -1;
+	TRACE("Found installer for stream %s %s (in process)", img->fname, img->type);
+	swupdate_progress_inc_step(img->fname, img->type);
+	timeline_begin(&chain->span);
+	chain->start = metrics_now();
+
+	return 0;
+}
+
+static int chain_thread_start(struct chain_handler *chain)
+{
+	int pipes[2];
+
+	if (pipe(pipes) < 0) {
+		ERROR("Could not create pipes for chained handler, existing...");
+		return -EFAULT;
+	}
+
+	chain->data.img.fdin = pipes[PIPE_READ];
+	chain->fd = pipes[PIPE_WRITE];
+	signal(SIGPIPE, SIG_IGN);
+
+	chain->thread = start_thread(chain_handler_thread, &chain->data);
+	wait_threads_ready();
 
+	return 0;
+}
+
+int chain_handler_start(struct chain_handler *chain, struct img_type *img)
+{
+	const struct chain_stream_ops *ops;
+	int ret = -EOPNOTSUPP;
+
+	memset(chain, 0, sizeof(*chain));
+	chain->fd = -1;
+	memcpy(&chain->data.img, img, sizeof(*img));
+
+	ops = find_chain_stream(img->type);
+	if (ops)
+		ret = chain_stream_start(chain, ops);
+	if (ret == -EOPNOTSUPP)
+		ret = chain_thread_start(chain);
+	if (ret)
+		return ret;
+
+	chain->active = true;
+
+	return 0;
+}
+
+int chain_handler_write(void *out, const void *buf, size_t len)
+{
+	struct chain_handler *chain = (struct chain_handler *)out;
+	struct img_type *img = &chain->data.img;
+
+	if (!chain->ops)
+		return copy_write(&chain->fd, buf, len);
+
+	if (img->size > 0 && chain->written + len > (unsigned long long)img->size) {
+		ERROR("Chained image %s is bigger than %llu bytes", img->fname,
+		      (unsigned long long)img->size);
+		return -EFBIG;
+	}
+	chain->written += len;
+
+	return chain->ops->write(chain->ctx, buf, len);
+}
+
+int chain_handler_end(struct chain_handler *chain, bool success)
+{
+	struct img_type *img = &chain->data.img;
+	void *status;
+	int ret;
+
+	if (!chain->active)
+		return -EINVAL;
+	chain->active = false;
+
+	if (chain->ops) {
+		if (success && img->size > 0 &&
+		    chain->written != (unsigned long long)img->size) {
+			ERROR("Chained image %s truncated: %llu of %llu bytes",
+			      img->fname, chain->written,
+			      (unsigned long long)img->size);
+			success = false;
+		}
+		ret = chain->ops->close(chain->ctx, success);
+		if (!success && !ret)
+			ret = -EFAULT;
+		metrics_handler_duration(img->type, chain->start);
+		timeline_end(&chain->span, img->type, img->fname);
+		swupdate_progress_step_completed();
+		chain->ops = NULL;
+		return ret;
+	}
+
+	close(chain->fd);
+	chain->fd = -1;
+	ret = pthread_join(chain->thread, &status);
+	if (ret) {
+		ERROR("return code from pthread_join() is %d", ret);
+		return -EFAULT;
+	}
+	ret = (unsigned long)status;
+	/* the thread closes its input on error only */
+	if (!ret)
+		close(img->fdin);
+
+	return ret;
+}
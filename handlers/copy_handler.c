@@ -7,13 +7,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <signal.h>
 #include <mtd/mtd-user.h>
 #ifdef __FreeBSD__
 #include <sys/disk.h>
@@ -30,28 +33,400 @@
 #include "chained_handler.h"
 #include "installer.h"
 
-#define PIPE_READ  0
-#define PIPE_WRITE 1
+#define DEFAULT_COPY_WORKERS	4
+#define MAX_COPY_WORKERS	32
 
 static void copy_handler(void);
 static void raw_copyimage_handler(void);
 
+/*
+ * Copy size bytes between two files without going through
+ * userspace if possible: a reflink shares the extents when both
+ * are on the same filesystem and supports it, copy_file_range()
+ * lets the filesystem or the kernel do the copy.
+ */
+static int copy_fast(int fdin, int fdout, size_t size, bool reflink)
+{
+	char buf[64 * 1024];
+	size_t copied = 0;
+	ssize_t n;
+	int ret;
+
+#ifdef FICLONE
+	if (reflink && ioctl(fdout, FICLONE, fdin) == 0)
+		return 0;
+#else
+	(void)reflink;
+#endif
+
+	preallocate_output(fdout, size);
+
+	ret = copy_in_kernel(fdin, fdout, size, &copied);
+	if (ret != -EOPNOTSUPP)
+		return (ret || copied == size) ? ret : -EIO;
+
+	while (copied < size) {
+		n = read(fdin, buf, min(sizeof(buf), size - copied));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		if (copy_write(&fdout, buf, n) < 0)
+			return -EIO;
+		copied += n;
+	}
+
+	return 0;
+}
+
+static void copy_metadata(int fd, const char *path, struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	/* ownership can be set only if running as root */
+	if (fd >= 0) {
+		if (fchown(fd, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+			WARN("Cannot set owner of %s: %s", path, strerror(errno));
+		(void)fchmod(fd, st->st_mode & 07777);
+		(void)futimens(fd, times);
+	} else {
+		if (lchown(path, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+			WARN("Cannot set owner of %s: %s", path, strerror(errno));
+		if (!S_ISLNK(st->st_mode))
+			(void)chmod(path, st->st_mode & 07777);
+		(void)utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+	}
+}
+
+static int copy_regular_file(const char *src, const char *dst, struct stat *st,
+			     bool reflink)
+{
+	int fdin, fdout;
+	int ret;
+
+	fdin = open(src, O_RDONLY);
+	if (fdin < 0) {
+		ERROR("%s cannot be opened: %s", src, strerror(errno));
+		return -ENOENT;
+	}
+	fdout = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+	if (fdout < 0) {
+		ERROR("%s cannot be created: %s", dst, strerror(errno));
+		close(fdin);
+		return -EIO;
+	}
+
+	ret = copy_fast(fdin, fdout, st->st_size, reflink);
+	if (ret)
+		ERROR("Copying %s to %s failed: %s", src, dst, strerror(-ret));
+	else
+		copy_metadata(fdout, dst, st);
+
+	close(fdin);
+	if (close(fdout) && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+
+struct copy_job {
+	char *src;
+	char *dst;
+	struct stat st;
+	STAILQ_ENTRY(copy_job) next;
+};
+
+STAILQ_HEAD(copy_jobs, copy_job);
+
+struct copy_dir {
+	char *path;
+	struct stat st;
+	SLIST_ENTRY(copy_dir) next;
+};
+
+SLIST_HEAD(copy_dirs, copy_dir);
+
+/*
+ * Recursive copy: the tree is walked by the caller, which creates
+ * directories, links and special files, while the regular files
+ * are copied by a pool of workers.
+ */
+struct copy_tree {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct copy_jobs jobs;
+	struct copy_dirs dirs;
+	bool done;
+	bool reflink;
+	int error;
+	unsigned long files;
+	unsigned long long bytes;
+};
+
+static void *copy_worker(void *data)
+{
+	struct copy_tree *tree = data;
+	struct copy_job *job;
+	int ret;
+
+	pthread_mutex_lock(&tree->lock);
+	for (;;) {
+		while (STAILQ_EMPTY(&tree->jobs) && !tree->done)
+			pthread_cond_wait(&tree->cond, &tree->lock);
+		job = STAILQ_FIRST(&tree->jobs);
+		if (!job)
+			break;
+		STAILQ_REMOVE_HEAD(&tree->jobs, next);
+		pthread_mutex_unlock(&tree->lock);
+
+		ret = tree->error ? 0 :
+			copy_regular_file(job->src, job->dst, &job->st, tree->reflink);
+
+		free(job->src);
+		free(job->dst);
+		free(job);
+
+		pthread_mutex_lock(&tree->lock);
+		if (ret && !tree->error)
+			tree->error = ret;
+	}
+	pthread_mutex_unlock(&tree->lock);
+
+	return NULL;
+}
+
+static int copy_queue_file(struct copy_tree *tree, const char *src,
+			   const char *dst, struct stat *st)
+{
+	struct copy_job *job = calloc(1, sizeof(*job));
+
+	if (!job)
+		return -ENOMEM;
+	job->src = strdup(src);
+	job->dst = strdup(dst);
+	job->st = *st;
+	if (!job->src || !job->dst) {
+		free(job->src);
+		free(job->dst);
+		free(job);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&tree->lock);
+	STAILQ_INSERT_TAIL(&tree->jobs, job, next);
+	tree->files++;
+	tree->bytes += st->st_size;
+	pthread_cond_signal(&tree->cond);
+	pthread_mutex_unlock(&tree->lock);
+
+	return 0;
+}
+
+static int copy_walk(struct copy_tree *tree, const char *src, const char *dst)
+{
+	struct dirent *d;
+	struct stat st;
+	struct copy_dir *dir;
+	DIR *dp;
+	int ret = 0;
+
+	if (lstat(src, &st) < 0) {
+		ERROR("Cannot stat %s: %s", src, strerror(errno));
+		return -ENOENT;
+	}
+
+	if (mkdir(dst, (st.st_mode & 07777) | S_IWUSR | S_IXUSR) < 0 && errno != EEXIST) {
+		ERROR("Cannot create directory %s: %s", dst, strerror(errno));
+		return -EIO;
+	}
+
+	/* permissions and times of directories are set after their content */
+	dir = calloc(1, sizeof(*dir));
+	if (!dir || !(dir->path = strdup(dst))) {
+		free(dir);
+		return -ENOMEM;
+	}
+	dir->st = st;
+	SLIST_INSERT_HEAD(&tree->dirs, dir, next);
+
+	dp = opendir(src);
+	if (!dp) {
+		ERROR("Cannot open directory %s: %s", src, strerror(errno));
+		return -EIO;
+	}
+
+	while (!ret && !tree->error && (d = readdir(dp)) != NULL) {
+		char *s, *t;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (asprintf(&s, "%s/%s", src, d->d_name) < 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (asprintf(&t, "%s/%s", dst, d->d_name) < 0) {
+			free(s);
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (lstat(s, &st) < 0) {
+			ERROR("Cannot stat %s: %s", s, strerror(errno));
+			ret = -ENOENT;
+		} else if (S_ISDIR(st.st_mode)) {
+			ret = copy_walk(tree, s, t);
+		} else if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+			/*
+			 * Hardlinks are copied as separate files; do it here
+			 * so that a failing copy is not hidden by the pool.
+			 */
+			ret = copy_regular_file(s, t, &st, tree->reflink);
+		} else if (S_ISREG(st.st_mode)) {
+			ret = copy_queue_file(tree, s, t, &st);
+		} else if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t n = readlink(s, target, sizeof(target) - 1);
+
+			if (n < 0) {
+				ret = -EIO;
+			} else {
+				target[n] = '\0';
+				unlink(t);
+				if (symlink(target, t) < 0) {
+					ERROR("Cannot create link %s: %s", t, strerror(errno));
+					ret = -EIO;
+				} else
+					copy_metadata(-1, t, &st);
+			}
+		} else {
+			unlink(t);
+			if (mknod(t, st.st_mode, st.st_rdev) < 0) {
+				ERROR("Cannot create %s: %s", t, strerror(errno));
+				ret = -EIO;
+			} else
+				copy_metadata(-1, t, &st);
+		}
+
+		free(s);
+		free(t);
+	}
+
+	closedir(dp);
+
+	return ret;
+}
+
+static int copy_tree(const char *src, const char *dst, unsigned int nworkers,
+		     bool reflink)
+{
+	struct copy_tree tree;
+	pthread_t workers[MAX_COPY_WORKERS];
+	struct copy_dir *dir;
+	unsigned int i, started = 0;
+	int ret;
+
+	memset(&tree, 0, sizeof(tree));
+	pthread_mutex_init(&tree.lock, NULL);
+	pthread_cond_init(&tree.cond, NULL);
+	STAILQ_INIT(&tree.jobs);
+	SLIST_INIT(&tree.dirs);
+	tree.reflink = reflink;
+
+	for (i = 0; i < nworkers; i++) {
+		if (start_worker_thread(&workers[i], copy_worker, &tree))
+			break;
+		started++;
+	}
+	if (!started) {
+		ERROR("Cannot start copy workers");
+		return -EFAULT;
+	}
+
+	ret = copy_walk(&tree, src, dst);
+
+	pthread_mutex_lock(&tree.lock);
+	tree.done = true;
+	if (ret)
+		tree.error = ret;
+	pthread_cond_broadcast(&tree.cond);
+	pthread_mutex_unlock(&tree.lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	ret = tree.error;
+
+	/* deepest directories are first in the list */
+	while (!SLIST_EMPTY(&tree.dirs)) {
+		dir = SLIST_FIRST(&tree.dirs);
+		SLIST_REMOVE_HEAD(&tree.dirs, next);
+		if (!ret)
+			copy_metadata(-1, dir->path, &dir->st);
+		free(dir->path);
+		free(dir);
+	}
+
+	pthread_mutex_destroy(&tree.lock);
+	pthread_cond_destroy(&tree.cond);
+
+	if (!ret)
+		TRACE("Copied %lu files (%llu bytes) from %s to %s with %u workers",
+		      tree.files, tree.bytes, src, dst, started);
+
+	return ret;
+}
+
+/*
+ * Regular file to regular file without a chained handler:
+ * the raw handler would just write the data, so copy it directly.
+ */
+static int copy_single_file(int fdin, struct img_type *img, size_t size,
+			    struct stat *st, bool reflink)
+{
+	struct stat dst;
+	int fdout, flags = O_WRONLY | O_CREAT;
+	bool whole = (off_t)size == st->st_size;
+	int ret;
+
+	if (stat(img->device, &dst) == 0 && !S_ISREG(dst.st_mode))
+		return -EOPNOTSUPP;
+
+	if (whole)
+		flags |= O_TRUNC;
+	fdout = open(img->device, flags, st->st_mode & 07777);
+	if (fdout < 0) {
+		ERROR("%s cannot be opened: %s", img->device, strerror(errno));
+		return -ENODEV;
+	}
+
+	ret = copy_fast(fdin, fdout, size, reflink && whole);
+	if (!ret && fdatasync(fdout) < 0)
+		ret = -EIO;
+	if (close(fdout) && !ret)
+		ret = -EIO;
+	if (ret)
+		ERROR("Copy to %s failed", img->device);
+
+	return ret;
+}
+
 static int copy_image_file(struct img_type *img, void *data)
 {
 	int ret;
-	int fdout, fdin;
+	int fdin;
 	struct dict_list *proplist;
 	struct dict_list_elem *entry;
-	uint32_t checksum;
 	unsigned long offset = 0;
 	size_t size;
 	struct stat statbuf;
 	struct script_handler_data *script_data;
 	struct chain_handler_data priv;
-	pthread_t chain_handler_thread_id;
-	int pipes[2];
+	struct chain_handler chained;
+	int status;
 	char *path = NULL;
 	struct mtd_info_user	mtdinfo;
+	const char *value, *chain;
+	bool reflink;
 
 	if (!data)
 		return -1;
@@ -105,6 +480,28 @@ static int copy_image_file(struct img_type *img, void *data)
 		return -ENODEV;
 	}
 
+	value = dict_get_value(&img->properties, "reflink");
+	reflink = !value || strtobool(value);
+
+	if (S_ISDIR(statbuf.st_mode)) {
+		unsigned int nworkers = DEFAULT_COPY_WORKERS;
+
+		value = dict_get_value(&img->properties, "copy-workers");
+		if (value)
+			nworkers = strtoul(value, NULL, 10);
+		if (!nworkers || nworkers > MAX_COPY_WORKERS) {
+			ERROR("copy-workers must be between 1 and %d", MAX_COPY_WORKERS);
+			free(path);
+			close(fdin);
+			return -EINVAL;
+		}
+		close(fdin);
+		TRACE("Copying directory %s to %s", path, img->device);
+		ret = copy_tree(path, img->device, nworkers, reflink);
+		free(path);
+		return ret;
+	}
+
 	/*
 	 * Detect the size if not set in sw-descriptiont
 	 */
@@ -139,17 +536,19 @@ static int copy_image_file(struct img_type *img, void *data)
 		return -EFAULT;
 	}
 
-	if (pipe(pipes) < 0) {
-		ERROR("Could not create pipes for chained handler, existing...");
-		close(fdin);
-		return -EFAULT;
+	chain = dict_get_value(&img->properties, "chain");
+	if (S_ISREG(statbuf.st_mode) && !img->seek && (!chain || !strcmp(chain, "raw"))) {
+		ret = copy_single_file(fdin, img, size, &statbuf, reflink);
+		if (ret != -EOPNOTSUPP) {
+			close(fdin);
+			return ret;
+		}
 	}
 
 	/* Overwrite some parameters for chained handler */
 	memcpy(&priv.img, img, sizeof(*img));
 	priv.img.compressed = COMPRESSED_FALSE;
 	memset(priv.img.sha256, 0, SHA256_HASH_LENGTH);
-	priv.img.fdin = pipes[PIPE_READ];
 	priv.img.size = size;
 
 	/*
@@ -164,32 +563,28 @@ static int copy_image_file(struct img_type *img, void *data)
 		TRACE("Set %s handler in the chain", priv.img.type);
 	}
 
-	fdout = pipes[PIPE_WRITE];
-	signal(SIGPIPE, SIG_IGN);
-
-	chain_handler_thread_id = start_thread(chain_handler_thread, &priv);
-	wait_threads_ready();
+	ret = chain_handler_start(&chained, &priv.img);
+	if (ret) {
+		close(fdin);
+		return ret;
+	}
 
 	ret = copyfile(fdin,
-			&fdout,
+			&chained,
 			size,
 			&offset,
 			0,
 			0, /* no skip */
 			0, /* no compressed */
-			&checksum,
+			NULL, /* no checksum */
 			0, /* no sha256 */
 			false, /* no encrypted */
 			NULL, /* no IVT */
-			NULL);
+			chain_handler_callback(&chained));
 
-	close(fdout);
-	void *status;
-	ret = pthread_join(chain_handler_thread_id, &status);
-	if (ret) {
-		ERROR("return code from pthread_join() is %d", ret);
-	} else
-		ret = (unsigned long)status;
+	status = chain_handler_end(&chained, ret == 0);
+	if (!ret)
+		ret = status;
 
 	DEBUG("Chained handler returned %d", ret);
 
@@ -201,12 +596,12 @@ __attribute__((constructor))
 void copy_handler(void)
 {
 	register_handler("copy", copy_image_file,
-				SCRIPT_HANDLER | NO_DATA_HANDLER, NULL);
+				SCRIPT_HANDLER | NO_DATA_HANDLER | SEEKABLE_HANDLER, NULL);
 }
 
 __attribute__((constructor))
 void raw_copyimage_handler(void)
 {
 	register_handler("rawcopy", copy_image_file,
-				SCRIPT_HANDLER | NO_DATA_HANDLER, NULL);
+				SCRIPT_HANDLER | NO_DATA_HANDLER | SEEKABLE_HANDLER, NULL);
 }
@@ -15,17 +15,26 @@
  * This is used explicitely to retrieve ranges : an answer
  * different as "Partial Content" (206) is rejected. This avoids that the
  * whole file is downloaded if the server is not able to work with ranges.
+ * Each request is served by an own thread with an own connection, so that
+ * the main task can keep several requests in flight. Answers are
+ * interleaved on the IPC and the main task reorders them using the id.
+ * If the main task shares a ring with the downloader (RANGE_RING),
+ * the answers are written there instead of the IPC.
  */
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <util.h>
 #include <pctl.h>
 #include <zlib.h>
@@ -34,17 +43,40 @@
 #include "delta_handler.h"
 #include "delta_process.h"
 
+/*
+ * Ring shared with the main task, mapped as long as
+ * it is the current one or a download writes into it
+ */
+struct ring_map {
+	range_ring_t *ring;
+	size_t len;
+	unsigned int users;
+};
+
 /*
  * Structure used in curl callbacks
  */
 typedef struct {
 	unsigned int id;	/* Request id */
 	int writefd;		/* IPC file descriptor */
+	struct ring_map *ring;	/* answers go here if set */
 	range_answer_t *answer;
 } dwl_data_t;
 
 extern channel_op_res_t channel_curl_init(void);
 
+/*
+ * Threads share the IPC, a message must be written
+ * completely before another thread can send
+ */
+static pthread_mutex_t ipc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* sw_sockfd of the process, read by the download threads, too */
+static int chunks_sockfd = -1;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring_map *current_ring;
+
 static channel_data_t channel_data_defaults = {
 					.debug = false,
 					.source=SOURCE_CHUNKS_DOWNLOADER,
@@ -58,6 +90,124 @@ static channel_data_t channel_data_defaults = {
 					.received_headers = NULL
 					};
 
+static void ring_put(struct ring_map *map)
+{
+	pthread_mutex_lock(&ring_lock);
+	if (!--map->users) {
+		munmap(map->ring, map->len);
+		free(map);
+	}
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * The ring for a new download, NULL if the main task
+ * does not share one or stopped reading it
+ */
+static struct ring_map *ring_get(void)
+{
+	struct ring_map *map;
+
+	pthread_mutex_lock(&ring_lock);
+	map = current_ring;
+	if (map && map->ring->closed) {
+		current_ring = NULL;
+		pthread_mutex_unlock(&ring_lock);
+		ring_put(map);
+		return NULL;
+	}
+	if (map)
+		map->users++;
+	pthread_mutex_unlock(&ring_lock);
+
+	return map;
+}
+
+/*
+ * Map the ring passed by the main task, it replaces
+ * the previous one
+ */
+static int ring_attach(int fd)
+{
+	struct ring_map *map, *old;
+	struct stat st;
+	void *addr;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(range_ring_t))
+		return -EINVAL;
+	addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return -errno;
+	map = (struct ring_map *)calloc(1, sizeof(*map));
+	if (!map) {
+		munmap(addr, st.st_size);
+		return -ENOMEM;
+	}
+	map->ring = addr;
+	map->len = st.st_size;
+	map->users = 1;
+	if (!map->ring->nslots || offsetof(range_ring_t, slots) +
+	    (size_t)map->ring->nslots * sizeof(range_answer_t) > map->len) {
+		ring_put(map);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&ring_lock);
+	old = current_ring;
+	current_ring = map;
+	pthread_mutex_unlock(&ring_lock);
+	if (old)
+		ring_put(old);
+
+	return 0;
+}
+
+/*
+ * Copy an answer into the next free slot, waiting for
+ * the main task to read the older ones
+ */
+static int ring_write(range_ring_t *ring, uint32_t id, request_type type,
+		      const char *data, size_t len, uint32_t crc)
+{
+	range_answer_t *slot;
+
+	if (pthread_mutex_lock(&ring->lock))
+		return -EPIPE;
+	while (!ring->closed && ring->head - ring->tail >= ring->nslots)
+		pthread_cond_wait(&ring->freed, &ring->lock);
+	if (ring->closed) {
+		pthread_mutex_unlock(&ring->lock);
+		return -EPIPE;
+	}
+	slot = &ring->slots[ring->head % ring->nslots];
+	slot->id = id;
+	slot->type = type;
+	slot->len = len;
+	slot->crc = crc;
+	if (len)
+		memcpy(slot->data, data, len);
+	ring->head++;
+	pthread_cond_signal(&ring->filled);
+	pthread_mutex_unlock(&ring->lock);
+
+	return 0;
+}
+
+static int send_answer(dwl_data_t *dwl, range_answer_t *answer)
+{
+	int ret;
+
+	if (dwl->ring)
+		return ring_write(dwl->ring->ring, answer->id, answer->type,
+				  answer->data, answer->len, answer->crc);
+
+	pthread_mutex_lock(&ipc_lock);
+	ret = copy_write(&dwl->writefd, answer, sizeof(*answer));
+	pthread_mutex_unlock(&ipc_lock);
+
+	return ret;
+}
+
 /*
  * Data callback: takes the buffer, surrounded with IPC meta data
  * and send to the process that reqeusted the download
@@ -82,17 +232,26 @@ static size_t wrdata_callback(char *buffer, size_t size, size_t nmemb, void *dat
 	}
 	while (nbytes > 0) {
 		range_answer_t *answer = dwl->answer;
-		answer->id = dwl->id;
-		answer->type = RANGE_DATA;
-		answer->len = min(nbytes, RANGE_PAYLOAD_SIZE);
-		memcpy(answer->data, buffer, answer->len);
-		answer->crc = crc32(0, (unsigned char *)answer->data, answer->len);
-		ret = copy_write(&dwl->writefd, answer, sizeof(range_answer_t));
+		size_t len = min(nbytes, RANGE_PAYLOAD_SIZE);
+
+		if (dwl->ring) {
+			/* copied only once, from curl into the ring */
+			ret = ring_write(dwl->ring->ring, dwl->id, RANGE_DATA, buffer, len,
+					 crc32(0, (unsigned char *)buffer, len));
+		} else {
+			answer->id = dwl->id;
+			answer->type = RANGE_DATA;
+			answer->len = len;
+			memcpy(answer->data, buffer, answer->len);
+			answer->crc = crc32(0, (unsigned char *)answer->data, answer->len);
+			ret = send_answer(dwl, answer);
+		}
 		if (ret < 0) {
 			ERROR("Error sending IPC data !");
 			return 0;
 		}
-		nbytes -= answer->len;
+		buffer += len;
+		nbytes -= len;
 	}
 
 	return size * nmemb;
@@ -120,8 +279,8 @@ static size_t delta_callback_headers(char *buffer, size_t size, size_t nitems, v
 	answer->len++;
 	answer->data[answer->len] = '\0';
 
-	ret = write(dwl->writefd, answer, sizeof(range_answer_t));
-	if (ret != sizeof(range_answer_t)) {
+	ret = send_answer(dwl, answer);
+	if (ret < 0) {
 		ERROR("Error sending IPC data !");
 		return 0;
 	}
@@ -130,64 +289,35 @@ static size_t delta_callback_headers(char *buffer, size_t size, size_t nitems, v
 }
 
 /*
- * Process that is spawned by the handler to download the missing chunks.
- * Downloading should be done in a separate process to not break
- * privilige separation
+ * Serve a single range request. It runs in an own thread
+ * and frees the request when done.
  */
-int start_delta_downloader(const char __attribute__ ((__unused__)) *fname,
-				int __attribute__ ((__unused__)) argc,
-				__attribute__ ((__unused__)) char *argv[])
+static void *range_download(void *data)
 {
-	ssize_t ret;
-	range_request_t *req = NULL;
+	range_request_t *req = (range_request_t *)data;
 	channel_op_res_t transfer;
 	range_answer_t *answer;
-	struct dict httpheaders;
+	channel_t *channel;
 	dwl_data_t priv;
 
-	TRACE("Starting Internal process for downloading chunks");
-	if (channel_curl_init() != CHANNEL_OK) {
-		ERROR("Cannot initialize curl");
-		return SERVER_EINIT;
-	}
-	req = (range_request_t *)malloc(sizeof *req);
-	if (!req) {
-		ERROR("OOM requesting request buffers !");
-		exit (EXIT_FAILURE);
-	}
-
 	answer = (range_answer_t *)malloc(sizeof *answer);
 	if (!answer) {
 		ERROR("OOM requesting answer buffers !");
-		exit (EXIT_FAILURE);
+		free(req);
+		return NULL;
 	}
 
+	priv.writefd = chunks_sockfd;
+	priv.id = req->id;
+	priv.answer = answer;
+	priv.ring = ring_get();
+
 	channel_data_t channel_data = channel_data_defaults;
-	channel_t *channel = channel_new();
+	channel = channel_new();
 	if (!channel) {
 		ERROR("Cannot get channel for communication");
-		exit (EXIT_FAILURE);
-	}
-	LIST_INIT(&httpheaders);
-	if (dict_insert_value(&httpheaders, "Accept", "*/*")) {
-		ERROR("Database error setting Accept header");
-		exit (EXIT_FAILURE);
-	}
-
-	for (;;) {
-		ret = read(sw_sockfd, req, sizeof(range_request_t));
-		if (ret < 0) {
-			ERROR("reading from sockfd returns error, aborting...");
-			exit (EXIT_FAILURE);
-		}
-
-		if ((req->urllen + req->rangelen) > ret) {
-			ERROR("Malformed data");
-			continue;
-		}
-		priv.writefd = sw_sockfd;
-		priv.id = req->id;
-		priv.answer = answer;
+		transfer = CHANNEL_EINIT;
+	} else {
 		channel_data.url = req->data;
 		channel_data.noipc = true;
 		channel_data.method = CHANNEL_GET;
@@ -203,15 +333,153 @@ int start_delta_downloader(const char __attribute__ ((__unused__)) *fname,
 			ERROR("Cannot open channel for communication");
 			transfer = CHANNEL_EINIT;
 		}
+	}
 
-		answer->id = req->id;
-		answer->type = (transfer == CHANNEL_OK) ? RANGE_COMPLETED : RANGE_ERROR;
-		answer->len = 0;
-		if (write(sw_sockfd, answer, sizeof(*answer)) != sizeof(*answer)) {
-			ERROR("Answer cannot be sent back, maybe deadlock !!");
-		}
+	answer->id = req->id;
+	answer->type = (transfer == CHANNEL_OK) ? RANGE_COMPLETED : RANGE_ERROR;
+	answer->len = 0;
+	if (send_answer(&priv, answer) < 0) {
+		ERROR("Answer cannot be sent back, maybe deadlock !!");
+	}
 
+	if (channel) {
 		(void)channel->close(channel);
+		free(channel);
+	}
+	if (priv.ring)
+		ring_put(priv.ring);
+	free(answer);
+	free(req);
+
+	return NULL;
+}
+
+/*
+ * Read a request, with the descriptor of the ring if one is passed
+ */
+static ssize_t read_request(int fd, range_request_t *req, int *passed)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { req, sizeof(*req) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	int rfd;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	*passed = -1;
+	n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return n;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(&rfd, CMSG_DATA(cmsg), sizeof(rfd));
+		if (*passed < 0)
+			*passed = rfd;
+		else
+			close(rfd);
+	}
+
+	return n;
+}
+
+/*
+ * A RANGE_RING request is acknowledged on the IPC
+ */
+static void setup_ring(range_request_t *req, int fd)
+{
+	dwl_data_t dwl = { .writefd = chunks_sockfd };
+	range_answer_t *answer;
+	int ret = fd < 0 ? -EINVAL : ring_attach(fd);
+
+	if (ret)
+		ERROR("Ring from the handler cannot be mapped: %s", strerror(-ret));
+	answer = (range_answer_t *)calloc(1, sizeof(*answer));
+	if (!answer) {
+		ERROR("OOM requesting answer buffers !");
+		return;
+	}
+	answer->id = req->id;
+	answer->type = ret ? RANGE_ERROR : RANGE_COMPLETED;
+	if (send_answer(&dwl, answer) < 0)
+		ERROR("Answer cannot be sent back, maybe deadlock !!");
+	free(answer);
+}
+
+/*
+ * Process that is spawned by the handler to download the missing chunks.
+ * Downloading should be done in a separate process to not break
+ * privilige separation
+ */
+int start_delta_downloader(const char __attribute__ ((__unused__)) *fname,
+				int __attribute__ ((__unused__)) argc,
+				__attribute__ ((__unused__)) char *argv[])
+{
+	ssize_t ret;
+	range_request_t *req;
+	pthread_attr_t attr;
+	pthread_t id;
+	int fd;
+
+	TRACE("Starting Internal process for downloading chunks");
+	subprocess_ready();
+	chunks_sockfd = sw_sockfd;
+	if (channel_curl_init() != CHANNEL_OK) {
+		ERROR("Cannot initialize curl");
+		return SERVER_EINIT;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		req = (range_request_t *)malloc(sizeof *req);
+		if (!req) {
+			ERROR("OOM requesting request buffers !");
+			exit (EXIT_FAILURE);
+		}
+
+		ret = read_request(chunks_sockfd, req, &fd);
+		if (ret < 0) {
+			ERROR("reading from sockfd returns error, aborting...");
+			exit (EXIT_FAILURE);
+		}
+
+		if (ret >= (ssize_t)offsetof(range_request_t, data) &&
+		    req->type == RANGE_RING) {
+			setup_ring(req, fd);
+			if (fd >= 0)
+				close(fd);
+			free(req);
+			continue;
+		}
+		if (fd >= 0)
+			close(fd);
+
+		if ((req->urllen + req->rangelen) > ret) {
+			ERROR("Malformed data");
+			free(req);
+			continue;
+		}
+
+		/*
+		 * Run the transfer in background, so that next
+		 * requests can be accepted. If no thread can be
+		 * created, serve the request here.
+		 */
+		if (pthread_create(&id, &attr, range_download, req)) {
+			WARN("Cannot start download thread, downloading synchronously");
+			range_download(req);
+		}
 	}
 
 	exit (EXIT_SUCCESS);
@@ -22,28 +22,43 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <bsdqueue.h>
 #include <swupdate.h>
 #include <handler.h>
-#include <signal.h>
 #include <zck.h>
 #include <zlib.h>
 #include <util.h>
 #include <pctl.h>
 #include <pthread.h>
 #include <fs_interface.h>
+#include <sslapi.h>
+#include <progress.h>
 #include "delta_handler.h"
 #include "multipart_parser.h"
 #include "installer.h"
 #include "zchunk_range.h"
 #include "chained_handler.h"
+#include "delta_index.h"
 
 #define DEFAULT_MAX_RANGES	150	/* Apache has default = 200 */
+#define DEFAULT_PARALLEL_RANGES	4	/* Range requests kept in flight */
+#define COST_WEIGHT		0.25	/* weight of a new sample in the estimation */
+#define EXTENT_MAX_SIZE		(4 * 1024 * 1024)	/* source chunks copied at once */
+#define DEFAULT_DECODE_THREADS	4	/* max workers decoding downloaded chunks */
+#define DECODE_QUEUE		32	/* downloaded chunks waiting to be written */
+#define QUEUED_ANSWERS_MAX	(8 * 1024 * 1024)	/* payload kept for later requests */
 
 const char *handlername = "delta";
 void delta_handler(void);
@@ -86,29 +101,131 @@ struct dwlchunk {
 	bool completed;
 };
 
+/*
+ * Answer from the downloader that belongs to a request
+ * not yet processed. Only the used part of the payload is stored.
+ */
+struct dwlanswer {
+	SIMPLEQ_ENTRY(dwlanswer) next;
+	range_answer_t answer;
+};
+SIMPLEQ_HEAD(dwlanswers, dwlanswer);
+
+/*
+ * Range request sent to the downloader. Requests are
+ * processed in the order they were sent, that is in
+ * the order of the chunks they cover.
+ */
+struct dwlrequest {
+	uint32_t id;
+	zckChunk *first;		/* first chunk retrieved by this request */
+	struct timespec sent;		/* time the request was sent to the downloader */
+	struct timespec started;	/* time the first answer was received */
+	bool answered;
+	size_t bytes;			/* payload received for this request */
+	struct dwlanswers answers;	/* answers received before request is processed */
+	SIMPLEQ_ENTRY(dwlrequest) next;
+};
+SIMPLEQ_HEAD(dwlrequests, dwlrequest);
+
+/*
+ * Downloaded chunks are decompressed and verified by a pool
+ * of workers while the next ones are received. They are
+ * written in the order they were queued, by the handler.
+ */
+struct decode_job {
+	unsigned char *in;		/* compressed chunk, freed by the worker */
+	size_t inlen;
+	unsigned char hash[SHA256_HASH_LENGTH];
+	unsigned char *out;		/* decompressed chunk */
+	size_t outlen;
+	size_t outsize;
+	int ret;
+	bool done;
+};
+
+struct decode_pool {
+	pthread_t *threads;
+	unsigned int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* a job was queued or the pool stops */
+	pthread_cond_t done;		/* a job was decoded */
+	struct decode_job jobs[DECODE_QUEUE];
+	unsigned long head;		/* next job to be written */
+	unsigned long taken;		/* next job for a worker */
+	unsigned long tail;		/* next free job */
+	bool stop;
+	bool error;			/* a chunk could not be decoded or written */
+};
+
+/*
+ * The sources are indexed one after the other into a single
+ * ZCK index: a source covers [base, base + size) of it.
+ */
+struct delta_source {
+	const char *dev;
+	int fd;
+	size_t base;
+	size_t size;
+};
+
 struct hnd_priv {
 	/* Attributes retrieved from sw-descritpion */
 	char *url;			/* URL to get full ZCK file */
 	char *srcdev;			/* device as source for comparison */
+	struct delta_source *sources;	/* srcdev first, then the other sources */
+	unsigned int nsources;
 	char *chainhandler;		/* Handler to pass the decompressed image */
-	struct chain_handler_data chain_handler_data;
 	zck_log_type zckloglevel;	/* if found, set log level for ZCK to this */
 	bool detectsrcsize;		/* if set, try to compute size of filesystem in srcdev */
 	size_t srcsize;			/* Size of source */
 	unsigned long max_ranges;	/* Max allowed ranges (configured via sw-description) */
+	unsigned long max_parallel;	/* Max requests in flight (configured via sw-description) */
+	size_t max_gap;			/* Unchanged bytes downloaded to merge ranges */
+	bool adaptive_gap;		/* compute max_gap from measured rtt and bandwidth */
+	zck_range_cost cost;		/* measured network parameters */
+	char *indexcache;		/* directory to store index of source */
+	char *cachekey;			/* identifies the source the index belongs to */
+	char *cachetmp;			/* index being written */
+	const char *srcversion;		/* version of the software in the source */
+	bool indexdst;			/* keep the index of the destination */
+	zckCtx *dstindex;		/* index of the destination being written */
+	int dstindexfd;
+	char *dstindextmp;
+	size_t dstindexsize;		/* bytes of the destination indexed */
+	size_t srcbase;			/* offset of first chunk in source index */
+	unsigned char *extbuf;		/* buffer for contiguous source chunks */
+	size_t extbufsize;
+	/* Resume of an interrupted update */
+	char *journal;			/* file to record progress */
+	char *journalkey;		/* identifies the update in the journal */
+	long resume_limit;		/* chunks below are read back from destination */
+	long journaled;			/* last value written into journal */
+	int fddst;			/* destination, opened for reading when resuming */
+	unsigned long long dstseek;	/* offset of artifact in destination */
+	zckChunk *poschunk;		/* cache to compute output offset of chunks */
+	size_t pos;
 	/* Data to be transferred to chain handler */
 	struct img_type img;
-	int fdout;
-	int fdsrc;
+	struct chain_handler chain;	/* handler installing the artifact */
+	unsigned long decode_threads;	/* workers decoding downloaded chunks */
+	struct decode_pool *decode;
 	zckCtx *tgt;
 	/* Structures for downloading chunks */
 	bool dwlrunning;
 	range_type_t range_type;	/* Single or multipart */
 	char boundary[SWUPDATE_GENERAL_STRING_SIZE];
 	int pipetodwl;			/* pipe to downloader process */
+	unsigned long ringslots;	/* answers in the ring shared with the downloader */
+	range_ring_t *ring;		/* if set, answers are read from here */
+	size_t ringlen;
 	dwl_state_t dwlstate;		/* for internal state machine */
 	range_answer_t *answer;			/* data from downloader */
 	uint32_t reqid;			/* Current request id to downloader */
+	struct dwlrequests requests;	/* Requests in flight */
+	unsigned long inflight;		/* Number of requests in flight */
+	size_t queued;			/* payload of answers kept for later requests */
+	zckChunk *nextreq;		/* First chunk not yet requested */
 	struct dwlchunk current;	/* Structure to collect data for working chunk */
 	zckChunk *chunk;		/* Current chunk to be processed */
 	size_t rangelen;		/* Value from Content-range header */
@@ -122,9 +239,217 @@ struct hnd_priv {
 	size_t totaldwlbytes;		/* bytes downloaded, including headers */
 	/* flags to improve logging */
 	bool debugchunks;
+	bool dry_run;			/* only estimate the download */
 };
 
 static bool copy_existing_chunks(zckChunk **dstChunk, struct hnd_priv *priv);
+static int delta_output(void *out, const void *buf, size_t len);
+
+static int decode_output(void *out, const void *buf, size_t len)
+{
+	struct decode_job *job = (struct decode_job *)out;
+
+	if (job->outlen + len > job->outsize) {
+		size_t size = max(job->outlen + len, job->outsize * 2);
+		unsigned char *tmp = realloc(job->out, size);
+
+		if (!tmp)
+			return -ENOMEM;
+		job->out = tmp;
+		job->outsize = size;
+	}
+	memcpy(job->out + job->outlen, buf, len);
+	job->outlen += len;
+
+	return 0;
+}
+
+static void *decode_thread(void *data)
+{
+	struct decode_pool *pool = (struct decode_pool *)data;
+	struct decode_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->taken == pool->tail && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->taken == pool->tail) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->taken++ % DECODE_QUEUE];
+		pthread_mutex_unlock(&pool->lock);
+
+		job->ret = copybuffer(job->in, job, job->inlen, COMPRESSED_ZSTD,
+				      job->hash, 0, NULL, decode_output);
+		free(job->in);
+		job->in = NULL;
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static void decode_stop(struct hnd_priv *priv)
+{
+	struct decode_pool *pool = priv->decode;
+	unsigned int i;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	for (i = 0; i < DECODE_QUEUE; i++) {
+		free(pool->jobs[i].in);
+		free(pool->jobs[i].out);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+	priv->decode = NULL;
+}
+
+/*
+ * Chunks are decoded in the handler's thread if the pool
+ * cannot be started
+ */
+static void decode_start(struct hnd_priv *priv)
+{
+	struct decode_pool *pool;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long nthreads = priv->decode_threads;
+
+	if (!nthreads)
+		nthreads = min(cpus > 0 ? (unsigned long)cpus : 1UL,
+			       (unsigned long)DEFAULT_DECODE_THREADS);
+	nthreads = min(nthreads, (unsigned long)DECODE_QUEUE);
+	if (nthreads < 2)
+		return;
+
+	pool = (struct decode_pool *)calloc(1, sizeof(*pool));
+	if (!pool)
+		return;
+	pool->threads = (pthread_t *)calloc(nthreads, sizeof(*pool->threads));
+	if (!pool->threads) {
+		free(pool);
+		return;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	priv->decode = pool;
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		if (start_worker_thread(&pool->threads[pool->nthreads],
+					decode_thread, pool))
+			break;
+	}
+	if (!pool->nthreads) {
+		WARN("Workers to decode chunks cannot be started");
+		decode_stop(priv);
+		return;
+	}
+	TRACE("Downloaded chunks are decoded by %u workers", pool->nthreads);
+}
+
+/*
+ * Write the decoded chunks in order, if wait is set until
+ * all queued chunks are written
+ */
+static bool decode_write(struct hnd_priv *priv, bool wait)
+{
+	struct decode_pool *pool = priv->decode;
+
+	if (!pool)
+		return true;
+	while (pool->head != pool->tail) {
+		struct decode_job *job = &pool->jobs[pool->head % DECODE_QUEUE];
+		bool done;
+		int ret;
+
+		pthread_mutex_lock(&pool->lock);
+		while (!job->done && wait)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		done = job->done;
+		pthread_mutex_unlock(&pool->lock);
+		if (!done)
+			break;
+
+		ret = job->ret;
+		if (ret)
+			ERROR("Downloaded chunk cannot be decoded (%d)", ret);
+		else if (!pool->error) {
+			ret = priv->dstindex ? delta_output(priv, job->out, job->outlen) :
+				chain_handler_callback(&priv->chain)(&priv->chain, job->out,
+								     job->outlen);
+			if (ret < 0)
+				ERROR("Downloaded chunk cannot be written (%d)", ret);
+		}
+		if (ret)
+			pool->error = true;
+		job->outlen = 0;
+		job->done = false;
+		pool->head++;
+	}
+
+	return !pool->error;
+}
+
+/*
+ * Queue a chunk for the workers, they own buf
+ */
+static int decode_submit(struct hnd_priv *priv, unsigned char *buf, size_t len,
+			 const unsigned char *hash, size_t size)
+{
+	struct decode_pool *pool = priv->decode;
+	struct decode_job *job;
+
+	/* the queue is full, wait for the oldest chunk */
+	if (pool->tail - pool->head == DECODE_QUEUE) {
+		struct decode_job *oldest = &pool->jobs[pool->head % DECODE_QUEUE];
+
+		pthread_mutex_lock(&pool->lock);
+		while (!oldest->done)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		if (!decode_write(priv, false)) {
+			free(buf);
+			return -EFAULT;
+		}
+	}
+
+	job = &pool->jobs[pool->tail % DECODE_QUEUE];
+	if (job->outsize < size) {
+		unsigned char *tmp = realloc(job->out, size);
+
+		if (!tmp) {
+			free(buf);
+			return -ENOMEM;
+		}
+		job->out = tmp;
+		job->outsize = size;
+	}
+	job->in = buf;
+	job->inlen = len;
+	memcpy(job->hash, hash, SHA256_HASH_LENGTH);
+	job->ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->tail++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return decode_write(priv, false) ? 0 : -EFAULT;
+}
 
 /*
  * Callbacks for multipart parsing.
@@ -160,17 +485,24 @@ static int network_process_data(multipart_parser* p, const char *at, size_t leng
 				TRACE("Copying chunk %ld from NETWORK, size %ld",
 					zck_get_chunk_number(priv->chunk),
 					priv->current.chunksize);
-			if (priv->current.chunksize != 0) {
+			if (priv->current.chunksize == 0) {
+				ret = 0; /* skipping, nothing to be copied */
+			} else if (priv->decode) {
+				ret = decode_submit(priv, priv->current.buf,
+						    priv->current.chunksize, hash,
+						    zck_get_chunk_size(priv->chunk));
+				priv->current.buf = NULL;
+			} else {
 				ret = copybuffer(priv->current.buf,
-						 &priv->fdout,
+						 priv->dstindex ? (void *)priv : &priv->chain,
 						 priv->current.chunksize,
 						 COMPRESSED_ZSTD,
 						 hash,
 						 0,
 						 NULL,
-						 NULL);
-			} else
-				ret = 0; /* skipping, nothing to be copied */
+						 priv->dstindex ? delta_output :
+						 chain_handler_callback(&priv->chain));
+			}
 			/* Buffer can be discarged */
 			free(priv->current.buf);
 			priv->current.buf = NULL;
@@ -188,7 +520,6 @@ static int network_process_data(multipart_parser* p, const char *at, size_t leng
 			priv->chunk = zck_get_next_chunk(priv->chunk);
 			if (!priv->chunk && nbytes > 0) {
 				WARN("Still data in range, but no chunks anymore !");
-				close(priv->fdout);
 			}
 			if (!priv->chunk)
 				break;
@@ -322,6 +653,19 @@ static int delta_retrieve_attributes(struct img_type *img, struct hnd_priv *priv
 		priv->max_ranges = strtoul(dict_get_value(&img->properties, "max-ranges"), NULL, 10);
 	if (errno || priv->max_ranges == 0)
 		priv->max_ranges = DEFAULT_MAX_RANGES;
+	errno = 0;
+	if (dict_get_value(&img->properties, "parallel-ranges"))
+		priv->max_parallel = strtoul(dict_get_value(&img->properties, "parallel-ranges"), NULL, 10);
+	if (errno || priv->max_parallel == 0)
+		priv->max_parallel = DEFAULT_PARALLEL_RANGES;
+
+	char *gap = dict_get_value(&img->properties, "gap-threshold");
+	if (gap) {
+		if (!strcmp(gap, "auto"))
+			priv->adaptive_gap = true;
+		else
+			priv->max_gap = ustrtoull(gap, NULL, 10);
+	}
 
 	char *srcsize;
 	srcsize = dict_get_value(&img->properties, "source-size");
@@ -332,6 +676,22 @@ static int delta_retrieve_attributes(struct img_type *img, struct hnd_priv *priv
 			priv->srcsize = ustrtoull(srcsize, NULL, 10);
 	}
 
+	errno = 0;
+	if (dict_get_value(&img->properties, "decode-threads"))
+		priv->decode_threads = strtoul(dict_get_value(&img->properties, "decode-threads"), NULL, 10);
+	if (errno)
+		priv->decode_threads = 0;
+
+	errno = 0;
+	if (dict_get_value(&img->properties, "shared-buffers"))
+		priv->ringslots = strtoul(dict_get_value(&img->properties, "shared-buffers"), NULL, 10);
+	if (errno)
+		priv->ringslots = 0;
+
+	priv->indexcache = dict_get_value(&img->properties, "index-cache");
+	priv->indexdst = strtobool(dict_get_value(&img->properties, "index-destination"));
+	priv->journal = dict_get_value(&img->properties, "resume-journal");
+
 	char *zckloglevel = dict_get_value(&img->properties, "zckloglevel");
 	if (!zckloglevel)
 		return 0;
@@ -468,209 +828,957 @@ static void zck_log_toswupdate(const char *function, zck_log_type lt,
 }
 
 /*
- * Create a zck Index from a file
+ * The source is read by a separate thread with large
+ * sequential reads, so that I/O runs while ZCK computes
+ * chunk boundaries and hashes on the previous buffer.
  */
-static bool create_zckindex(zckCtx *zck, int fd, size_t maxbytes)
+#define INDEX_READ_SIZE		(1024 * 1024)
+#define INDEX_READ_BUFFERS	4
+
+struct index_reader {
+	int fd;
+	size_t maxbytes;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[INDEX_READ_BUFFERS];
+	ssize_t len[INDEX_READ_BUFFERS];
+	unsigned long rd, wr;		/* buffers consumed / filled */
+	size_t total;			/* bytes read */
+	bool eof;
+	int error;			/* errno if read fails */
+	bool abort;
+};
+
+static ssize_t read_source(int fd, char *buf, size_t len)
 {
-	const size_t bufsize = 16384;
-	char *buf = malloc(bufsize);
-	ssize_t n;
-	int ret;
+	ssize_t n = 0, ret;
 
-	if (!buf) {
-		ERROR("OOM creating temporary buffer");
-		return false;
+	while (len) {
+		ret = read(fd, buf + n, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		n += ret;
+		len -= ret;
 	}
-	while ((n = read(fd, buf, bufsize)) > 0) {
-		ret = zck_write(zck, buf, n);
-		if (ret < 0) {
-			ERROR("ZCK returns %s", zck_get_error(zck));
-			free(buf);
-			return false;
+
+	return n;
+}
+
+static void *index_reader_thread(void *data)
+{
+	struct index_reader *rd = (struct index_reader *)data;
+
+	for (;;) {
+		size_t len = INDEX_READ_SIZE;
+		ssize_t n;
+		unsigned int slot;
+
+		pthread_mutex_lock(&rd->lock);
+		while (rd->wr - rd->rd == INDEX_READ_BUFFERS && !rd->abort)
+			pthread_cond_wait(&rd->cond, &rd->lock);
+		if (rd->abort) {
+			pthread_mutex_unlock(&rd->lock);
+			break;
+		}
+		slot = rd->wr % INDEX_READ_BUFFERS;
+		pthread_mutex_unlock(&rd->lock);
+
+		if (rd->maxbytes)
+			len = min(len, rd->maxbytes - rd->total);
+		n = len ? read_source(rd->fd, rd->buf[slot], len) : 0;
+
+		pthread_mutex_lock(&rd->lock);
+		if (n <= 0) {
+			rd->error = n < 0 ? errno : 0;
+			rd->eof = true;
+		} else {
+			rd->len[slot] = n;
+			rd->wr++;
+			rd->total += n;
 		}
-		if (maxbytes && n > maxbytes)
+		pthread_cond_broadcast(&rd->cond);
+		pthread_mutex_unlock(&rd->lock);
+		if (n <= 0)
 			break;
 	}
 
-	free(buf);
-
-	return true;
+	return NULL;
 }
 
 /*
- * Chunks must be retrieved from network, prepare an send
- * a request for the downloader
+ * Create a zck Index from a file, indexed is set to the
+ * number of bytes added to the index
  */
-static bool trigger_download(struct hnd_priv *priv)
+static bool create_zckindex(zckCtx *zck, int fd, size_t maxbytes, size_t *indexed)
 {
-	range_request_t *req = NULL;
-	zckCtx *tgt = priv->tgt;
-	size_t reqlen;
-	zck_range *range;
-	char *http_range;
+	struct index_reader rd;
+	pthread_t reader;
 	bool status = true;
+	unsigned int i;
+
+	memset(&rd, 0, sizeof(rd));
+	rd.fd = fd;
+	rd.maxbytes = maxbytes;
+	for (i = 0; i < INDEX_READ_BUFFERS; i++) {
+		rd.buf[i] = malloc(INDEX_READ_SIZE);
+		if (!rd.buf[i]) {
+			ERROR("OOM creating temporary buffer");
+			status = false;
+			goto out;
+		}
+	}
+	pthread_mutex_init(&rd.lock, NULL);
+	pthread_cond_init(&rd.cond, NULL);
 
+	/* Source is read once from start to end */
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	priv->boundary[0] = '\0';
+	if (pthread_create(&reader, NULL, index_reader_thread, &rd)) {
+		ERROR("Cannot start thread to read source");
+		status = false;
+		goto destroy;
+	}
 
-	range = zchunk_get_missing_range(tgt, priv->chunk, priv->max_ranges);
-	if (!range)
-		return false;
-	http_range = zchunk_get_range_char(range);
-	TRACE("Range request : %s", http_range);
+	for (;;) {
+		unsigned int slot;
 
-	req = prepare_range_request(priv->url, http_range, &reqlen);
-	if (!req) {
-		ERROR(" Internal chunk request cannot be prepared");
-		free(range);
-		free(http_range);
-		return false;
-	}
+		pthread_mutex_lock(&rd.lock);
+		while (rd.rd == rd.wr && !rd.eof)
+			pthread_cond_wait(&rd.cond, &rd.lock);
+		if (rd.rd == rd.wr) {
+			pthread_mutex_unlock(&rd.lock);
+			break;
+		}
+		slot = rd.rd % INDEX_READ_BUFFERS;
+		pthread_mutex_unlock(&rd.lock);
 
-	/* Store request id to compare later */
-	priv->reqid = req->id;
-	priv->range_type = NONE_RANGE;
+		if (zck_write(zck, rd.buf[slot], rd.len[slot]) < 0) {
+			ERROR("ZCK returns %s", zck_get_error(zck));
+			status = false;
+		}
 
-	if (write(priv->pipetodwl, req, sizeof(*req)) != sizeof(*req)) {
-		ERROR("Cannot write all bytes to pipe");
+		pthread_mutex_lock(&rd.lock);
+		rd.rd++;
+		if (!status)
+			rd.abort = true;
+		pthread_cond_broadcast(&rd.cond);
+		pthread_mutex_unlock(&rd.lock);
+		if (!status)
+			break;
+	}
+
+	pthread_join(reader, NULL);
+	*indexed = rd.total;
+	if (rd.error) {
+		ERROR("Error reading source : %s", strerror(rd.error));
 		status = false;
 	}
 
-	free(req);
-	free(range);
-	free(http_range);
-	priv->dwlrunning = true;
+destroy:
+	pthread_cond_destroy(&rd.cond);
+	pthread_mutex_destroy(&rd.lock);
+out:
+	for (i = 0; i < INDEX_READ_BUFFERS; i++)
+		free(rd.buf[i]);
+
 	return status;
 }
 
 /*
- * drop all temporary data collected during download
+ * "source" names a device or a list of them: the first one is
+ * the source of the comparison, chunks found in the others are
+ * reused too. Sources other than the first one are optional.
  */
-static void dwl_cleanup(struct hnd_priv *priv)
+static int open_sources(struct img_type *img, struct hnd_priv *priv)
 {
-	multipart_parser_free(priv->parser);
-	priv->parser = NULL;
-}
-
-static bool read_and_validate_package(struct hnd_priv *priv)
-{
-	ssize_t nbytes = sizeof(range_answer_t);
-	range_answer_t *answer;
-	int count = -1;
-	uint32_t crc;
+	struct dict_list *srclist = dict_get_list(&img->properties, "source");
+	struct dict_list_elem *elem;
+	unsigned int count = 0;
 
-	do {
+	LIST_FOREACH(elem, srclist, next)
 		count++;
-		if (count == 1)
-			DEBUG("id does not match in IPC, skipping..");
-
-		char *buf = (char *)priv->answer;
-		do {
-			ssize_t ret;
-			ret = read(priv->pipetodwl, buf, sizeof(range_answer_t));
-			if (ret < 0)
-				return false;
-			buf += ret;
-			nbytes -= ret;
-		} while (nbytes > 0);
-		answer = priv->answer;
-
-		if (nbytes < 0)
-			return false;
-	} while (answer->id != priv->reqid);
-
-
-	if (answer->type == RANGE_ERROR) {
-	    ERROR("Transfer was unsuccessful, aborting...");
-	    priv->dwlrunning = false;
-	    dwl_cleanup(priv);
-	    return false;
+	priv->sources = calloc(count, sizeof(*priv->sources));
+	if (!priv->sources) {
+		ERROR("OOM when allocating sources !");
+		return -ENOMEM;
 	}
 
-	if (answer->type == RANGE_DATA) {
-		crc = crc32(0, (unsigned char *)answer->data, answer->len);
-		if (crc != answer->crc) {
-			ERROR("Corrupted package received !");
-			exit(1);
-			return false;
+	LIST_FOREACH(elem, srclist, next) {
+		struct delta_source *src = &priv->sources[priv->nsources];
+
+		src->dev = elem->value;
+		src->fd = open(src->dev, O_RDONLY);
+		if (src->fd < 0) {
+			if (!priv->nsources) {
+				ERROR("Unable to open Source : %s for reading", src->dev);
+				return -ENOENT;
+			}
+			WARN("Source %s cannot be opened, its chunks are not reused", src->dev);
+			continue;
 		}
+		src->size = SIZE_MAX;
+		priv->nsources++;
 	}
 
-	priv->totaldwlbytes += answer->len;
+	return 0;
+}
 
-	return true;
+static void close_sources(struct hnd_priv *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->nsources; i++)
+		close(priv->sources[i].fd);
+	free(priv->sources);
 }
 
 /*
- * This is called to parse the HTTP headers
- * It searches for content-ranges and select a SINGLE or
- * MULTIPARTS answer.
+ * Index all sources, one after the other. A chunk never
+ * spans two of them.
  */
-static bool parse_headers(struct hnd_priv *priv)
+static bool index_sources(zckCtx *zck, struct hnd_priv *priv)
 {
-	int nconv;
-	char *header = NULL, *value = NULL, *boundary_string = NULL;
-	char **pair;
-	int cnt;
-
-	range_answer_t *answer = priv->answer;
-	answer->data[answer->len] = '\0';
-	/* Converto to lower case to make comparison easier */
-	string_tolower(answer->data);
+	size_t base = 0;
+	unsigned int i;
 
-	/* Check for multipart */
-	nconv = sscanf(answer->data, "%ms %ms %ms", &header, &value, &boundary_string);
+	for (i = 0; i < priv->nsources; i++) {
+		struct delta_source *src = &priv->sources[i];
 
-	if (nconv == 3) {
-		if (!strncmp(header, "content-type", strlen("content-type")) &&
-			!strncmp(boundary_string, "boundary", strlen("boundary"))) {
-			pair = string_split(boundary_string, '=');
-			cnt = count_string_array((const char **)pair);
-			if (cnt == 2) {
-				memset(priv->boundary, '-', 2);
-				strlcpy(&priv->boundary[2], pair[1], sizeof(priv->boundary) - 2);
-				priv->range_type = MULTIPART_RANGE;
-			}
-			free_string_array(pair);
+		if (i)
+			TRACE("Adding %s to the index of the source", src->dev);
+		src->base = base;
+		if (!create_zckindex(zck, src->fd, i ? 0 : priv->srcsize, &src->size))
+			return false;
+		if (i + 1 < priv->nsources && zck_end_chunk(zck) < 0) {
+			ERROR("ZCK returns %s", zck_get_error(zck));
+			return false;
 		}
+		base += src->size;
+	}
 
-		if (!strncmp(header, "content-range", strlen("content-range")) &&
-		    !strncmp(value, "bytes", strlen("bytes"))) {
-			pair = string_split(boundary_string, '-');
-			priv->range_type = SINGLE_RANGE;
-			size_t start = strtoul(pair[0], NULL, 10);
-			size_t end = strtoul(pair[1], NULL, 10);
-			free_string_array(pair);
-			priv->rangestart = start;
-			priv->rangelen = end - start;
+	return true;
+}
+
+static const char *index_source_version(struct img_type *img)
+{
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+	const char *version = dict_get_value(&img->properties, "source-version");
+	struct sw_version *swver;
+
+	/* Use the version of the running software if not set */
+	if (!version) {
+		version = "";
+		LIST_FOREACH(swver, &cfg->installed_sw_list, next) {
+			if (!strcmp(swver->name, img->id.name)) {
+				version = swver->version;
+				break;
+			}
 		}
-		free(header);
-		free(value);
-		free(boundary_string);
-	} else if (nconv == 1) {
-		free(header);
-	} else if (nconv == 2) {
-		free(header);
-		free(value);
 	}
 
-	return true;
+	return version;
 }
 
-static bool search_boundary_in_body(struct hnd_priv *priv)
+static char *index_cache_key(const char *dev, size_t size, const char *version)
 {
-	char *s;
-	range_answer_t *answer = priv->answer;
-	size_t i;
+	char *key;
 
-	if (priv->range_type == NONE_RANGE) {
-		ERROR("Malformed body, no boundary found");
-		return false;
-	}
+	if (asprintf(&key, "%s %zu %s\n", dev, size, version) == -1)
+		return NULL;
 
-	if (priv->range_type == SINGLE_RANGE) {
-		/* Body contains just one range, it is data, do nothing */
-		return true;
+	return key;
+}
+
+/*
+ * The index saved while the previous update wrote the source
+ * covers only the image, that can be shorter than the source
+ */
+static bool index_cache_key_prefix(struct hnd_priv *priv, const char *key)
+{
+	size_t len = strlen(priv->srcdev), size;
+	char *expected;
+	bool ret;
+
+	if (strncmp(key, priv->srcdev, len) || key[len] != ' ' ||
+	    sscanf(key + len + 1, "%zu", &size) != 1 ||
+	    (priv->srcsize && size > priv->srcsize))
+		return false;
+	expected = index_cache_key(priv->srcdev, size, priv->srcversion);
+	ret = expected && !strcmp(expected, key);
+	free(expected);
+
+	return ret;
+}
+
+/*
+ * Drop the cached index for a device, it is called
+ * for the device that is going to be written
+ */
+static void invalidate_zckindex(struct hnd_priv *priv, const char *dev)
+{
+	delta_index_invalidate(priv->indexcache, dev);
+}
+
+/*
+ * Load the index of the source saved by a previous update.
+ * It is used only if the key matches and samples of the
+ * source are unchanged.
+ */
+static zckCtx *load_zckindex(struct hnd_priv *priv, int srcfd)
+{
+	char *key = delta_index_key(priv->indexcache, priv->srcdev);
+	zckCtx *zck;
+
+	if (!key)
+		return NULL;
+	if (strcmp(key, priv->cachekey) && !index_cache_key_prefix(priv, key)) {
+		TRACE("Cached index for %s is outdated", priv->srcdev);
+		free(key);
+		return NULL;
+	}
+	free(key);
+
+	zck = delta_index_load(priv->indexcache, priv->srcdev, srcfd);
+	if (zck)
+		priv->srcbase = zck_get_chunk_start(zck_get_first_chunk(zck));
+
+	return zck;
+}
+
+/*
+ * The index is computed from the data written to the destination,
+ * the same way as it is computed when the source is read, so that
+ * the next update, whose source is this destination, can use it
+ * without reading the device again.
+ */
+static void drop_dest_index(struct hnd_priv *priv)
+{
+	if (priv->dstindex)
+		zck_free(&priv->dstindex);
+	priv->dstindex = NULL;
+	if (priv->dstindexfd >= 0)
+		close(priv->dstindexfd);
+	priv->dstindexfd = -1;
+	if (priv->dstindextmp) {
+		unlink(priv->dstindextmp);
+		free(priv->dstindextmp);
+		priv->dstindextmp = NULL;
+	}
+}
+
+static void start_dest_index(struct img_type *img, struct hnd_priv *priv)
+{
+	if (!priv->indexcache) {
+		WARN("index-destination requires index-cache, not set");
+		return;
+	}
+	/* the next update reads the source from its start */
+	if (strcmp(priv->chainhandler, "raw") || img->seek) {
+		WARN("Index of %s is kept only for a raw image at the start of the device",
+		     img->device);
+		return;
+	}
+
+	priv->dstindexfd = delta_index_create(priv->indexcache, img->device,
+					      &priv->dstindextmp);
+	if (priv->dstindexfd < 0)
+		return;
+	priv->dstindex = zck_create();
+	if (!priv->dstindex) {
+		zck_clear_error(NULL);
+		drop_dest_index(priv);
+		return;
+	}
+	if (!zck_init_write(priv->dstindex, priv->dstindexfd) ||
+	    !zck_set_ioption(priv->dstindex, ZCK_UNCOMP_HEADER, 1) ||
+	    !zck_set_ioption(priv->dstindex, ZCK_COMP_TYPE, ZCK_COMP_NONE) ||
+	    !zck_set_ioption(priv->dstindex, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256) ||
+	    /* else the chunks are written into the cache, too */
+	    !zck_set_ioption(priv->dstindex, ZCK_NO_WRITE, 1)) {
+		WARN("Index of %s cannot be computed : %s", img->device,
+		     zck_get_error(priv->dstindex));
+		drop_dest_index(priv);
+		return;
+	}
+	priv->dstindexsize = 0;
+}
+
+static void save_dest_index(struct img_type *img, struct hnd_priv *priv)
+{
+	char *key;
+
+	if (!priv->dstindex)
+		return;
+	/* the version becomes the one of the source for the next update */
+	key = index_cache_key(img->device, priv->dstindexsize, img->id.version);
+	delta_index_save(priv->indexcache, img->device, key, priv->dstindextmp,
+			 priv->dstindex, priv->dstindexfd);
+	free(key);
+}
+
+/*
+ * Output of the handler: data is passed to the chained
+ * handler and added to the index of the destination
+ */
+static int delta_output(void *out, const void *buf, size_t len)
+{
+	struct hnd_priv *priv = (struct hnd_priv *)out;
+	int ret;
+
+	ret = chain_handler_write(&priv->chain, buf, len);
+	if (ret < 0 || !priv->dstindex)
+		return ret;
+
+	if (zck_write(priv->dstindex, (const char *)buf, len) < 0) {
+		WARN("Index of the destination cannot be computed : %s",
+		     zck_get_error(priv->dstindex));
+		drop_dest_index(priv);
+	} else {
+		priv->dstindexsize += len;
+	}
+
+	return ret;
+}
+
+/*
+ * Chunks must be retrieved from network, prepare an send
+ * a request for the downloader. The request starts from
+ * the first missing chunk after priv->nextreq and it is
+ * queued until the handler processes it.
+ */
+static bool trigger_download(struct hnd_priv *priv)
+{
+	range_request_t *req = NULL;
+	struct dwlrequest *dwlreq;
+	zckCtx *tgt = priv->tgt;
+	zckChunk *first = priv->nextreq;
+	size_t reqlen;
+	zck_range *range;
+	char *http_range;
+	bool status = true;
+
+	while (first && zck_get_chunk_valid(first))
+		first = zck_get_next_chunk(first);
+	if (!first) {
+		/* Nothing left to be downloaded */
+		priv->nextreq = NULL;
+		return true;
+	}
+
+	if (priv->adaptive_gap) {
+		priv->max_gap = zchunk_range_gap_threshold(&priv->cost, priv->max_ranges);
+		if (priv->debugchunks)
+			TRACE("RTT %.3f s, bandwidth %.0f B/s : merging gaps up to %zu bytes",
+				priv->cost.rtt, priv->cost.bandwidth, priv->max_gap);
+	}
+	range = zchunk_get_missing_range(tgt, first, priv->max_ranges, priv->max_gap,
+					 &priv->nextreq);
+	if (!range)
+		return false;
+	http_range = zchunk_get_range_char(range);
+	zchunk_range_free(&range);
+	if (!http_range)
+		return false;
+	TRACE("Range request : %s", http_range);
+
+	req = prepare_range_request(priv->url, http_range, &reqlen);
+	free(http_range);
+	if (!req) {
+		ERROR(" Internal chunk request cannot be prepared");
+		return false;
+	}
+
+	dwlreq = (struct dwlrequest *)calloc(1, sizeof(*dwlreq));
+	if (!dwlreq) {
+		ERROR("OOM queuing range request !");
+		free(req);
+		return false;
+	}
+	/* Store request id to compare later */
+	dwlreq->id = req->id;
+	dwlreq->first = first;
+	SIMPLEQ_INIT(&dwlreq->answers);
+	clock_gettime(CLOCK_MONOTONIC, &dwlreq->sent);
+
+	if (write(priv->pipetodwl, req, sizeof(*req)) != sizeof(*req)) {
+		ERROR("Cannot write all bytes to pipe");
+		status = false;
+	}
+
+	free(req);
+	if (!status) {
+		free(dwlreq);
+		return false;
+	}
+	SIMPLEQ_INSERT_TAIL(&priv->requests, dwlreq, next);
+	priv->inflight++;
+	priv->dwlrunning = true;
+	return status;
+}
+
+/*
+ * Keep up to max_parallel requests in flight, so that the
+ * downloader can already retrieve next ranges while chunks
+ * of the current one are processed or copied from source.
+ * No request is added while too many answers are kept for
+ * later requests, they are consumed first.
+ */
+static bool fill_request_queue(struct hnd_priv *priv)
+{
+	while (priv->nextreq && priv->inflight < priv->max_parallel &&
+	       (!priv->inflight || priv->queued < QUEUED_ANSWERS_MAX)) {
+		if (!trigger_download(priv))
+			return false;
+	}
+
+	return true;
+}
+
+static void free_request(struct hnd_priv *priv, struct dwlrequest *dwlreq)
+{
+	struct dwlanswer *dwlans;
+
+	while (!SIMPLEQ_EMPTY(&dwlreq->answers)) {
+		dwlans = SIMPLEQ_FIRST(&dwlreq->answers);
+		SIMPLEQ_REMOVE_HEAD(&dwlreq->answers, next);
+		priv->queued -= dwlans->answer.len;
+		free(dwlans);
+	}
+	free(dwlreq);
+}
+
+/*
+ * Drop the request at the head of the queue, it was
+ * completely processed
+ */
+static void complete_request(struct hnd_priv *priv)
+{
+	struct dwlrequest *dwlreq = SIMPLEQ_FIRST(&priv->requests);
+
+	if (!dwlreq)
+		return;
+	SIMPLEQ_REMOVE_HEAD(&priv->requests, next);
+	free_request(priv, dwlreq);
+	priv->inflight--;
+	priv->dwlrunning = !SIMPLEQ_EMPTY(&priv->requests);
+}
+
+static void drop_requests(struct hnd_priv *priv)
+{
+	while (!SIMPLEQ_EMPTY(&priv->requests))
+		complete_request(priv);
+}
+
+static double elapsed_s(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+static void update_estimation(double *value, double sample)
+{
+	if (*value <= 0)
+		*value = sample;
+	else
+		*value += COST_WEIGHT * (sample - *value);
+}
+
+/*
+ * Measure round trip and bandwidth for the cost model
+ * used to merge ranges. It is called when an answer is
+ * read from the downloader, even if it is processed later.
+ */
+static void account_answer(struct hnd_priv *priv, range_answer_t *answer)
+{
+	struct dwlrequest *dwlreq;
+	struct timespec now;
+	double duration;
+
+	SIMPLEQ_FOREACH(dwlreq, &priv->requests, next) {
+		if (dwlreq->id == answer->id)
+			break;
+	}
+	if (!dwlreq)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!dwlreq->answered) {
+		dwlreq->answered = true;
+		dwlreq->started = now;
+		update_estimation(&priv->cost.rtt, elapsed_s(&dwlreq->sent, &now));
+	}
+	if (answer->type == RANGE_DATA)
+		dwlreq->bytes += answer->len;
+	if (answer->type == RANGE_COMPLETED) {
+		duration = elapsed_s(&dwlreq->started, &now);
+		if (duration > 0 && dwlreq->bytes)
+			update_estimation(&priv->cost.bandwidth, dwlreq->bytes / duration);
+	}
+}
+
+/*
+ * An answer for a request that is not the current one
+ * was received: store it until the request is processed
+ */
+static bool queue_answer(struct hnd_priv *priv, range_answer_t *answer)
+{
+	struct dwlrequest *dwlreq;
+	struct dwlanswer *dwlans;
+
+	SIMPLEQ_FOREACH(dwlreq, &priv->requests, next) {
+		if (dwlreq->id == answer->id)
+			break;
+	}
+	if (!dwlreq) {
+		DEBUG("id does not match in IPC, skipping..");
+		return true;
+	}
+
+	dwlans = (struct dwlanswer *)malloc(offsetof(struct dwlanswer, answer.data) +
+					    answer->len);
+	if (!dwlans) {
+		ERROR("OOM storing answer from downloader !");
+		return false;
+	}
+	memcpy(&dwlans->answer, answer, offsetof(range_answer_t, data) + answer->len);
+	SIMPLEQ_INSERT_TAIL(&dwlreq->answers, dwlans, next);
+	priv->queued += answer->len;
+
+	return true;
+}
+
+/*
+ * drop all temporary data collected during download
+ */
+static void dwl_cleanup(struct hnd_priv *priv)
+{
+	multipart_parser_free(priv->parser);
+	priv->parser = NULL;
+}
+
+static bool read_answer(struct hnd_priv *priv, range_answer_t *answer)
+{
+	ssize_t nbytes = sizeof(range_answer_t);
+	char *buf = (char *)answer;
+
+	do {
+		ssize_t ret;
+		ret = read(priv->pipetodwl, buf, nbytes);
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		nbytes -= ret;
+	} while (nbytes > 0);
+
+	return true;
+}
+
+/*
+ * The downloader holding the lock of the ring died
+ */
+static bool ring_lock(range_ring_t *ring)
+{
+	int ret = pthread_mutex_lock(&ring->lock);
+
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&ring->lock);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	return ret == 0;
+}
+
+static bool downloader_alive(struct hnd_priv *priv)
+{
+	struct pollfd pfd = { .fd = priv->pipetodwl, .events = 0 };
+
+	return poll(&pfd, 1, 0) >= 0 && !(pfd.revents & (POLLHUP | POLLERR));
+}
+
+/*
+ * Copy the next answer out of the ring: the downloader cannot
+ * change it anymore while it is validated and processed
+ */
+static bool ring_read(struct hnd_priv *priv, range_answer_t *answer)
+{
+	range_ring_t *ring = priv->ring;
+	range_answer_t *slot;
+	struct timespec ts;
+	size_t len;
+	int ret;
+
+	if (!ring_lock(ring))
+		return false;
+	while (ring->head == ring->tail) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec++;
+		ret = pthread_cond_timedwait(&ring->filled, &ring->lock, &ts);
+		if (ret == EOWNERDEAD) {
+			pthread_mutex_consistent(&ring->lock);
+			break;
+		}
+		if (ret == ETIMEDOUT && !downloader_alive(priv))
+			break;
+	}
+	if (ring->head == ring->tail) {
+		pthread_mutex_unlock(&ring->lock);
+		ERROR("Chunks downloader is not running anymore");
+		return false;
+	}
+	slot = &ring->slots[ring->tail % ring->nslots];
+	len = slot->len;
+	if (len > RANGE_PAYLOAD_SIZE)
+		len = RANGE_PAYLOAD_SIZE + 1;	/* rejected by the caller */
+	else
+		memcpy(answer->data, slot->data, len);
+	answer->id = slot->id;
+	answer->type = slot->type;
+	answer->crc = slot->crc;
+	answer->len = len;
+	ring->tail++;
+	pthread_cond_signal(&ring->freed);
+	pthread_mutex_unlock(&ring->lock);
+
+	return true;
+}
+
+static void ring_close(struct hnd_priv *priv)
+{
+	range_ring_t *ring = priv->ring;
+
+	if (!ring)
+		return;
+	if (ring_lock(ring)) {
+		ring->closed = true;
+		pthread_cond_broadcast(&ring->freed);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	munmap(ring, priv->ringlen);
+	priv->ring = NULL;
+}
+
+/*
+ * Pass a ring to the downloader, so that next answers are exchanged
+ * without the IPC. The IPC is used if the downloader cannot map it.
+ */
+static void ring_setup(struct hnd_priv *priv)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	range_request_t *req;
+	range_ring_t *ring;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	bool acked = false;
+	int fd;
+
+	priv->ringlen = offsetof(range_ring_t, slots) + priv->ringslots * sizeof(range_answer_t);
+	fd = memfd_create("delta-ring", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, priv->ringlen) < 0) {
+		WARN("Memory cannot be shared with the downloader, using IPC");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	ring = mmap(NULL, priv->ringlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	req = (range_request_t *)calloc(1, sizeof(*req));
+	if (ring == MAP_FAILED || !req) {
+		WARN("Memory cannot be shared with the downloader, using IPC");
+		if (ring != MAP_FAILED)
+			munmap(ring, priv->ringlen);
+		free(req);
+		close(fd);
+		return;
+	}
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&ring->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ring->filled, &cattr);
+	pthread_cond_init(&ring->freed, &cattr);
+	pthread_condattr_destroy(&cattr);
+	ring->nslots = priv->ringslots;
+	priv->ring = ring;
+
+	req->id = rand();
+	req->type = RANGE_RING;
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	memset(&mh, 0, sizeof(mh));
+	memset(&control, 0, sizeof(control));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(priv->pipetodwl, &mh, MSG_NOSIGNAL) == (ssize_t)sizeof(*req)) {
+		/* no request is in flight yet, other answers are stale */
+		while (read_answer(priv, priv->answer)) {
+			if (priv->answer->id == req->id) {
+				acked = priv->answer->type == RANGE_COMPLETED;
+				break;
+			}
+		}
+	}
+	close(fd);
+	free(req);
+
+	if (acked) {
+		TRACE("Answers of the downloader in a ring of %lu buffers", priv->ringslots);
+	} else {
+		WARN("Downloader does not share the ring, using IPC");
+		ring_close(priv);
+	}
+}
+
+static bool read_and_validate_package(struct hnd_priv *priv)
+{
+	struct dwlrequest *dwlreq = SIMPLEQ_FIRST(&priv->requests);
+	range_answer_t *answer = priv->answer;
+	uint32_t crc;
+
+	if (!dwlreq)
+		return false;
+
+	/*
+	 * Answers can be already received while
+	 * a previous request was processed
+	 */
+	if (!SIMPLEQ_EMPTY(&dwlreq->answers)) {
+		struct dwlanswer *dwlans = SIMPLEQ_FIRST(&dwlreq->answers);
+		SIMPLEQ_REMOVE_HEAD(&dwlreq->answers, next);
+		priv->queued -= dwlans->answer.len;
+		memcpy(answer, &dwlans->answer,
+		       offsetof(range_answer_t, data) + dwlans->answer.len);
+		free(dwlans);
+	} else {
+		for (;;) {
+			if (priv->ring) {
+				if (!ring_read(priv, answer))
+					return false;
+			} else if (!read_answer(priv, answer))
+				return false;
+
+			if (answer->len > RANGE_PAYLOAD_SIZE)
+				return false;
+			account_answer(priv, answer);
+			if (answer->id == priv->reqid)
+				break;
+			if (!queue_answer(priv, answer))
+				return false;
+		}
+	}
+
+	if (answer->type == RANGE_ERROR) {
+	    ERROR("Transfer was unsuccessful, aborting...");
+	    priv->dwlrunning = false;
+	    dwl_cleanup(priv);
+	    return false;
+	}
+
+	if (answer->type == RANGE_DATA) {
+		crc = crc32(0, (unsigned char *)answer->data, answer->len);
+		if (crc != answer->crc) {
+			ERROR("Corrupted package received !");
+			exit(1);
+			return false;
+		}
+	}
+
+	priv->totaldwlbytes += answer->len;
+
+	return true;
+}
+
+/*
+ * This is called to parse the HTTP headers
+ * It searches for content-ranges and select a SINGLE or
+ * MULTIPARTS answer.
+ */
+static bool parse_headers(struct hnd_priv *priv)
+{
+	int nconv;
+	char *header = NULL, *value = NULL, *boundary_string = NULL;
+	char **pair;
+	int cnt;
+
+	range_answer_t *answer = priv->answer;
+	answer->data[answer->len] = '\0';
+	/* Converto to lower case to make comparison easier */
+	string_tolower(answer->data);
+
+	/* Check for multipart */
+	nconv = sscanf(answer->data, "%ms %ms %ms", &header, &value, &boundary_string);
+
+	if (nconv == 3) {
+		if (!strncmp(header, "content-type", strlen("content-type")) &&
+			!strncmp(boundary_string, "boundary", strlen("boundary"))) {
+			pair = string_split(boundary_string, '=');
+			cnt = count_string_array((const char **)pair);
+			if (cnt == 2) {
+				memset(priv->boundary, '-', 2);
+				strlcpy(&priv->boundary[2], pair[1], sizeof(priv->boundary) - 2);
+				priv->range_type = MULTIPART_RANGE;
+			}
+			free_string_array(pair);
+		}
+
+		if (!strncmp(header, "content-range", strlen("content-range")) &&
+		    !strncmp(value, "bytes", strlen("bytes"))) {
+			pair = string_split(boundary_string, '-');
+			priv->range_type = SINGLE_RANGE;
+			size_t start = strtoul(pair[0], NULL, 10);
+			size_t end = strtoul(pair[1], NULL, 10);
+			free_string_array(pair);
+			priv->rangestart = start;
+			priv->rangelen = end - start;
+		}
+		free(header);
+		free(value);
+		free(boundary_string);
+	} else if (nconv == 1) {
+		free(header);
+	} else if (nconv == 2) {
+		free(header);
+		free(value);
+	}
+
+	return true;
+}
+
+static bool search_boundary_in_body(struct hnd_priv *priv)
+{
+	char *s;
+	range_answer_t *answer = priv->answer;
+	size_t i;
+
+	if (priv->range_type == NONE_RANGE) {
+		ERROR("Malformed body, no boundary found");
+		return false;
+	}
+
+	if (priv->range_type == SINGLE_RANGE) {
+		/* Body contains just one range, it is data, do nothing */
+		return true;
 	}
 	s = answer->data;
 	for (i = 0; i < answer->len; i++, s++) {
@@ -714,14 +1822,23 @@ static bool fill_buffers_list(struct hnd_priv *priv)
 static bool copy_network_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 {
 	range_answer_t *answer;
+	struct dwlrequest *dwlreq;
 
 	priv->chunk = *dstChunk;
 	priv->error_in_parser = false;
 	while (1) {
 		switch (priv->dwlstate) {
 		case NOTRUNNING:
-			if (!trigger_download(priv))
+			if (!fill_request_queue(priv))
+				return false;
+			dwlreq = SIMPLEQ_FIRST(&priv->requests);
+			if (!dwlreq || dwlreq->first != priv->chunk) {
+				ERROR("Range requests out of sync with chunks, aborting...");
 				return false;
+			}
+			priv->reqid = dwlreq->id;
+			priv->range_type = NONE_RANGE;
+			priv->boundary[0] = '\0';
 			priv->dwlstate = WAITING_FOR_HEADERS;
 			break;
 		case WAITING_FOR_HEADERS:
@@ -771,67 +1888,306 @@ static bool copy_network_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 			if (priv->range_type == SINGLE_RANGE)
 				multipart_data_end(priv->parser);
 			dwl_cleanup(priv);
+			complete_request(priv);
 			priv->dwlstate = NOTRUNNING;
 			*dstChunk = priv->chunk;
-			return !priv->error_in_parser;
+			if (!decode_write(priv, true) || priv->error_in_parser)
+				return false;
+			/* Next ranges are downloaded while source chunks are copied */
+			return fill_request_queue(priv);
 		}
 	}
 
 	return !priv->error_in_parser;
 }
 
+static bool ensure_extbuf(struct hnd_priv *priv, size_t len)
+{
+	if (len <= priv->extbufsize)
+		return true;
+
+	free(priv->extbuf);
+	priv->extbufsize = max(len, (size_t)EXTENT_MAX_SIZE);
+	priv->extbuf = (unsigned char *)malloc(priv->extbufsize);
+	if (!priv->extbuf) {
+		ERROR("OOM allocating buffer for chunks");
+		priv->extbufsize = 0;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Read from the merged index of the sources, offset is relative
+ * to the first chunk. A read can span two sources.
+ */
+static bool read_sources(struct hnd_priv *priv, unsigned char *buf, size_t len, size_t offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->nsources && len; i++) {
+		struct delta_source *src = &priv->sources[i];
+		size_t n;
+
+		if (offset >= src->base + src->size)
+			continue;
+		if (offset < src->base)
+			return false;
+		n = min(len, src->base + src->size - offset);
+		if (!delta_read_fully(src->fd, buf, n, offset - src->base))
+			return false;
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+
+	return !len;
+}
+
 /*
- * This writes a chunk from an existing copy on the source path
- * The chunk to be copied is retrieved via zck_get_src_chunk()
+ * This writes chunks from an existing copy on the source path
+ * The chunk to be copied is retrieved via zck_get_src_chunk().
+ * Consecutive chunks that are contiguous in the source are
+ * read with a single request, verified and written together.
  */
 static bool copy_existing_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 {
-	unsigned long offset = 0;
-	uint32_t checksum;
-	int ret;
-	unsigned char hash[SHA256_HASH_LENGTH];
+	/* chunks downloaded before are written first */
+	if (!decode_write(priv, true))
+		return false;
 
 	while (*dstChunk && zck_get_chunk_valid(*dstChunk)) {
-		zckChunk *chunk	= zck_get_src_chunk(*dstChunk);
-		size_t len = zck_get_chunk_size(chunk);
-		size_t start = zck_get_chunk_start(chunk);
-		char *sha = zck_get_chunk_digest_uncompressed(chunk);
-		if (!len) {
+		zckChunk *iter = *dstChunk;
+		zckChunk *chunk = zck_get_src_chunk(iter);
+		size_t start = zck_get_chunk_start(chunk) - priv->srcbase;
+		size_t extlen = 0, pos;
+		unsigned int nchunks = 0, i;
+
+		if (!zck_get_chunk_size(chunk)) {
 			*dstChunk = zck_get_next_chunk(*dstChunk);
 			continue;
 		}
-		if (!sha) {
-			ERROR("Cannot get hash for chunk %ld", zck_get_chunk_number(chunk));
-			return false;
+
+		/*
+		 * Collect the run of chunks that follow each other in source
+		 */
+		for (; iter && zck_get_chunk_valid(iter); iter = zck_get_next_chunk(iter)) {
+			size_t len;
+
+			chunk = zck_get_src_chunk(iter);
+			len = zck_get_chunk_size(chunk);
+			if (len && zck_get_chunk_start(chunk) - priv->srcbase != start + extlen)
+				break;
+			if (nchunks && extlen + len > EXTENT_MAX_SIZE)
+				break;
+			extlen += len;
+			nchunks++;
 		}
-		if (lseek(priv->fdsrc, start, SEEK_SET) < 0) {
-			ERROR("Seeking source file at %lu", start);
-			free(sha);
+
+		if (!ensure_extbuf(priv, extlen))
 			return false;
-		}
 
-		ascii_to_hash(hash, sha);
+		if (!read_sources(priv, priv->extbuf, extlen, start)) {
+			ERROR("Reading source file at %lu", start);
+			return false;
+		}
 
 		if (priv->debugchunks)
-			TRACE("Copying chunk %ld from SRC %ld, start %ld size %ld",
+			TRACE("Copying chunks %ld-%ld from SRC, start %ld size %ld",
 				zck_get_chunk_number(*dstChunk),
-				zck_get_chunk_number(chunk),
+				zck_get_chunk_number(*dstChunk) + nchunks - 1,
 				start,
-				len);
-		ret = copyfile(priv->fdsrc, &priv->fdout, len, &offset, 0, 0, COMPRESSED_FALSE,
-				&checksum, hash, false, NULL, NULL);
+				extlen);
 
-		free(sha);
-		if (ret)
+		/*
+		 * Verify all chunks before the extent is written
+		 */
+		for (i = 0, pos = 0; i < nchunks; i++) {
+			size_t len;
+
+			chunk = zck_get_src_chunk(*dstChunk);
+			len = zck_get_chunk_size(chunk);
+			if (len && !delta_verify_chunk(chunk, priv->extbuf + pos, len)) {
+				ERROR("HASH mismatch for chunk %ld in source",
+					zck_get_chunk_number(chunk));
+				return false;
+			}
+			pos += len;
+			*dstChunk = zck_get_next_chunk(*dstChunk);
+		}
+
+		if (delta_output(priv, priv->extbuf, extlen) < 0)
 			return false;
+	}
+	return true;
+}
+
+/*
+ * Offset of a chunk in the reassembled artifact. Chunks
+ * are processed in order, so the last result is kept to
+ * avoid walking the list from the beginning.
+ */
+static size_t chunk_output_offset(struct hnd_priv *priv, zckChunk *chunk)
+{
+	if (!priv->poschunk ||
+	    zck_get_chunk_number(chunk) < zck_get_chunk_number(priv->poschunk)) {
+		priv->poschunk = zck_get_first_chunk(priv->tgt);
+		priv->pos = 0;
+	}
+	while (priv->poschunk && priv->poschunk != chunk) {
+		priv->pos += zck_get_chunk_size(priv->poschunk);
+		priv->poschunk = zck_get_next_chunk(priv->poschunk);
+	}
+
+	return priv->pos;
+}
+
+/*
+ * Read back a chunk already written into the destination
+ * by an interrupted update and check it with the hash
+ * from the header
+ */
+static bool read_dest_chunk(struct hnd_priv *priv, zckChunk *chunk)
+{
+	size_t len = zck_get_chunk_size(chunk);
+
+	if (!ensure_extbuf(priv, len))
+		return false;
+
+	return delta_read_chunk(chunk, priv->fddst,
+				priv->dstseek + chunk_output_offset(priv, chunk),
+				priv->extbuf);
+}
+
+static void write_journal(struct hnd_priv *priv, zckChunk *next)
+{
+	long number = next ? zck_get_chunk_number(next) : LONG_MAX;
+
+	if (number <= priv->journaled)
+		return;
+	if (!delta_journal_write(priv->journal, priv->journalkey, number))
+		WARN("Journal %s cannot be updated", priv->journal);
+	priv->journaled = number;
+}
+
+static bool setup_resume(struct img_type *img, struct hnd_priv *priv)
+{
+	char *digest;
+	long limit;
+
+	if (strcmp(priv->chainhandler, "raw")) {
+		WARN("Resume is supported only with raw as chained handler");
+		return false;
+	}
+	digest = zck_get_header_digest(priv->tgt);
+	if (!digest)
+		return false;
+	if (asprintf(&priv->journalkey, "%s %s %s ", priv->url, img->device, digest) == -1) {
+		priv->journalkey = NULL;
+		free(digest);
+		return false;
+	}
+	free(digest);
+
+	limit = delta_journal_read(priv->journal, priv->journalkey);
+	if (limit <= 0)
+		return true;
+
+	priv->fddst = open(img->device, O_RDONLY);
+	if (priv->fddst < 0) {
+		WARN("%s cannot be read, resume not possible", img->device);
+		return true;
+	}
+	priv->dstseek = img->seek;
+	priv->resume_limit = delta_verify_prefix(priv->tgt, priv->fddst,
+						 priv->dstseek, limit);
+	priv->journaled = priv->resume_limit;
+	INFO("Resuming: chunks up to %ld are taken from %s",
+		priv->resume_limit, img->device);
 
+	return true;
+}
+
+/*
+ * Chunks already written by an interrupted update are
+ * sent again to the chained handler instead of downloading them
+ */
+static bool copy_resumed_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
+{
+	while (*dstChunk && !zck_get_chunk_valid(*dstChunk) &&
+	       zck_get_chunk_number(*dstChunk) < priv->resume_limit) {
+		size_t len = zck_get_chunk_size(*dstChunk);
+
+		if (len) {
+			if (!read_dest_chunk(priv, *dstChunk)) {
+				ERROR("Chunk %ld changed in destination, aborting...",
+					zck_get_chunk_number(*dstChunk));
+				return false;
+			}
+			if (priv->debugchunks)
+				TRACE("Copying chunk %ld from DESTINATION, size %ld",
+					zck_get_chunk_number(*dstChunk), len);
+			if (delta_output(priv, priv->extbuf, len) < 0)
+				return false;
+		}
 		*dstChunk = zck_get_next_chunk(*dstChunk);
 	}
+
 	return true;
 }
 
-#define PIPE_READ  0
-#define PIPE_WRITE 1
+/*
+ * In a dry run, report what would be downloaded, with the ranges
+ * as they would be requested. Progress clients get it as:
+ * {"DELTA" : {"file": ..., "download_bytes": ..., "ranges": ...,
+ *  "requests": ..., "reused_bytes": ..., "reused_percent": ...}}
+ */
+static int report_estimation(struct img_type *img, struct hnd_priv *priv, size_t total)
+{
+	zckChunk *chunk = zck_get_first_chunk(priv->tgt);
+	unsigned long requests = 0, ranges = 0;
+	zck_range_item *item;
+	zck_range *range;
+	size_t bytes = 0;
+	char *info;
+
+	if (priv->adaptive_gap)
+		priv->max_gap = zchunk_range_gap_threshold(&priv->cost, priv->max_ranges);
+
+	for (;;) {
+		while (chunk && zck_get_chunk_valid(chunk))
+			chunk = zck_get_next_chunk(chunk);
+		if (!chunk)
+			break;
+		range = zchunk_get_missing_range(priv->tgt, chunk, priv->max_ranges,
+						 priv->max_gap, &chunk);
+		if (!range)
+			return -ENOMEM;
+		requests++;
+		ranges += range->count;
+		for (item = range->first; item; item = item->next)
+			bytes += item->end - item->start + 1;
+		zchunk_range_free(&range);
+	}
+
+	INFO("Dry run %s: %zu bytes to download in %lu ranges (%lu requests), "
+	     "%zu of %zu bytes reused", img->fname, bytes, ranges, requests,
+	     priv->bytes_to_be_reused, total);
+
+	if (asprintf(&info, "{\"DELTA\" : {\"file\": \"%s\", \"download_bytes\": %zu, "
+		     "\"ranges\": %lu, \"requests\": %lu, \"reused_bytes\": %zu, "
+		     "\"reused_percent\": %u}}", img->fname, bytes, ranges, requests,
+		     priv->bytes_to_be_reused,
+		     total ? (unsigned int)(priv->bytes_to_be_reused * 100 / total) : 0) ==
+	    ENOMEM_ASPRINTF)
+		return -ENOMEM;
+	swupdate_progress_info(RUN, 0, info);
+	free(info);
+
+	return 0;
+}
+
 /*
  * Handler entry point
  */
@@ -840,12 +2196,11 @@ static int install_delta(struct img_type *img,
 {
 	struct hnd_priv *priv;
 	int ret = -1;
-	int dst_fd = -1, in_fd = -1;
+	int dst_fd = -1;
 	zckChunk *iter;
 	zckCtx *zckSrc = NULL, *zckDst = NULL;
 	char *FIFO = NULL;
-	pthread_t chain_handler_thread_id;
-	int pipes[2];
+	struct img_type chainimg;
 
 	/*
 	 * No streaming allowed
@@ -863,6 +2218,9 @@ static int install_delta(struct img_type *img,
 		ERROR("OOM when allocating handler data !");
 		return -ENOMEM;
 	}
+	SIMPLEQ_INIT(&priv->requests);
+	priv->fddst = -1;
+	priv->dstindexfd = -1;
 	priv->answer = (range_answer_t *)malloc(sizeof(*priv->answer));
 	if (!priv->answer) {
 		ERROR("OOM when allocating buffer !");
@@ -879,27 +2237,30 @@ static int install_delta(struct img_type *img,
 	}
 
 
+	/* nothing is downloaded or written in a dry run */
+	priv->dry_run = get_swupdate_cfg()->parms.dry_run;
+	if (priv->dry_run) {
+		priv->journal = NULL;
+		priv->indexdst = false;
+	}
+
 	priv->pipetodwl = pctl_getfd_from_type(SOURCE_CHUNKS_DOWNLOADER);
 
-	if (priv->pipetodwl < 0) {
+	if (priv->pipetodwl < 0 && !priv->dry_run) {
 		ERROR("Chunks dowbnloader is not running, delta update not available !");
 		ret = -EINVAL;
 		goto cleanup;
 	}
 
-	if (pipe(pipes) < 0) {
-		ERROR("Could not create pipes for chained handler, existing...");
-		ret = -EFAULT;
-		goto cleanup;
-	}
+	if (priv->ringslots && !priv->dry_run)
+		ring_setup(priv);
+
 	/*
-	 * Open files
+	 * The destination is rewritten, its index is not valid anymore
 	 */
-	dst_fd = open("/dev/null", O_TRUNC | O_WRONLY | O_CREAT, 0666);
-	if (dst_fd < 0) {
-		ERROR("/dev/null not present or cannot be opened, aborting...");
-		goto cleanup;
-	}
+	if (!priv->dry_run)
+		invalidate_zckindex(priv, img->device);
+
 
 	if (priv->detectsrcsize) {
 #if defined(CONFIG_DISKFORMAT)
@@ -925,11 +2286,8 @@ static int install_delta(struct img_type *img,
 #endif
 	}
 
-	in_fd = open(priv->srcdev, O_RDONLY);
-	if(in_fd < 0) {
-		ERROR("Unable to open Source : %s for reading", priv->srcdev);
+	if (open_sources(img, priv))
 		goto cleanup;
-	}
 
 	/*
 	 * Set ZCK log level
@@ -943,28 +2301,12 @@ static int install_delta(struct img_type *img,
 	 * source : device / file of current software
 	 * dst : final software to be installed
 	 */
-	zckSrc = zck_create();
-	if (!zckSrc) {
-		ERROR("Cannot create ZCK Source %s",  zck_get_error(NULL));
-		zck_clear_error(NULL);
-		goto cleanup;
-	}
 	zckDst = zck_create();
 	if (!zckDst) {
 		ERROR("Cannot create ZCK Destination %s",  zck_get_error(NULL));
 		zck_clear_error(NULL);
 		goto cleanup;
 	}
-
-	/*
-	 * Prepare zckSrc for writing: the ZCK header must be computed from
-	 * the running source
-	 */
-	if(!zck_init_write(zckSrc, dst_fd)) {
-		ERROR("Cannot initialize ZCK for writing (%s), aborting..",
-			zck_get_error(zckSrc));
-		goto cleanup;
-	}
 	if (!zck_init_read(zckDst, img->fdin)) {
 		ERROR("Unable to read ZCK header from %s : %s",
 			img->fname,
@@ -972,39 +2314,109 @@ static int install_delta(struct img_type *img,
 		goto cleanup;
 	}
 
-	TRACE("ZCK Header read successfully from SWU, creating header from %s",
-		priv->srcdev);
+	TRACE("ZCK Header read successfully from SWU");
+
 	/*
-	 * Now read completely source and generate the index file
-	 * with hashes for the uncompressed data
+	 * Reuse the index computed by a previous update
+	 * if the source was not changed in between
 	 */
-	if (!zck_set_ioption(zckSrc, ZCK_UNCOMP_HEADER, 1)) {
-		ERROR("%s\n", zck_get_error(zckSrc));
-		goto cleanup;
+	if (priv->indexcache && priv->nsources > 1)
+		TRACE("Index of %u sources is not cached", priv->nsources);
+	else if (priv->indexcache) {
+		priv->srcversion = index_source_version(img);
+		priv->cachekey = index_cache_key(priv->srcdev, priv->srcsize,
+						 priv->srcversion);
+		if (priv->cachekey)
+			zckSrc = load_zckindex(priv, priv->sources[0].fd);
+		if (zckSrc) {
+			zck_generate_hashdb(zckSrc);
+			zck_find_matching_chunks(zckSrc, zckDst);
+		} else if (priv->cachekey && !priv->dry_run)
+			dst_fd = delta_index_create(priv->indexcache, priv->srcdev,
+						    &priv->cachetmp);
 	}
-	if (!zck_set_ioption(zckSrc, ZCK_COMP_TYPE, ZCK_COMP_NONE)) {
-		ERROR("Error setting ZCK_COMP_NONE %s\n", zck_get_error(zckSrc));
-		goto cleanup;
-	}
-	if (!zck_set_ioption(zckSrc, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256)) {
-		ERROR("Error setting HASH Type %s\n", zck_get_error(zckSrc));
-		goto cleanup;
-	}
-	if (!zck_set_ioption(zckSrc, ZCK_NO_WRITE, 1)) {
-		WARN("ZCK does not support NO Write, use huge amount of RAM %s\n", zck_get_error(zckSrc));
+
+	/*
+	 * Open files
+	 */
+	if (!zckSrc && dst_fd < 0) {
+		dst_fd = open("/dev/null", O_TRUNC | O_WRONLY | O_CREAT, 0666);
+		if (dst_fd < 0) {
+			ERROR("/dev/null not present or cannot be opened, aborting...");
+			goto cleanup;
+		}
 	}
 
-	if (!create_zckindex(zckSrc, in_fd, priv->srcsize)) {
-		WARN("ZCK Header form %s cannot be created, fallback to full download",
-			priv->srcdev);
-	} else {
-		zck_generate_hashdb(zckSrc);
-		zck_find_matching_chunks(zckSrc, zckDst);
+	if (!zckSrc) {
+		zckSrc = zck_create();
+		if (!zckSrc) {
+			ERROR("Cannot create ZCK Source %s",  zck_get_error(NULL));
+			zck_clear_error(NULL);
+			goto cleanup;
+		}
+
+		/*
+		 * Prepare zckSrc for writing: the ZCK header must be computed from
+		 * the running source
+		 */
+		if(!zck_init_write(zckSrc, dst_fd)) {
+			ERROR("Cannot initialize ZCK for writing (%s), aborting..",
+				zck_get_error(zckSrc));
+			goto cleanup;
+		}
+
+		TRACE("Creating header from %s", priv->srcdev);
+		/*
+		 * Now read completely source and generate the index file
+		 * with hashes for the uncompressed data
+		 */
+		if (!zck_set_ioption(zckSrc, ZCK_UNCOMP_HEADER, 1)) {
+			ERROR("%s\n", zck_get_error(zckSrc));
+			goto cleanup;
+		}
+		if (!zck_set_ioption(zckSrc, ZCK_COMP_TYPE, ZCK_COMP_NONE)) {
+			ERROR("Error setting ZCK_COMP_NONE %s\n", zck_get_error(zckSrc));
+			goto cleanup;
+		}
+		if (!zck_set_ioption(zckSrc, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256)) {
+			ERROR("Error setting HASH Type %s\n", zck_get_error(zckSrc));
+			goto cleanup;
+		}
+		if (!zck_set_ioption(zckSrc, ZCK_NO_WRITE, 1)) {
+			WARN("ZCK does not support NO Write, use huge amount of RAM %s\n", zck_get_error(zckSrc));
+			/* Chunks would be written into the cache, too */
+			if (priv->cachetmp) {
+				unlink(priv->cachetmp);
+				free(priv->cachetmp);
+				priv->cachetmp = NULL;
+			}
+		}
+
+		if (!index_sources(zckSrc, priv)) {
+			WARN("ZCK Header form %s cannot be created, fallback to full download",
+				priv->srcdev);
+			if (priv->cachetmp) {
+				unlink(priv->cachetmp);
+				free(priv->cachetmp);
+				priv->cachetmp = NULL;
+			}
+		} else {
+			zck_generate_hashdb(zckSrc);
+			zck_find_matching_chunks(zckSrc, zckDst);
+		}
 	}
 
 	size_t uncompressed_size = get_total_size(zckDst, priv);
 	INFO("Size of artifact to be installed : %lu", uncompressed_size);
 
+	priv->tgt = zckDst;
+	if (priv->dry_run) {
+		ret = report_estimation(img, priv, uncompressed_size);
+		goto cleanup;
+	}
+	if (priv->journal && !setup_resume(img, priv))
+		priv->journal = NULL;
+
 	/*
 	 * Everything checked: now starts to combine
 	 * source data and ranges from server
@@ -1012,33 +2424,44 @@ static int install_delta(struct img_type *img,
 
 
 	/* Overwrite some parameters for chained handler */
-	struct chain_handler_data *priv_hnd;
-	priv_hnd = &priv->chain_handler_data;
-	memcpy(&priv_hnd->img, img, sizeof(*img));
-	priv_hnd->img.compressed = COMPRESSED_FALSE;
-	priv_hnd->img.size = uncompressed_size;
-	memset(priv_hnd->img.sha256, 0, SHA256_HASH_LENGTH);
-	strlcpy(priv_hnd->img.type, priv->chainhandler, sizeof(priv_hnd->img.type));
-	priv_hnd->img.fdin = pipes[PIPE_READ];
-
-	signal(SIGPIPE, SIG_IGN);
-
-	chain_handler_thread_id = start_thread(chain_handler_thread, priv_hnd);
-	wait_threads_ready();
-
-	priv->fdout = pipes[PIPE_WRITE];
-
-	ret = 0;
+	memcpy(&chainimg, img, sizeof(*img));
+	chainimg.compressed = COMPRESSED_FALSE;
+	chainimg.size = uncompressed_size;
+	memset(chainimg.sha256, 0, SHA256_HASH_LENGTH);
+	strlcpy(chainimg.type, priv->chainhandler, sizeof(chainimg.type));
+
+	ret = chain_handler_start(&priv->chain, &chainimg);
+	if (ret)
+		goto cleanup;
+	if (priv->indexdst)
+		start_dest_index(img, priv);
+	decode_start(priv);
 
 	iter = zck_get_first_chunk(zckDst);
 	bool success;
-	priv->tgt = zckDst;
-	priv->fdsrc = in_fd;
+	/* Chunks recovered from destination are not requested */
+	priv->nextreq = iter;
+	while (priv->nextreq &&
+	       zck_get_chunk_number(priv->nextreq) < priv->resume_limit)
+		priv->nextreq = zck_get_next_chunk(priv->nextreq);
 	while (iter) {
+		/*
+		 * Send requests before copying from source, so that
+		 * network transfers run while the source is read
+		 */
+		if (!fill_request_queue(priv)) {
+			ERROR("Delta Update fails : aborting");
+			ret = -1;
+			goto cleanup;
+		}
 		if (zck_get_chunk_valid(iter)) {
 			success = copy_existing_chunks(&iter, priv);
+		} else if (zck_get_chunk_number(iter) < priv->resume_limit) {
+			success = copy_resumed_chunks(&iter, priv);
 		} else {
 			success = copy_network_chunks(&iter, priv);
+			if (success && priv->journal)
+				write_journal(priv, iter);
 		}
 		if (!success) {
 			ERROR("Delta Update fails : aborting");
@@ -1047,27 +2470,51 @@ static int install_delta(struct img_type *img,
 		}
 	}
 
-	close(priv->fdout);
-
 	INFO("Total downloaded data : %ld bytes", priv->totaldwlbytes);
 
-	void *status;
-	ret = pthread_join(chain_handler_thread_id, &status);
-	if (ret) {
-		ERROR("return code from pthread_join() is %d", ret);
-	}
-	ret = (unsigned long)status;
+	/* Nothing to resume if the update is interrupted now */
+	if (priv->journal)
+		unlink(priv->journal);
+
+	/* Source was read completely, keep its index for next update */
+	if (priv->cachetmp)
+		delta_index_save(priv->indexcache, priv->srcdev, priv->cachekey,
+				 priv->cachetmp, zckSrc, dst_fd);
+
+	ret = chain_handler_end(&priv->chain, true);
 	TRACE("Chained handler returned %d", ret);
 
+	/* The destination is written, keep its index for the next update */
+	if (!ret)
+		save_dest_index(img, priv);
+
 cleanup:
+	/* stops the chained handler if the delta update failed */
+	if (priv->chain.active)
+		chain_handler_end(&priv->chain, false);
 	if (zckSrc) zck_free(&zckSrc);
 	if (zckDst) zck_free(&zckDst);
-	close(dst_fd);
-	close(in_fd);
+	if (dst_fd >= 0)
+		close(dst_fd);
+	close_sources(priv);
+	if (priv->cachetmp) {
+		unlink(priv->cachetmp);
+		free(priv->cachetmp);
+	}
+	drop_dest_index(priv);
+	free(priv->cachekey);
+	free(priv->journalkey);
+	if (priv->fddst >= 0)
+		close(priv->fddst);
 	if (FIFO) {
 		unlink(FIFO);
 		free(FIFO);
 	}
+	decode_stop(priv);
+	drop_requests(priv);
+	ring_close(priv);
+	dwl_cleanup(priv);
+	free(priv->extbuf);
 	if (priv->answer) free(priv->answer);
 	free(priv);
 	return ret;
@@ -1077,5 +2524,6 @@ __attribute__((constructor))
 void delta_handler(void)
 {
 	register_handler(handlername, install_delta,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+				IMAGE_HANDLER | FILE_HANDLER | DRYRUN_HANDLER |
+				SEEKABLE_HANDLER, NULL);
 }
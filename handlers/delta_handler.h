@@ -9,6 +9,8 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #define RANGE_PAYLOAD_SIZE (32 * 1024)
 typedef enum {
@@ -16,7 +18,8 @@ typedef enum {
 	RANGE_HEADERS,
 	RANGE_DATA,
 	RANGE_COMPLETED,
-	RANGE_ERROR
+	RANGE_ERROR,
+	RANGE_RING
 } request_type;
 
 typedef struct {
@@ -35,3 +38,22 @@ typedef struct {
 	uint32_t crc;
 	char data[RANGE_PAYLOAD_SIZE]; /* Payload */
 } range_answer_t;
+
+/*
+ * Instead of the IPC, the downloader can write the answers into a
+ * ring in memory shared with the handler. The handler passes the
+ * memory with a RANGE_RING request, the downloader acknowledges it on
+ * the IPC and sends the answers of next requests through the ring.
+ * The handler copies each answer out of the ring before validating
+ * it, the downloader has no access to its memory.
+ */
+typedef struct {
+	pthread_mutex_t lock;		/* process shared, robust */
+	pthread_cond_t filled;		/* an answer was written */
+	pthread_cond_t freed;		/* a slot can be written */
+	bool closed;			/* the handler does not read anymore */
+	uint32_t nslots;
+	uint32_t head;			/* answers written */
+	uint32_t tail;			/* answers read */
+	range_answer_t slots[];
+} range_ring_t;
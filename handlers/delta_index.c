@@ -0,0 +1,368 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zck.h>
+#include <swupdate.h>
+#include <util.h>
+#include <sslapi.h>
+#include "delta_index.h"
+
+#define INDEX_CACHE_SAMPLES	16	/* chunks checked before a cached index is used */
+
+bool delta_verify_chunk(zckChunk *chunk, const unsigned char *buf, size_t len)
+{
+	unsigned char hash[SHA256_HASH_LENGTH];
+	unsigned char md[SHA256_HASH_LENGTH];
+	struct swupdate_digest *dgst;
+	unsigned int mdlen;
+	bool ret = false;
+	char *sha;
+
+	sha = zck_get_chunk_digest_uncompressed(chunk);
+	if (!sha) {
+		ERROR("Cannot get hash for chunk %ld", zck_get_chunk_number(chunk));
+		return false;
+	}
+	if (ascii_to_hash(hash, sha)) {
+		ERROR("Hash of chunk %ld is not SHA-256", zck_get_chunk_number(chunk));
+		free(sha);
+		return false;
+	}
+	free(sha);
+
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst)
+		return false;
+	/* swupdate_HASH_final() returns 1 on success */
+	if (!swupdate_HASH_update(dgst, buf, len) &&
+	    swupdate_HASH_final(dgst, md, &mdlen) == 1)
+		ret = !swupdate_HASH_compare(hash, md);
+	swupdate_HASH_cleanup(dgst);
+
+	return ret;
+}
+
+/*
+ * The index of the source is stored as ZCK header in the
+ * cache directory, the name is derived from the device.
+ * A key file identifies the content of the device.
+ */
+char *delta_index_file(const char *dir, const char *dev, const char *suffix)
+{
+	char *fname, *p;
+
+	if (asprintf(&fname, "%s/%s%s", dir, dev, suffix) == -1)
+		return NULL;
+	for (p = fname + strlen(dir) + 1; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return fname;
+}
+
+void delta_index_invalidate(const char *dir, const char *dev)
+{
+	char *fname;
+
+	if (!dir || !strlen(dev))
+		return;
+	fname = delta_index_file(dir, dev, ".key");
+	if (fname) {
+		unlink(fname);
+		free(fname);
+	}
+	fname = delta_index_file(dir, dev, ".zck");
+	if (fname) {
+		unlink(fname);
+		free(fname);
+	}
+}
+
+/*
+ * Read some chunks from the source and compare their
+ * hashes with the index to detect that the source was
+ * changed without invalidating the cache
+ */
+bool delta_index_check(zckCtx *zck, int fd, size_t base)
+{
+	ssize_t count = zck_get_chunk_count(zck);
+	ssize_t step, n = 0;
+	unsigned char *buf = NULL;
+	size_t bufsize = 0;
+	bool ret = true;
+	zckChunk *chunk;
+
+	if (count <= 0)
+		return false;
+	step = count / INDEX_CACHE_SAMPLES;
+	if (!step)
+		step = 1;
+
+	for (chunk = zck_get_first_chunk(zck); chunk && ret;
+	     chunk = zck_get_next_chunk(chunk), n++) {
+		size_t len = zck_get_chunk_size(chunk);
+
+		if ((n % step) || !len)
+			continue;
+		if (len > bufsize) {
+			free(buf);
+			buf = malloc(len);
+			bufsize = buf ? len : 0;
+		}
+		ret = buf &&
+			pread(fd, buf, len, zck_get_chunk_start(chunk) - base) == (ssize_t)len &&
+			delta_verify_chunk(chunk, buf, len);
+	}
+	free(buf);
+
+	return ret;
+}
+
+char *delta_index_key(const char *dir, const char *dev)
+{
+	char key[SWUPDATE_GENERAL_STRING_SIZE * 4];
+	char *keyfile;
+	ssize_t n = -1;
+	int fd;
+
+	keyfile = delta_index_file(dir, dev, ".key");
+	if (!keyfile)
+		return NULL;
+	fd = open(keyfile, O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, key, sizeof(key) - 1);
+		close(fd);
+	}
+	free(keyfile);
+	if (n < 0)
+		return NULL;
+	key[n] = '\0';
+
+	return strdup(key);
+}
+
+/*
+ * Load the index of the source saved by a previous update.
+ * It is dropped if samples of the source were changed.
+ */
+zckCtx *delta_index_load(const char *dir, const char *dev, int srcfd)
+{
+	zckCtx *zck = NULL;
+	char *fname;
+	int fd;
+
+	fname = delta_index_file(dir, dev, ".zck");
+	if (!fname)
+		return NULL;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		goto out;
+	zck = zck_create();
+	if (!zck || !zck_init_read(zck, fd)) {
+		WARN("Cached index %s cannot be read", fname);
+		goto drop;
+	}
+	if (!delta_index_check(zck, srcfd,
+			       zck_get_chunk_start(zck_get_first_chunk(zck)))) {
+		WARN("%s was changed, cached index cannot be used", dev);
+		goto drop;
+	}
+	close(fd);
+	TRACE("Using cached index %s", fname);
+	goto out;
+
+drop:
+	close(fd);
+	if (zck)
+		zck_free(&zck);
+	zck = NULL;
+	delta_index_invalidate(dir, dev);
+out:
+	free(fname);
+	return zck;
+}
+
+/*
+ * Index is written into a temporary file and it
+ * is renamed when the update succeeded
+ */
+int delta_index_create(const char *dir, const char *dev, char **tmp)
+{
+	int fd;
+
+	*tmp = delta_index_file(dir, dev, ".tmp");
+	if (!*tmp)
+		return -1;
+	fd = open(*tmp, O_TRUNC | O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		WARN("Cannot create %s, index is not cached", *tmp);
+		free(*tmp);
+		*tmp = NULL;
+	}
+
+	return fd;
+}
+
+void delta_index_save(const char *dir, const char *dev, const char *key,
+		      const char *tmp, zckCtx *zck, int fd)
+{
+	char *keyfile, *fname;
+	bool ok = false;
+	int keyfd;
+
+	keyfile = delta_index_file(dir, dev, ".key");
+	fname = delta_index_file(dir, dev, ".zck");
+	if (!keyfile || !fname || !key)
+		goto out;
+
+	/* This writes the ZCK header into the temporary file */
+	if (!zck_close(zck) || fsync(fd)) {
+		WARN("Index for %s cannot be written : %s", dev,
+			zck_get_error(zck));
+		goto out;
+	}
+	unlink(keyfile);
+	if (rename(tmp, fname))
+		goto out;
+	keyfd = open(keyfile, O_TRUNC | O_WRONLY | O_CREAT, 0644);
+	if (keyfd < 0)
+		goto out;
+	ok = copy_write(&keyfd, key, strlen(key)) == 0 &&
+		fsync(keyfd) == 0;
+	close(keyfd);
+	if (ok)
+		TRACE("Index for %s saved into %s", dev, fname);
+
+out:
+	if (!ok) {
+		WARN("Index for %s not cached", dev);
+		if (keyfile)
+			unlink(keyfile);
+	}
+	free(keyfile);
+	free(fname);
+}
+
+bool delta_read_fully(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	size_t pos;
+	ssize_t n;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = pread(fd, buf + pos, len - pos, offset + pos);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Read back a chunk already written into a device
+ * and check it with the hash from the header
+ */
+bool delta_read_chunk(zckChunk *chunk, int fd, off_t offset, unsigned char *buf)
+{
+	size_t len = zck_get_chunk_size(chunk);
+
+	return delta_read_fully(fd, buf, len, offset) &&
+		delta_verify_chunk(chunk, buf, len);
+}
+
+/*
+ * The journal contains a key for the update and the number
+ * of the first chunk that was not yet sent to the chained handler
+ */
+long delta_journal_read(const char *journal, const char *key)
+{
+	char buf[SWUPDATE_GENERAL_STRING_SIZE * 4];
+	size_t keylen = strlen(key);
+	ssize_t n;
+	int fd;
+
+	fd = open(journal, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= (ssize_t)keylen)
+		return 0;
+	buf[n] = '\0';
+	if (strncmp(buf, key, keylen)) {
+		TRACE("Journal %s belongs to another update, ignoring", journal);
+		return 0;
+	}
+
+	return strtol(&buf[keylen], NULL, 10);
+}
+
+bool delta_journal_write(const char *journal, const char *key, long number)
+{
+	bool ret = false;
+	char *buf;
+	int fd;
+
+	if (asprintf(&buf, "%s%ld\n", key, number) == -1)
+		return false;
+	fd = open(journal, O_TRUNC | O_WRONLY | O_CREAT, 0600);
+	if (fd >= 0) {
+		ret = copy_write(&fd, buf, strlen(buf)) == 0 && !fsync(fd);
+		close(fd);
+	}
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Check which chunks written by the interrupted update
+ * are still valid. Chunks taken from source are not checked,
+ * they are copied again because this is cheap.
+ */
+long delta_verify_prefix(zckCtx *tgt, int fd, off_t seek, long limit)
+{
+	unsigned char *buf = NULL;
+	size_t bufsize = 0;
+	off_t offset = seek;
+	zckChunk *chunk;
+	long ret = limit;
+
+	for (chunk = zck_get_first_chunk(tgt); chunk;
+	     chunk = zck_get_next_chunk(chunk)) {
+		size_t len = zck_get_chunk_size(chunk);
+
+		if (zck_get_chunk_number(chunk) >= limit)
+			break;
+		if (!zck_get_chunk_valid(chunk) && len) {
+			if (len > bufsize) {
+				free(buf);
+				buf = malloc(len);
+				bufsize = buf ? len : 0;
+			}
+			if (!buf || !delta_read_chunk(chunk, fd, offset, buf)) {
+				ret = zck_get_chunk_number(chunk);
+				break;
+			}
+		}
+		offset += len;
+	}
+	free(buf);
+
+	return ret;
+}
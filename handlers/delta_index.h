@@ -0,0 +1,57 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zck.h>
+
+/*
+ * Checks of the data read from a device against the hashes of a
+ * zck index, used by the delta handler for the chunks it does not
+ * download, the cache of the index of the source device and the
+ * journal of an update that can be resumed.
+ */
+
+/* The SHA-256 of the uncompressed data of chunk is the one in the index */
+bool delta_verify_chunk(zckChunk *chunk, const unsigned char *buf, size_t len);
+
+/*
+ * Cache of the index: <dir>/<dev>.zck holds the ZCK header and
+ * <dev>.key the key of the content it was computed from.
+ */
+char *delta_index_file(const char *dir, const char *dev, const char *suffix);
+void delta_index_invalidate(const char *dir, const char *dev);
+
+/* Samples of the chunks in fd, base is the start of the first chunk */
+bool delta_index_check(zckCtx *zck, int fd, size_t base);
+
+/* Key of the cached index, NULL if it is not cached */
+char *delta_index_key(const char *dir, const char *dev);
+zckCtx *delta_index_load(const char *dir, const char *dev, int srcfd);
+
+int delta_index_create(const char *dir, const char *dev, char **tmp);
+void delta_index_save(const char *dir, const char *dev, const char *key,
+		      const char *tmp, zckCtx *zck, int fd);
+
+bool delta_read_fully(int fd, unsigned char *buf, size_t len, off_t offset);
+bool delta_read_chunk(zckChunk *chunk, int fd, off_t offset, unsigned char *buf);
+
+/*
+ * The journal holds the key of the update followed by the number
+ * of the first chunk not yet written, 0 if it cannot be resumed
+ */
+long delta_journal_read(const char *journal, const char *key);
+bool delta_journal_write(const char *journal, const char *key, long number);
+
+/*
+ * First chunk below limit that is not found unchanged in fd,
+ * where the target was written starting at seek
+ */
+long delta_verify_prefix(zckCtx *tgt, int fd, off_t seek, long limit);
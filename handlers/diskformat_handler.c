@@ -32,6 +32,15 @@ static int diskformat(struct img_type *img,
 		return -EINVAL;
 	}
 
+	int discard = img_discard_mode(img);
+
+	if (discard < 0)
+		return discard;
+	if (discard == DISCARD_TAIL) {
+		ERROR("diskformat handler does not support discard \"tail\"");
+		return -EINVAL;
+	}
+
 	char *force = dict_get_value(&img->properties, "force");
 
 	if (force != NULL && strcmp(force, "true") == 0) {
@@ -50,8 +59,14 @@ static int diskformat(struct img_type *img,
 		}
 	}
 
+	if (discard != DISCARD_NONE) {
+		ret = blkdev_discard_device(img->device, discard == DISCARD_SECURE);
+		if (ret)
+			return ret;
+	}
+
 	/* File system does not exist, create new file system */
-	ret = diskformat_mkfs(img->device, fstype);
+	ret = diskformat_mkfs(img->device, fstype, diskformat_mkfs_options(img));
 
 	/*
 	 * Declare that handler has finished
@@ -15,22 +15,30 @@
 #include <ctype.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/netlink.h>
 #include <libfdisk/libfdisk.h>
 #include <linux/fs.h>
 #include <fs_interface.h>
+#include <blkdev_cache.h>
 #include <uuid/uuid.h>
-#include <dirent.h>
 #include <libgen.h>
+#include <endian.h>
+#include <pthread.h>
 #include "swupdate.h"
 #include "handler.h"
 #include "util.h"
 #include "progress.h"
+#include "pctl.h"
 
 void diskpart_handler(void);
 void diskpart_toggle_boot(void);
 void diskpart_gpt_swap_partition(void);
 void diskpart_install_gpt_partition_image(void);
+void diskpart_install_gpt_image(void);
 
 /*
  * This is taken from libfdisk to declare if a field is not set
@@ -172,7 +180,8 @@ static int diskpart_assign_label(struct fdisk_context *cxt, struct img_type *img
 }
 
 static int diskpart_assign_context(struct fdisk_context **cxt,struct img_type *img,
-		struct hnd_priv priv, unsigned long hybrid, struct create_table *createtable)
+		struct hnd_priv priv, unsigned long hybrid, struct create_table *createtable,
+		bool readonly)
 {
 	struct fdisk_context *parent;
 	char *path = NULL;
@@ -208,7 +217,7 @@ static int diskpart_assign_context(struct fdisk_context **cxt,struct img_type *i
 	/*
 	 * fdisk_new_nested_context requires the device to be assigned.
 	 */
-	ret = fdisk_assign_device(parent, path, 0);
+	ret = fdisk_assign_device(parent, path, readonly);
 	free(path);
 	if (ret < 0) {
 		ERROR("Device %s cannot be opened: %s", img->device, strerror(-ret));
@@ -858,6 +867,7 @@ static int diskpart_write_table(struct fdisk_context *cxt, struct create_table *
 		 * Everything done, write into disk
 		 */
 		ret = fdisk_write_disklabel(cxt);
+		blkdev_cache_invalidate(NULL);
 		if (ret)
 			ERROR("Nested partition table cannot be written on disk");
 		if (fdisk_reread_partition_table(cxt))
@@ -871,6 +881,7 @@ static int diskpart_write_table(struct fdisk_context *cxt, struct create_table *
 		 * Everything done, write into disk
 		 */
 		ret = fdisk_write_disklabel(PARENT(cxt));
+		blkdev_cache_invalidate(NULL);
 		if (ret)
 			ERROR("Partition table cannot be written on disk");
 		if (fdisk_reread_partition_table(PARENT(cxt)))
@@ -912,127 +923,113 @@ static int diskpart_reread_partition(char *device)
 	return ret;
 }
 
-static int keep_directory(const struct dirent *ent)
-{
-	return ((ent->d_type & DT_DIR) && \
-		strcmp(ent->d_name, ".") && \
-		strcmp(ent->d_name, ".."));
-}
+/*
+ * After the partition table is written, the kernel and udev send a
+ * uevent for each partition that is removed or added. Instead of a
+ * fixed delay, the handler listens to the uevents of the disk and
+ * returns when udev has processed all of them and nothing has been
+ * received for a short time.
+ */
+#define UEVENT_BUFFER_SIZE	8192
+#define UEVENT_QUIET_MS		250
+#define UEVENT_TIMEOUT_MS	2000
 
-static char *compute_sys_block_path(char *device_name)
+static int diskpart_uevent_open(void)
 {
-	int size = strlen("/sys/block/") + strlen(device_name) + 1;
-	char *sys_block = malloc(size * sizeof(char));
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1 | 2,	/* kernel, udev */
+	};
+	int sock;
 
-	if (!sys_block) {
-		ERROR("ERROR: cannot allocate sys_block\n");
-		goto out;
-	}
+	sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		      NETLINK_KOBJECT_UEVENT);
+	if (sock < 0)
+		return -1;
 
-	sprintf(sys_block, "/sys/block/%s", device_name);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
 
- out:
-	return sys_block;
+	return sock;
 }
 
-static int read_partition(char *sys_block, char *dir_name)
+static bool diskpart_uevent_match(const char *buf, size_t len, const char *name)
 {
-	size_t size = strlen(sys_block) + strlen(dir_name) + 12;
-	char *path = (char *)malloc(size * sizeof(char));
-	struct stat statbuf;
-	int fd, err, len, partition = -1;
-	char *data = NULL;
-
-	if (!path) {
-		ERROR("Failed to allocate path\n");
-		goto out;
-	}
-
-	size = sprintf(path, "%s/%s/partition", sys_block, dir_name);
-
-	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		goto out;
-
-	err = fstat(fd, &statbuf);
-	if (err < 0) {
-		ERROR("Cannot get info on %s\n", path);
-		close(fd);
-		goto out;
-	}
-
-	size = statbuf.st_size;
-	data = (char *)malloc(size * sizeof(char));
-	if (!data) {
-		ERROR("Cannot allocate data\n");
-		close(fd);
-		goto out;
+	const char *devpath = memmem(buf, len, "DEVPATH=", strlen("DEVPATH="));
+	const char *p;
+	size_t n = strlen(name);
+
+	if (!devpath)
+		return false;
+	devpath += strlen("DEVPATH=");
+	if (!memchr(devpath, '\0', buf + len - devpath))
+		return false;
+
+	for (p = strstr(devpath, name); p; p = strstr(p + 1, name)) {
+		if (p[-1] == '/' && (p[n] == '\0' || p[n] == '/'))
+			return true;
 	}
 
-	len = read(fd, data, size);
-	if ((len > 0) && (len <= size))
-		partition = strtoul(data, NULL, 10);
-
-	close(fd);
-
- out:
-	free(path);
-	free(data);
-	return partition;
+	return false;
 }
 
-static int set_partition(char *buf, int bufsize, char *device, int partno)
+static long diskpart_elapsed_ms(struct timespec *start)
 {
-	char *device1 = strdup(device);
-	char *device2 = strdup(device);
-	char *device_path;
-	char *device_name;
-	char *sys_block = NULL;
-	struct dirent **dirlist = NULL;
-	int i, num_dir, ret = -1;
-
-	if (!device1 || !device2) {
-		ERROR("Cannot duplicate device\n");
-		goto out;
-	}
+	struct timespec now;
 
-	device_path = dirname(device1);
-	device_name = basename(device2);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
 
-	if (!device_name) {
-		ERROR("Cannot get basename\n");
-		goto out;
+static void diskpart_uevent_wait(int sock, char *device)
+{
+	char *path = realpath(device, NULL);
+	char *buf = malloc(UEVENT_BUFFER_SIZE);
+	struct pollfd pfd = {
+		.fd = sock,
+		.events = POLLIN
+	};
+	unsigned int kernel = 0, udev = 0;
+	bool udevd = access("/run/udev/control", F_OK) == 0;
+	struct timespec start, last;
+	const char *name;
+	ssize_t len;
+
+	if (!buf) {
+		free(path);
+		sleep(2);
+		return;
 	}
+	name = basename(path ? path : device);
 
-	sys_block = compute_sys_block_path(device_name);
-	if (!sys_block)
-		goto out;
-
-	num_dir = scandir(sys_block, &dirlist, keep_directory, NULL);
-	if (num_dir < 0)
-		goto out;
-
-	for (i = 0; i < num_dir; i++) {
-		char *dir_name = dirlist[i]->d_name;
-		int partition;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+	while (diskpart_elapsed_ms(&start) < UEVENT_TIMEOUT_MS) {
+		if ((kernel && (!udevd || udev >= kernel)) &&
+		    diskpart_elapsed_ms(&last) >= UEVENT_QUIET_MS)
+			break;
+		if (poll(&pfd, 1, UEVENT_QUIET_MS / 5) <= 0)
+			continue;
 
-		partition = read_partition(sys_block, dir_name);
-		if (partition == partno) {
-			snprintf(buf, bufsize, "%s/%s", device_path, dir_name);
-			ret = 0;
+		while ((len = recv(sock, buf, UEVENT_BUFFER_SIZE - 1, 0)) > 0) {
+			buf[len] = '\0';
+			if (!diskpart_uevent_match(buf, len + 1, name))
+				continue;
+			if (!strcmp(buf, "libudev"))
+				udev++;
+			else
+				kernel++;
+			clock_gettime(CLOCK_MONOTONIC, &last);
 		}
-
-		free(dirlist[i]);
 	}
+	TRACE("%s: %u kernel and %u udev events after %ld ms", name,
+	      kernel, udev, diskpart_elapsed_ms(&start));
 
-	free(dirlist);
-
- out:
-	free(sys_block);
-	free(device1);
-	free(device2);
-
-	return ret;
+	free(buf);
+	free(path);
 }
 
 static int install_gpt_partition_image(struct img_type *img,
@@ -1048,7 +1045,7 @@ static int install_gpt_partition_image(struct img_type *img,
 	struct create_table *createtable = NULL;
 	struct fdisk_partition *pa;
 	size_t partno;
-	char device[MAX_VOLNAME];
+	char *path, *device;
 	struct installer_handler *hnd;
 
 	LIST_INIT(&priv.listparts);
@@ -1072,7 +1069,7 @@ static int install_gpt_partition_image(struct img_type *img,
         /*
          * Create context
          */
-	ret = diskpart_assign_context(&cxt, img, priv, hybrid, createtable);
+	ret = diskpart_assign_context(&cxt, img, priv, hybrid, createtable, true);
 	if (ret == -EACCES)
 		goto handler_release;
 	else if (ret)
@@ -1095,9 +1092,9 @@ static int install_gpt_partition_image(struct img_type *img,
 	/*
 	 * Search partition to update
 	 */
-	pa = diskpart_get_partition_by_name(tb, img->volname);
+	pa = diskpart_get_partition_by_name(tb, IMG_STRING(img->volname));
 	if (!pa) {
-		ERROR("Can't find partition %s", img->volname);
+		ERROR("Can't find partition %s", IMG_STRING(img->volname));
 		ret = -1;
 		goto handler_exit;
 	}
@@ -1106,8 +1103,18 @@ static int install_gpt_partition_image(struct img_type *img,
 	 * Set device for next handler
 	 */
 	partno = fdisk_partition_get_partno(pa);
-	set_partition(device, sizeof(device), img->device, partno + 1);
+	path = realpath(img->device, NULL);
+	if (!path)
+		path = strdup(img->device);
+	device = fdisk_partname(path, partno + 1);
+	free(path);
+	if (!device) {
+		ERROR("Can't get device of partition %s", IMG_STRING(img->volname));
+		ret = -ENOMEM;
+		goto handler_exit;
+	}
 	strlcpy(img->device, device, sizeof(img->device));
+	free(device);
 
 	/*
 	 * Set next handler
@@ -1150,6 +1157,466 @@ handler_release:
 	return ret;
 }
 
+/*
+ * Whole-disk images with a GPT: only the partition tables and the
+ * partitions are written, the unallocated space of the image is
+ * skipped. If the image was staged in TMPDIR (or indexed in the SWU)
+ * and is stored as it is, the partitions are written concurrently.
+ */
+#define GPT_SIGNATURE		"EFI PART"
+#define GPT_HEADER_MAX		(1024 * 1024)
+#define GPT_MAX_ENTRIES		1024
+#define GPT_ZERO_BLOCK		4096
+#define GPT_COPY_BUFFER		(1024 * 1024)
+#define GPT_WORKERS		4
+
+struct gpt_region {
+	uint64_t start;		/* offset in the image */
+	uint64_t end;		/* first byte after the region */
+};
+
+struct gptimage_out {
+	int fdout;		/* first, copyimage() seeks it for an offset */
+	uint64_t seek;		/* offset of the image on the device */
+	bool skip_zero;
+	unsigned char *head;	/* kept until the table is parsed */
+	size_t headlen;
+	struct gpt_region *regions;
+	unsigned int nregions;
+	unsigned int cur;
+	uint64_t pos;		/* offset in the image of the next byte */
+};
+
+struct gptimage_job {
+	struct gptimage_out *g;
+	int fdin;
+	off_t base;		/* offset of the image in fdin */
+	uint64_t size;
+	unsigned int next;	/* next region to be written */
+	uint64_t total;
+	uint64_t done;
+	unsigned int percent;
+	pthread_mutex_t lock;
+	int ret;
+};
+
+static uint64_t gpt_le64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static uint32_t gpt_le32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static int gpt_region_cmp(const void *a, const void *b)
+{
+	const struct gpt_region *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/*
+ * Regions of the image to be written: protective MBR, primary
+ * header and entries, the partitions and everything after the
+ * last usable LBA (backup entries and header).
+ * Returns -EAGAIN if more data is required.
+ */
+static int gpt_parse_regions(const unsigned char *buf, size_t len,
+			     struct gpt_region **regions, unsigned int *nregions)
+{
+	static const unsigned int sector_sizes[] = { 512, 4096 };
+	const unsigned char *hdr = NULL;
+	uint64_t first_usable, last_usable, entries;
+	uint32_t nentries, entsize;
+	struct gpt_region *r;
+	unsigned int ss = 0, n = 0;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sector_sizes); i++) {
+		if (len < 2 * sector_sizes[i])
+			return -EAGAIN;
+		if (!memcmp(buf + sector_sizes[i], GPT_SIGNATURE, 8)) {
+			ss = sector_sizes[i];
+			hdr = buf + ss;
+			break;
+		}
+	}
+	if (!hdr) {
+		ERROR("Image has no GPT");
+		return -EINVAL;
+	}
+
+	first_usable = gpt_le64(hdr + 0x28);
+	last_usable = gpt_le64(hdr + 0x30);
+	entries = gpt_le64(hdr + 0x48);
+	nentries = gpt_le32(hdr + 0x50);
+	entsize = gpt_le32(hdr + 0x54);
+	if (entsize < 128 || nentries > GPT_MAX_ENTRIES || entries < 2 ||
+	    first_usable > last_usable ||
+	    entries * ss + (uint64_t)nentries * entsize > first_usable * ss ||
+	    first_usable * ss > GPT_HEADER_MAX) {
+		ERROR("GPT header of the image is corrupted");
+		return -EINVAL;
+	}
+	if (len < first_usable * ss)
+		return -EAGAIN;
+
+	r = calloc(nentries + 2, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	r[n++] = (struct gpt_region){ 0, first_usable * ss };
+	for (uint32_t i = 0; i < nentries; i++) {
+		const unsigned char *e = buf + entries * ss + (uint64_t)i * entsize;
+		static const unsigned char unused[16];
+		uint64_t first = gpt_le64(e + 32), last = gpt_le64(e + 40);
+
+		if (!memcmp(e, unused, sizeof(unused)))
+			continue;
+		if (first < first_usable || last < first || last > last_usable) {
+			ERROR("GPT entry %u of the image is out of the disk", i + 1);
+			free(r);
+			return -EINVAL;
+		}
+		r[n++] = (struct gpt_region){ first * ss, (last + 1) * ss };
+	}
+	r[n++] = (struct gpt_region){ (last_usable + 1) * ss, UINT64_MAX };
+
+	qsort(r, n, sizeof(*r), gpt_region_cmp);
+	for (unsigned int i = 1; i < n; i++) {
+		if (r[i].start < r[i - 1].end) {
+			ERROR("Partitions of the image overlap");
+			free(r);
+			return -EINVAL;
+		}
+	}
+	TRACE("GPT of the image: sector size %u, %u partitions", ss, n - 2);
+
+	*regions = r;
+	*nregions = n;
+
+	return 0;
+}
+
+static int gpt_pwrite(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ERROR("Cannot write at %lld: %s", (long long)offset,
+			      n < 0 ? strerror(errno) : "short write");
+			return -EIO;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/*
+ * With skip-zero, blocks of zeroes are not written: the device
+ * must already read as zeroes
+ */
+static int gpt_write_block(const struct gptimage_out *g, const unsigned char *buf,
+			   size_t len, uint64_t pos)
+{
+	while (len) {
+		size_t n = min(len, (size_t)GPT_ZERO_BLOCK);
+
+		if (!g->skip_zero || buf[0] || memcmp(buf, buf + 1, n - 1)) {
+			int ret = gpt_pwrite(g->fdout, buf, n, g->seek + pos);
+
+			if (ret)
+				return ret;
+		}
+		buf += n;
+		len -= n;
+		pos += n;
+	}
+
+	return 0;
+}
+
+static int gptimage_regions_write(struct gptimage_out *g, const unsigned char *buf,
+				  size_t len)
+{
+	while (len) {
+		const struct gpt_region *r;
+		size_t n;
+		int ret;
+
+		while (g->cur < g->nregions && g->pos >= g->regions[g->cur].end)
+			g->cur++;
+		if (g->cur == g->nregions)
+			return 0;
+		r = &g->regions[g->cur];
+		if (g->pos < r->start) {
+			n = min((uint64_t)len, r->start - g->pos);
+		} else {
+			n = min((uint64_t)len, r->end - g->pos);
+			ret = gpt_write_block(g, buf, n, g->pos);
+			if (ret)
+				return ret;
+		}
+		buf += n;
+		len -= n;
+		g->pos += n;
+	}
+
+	return 0;
+}
+
+static int gptimage_write(void *out, const void *buf, size_t len)
+{
+	struct gptimage_out *g = out;
+	const unsigned char *p = buf;
+	size_t n;
+	int ret;
+
+	if (!g->regions) {
+		n = min(len, GPT_HEADER_MAX - g->headlen);
+		memcpy(g->head + g->headlen, p, n);
+		g->headlen += n;
+		ret = gpt_parse_regions(g->head, g->headlen, &g->regions, &g->nregions);
+		if (ret == -EAGAIN && g->headlen < GPT_HEADER_MAX)
+			return 0;
+		if (ret)
+			return ret == -EAGAIN ? -EINVAL : ret;
+		ret = gptimage_regions_write(g, g->head, g->headlen);
+		if (ret)
+			return ret;
+		p += n;
+		len -= n;
+	}
+
+	return gptimage_regions_write(g, p, len);
+}
+
+static int gptimage_discard(void __attribute__ ((__unused__)) *out,
+			    const void __attribute__ ((__unused__)) *buf,
+			    size_t __attribute__ ((__unused__)) len)
+{
+	return 0;
+}
+
+static int gpt_pread(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t n = pread(fd, buf, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ERROR("Cannot read the image at %lld: %s", (long long)offset,
+			      n < 0 ? strerror(errno) : "end of file");
+			return -EIO;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Each worker takes the next region not yet written
+ */
+static void *gptimage_worker(void *data)
+{
+	struct gptimage_job *job = data;
+	unsigned char *buf = malloc(GPT_COPY_BUFFER);
+	int ret = buf ? 0 : -ENOMEM;
+
+	while (!ret) {
+		struct gpt_region r;
+		uint64_t end;
+
+		pthread_mutex_lock(&job->lock);
+		if (job->ret || job->next == job->g->nregions) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		r = job->g->regions[job->next++];
+		pthread_mutex_unlock(&job->lock);
+
+		end = min(r.end, job->size);
+		for (uint64_t pos = r.start; pos < end && !ret;) {
+			size_t n = min(end - pos, (uint64_t)GPT_COPY_BUFFER);
+
+			ret = gpt_pread(job->fdin, buf, n, job->base + pos);
+			if (!ret)
+				ret = gpt_write_block(job->g, buf, n, pos);
+			pos += n;
+
+			pthread_mutex_lock(&job->lock);
+			job->done += n;
+			if (job->done * 100 / job->total > job->percent) {
+				job->percent = job->done * 100 / job->total;
+				swupdate_progress_update(job->percent);
+			}
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	pthread_mutex_lock(&job->lock);
+	if (ret && !job->ret)
+		job->ret = ret;
+	pthread_mutex_unlock(&job->lock);
+	free(buf);
+
+	return NULL;
+}
+
+static int gptimage_parallel(struct gptimage_out *g, struct img_type *img,
+			     off_t base, unsigned int workers)
+{
+	struct gptimage_job job = {
+		.g = g,
+		.fdin = img->fdin,
+		.base = base,
+		.size = img->size,
+	};
+	pthread_t *ids;
+	bool *started;
+	unsigned int i;
+	int ret;
+
+	/* the hash is verified before anything is written */
+	if (!img->hash_verified && IsValidHash(img->sha256)) {
+		unsigned long offs = 0;
+
+		ret = copyfile_hash(img->fdin, NULL, img->size, &offs, 0, 0,
+				    COMPRESSED_FALSE, NULL, img->sha256, img->hashalg,
+				    ENCRYPTED_FALSE, NULL, gptimage_discard);
+		if (ret)
+			return ret;
+	}
+
+	g->headlen = min((uint64_t)GPT_HEADER_MAX, (uint64_t)img->size);
+	ret = gpt_pread(img->fdin, g->head, g->headlen, base);
+	if (!ret)
+		ret = gpt_parse_regions(g->head, g->headlen, &g->regions, &g->nregions);
+	if (ret)
+		return ret == -EAGAIN ? -EINVAL : ret;
+
+	for (i = 0; i < g->nregions; i++)
+		if (g->regions[i].start < job.size)
+			job.total += min(g->regions[i].end, job.size) - g->regions[i].start;
+	if (!job.total)
+		return 0;
+
+	workers = min(workers, g->nregions);
+	ids = calloc(workers, sizeof(*ids));
+	started = calloc(workers, sizeof(*started));
+	if (!ids || !started) {
+		free(ids);
+		free(started);
+		return -ENOMEM;
+	}
+	TRACE("Writing %u regions of %s with %u workers", g->nregions,
+	      img->fname, workers);
+
+	pthread_mutex_init(&job.lock, NULL);
+	for (i = 0; i < workers; i++)
+		started[i] = !start_worker_thread(&ids[i], gptimage_worker, &job);
+	/* at least the caller writes */
+	if (!started[0])
+		gptimage_worker(&job);
+	for (i = 0; i < workers; i++)
+		if (started[i])
+			pthread_join(ids[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	free(ids);
+	free(started);
+
+	return job.ret;
+}
+
+static int install_gpt_image(struct img_type *img,
+			     void __attribute__ ((__unused__)) *data)
+{
+	const char *nworkers = dict_get_value(&img->properties, "workers");
+	unsigned int workers = nworkers ? ustrtoull(nworkers, NULL, 10) : GPT_WORKERS;
+	struct gptimage_out g = {
+		.seek = img->seek,
+		.skip_zero = strtobool(dict_get_value(&img->properties, "skip-zero")),
+	};
+	off_t base = -1;
+	int uevents;
+	int ret;
+
+	if (!strlen(img->device)) {
+		ERROR("GPT image handler without setting the device");
+		return -EINVAL;
+	}
+
+	g.head = malloc(GPT_HEADER_MAX);
+	if (!g.head)
+		return -ENOMEM;
+
+	g.fdout = open(img->device, O_RDWR);
+	if (g.fdout < 0) {
+		ERROR("Device %s cannot be opened: %s", img->device, strerror(errno));
+		free(g.head);
+		return -ENODEV;
+	}
+
+	/*
+	 * A staged image stored as it is can be read at any offset,
+	 * a streamed one is written while it arrives
+	 */
+	if (workers > 1 && !img->install_directly &&
+	    img->compressed == COMPRESSED_FALSE && !img->is_encrypted)
+		base = lseek(img->fdin, 0, SEEK_CUR);
+
+	if (base >= 0) {
+		ret = gptimage_parallel(&g, img, base, workers);
+	} else {
+		ret = copyimage(&g, img, gptimage_write);
+		if (!ret && !g.regions) {
+			ERROR("Image %s is too short for a GPT", img->fname);
+			ret = -EINVAL;
+		}
+	}
+
+	if (!ret && fsync(g.fdout)) {
+		ERROR("Cannot flush %s: %s", img->device, strerror(errno));
+		ret = -EIO;
+	}
+	close(g.fdout);
+	free(g.regions);
+	free(g.head);
+
+	/*
+	 * The kernel rereads the new partition table, the partitions
+	 * are ready when the uevents are processed
+	 */
+	if (!ret) {
+		uevents = diskpart_uevent_open();
+		if (!diskpart_reread_partition(img->device) && uevents >= 0)
+			diskpart_uevent_wait(uevents, img->device);
+		if (uevents >= 0)
+			close(uevents);
+	}
+
+	swupdate_progress_update(100);
+
+	return ret;
+}
+
 static int diskpart(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
@@ -1168,6 +1635,9 @@ static int diskpart(struct img_type *img,
 		.labeltype = FDISK_DISKLABEL_DOS,
 	};
 	struct create_table *createtable = NULL;
+	bool readonly = true;
+	int uevents = -1;
+	int discard;
 
 	if (!diskpart_is_gpt(img) && !diskpart_is_dos(img)) {
 		ERROR("Just GPT or DOS partition table are supported");
@@ -1191,6 +1661,21 @@ static int diskpart(struct img_type *img,
 	priv.nolock = strtobool(dict_get_value(&img->properties, "nolock"));
 	priv.noinuse = strtobool(dict_get_value(&img->properties, "noinuse"));
 
+	/*
+	 * Partitions that are going to be formatted are discarded first
+	 */
+	discard = img_discard_mode(img);
+	if (discard < 0 || discard == DISCARD_TAIL) {
+		if (discard == DISCARD_TAIL)
+			ERROR("diskpart handler does not support discard \"tail\"");
+		free(createtable);
+		return -EINVAL;
+	}
+#ifndef CONFIG_DISKPART_FORMAT
+	if (discard != DISCARD_NONE)
+		WARN("discard is set, but diskpart format support is missing, ignored");
+#endif
+
 	/*
 	 * Parse partitions
 	 */
@@ -1329,7 +1814,13 @@ static int diskpart(struct img_type *img,
 		goto handler_release;
 	}
 
-	ret = diskpart_assign_context(&cxt, img, priv, hybrid, createtable);
+	/*
+	 * The device is opened read-only to compare the tables: closing
+	 * a disk opened for writing triggers a rescan by udev, and this
+	 * is not needed if the table on the disk is already the right one.
+	 */
+diskpart_open:
+	ret = diskpart_assign_context(&cxt, img, priv, hybrid, createtable, readonly);
 	if (ret == -EACCES)
 		goto handler_release;
 	else if (ret)
@@ -1371,6 +1862,26 @@ static int diskpart(struct img_type *img,
 	if (ret)
 		goto handler_exit;
 
+	if (!createtable->parent && !createtable->child) {
+		TRACE("Same partition table on disk, do not touch partition table !");
+		goto handler_exit;
+	}
+
+	if (readonly) {
+		/* Start again with the device opened for writing */
+		diskpart_unref_table(tb);
+		diskpart_unref_table(oldtb);
+		tb = oldtb = NULL;
+		if (fdisk_deassign_device(cxt, 0))
+			WARN("Error deassign device %s", img->device);
+		diskpart_unref_context(cxt);
+		cxt = NULL;
+		memset(createtable, 0, sizeof(*createtable));
+		readonly = false;
+		goto diskpart_open;
+	}
+
+	uevents = diskpart_uevent_open();
 	ret = diskpart_write_table(cxt, createtable, priv.nolock, priv.noinuse);
 
 handler_exit:
@@ -1387,12 +1898,16 @@ handler_release:
 		diskpart_unref_context(cxt);
 
 	/*
-	 * Kernel rereads the partition table and add just a delay to be sure
-	 * that SWUpdate does not try to access the partitions before the kernel is
-	 * ready
+	 * Kernel rereads the partition table: wait until the partitions
+	 * are announced, so that SWUpdate does not try to access them
+	 * before the kernel and udev are ready
 	 */
-
-	sleep(2);
+	if (uevents >= 0) {
+		diskpart_uevent_wait(uevents, img->device);
+		close(uevents);
+	} else if (!readonly) {
+		sleep(2);
+	}
 
 #ifdef CONFIG_DISKPART_FORMAT
 	/* Create filesystems */
@@ -1435,7 +1950,16 @@ handler_release:
 				}
 			}
 
-			ret = diskformat_mkfs(device, part->fstype);
+			if (discard != DISCARD_NONE) {
+				ret = blkdev_discard_device(device, discard == DISCARD_SECURE);
+				if (ret) {
+					free(device);
+					break;
+				}
+			}
+
+			ret = diskformat_mkfs(device, part->fstype,
+					      diskformat_mkfs_options(img));
 			free(device);
 			if (ret)
 				break;
@@ -1609,7 +2133,7 @@ static int gpt_swap_partition(struct img_type *img, void *data)
         /*
          * Create context
          */
-	ret = diskpart_assign_context(&cxt, img, priv, hybrid, createtable);
+	ret = diskpart_assign_context(&cxt, img, priv, hybrid, createtable, false);
 	if (ret == -EACCES)
 		goto handler_release;
 	else if (ret)
@@ -1745,3 +2269,10 @@ void diskpart_install_gpt_partition_image(void)
 	register_handler("gptpart", install_gpt_partition_image,
 			 IMAGE_HANDLER, NULL);
 }
+
+__attribute__((constructor))
+void diskpart_install_gpt_image(void)
+{
+	register_handler("gptimage", install_gpt_image,
+			 IMAGE_HANDLER, NULL);
+}
@@ -47,6 +47,7 @@ void dummy_handler(void)
 				IMAGE_HANDLER |
 				FILE_HANDLER |
 				SCRIPT_HANDLER |
-				PARTITION_HANDLER,
+				PARTITION_HANDLER |
+				PARALLEL_HANDLER,
 				NULL);
 }
@@ -30,106 +30,17 @@
 #include "util.h"
 #include "flash.h"
 #include "progress.h"
+#include "hamming1_ecc.h"
 
 #define PROCMTD	"/proc/mtd"
 #define LINESIZE	80
 
-#define EVEN_WHOLE  0xff
-#define EVEN_HALF   0x0f
-#define ODD_HALF    0xf0
-#define EVEN_FOURTH 0x33
-#define ODD_FOURTH  0xcc
-#define EVEN_EIGHTH 0x55
-#define ODD_EIGHTH  0xaa
-#define ODD_WHOLE   0x00
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
 #define MTD_FILE_MODE_RAW MTD_MODE_RAW
 #endif
 
-#define _L1(n)  (((n) < 2)     ?      0 :  1)
-#define _L2(n)  (((n) < 1<<2)  ? _L1(n) :  2 + _L1((n)>>2))
-#define _L4(n)  (((n) < 1<<4)  ? _L2(n) :  4 + _L2((n)>>4))
-#define _L8(n)  (((n) < 1<<8)  ? _L4(n) :  8 + _L4((n)>>8))
-#define LOG2(n) (((n) < 1<<16) ? _L8(n) : 16 + _L8((n)>>16))
-
 void flash_1bit_hamming_handler(void);
 
-static unsigned char calc_bitwise_parity(unsigned char val, unsigned char mask)
-{
-	unsigned char result = 0, byte_mask;
-	int i;
-
-	byte_mask = mask;
-
-	for (i = 0; i < 8; i++) {
-		if ((byte_mask & 0x1) != 0)
-			result ^= (val & 1);
-		byte_mask >>= 1;
-		val >>= 1;
-	}
-	return result & 0x1;
-}
-
-static unsigned char calc_row_parity_bits(unsigned char byte_parities[],
-					  int even, int chunk_size,
-					  int sector_size)
-{
-	unsigned char result = 0;
-	int i, j;
-
-	for (i = (even ? 0 : chunk_size);
-	     i < sector_size;
-	     i += (2 * chunk_size)) {
-		for (j = 0; j < chunk_size; j++)
-			result ^= byte_parities[i + j];
-	}
-	return result & 0x1;
-}
-
-/*
- * Based on Texas Instrument's C# GenECC application
- * (sourceforge.net/projects/dvflashutils)
- */
-static unsigned int nand_calculate_ecc(unsigned char *buf, unsigned int sector_size)
-{
-	unsigned short odd_result = 0, even_result = 0;
-	unsigned char bit_parities = 0;
-	int i;
-	unsigned char val;
-	unsigned char *byte_parities = malloc(sector_size);
-
-	if (!byte_parities)
-		return -ENOMEM;
-
-	for (i = 0; i < sector_size; i++)
-		bit_parities ^= buf[i];
-
-	even_result |= ((calc_bitwise_parity(bit_parities, EVEN_HALF) << 2) |
-			(calc_bitwise_parity(bit_parities, EVEN_FOURTH) << 1) |
-			(calc_bitwise_parity(bit_parities, EVEN_EIGHTH) << 0));
-
-	odd_result |= ((calc_bitwise_parity(bit_parities, ODD_HALF) << 2) |
-			(calc_bitwise_parity(bit_parities, ODD_FOURTH) << 1) |
-			(calc_bitwise_parity(bit_parities, ODD_EIGHTH) << 0));
-
-	for (i = 0; i < sector_size; i++)
-		byte_parities[i] = calc_bitwise_parity(buf[i], EVEN_WHOLE);
-
-	for (i = 0; i < LOG2(sector_size); i++) {
-		val = 0;
-		val = calc_row_parity_bits(byte_parities, 1, 1 << i, sector_size);
-		even_result |= (val << (3 + i));
-
-		val = calc_row_parity_bits(byte_parities, 0, 1 << i, sector_size);
-		odd_result |= (val << (3 + i));
-	}
-
-	free(byte_parities);
-
-	return (odd_result << 16) | even_result;
-}
-
 static int write_ecc(int ofd, unsigned char *ecc, int start)
 {
 	struct mtd_oob_buf oob;
@@ -154,7 +65,7 @@ static void ecc_sector(unsigned char *sector, unsigned char *code,
 	unsigned char *p;
 	int ecc = 0;
 
-	ecc = nand_calculate_ecc(sector, sector_size);
+	ecc = hamming1_calculate_ecc(sector, sector_size);
 
 	p = (unsigned char *) &ecc;
 
@@ -281,13 +192,13 @@ static int install_flash_hamming_image(struct img_type *img,
 {
 	int mtdnum;
 
-	if (strlen(img->mtdname))
+	if (img->mtdname)
 		mtdnum = get_mtd_from_name(img->mtdname);
 	else
 		mtdnum = get_mtd_from_device(img->device);
 	if (mtdnum < 0) {
 		ERROR("Wrong MTD device in description: %s",
-			strlen(img->mtdname) ? img->mtdname : img->device);
+			img->mtdname ? img->mtdname : img->device);
 		return -1;
 	}
 
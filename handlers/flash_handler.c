@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
 #include <linux/version.h>
 #include <sys/ioctl.h>
 
@@ -30,14 +31,20 @@
 #include "util.h"
 #include "flash.h"
 #include "progress.h"
+#include "swupdate_metrics.h"
 
 #define PROCMTD	"/proc/mtd"
 #define LINESIZE	80
 
 void flash_handler(void);
 
-/* Check whether buffer is filled with character 'pattern' */
-static inline int buffer_check_pattern(unsigned char *buffer, size_t size,
+/*
+ * Check whether buffer is filled with character 'pattern'.
+ * This runs on every page before it is programmed: memcmp() of the
+ * C library is already vectorised and it is much faster than the
+ * flash, pages with data usually fail on the first byte.
+ */
+static inline int buffer_check_pattern(const unsigned char *buffer, size_t size,
                                        unsigned char pattern)
 {
         /* Invalid input */
@@ -78,25 +85,213 @@ static void erase_buffer(void *buffer, size_t size)
 		memset(buffer, kEraseByte, size);
 }
 
+static void flash_report_skipped(int mtdnum, struct img_type *img,
+				 unsigned long pages, unsigned long skipped)
+{
+	if (!pages)
+		return;
+	INFO("%s: %lu of %lu pages on mtd%d were empty and not programmed",
+		img->fname, skipped, pages, mtdnum);
+	metrics_count(METRICS_FLASH_PAGES_SKIPPED, skipped);
+}
+
+/*
+ * State of the streaming NAND writer. Data is collected into a buffer
+ * of exactly one eraseblock (or what is left of the first one if the
+ * image does not start at a block boundary). The target block is chosen
+ * and erased just before data for it is collected, skipping bad blocks,
+ * so nothing must be staged in TMPDIR and the whole range is not erased
+ * up front.
+ */
+struct nand_out {
+	int fd;		/* must be first, see copyimage() */
+	int mtdnum;
+	struct flash_description *flash;
+	struct mtd_dev_info *mtd;
+	long long mtdoffset;
+	unsigned char *buf;
+	size_t len;
+	size_t room;
+	unsigned long pages;
+	unsigned long skipped;	/* empty pages, not programmed */
+	unsigned char *verify;	/* read back buffer in "verify" mode */
+};
+
+/*
+ * Skip bad blocks starting from the current offset and erase the first
+ * good one. An eraseblock that cannot be erased is marked bad.
+ */
+static int nand_open_block(struct nand_out *n)
+{
+	struct mtd_dev_info *mtd = n->mtd;
+	long long eb;
+	int ret;
+
+	while (n->mtdoffset < mtd->size) {
+		eb = n->mtdoffset / mtd->eb_size;
+		ret = mtd_is_bad(mtd, n->fd, eb);
+		if (ret < 0 && errno != EOPNOTSUPP) {
+			ERROR("mtd%d: MTD get bad block failed", n->mtdnum);
+			return -EIO;
+		}
+		if (ret == 1) {
+			TRACE("mtd%d: skipping bad block at %08llx", n->mtdnum,
+				eb * mtd->eb_size);
+			n->mtdoffset = (eb + 1) * mtd->eb_size;
+			continue;
+		}
+		if (mtd_erase(n->flash->libmtd, mtd, n->fd, eb)) {
+			if (errno != EIO) {
+				ERROR("mtd%d: MTD Erase failure", n->mtdnum);
+				return -EIO;
+			}
+			TRACE("Marking block at %08llx bad", eb * mtd->eb_size);
+			if (mtd_mark_bad(mtd, n->fd, eb)) {
+				ERROR("mtd%d: MTD Mark bad block failure", n->mtdnum);
+				return -EIO;
+			}
+			n->mtdoffset = (eb + 1) * mtd->eb_size;
+			continue;
+		}
+		n->room = mtd->eb_size - n->mtdoffset % mtd->eb_size;
+		return 0;
+	}
+
+	ERROR("too many bad blocks, cannot complete request");
+	return -ENOSPC;
+}
+
+/*
+ * Write the collected data page by page into the current block. Pages
+ * filled with 0xff are skipped, they are already erased. In "verify"
+ * mode, the block is read back and compared with the buffer: a block
+ * that does not return the data is handled as a block gone bad.
+ * Returns 1 if the block went bad and must be replaced.
+ */
+static int nand_write_pages(struct nand_out *n, size_t len)
+{
+	struct mtd_dev_info *mtd = n->mtd;
+	long long eb = n->mtdoffset / mtd->eb_size;
+	unsigned long skipped = 0;
+	size_t i;
+
+	for (i = 0; i < len; i += mtd->min_io_size) {
+		if (buffer_check_pattern(n->buf + i, mtd->min_io_size, 0xff)) {
+			skipped++;
+			continue;
+		}
+		if (!mtd_write(n->flash->libmtd, mtd, n->fd, eb,
+				n->mtdoffset % mtd->eb_size + i,
+				n->buf + i, mtd->min_io_size,
+				NULL, 0, MTD_OPS_PLACE_OOB))
+			continue;
+		if (errno != EIO) {
+			ERROR("mtd%d: MTD write failure", n->mtdnum);
+			return -EIO;
+		}
+		goto bad_block;
+	}
+
+	/* erased pages are read back too, they must be empty */
+	if (n->verify) {
+		if (mtd_read(mtd, n->fd, eb, n->mtdoffset % mtd->eb_size,
+			     n->verify, len)) {
+			if (errno != EIO && errno != EBADMSG) {
+				ERROR("mtd%d: MTD read failure", n->mtdnum);
+				return -EIO;
+			}
+			TRACE("mtd%d: block at %08llx cannot be read back",
+			      n->mtdnum, eb * mtd->eb_size);
+			goto bad_block;
+		}
+		if (memcmp(n->verify, n->buf, len)) {
+			TRACE("mtd%d: verification of block at %08llx failed",
+			      n->mtdnum, eb * mtd->eb_size);
+			goto bad_block;
+		}
+	}
+
+	n->pages += len / mtd->min_io_size;
+	n->skipped += skipped;
+
+	return 0;
+
+bad_block:
+	if (mtd_erase(n->flash->libmtd, mtd, n->fd, eb) && errno != EIO) {
+		TRACE("mtd%d: MTD Erase failure", n->mtdnum);
+		return -EIO;
+	}
+	TRACE("Marking block at %08llx bad", eb * mtd->eb_size);
+	if (mtd_mark_bad(mtd, n->fd, eb)) {
+		ERROR("mtd%d: MTD Mark bad block failure", n->mtdnum);
+		return -EIO;
+	}
+	return 1;
+}
+
+/*
+ * Flush the buffer into the current block. If the block goes bad, the
+ * data is kept and replayed into the next good block; unless this is
+ * the last chunk of the image, collecting goes on if that block has
+ * more room.
+ */
+static int nand_flush_block(struct nand_out *n, bool last)
+{
+	size_t len = SWUPDATE_ALIGN(n->len, (size_t)n->mtd->min_io_size);
+	int ret;
+
+	erase_buffer(n->buf + n->len, len - n->len);
+	while ((ret = nand_write_pages(n, len)) > 0) {
+		n->mtdoffset = (n->mtdoffset / n->mtd->eb_size + 1) * n->mtd->eb_size;
+		if (nand_open_block(n))
+			return -EIO;
+		if (!last && n->len < n->room)
+			return 0;
+	}
+	if (ret < 0)
+		return ret;
+
+	n->mtdoffset += len;
+	n->len = 0;
+	n->room = 0;
+
+	return 0;
+}
+
+static int nand_write(void *out, const void *buf, size_t len)
+{
+	struct nand_out *n = (struct nand_out *)out;
+	const unsigned char *p = buf;
+	size_t cnt;
+
+	while (len > 0) {
+		if (!n->room && nand_open_block(n))
+			return -1;
+		cnt = min(len, n->room - n->len);
+		memcpy(n->buf + n->len, p, cnt);
+		n->len += cnt;
+		p += cnt;
+		len -= cnt;
+		if (n->len == n->room && nand_flush_block(n, false))
+			return -1;
+	}
+
+	return 0;
+}
+
 static int flash_write_nand(int mtdnum, struct img_type *img)
 {
 	char mtd_device[LINESIZE];
 	struct flash_description *flash = get_flash_info();
 	struct mtd_dev_info *mtd = &flash->mtd_info[mtdnum].mtd;
-	int pagelen;
-	bool baderaseblock = false;
-	long long imglen = 0;
-	long long blockstart = -1;
-	long long offs;
-	unsigned char *filebuf = NULL;
-	size_t filebuf_max = 0;
-	size_t filebuf_len = 0;
-	long long mtdoffset = img->seek;
-	int ifd = img->fdin;
-	int fd = -1;
-	bool failed = true;
+	struct nand_out n = {
+		.mtdnum = mtdnum,
+		.flash = flash,
+		.mtd = mtd,
+		.mtdoffset = img->seek
+	};
+	bool verify = strtobool(dict_get_value(&img->properties, "verify"));
 	int ret;
-	unsigned char *writebuf = NULL;
 
 	/*
 	 * if nothing to do, returns without errors
@@ -104,198 +299,330 @@ static int flash_write_nand(int mtdnum, struct img_type *img)
 	if (!img->size)
 		return 0;
 
-	if (mtdoffset & (mtd->min_io_size - 1)) {
+	if (n.mtdoffset & (mtd->min_io_size - 1)) {
 		ERROR("The start address is not page-aligned !\n"
 			   "The pagesize of this NAND Flash is 0x%x.\n",
 			   mtd->min_io_size);
 		return -EIO;
 	}
 
-	pagelen = mtd->min_io_size;
-	imglen = img->size;
 	snprintf(mtd_device, sizeof(mtd_device), "/dev/mtd%d", mtdnum);
 
-	if ((imglen / pagelen) * mtd->min_io_size > mtd->size - mtdoffset) {
+	if ((img->size / mtd->min_io_size) * mtd->min_io_size > mtd->size - n.mtdoffset) {
 		ERROR("Image %s does not fit into mtd%d", img->fname, mtdnum);
 		return -EIO;
 	}
 
-	/* Flashing to NAND is currently not streamable */
-	if (img->install_directly) {
-		ERROR("Raw NAND not streamable");
-		return -EINVAL;
+	if ((n.fd = open(mtd_device, O_RDWR)) < 0) {
+		ERROR( "%s: %s: %s", __func__, mtd_device, strerror(errno));
+		return -ENODEV;
 	}
 
-	if(flash_erase_sector(mtdnum, img->seek, img->size)) {
-		ERROR("I cannot erasing %s",
-			img->device);
-		return -1;
+	n.buf = malloc(mtd->eb_size);
+	if (verify)
+		n.verify = malloc(mtd->eb_size);
+	if (!n.buf || (verify && !n.verify)) {
+		ERROR("No memory for a buffer of %d bytes", mtd->eb_size);
+		free(n.buf);
+		close(n.fd);
+		return -ENOMEM;
 	}
 
-	if ((fd = open(mtd_device, O_RDWR)) < 0) {
-		ERROR( "%s: %s: %s", __func__, mtd_device, strerror(errno));
-		return -ENODEV;
+	ret = copyimage(&n, img, nand_write);
+	if (!ret && n.len)
+		ret = nand_flush_block(&n, true);
+	if (!ret)
+		flash_report_skipped(mtdnum, img, n.pages, n.skipped);
+
+	free(n.verify);
+	free(n.buf);
+	close(n.fd);
+
+	if (ret) {
+		ERROR("Installing image %s into mtd%d failed",
+			img->fname,
+			mtdnum);
+		return -1;
 	}
 
-	filebuf_max = mtd->eb_size / mtd->min_io_size * pagelen;
-	filebuf = calloc(1, filebuf_max);
-	erase_buffer(filebuf, filebuf_max);
+	return 0;
+}
 
-	/*
-	 * Get data from input and write to the device while there is
-	 * still input to read and we are still within the device
-	 * bounds. Note that in the case of standard input, the input
-	 * length is simply a quasi-boolean flag whose values are page
-	 * length or zero.
-	 */
-	while ((imglen > 0 || writebuf < filebuf + filebuf_len)
-		&& mtdoffset < mtd->size) {
-		/*
-		 * New eraseblock, check for bad block(s)
-		 * Stay in the loop to be sure that, if mtdoffset changes because
-		 * of a bad block, the next block that will be written to
-		 * is also checked. Thus, we avoid errors if the block(s) after the
-		 * skipped block(s) is also bad
-		 */
-		while (blockstart != (mtdoffset & (~mtd->eb_size + 1))) {
-			blockstart = mtdoffset & (~mtd->eb_size + 1);
-			offs = blockstart;
-
-			/*
-			 * if writebuf == filebuf, we are rewinding so we must
-			 * not reset the buffer but just replay it
-			 */
-			if (writebuf != filebuf) {
-				erase_buffer(filebuf, filebuf_len);
-				filebuf_len = 0;
-				writebuf = filebuf;
-			}
+/*
+ * Granularity used to skip empty data on NOR, the size of the
+ * page program buffer of most SPI-NOR and CFI parts.
+ */
+#define NOR_PAGE_SIZE	256
 
-			baderaseblock = false;
+/*
+ * With CONFIG_CFI_NOR_INTERLEAVED, the eraser thread walks the sectors
+ * of the target region in order and publishes how far it got; the
+ * writer waits only for the sectors it is about to program, so erasing
+ * overlaps with fetching, decompressing and programming the image.
+ * Otherwise, the region is erased before the copy starts.
+ */
+struct nor_out {
+	int fd;		/* must be first, see copyimage() */
+	int mtdnum;
+	struct flash_description *flash;
+	struct mtd_dev_info *mtd;
+	unsigned long long offset;
+	unsigned int eb_start;
+	unsigned int eb_end;
+	unsigned int erased;	/* sectors below this are ready */
+	int error;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long written;
+	unsigned long long skipped;	/* empty bytes, not programmed */
+	bool verify;
+	unsigned char *readback;
+	size_t size;
+};
+
+#if defined(CONFIG_CFI_NOR_INTERLEAVED)
+
+static int nor_erase_block(struct nor_out *n, unsigned int eb, unsigned char *buf)
+{
+	struct mtd_dev_info *mtd = n->mtd;
 
-			do {
-				ret = mtd_is_bad(mtd, fd, offs / mtd->eb_size);
-				if (ret < 0) {
-					ERROR("mtd%d: MTD get bad block failed", mtdnum);
-					goto closeall;
-				} else if (ret == 1) {
-					baderaseblock = true;
-				}
+	if (mtd_is_locked(mtd, n->fd, eb) > 0) {
+		if (mtd_unlock(mtd, n->fd, eb) != 0 && errno != EOPNOTSUPP)
+			TRACE("mtd%d: MTD unlock failure", n->mtdnum);
+	}
 
-				if (baderaseblock) {
-					mtdoffset = blockstart + mtd->eb_size;
+	if (mtd_read(mtd, n->fd, eb, 0, buf, mtd->eb_size) != 0) {
+		ERROR("mtd%d: MTD Read failure", n->mtdnum);
+		return -EIO;
+	}
 
-					if (mtdoffset > mtd->size) {
-						ERROR("too many bad blocks, cannot complete request");
-						goto closeall;
-					}
-				}
+	/* erasing a NOR sector is slow, skip it if already blank */
+	if (buffer_check_pattern(buf, mtd->eb_size, 0xff))
+		return 0;
 
-				offs +=  mtd->eb_size;
-			} while (offs < blockstart + mtd->eb_size);
-		}
+	if (mtd_erase(n->flash->libmtd, mtd, n->fd, eb) != 0) {
+		ERROR("mtd%d: MTD Erase failure", n->mtdnum);
+		return -EIO;
+	}
 
-		/* Read more data from the input if there isn't enough in the buffer */
-		if (writebuf + mtd->min_io_size > filebuf + filebuf_len) {
-			size_t readlen = mtd->min_io_size;
-			size_t alreadyread = (filebuf + filebuf_len) - writebuf;
-			size_t tinycnt = alreadyread;
-			ssize_t cnt = 0;
-
-			while (tinycnt < readlen) {
-				cnt = read(ifd, writebuf + tinycnt, readlen - tinycnt);
-				if (cnt == 0) { /* EOF */
-					break;
-				} else if (cnt < 0) {
-					ERROR("File I/O error on input");
-					goto closeall;
-				}
-				tinycnt += cnt;
-			}
+	return 0;
+}
 
-			/* No padding needed - we are done */
-			if (tinycnt == 0) {
-				imglen = 0;
-				break;
-			}
+static void *nor_eraser(void *data)
+{
+	struct nor_out *n = (struct nor_out *)data;
+	unsigned char *buf;
+	unsigned int eb;
+	int ret = 0;
+
+	buf = malloc(n->mtd->eb_size);
+	if (!buf) {
+		ERROR("No memory for temporary buffer of %d bytes",
+			n->mtd->eb_size);
+		ret = -ENOMEM;
+	}
 
-			/* Padding */
-			if (tinycnt < readlen) {
-				erase_buffer(writebuf + tinycnt, readlen - tinycnt);
-			}
+	for (eb = n->eb_start; !ret && eb < n->eb_end; eb++) {
+		pthread_mutex_lock(&n->lock);
+		if (n->stop) {
+			pthread_mutex_unlock(&n->lock);
+			break;
+		}
+		pthread_mutex_unlock(&n->lock);
 
-			filebuf_len += readlen - alreadyread;
+		ret = nor_erase_block(n, eb, buf);
 
-			imglen -= tinycnt - alreadyread;
+		pthread_mutex_lock(&n->lock);
+		if (!ret)
+			n->erased = eb + 1;
+		pthread_cond_signal(&n->cond);
+		pthread_mutex_unlock(&n->lock);
+	}
 
-		}
+	pthread_mutex_lock(&n->lock);
+	n->error = ret;
+	pthread_cond_signal(&n->cond);
+	pthread_mutex_unlock(&n->lock);
 
-		ret =0;
-		if (!buffer_check_pattern(writebuf, mtd->min_io_size, 0xff)) {
-			/* Write out data */
-			ret = mtd_write(flash->libmtd, mtd, fd, mtdoffset / mtd->eb_size,
-					mtdoffset % mtd->eb_size,
-					writebuf,
-					mtd->min_io_size,
-					NULL,
-					0,
-					MTD_OPS_PLACE_OOB);
-		}
-		if (ret) {
-			long long i;
-			if (errno != EIO) {
-				ERROR("mtd%d: MTD write failure", mtdnum);
-				goto closeall;
-			}
+	free(buf);
 
-			/* Must rewind to blockstart if we can */
-			writebuf = filebuf;
+	return NULL;
+}
+#endif
 
-			for (i = blockstart; i < blockstart + mtd->eb_size; i += mtd->eb_size) {
-				if (mtd_erase(flash->libmtd, mtd, fd, i / mtd->eb_size)) {
-					int errno_tmp = errno;
-					TRACE("mtd%d: MTD Erase failure", mtdnum);
-					if (errno_tmp != EIO)
-						goto closeall;
-				}
-			}
+static int nor_pwrite(struct nor_out *n, const char *p, size_t len)
+{
+	ssize_t cnt;
+
+	while (len > 0) {
+		cnt = pwrite(n->fd, p, len, n->offset);
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("mtd%d: write failure: %s", n->mtdnum, strerror(errno));
+			return -1;
+		}
+		p += cnt;
+		len -= cnt;
+		n->offset += cnt;
+	}
 
-			TRACE("Marking block at %08llx bad",
-					mtdoffset & (~mtd->eb_size + 1));
-			if (mtd_mark_bad(mtd, fd, mtdoffset / mtd->eb_size)) {
-				ERROR("mtd%d: MTD Mark bad block failure", mtdnum);
-				goto closeall;
-			}
-			mtdoffset = blockstart + mtd->eb_size;
+	return 0;
+}
 
-			continue;
+/*
+ * In "verify" mode, what was just programmed is read back from the
+ * flash (reads of a MTD device do not go through the page cache)
+ */
+static int nor_verify(struct nor_out *n, const unsigned char *p, size_t len)
+{
+	unsigned long long offset = n->offset - len;
+	ssize_t cnt;
+	size_t done;
+
+	if (len > n->size) {
+		unsigned char *tmp = realloc(n->readback, len);
+		if (!tmp) {
+			ERROR("No memory for a buffer of %zu bytes", len);
+			return -1;
 		}
+		n->readback = tmp;
+		n->size = len;
+	}
 
-		/*
-		 * this handler does not use copyfile()
-		 * and must update itself the progress bar
-		 */
-		swupdate_progress_update((img->size - imglen) * 100 / img->size);
+	for (done = 0; done < len; done += cnt) {
+		cnt = pread(n->fd, n->readback + done, len - done, offset + done);
+		if (cnt < 0 && errno == EINTR) {
+			cnt = 0;
+			continue;
+		}
+		if (cnt <= 0) {
+			ERROR("mtd%d: read back failure at 0x%llx", n->mtdnum,
+			      offset + done);
+			return -1;
+		}
+	}
 
-		mtdoffset += mtd->min_io_size;
-		writebuf += pagelen;
+	if (memcmp(n->readback, p, len)) {
+		ERROR("mtd%d: verification failed, %zu bytes at 0x%llx differ",
+		      n->mtdnum, len, offset);
+		return -1;
 	}
-	failed = false;
 
-closeall:
-	free(filebuf);
-	close(fd);
+	return 0;
+}
 
-	if (failed) {
-		ERROR("Installing image %s into mtd%d failed",
-			img->fname,
-			mtdnum);
+static int nor_write(void *out, const void *buf, size_t len)
+{
+	struct nor_out *n = (struct nor_out *)out;
+	unsigned long long end = n->offset + len;
+	unsigned int eb = (end + n->mtd->eb_size - 1) / n->mtd->eb_size;
+	const unsigned char *p = buf;
+	size_t piece, run;
+
+	if (eb > n->eb_end) {
+		ERROR("Image does not fit into mtd%d", n->mtdnum);
 		return -1;
 	}
 
+	pthread_mutex_lock(&n->lock);
+	while (n->erased < eb && !n->error)
+		pthread_cond_wait(&n->cond, &n->lock);
+	pthread_mutex_unlock(&n->lock);
+	if (n->erased < eb)
+		return -1;
+
+	/*
+	 * The target is erased: pages that are empty in the image are
+	 * skipped, consecutive pages with data are written at once.
+	 */
+	n->written += len;
+	while (len > 0) {
+		piece = min(len, NOR_PAGE_SIZE - (size_t)(n->offset % NOR_PAGE_SIZE));
+		if (buffer_check_pattern(p, piece, 0xff)) {
+			n->offset += piece;
+			n->skipped += piece;
+			p += piece;
+			len -= piece;
+			continue;
+		}
+		for (run = piece; run < len; run += piece) {
+			piece = min(len - run, (size_t)NOR_PAGE_SIZE);
+			if (buffer_check_pattern(p + run, piece, 0xff))
+				break;
+		}
+		if (nor_pwrite(n, (const char *)p, run))
+			return -1;
+		if (n->verify && nor_verify(n, p, run))
+			return -1;
+		p += run;
+		len -= run;
+	}
+
 	return 0;
 }
 
+static int nor_copyimage(int fd, int mtdnum, struct img_type *img, long long size)
+{
+	struct flash_description *flash = get_flash_info();
+	struct nor_out n = {
+		.fd = fd,
+		.mtdnum = mtdnum,
+		.flash = flash,
+		.mtd = &flash->mtd_info[mtdnum].mtd,
+		.offset = img->seek,
+		.verify = strtobool(dict_get_value(&img->properties, "verify")),
+	};
+#if defined(CONFIG_CFI_NOR_INTERLEAVED)
+	pthread_t eraser;
+#endif
+	int ret;
+
+	if (!n.mtd->eb_size)
+		return -EINVAL;
+	n.eb_start = img->seek / n.mtd->eb_size;
+	n.eb_end = n.mtd->size / n.mtd->eb_size;
+	if (size)
+		n.eb_end = min(n.eb_end, (unsigned int)((img->seek + size +
+				n.mtd->eb_size - 1) / n.mtd->eb_size));
+
+	pthread_mutex_init(&n.lock, NULL);
+	pthread_cond_init(&n.cond, NULL);
+
+#if defined(CONFIG_CFI_NOR_INTERLEAVED)
+	n.erased = n.eb_start;
+	ret = pthread_create(&eraser, NULL, nor_eraser, &n);
+	if (ret) {
+		ERROR("Code from pthread_create() is %d", ret);
+		ret = -EFAULT;
+	} else {
+		ret = copyimage(&n, img, nor_write);
+
+		pthread_mutex_lock(&n.lock);
+		n.stop = true;
+		pthread_mutex_unlock(&n.lock);
+		pthread_join(eraser, NULL);
+
+		if (!ret && n.error)
+			ret = n.error;
+	}
+#else
+	n.erased = n.eb_end;
+	ret = copyimage(&n, img, nor_write);
+#endif
+	if (!ret)
+		flash_report_skipped(n.mtdnum, img,
+				     (n.written + NOR_PAGE_SIZE - 1) / NOR_PAGE_SIZE,
+				     n.skipped / NOR_PAGE_SIZE);
+
+	free(n.readback);
+	pthread_cond_destroy(&n.cond);
+	pthread_mutex_destroy(&n.lock);
+
+	return ret;
+}
+
 static int flash_write_nor(int mtdnum, struct img_type *img)
 {
 	int fdout;
@@ -313,11 +640,13 @@ static int flash_write_nor(int mtdnum, struct img_type *img)
 		ERROR("Failed to determine output size, bailing out.");
 		return -1;
 	}
+#if !defined(CONFIG_CFI_NOR_INTERLEAVED)
 	if (flash_erase_sector(mtdnum, img->seek, size)) {
 		ERROR("Failed to erase sectors on /dev/mtd%d (start: %llu, size: %lld)",
 			mtdnum, img->seek, size);
 		return -1;
 	}
+#endif
 
 	snprintf(mtd_device, sizeof(mtd_device), "/dev/mtd%d", mtdnum);
 	if ((fdout = open(mtd_device, O_RDWR)) < 0) {
@@ -325,7 +654,7 @@ static int flash_write_nor(int mtdnum, struct img_type *img)
 		return -1;
 	}
 
-	ret = copyimage(&fdout, img, NULL);
+	ret = nor_copyimage(fdout, mtdnum, img, size);
 	close(fdout);
 
 	/* tell 'nbytes == 0' (EOF) from 'nbytes < 0' (read error) */
@@ -351,13 +680,13 @@ static int install_flash_image(struct img_type *img,
 {
 	int mtdnum;
 
-	if (strlen(img->mtdname))
+	if (img->mtdname)
 		mtdnum = get_mtd_from_name(img->mtdname);
 	else
 		mtdnum = get_mtd_from_device(img->device);
-	if (mtdnum < 0) {
+	if (mtdnum < 0 || !mtd_get_device(mtdnum)) {
 		ERROR("Wrong MTD device in description: %s",
-			strlen(img->mtdname) ? img->mtdname : img->device);
+			img->mtdname ? img->mtdname : img->device);
 		return -1;
 	}
 
@@ -376,5 +705,6 @@ __attribute__((constructor))
 void flash_handler(void)
 {
 	register_handler("flash", install_flash_image,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+				IMAGE_HANDLER | FILE_HANDLER | STREAM_HANDLER |
+				PARALLEL_HANDLER | SEEKABLE_HANDLER, NULL);
 }
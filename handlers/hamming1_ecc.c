@@ -0,0 +1,86 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * Table driven version of the Hamming code taken from writeloader
+ * (Texas Instrument's GenECC): the column parities are computed on
+ * the XOR of all bytes, folded a word at a time, and the row parities
+ * on the XOR of the offsets of the bytes with odd parity.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "hamming1_ecc.h"
+
+#define EVEN_HALF   0x0f
+#define ODD_HALF    0xf0
+#define EVEN_FOURTH 0x33
+#define ODD_FOURTH  0xcc
+#define EVEN_EIGHTH 0x55
+#define ODD_EIGHTH  0xaa
+
+#define P2(n)	n, n ^ 1, n ^ 1, n
+#define P4(n)	P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n)	P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+
+/* parity of each byte value */
+static const unsigned char parity8[256] = {
+	P6(0), P6(1), P6(1), P6(0)
+};
+
+static unsigned char column_parity(const unsigned char *buf, unsigned int len)
+{
+	uint64_t acc = 0, word;
+	unsigned char result;
+	unsigned int i;
+
+	for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, buf + i, sizeof(word));
+		acc ^= word;
+	}
+	acc ^= acc >> 32;
+	acc ^= acc >> 16;
+	acc ^= acc >> 8;
+	result = (unsigned char)acc;
+	for (; i < len; i++)
+		result ^= buf[i];
+
+	return result;
+}
+
+unsigned int hamming1_calculate_ecc(const unsigned char *buf,
+				    unsigned int sector_size)
+{
+	unsigned int odd_result, even_result;
+	unsigned int odd_rows = 0, total;
+	unsigned char columns;
+	unsigned int i, nbits;
+
+	columns = column_parity(buf, sector_size);
+
+	even_result = (parity8[columns & EVEN_HALF] << 2) |
+		      (parity8[columns & EVEN_FOURTH] << 1) |
+		      parity8[columns & EVEN_EIGHTH];
+	odd_result = (parity8[columns & ODD_HALF] << 2) |
+		     (parity8[columns & ODD_FOURTH] << 1) |
+		     parity8[columns & ODD_EIGHTH];
+
+	/*
+	 * Bit n of odd_rows is the parity of the bytes whose offset has
+	 * bit n set, the even row parity is the rest of the total one
+	 */
+	for (i = 0; i < sector_size; i++)
+		odd_rows ^= i & -(unsigned int)parity8[buf[i]];
+	total = parity8[columns];
+
+	for (nbits = 0; (1U << nbits) < sector_size; nbits++)
+		;
+	for (i = 0; i < nbits; i++) {
+		odd_result |= ((odd_rows >> i) & 1) << (3 + i);
+		even_result |= (((odd_rows >> i) & 1) ^ total) << (3 + i);
+	}
+
+	return (odd_result << 16) | even_result;
+}
@@ -0,0 +1,16 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#pragma once
+
+/*
+ * 1-bit Hamming ECC of a NAND sector as required by the TI ROM boot,
+ * odd parities in the upper 16 bits, even parities in the lower ones.
+ * sector_size must be a power of two.
+ */
+unsigned int hamming1_calculate_ecc(const unsigned char *buf,
+				    unsigned int sector_size);
@@ -32,7 +32,7 @@ static int start_lua_script(struct img_type *img, void *data)
 	struct script_handler_data *script_data;
 
 	const char* tmp = get_tmpdirscripts();
-	char filename[MAX_IMAGE_FNAME + strlen(tmp) + 2 + strlen(img->type_data)];
+	char filename[MAX_IMAGE_FNAME + strlen(tmp) + 2 + strlen(IMG_STRING(img->type_data))];
 
 	if (!data)
 		return -1;
@@ -55,7 +55,7 @@ static int start_lua_script(struct img_type *img, void *data)
 		"%s%s", tmp, img->fname);
 	TRACE("Calling Lua %s", filename);
 
-	ret = run_lua_script(filename, fnname, img->type_data);
+	ret = run_lua_script(filename, fnname, IMG_STRING(img->type_data));
 
 	return ret;
 
@@ -26,7 +26,12 @@
 
 #include "swupdate.h"
 #include "handler.h"
+#include "chained_handler.h"
 #include "util.h"
+#include "blkdev_cache.h"
+#ifdef CONFIG_RAW_VERITY
+#include "verity.h"
+#endif
 
 void raw_image_handler(void);
 void raw_file_handler(void);
@@ -40,7 +45,7 @@ void raw_file_handler(void);
  * - A corresponding ro flag e.g. /sys/class/block/mmcblk0boot0/force_ro is available
  * - The force_ro flag can be opened writeable
  */
-static int blkprotect(struct img_type *img, bool on)
+static int blkprotect(const char *device, bool on)
 {
 	char abs_path[PATH_MAX];
 	const char c_sys_path[] = "/sys/class/block/%s/force_ro";
@@ -54,12 +59,12 @@ static int blkprotect(struct img_type *img, bool on)
 	struct stat sb;
 	char current_prot;
 
-	if (strncmp("/dev/", img->device, 5) != 0) {
+	if (strncmp("/dev/", device, 5) != 0) {
 		return ret;
 	}
 
-	if (stat(img->device, &sb) == -1) {
-		TRACE("stat for device %s failed: %s", img->device, strerror(errno));
+	if (stat(device, &sb) == -1) {
+		TRACE("stat for device %s failed: %s", device, strerror(errno));
 		return ret;
 	}
 	if(!S_ISBLK(sb.st_mode)) {
@@ -67,7 +72,7 @@ static int blkprotect(struct img_type *img, bool on)
 	}
 
 	/* If given, traverse symlink and convert to absolute path */
-	if (realpath(img->device, abs_path) == NULL) {
+	if (realpath(device, abs_path) == NULL) {
 		ret = -errno;
 		goto blkprotect_out;
 	}
@@ -95,7 +100,7 @@ static int blkprotect(struct img_type *img, bool on)
 		if (requested_prot != current_prot) {
 			ret_ss = write(fd_force_ro, &requested_prot, 1);
 			if(ret_ss == 1) {
-				TRACE("Device %s: changed force_ro to %c", img->device, requested_prot);
+				TRACE("Device %s: changed force_ro to %c", device, requested_prot);
 				ret = 1;
 			} else {
 				ret = -EIO;
@@ -105,7 +110,7 @@ static int blkprotect(struct img_type *img, bool on)
 		ret = -EIO;
 	}
 	if (ret < 0) {
-		TRACE("Device %s: changing force_ro mode failed!", img->device);
+		TRACE("Device %s: changing force_ro mode failed!", device);
 	}
 
 	close(fd_force_ro);
@@ -116,37 +121,993 @@ blkprotect_out:
 	return ret;
 }
 
+#ifdef O_DIRECT
+/*
+ * With O_DIRECT, both the buffer address and the length of each write
+ * must be aligned to the logical block size of the device. The chunks
+ * coming from the copy pipeline have an arbitrary length, so they are
+ * collected into an aligned bounce buffer first.
+ */
+struct raw_direct_out {
+	int fdout;	/* must be first, copyimage() seeks on it */
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	size_t align;
+};
+
+static int raw_direct_write(void *out, const void *buf, size_t len)
+{
+	struct raw_direct_out *d = (struct raw_direct_out *)out;
+	size_t n;
+
+	while (len) {
+		n = min(len, d->size - d->len);
+		memcpy(d->buf + d->len, buf, n);
+		d->len += n;
+		buf += n;
+		len -= n;
+		if (d->len == d->size) {
+			if (copy_write(&d->fdout, d->buf, d->len) < 0)
+				return -1;
+			d->len = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int raw_direct_flush(struct raw_direct_out *d)
+{
+	size_t aligned = d->len - (d->len % d->align);
+	int flags;
+
+	if (aligned && copy_write(&d->fdout, d->buf, aligned) < 0)
+		return -1;
+
+	if (d->len > aligned) {
+		/* The unaligned tail is written through the page cache */
+		flags = fcntl(d->fdout, F_GETFL);
+		if (flags < 0 || fcntl(d->fdout, F_SETFL, flags & ~O_DIRECT) < 0) {
+			ERROR("Cannot disable O_DIRECT on %d: %s", d->fdout, strerror(errno));
+			return -1;
+		}
+		if (copy_write(&d->fdout, d->buf + aligned, d->len - aligned) < 0)
+			return -1;
+	}
+	d->len = 0;
+
+	return 0;
+}
+
+static int raw_direct_copyimage(int fdout, struct img_type *img)
+{
+	struct raw_direct_out d = {
+		.fdout = fdout,
+		.len = 0,
+		.align = 512
+	};
+	const char *bufsize = dict_get_value(&img->properties, "copy-buffer-size");
+	int ret;
+#ifdef BLKSSZGET
+	int blksz;
+
+	if (!ioctl(fdout, BLKSSZGET, &blksz) && blksz > 0)
+		d.align = blksz;
+#endif
+
+	if (img->seek % d.align) {
+		ERROR("offset %llu is not aligned to %zu bytes, direct-io not possible",
+		      img->seek, d.align);
+		return -EINVAL;
+	}
+
+	d.size = copy_buffer_size(fdout, bufsize ? ustrtoull(bufsize, NULL, 0) : 0);
+	d.size = SWUPDATE_ALIGN(d.size, d.align);
+	if (posix_memalign((void **)&d.buf, max(d.align, (size_t)getpagesize()), d.size)) {
+		ERROR("OOM allocating %zu bytes for direct-io", d.size);
+		return -ENOMEM;
+	}
+
+	ret = copyimage(&d, img, raw_direct_write);
+	if (!ret)
+		ret = raw_direct_flush(&d);
+	if (!ret && fdatasync(fdout)) {
+		ERROR("Error syncing %s: %s", img->device, strerror(errno));
+		ret = -EIO;
+	}
+
+	free(d.buf);
+	return ret;
+}
+#endif
+
+/*
+ * In "skip-unchanged-blocks" mode, the destination is read back
+ * block by block and compared with the incoming data: only the
+ * blocks that differ are written, reducing flash wear when the
+ * device already contains a (mostly) identical image.
+ */
+#define RAW_DIFF_BLOCK_SIZE	4096
+
+struct raw_diff_out {
+	int fdout;	/* must be first, copyimage() seeks on it */
+	off_t offset;
+	uint8_t *readback;
+	size_t size;
+	unsigned long long written;
+	unsigned long long unchanged;
+};
+
+static int raw_pwrite(int fd, const uint8_t *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("cannot write %zu bytes at %lld: %s", len,
+			      (long long)offset, strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			ERROR("cannot write %zu bytes at %lld", len, (long long)offset);
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static ssize_t raw_pread(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+	size_t count = 0;
+	ssize_t ret;
+
+	while (count < len) {
+		ret = pread(fd, buf + count, len - count, offset + count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		count += ret;
+	}
+
+	return count;
+}
+
+static int raw_diff_write(void *out, const void *buf, size_t len)
+{
+	struct raw_diff_out *d = (struct raw_diff_out *)out;
+	const uint8_t *data = buf;
+	size_t pos, blk, run_start = 0;
+	bool in_run = false;
+	ssize_t nread;
+
+	if (len > d->size) {
+		uint8_t *tmp = realloc(d->readback, len);
+		if (!tmp) {
+			ERROR("OOM reading back %zu bytes", len);
+			return -1;
+		}
+		d->readback = tmp;
+		d->size = len;
+	}
+
+	nread = raw_pread(d->fdout, d->readback, len, d->offset);
+	if (nread < 0) {
+		ERROR("cannot read back %zu bytes at %lld: %s", len,
+		      (long long)d->offset, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Consecutive blocks that differ are coalesced into a single write
+	 */
+	for (pos = 0; pos < len; pos += blk) {
+		blk = min(len - pos, (size_t)RAW_DIFF_BLOCK_SIZE);
+		if (pos + blk <= (size_t)nread &&
+		    !memcmp(data + pos, d->readback + pos, blk)) {
+			d->unchanged += blk;
+			if (in_run) {
+				if (raw_pwrite(d->fdout, data + run_start,
+					       pos - run_start, d->offset + run_start) < 0)
+					return -1;
+				in_run = false;
+			}
+			continue;
+		}
+		d->written += blk;
+		if (!in_run) {
+			run_start = pos;
+			in_run = true;
+		}
+	}
+	if (in_run && raw_pwrite(d->fdout, data + run_start, len - run_start,
+				 d->offset + run_start) < 0)
+		return -1;
+
+	d->offset += len;
+
+	return 0;
+}
+
+static int raw_diff_copyimage(int fdout, struct img_type *img, off_t *end)
+{
+	struct raw_diff_out d = {
+		.fdout = fdout,
+		.offset = img->seek,
+		.readback = NULL,
+		.size = 0,
+		.written = 0,
+		.unchanged = 0
+	};
+	int ret;
+
+	ret = copyimage(&d, img, raw_diff_write);
+	free(d.readback);
+	*end = d.offset;
+
+	if (!ret)
+		INFO("%s: %llu bytes written, %llu bytes unchanged",
+		     img->device, d.written, d.unchanged);
+
+	return ret;
+}
+
+/*
+ * In "verify" mode, each chunk is read back from the device and
+ * compared with a hash of the data taken when it was written. The
+ * writeback of a chunk is started as soon as it is written and the
+ * chunk is verified RAW_VERIFY_LAG chunks later, so that reading back
+ * overlaps with writing the next chunks. The range is dropped from
+ * the page cache before it is read back.
+ */
+#define RAW_VERIFY_LAG	4
+
+struct raw_verify_chunk {
+	off_t offset;
+	size_t len;
+	uint64_t hash;
+};
+
+struct raw_verify_out {
+	int fdout;	/* must be first, copyimage() seeks on it */
+	const char *device;
+	off_t offset;
+	struct raw_verify_chunk pending[RAW_VERIFY_LAG];
+	unsigned int first;
+	unsigned int count;
+	uint8_t *readback;
+	size_t size;
+	unsigned long long verified;
+};
+
+/* FNV-1a on 64 bit words, enough to detect corrupted data */
+static uint64_t raw_verify_hash(const uint8_t *buf, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL, w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, buf + i, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	for (; i < len; i++)
+		h = (h ^ buf[i]) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static int raw_verify_chunk(struct raw_verify_out *v, const struct raw_verify_chunk *c)
+{
+	ssize_t nread;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+	if (sync_file_range(v->fdout, c->offset, c->len, SYNC_FILE_RANGE_WAIT_BEFORE |
+			    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) &&
+	    fdatasync(v->fdout)) {
+#else
+	if (fdatasync(v->fdout)) {
+#endif
+		ERROR("Error syncing %s: %s", v->device, strerror(errno));
+		return -EIO;
+	}
+	posix_fadvise(v->fdout, c->offset, c->len, POSIX_FADV_DONTNEED);
+
+	if (c->len > v->size) {
+		uint8_t *tmp = realloc(v->readback, c->len);
+		if (!tmp) {
+			ERROR("OOM reading back %zu bytes", c->len);
+			return -ENOMEM;
+		}
+		v->readback = tmp;
+		v->size = c->len;
+	}
+
+	nread = raw_pread(v->fdout, v->readback, c->len, c->offset);
+	if (nread != (ssize_t)c->len) {
+		ERROR("cannot read back %zu bytes at %lld: %s", c->len,
+		      (long long)c->offset, nread < 0 ? strerror(errno) : "short read");
+		return -EIO;
+	}
+	if (raw_verify_hash(v->readback, c->len) != c->hash) {
+		ERROR("%s: verification failed, %zu bytes at %lld differ",
+		      v->device, c->len, (long long)c->offset);
+		return -EIO;
+	}
+	v->verified += c->len;
+
+	return 0;
+}
+
+static int raw_verify_write(void *out, const void *buf, size_t len)
+{
+	struct raw_verify_out *v = (struct raw_verify_out *)out;
+	struct raw_verify_chunk *c;
+
+	if (raw_pwrite(v->fdout, buf, len, v->offset) < 0)
+		return -1;
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(v->fdout, v->offset, len, SYNC_FILE_RANGE_WRITE);
+#endif
+
+	if (v->count == RAW_VERIFY_LAG) {
+		if (raw_verify_chunk(v, &v->pending[v->first]))
+			return -1;
+		v->first = (v->first + 1) % RAW_VERIFY_LAG;
+		v->count--;
+	}
+	c = &v->pending[(v->first + v->count++) % RAW_VERIFY_LAG];
+	c->offset = v->offset;
+	c->len = len;
+	c->hash = raw_verify_hash(buf, len);
+	v->offset += len;
+
+	return 0;
+}
+
+static int raw_verify_copyimage(int fdout, struct img_type *img, off_t *end)
+{
+	struct raw_verify_out v = {
+		.fdout = fdout,
+		.device = img->device,
+		.offset = img->seek,
+	};
+	int ret;
+
+	ret = copyimage(&v, img, raw_verify_write);
+	while (!ret && v.count) {
+		ret = raw_verify_chunk(&v, &v.pending[v.first]);
+		v.first = (v.first + 1) % RAW_VERIFY_LAG;
+		v.count--;
+	}
+	free(v.readback);
+	*end = v.offset;
+
+	if (!ret)
+		INFO("%s: %llu bytes written and verified", img->device, v.verified);
+
+	return ret;
+}
+
+/*
+ * Android sparse images describe a block device as a list of chunks:
+ * raw data, a 32 bit fill pattern or "don't care" blocks. Only the
+ * raw and fill chunks are written, the device is left untouched in
+ * the "don't care" regions. The image is parsed while it is streamed.
+ */
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_FILE_HDR_SIZE	28
+#define SPARSE_CHUNK_HDR_SIZE	12
+#define SPARSE_CHUNK_RAW	0xcac1
+#define SPARSE_CHUNK_FILL	0xcac2
+#define SPARSE_CHUNK_DONT_CARE	0xcac3
+#define SPARSE_CHUNK_CRC32	0xcac4
+#define SPARSE_FILL_BUF_SIZE	(64 * 1024)
+
+enum sparse_state {
+	SPARSE_FILE_HDR,
+	SPARSE_CHUNK_HDR,
+	SPARSE_RAW,
+	SPARSE_FILL
+};
+
+struct raw_sparse_out {
+	int fdout;	/* must be first, copyimage() seeks on it */
+	enum sparse_state state;
+	uint8_t hdr[SPARSE_FILE_HDR_SIZE];
+	size_t hdrlen;
+	size_t want;
+	unsigned long long skip;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint16_t chunk_hdr_sz;
+	uint32_t chunks;
+	unsigned long long blocks;
+	unsigned long long remaining;
+	off_t offset;
+	uint8_t *fill;
+	unsigned long long written;
+	unsigned long long skipped;
+};
+
+static inline uint16_t sparse_get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t sparse_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int sparse_file_header(struct raw_sparse_out *s)
+{
+	uint16_t file_hdr_sz;
+
+	if (sparse_get32(s->hdr) != SPARSE_HEADER_MAGIC) {
+		ERROR("Image is not in sparse format");
+		return -1;
+	}
+	if (sparse_get16(s->hdr + 4) != 1) {
+		ERROR("Unsupported sparse format version %u.%u",
+		      sparse_get16(s->hdr + 4), sparse_get16(s->hdr + 6));
+		return -1;
+	}
+	file_hdr_sz = sparse_get16(s->hdr + 8);
+	s->chunk_hdr_sz = sparse_get16(s->hdr + 10);
+	s->blk_sz = sparse_get32(s->hdr + 12);
+	s->total_blks = sparse_get32(s->hdr + 16);
+	s->total_chunks = sparse_get32(s->hdr + 20);
+
+	if (file_hdr_sz < SPARSE_FILE_HDR_SIZE ||
+	    s->chunk_hdr_sz < SPARSE_CHUNK_HDR_SIZE ||
+	    !s->blk_sz || s->blk_sz % 4) {
+		ERROR("Corrupted sparse header");
+		return -1;
+	}
+	TRACE("Sparse image: %u blocks of %u bytes in %u chunks",
+	      s->total_blks, s->blk_sz, s->total_chunks);
+
+	s->skip = file_hdr_sz - SPARSE_FILE_HDR_SIZE;
+	s->state = SPARSE_CHUNK_HDR;
+	s->want = SPARSE_CHUNK_HDR_SIZE;
+
+	return 0;
+}
+
+static int sparse_chunk_header(struct raw_sparse_out *s)
+{
+	uint16_t type = sparse_get16(s->hdr);
+	uint32_t chunk_sz = sparse_get32(s->hdr + 4);
+	uint32_t total_sz = sparse_get32(s->hdr + 8);
+	unsigned long long size = (unsigned long long)chunk_sz * s->blk_sz;
+	unsigned long long payload;
+
+	if (++s->chunks > s->total_chunks) {
+		ERROR("Sparse image has more than %u chunks", s->total_chunks);
+		return -1;
+	}
+	if (total_sz < s->chunk_hdr_sz) {
+		ERROR("Corrupted sparse chunk %u", s->chunks);
+		return -1;
+	}
+	payload = total_sz - s->chunk_hdr_sz;
+	s->skip = s->chunk_hdr_sz - SPARSE_CHUNK_HDR_SIZE;
+
+	if (type != SPARSE_CHUNK_CRC32) {
+		s->blocks += chunk_sz;
+		if (s->blocks > s->total_blks) {
+			ERROR("Sparse image has more than %u blocks", s->total_blks);
+			return -1;
+		}
+	}
+
+	switch (type) {
+	case SPARSE_CHUNK_RAW:
+		if (payload != size)
+			break;
+		s->remaining = size;
+		s->state = size ? SPARSE_RAW : SPARSE_CHUNK_HDR;
+		return 0;
+	case SPARSE_CHUNK_FILL:
+		if (payload != sizeof(uint32_t))
+			break;
+		s->remaining = size;
+		s->state = SPARSE_FILL;
+		s->want = sizeof(uint32_t);
+		return 0;
+	case SPARSE_CHUNK_DONT_CARE:
+		if (payload)
+			break;
+		s->offset += size;
+		s->skipped += size;
+		return 0;
+	case SPARSE_CHUNK_CRC32:
+		/* not verified, the image has its own sha256 */
+		s->skip += payload;
+		return 0;
+	default:
+		ERROR("Unknown sparse chunk type 0x%x", type);
+		return -1;
+	}
+
+	ERROR("Sparse chunk %u (0x%x) has a wrong size", s->chunks, type);
+	return -1;
+}
+
+static int sparse_fill(struct raw_sparse_out *s)
+{
+	size_t n;
+
+	if (!s->fill) {
+		s->fill = malloc(SPARSE_FILL_BUF_SIZE);
+		if (!s->fill) {
+			ERROR("OOM allocating sparse fill buffer");
+			return -1;
+		}
+	}
+	for (n = 0; n < SPARSE_FILL_BUF_SIZE; n += sizeof(uint32_t))
+		memcpy(s->fill + n, s->hdr, sizeof(uint32_t));
+
+	while (s->remaining) {
+		n = min(s->remaining, (unsigned long long)SPARSE_FILL_BUF_SIZE);
+		if (raw_pwrite(s->fdout, s->fill, n, s->offset) < 0)
+			return -1;
+		s->offset += n;
+		s->written += n;
+		s->remaining -= n;
+	}
+	s->state = SPARSE_CHUNK_HDR;
+	s->want = SPARSE_CHUNK_HDR_SIZE;
+
+	return 0;
+}
+
+static int raw_sparse_write(void *out, const void *buf, size_t len)
+{
+	struct raw_sparse_out *s = (struct raw_sparse_out *)out;
+	const uint8_t *data = buf;
+	size_t n;
+	int ret;
+
+	while (len) {
+		if (s->skip) {
+			n = min((unsigned long long)len, s->skip);
+			s->skip -= n;
+			data += n;
+			len -= n;
+			continue;
+		}
+
+		if (s->state == SPARSE_RAW) {
+			n = min((unsigned long long)len, s->remaining);
+			if (raw_pwrite(s->fdout, data, n, s->offset) < 0)
+				return -1;
+			s->offset += n;
+			s->written += n;
+			s->remaining -= n;
+			data += n;
+			len -= n;
+			if (!s->remaining) {
+				s->state = SPARSE_CHUNK_HDR;
+				s->want = SPARSE_CHUNK_HDR_SIZE;
+			}
+			continue;
+		}
+
+		/* headers and fill values are collected first */
+		n = min(len, s->want - s->hdrlen);
+		memcpy(s->hdr + s->hdrlen, data, n);
+		s->hdrlen += n;
+		data += n;
+		len -= n;
+		if (s->hdrlen < s->want)
+			continue;
+		s->hdrlen = 0;
+
+		switch (s->state) {
+		case SPARSE_FILE_HDR:
+			ret = sparse_file_header(s);
+			break;
+		case SPARSE_CHUNK_HDR:
+			ret = sparse_chunk_header(s);
+			break;
+		default:
+			ret = sparse_fill(s);
+			break;
+		}
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int raw_sparse_copyimage(int fdout, struct img_type *img, off_t *end)
+{
+	struct raw_sparse_out s = {
+		.fdout = fdout,
+		.state = SPARSE_FILE_HDR,
+		.want = SPARSE_FILE_HDR_SIZE,
+		.offset = img->seek
+	};
+	int ret;
+
+	ret = copyimage(&s, img, raw_sparse_write);
+	free(s.fill);
+	if (ret)
+		return ret;
+
+	if (s.state != SPARSE_CHUNK_HDR || s.hdrlen || s.skip ||
+	    s.chunks != s.total_chunks) {
+		ERROR("Sparse image %s is truncated", img->fname);
+		return -EINVAL;
+	}
+	if (s.blocks != s.total_blks)
+		WARN("Sparse image %s describes %llu blocks instead of %u",
+		     img->fname, s.blocks, s.total_blks);
+
+	*end = img->seek + (off_t)s.total_blks * s.blk_sz;
+	INFO("%s: %llu bytes written, %llu bytes skipped",
+	     img->device, s.written, s.skipped);
+
+	return 0;
+}
+
+#ifdef CONFIG_RAW_VERITY
+/*
+ * The dm-verity tree is computed from the chunks
+ * while they are written to the device
+ */
+struct raw_verity_out {
+	int fdout;	/* must be first, copyimage() seeks on it */
+	struct verity_tree *tree;
+};
+
+static int raw_verity_write(void *out, const void *buf, size_t len)
+{
+	struct raw_verity_out *v = (struct raw_verity_out *)out;
+
+#if defined(__FreeBSD__)
+	if (copy_write_padded(&v->fdout, buf, len) < 0)
+#else
+	if (copy_write(&v->fdout, buf, len) < 0)
+#endif
+		return -1;
+
+	return verity_update(v->tree, buf, len) < 0 ? -1 : 0;
+}
+
+static int raw_verity_copyimage(int fdout, struct img_type *img,
+				struct verity_tree *tree)
+{
+	struct raw_verity_out v = {
+		.fdout = fdout,
+		.tree = tree
+	};
+
+	return copyimage(&v, img, raw_verity_write);
+}
+#endif
+
+/*
+ * The image is decoded once and written to its device and to each
+ * device of the "mirror" property, e.g. the two boot partitions
+ * of an eMMC
+ */
+static int raw_mirror_copyimage(struct img_type *img, struct dict_list *mirrors)
+{
+	struct dict_list_elem *elem;
+	struct copy_tee tee = { .count = 0 };
+	const char **devices;
+	int *prot_stat;
+	unsigned int count = 1, i;
+	int ret = 0;
+
+	LIST_FOREACH(elem, mirrors, next)
+		count++;
+
+	devices = calloc(count, sizeof(*devices));
+	prot_stat = calloc(count, sizeof(*prot_stat));
+	tee.fds = calloc(count, sizeof(*tee.fds));
+	if (!devices || !prot_stat || !tee.fds) {
+		ret = -ENOMEM;
+		goto mirror_out;
+	}
+
+	devices[0] = img->device;
+	i = 1;
+	LIST_FOREACH(elem, mirrors, next)
+		devices[i++] = elem->value;
+
+	for (i = 0; i < count; i++) {
+		prot_stat[i] = blkprotect(devices[i], false);
+		if (prot_stat[i] < 0) {
+			ret = prot_stat[i];
+			goto mirror_out;
+		}
+		tee.fds[i] = open(devices[i], O_RDWR);
+		if (tee.fds[i] < 0) {
+			ERROR("Device %s cannot be opened: %s",
+				devices[i], strerror(errno));
+			if (prot_stat[i] == 1)
+				blkprotect(devices[i], true);
+			ret = -ENODEV;
+			goto mirror_out;
+		}
+		tee.count++;
+	}
+
+	TRACE("Writing %s to %u devices", img->fname, count);
+	ret = copyimage(&tee, img, copy_write_tee);
+
+mirror_out:
+	for (i = 0; i < tee.count; i++) {
+		if (prot_stat[i] == 1) {
+			fsync(tee.fds[i]);
+			blkprotect(devices[i], true);
+		}
+		close(tee.fds[i]);
+		/* the installer drops only the main device */
+		if (i)
+			blkdev_cache_invalidate(devices[i]);
+	}
+	free(tee.fds);
+	free(prot_stat);
+	free(devices);
+
+	return ret;
+}
+
 static int install_raw_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
 	int ret;
 	int fdout;
+	int flags = O_RDWR;
+	off_t end = -1;
+	bool direct_io = strtobool(dict_get_value(&img->properties, "direct-io"));
+	bool skip_unchanged = strtobool(dict_get_value(&img->properties,
+				"skip-unchanged-blocks"));
+	bool sparse = strtobool(dict_get_value(&img->properties, "sparse"));
+	bool verify = strtobool(dict_get_value(&img->properties, "verify"));
+	int discard = img_discard_mode(img);
+	struct dict_list *mirrors = dict_get_list(&img->properties, "mirror");
+#ifdef CONFIG_RAW_VERITY
+	struct verity_tree *tree = NULL;
+#endif
+
+	if (discard < 0)
+		return discard;
+
+	if (strtobool(dict_get_value(&img->properties, "verity"))) {
+#ifdef CONFIG_RAW_VERITY
+		if (direct_io || skip_unchanged || sparse || mirrors || verify) {
+			ERROR("verity cannot be used together with direct-io, "
+			      "skip-unchanged-blocks, sparse, mirror or verify");
+			return -EINVAL;
+		}
+		ret = verity_start(img, &tree);
+		if (ret < 0)
+			return ret;
+#else
+		ERROR("%s: dm-verity support is not enabled", img->fname);
+		return -EINVAL;
+#endif
+	}
+
+	if (mirrors) {
+		if (direct_io || skip_unchanged || sparse || verify ||
+		    discard != DISCARD_NONE) {
+			ERROR("mirror cannot be used together with direct-io, "
+			      "skip-unchanged-blocks, sparse, verify or discard");
+			return -EINVAL;
+		}
+		return raw_mirror_copyimage(img, mirrors);
+	}
+
+	if (direct_io && skip_unchanged) {
+		ERROR("direct-io and skip-unchanged-blocks cannot be used together");
+		return -EINVAL;
+	}
+
+	if (sparse && (direct_io || skip_unchanged)) {
+		ERROR("sparse cannot be used together with direct-io or skip-unchanged-blocks");
+		return -EINVAL;
+	}
+
+	if (verify && (direct_io || skip_unchanged || sparse)) {
+		ERROR("verify cannot be used together with direct-io, "
+		      "skip-unchanged-blocks or sparse");
+		return -EINVAL;
+	}
+
+	if (skip_unchanged && (discard == DISCARD_FULL || discard == DISCARD_SECURE)) {
+		ERROR("discard before writing and skip-unchanged-blocks cannot be used together");
+		return -EINVAL;
+	}
+
+	int prot_stat = blkprotect(img->device, false);
+	if (prot_stat < 0) {
+		ret = prot_stat;
+		goto raw_free;
+	}
 
-	int prot_stat = blkprotect(img, false);
-	if (prot_stat < 0)
-		return prot_stat;
+#ifdef O_DIRECT
+	if (direct_io)
+		flags |= O_DIRECT;
+#else
+	if (direct_io)
+		WARN("direct-io is not supported on this system, ignoring");
+#endif
 
-	fdout = open(img->device, O_RDWR);
+	fdout = open(img->device, flags);
 	if (fdout < 0) {
 		TRACE("Device %s cannot be opened: %s",
 			img->device, strerror(errno));
-		return -ENODEV;
+		ret = -ENODEV;
+		goto raw_free;
+	}
+
+	/*
+	 * Discard starts at the offset, data before it is not
+	 * part of this image
+	 */
+	if (discard == DISCARD_FULL || discard == DISCARD_SECURE) {
+		ret = blkdev_discard(fdout, img->seek, 0, discard == DISCARD_SECURE);
+		if (ret)
+			goto raw_out;
 	}
+
+	if (sparse)
+		ret = raw_sparse_copyimage(fdout, img, &end);
+	else if (skip_unchanged)
+		ret = raw_diff_copyimage(fdout, img, &end);
+	else if (verify)
+		ret = raw_verify_copyimage(fdout, img, &end);
+	else
+#ifdef O_DIRECT
+	if (direct_io)
+		ret = raw_direct_copyimage(fdout, img);
+	else
+#endif
+#ifdef CONFIG_RAW_VERITY
+	if (tree)
+		ret = raw_verity_copyimage(fdout, img, tree);
+	else
+#endif
 #if defined(__FreeBSD__)
 	ret = copyimage(&fdout, img, copy_write_padded);
 #else
 	ret = copyimage(&fdout, img, NULL);
 #endif
 
+	if (!ret && discard == DISCARD_TAIL) {
+		if (end < 0)
+			end = lseek(fdout, 0, SEEK_CUR);
+		if (end < 0) {
+			ERROR("Cannot get position on %s: %s", img->device, strerror(errno));
+			ret = -EIO;
+		} else {
+			ret = blkdev_discard(fdout, end, 0, false);
+		}
+	}
+
+#ifdef CONFIG_RAW_VERITY
+	/* after the discard, the tree can follow the image on the device */
+	if (!ret && tree)
+		ret = verity_finish(tree, img);
+#endif
+
+raw_out:
 	if (prot_stat == 1) {
 		fsync(fdout);  // At least with Linux 4.14 data are not automatically flushed before ro mode is enabled
-		blkprotect(img, true);  // no error handling, keep ret from copyimage
+		blkprotect(img->device, true);  // no error handling, keep ret from copyimage
 	}
 
 	close(fdout);
+raw_free:
+#ifdef CONFIG_RAW_VERITY
+	verity_free(tree);
+#endif
 	return ret;
 }
 
+/*
+ * Plain copy to the device for chained images, written
+ * directly by the producing handler
+ */
+struct raw_stream {
+	int fdout;
+	int prot_stat;
+	struct img_type *img;
+};
+
+static int raw_stream_open(struct img_type *img, void **ctx)
+{
+	struct raw_stream *s;
+
+	if (strtobool(dict_get_value(&img->properties, "direct-io")) ||
+	    strtobool(dict_get_value(&img->properties, "skip-unchanged-blocks")) ||
+	    strtobool(dict_get_value(&img->properties, "sparse")) ||
+	    dict_get_list(&img->properties, "mirror") ||
+	    strtobool(dict_get_value(&img->properties, "verity")) ||
+	    strtobool(dict_get_value(&img->properties, "verify")) ||
+	    img_discard_mode(img) != DISCARD_NONE)
+		return -EOPNOTSUPP;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+	s->img = img;
+
+	s->prot_stat = blkprotect(img->device, false);
+	if (s->prot_stat < 0) {
+		free(s);
+		return -EFAULT;
+	}
+
+	s->fdout = open(img->device, O_RDWR);
+	if (s->fdout < 0) {
+		TRACE("Device %s cannot be opened: %s",
+			img->device, strerror(errno));
+		free(s);
+		return -ENODEV;
+	}
+	if (img->seek && lseek(s->fdout, img->seek, SEEK_SET) < 0) {
+		ERROR("offset argument: seek failed");
+		close(s->fdout);
+		free(s);
+		return -EFAULT;
+	}
+
+	*ctx = s;
+
+	return 0;
+}
+
+static int raw_stream_write(void *ctx, const void *buf, size_t len)
+{
+	struct raw_stream *s = ctx;
+
+#if defined(__FreeBSD__)
+	return copy_write_padded(&s->fdout, buf, len);
+#else
+	return copy_write(&s->fdout, buf, len);
+#endif
+}
+
+static int raw_stream_close(void *ctx, bool __attribute__ ((__unused__)) success)
+{
+	struct raw_stream *s = ctx;
+
+	if (s->prot_stat == 1) {
+		fsync(s->fdout);
+		blkprotect(s->img->device, true);
+	}
+	close(s->fdout);
+	free(s);
+
+	return 0;
+}
+
+static const struct chain_stream_ops raw_stream_ops = {
+	.open = raw_stream_open,
+	.write = raw_stream_write,
+	.close = raw_stream_close,
+};
+
 static int install_raw_file(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
@@ -154,7 +1115,9 @@ static int install_raw_file(struct img_type *img,
 	char tmp_path[255];
 	int fdout;
 	int ret = 0;
-	int use_mount = (strlen(img->device) && strlen(img->filesystem)) ? 1 : 0;
+	off_t end;
+	int use_mount = (strlen(img->device) && img->filesystem) ? 1 : 0;
+	bool atomic = strtobool(dict_get_value(&img->properties, "atomic-install"));
 	char* DATADST_DIR = alloca(strlen(get_tmpdir())+strlen(DATADST_DIR_SUFFIX)+1);
 	sprintf(DATADST_DIR, "%s%s", get_tmpdir(), DATADST_DIR_SUFFIX);
 
@@ -183,7 +1146,7 @@ static int install_raw_file(struct img_type *img,
 		}
 	}
 
-	if (strtobool(dict_get_value(&img->properties, "atomic-install"))) {
+	if (atomic) {
 		if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
 			ERROR("Temp path too long: %s.tmp", img->path);
 			return -1;
@@ -204,32 +1167,55 @@ static int install_raw_file(struct img_type *img,
 	}
 
 	fdout = openfileoutput(tmp_path);
-	if (fdout < 0)
-		return fdout;
+	if (fdout < 0) {
+		ret = fdout;
+		goto out_umount;
+	}
 	if (!img_check_free_space(img, fdout)) {
-		return -ENOSPC;
+		ret = -ENOSPC;
+		goto out_close;
 	}
 
+	preallocate_output(fdout, get_output_size(img, false));
+
 	ret = copyimage(&fdout, img, NULL);
 	if (ret< 0) {
 		ERROR("Error copying extracted file");
+		goto out_close;
 	}
 
-	if(fsync(fdout)) {
+	/* release the blocks preallocated beyond the data */
+	end = lseek(fdout, 0, SEEK_CUR);
+	if (end < 0 || ftruncate(fdout, end)) {
+		ERROR("Error truncating %s: %s", tmp_path, strerror(errno));
+		ret = -EIO;
+		goto out_close;
+	}
+
+	if (fdatasync(fdout)) {
 		ERROR("Error writing %s to disk: %s", tmp_path, strerror(errno));
-		return -1;
+		ret = -EIO;
+		goto out_close;
 	}
 
 	close(fdout);
+	fdout = -1;
 
-	if (strtobool(dict_get_value(&img->properties, "atomic-install"))) {
+	if (atomic) {
 		TRACE("Renaming file %s to %s", tmp_path, path);
 		if(rename(tmp_path, path)) {
 			ERROR("Error renaming %s to %s: %s", tmp_path, path, strerror(errno));
-			return -1;
+			ret = -1;
 		}
 	}
 
+out_close:
+	if (fdout >= 0)
+		close(fdout);
+	/* a failed atomic install leaves the previous file in place */
+	if (ret < 0 && atomic)
+		unlink(tmp_path);
+out_umount:
 	if (use_mount) {
 		swupdate_umount(DATADST_DIR);
 	}
@@ -241,12 +1227,16 @@ __attribute__((constructor))
 void raw_image_handler(void)
 {
 	register_handler("raw", install_raw_image,
-				IMAGE_HANDLER, NULL);
+				IMAGE_HANDLER | STREAM_HANDLER | PARALLEL_HANDLER |
+				SEEKABLE_HANDLER | DIRECTIO_HANDLER |
+				SKIP_UNCHANGED_HANDLER, NULL);
+	register_chain_stream("raw", &raw_stream_ops);
 }
 
 	__attribute__((constructor))
 void raw_file_handler(void)
 {
 	register_handler("rawfile", install_raw_file,
-				FILE_HANDLER, NULL);
+				FILE_HANDLER | STREAM_HANDLER | PARALLEL_HANDLER |
+				SKIP_UNCHANGED_HANDLER, NULL);
 }
@@ -10,21 +10,30 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <stdbool.h>
 #include <librsync.h>
 #if defined(__linux__)
 #include <sys/sendfile.h>
+#include <linux/fs.h>
 #endif
 #if defined(__FreeBSD__)
 #include <sys/param.h>
+#include <sys/disk.h>
+#define BLKGETSIZE64 DIOCGMEDIASIZE
 #endif
 #include "swupdate.h"
 #include "handler.h"
 #include "util.h"
 
 /* Use rdiff's default inbuf and outbuf size of 64K */
-#define RDIFF_BUFFER_SIZE 64 * 1024
+#define RDIFF_BUFFER_SIZE (64 * 1024)
+#define RDIFF_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+/* Minimum size of the base file cache if it cannot be mapped */
+#define RDIFF_BASE_CACHE_SIZE (1024 * 1024)
 
 #define TEST_OR_FAIL(expr, failret) \
 	if (expr) { \
@@ -46,6 +55,23 @@ struct rdiff_t
 
 	char *inbuf;
 	char *outbuf;
+	size_t bufsize;
+
+	/* base file, mapped or read through a cache */
+	int base_fd;
+	const char *base_map;
+	unsigned long long base_size;
+	char *base_cache;
+	size_t base_cache_size;
+	unsigned long long base_cache_pos;
+	size_t base_cache_len;
+
+	/* statistics */
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	unsigned long long base_bytes;
+	unsigned long base_calls;
+	unsigned long base_reads;
 
 	uint8_t type;
 };
@@ -67,29 +93,126 @@ static void rdiff_log(rs_loglevel level, char const *msg)
 	swupdate_notify(RUN, "%s", loglevelmap[level], msg);
 }
 
-static rs_result base_file_read_cb(void *fp, rs_long_t pos, size_t *len, void **buf)
+/*
+ * librsync asks for the base data of each copy command. The callback
+ * may return a pointer to its own memory instead of filling *buf, so
+ * the data is taken from the mapped base file or from a cache filled
+ * with large reads.
+ */
+static rs_result base_file_read_cb(void *data, rs_long_t pos, size_t *len, void **buf)
 {
-	FILE *f = (FILE *)fp;
+	struct rdiff_t *rdiff_state = (struct rdiff_t *)data;
+	unsigned long long off = pos;
 
-	if (fseek(f, pos, SEEK_SET) != 0) {
-		ERROR("Error seeking rdiff base file: %s", strerror(errno));
-		return RS_IO_ERROR;
-	}
+	rdiff_state->base_calls++;
 
-	int ret = fread(*buf, 1, *len, f);
-	if (ret == -1) {
-		ERROR("Error reading rdiff base file: %s", strerror(errno));
-		return RS_IO_ERROR;
-	}
-	if (ret == 0) {
+	if (pos < 0 || (rdiff_state->base_size && off >= rdiff_state->base_size)) {
 		ERROR("Unexpected EOF on rdiff base file.");
 		return RS_INPUT_ENDED;
 	}
-	*len = ret;
+
+	if (rdiff_state->base_map) {
+		if (*len > rdiff_state->base_size - off)
+			*len = rdiff_state->base_size - off;
+		*buf = (void *)(rdiff_state->base_map + off);
+		rdiff_state->base_bytes += *len;
+		return RS_DONE;
+	}
+
+	if (off < rdiff_state->base_cache_pos ||
+	    off + *len > rdiff_state->base_cache_pos + rdiff_state->base_cache_len) {
+		ssize_t ret;
+
+		/* requests bigger than the cache are read directly */
+		if (*len > rdiff_state->base_cache_size) {
+			ret = pread(rdiff_state->base_fd, *buf, *len, off);
+			rdiff_state->base_reads++;
+			if (ret < 0) {
+				ERROR("Error reading rdiff base file: %s", strerror(errno));
+				return RS_IO_ERROR;
+			}
+			if (ret == 0) {
+				ERROR("Unexpected EOF on rdiff base file.");
+				return RS_INPUT_ENDED;
+			}
+			*len = ret;
+			rdiff_state->base_bytes += *len;
+			return RS_DONE;
+		}
+
+		do {
+			ret = pread(rdiff_state->base_fd, rdiff_state->base_cache,
+				    rdiff_state->base_cache_size, off);
+		} while (ret < 0 && errno == EINTR);
+		rdiff_state->base_reads++;
+		if (ret < 0) {
+			ERROR("Error reading rdiff base file: %s", strerror(errno));
+			rdiff_state->base_cache_len = 0;
+			return RS_IO_ERROR;
+		}
+		if (ret == 0) {
+			ERROR("Unexpected EOF on rdiff base file.");
+			rdiff_state->base_cache_len = 0;
+			return RS_INPUT_ENDED;
+		}
+		rdiff_state->base_cache_pos = off;
+		rdiff_state->base_cache_len = ret;
+	}
+
+	off -= rdiff_state->base_cache_pos;
+	if (*len > rdiff_state->base_cache_len - off)
+		*len = rdiff_state->base_cache_len - off;
+	*buf = rdiff_state->base_cache + off;
+	rdiff_state->base_bytes += *len;
 
 	return RS_DONE;
 }
 
+static int base_file_open(struct rdiff_t *rdiff_state, bool use_mmap)
+{
+	struct stat st;
+	int fd = fileno(rdiff_state->base_file);
+
+	rdiff_state->base_fd = fd;
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	if (S_ISREG(st.st_mode))
+		rdiff_state->base_size = st.st_size;
+	else if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &rdiff_state->base_size) < 0)
+		rdiff_state->base_size = 0;
+
+	if (use_mmap && rdiff_state->base_size &&
+	    rdiff_state->base_size <= (unsigned long long)SIZE_MAX) {
+		void *map = mmap(NULL, rdiff_state->base_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (map != MAP_FAILED) {
+			(void)madvise(map, rdiff_state->base_size, MADV_SEQUENTIAL);
+			rdiff_state->base_map = map;
+			TRACE("rdiff base file mapped, %llu bytes", rdiff_state->base_size);
+			return 0;
+		}
+		TRACE("rdiff base file cannot be mapped: %s", strerror(errno));
+	}
+
+	rdiff_state->base_cache_size = max(rdiff_state->bufsize, (size_t)RDIFF_BASE_CACHE_SIZE);
+	rdiff_state->base_cache = malloc(rdiff_state->base_cache_size);
+	if (!rdiff_state->base_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void base_file_close(struct rdiff_t *rdiff_state)
+{
+	if (rdiff_state->base_map) {
+		munmap((void *)rdiff_state->base_map, rdiff_state->base_size);
+		rdiff_state->base_map = NULL;
+	}
+	free(rdiff_state->base_cache);
+	rdiff_state->base_cache = NULL;
+}
+
 static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const void *buf, unsigned int *len)
 {
 	rs_buffers_t *buffers = &rdiff_state->buffers;
@@ -106,18 +229,18 @@ static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const void *buf, uns
 
 	if (buffers->avail_in == 0) {
 		/* No more buffered input data pending, get some... */
-		TEST_OR_FAIL(*len <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+		unsigned int buflen = min(*len, (unsigned int)rdiff_state->bufsize);
 		buffers->next_in = rdiff_state->inbuf;
-		buffers->avail_in = *len;
-		TRACE("Writing %d bytes to rdiff input buffer.", *len);
-		(void)memcpy(rdiff_state->inbuf, buf, *len);
-		*len = 0;
+		buffers->avail_in = buflen;
+		TRACE("Writing %d bytes to rdiff input buffer.", buflen);
+		(void)memcpy(rdiff_state->inbuf, buf, buflen);
+		*len -= buflen;
 	} else {
 		/* There's more input, try to append it to input buffer. */
 		char *target = buffers->next_in + buffers->avail_in;
-		unsigned int buflen = rdiff_state->inbuf + RDIFF_BUFFER_SIZE - target;
+		unsigned int buflen = rdiff_state->inbuf + rdiff_state->bufsize - target;
 		buflen = buflen > *len ? *len : buflen;
-		TEST_OR_FAIL(target + buflen <= rdiff_state->inbuf + RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+		TEST_OR_FAIL(target + buflen <= rdiff_state->inbuf + rdiff_state->bufsize, RS_IO_ERROR);
 
 		if (buflen == 0) {
 			TRACE("Not consuming rdiff chunk input, buffer already filled.");
@@ -136,9 +259,9 @@ static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
 	rs_buffers_t *buffers = &rdiff_state->buffers;
 
 	int len = buffers->next_out - rdiff_state->outbuf;
-	TEST_OR_FAIL(len <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+	TEST_OR_FAIL(len <= (int)rdiff_state->bufsize, RS_IO_ERROR);
 	TEST_OR_FAIL(buffers->next_out >= rdiff_state->outbuf, RS_IO_ERROR);
-	TEST_OR_FAIL(buffers->next_out <= rdiff_state->outbuf + RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+	TEST_OR_FAIL(buffers->next_out <= rdiff_state->outbuf + rdiff_state->bufsize, RS_IO_ERROR);
 
 	writeimage destfiledrain = copy_write;
 #if defined(__FreeBSD__)
@@ -152,7 +275,8 @@ static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
 	if (len > 0) {
 		TRACE("Draining %d bytes from rdiff output buffer", len);
 		buffers->next_out = rdiff_state->outbuf;
-		buffers->avail_out = RDIFF_BUFFER_SIZE;
+		buffers->avail_out = rdiff_state->bufsize;
+		rdiff_state->out_bytes += len;
 		int dest_file_fd = fileno(rdiff_state->dest_file);
 		if (destfiledrain(&dest_file_fd, buffers->next_out, len) != 0) {
 			ERROR("Cannot drain rdiff output buffer.");
@@ -177,6 +301,25 @@ static inline void rdiff_stats(const char* msg, struct rdiff_t *rdiff_state, rs_
 		  msg, buffers->avail_in, buffers->avail_out, strresult);
 }
 
+static void rdiff_summary(struct rdiff_t *rdiff_state, struct timespec *start)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	INFO("rdiff: %llu bytes delta, %llu bytes written (%.1f MB/s), "
+	     "%llu bytes from base in %lu copies (%s, %lu reads), %.2f s",
+	     rdiff_state->in_bytes, rdiff_state->out_bytes,
+	     rdiff_state->out_bytes / secs / 1e6,
+	     rdiff_state->base_bytes, rdiff_state->base_calls,
+	     rdiff_state->base_map ? "mapped" : "cached",
+	     rdiff_state->base_reads, secs);
+}
+
 static int apply_rdiff_chunk_cb(void *out, const void *buf, size_t len)
 {
 	struct rdiff_t *rdiff_state = (struct rdiff_t *)out;
@@ -185,15 +328,17 @@ static int apply_rdiff_chunk_cb(void *out, const void *buf, size_t len)
 	rs_result result = RS_RUNNING;
 	rs_result drain_run_result = RS_RUNNING;
 
+	rdiff_state->in_bytes += len;
 	if (buffers->next_out == NULL) {
 		TEST_OR_FAIL(buffers->avail_out == 0, -1);
 		buffers->next_out = rdiff_state->outbuf;
-		buffers->avail_out = RDIFF_BUFFER_SIZE;
+		buffers->avail_out = rdiff_state->bufsize;
 	}
 
 	while (inbytesleft > 0 || buffers->avail_in > 0) {
 		rdiff_stats("[pre] ", rdiff_state, result);
-		result = fill_inbuffer(rdiff_state, buf, &inbytesleft);
+		result = fill_inbuffer(rdiff_state, (const char *)buf + len - inbytesleft,
+				       &inbytesleft);
 		if (result != RS_DONE && result != RS_BLOCKED) {
 			return -1;
 		}
@@ -228,10 +373,23 @@ static int apply_rdiff_patch(struct img_type *img,
 	    strcmp(img->type, "rdiff_image") == 0 ? IMAGE_HANDLER : FILE_HANDLER;
 
 	char *mountpoint = NULL;
-	bool use_mount = (strlen(img->device) && strlen(img->filesystem)) ? true : false;
+	bool use_mount = (strlen(img->device) && img->filesystem) ? true : false;
 
 	char *base_file_filename = NULL;
 	char *dest_file_filename = NULL;
+	struct timespec start;
+	char *value;
+
+	rdiff_state.bufsize = RDIFF_BUFFER_SIZE;
+	value = dict_get_value(&img->properties, "buffer-size");
+	if (value) {
+		rdiff_state.bufsize = ustrtoull(value, NULL, 10);
+		if (rdiff_state.bufsize < 4096 ||
+		    rdiff_state.bufsize > RDIFF_MAX_BUFFER_SIZE) {
+			ERROR("buffer-size %s out of range", value);
+			return -1;
+		}
+	}
 
 	if (rdiff_state.type == IMAGE_HANDLER) {
 		if (img->seek) {
@@ -312,13 +470,20 @@ static int apply_rdiff_patch(struct img_type *img,
 		goto cleanup;
 	}
 
-	if (!(rdiff_state.inbuf = malloc(RDIFF_BUFFER_SIZE))) {
+	value = dict_get_value(&img->properties, "base-mmap");
+	if (base_file_open(&rdiff_state, !value || strtobool(value)) < 0) {
+		ERROR("Cannot set up access to %s", base_file_filename);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(rdiff_state.inbuf = malloc(rdiff_state.bufsize))) {
 		ERROR("Cannot allocate memory for rdiff input buffer.");
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (!(rdiff_state.outbuf = malloc(RDIFF_BUFFER_SIZE))) {
+	if (!(rdiff_state.outbuf = malloc(rdiff_state.bufsize))) {
 		ERROR("Cannot allocate memory for rdiff output buffer.");
 		ret = -1;
 		goto cleanup;
@@ -336,8 +501,9 @@ static int apply_rdiff_patch(struct img_type *img,
 	rs_trace_set_level(loglevelmap[loglevel]);
 	rs_trace_to(rdiff_log);
 
-	rdiff_state.job = rs_patch_begin(base_file_read_cb, rdiff_state.base_file);
-	ret = copyfile(img->fdin,
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rdiff_state.job = rs_patch_begin(base_file_read_cb, &rdiff_state);
+	ret = copyfile_hash(img->fdin,
 			&rdiff_state,
 			img->size,
 			(unsigned long *)&img->offset,
@@ -346,6 +512,7 @@ static int apply_rdiff_patch(struct img_type *img,
 			img->compressed,
 			&img->checksum,
 			img->sha256,
+			img->hashalg,
 			img->is_encrypted,
 			img->ivt_ascii,
 			apply_rdiff_chunk_cb);
@@ -353,6 +520,8 @@ static int apply_rdiff_patch(struct img_type *img,
 		ERROR("Error %d running rdiff job, aborting.", ret);
 		goto cleanup;
 	}
+	rdiff_summary(&rdiff_state, &start);
+	base_file_close(&rdiff_state);
 
 	if (rdiff_state.type == FILE_HANDLER) {
 		struct stat stat_dest_file;
@@ -407,6 +576,7 @@ static int apply_rdiff_patch(struct img_type *img,
 	}
 
 cleanup:
+	base_file_close(&rdiff_state);
 	free(rdiff_state.inbuf);
 	free(rdiff_state.outbuf);
 	if (rdiff_state.job != NULL) {
@@ -438,11 +608,13 @@ cleanup:
 __attribute__((constructor))
 void rdiff_image_handler(void)
 {
-	register_handler("rdiff_image", apply_rdiff_patch, IMAGE_HANDLER, NULL);
+	register_handler("rdiff_image", apply_rdiff_patch,
+			 IMAGE_HANDLER | SEEKABLE_HANDLER, NULL);
 }
 
 __attribute__((constructor))
 void rdiff_file_handler(void)
 {
-	register_handler("rdiff_file", apply_rdiff_patch, FILE_HANDLER, NULL);
+	register_handler("rdiff_file", apply_rdiff_patch,
+			 FILE_HANDLER | SEEKABLE_HANDLER, NULL);
 }
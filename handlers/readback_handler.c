@@ -6,9 +6,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #ifdef __FreeBSD__
 #include <sys/disk.h>
@@ -24,109 +27,297 @@
 #include "util.h"
 
 void readback_handler(void);
-static int readback_postinst(struct img_type *img);
 
-static int readback(struct img_type *img, void *data)
+#define READBACK_ALIGN		4096
+#define READBACK_BUFSIZE	(1024 * 1024)
+
+/*
+ * A verification of one partition. Verifications marked
+ * as parallel run in their own thread and are collected
+ * by the last readback script of the list.
+ */
+struct readback_job {
+	char device[MAX_VOLNAME];
+	unsigned char hash[SHA256_HASH_LENGTH];
+	unsigned long long size;
+	unsigned long long offset;
+	size_t bufsize;
+	bool direct;
+	int status;
+	pthread_t thread;
+	LIST_ENTRY(readback_job) next;
+};
+
+LIST_HEAD(readback_jobs, readback_job);
+
+static struct readback_jobs jobs = LIST_HEAD_INITIALIZER(jobs);
+static volatile bool readback_stop;
+
+/*
+ * Read the partition and compute its hash. With O_DIRECT, offset
+ * and length of the reads must be aligned, so the area is extended
+ * to the alignment and only the requested bytes are hashed.
+ */
+static int readback_verify(struct readback_job *job)
 {
-	if (!data)
-		return -1;
+	struct swupdate_digest *dgst;
+	unsigned char md[SHA256_HASH_LENGTH];
+	unsigned int md_len;
+	unsigned long long pos, remaining;
+	unsigned char *buf;
+	size_t skip;
+	ssize_t n;
+	int fdin = -1;
+	int ret = -EFAULT;
 
-	struct script_handler_data *script_data = data;
-	switch (script_data->scriptfn) {
-	case POSTINSTALL:
-		return readback_postinst(img);
-	case PREINSTALL:
-	default:
-		return 0;
+	if (job->direct) {
+		fdin = open(job->device, O_RDONLY | O_DIRECT);
+		if (fdin < 0)
+			TRACE("%s: O_DIRECT not supported, using buffered reads",
+			      job->device);
+	}
+	if (fdin < 0) {
+		job->direct = false;
+		fdin = open(job->device, O_RDONLY);
+		if (fdin < 0) {
+			ERROR("Failed to open %s: %s", job->device, strerror(errno));
+			return -ENODEV;
+		}
+	}
+
+	/* Get the real size of the partition, if size is not set. */
+	if (job->size == 0) {
+		unsigned long long devsize;
+
+		if (ioctl(fdin, BLKGETSIZE64, &devsize) < 0 || devsize <= job->offset) {
+			ERROR("Cannot get size of %s", job->device);
+			close(fdin);
+			return -EFAULT;
+		}
+		job->size = devsize - job->offset;
+		TRACE("Partition size: %llu", job->size);
+	}
+
+#ifdef POSIX_FADV_DONTNEED
+	/* verify what is on the device, not what is in the page cache */
+	if (!job->direct) {
+		fdatasync(fdin);
+		posix_fadvise(fdin, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+
+	if (posix_memalign((void **)&buf, READBACK_ALIGN, job->bufsize)) {
+		close(fdin);
+		return -ENOMEM;
+	}
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst) {
+		free(buf);
+		close(fdin);
+		return -EFAULT;
+	}
+
+	pos = job->direct ? job->offset & ~(READBACK_ALIGN - 1ULL) : job->offset;
+	skip = job->offset - pos;
+	remaining = job->size;
+
+	while (remaining > 0) {
+		size_t len = job->bufsize;
+		size_t valid;
+
+		if (readback_stop) {
+			ret = -EINTR;
+			goto out;
+		}
+		if (skip + remaining < len) {
+			len = skip + remaining;
+			if (job->direct)
+				len = (len + READBACK_ALIGN - 1) & ~(READBACK_ALIGN - 1);
+		}
+		n = pread(fdin, buf, len, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= (ssize_t)skip) {
+			ERROR("%s: read at %llu failed: %s", job->device, pos,
+			      n < 0 ? strerror(errno) : "end of device");
+			goto out;
+		}
+		valid = n - skip;
+		if (valid > remaining)
+			valid = remaining;
+		if (swupdate_HASH_update(dgst, buf + skip, valid) < 0)
+			goto out;
+		remaining -= valid;
+		pos += n;
+		skip = 0;
 	}
+
+	if (swupdate_HASH_final(dgst, md, &md_len) < 0)
+		goto out;
+	ret = swupdate_HASH_compare(job->hash, md) ? -EFAULT : 0;
+
+out:
+	swupdate_HASH_cleanup(dgst);
+	free(buf);
+	close(fdin);
+
+	if (ret == 0)
+		INFO("Readback verification of %s success", job->device);
+	else
+		ERROR("Readback verification of %s failed, status=%d", job->device, ret);
+
+	return ret;
+}
+
+static void *readback_thread(void *data)
+{
+	struct readback_job *job = data;
+
+	job->status = readback_verify(job);
+
+	return NULL;
+}
+
+/*
+ * Wait for all verifications running in background
+ */
+static int readback_collect(void)
+{
+	struct readback_job *job, *tmp;
+	int ret = 0;
+
+	LIST_FOREACH_SAFE(job, &jobs, next, tmp) {
+		pthread_join(job->thread, NULL);
+		if (job->status)
+			ret = job->status;
+		LIST_REMOVE(job, next);
+		free(job);
+	}
+
+	return ret;
+}
+
+/*
+ * If the installation stops before the last readback script,
+ * the verifications still running are dropped here.
+ */
+static int readback_commit(bool apply)
+{
+	int ret;
+
+	if (!apply)
+		readback_stop = true;
+	ret = readback_collect();
+	readback_stop = false;
+
+	return apply ? ret : 0;
+}
+
+static bool readback_parallel(struct img_type *img)
+{
+	char *value = dict_get_value(&img->properties, "parallel");
+
+	return !value || strtobool(value);
+}
+
+static bool is_last_readback(struct img_type *img)
+{
+	struct img_type *next;
+
+	for (next = LIST_NEXT(img, next); next; next = LIST_NEXT(next, next)) {
+		if (next->is_script && !strcmp(next->type, "readback"))
+			return false;
+	}
+
+	return true;
 }
 
 static int readback_postinst(struct img_type *img)
 {
+	struct readback_job *job;
+	int ret, status;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
 	/* Get property: partition hash */
-	unsigned char hash[SHA256_HASH_LENGTH];
 	char *ascii_hash = dict_get_value(&img->properties, "sha256");
-	if (!ascii_hash || ascii_to_hash(hash, ascii_hash) < 0 || !IsValidHash(hash)) {
+	if (!ascii_hash || ascii_to_hash(job->hash, ascii_hash) < 0 ||
+	    !IsValidHash(job->hash)) {
 		ERROR("Invalid hash");
+		free(job);
 		return -EINVAL;
 	}
 
 	/* Get property: partition size */
-	unsigned int size = 0;
 	char *value = dict_get_value(&img->properties, "size");
 	if (value) {
-		size = strtoul(value, NULL, 10);
+		job->size = strtoull(value, NULL, 10);
 	} else {
 		TRACE("Property size not found, use partition size");
 	}
 
 	/* Get property: offset */
-	unsigned long offset = 0;
 	value = dict_get_value(&img->properties, "offset");
 	if (value) {
-		offset = strtoul(value, NULL, 10);
+		job->offset = strtoull(value, NULL, 10);
 	} else {
 		TRACE("Property offset not found, use default 0");
 	}
 
-	/* Open the device (partition) */
-	int fdin = open(img->device, O_RDONLY);
-	if (fdin < 0) {
-		ERROR("Failed to open %s: %s", img->device, strerror(errno));
-		return -ENODEV;
+	job->bufsize = READBACK_BUFSIZE;
+	value = dict_get_value(&img->properties, "buffer-size");
+	if (value) {
+		job->bufsize = ustrtoull(value, NULL, 10);
+		job->bufsize = (job->bufsize + READBACK_ALIGN - 1) &
+				~(size_t)(READBACK_ALIGN - 1);
+		if (!job->bufsize)
+			job->bufsize = READBACK_BUFSIZE;
 	}
 
-	/* Get the real size of the partition, if size is not set. */
-	if (size == 0) {
-		if (ioctl(fdin, BLKGETSIZE64, &size) < 0) {
-			ERROR("Cannot get size of %s", img->device);
-			close(fdin);
-			return -EFAULT;
-		}
-		TRACE("Partition size: %u", size);
-	}
+	value = dict_get_value(&img->properties, "direct-io");
+	job->direct = !value || strtobool(value);
 
-	/* 
-	 * Seek the file descriptor before passing it to copyfile().
-	 * This is necessary because copyfile() only accepts streams,
-	 * so the file descriptor shall be already at the right position.
-	 */
-	if (lseek(fdin, offset, SEEK_SET) < 0) {
-		ERROR("Seek %lu bytes failed: %s", offset, strerror(errno));
-		close(fdin);
-		return -EFAULT;
-	}
+	strlcpy(job->device, img->device, sizeof(job->device));
 
-	/*
-	 * Perform hash verification. We do not need to pass an output device to
-	 * the copyfile() function, because we only want it to verify the hash of
-	 * the input device.
-	 */
-	unsigned long offset_out = 0;
-	int status = copyfile(fdin,
-			NULL,  /* no output */
-			size,
-			&offset_out,
-			0,     /* no output seek */
-			1,     /* skip file, do not write to the output */
-			0,     /* no compressed */
-			NULL,  /* no checksum */
-			hash,
-			false,     /* no encrypted */
-			NULL,     /* no IVT */
-			NULL); /* no callback */
-	if (status == 0) {
-		INFO("Readback verification success");
+	if (!readback_parallel(img) ||
+	    pthread_create(&job->thread, NULL, readback_thread, job)) {
+		ret = readback_verify(job);
+		free(job);
 	} else {
-		ERROR("Readback verification failed, status=%d", status);
+		LIST_INSERT_HEAD(&jobs, job, next);
+		ret = 0;
 	}
 
-	close(fdin);
-	return status;
+	if (is_last_readback(img)) {
+		status = readback_collect();
+		if (!ret)
+			ret = status;
+	}
+
+	return ret;
+}
+
+static int readback(struct img_type *img, void *data)
+{
+	if (!data)
+		return -1;
+
+	struct script_handler_data *script_data = data;
+	switch (script_data->scriptfn) {
+	case POSTINSTALL:
+		return readback_postinst(img);
+	case PREINSTALL:
+	default:
+		return 0;
+	}
 }
 
 __attribute__((constructor))
 void readback_handler(void)
 {
-	register_handler("readback", readback, SCRIPT_HANDLER | NO_DATA_HANDLER, NULL);
+	register_handler("readback", readback,
+			 SCRIPT_HANDLER | NO_DATA_HANDLER | DIRECTIO_HANDLER, NULL);
+	register_commit_hook(readback_commit);
 }
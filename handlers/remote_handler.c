@@ -13,6 +13,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 #include <zmq.h>
 
 #include <swupdate.h>
@@ -24,6 +27,9 @@
 #define FRAME_BODY	1
 
 #define REMOTE_IPC_TIMEOUT	2000
+#define REMOTE_MAX_WINDOW	64
+#define REMOTE_PAYLOAD_SIZE	(256 * 1024)
+#define REMOTE_POOL_BUFS	4
 
 static int timeout = REMOTE_IPC_TIMEOUT;
 
@@ -35,6 +41,36 @@ struct remote_command {
 	char *cmd;
 };
 
+/*
+ * The data of the image is collected in the buffers of a pool,
+ * which are handed to ZeroMQ as payload of the DATA messages
+ * without a further copy. ZeroMQ gives them back when they
+ * have been sent.
+ */
+struct remote_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t size;
+	char *buf[REMOTE_POOL_BUFS];
+	bool busy[REMOTE_POOL_BUFS];
+};
+
+/*
+ * DATA messages can be sent without waiting for the
+ * ACK of the previous ones, up to window of them.
+ * The window is offered by the remote process in
+ * the answer to INIT, older ones do not and get 1.
+ */
+struct remote_conn {
+	int fd;			/* unused, copyimage() expects a fd first */
+	void *request;
+	unsigned int window;
+	unsigned int pending;
+	struct remote_pool pool;
+	char *cur;		/* buffer being filled */
+	size_t used;
+};
+
 void remote_handler(void);
 
 static void RHset_command(struct RHmsg *self, const char *key)
@@ -51,29 +87,138 @@ static void RHset_payload(struct RHmsg *self, const void *body, size_t size)
     memcpy (zmq_msg_data(msg), body, size);
 }
 
+static int pool_init(struct remote_pool *pool, size_t size)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->size = size;
+	for (i = 0; i < REMOTE_POOL_BUFS; i++) {
+		pool->buf[i] = malloc(size);
+		if (!pool->buf[i])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* ZeroMQ has all messages released when the context is destroyed */
+static void pool_free(struct remote_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < REMOTE_POOL_BUFS; i++)
+		free(pool->buf[i]);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Return a free buffer, waiting up to the timeout of
+ * the remote for ZeroMQ to give one back.
+ */
+static char *pool_get(struct remote_pool *pool)
+{
+	struct timespec deadline;
+	char *buf = NULL;
+	int i, ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (!buf && !ret) {
+		for (i = 0; i < REMOTE_POOL_BUFS; i++) {
+			if (!pool->busy[i]) {
+				pool->busy[i] = true;
+				buf = pool->buf[i];
+				break;
+			}
+		}
+		if (!buf)
+			ret = pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return buf;
+}
+
+/* free callback of zmq_msg_init_data(), called by a ZeroMQ thread */
+static void pool_put(void *data, void *hint)
+{
+	struct remote_pool *pool = (struct remote_pool *)hint;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < REMOTE_POOL_BUFS; i++) {
+		if (pool->buf[i] == data)
+			pool->busy[i] = false;
+	}
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static int RHset_pool_payload(struct RHmsg *self, struct remote_pool *pool,
+			      char *buf, size_t size)
+{
+	if (zmq_msg_init_data(&self->frame[FRAME_BODY], buf, size, pool_put, pool)) {
+		pool_put(buf, pool);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int RHmsg_send_cmd(struct RHmsg *self, void *request)
 {
 	int i;
 	int ret;
 
+	/*
+	 * The socket is a DEALER to be able to send without waiting for
+	 * the answer: add the empty delimiter a REQ socket would add, so
+	 * that the remote REP socket gets the same message.
+	 */
+	if (zmq_send(request, NULL, 0, ZMQ_SNDMORE) < 0) {
+		i = 0;
+		goto out_close;
+	}
+
 	for (i = 0; i < MSG_FRAMES; i++) {
 		ret = zmq_msg_send (&self->frame[i], request,
 			(i < MSG_FRAMES - 1)? ZMQ_SNDMORE: 0);
 		if (ret < 0 )
-			return errno;
+			goto out_close;
 	}
 
 	return 0;
+
+out_close:
+	/* frames not sent are still owned here, a pool buffer goes back */
+	ret = errno;
+	for (; i < MSG_FRAMES; i++)
+		zmq_msg_close(&self->frame[i]);
+	return ret;
 }
 
-static int RHmsg_get_ack(struct RHmsg *self, void *request)
+static int RHmsg_get_ack(struct RHmsg *self, void *request, unsigned int *window)
 {
 	int rc;
 	unsigned long size;
 	zmq_pollitem_t zpoll;
 	char *string;
+	char *offer;
 	int newtimeout;
 	int len;
+	int more;
+	size_t optlen = sizeof(more);
 
 	zpoll.socket = request;
 	zpoll.events = ZMQ_POLLIN;
@@ -86,13 +231,19 @@ static int RHmsg_get_ack(struct RHmsg *self, void *request)
 	if (rc <= 0)
 		return -EFAULT;
 
-	zmq_msg_init (&self->frame[0]);
-	if (zmq_msg_recv(&self->frame[0], request, 0) == -1) {
+	/* skip the empty delimiter in front of the answer */
+	do {
+		zmq_msg_init (&self->frame[0]);
+		if (zmq_msg_recv(&self->frame[0], request, 0) == -1) {
+			zmq_msg_close(&self->frame[0]);
+			return -EFAULT;
+		}
+		size = zmq_msg_size(&self->frame[0]);
+		if (size || !zmq_msg_more(&self->frame[0]))
+			break;
 		zmq_msg_close(&self->frame[0]);
-		return -EFAULT;
-	}
+	} while (1);
 
-	size = zmq_msg_size(&self->frame[0]);
 	string = malloc (size + 1);
 	if (!string)
 		return -ENOMEM;
@@ -100,6 +251,15 @@ static int RHmsg_get_ack(struct RHmsg *self, void *request)
 	string[size] = '\0';
 	zmq_msg_close(&self->frame[0]);
 
+	/* drop any further frame of the answer */
+	while (zmq_getsockopt(request, ZMQ_RCVMORE, &more, &optlen) == 0 && more) {
+		zmq_msg_init (&self->frame[0]);
+		rc = zmq_msg_recv(&self->frame[0], request, 0);
+		zmq_msg_close(&self->frame[0]);
+		if (rc == -1)
+			break;
+	}
+
 	/*
 	 * Check if the remote send a new timeout
 	 */
@@ -124,42 +284,119 @@ static int RHmsg_get_ack(struct RHmsg *self, void *request)
 			timeout = newtimeout;
 	}
 
+	/*
+	 * A remote process able to answer DATA
+	 * messages in a row offers a window,
+	 * for example "ACK:2000:window=16"
+	 */
+	if (window && (offer = strstr(string, "window=")) != NULL) {
+		unsigned long w = strtoul(offer + strlen("window="), NULL, 10);
+
+		if (w > 0)
+			*window = min(w, (unsigned long)REMOTE_MAX_WINDOW);
+	}
+
 	free(string);
 
 	return 0;
 }
 
-static int forward_data(void *request, const void *buf, size_t len)
+/*
+ * Send the filled buffer as DATA message
+ */
+static int send_data(struct remote_conn *conn)
 {
 	struct RHmsg RHmessage;
 	int ret;
 
-	if (!request)
-		return -EFAULT;
-
 	RHset_command(&RHmessage, "DATA");
-	RHset_payload(&RHmessage, buf, len);
-	ret = RHmsg_send_cmd(&RHmessage, request);
+	ret = RHset_pool_payload(&RHmessage, &conn->pool, conn->cur, conn->used);
+	conn->cur = NULL;
+	conn->used = 0;
+	if (ret) {
+		zmq_msg_close(&RHmessage.frame[FRAME_CMD]);
+		return ret;
+	}
+	ret = RHmsg_send_cmd(&RHmessage, conn->request);
 	if (ret)
 		return ret;
+	conn->pending++;
 
-	ret = RHmsg_get_ack(&RHmessage, request);
+	while (conn->pending >= conn->window) {
+		ret = RHmsg_get_ack(&RHmessage, conn->request, NULL);
+		if (ret)
+			return ret;
+		conn->pending--;
+	}
 
-	return ret;
+	return 0;
+}
+
+static int forward_data(void *data, const void *buf, size_t len)
+{
+	struct remote_conn *conn = (struct remote_conn *)data;
+	const char *p = buf;
+	size_t n;
+	int ret;
+
+	if (!conn || !conn->request)
+		return -EFAULT;
+
+	while (len) {
+		if (!conn->cur) {
+			conn->cur = pool_get(&conn->pool);
+			if (!conn->cur) {
+				ERROR("Timeout sending data to the remote installer");
+				return -ETIMEDOUT;
+			}
+		}
+		n = min(len, conn->pool.size - conn->used);
+		memcpy(conn->cur + conn->used, p, n);
+		conn->used += n;
+		p += n;
+		len -= n;
+		if (conn->used == conn->pool.size) {
+			ret = send_data(conn);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
 }
 
 static int install_remote_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
-	void *context = zmq_ctx_new();
-	void *request = zmq_socket (context, ZMQ_REQ);
+	void *context;
+	void *request;
 	char *connect_string;
 	int len;
 	int ret = 0;
 	struct RHmsg RHmessage;
+	struct remote_conn conn = {
+		.fd = -1,
+		.window = 1,
+	};
 	char bufcmd[80];
+	const char *payload = dict_get_value(&img->properties, "payload-size");
+	size_t payload_size = payload ? ustrtoull(payload, NULL, 0) : REMOTE_PAYLOAD_SIZE;
+
+	if (!payload_size) {
+		ERROR("Invalid payload-size %s", payload);
+		return -EINVAL;
+	}
+	if (pool_init(&conn.pool, payload_size)) {
+		ERROR("Not enough memory");
+		pool_free(&conn.pool);
+		return -ENOMEM;
+	}
 
-	len = strlen(img->type_data) + strlen(get_tmpdir()) + strlen("ipc://") + 4;
+	context = zmq_ctx_new();
+	request = zmq_socket (context, ZMQ_DEALER);
+	conn.request = request;
+
+	len = strlen(IMG_STRING(img->type_data)) + strlen(get_tmpdir()) + strlen("ipc://") + 4;
 
 	/*
 	 * Allocate maximum string
@@ -167,10 +404,11 @@ static int install_remote_image(struct img_type *img,
 	connect_string = malloc(len);
 	if (!connect_string) {
 		ERROR("Not enough memory");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto cleanup;
 	}
 	snprintf(connect_string, len, "ipc://%s%s", get_tmpdir(),
-			img->type_data);
+			IMG_STRING(img->type_data));
 
 	ret = zmq_connect(request, connect_string);
 	if (ret < 0) {
@@ -188,14 +426,31 @@ static int install_remote_image(struct img_type *img,
 	RHset_command(&RHmessage, bufcmd);
 	RHset_payload(&RHmessage, NULL, 0);
 	RHmsg_send_cmd(&RHmessage, request);
-	if (RHmsg_get_ack(&RHmessage, request))
-		return -ENODEV;
-
-	ret = copyimage(request, img, forward_data);
+	if (RHmsg_get_ack(&RHmessage, request, &conn.window)) {
+		ret = -ENODEV;
+		goto cleanup;
+	}
+	if (conn.window > 1)
+		TRACE("Remote %s accepts %u DATA messages in a row",
+		      connect_string, conn.window);
+
+	ret = copyimage(&conn, img, forward_data);
+	if (!ret && conn.used)
+		ret = send_data(&conn);
+	if (conn.cur)
+		pool_put(conn.cur, &conn.pool);
+
+	/* wait for the outstanding ACKs */
+	while (!ret && conn.pending) {
+		ret = RHmsg_get_ack(&RHmessage, request, NULL);
+		conn.pending--;
+	}
 
 cleanup:
+	free(connect_string);
 	zmq_close(request);
 	zmq_ctx_destroy(context);
+	pool_free(&conn.pool);
 
 	return ret;
 }
@@ -40,7 +40,7 @@ static int execute_shell_script(struct img_type *img, const char *fnname)
 		return -1;
 	}
 	snprintf(shellscript, sizeof(shellscript),
-		 "%s%s %s %s", tmp, img->fname, fnname, img->type_data);
+		 "%s%s %s %s", tmp, img->fname, fnname, IMG_STRING(img->type_data));
 
 	ret = run_system_cmd(shellscript);
 
@@ -0,0 +1,315 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+/*
+ * This handler does not install, it takes a snapshot of a LVM thin
+ * volume or of a btrfs subvolume before the images and files are
+ * installed into it in place. If the update fails, the snapshot is
+ * restored. If it succeeds, a bootloader variable tells how to boot
+ * the snapshot, so that the bootloader can fall back to it if the new
+ * software does not start.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+#include "swupdate.h"
+#include "handler.h"
+#include "util.h"
+#include "pctl.h"
+
+#define DEFAULT_BOOTENV		"swupdate_snapshot"
+#define DEFAULT_LVM_SUFFIX	"-swupdate"
+#define DEFAULT_BTRFS_NAME	".swupdate-snapshot"
+
+void snapshot_handler(void);
+
+enum snapshot_fstype {
+	SNAPSHOT_LVM,
+	SNAPSHOT_BTRFS
+};
+
+struct snapshot {
+	enum snapshot_fstype fstype;
+	char origin[PATH_MAX];		/* vg/lv or path of the subvolume */
+	char name[PATH_MAX];		/* vg/lv or path of the snapshot */
+	unsigned long long subvolid;
+	LIST_ENTRY(snapshot) next;
+};
+
+/* Snapshots taken by the running update */
+static LIST_HEAD(, snapshot) snapshots;
+
+/* The names are passed to the LVM tools, only their charset is accepted */
+static bool valid_lvm_name(const char *name)
+{
+	if (!strlen(name) || name[0] == '-')
+		return false;
+	return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		      "0123456789+_.-") == strlen(name);
+}
+
+static int lvm_snapshot(struct img_type *img, struct snapshot *snap, char *bootval,
+			size_t len)
+{
+	const char *origin = img->device, *name;
+	char vg[NAME_MAX], lv[NAME_MAX], cmd[3 * PATH_MAX];
+	const char *slash;
+
+	if (!strncmp(origin, "/dev/", 5))
+		origin += 5;
+	slash = strchr(origin, '/');
+	if (!slash || (size_t)(slash - origin) >= sizeof(vg) ||
+	    strlen(slash + 1) >= sizeof(lv)) {
+		ERROR("%s is not a logical volume (vg/lv)", img->device);
+		return -EINVAL;
+	}
+	memcpy(vg, origin, slash - origin);
+	vg[slash - origin] = '\0';
+	strlcpy(lv, slash + 1, sizeof(lv));
+
+	name = dict_get_value(&img->properties, "name");
+	if (name)
+		snprintf(snap->name, sizeof(snap->name), "%s/%s", vg, name);
+	else
+		snprintf(snap->name, sizeof(snap->name), "%s/%s" DEFAULT_LVM_SUFFIX, vg, lv);
+	if (!valid_lvm_name(vg) || !valid_lvm_name(lv) ||
+	    !valid_lvm_name(strchr(snap->name, '/') + 1)) {
+		ERROR("Invalid name of logical volume: %s, %s", img->device, snap->name);
+		return -EINVAL;
+	}
+	snprintf(snap->origin, sizeof(snap->origin), "%s/%s", vg, lv);
+
+	/* the snapshot of the previous update is replaced */
+	snprintf(cmd, sizeof(cmd), "/dev/%s", snap->name);
+	if (!access(cmd, F_OK)) {
+		snprintf(cmd, sizeof(cmd), "lvremove -qq -y %s", snap->name);
+		if (run_system_cmd(cmd)) {
+			ERROR("Previous snapshot %s cannot be removed", snap->name);
+			return -EFAULT;
+		}
+	}
+
+	/* thin snapshot, activated as any other volume */
+	snprintf(cmd, sizeof(cmd), "lvcreate -qq -s -kn -n %s %s",
+		 strchr(snap->name, '/') + 1, snap->origin);
+	if (run_system_cmd(cmd)) {
+		ERROR("Snapshot of %s cannot be created", snap->origin);
+		return -EFAULT;
+	}
+	snprintf(bootval, len, "root=/dev/%s", snap->name);
+
+	return 0;
+}
+
+static int lvm_restore(struct snapshot *snap)
+{
+	char cmd[PATH_MAX + 32];
+
+	/* if the origin is in use, it is merged when it is activated again */
+	snprintf(cmd, sizeof(cmd), "lvconvert -qq --merge %s", snap->name);
+
+	return run_system_cmd(cmd) ? -EFAULT : 0;
+}
+
+static int btrfs_subvolid(const char *path, unsigned long long *id)
+{
+	struct btrfs_ioctl_ino_lookup_args args = {
+		.treeid = 0,
+		.objectid = BTRFS_FIRST_FREE_OBJECTID
+	};
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) < 0)
+		ret = -errno;
+	else
+		*id = args.treeid;
+	close(fd);
+
+	return ret;
+}
+
+static int btrfs_snapshot(struct img_type *img, struct snapshot *snap, char *bootval,
+			  size_t len)
+{
+	struct btrfs_ioctl_vol_args_v2 args;
+	struct btrfs_ioctl_vol_args del;
+	char dir[PATH_MAX], base[PATH_MAX];
+	const char *name, *parent;
+	int srcfd = -1, dirfd = -1, ret = 0;
+
+	strlcpy(snap->origin, img->device, sizeof(snap->origin));
+	name = dict_get_value(&img->properties, "name");
+	if (name)
+		strlcpy(snap->name, name, sizeof(snap->name));
+	else
+		snprintf(snap->name, sizeof(snap->name), "%s/" DEFAULT_BTRFS_NAME, snap->origin);
+
+	strlcpy(dir, snap->name, sizeof(dir));
+	strlcpy(base, snap->name, sizeof(base));
+	parent = dirname(dir);
+	name = basename(base);
+	if (strlen(name) > BTRFS_SUBVOL_NAME_MAX) {
+		ERROR("Name of the snapshot too long: %s", snap->name);
+		return -EINVAL;
+	}
+
+	srcfd = open(snap->origin, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dirfd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (srcfd < 0 || dirfd < 0) {
+		ERROR("%s cannot be opened: %s", srcfd < 0 ? snap->origin : parent,
+		      strerror(errno));
+		ret = -ENOENT;
+		goto out;
+	}
+
+	/* the snapshot of the previous update is replaced */
+	if (!access(snap->name, F_OK)) {
+		memset(&del, 0, sizeof(del));
+		strlcpy(del.name, name, sizeof(del.name));
+		if (ioctl(dirfd, BTRFS_IOC_SNAP_DESTROY, &del) < 0) {
+			ERROR("Previous snapshot %s cannot be removed: %s", snap->name,
+			      strerror(errno));
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	/* writable, the bootloader can mount it as it is */
+	memset(&args, 0, sizeof(args));
+	args.fd = srcfd;
+	strlcpy(args.name, name, sizeof(args.name));
+	if (ioctl(dirfd, BTRFS_IOC_SNAP_CREATE_V2, &args) < 0) {
+		ERROR("Snapshot of %s cannot be created: %s", snap->origin, strerror(errno));
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = btrfs_subvolid(snap->name, &snap->subvolid);
+	if (ret) {
+		ERROR("Subvolume of %s not found", snap->name);
+		goto out;
+	}
+	snprintf(bootval, len, "rootflags=subvolid=%llu", snap->subvolid);
+
+out:
+	if (srcfd >= 0)
+		close(srcfd);
+	if (dirfd >= 0)
+		close(dirfd);
+
+	return ret;
+}
+
+static int btrfs_restore(struct snapshot *snap)
+{
+	__u64 id = snap->subvolid;
+	int fd, ret = 0;
+
+	/* mounted from the next boot on, unless a subvolume is requested */
+	fd = open(snap->origin, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || ioctl(fd, BTRFS_IOC_DEFAULT_SUBVOL, &id) < 0)
+		ret = -errno;
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+static int snapshot(struct img_type *img,
+	void __attribute__ ((__unused__)) *data)
+{
+	char bootval[PATH_MAX + 32];
+	struct snapshot *snap;
+	const char *value;
+	int ret;
+
+	if (!strlen(img->device)) {
+		ERROR("Volume to be snapshotted not set");
+		return -EINVAL;
+	}
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return -ENOMEM;
+
+	value = dict_get_value(&img->properties, "fstype");
+	if (!value || !strcmp(value, "lvm")) {
+		snap->fstype = SNAPSHOT_LVM;
+		ret = lvm_snapshot(img, snap, bootval, sizeof(bootval));
+	} else if (!strcmp(value, "btrfs")) {
+		snap->fstype = SNAPSHOT_BTRFS;
+		ret = btrfs_snapshot(img, snap, bootval, sizeof(bootval));
+	} else {
+		ERROR("Snapshots on %s are not supported", value);
+		ret = -EINVAL;
+	}
+	if (ret) {
+		free(snap);
+		return ret;
+	}
+	INFO("Snapshot %s of %s created", snap->name, snap->origin);
+	LIST_INSERT_HEAD(&snapshots, snap, next);
+
+	/* written with the other variables if the update succeeds */
+	value = dict_get_value(&img->properties, "bootenv");
+	if (!value)
+		value = DEFAULT_BOOTENV;
+	if (strlen(value) && img->bootloader &&
+	    dict_set_value(img->bootloader, value, bootval)) {
+		ERROR("Bootloader variable %s cannot be set", value);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * A failed update is rolled back to the snapshots, the changes written
+ * in place are dropped when the volumes are used the next time
+ */
+static int snapshot_commit(bool apply)
+{
+	struct snapshot *snap, *tmp;
+	int ret = 0;
+
+	LIST_FOREACH_SAFE(snap, &snapshots, next, tmp) {
+		if (!apply) {
+			if ((snap->fstype == SNAPSHOT_LVM ? lvm_restore(snap) :
+			     btrfs_restore(snap))) {
+				ERROR("%s cannot be restored from %s", snap->origin, snap->name);
+				ret = -1;
+			} else
+				WARN("%s restored from %s from the next boot on",
+				     snap->origin, snap->name);
+		}
+		LIST_REMOVE(snap, next);
+		free(snap);
+	}
+
+	return ret;
+}
+
+__attribute__((constructor))
+void snapshot_handler(void)
+{
+	register_handler("snapshot", snapshot,
+				PARTITION_HANDLER | NO_DATA_HANDLER, NULL);
+	register_commit_hook(snapshot_commit);
+}
@@ -15,8 +15,9 @@
  *
  * This handler spawns a task to provide callback with libcurl.
  * The main task has an own callback for copyimage(), and
- * writes into cretated FIFOs (one for each remote device)
- * because the connections to devices is asynchrounous.
+ * writes into a ring buffer shared by all remote devices,
+ * where each connection has its own read position because
+ * the connections to devices is asynchrounous.
  *
  */
 
@@ -39,6 +40,23 @@
 
 void swuforward_handler(void);
 
+#define DEFAULT_SLACK	(1024 * 1024)
+
+/*
+ * The SWU is copied once into the ring. The writer waits only
+ * when the slowest connection still reading is a whole ring
+ * (the slack) behind, so a slow device does not stop the others
+ * until then.
+ */
+struct swuforward_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;
+	size_t size;
+	unsigned long long head;	/* bytes written so far */
+	bool stop;			/* writer gave up */
+};
+
 /*
  * global handler data
  *
@@ -46,6 +64,7 @@ void swuforward_handler(void);
 struct hnd_priv {
 	unsigned int maxwaitms;	/* maximum time in CURL wait */
 	struct listconns conns;	/* list of connections */
+	struct swuforward_ring ring;
 };
 
 /*
@@ -55,6 +74,8 @@ struct hnd_priv {
 static size_t curl_read_data(char *buffer, size_t size, size_t nmemb, void *userp)
 {
 	struct curlconn *conn = (struct curlconn *)userp;
+	struct swuforward_ring *ring;
+	size_t off, first;
 	ssize_t nbytes;
 
 	if (!nmemb)
@@ -68,17 +89,33 @@ static size_t curl_read_data(char *buffer, size_t size, size_t nmemb, void *user
 		nbytes =  conn->total_bytes;
 	else
 		nbytes = nmemb * size;
+	if (!nbytes)
+		return 0;
 
-	nbytes = read(conn->fifo[0], buffer, nbytes);
-	if (nbytes == -1 && errno == EAGAIN) {
-		TRACE("No data, try again");
-		nbytes = 0;
-	}
-
-	if (nbytes < 0) {
-		ERROR("Cannot read from FIFO");
+	ring = conn->ring;
+	pthread_mutex_lock(&ring->lock);
+	while (conn->ring_pos == ring->head && !ring->stop)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	if (conn->ring_pos == ring->head) {
+		pthread_mutex_unlock(&ring->lock);
 		return CURL_READFUNC_ABORT;
 	}
+	nbytes = min((unsigned long long)nbytes, ring->head - conn->ring_pos);
+	pthread_mutex_unlock(&ring->lock);
+
+	/*
+	 * The data up to head cannot be overwritten until
+	 * ring_pos is moved forward
+	 */
+	off = conn->ring_pos % ring->size;
+	first = min((size_t)nbytes, ring->size - off);
+	memcpy(buffer, ring->buf + off, first);
+	memcpy(buffer + first, ring->buf, nbytes - first);
+
+	pthread_mutex_lock(&ring->lock);
+	conn->ring_pos += nbytes;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
 
 	nmemb = nbytes / size;
 
@@ -88,39 +125,78 @@ static size_t curl_read_data(char *buffer, size_t size, size_t nmemb, void *user
 }
 
 /*
- * This is the copyimage's callback. When called,
- * there is a buffer to be passed to curl connections
+ * Lowest read position of the connections still reading,
+ * head if there is none
  */
-static int swu_forward_data(void *data, const void *buf, size_t len)
+static unsigned long long ring_tail(struct hnd_priv *priv, bool *readers)
 {
-	struct hnd_priv *priv = (struct hnd_priv *)data;
-	ssize_t written;
+	unsigned long long tail = priv->ring.head;
 	struct curlconn *conn;
-	int index = 0;
 
-	/*
-	 * Iterate all connection and copy the incoming buffer
-	 * to the corresponding FIFO.
-	 * Each connection has own FIFO to transfer the data
-	 * to the curl thread
-	 */
+	*readers = false;
 	LIST_FOREACH(conn, &priv->conns, next) {
-		unsigned int nbytes = len;
-		const void *tmp = buf;
+		if (!conn->reading)
+			continue;
+		*readers = true;
+		if (conn->ring_pos < tail)
+			tail = conn->ring_pos;
+	}
 
-		while (nbytes) {
-			written = write(conn->fifo[1], buf, len);
+	return tail;
+}
 
-			if (written < 0) {
-				ERROR ("Cannot write to fifo %d", index);
-				return -EFAULT;
-			}
-			nbytes -= written;
-			tmp += written;
+/*
+ * This is the copyimage's callback. When called,
+ * there is a buffer to be passed to curl connections
+ */
+static int swu_forward_data(void *data, const void *buf, size_t len)
+{
+	struct hnd_priv *priv = (struct hnd_priv *)data;
+	struct swuforward_ring *ring = &priv->ring;
+	const char *src = buf;
+	bool readers;
+	int ret = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	while (len) {
+		unsigned long long tail = ring_tail(priv, &readers);
+		size_t space, off, n;
+
+		if (!readers) {
+			ERROR("No connection is receiving the SWU anymore");
+			ret = -EFAULT;
+			break;
+		}
+		space = ring->size - (ring->head - tail);
+		if (!space) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+			continue;
 		}
+		off = ring->head % ring->size;
+		n = min(len, space);
+		n = min(n, ring->size - off);
+
+		/* nobody reads beyond head, copy without the lock */
+		pthread_mutex_unlock(&ring->lock);
+		memcpy(ring->buf + off, src, n);
+		pthread_mutex_lock(&ring->lock);
+
+		ring->head += n;
+		src += n;
+		len -= n;
+		pthread_cond_broadcast(&ring->cond);
 	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return ret;
+}
 
-	return 0;
+static void ring_stop(struct swuforward_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->stop = true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
 }
 
 /*
@@ -217,7 +293,10 @@ static void *curl_transfer_thread(void *p)
 	conn->exitval = SUCCESS;
 
 curl_thread_exit:
-	close(conn->fifo[0]);
+	pthread_mutex_lock(&conn->ring->lock);
+	conn->reading = false;
+	pthread_cond_broadcast(&conn->ring->cond);
+	pthread_mutex_unlock(&conn->ring->lock);
 	curl_easy_cleanup(conn->curl_handle);
 	pthread_exit(NULL);
 }
@@ -294,6 +373,7 @@ static int install_remote_swu(struct img_type *img,
 	int index = 0;
 	pthread_attr_t attr;
 	int thread_ret = -1;
+	const char *slack;
 
 	/*
 	 * A single SWU can contains encrypted artifacts,
@@ -319,6 +399,20 @@ static int install_remote_swu(struct img_type *img,
 	/* Reset list of connections */
 	LIST_INIT(&priv.conns);
 
+	memset(&priv.ring, 0, sizeof(priv.ring));
+	pthread_mutex_init(&priv.ring.lock, NULL);
+	pthread_cond_init(&priv.ring.cond, NULL);
+	priv.ring.size = DEFAULT_SLACK;
+	slack = dict_get_value(&img->properties, "slack");
+	if (slack)
+		priv.ring.size = ustrtoull(slack, NULL, 10);
+	priv.ring.buf = priv.ring.size ? malloc(priv.ring.size) : NULL;
+	if (!priv.ring.buf) {
+		ERROR("Cannot allocate %zu bytes to forward the SWU", priv.ring.size);
+		ret = -ENOMEM;
+		goto handler_exit;
+	}
+
 	/* initialize CURL */
 	ret = curl_global_init(CURL_GLOBAL_DEFAULT);
 	if (ret != CURLE_OK) {
@@ -346,18 +440,11 @@ static int install_remote_swu(struct img_type *img,
 		conn->url = url->value;
 		conn->total_bytes = img->size;
 		conn->SWUpdateStatus = IDLE;
+		conn->ring = &priv.ring;
+		conn->reading = true;
 
 		LIST_INSERT_HEAD(&priv.conns, conn, next);
 
-		/*
-		 * Create one FIFO for each connection to be thread safe
-		 */
-		if (pipe(conn->fifo) < 0) {
-			ERROR("Cannot create internal pipes, exit..");
-			ret = FAILURE;
-			goto handler_exit;
-		}
-
 		pthread_attr_init(&attr);
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
@@ -366,6 +453,7 @@ static int install_remote_swu(struct img_type *img,
 			ERROR("Code from pthread_create() is %d",
 				thread_ret);
 			conn->transfer_thread = 0;
+			conn->reading = false;
 			ret = FAILURE;
 			goto handler_exit;
 		}
@@ -390,7 +478,7 @@ static int install_remote_swu(struct img_type *img,
 	LIST_FOREACH(conn, &priv.conns, next) {
 		void *status;
 		ret = pthread_join(conn->transfer_thread, &status);
-		close(conn->fifo[1]);
+		conn->transfer_thread = 0;
 		if (ret) {
 			ERROR("return code from pthread_join() is %d", ret);
 			ret = FAILURE;
@@ -408,13 +496,20 @@ static int install_remote_swu(struct img_type *img,
 	}
 
 handler_exit:
+	/* transfer threads still waiting for data must give up */
+	ring_stop(&priv.ring);
 	LIST_FOREACH_SAFE(conn, &priv.conns, next, tmp) {
 		index = 0;
+		if (conn->transfer_thread)
+			pthread_join(conn->transfer_thread, NULL);
 		LIST_REMOVE(conn, next);
 		swuforward_ws_free(conn);
 		free(conn);
 		index++;
 	}
+	free(priv.ring.buf);
+	pthread_cond_destroy(&priv.ring.cond);
+	pthread_mutex_destroy(&priv.ring.lock);
 
 	return ret;
 }
@@ -423,5 +518,5 @@ __attribute__((constructor))
 void swuforward_handler(void)
 {
 	register_handler("swuforward", install_remote_swu,
-				IMAGE_HANDLER, NULL);
+				IMAGE_HANDLER | STREAM_HANDLER, NULL);
 }
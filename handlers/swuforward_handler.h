@@ -38,6 +38,8 @@ typedef enum {
 	WS_CLOSED
 } SWUPDATE_WS_CONNECTION;
 
+struct swuforward_ring;
+
 /*
  * Track each connection
  * The handler maintains a list of connections and sends the SWU
@@ -50,7 +52,9 @@ struct curlconn {
 	const void *buffer;	/* temporary buffer to transfer image */
 	unsigned int nbytes;	/* bytes to be transferred */
 	size_t total_bytes;	/* size of SWU image */
-	int fifo[2];		/* Pipe for IPC */
+	struct swuforward_ring *ring;	/* buffer shared by all connections */
+	unsigned long long ring_pos;	/* bytes read from ring */
+	bool reading;		/* transfer thread still reads from ring */
 	char *url;		/* URL for forwarding */
 	bool gotMsg;		/* set if the remote board has sent a new msg */
 	RECOVERY_STATUS SWUpdateStatus;	/* final status of update */
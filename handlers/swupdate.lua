@@ -227,7 +227,7 @@ swupdate.HANDLER_MASK = {
 swupdate.register_handler = function(name, funcptr, mask) end
 
 
---- Lua equivalent of `struct img_type {...}` as in `include/swupdate.h` plus `read()` and `copy2file()` functions.
+--- Lua equivalent of `struct img_type {...}` as in `include/swupdate.h` plus `read()`, `read_buffer()` and `copy2file()` functions.
 --- @class img_type
 --- @field name                  string    `sw-component` name to check with `sw-versions`
 --- @field version               string    `sw-component` version to check with `sw-versions`
@@ -277,9 +277,31 @@ local img_type = {
     --- @return number              # 0 on success, -1 on error
     --- @return string | nil        # nil on success, error message on failure
     ['read'] = function(self, callback) end,
+
+    --- Process the current image artifact in Lua without copying it.
+    --
+    -- As `read()`, but the `callback = function(buf) ... end` is fed
+    -- a `swupdate.buffer` pointing to the chunked artifact data instead
+    -- of a `string`. The buffer is only valid during the callback.
+    --
+    --- @param  self      img_type  This `img_type` instance
+    --- @param  callback  function  Callback `function(buf) ... end` that is fed the current image artifact in chunks.
+    --- @return number              # 0 on success, -1 on error
+    --- @return string | nil        # nil on success, error message on failure
+    ['read_buffer'] = function(self, callback) end,
 }
 
 
+--- Artifact chunk passed to the callback of `img_type:read_buffer()`.
+--- @class swupdate.buffer
+--- @field len       fun(self: swupdate.buffer): number                          Chunk size, as `#buf`
+--- @field sub       fun(self: swupdate.buffer, i?: number, j?: number): string  As `string.sub()`
+--- @field byte      fun(self: swupdate.buffer, i?: number, j?: number): number  As `string.byte()`
+--- @field tostring  fun(self: swupdate.buffer): string                          Copy of the chunk
+--- @field write     fun(self: swupdate.buffer, file: file*): boolean | nil, string | nil  Write the chunk to `file`
+--- @field ptr       fun(self: swupdate.buffer): lightuserdata, number           Chunk data and size
+
+
 --- @class swupdate.handler
 --- Chain-callable SWUpdate Handlers (Non-exhaustive).
 --
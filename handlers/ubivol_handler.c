@@ -13,15 +13,24 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <mtd/mtd-user.h>
 #include "swupdate.h"
 #include "handler.h"
 #include "flash.h"
 #include "util.h"
+#include "content_check.h"
 
 void ubi_handler(void);
 
+/*
+ * Images in different install groups may be installed concurrently:
+ * the lists of volumes are shared, so they are walked and changed
+ * only with this lock held. Writing into a volume runs unlocked.
+ */
+static pthread_mutex_t ubi_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct ubi_part *search_volume(const char *str, struct ubilist *list)
 {
 	struct ubi_part *vol;
@@ -33,22 +42,33 @@ static struct ubi_part *search_volume(const char *str, struct ubilist *list)
 	return NULL;
 }
 
-/* search a UBI volume by name across all mtd partitions */
+/*
+ * search a UBI volume by name across all mtd partitions,
+ * devices are scanned only until the volume is found
+ */
 static struct ubi_part *search_volume_global(const char *str)
 {
 	struct flash_description *flash = get_flash_info();
 	struct mtd_info *mtd_info = &flash->mtd;
 	struct mtd_ubi_info *mtd_ubi_info;
-	struct ubi_part *ubivol;
+	struct ubi_part *ubivol = NULL;
 	int i;
 
+	if (mtd_load_table())
+		return NULL;
+
+	pthread_mutex_lock(&ubi_lock);
 	for (i = mtd_info->lowest_mtd_num; i <= mtd_info->highest_mtd_num; i++) {
-		mtd_ubi_info = &flash->mtd_info[i];
+		mtd_ubi_info = mtd_get_ubi_device(i);
+		if (!mtd_ubi_info)
+			continue;
 		ubivol = search_volume(str, &mtd_ubi_info->ubi_partitions);
 		if (ubivol)
-			return ubivol;
+			break;
 	}
-	return NULL;
+	pthread_mutex_unlock(&ubi_lock);
+
+	return ubivol;
 }
 
 /**
@@ -95,37 +115,119 @@ static int check_replace(struct img_type *img,
 	return 0;
 }
 
+/*
+ * Renames are not done when a volume is written, but collected per
+ * UBI device and applied with one atomic UBI_IOCRNVOL request at the
+ * end of the installation, so the names never show an intermediate
+ * state and every device is renamed with a single ioctl.
+ */
+struct ubi_rename {
+	int dev_num;
+	struct ubi_rnvol_req req;
+	LIST_ENTRY(ubi_rename) next;
+};
+
+LIST_HEAD(ubi_renames, ubi_rename);
+
+static struct ubi_renames renames = LIST_HEAD_INITIALIZER(renames);
+
+static int queue_rename(int dev_num, int vol_id, const char *name)
+{
+	struct ubi_rename *rn;
+	int i;
+
+	LIST_FOREACH(rn, &renames, next) {
+		if (rn->dev_num == dev_num)
+			break;
+	}
+	if (!rn) {
+		rn = (struct ubi_rename *)calloc(1, sizeof(*rn));
+		if (!rn) {
+			ERROR("No memory: malloc failed");
+			return -ENOMEM;
+		}
+		rn->dev_num = dev_num;
+		LIST_INSERT_HEAD(&renames, rn, next);
+	}
+
+	for (i = 0; i < rn->req.count; i++) {
+		if (rn->req.ents[i].vol_id == vol_id) {
+			ERROR("UBI volume %d on ubi%d is renamed twice", vol_id, dev_num);
+			return -EINVAL;
+		}
+	}
+	if (rn->req.count >= UBI_MAX_RNVOL) {
+		ERROR("Too many UBI volumes renamed on ubi%d", dev_num);
+		return -EINVAL;
+	}
+
+	rn->req.ents[i].vol_id = vol_id;
+	rn->req.ents[i].name_len = min(strlen(name), (size_t)UBI_MAX_VOLUME_NAME);
+	strlcpy(rn->req.ents[i].name, name, sizeof(rn->req.ents[i].name));
+	rn->req.count++;
+
+	return 0;
+}
+
 /**
- * swap_volnames - swap the names of the given volumes
+ * swap_volnames - queue the swap of the names of the given volumes
  * @vol1: first volume
  * @vol2: second volume
  *
  * Return: 0 if OK, <0 otherwise
  */
-static int swap_volnames(libubi_t libubi,
-			 struct ubi_vol_info *vol1,
+static int swap_volnames(struct ubi_vol_info *vol1,
 			 struct ubi_vol_info *vol2)
 {
-	struct ubi_rnvol_req rnvol;
-	char masternode[64];
+	int ret;
 
-	snprintf(masternode, sizeof(masternode),
-		 "/dev/ubi%d", vol1->dev_num);
+	if (vol1->dev_num != vol2->dev_num) {
+		ERROR("%s and %s are not on the same UBI device",
+		      vol1->name, vol2->name);
+		return -EINVAL;
+	}
 
-	TRACE("replace: swapping UBI volume names %s <-> %s on %s",
-	      vol1->name, vol2->name, masternode);
+	TRACE("swapping UBI volume names %s <-> %s on ubi%d",
+	      vol1->name, vol2->name, vol1->dev_num);
 
-	rnvol.ents[0].vol_id = vol1->vol_id;
-	rnvol.ents[0].name_len = strlen(vol2->name);
-	strcpy(rnvol.ents[0].name, vol2->name);
+	pthread_mutex_lock(&ubi_lock);
+	ret = queue_rename(vol1->dev_num, vol1->vol_id, vol2->name);
+	if (!ret)
+		ret = queue_rename(vol2->dev_num, vol2->vol_id, vol1->name);
+	pthread_mutex_unlock(&ubi_lock);
 
-	rnvol.ents[1].vol_id = vol2->vol_id;
-	rnvol.ents[1].name_len = strlen(vol1->name);
-	strcpy(rnvol.ents[1].name, vol1->name);
+	return ret;
+}
 
-	rnvol.count = 2;
+/*
+ * Apply the queued renames, or drop them if the installation failed
+ */
+static int commit_renames(bool apply)
+{
+	struct flash_description *flash = get_flash_info();
+	struct ubi_rename *rn, *tmp;
+	char masternode[64];
+	int ret = 0;
+
+	pthread_mutex_lock(&ubi_lock);
+	LIST_FOREACH_SAFE(rn, &renames, next, tmp) {
+		if (apply && !ret) {
+			snprintf(masternode, sizeof(masternode), "/dev/ubi%d",
+				 rn->dev_num);
+			TRACE("renaming %d UBI volumes on %s", rn->req.count,
+			      masternode);
+			if (ubi_rnvols(flash->libubi, masternode, &rn->req)) {
+				ERROR("failed to rename UBI volumes on %s", masternode);
+				ret = -1;
+			}
+			ubi_invalidate(rn->dev_num);
+		}
+		LIST_REMOVE(rn, next);
+		free(rn);
+	}
+	pthread_mutex_unlock(&ubi_lock);
 
-	return ubi_rnvols(libubi, masternode, &rnvol);
+	return ret;
 }
 
 /**
@@ -139,6 +241,67 @@ static bool check_ubi_alwaysremove(struct img_type *img)
 	return strtobool(dict_get_value(&img->properties, "always-remove"));
 }
 
+/*
+ * The volume is written in batches of whole LEBs: UBI programs one
+ * LEB at a time, and larger writes need fewer system calls than the
+ * chunks coming from the copy pipeline.
+ */
+struct ubi_out {
+	int fdout;	/* must be first, see copyimage() */
+	unsigned char *buf;
+	size_t size;
+	size_t len;
+};
+
+static int ubi_write(void *out, const void *buf, size_t len)
+{
+	struct ubi_out *u = (struct ubi_out *)out;
+	const unsigned char *p = buf;
+	size_t n;
+
+	while (len) {
+		n = min(len, u->size - u->len);
+		memcpy(u->buf + u->len, p, n);
+		u->len += n;
+		p += n;
+		len -= n;
+		if (u->len == u->size) {
+			if (copy_write(&u->fdout, u->buf, u->len) < 0)
+				return -1;
+			u->len = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int ubi_copyimage(int fdout, struct img_type *img,
+			 struct ubi_vol_info *vol)
+{
+	const char *bufsize = dict_get_value(&img->properties, "copy-buffer-size");
+	struct ubi_out u = {
+		.fdout = fdout,
+	};
+	size_t leb = vol->leb_size > 0 ? vol->leb_size : 1;
+	int ret;
+
+	u.size = copy_buffer_size(fdout, bufsize ? ustrtoull(bufsize, NULL, 0) : 0);
+	u.size = max(leb, u.size / leb * leb);
+	u.buf = malloc(u.size);
+	if (!u.buf) {
+		ERROR("OOM allocating %zu bytes for UBI volume", u.size);
+		return -ENOMEM;
+	}
+
+	ret = copyimage(&u, img, ubi_write);
+	if (!ret && u.len && copy_write(&u.fdout, u.buf, u.len) < 0)
+		ret = -1;
+
+	free(u.buf);
+
+	return ret;
+}
+
 static int update_volume(libubi_t libubi, struct img_type *img,
 	struct ubi_vol_info *vol)
 {
@@ -192,6 +355,7 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 		ERROR("cannot open UBI volume \"%s\"", node);
 		return -1;
 	}
+	content_check_invalidate(node);
 	err = ubi_update_start(libubi, fdout, bytes);
 	if (err) {
 		ERROR("cannot start volume \"%s\" update", node);
@@ -204,14 +368,14 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 
 	TRACE("Updating UBI : %s %lld",
 			img->fname, bytes);
-	if (copyimage(&fdout, img, NULL) < 0) {
+	if (ubi_copyimage(fdout, img, vol) < 0) {
 		ERROR("Error copying extracted file");
 		err = -1;
 	}
 
 	/* handle replace */
 	if(repl_vol) {
-		err = swap_volnames(libubi, vol, repl_vol);
+		err = swap_volnames(vol, repl_vol);
 		if(err)
 			ERROR("replace: failed to swap volume names %s<->%s: %d",
 			      vol->name, repl_vol->name, err);
@@ -221,7 +385,7 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 	return err;
 }
 
-static int resize_volume(struct img_type *cfg, long long size)
+static int __resize_volume(struct img_type *cfg, long long size)
 {
 	struct flash_description *nandubi = get_flash_info();
 	struct ubi_part *ubivol;
@@ -233,7 +397,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 	struct flash_description *flash = get_flash_info();
 
 	/* determine the requested volume type */
-	if (!strcmp(cfg->type_data, "static"))
+	if (!strcmp(IMG_STRING(cfg->type_data), "static"))
 		req_vol_type = UBI_STATIC_VOLUME;
 	else
 		req_vol_type = UBI_DYNAMIC_VOLUME;
@@ -247,14 +411,13 @@ static int resize_volume(struct img_type *cfg, long long size)
 		/* Allow device to be specified by name OR number */
 		mtdnum = get_mtd_from_name(cfg->device);
 	}
-	if (mtdnum < 0 || !mtd_dev_present(flash->libmtd, mtdnum)) {
+	if (mtdnum < 0 || !mtd_dev_present(flash->libmtd, mtdnum) ||
+	    !(mtd_info = mtd_get_ubi_device(mtdnum))) {
 		ERROR("%s does not exist: partitioning not possible",
 			cfg->device);
 		return -ENODEV;
 	}
 
-	mtd_info = &nandubi->mtd_info[mtdnum];
-
 	/*
 	 * Search for volume with the same name
 	 */
@@ -262,7 +425,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 	for(ubivol = mtd_info->ubi_partitions.lh_first;
 		ubivol != NULL;
 		ubivol = ubivol->next.le_next) {
-		if (strcmp(ubivol->vol_info.name, cfg->volname) == 0) {
+		if (strcmp(ubivol->vol_info.name, IMG_STRING(cfg->volname)) == 0) {
 			break;
 		}
 	}
@@ -288,6 +451,9 @@ static int resize_volume(struct img_type *cfg, long long size)
 			return 0;
 		}
 
+		snprintf(node, sizeof(node), "/dev/ubi%d_%d", ubivol->vol_info.dev_num,
+			 ubivol->vol_info.vol_id);
+		content_check_invalidate(node);
 		snprintf(node, sizeof(node), "/dev/ubi%d", ubivol->vol_info.dev_num);
 		err = ubi_rmvol(nandubi->libubi, node, ubivol->vol_info.vol_id);
 		if (err) {
@@ -313,7 +479,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 		req.vol_id = UBI_VOL_NUM_AUTO;
 		req.alignment = 1;
 		req.bytes = size;
-		req.name = cfg->volname;
+		req.name = IMG_STRING(cfg->volname);
 		err = ubi_mkvol(nandubi->libubi, node, &req);
 		if (err < 0) {
 			ERROR("cannot create %s UBI volume %s of %lld bytes",
@@ -335,6 +501,9 @@ static int resize_volume(struct img_type *cfg, long long size)
 				"newly created UBI volume");
 			return err;
 		}
+		snprintf(node, sizeof(node), "/dev/ubi%d_%d", ubivol->vol_info.dev_num,
+			 ubivol->vol_info.vol_id);
+		content_check_invalidate(node);
 		LIST_INSERT_HEAD(&mtd_info->ubi_partitions, ubivol, next);
 		TRACE("Created %s UBI volume %s of %lld bytes (old size %lld)",
 			  (req_vol_type == UBI_DYNAMIC_VOLUME) ? "dynamic" : "static",
@@ -362,9 +531,9 @@ static int wait_volume(struct img_type *img)
 	struct stat buf;
 	char node[64];
 
-	ubivol = search_volume_global(img->volname);
+	ubivol = search_volume_global(IMG_STRING(img->volname));
 	if (!ubivol) {
-		ERROR("can't found volume %s", img->volname);
+		ERROR("can't found volume %s", IMG_STRING(img->volname));
 		return -1;
 	}
 
@@ -387,6 +556,17 @@ static int wait_volume(struct img_type *img)
 	return ret;
 }
 
+static int resize_volume(struct img_type *cfg, long long size)
+{
+	int ret;
+
+	pthread_mutex_lock(&ubi_lock);
+	ret = __resize_volume(cfg, size);
+	pthread_mutex_unlock(&ubi_lock);
+
+	return ret;
+}
+
 static int install_ubivol_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
@@ -401,25 +581,25 @@ static int install_ubivol_image(struct img_type *img,
 
 		ret = resize_volume(img, bytes);
 		if (ret < 0) {
-			ERROR("Can't resize ubi volume %s", img->volname);
+			ERROR("Can't resize ubi volume %s", IMG_STRING(img->volname));
 			return -1;
 		}
 
 		ret = wait_volume(img);
 		if (ret < 0) {
-			ERROR("can't found ubi volume %s", img->volname);
+			ERROR("can't found ubi volume %s", IMG_STRING(img->volname));
 			return -1;
 		}
 	}
 
 	/* find the volume to be updated */
-	ubivol = search_volume_global(img->volname);
+	ubivol = search_volume_global(IMG_STRING(img->volname));
 
 	if (!ubivol) {
 		ERROR("Image %s should be stored in volume "
 			"%s, but no volume found",
 			img->fname,
-				img->volname);
+				IMG_STRING(img->volname));
 		return -1;
 	}
 	ret = update_volume(flash->libubi, img,
@@ -434,36 +614,14 @@ static int adjust_volume(struct img_type *cfg,
 	return resize_volume(cfg, cfg->partsize);
 }
 
-static int ubi_volume_get_info(char *name, int *dev_num, int *vol_id)
-{
-	struct ubi_part *ubi_part;
-
-	ubi_part = search_volume_global(name);
-	if (!ubi_part) {
-		ERROR("could not found UBI volume %s", name);
-		return -1;
-	}
-
-	*dev_num = ubi_part->vol_info.dev_num;
-	*vol_id  = ubi_part->vol_info.vol_id;
-
-	return 0;
-}
-
 static int swap_volume(struct img_type *img, void *data)
 {
 	struct script_handler_data *script_data;
-	struct flash_description *flash = get_flash_info();
-	libubi_t libubi = flash->libubi;
 	int num, count = 0;
 	struct dict_list *volumes;
 	struct dict_list_elem *volume;
-	char *name[2];
-	int dev_num[2], vol_id[2], global_dev_num = -1;
+	struct ubi_part *vol[2];
 	char prop[SWUPDATE_GENERAL_STRING_SIZE];
-	char masternode[UBI_MAX_VOLUME_NAME+1];
-	struct ubi_rnvol_req rnvol;
-	int ret = -1;
 
 	if (!data)
 		return -EINVAL;
@@ -484,84 +642,53 @@ static int swap_volume(struct img_type *img, void *data)
 
 		if (count >= (UBI_MAX_RNVOL / 2)) {
 			ERROR("Too many requested swap");
-			goto out;
+			return -1;
 		}
 
 		num = 0;
 		LIST_FOREACH(volume, volumes, next) {
 			if (num >= 2) {
 				ERROR("Too many ubi volume (%s)", prop);
-				goto out;
+				return -1;
 			}
 
-			name[num] = volume->value;
-			if (ubi_volume_get_info(volume->value,
-						&dev_num[num],
-						&vol_id[num]) < 0)
-				goto out;
+			vol[num] = search_volume_global(volume->value);
+			if (!vol[num]) {
+				ERROR("could not found UBI volume %s", volume->value);
+				return -1;
+			}
 
 			num++;
 		}
 
 		if (num != 2) {
 			ERROR("Invalid number (%d) of ubi volume (%s)", num, prop);
-			goto out;
-		}
-
-		if (dev_num[0] != dev_num[1]) {
-			ERROR("both volume should be on the same UBI device");
-			goto out;
-		}
-
-		if (global_dev_num == -1) {
-			global_dev_num = dev_num[0];
-			snprintf(&masternode[0], sizeof(masternode),
-				 "/dev/ubi%d", global_dev_num);
-		} else {
-			if (global_dev_num != dev_num[0]) {
-				ERROR("all volumes should be on the"
-				      "same UBI device (%s)", prop);
-				goto out;
-			}
+			return -1;
 		}
 
-		TRACE("swap UBI volume %s <-> %s", name[0], name[1]);
-
-		/* swap first -> second */
-		rnvol.ents[2 * count + 0].vol_id = vol_id[0];
-		rnvol.ents[2 * count + 0].name_len = min(strlen(name[1]), UBI_MAX_VOLUME_NAME);
-		strlcpy(rnvol.ents[2 * count + 0].name, name[1], UBI_MAX_VOLUME_NAME);
-
-		/* swap second -> first */
-		rnvol.ents[2 * count + 1].vol_id = vol_id[1];
-		rnvol.ents[2 * count + 1].name_len = min(strlen(name[0]), UBI_MAX_VOLUME_NAME);
-		strlcpy(rnvol.ents[2 * count + 1].name, name[0], UBI_MAX_VOLUME_NAME);
+		if (swap_volnames(&vol[0]->vol_info, &vol[1]->vol_info))
+			return -1;
 
 		count++;
 	}
 
 	if (!count) {
 		ERROR("No UBI volume provided");
-		goto out;
+		return -1;
 	}
 
-	rnvol.count = count * 2;
-
-	ret = ubi_rnvols(libubi, masternode, &rnvol);
-	if (ret)
-		ERROR("failed to swap UBI volume names");
-
- out:
-	return ret;
+	return 0;
 }
 
 __attribute__((constructor))
 void ubi_handler(void)
 {
 	register_handler("ubivol", install_ubivol_image,
-				IMAGE_HANDLER, NULL);
+				IMAGE_HANDLER | STREAM_HANDLER | PARALLEL_HANDLER |
+				SKIP_UNCHANGED_HANDLER, NULL);
 	register_handler("ubipartition", adjust_volume,
 				PARTITION_HANDLER | NO_DATA_HANDLER, NULL);
 	register_handler("ubiswap", swap_volume,
 				SCRIPT_HANDLER | NO_DATA_HANDLER, NULL);
+	register_commit_hook(commit_renames);
 }
@@ -39,12 +39,35 @@
  * the modulo-256 sum over all bytes of the message
  * string except for the start marker "$".
  *
+ * Optional extensions, negotiated after $READY; and only used if
+ * the microcontroller confirms them with $READY;<<CS>><CR><LF>:
+ *
+ *   - $BAUD;<rate>;<<CS>><CR><LF> : both sides switch the UART to <rate>,
+ *     the handler then sends $SYNC;<<CS>><CR><LF> at the new speed and
+ *     expects $READY; again.
+ *   - $BLOCK;<size>;<window>;<<CS>><CR><LF> : the image is sent as binary
+ *     blocks instead of records:
+ *         $D<seq><lenhi><lenlo><data><<CS>><CR><LF>
+ *     <seq> is a 8 bit sequence number, <len> (big endian) the size of
+ *     <data>, <<CS>> is computed as for the other messages. Up to <window>
+ *     blocks can be outstanding, the microcontroller acknowledges them with
+ *     $ACK;<seq>;<<CS>><CR><LF> (all blocks up to <seq> are received) or
+ *     asks to resend from <seq> with $NAK;<seq>;<<CS>><CR><LF>. After the
+ *     last block the handler sends $END;<<CS>><CR><LF> and waits for
+ *     $COMPLETED;.
+ *
+ * If the microcontroller refuses an extension, the default protocol
+ * at 115200 baud is used.
+ *
  * The handler expects to get in the properties the setup for the reset
  * and prog gpios. They should be in this format:
  *
  * properties = {
  * 	reset = "<gpiodevice>:<gpionumber>:<activelow>";
  * 	prog = "<gpiodevice>:<gpionumber>:<activelow>";
+ * 	baudrate = "<speed>";		(optional)
+ * 	block-size = "<bytes>";		(optional, enables block mode)
+ * 	window = "<blocks>";		(optional, default 4)
  * }
  *
  * Example:
@@ -79,6 +102,13 @@
 #define RESET_CONSUMER	"swupdate-uc-handler"
 #define PROG_CONSUMER	RESET_CONSUMER
 #define DEFAULT_TIMEOUT 2
+#define DEFAULT_BAUDRATE	115200
+#define DEFAULT_WINDOW	4
+#define MAX_BLOCK_SIZE	4096
+#define MAX_WINDOW	16
+#define MAX_RETRIES	3
+/* $D + seq + 2 bytes length + data + checksum + CR/LF (+ '\0' from sprintf) */
+#define BLOCK_OVERHEAD	(5 + 2 + 2 + 1)
 
 void ucfw_handler(void);
 
@@ -107,6 +137,19 @@ struct handler_priv {
 	unsigned int timeout;
 	char buf[1024];	/* enough for 3 records */
 	unsigned int nbytes;
+	unsigned int baudrate;
+	/* block mode, active if block_size != 0 */
+	unsigned int block_size;
+	unsigned int window;
+	char *blocks;		/* window frames, kept until acknowledged */
+	unsigned int blen[MAX_WINDOW];
+	uint8_t base;		/* oldest unacknowledged sequence */
+	uint8_t next;		/* sequence of the block being filled */
+	unsigned int outstanding;
+	unsigned int fill;
+	bool completed;
+	char rx[128];
+	unsigned int rxlen;
 };
 
 static int switch_mode(char *devreset, int resoffset, char *devprog, int progoffset, int mode)
@@ -227,17 +270,66 @@ static int insert_chksum(char *buf, unsigned int len)
 	return len;
 }
 
-static int set_uart (int fd)
+static speed_t baud_to_speed(unsigned int baudrate)
+{
+	static const struct {
+		unsigned int rate;
+		speed_t speed;
+	} speeds[] = {
+		{ 9600, B9600 },
+		{ 19200, B19200 },
+		{ 38400, B38400 },
+		{ 57600, B57600 },
+		{ 115200, B115200 },
+		{ 230400, B230400 },
+#ifdef B460800
+		{ 460800, B460800 },
+#endif
+#ifdef B921600
+		{ 921600, B921600 },
+#endif
+#ifdef B1000000
+		{ 1000000, B1000000 },
+#endif
+#ifdef B1500000
+		{ 1500000, B1500000 },
+#endif
+#ifdef B2000000
+		{ 2000000, B2000000 },
+#endif
+#ifdef B3000000
+		{ 3000000, B3000000 },
+#endif
+#ifdef B4000000
+		{ 4000000, B4000000 },
+#endif
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(speeds); i++)
+		if (speeds[i].rate == baudrate)
+			return speeds[i].speed;
+
+	return B0;
+}
+
+static int set_uart (int fd, unsigned int baudrate)
 {
 	struct termios tty;
+	speed_t speed = baud_to_speed(baudrate);
+
+	if (speed == B0) {
+		ERROR("Unsupported baudrate %u", baudrate);
+		return -EINVAL;
+	}
 
 	if (tcgetattr (fd, &tty) < 0) {
 		printf ("Error from tcgetattr: %s\n", strerror (errno));
 		return -1;
 	}
 
-	 cfsetospeed (&tty, (speed_t) B115200);
-	 cfsetispeed (&tty, (speed_t) B115200);
+	 cfsetospeed (&tty, speed);
+	 cfsetispeed (&tty, speed);
 
 	 tty.c_cflag |= (CLOCAL | CREAD);	/* ignore modem controls */
 	 tty.c_cflag &= ~CSIZE;
@@ -363,14 +455,331 @@ static int write_msg(int fd, const char *msg)
 	int len, ret;
 	char *buf;
 
-	buf = strdup(msg);
+	/* room for checksum, CR/LF and the terminator */
+	len = strlen(msg);
+	buf = malloc(len + 5);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, msg, len);
 
-	len = insert_chksum(buf, strlen(buf));
+	len = insert_chksum(buf, len);
 	ret = write_data(fd, buf, len);
 	free(buf);
 	return ret;
 }
 
+/*
+ * Block mode: answers can be sent back to back, so they are
+ * split on <LF> instead of relying on one read() per message.
+ */
+static int receive_line(struct handler_priv *priv, char *msg, size_t size)
+{
+	fd_set fds;
+	struct timeval tv;
+	char *eol;
+	unsigned int len;
+	int ret;
+
+	for (;;) {
+		eol = memchr(priv->rx, '\n', priv->rxlen);
+		if (eol) {
+			len = eol - priv->rx + 1;
+			if (len < size) {
+				memcpy(msg, priv->rx, len);
+				msg[len] = '\0';
+			}
+			memmove(priv->rx, eol + 1, priv->rxlen - len);
+			priv->rxlen -= len;
+			if (len >= size || msg[0] != '$') {
+				ERROR("Malformed answer from microcontroller");
+				return -EBADMSG;
+			}
+			if (priv->debug)
+				dump_ascii(true, msg, len);
+			if (!verify_chksum(msg, &len))
+				return -EBADMSG;
+			return 0;
+		}
+
+		if (priv->rxlen == sizeof(priv->rx))
+			priv->rxlen = 0;
+
+		FD_ZERO(&fds);
+		FD_SET(priv->fduart, &fds);
+		tv.tv_sec = priv->timeout;
+		tv.tv_usec = 0;
+		ret = select(priv->fduart + 1, &fds, NULL, NULL, &tv);
+		if (ret == 0)
+			return -ETIMEDOUT;
+		if (ret < 0)
+			return -errno;
+
+		ret = read(priv->fduart, priv->rx + priv->rxlen,
+			   sizeof(priv->rx) - priv->rxlen);
+		if (ret <= 0) {
+			ERROR("Error in read: %d", ret);
+			return -EBADMSG;
+		}
+		priv->rxlen += ret;
+	}
+}
+
+static char *block_frame(struct handler_priv *priv, uint8_t seq)
+{
+	return priv->blocks + (seq % priv->window) *
+		(priv->block_size + BLOCK_OVERHEAD);
+}
+
+static int send_frame(struct handler_priv *priv, uint8_t seq)
+{
+	char *frame = block_frame(priv, seq);
+	unsigned int len = priv->blen[seq % priv->window];
+
+	if (priv->debug)
+		TRACE("TX: block %u, %u bytes", seq, len);
+
+	return write_data(priv->fduart, frame, len);
+}
+
+static int resend_from(struct handler_priv *priv, uint8_t seq)
+{
+	uint8_t s;
+	int ret;
+
+	for (s = seq; s != (uint8_t)(priv->base + priv->outstanding); s++) {
+		ret = send_frame(priv, s);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for one answer and slide the window. It returns
+ * after the window has moved or an error occurred.
+ */
+static int wait_ack(struct handler_priv *priv)
+{
+	char msg[80];
+	unsigned int retries = 0;
+	unsigned int acked;
+	uint8_t seq;
+	int ret;
+
+	for (;;) {
+		ret = receive_line(priv, msg, sizeof(msg));
+		if (ret == -ETIMEDOUT) {
+			if (++retries > MAX_RETRIES) {
+				ERROR("Timeout, no answer from microcontroller");
+				return -EPROTO;
+			}
+			WARN("No ack for block %u, resending %u blocks",
+			     priv->base, priv->outstanding);
+			ret = resend_from(priv, priv->base);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		if (ret < 0)
+			return ret;
+
+		if (!strcmp(msg, "$COMPLETED;")) {
+			priv->completed = true;
+			priv->outstanding = 0;
+			return 0;
+		}
+
+		if (!strncmp(msg, "$ACK;", 5)) {
+			seq = strtoul(&msg[5], NULL, 10);
+			acked = (uint8_t)(seq - priv->base) + 1;
+			if (acked > priv->outstanding) {
+				/* duplicate or stale ack, ignore it */
+				continue;
+			}
+			priv->base += acked;
+			priv->outstanding -= acked;
+			return 0;
+		}
+
+		if (!strncmp(msg, "$NAK;", 5)) {
+			seq = strtoul(&msg[5], NULL, 10);
+			if ((uint8_t)(seq - priv->base) >= priv->outstanding) {
+				ERROR("NAK for block %u outside the window", seq);
+				return -EPROTO;
+			}
+			if (++retries > MAX_RETRIES) {
+				ERROR("Block %u refused by microcontroller", seq);
+				return -EPROTO;
+			}
+			/* blocks before seq are received */
+			acked = (uint8_t)(seq - priv->base);
+			priv->base += acked;
+			priv->outstanding -= acked;
+			ret = resend_from(priv, seq);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		ERROR("Unexpected answer %s", msg);
+		return -EBADMSG;
+	}
+}
+
+static int send_block(struct handler_priv *priv)
+{
+	char *frame;
+	unsigned int len;
+	int ret;
+
+	if (priv->completed) {
+		ERROR("Microcontroller completed before the end of the image");
+		return -EPROTO;
+	}
+
+	frame = block_frame(priv, priv->next);
+	frame[2] = priv->next;
+	frame[3] = (priv->fill >> 8) & 0xff;
+	frame[4] = priv->fill & 0xff;
+	len = insert_chksum(frame, 5 + priv->fill);
+	priv->blen[priv->next % priv->window] = len;
+
+	ret = send_frame(priv, priv->next);
+	if (ret < 0)
+		return ret;
+
+	priv->outstanding++;
+	priv->next++;
+	priv->fill = 0;
+
+	/* the slot of the next block must not be in use anymore */
+	while (priv->outstanding == priv->window) {
+		ret = wait_ack(priv);
+		if (ret < 0)
+			return ret;
+	}
+
+	frame = block_frame(priv, priv->next);
+	frame[0] = '$';
+	frame[1] = 'D';
+
+	return 0;
+}
+
+static int update_fw_blocks(struct handler_priv *priv, const char *buf,
+			    size_t size)
+{
+	unsigned int len;
+	int ret;
+
+	while (size > 0) {
+		len = priv->block_size - priv->fill;
+		if (size < len)
+			len = size;
+		memcpy(block_frame(priv, priv->next) + 5 + priv->fill, buf, len);
+		priv->fill += len;
+		buf += len;
+		size -= len;
+		if (priv->fill == priv->block_size) {
+			ret = send_block(priv);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int finish_blocks(struct handler_priv *priv)
+{
+	char msg[80];
+	int ret;
+
+	if (priv->fill) {
+		ret = send_block(priv);
+		if (ret < 0)
+			return ret;
+	}
+	while (priv->outstanding) {
+		ret = wait_ack(priv);
+		if (ret < 0)
+			return ret;
+	}
+	if (priv->completed)
+		return 0;
+
+	ret = write_msg(priv->fduart, "$END;");
+	if (ret < 0)
+		return ret;
+	ret = receive_line(priv, msg, sizeof(msg));
+	if (ret < 0 || strcmp(msg, "$COMPLETED;")) {
+		ERROR("Microcontroller did not confirm the firmware");
+		return ret < 0 ? ret : -EBADMSG;
+	}
+
+	return 0;
+}
+
+static int negotiate_baudrate(struct handler_priv *priv)
+{
+	char msg[128];
+	int ret;
+
+	snprintf(msg, sizeof(msg), "$BAUD;%u;", priv->baudrate);
+	ret = write_msg(priv->fduart, msg);
+	if (ret < 0)
+		return ret;
+	ret = receive_msg(priv->fduart, msg, sizeof(msg), priv->timeout, priv->debug);
+	if (ret < 0 || strcmp(msg, "$READY;")) {
+		WARN("Microcontroller refused %u baud, staying at %u",
+		     priv->baudrate, DEFAULT_BAUDRATE);
+		priv->baudrate = DEFAULT_BAUDRATE;
+		return 0;
+	}
+
+	tcdrain(priv->fduart);
+	ret = set_uart(priv->fduart, priv->baudrate);
+	if (ret < 0)
+		return ret;
+
+	ret = write_msg(priv->fduart, "$SYNC;");
+	if (ret < 0)
+		return ret;
+	ret = receive_msg(priv->fduart, msg, sizeof(msg), priv->timeout, priv->debug);
+	if (ret < 0 || strcmp(msg, "$READY;")) {
+		ERROR("No answer from microcontroller at %u baud", priv->baudrate);
+		return -EPROTO;
+	}
+	INFO("Microcontroller UART switched to %u baud", priv->baudrate);
+
+	return 0;
+}
+
+static void negotiate_blocks(struct handler_priv *priv)
+{
+	char msg[128];
+	int ret;
+
+	snprintf(msg, sizeof(msg), "$BLOCK;%u;%u;", priv->block_size, priv->window);
+	ret = write_msg(priv->fduart, msg);
+	if (!ret)
+		ret = receive_msg(priv->fduart, msg, sizeof(msg),
+				  priv->timeout, priv->debug);
+	if (!ret && !strcmp(msg, "$READY;"))
+		priv->blocks = malloc(priv->window *
+				      (priv->block_size + BLOCK_OVERHEAD));
+
+	if (!priv->blocks) {
+		WARN("Block mode not available, sending records");
+		priv->block_size = 0;
+		return;
+	}
+
+	priv->blocks[0] = '$';
+	priv->blocks[1] = 'D';
+}
+
 static int prepare_update(struct handler_priv *priv, 
 			  struct img_type *img)
 {
@@ -393,7 +802,7 @@ static int prepare_update(struct handler_priv *priv,
 		return -ENODEV;
 	}
 
-	set_uart(priv->fduart);
+	set_uart(priv->fduart, DEFAULT_BAUDRATE);
 
 	/* No FW data to be sent */
 	priv->nbytes = 0;
@@ -404,6 +813,15 @@ static int prepare_update(struct handler_priv *priv,
 	if (len < 0 || strcmp(msg, "$READY;"))
 		return -EBADMSG;
 
+	if (priv->baudrate != DEFAULT_BAUDRATE) {
+		ret = negotiate_baudrate(priv);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (priv->block_size)
+		negotiate_blocks(priv);
+
 	return 0;
 }
 
@@ -416,6 +834,9 @@ static int update_fw(void *data, const void *buffer, size_t size)
 	struct handler_priv *priv = (struct handler_priv *)data;
 	const char *buf = (const char *)buffer;
 
+	if (priv->block_size)
+		return update_fw_blocks(priv, buf, size);
+
 	while (size > 0) {
 		c = buf[cnt++];
 		priv->buf[priv->nbytes++] = c;
@@ -448,7 +869,9 @@ static int finish_update(struct handler_priv *priv)
 {
 	int ret;
 
-	close(priv->fduart);
+	if (priv->fduart > 0)
+		close(priv->fduart);
+	free(priv->blocks);
 	ret = switch_mode(priv->reset.gpiodev, priv->reset.offset,
 			  priv->prog.gpiodev, priv->prog.offset, MODE_NORMAL);
 	if (ret < 0) {
@@ -506,6 +929,7 @@ static int install_uc_firmware_image(struct img_type *img,
 	unsigned int cnt;
 	int ret = 0;
 	struct mode_setup *gpio;
+	const char *value;
 
 	memset(&hnd_data, 0, sizeof(hnd_data));
 	hnd_data.timeout = DEFAULT_TIMEOUT;
@@ -552,6 +976,35 @@ static int install_uc_firmware_image(struct img_type *img,
 			hnd_data.timeout = strtoul(entry->value, NULL, 10);
 	}
 
+	hnd_data.baudrate = DEFAULT_BAUDRATE;
+	value = dict_get_value(&img->properties, "baudrate");
+	if (value) {
+		hnd_data.baudrate = strtoul(value, NULL, 10);
+		if (baud_to_speed(hnd_data.baudrate) == B0) {
+			ERROR("Unsupported baudrate %s", value);
+			return -EINVAL;
+		}
+	}
+
+	value = dict_get_value(&img->properties, "block-size");
+	if (value) {
+		hnd_data.block_size = strtoul(value, NULL, 10);
+		if (hnd_data.block_size > MAX_BLOCK_SIZE) {
+			ERROR("block-size %u too big, max %u",
+			      hnd_data.block_size, MAX_BLOCK_SIZE);
+			return -EINVAL;
+		}
+	}
+
+	hnd_data.window = DEFAULT_WINDOW;
+	value = dict_get_value(&img->properties, "window");
+	if (value)
+		hnd_data.window = strtoul(value, NULL, 10);
+	if (!hnd_data.window || hnd_data.window > MAX_WINDOW) {
+		ERROR("window must be between 1 and %u", MAX_WINDOW);
+		return -EINVAL;
+	}
+
 	ret = prepare_update(&hnd_data, img);
 	if (ret) {
 		ERROR("Prepare failed !!");
@@ -559,6 +1012,8 @@ static int install_uc_firmware_image(struct img_type *img,
 	}
 
 	ret = copyimage(&hnd_data, img, update_fw);
+	if (!ret && hnd_data.block_size)
+		ret = finish_blocks(&hnd_data);
 	if (ret) {
 		ERROR("Transferring image to uController was not successful");
 		goto handler_exit;
@@ -575,5 +1030,5 @@ __attribute__((constructor))
 void ucfw_handler(void)
 {
 	register_handler("ucfw", install_uc_firmware_image,
-				IMAGE_HANDLER, NULL);
+				IMAGE_HANDLER | PARALLEL_HANDLER, NULL);
 }
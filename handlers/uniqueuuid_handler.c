@@ -19,23 +19,26 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
-#include <blkid/blkid.h>
 #include <sys/types.h>
 #include "swupdate.h"
 #include "handler.h"
 #include "util.h"
+#include "blkdev_cache.h"
 
 void uniqueuuid_handler(void);
 
+static int report_uuid(const char *devname, void *data)
+{
+	ERROR("UUID=%s not unique on %s !", (const char *)data, devname);
+	return 0;
+}
+
 static int uniqueuuid(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
 	struct dict_list *uuids;
 	struct dict_list_elem *uuid;
-	blkid_cache cache = NULL;
-	blkid_dev_iterate	iter;
-	blkid_dev		dev;
-	int ret = 0;
+	int ret = 0, found;
 
 	uuids = dict_get_list(&img->properties, "fs-uuid");
 	if (!uuids) {
@@ -43,23 +46,13 @@ static int uniqueuuid(struct img_type *img,
 		return -EINVAL;
 	}
 
-	blkid_get_cache(&cache, NULL);
-
-	blkid_probe_all(cache);
-
 	LIST_FOREACH(uuid, uuids, next) {
-		iter = blkid_dev_iterate_begin(cache);
-		blkid_dev_set_search(iter, "UUID", uuid->value);
-
-		while (blkid_dev_next(iter, &dev) == 0) {
-			dev = blkid_verify(cache, dev);
-			if (!dev)
-				continue;
-			ERROR("UUID=%s not unique on %s !", uuid->value,
-				blkid_dev_devname(dev));
+		found = blkdev_cache_find("UUID", uuid->value, report_uuid,
+					  uuid->value);
+		if (found < 0)
+			return found;
+		if (found)
 			ret = -EAGAIN;
-		}
-		blkid_dev_iterate_end(iter);
 	}
 
 	return ret;
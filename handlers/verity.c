@@ -0,0 +1,379 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ *
+ * dm-verity hash tree generated while a raw image is written, instead
+ * of running "veritysetup format" on the device after the update and
+ * reading the whole image again. The hashes of the data blocks are
+ * kept in memory (32 bytes for each 4 KiB block), the upper levels are
+ * computed from them when the image is complete.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "swupdate.h"
+#include "util.h"
+#include "sslapi.h"
+#include "swupdate_membudget.h"
+#include "blkdev_cache.h"
+#include "verity.h"
+
+#define VERITY_BLOCK_SIZE	4096
+#define VERITY_DIGEST_SIZE	SHA256_HASH_LENGTH
+#define VERITY_HASHES_PER_BLOCK	(VERITY_BLOCK_SIZE / VERITY_DIGEST_SIZE)
+#define VERITY_MAX_LEVELS	63
+#define VERITY_MAX_SALT		256
+#define VERITY_DEFAULT_SALT	32
+
+/* On disk superblock, as written by veritysetup */
+struct verity_sb {
+	uint8_t signature[8];	/* "verity\0\0" */
+	uint32_t version;
+	uint32_t hash_type;	/* 1: salt before the data */
+	uint8_t uuid[16];
+	uint8_t algorithm[32];
+	uint32_t data_block_size;
+	uint32_t hash_block_size;
+	uint64_t data_blocks;
+	uint16_t salt_size;
+	uint8_t pad1[6];
+	uint8_t salt[VERITY_MAX_SALT];
+	uint8_t pad2[168];
+} __attribute__((packed));
+
+struct verity_tree {
+	const char *fname;
+	void *dgst;
+	unsigned char salt[VERITY_MAX_SALT];
+	size_t salt_size;
+	size_t filled;		/* bytes of the current data block */
+	unsigned char *hashes;	/* hashes of the data blocks */
+	size_t nblocks;
+	size_t allocated;
+};
+
+static int verity_block_start(struct verity_tree *tree)
+{
+	if (swupdate_HASH_reset(tree->dgst) < 0)
+		return -EFAULT;
+	if (tree->salt_size &&
+	    swupdate_HASH_update(tree->dgst, tree->salt, tree->salt_size) < 0)
+		return -EFAULT;
+
+	return 0;
+}
+
+static int verity_block_end(struct verity_tree *tree, unsigned char *md)
+{
+	unsigned char md_value[64];
+	unsigned int md_len;
+
+	if (swupdate_HASH_final(tree->dgst, md_value, &md_len) < 0 ||
+	    md_len != VERITY_DIGEST_SIZE)
+		return -EFAULT;
+	memcpy(md, md_value, VERITY_DIGEST_SIZE);
+
+	return 0;
+}
+
+static int verity_hash_block(struct verity_tree *tree, const unsigned char *buf,
+			     unsigned char *md)
+{
+	if (verity_block_start(tree) ||
+	    swupdate_HASH_update(tree->dgst, buf, VERITY_BLOCK_SIZE) < 0)
+		return -EFAULT;
+
+	return verity_block_end(tree, md);
+}
+
+static int verity_parse_salt(struct verity_tree *tree, const char *salt)
+{
+	size_t len;
+
+	if (!salt) {
+		tree->salt_size = VERITY_DEFAULT_SALT;
+		if (getrandom(tree->salt, tree->salt_size, 0) !=
+		    (ssize_t)tree->salt_size) {
+			ERROR("%s: cannot generate the salt: %s", tree->fname,
+			      strerror(errno));
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	/* "-" means no salt, like for veritysetup */
+	if (!strcmp(salt, "-"))
+		return 0;
+
+	len = strlen(salt);
+	if (len % 2 || len / 2 > VERITY_MAX_SALT ||
+	    ascii_to_bin(tree->salt, len / 2, salt) < 0) {
+		ERROR("%s: invalid verity-salt %s", tree->fname, salt);
+		return -EINVAL;
+	}
+	tree->salt_size = len / 2;
+
+	return 0;
+}
+
+int verity_start(struct img_type *img, struct verity_tree **tree)
+{
+	struct verity_tree *t;
+	int ret;
+
+	*tree = NULL;
+	if (!strtobool(dict_get_value(&img->properties, "verity")))
+		return 0;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+	t->fname = img->fname;
+
+	ret = verity_parse_salt(t, dict_get_value(&img->properties, "verity-salt"));
+	if (ret)
+		goto out;
+
+	t->dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!t->dgst) {
+		ERROR("%s: dm-verity hash cannot be computed", img->fname);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	*tree = t;
+
+	return 1;
+
+out:
+	verity_free(t);
+	return ret;
+}
+
+int verity_update(struct verity_tree *tree, const void *buf, size_t len)
+{
+	unsigned char *hashes;
+	size_t n;
+
+	while (len) {
+		if (!tree->filled && verity_block_start(tree))
+			return -EFAULT;
+		n = min(len, VERITY_BLOCK_SIZE - tree->filled);
+		if (swupdate_HASH_update(tree->dgst, buf, n) < 0)
+			return -EFAULT;
+		tree->filled += n;
+		buf += n;
+		len -= n;
+		if (tree->filled < VERITY_BLOCK_SIZE)
+			continue;
+
+		if (tree->nblocks == tree->allocated) {
+			n = tree->allocated ? tree->allocated * 2 : 1024;
+			hashes = realloc(tree->hashes, n * VERITY_DIGEST_SIZE);
+			if (!hashes) {
+				ERROR("OOM for the dm-verity hashes of %s", tree->fname);
+				return -ENOMEM;
+			}
+			membudget_charge((n - tree->allocated) * VERITY_DIGEST_SIZE);
+			tree->hashes = hashes;
+			tree->allocated = n;
+		}
+		if (verity_block_end(tree, tree->hashes + tree->nblocks * VERITY_DIGEST_SIZE))
+			return -EFAULT;
+		tree->nblocks++;
+		tree->filled = 0;
+	}
+
+	return 0;
+}
+
+static int verity_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -EIO;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static void verity_fill_sb(struct verity_tree *tree, struct verity_sb *sb)
+{
+	memset(sb, 0, sizeof(*sb));
+	memcpy(sb->signature, "verity", 6);
+	sb->version = htole32(1);
+	sb->hash_type = htole32(1);
+	if (getrandom(sb->uuid, sizeof(sb->uuid), 0) == sizeof(sb->uuid)) {
+		sb->uuid[6] = (sb->uuid[6] & 0x0f) | 0x40;
+		sb->uuid[8] = (sb->uuid[8] & 0x3f) | 0x80;
+	}
+	strlcpy((char *)sb->algorithm, SHA_DEFAULT, sizeof(sb->algorithm));
+	sb->data_block_size = htole32(VERITY_BLOCK_SIZE);
+	sb->hash_block_size = htole32(VERITY_BLOCK_SIZE);
+	sb->data_blocks = htole64(tree->nblocks);
+	sb->salt_size = htole16(tree->salt_size);
+	memcpy(sb->salt, tree->salt, tree->salt_size);
+}
+
+static void verity_set_var(struct img_type *img, const char *prop, const char *value)
+{
+	const char *var = dict_get_value(&img->properties, prop);
+
+	if (!var)
+		return;
+	if (!img->bootloader || dict_set_value(img->bootloader, var, value))
+		WARN("%s: %s cannot be stored in the bootloader environment",
+		     img->fname, var);
+}
+
+int verity_finish(struct verity_tree *tree, struct img_type *img)
+{
+	unsigned char *levels[VERITY_MAX_LEVELS] = { NULL };
+	size_t level_blocks[VERITY_MAX_LEVELS];
+	unsigned char *digests = tree->hashes, *next;
+	unsigned char root[VERITY_DIGEST_SIZE];
+	char roothash[2 * VERITY_DIGEST_SIZE + 1];
+	char salt[2 * VERITY_MAX_SALT + 2];
+	const char *hashdev = dict_get_value(&img->properties, "verity-hash-device");
+	const char *prop = dict_get_value(&img->properties, "verity-hash-offset");
+	const char *sbprop = dict_get_value(&img->properties, "verity-superblock");
+	bool superblock = sbprop ? strtobool(sbprop) : true;
+	unsigned long long offset = prop ? ustrtoull(prop, NULL, 0) : 0;
+	unsigned long long data_end, pos, tree_size = 0;
+	size_t count = tree->nblocks;
+	struct verity_sb sb;
+	int nlevels = 0, i, fd = -1, ret = 0;
+
+	if (tree->filled || !tree->nblocks) {
+		ERROR("%s: size is not a multiple of %d bytes, no dm-verity tree",
+		      img->fname, VERITY_BLOCK_SIZE);
+		return -EINVAL;
+	}
+
+	/* each level is made of the hashes of the blocks below it */
+	while (count > 1) {
+		if (nlevels == VERITY_MAX_LEVELS) {
+			ret = -EINVAL;
+			goto out;
+		}
+		level_blocks[nlevels] = (count + VERITY_HASHES_PER_BLOCK - 1) /
+					VERITY_HASHES_PER_BLOCK;
+		levels[nlevels] = calloc(level_blocks[nlevels], VERITY_BLOCK_SIZE);
+		next = malloc(level_blocks[nlevels] * VERITY_DIGEST_SIZE);
+		if (!levels[nlevels] || !next) {
+			free(next);
+			ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(levels[nlevels], digests, count * VERITY_DIGEST_SIZE);
+		if (digests != tree->hashes)
+			free(digests);
+		digests = next;
+		for (size_t b = 0; b < level_blocks[nlevels]; b++) {
+			if (verity_hash_block(tree, levels[nlevels] + b * VERITY_BLOCK_SIZE,
+					      digests + b * VERITY_DIGEST_SIZE)) {
+				ret = -EFAULT;
+				goto out;
+			}
+		}
+		tree_size += level_blocks[nlevels] * VERITY_BLOCK_SIZE;
+		count = level_blocks[nlevels++];
+	}
+	/* with a single data block, the root is the hash of the block */
+	memcpy(root, digests, VERITY_DIGEST_SIZE);
+
+	if (!hashdev)
+		hashdev = img->device;
+	if (offset % (superblock ? 512 : VERITY_BLOCK_SIZE)) {
+		ERROR("%s: verity-hash-offset %llu is not aligned", img->fname, offset);
+		ret = -EINVAL;
+		goto out;
+	}
+	pos = superblock ? (offset + sizeof(sb) + VERITY_BLOCK_SIZE - 1) /
+			   VERITY_BLOCK_SIZE * VERITY_BLOCK_SIZE : offset;
+	data_end = img->seek + (unsigned long long)tree->nblocks * VERITY_BLOCK_SIZE;
+	if (!strcmp(hashdev, img->device) && offset < data_end &&
+	    pos + tree_size > img->seek) {
+		ERROR("%s: the dm-verity tree at %llu overlaps the image", img->fname,
+		      offset);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	fd = open(hashdev, O_RDWR);
+	if (fd < 0) {
+		ERROR("%s: cannot open %s: %s", img->fname, hashdev, strerror(errno));
+		ret = -ENODEV;
+		goto out;
+	}
+
+	/* the top level comes first */
+	for (i = nlevels - 1; i >= 0 && !ret; i--) {
+		ret = verity_pwrite(fd, levels[i], level_blocks[i] * VERITY_BLOCK_SIZE, pos);
+		pos += level_blocks[i] * VERITY_BLOCK_SIZE;
+	}
+	if (!ret && superblock) {
+		verity_fill_sb(tree, &sb);
+		ret = verity_pwrite(fd, &sb, sizeof(sb), offset);
+	}
+	if (!ret && fdatasync(fd))
+		ret = -EIO;
+	if (ret) {
+		ERROR("%s: cannot write the dm-verity tree to %s: %s", img->fname,
+		      hashdev, strerror(errno));
+		goto out;
+	}
+	if (strcmp(hashdev, img->device))
+		blkdev_cache_invalidate(hashdev);
+
+	hash_to_ascii(root, roothash);
+	if (tree->salt_size) {
+		for (size_t j = 0; j < tree->salt_size; j++)
+			sprintf(&salt[2 * j], "%02x", tree->salt[j]);
+	} else {
+		strcpy(salt, "-");
+	}
+	INFO("%s: dm-verity root hash %s, %zu data blocks, %d levels", img->fname,
+	     roothash, tree->nblocks, nlevels);
+	verity_set_var(img, "verity-roothash-var", roothash);
+	verity_set_var(img, "verity-salt-var", salt);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	if (digests != tree->hashes)
+		free(digests);
+	for (i = 0; i < VERITY_MAX_LEVELS; i++)
+		free(levels[i]);
+
+	return ret;
+}
+
+void verity_free(struct verity_tree *tree)
+{
+	if (!tree)
+		return;
+	if (tree->dgst)
+		swupdate_HASH_cleanup(tree->dgst);
+	membudget_release(tree->allocated * VERITY_DIGEST_SIZE);
+	free(tree->hashes);
+	free(tree);
+}
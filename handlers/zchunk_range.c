@@ -24,6 +24,14 @@
 #include "util.h"
 
 #define BUF_SIZE 32768
+
+/*
+ * Bytes added by the server for each part of a
+ * multipart/byteranges answer (boundary and headers)
+ */
+#define RANGE_PART_OVERHEAD	100
+/* Upper limit for the computed gap threshold */
+#define RANGE_MAX_GAP		(4 * 1024 * 1024)
 static zck_range_item *range_insert_new(zck_range_item *prev,
 				        zck_range_item *next, uint64_t start,
 					uint64_t end) {
@@ -59,7 +67,7 @@ static void range_merge_combined(zck_range *info) {
 		return;
 	}
 	for(zck_range_item *ptr=info->first; ptr;) {
-		if(ptr->next && ptr->end >= ptr->next->start-1) {
+		if(ptr->next && ptr->next->start <= ptr->end + 1 + info->max_gap) {
 			if(ptr->end < ptr->next->end)
 				ptr->end = ptr->next->end;
 			ptr->next = range_remove(ptr->next);
@@ -160,7 +168,8 @@ char *zchunk_get_range_char(zck_range *range) {
 	return output;
 }
 
-zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *first, int max_ranges) {
+zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *first, int max_ranges,
+				    size_t max_gap, zckChunk **next) {
 	if (!zck)
 		return NULL;
 	zck_range *range = calloc(1, sizeof(zck_range));
@@ -168,20 +177,49 @@ zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *first, int max_ranges
 		ERROR ("OOM in %s", __func__);
 		return NULL;
 	}
+	range->max_gap = max_gap;
 
-	for(zckChunk *chk = first ? first : zck_get_first_chunk(zck); chk; chk = zck_get_next_chunk(chk)) {
+	zckChunk *chk;
+	for(chk = first ? first : zck_get_first_chunk(zck); chk; chk = zck_get_next_chunk(chk)) {
 		if (zck_get_chunk_valid(chk))
 			continue;
 		if(!range_add(range, chk)) {
 			zchunk_range_free(&range);
 			return NULL;
 		}
-		if(max_ranges >= 0 && range->count >= max_ranges)
+		if(max_ranges >= 0 && range->count >= max_ranges) {
+			chk = zck_get_next_chunk(chk);
 			break;
+		}
 	}
+	/* First chunk not covered by this range */
+	if (next)
+		*next = chk;
 	return range;
 }
 
 int zchunk_get_range_count(zck_range *range) {
 	return range->count;
 }
+
+/*
+ * Splitting two ranges costs the part overhead and, because a request
+ * carries at most max_ranges ranges, the share of a round trip for an
+ * additional request. Merging costs the time to download the gap.
+ * Each gap is decided independently, so merging all gaps below the
+ * break-even size minimizes the estimated transfer time.
+ */
+size_t zchunk_range_gap_threshold(const zck_range_cost *cost, int max_ranges) {
+	double gap;
+
+	if (!cost || cost->rtt <= 0 || cost->bandwidth <= 0)
+		return 0;
+	if (max_ranges <= 0)
+		max_ranges = 1;
+
+	gap = cost->bandwidth * cost->rtt / max_ranges + RANGE_PART_OVERHEAD;
+	if (gap > RANGE_MAX_GAP)
+		gap = RANGE_MAX_GAP;
+
+	return (size_t)gap;
+}
@@ -23,13 +23,28 @@ typedef struct zck_range_item {
 
 typedef struct zck_range {
     unsigned int count;
+    size_t max_gap;	/* unchanged bytes downloaded to join two ranges */
     zck_range_item *first;
 } zck_range;
 
+/* Network estimation used to compute the gap threshold */
+typedef struct zck_range_cost {
+    double rtt;		/* round trip time of a request in seconds */
+    double bandwidth;	/* bytes per second on a single connection */
+} zck_range_cost;
+
 /* exported function */
 
-/* Get a Range from a zck context */
-zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *chk, int max_ranges);
+/*
+ * Get a Range from a zck context, if next is set it returns
+ * the first chunk that is not covered by the range.
+ * Ranges separated by up to max_gap bytes are merged.
+ */
+zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *chk, int max_ranges,
+				    size_t max_gap, zckChunk **next);
+
+/* Compute the largest gap that is cheaper to download than to split */
+size_t zchunk_range_gap_threshold(const zck_range_cost *cost, int max_ranges);
 
 /* Return number of ranges */
 int zchunk_get_range_count(zck_range *range);
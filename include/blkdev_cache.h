@@ -0,0 +1,43 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _BLKDEV_CACHE_H
+#define _BLKDEV_CACHE_H
+
+/*
+ * Filesystem information of the block devices, probed once for a
+ * running update and shared by the handlers. Supported tags are
+ * "TYPE", "UUID" and "LABEL".
+ */
+
+typedef int (*blkdev_cache_fn)(const char *devname, void *data);
+
+#if defined(CONFIG_BLKDEV_CACHE)
+/* Returns an allocated copy of the value, NULL if not found */
+char *blkdev_cache_get(const char *device, const char *tag);
+
+/*
+ * Calls fn for each block device of the system whose tag is value
+ * and returns the number of matches, or a negative value on error
+ * or if fn has failed.
+ */
+int blkdev_cache_find(const char *tag, const char *value,
+		      blkdev_cache_fn fn, void *data);
+
+/*
+ * Drops what is known about a device after it was written.
+ * NULL drops all devices, for example when a partition
+ * table has changed.
+ */
+void blkdev_cache_invalidate(const char *device);
+void blkdev_cache_free(void);
+#else
+static inline void blkdev_cache_invalidate(const char __attribute__ ((__unused__)) *device) { }
+static inline void blkdev_cache_free(void) { }
+#endif
+
+#endif
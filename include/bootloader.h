@@ -25,6 +25,8 @@ typedef struct {
 	int (*env_unset)(const char *);
 	char* (*env_get)(const char *);
 	int (*apply_list)(const char *);
+	int (*env_begin)(void);
+	int (*env_commit)(bool);
 } bootloader;
 
 /*
@@ -114,3 +116,33 @@ extern char* (*bootloader_env_get)(const char *);
  */
 extern int (*bootloader_apply_list)(const char *);
 
+/*
+ * bootloader_env_invalidate - drop the cached variables
+ *
+ * The values read by the main process are cached until the next
+ * write. This forces them to be read again from the environment,
+ * e.g. when it could have been changed by another process.
+ */
+void bootloader_env_invalidate(void);
+
+/*
+ * bootloader_env_begin - start a transaction
+ *
+ * Until bootloader_env_commit() is called, changes to the environment
+ * are collected in memory and stored at once. Bootloaders without
+ * transactions store each change immediately.
+ *
+ * Return:
+ *   0 on success
+ */
+int bootloader_env_begin(void);
+
+/*
+ * bootloader_env_commit - end a transaction
+ *
+ * @apply : store the changes, or drop them
+ *
+ * Return:
+ *   0 on success
+ */
+int bootloader_env_commit(bool apply);
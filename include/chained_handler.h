@@ -5,9 +5,61 @@
  * SPDX-License-Identifier:     GPL-2.0-only
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "swupdate.h"
+#include "swupdate_timeline.h"
+#include "util.h"
+
 struct chain_handler_data {
 	struct img_type img;
 };
 
 extern void *chain_handler_thread(void *data);
+
+/*
+ * A handler can consume a chained image in the caller's context:
+ * the data is passed with write() as it is produced, instead of
+ * being read by the handler from a pipe in its own thread.
+ * open() returns -EOPNOTSUPP if the image requires the full
+ * handler (the pipe is used then).
+ */
+struct chain_stream_ops {
+	int (*open)(struct img_type *img, void **ctx);
+	int (*write)(void *ctx, const void *buf, size_t len);
+	int (*close)(void *ctx, bool success);
+};
+
+int register_chain_stream(const char *desc, const struct chain_stream_ops *ops);
+
+struct chain_handler {
+	int fd;		/* must be first, see copyimage(): pipe or -1 */
+	struct chain_handler_data data;
+	const struct chain_stream_ops *ops;
+	void *ctx;
+	pthread_t thread;
+	bool active;
+	unsigned long long written;
+	struct timeline_span span;
+	uint64_t start;
+};
+
+/*
+ * Start the handler set in img->type for the chained image img:
+ * the data is then sent with chain_handler_write(), that can be used
+ * as writeimage callback with the chain_handler as output, and
+ * chain_handler_end() waits for the handler's result.
+ */
+int chain_handler_start(struct chain_handler *chain, struct img_type *img);
+int chain_handler_write(void *out, const void *buf, size_t len);
+int chain_handler_end(struct chain_handler *chain, bool success);
+
+/*
+ * Callback to pass to copyfile() / copybuffer(): with the pipe,
+ * copy_write lets them move the data in the kernel.
+ */
+static inline writeimage chain_handler_callback(struct chain_handler *chain)
+{
+	return chain->ops ? chain_handler_write : copy_write;
+}
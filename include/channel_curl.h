@@ -34,6 +34,13 @@ typedef enum {
 	CHANNEL_PARSE_RAW
 } channel_body_t;
 
+typedef enum {
+	CHANNEL_HTTP_DEFAULT,
+	CHANNEL_HTTP_1_1,
+	CHANNEL_HTTP_2,
+	CHANNEL_HTTP_3
+} channel_http_version_t;
+
 #define USE_PROXY_ENV (char *)0x11
 
 typedef struct {
@@ -61,7 +68,9 @@ typedef struct {
 	unsigned int retries;
 	unsigned int low_speed_timeout;
 	unsigned int connection_timeout;
+	unsigned int idle_timeout;	/* max idle time of a reused connection */
 	channel_body_t format;
+	channel_http_version_t http_version;
 	bool debug;
 	bool usessl;
 	bool strictssl;
@@ -69,6 +78,8 @@ typedef struct {
 	bool noipc;	/* do not send to SWUpdate IPC if set */
 	long http_response_code;
 	bool nofollow;
+	bool compress_replies;	/* accept compressed replies in get */
+	bool conditional_get;	/* send If-None-Match with the last ETag */
 	size_t (*dwlwrdata)(char *streamdata, size_t size, size_t nmemb,
 				   void *data);
 	size_t (*headers)(char *streamdata, size_t size, size_t nmemb,
@@ -76,9 +87,40 @@ typedef struct {
 	struct swupdate_digest *dgst;
 	char sha1hash[SWUPDATE_SHA_DIGEST_LENGTH * 2 + 1];
 	sourcetype source;
+	unsigned char bundle;	/* enum bundle_type of the install request */
 	struct dict *headers_to_send;
 	struct dict *received_headers;
 	unsigned int max_download_speed;
+	unsigned int min_download_speed;	/* lower bound in adaptive mode */
+	bool adaptive_speed;	/* reduce the rate when the RTT increases */
+	unsigned int segments;		/* parallel connections for get_file */
+	unsigned int segment_size;	/* bytes requested by a connection at once */
+	unsigned int readahead;		/* buffer between network and installer */
+	unsigned int readahead_high;	/* % of readahead, download pauses */
+	unsigned int readahead_low;	/* % of readahead, download goes on */
 	char *range; /* Range request for get_file in any */
+	char *peers;		/* base URLs of devices sharing artifacts */
+	char *peer_cache;	/* directory with the artifact for peers */
+	char *artifact_id;	/* SHA1 of the artifact, name used by peers */
+	char *tls_sessions;	/* file to keep TLS sessions across restarts */
+	unsigned int tls_session_lifetime;	/* seconds, 0 as set by the server */
 	void *user;
 } channel_data_t;
+
+/*
+ * Change the download rate limits of the running process,
+ * overriding the ones of the channel configuration.
+ */
+void channel_set_download_speed(unsigned int max, unsigned int min, bool adaptive);
+
+/*
+ * Map the value of the "http-version" setting ("1.1", "2", "3")
+ */
+channel_http_version_t channel_http_version(const char *version);
+
+/*
+ * Delay in seconds asked with Retry-After by the server in the last
+ * reply to a channel operation of the calling thread, 0 if none.
+ * The value is cleared when it is read.
+ */
+unsigned int channel_retry_after(void);
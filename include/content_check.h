@@ -0,0 +1,37 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _CONTENT_CHECK_H
+#define _CONTENT_CHECK_H
+
+#include <stdbool.h>
+#include "swupdate.h"
+
+/*
+ * With "install-if-content-different", sw-description records the
+ * SHA-256 of the decompressed payload of an image ("content-sha256").
+ * The parser hashes what the destination (raw device, UBI volume or
+ * file) contains and skips the image if it is identical.
+ *
+ * With "content-cache" in the configuration file, the measured hashes
+ * and the ones of the installed images are kept in that file, with
+ * what identifies the state of the destination (the write counter of
+ * a block device during this boot, size and times of a file), so that
+ * a destination that did not change is not read again. UBI does not
+ * count the writes to a volume: only the entry recorded when SWUpdate
+ * installed a volume is kept, and it is dropped before the volume is
+ * written again.
+ */
+void content_check_set_cache(const char *path);
+
+bool content_check_identical(struct img_type *img);
+/* Called after img was installed */
+void content_check_installed(struct img_type *img);
+/* Called before the destination at path is written, removed or created */
+void content_check_invalidate(const char *path);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _CPIO_URING_H
+#define _CPIO_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * io_uring engine of the copy pipeline: several reads of the input
+ * and several writes to the output are kept in flight, each with a
+ * registered buffer. It works on regular files and block devices
+ * only, because the requests are issued at explicit offsets; the
+ * position of the file descriptor is updated when the engine is
+ * stopped, as if the data was read or written synchronously.
+ *
+ * The start functions return NULL if the engine cannot be used, e.g.
+ * the kernel does not support io_uring, and the caller goes on with
+ * read() and write().
+ */
+struct uring_reader;
+struct uring_writer;
+
+/* Reads ahead at most total bytes of fd */
+struct uring_reader *uring_reader_start(int fd, size_t total, size_t bufsize);
+/* Like read(), returns -1 and sets errno on error */
+ssize_t uring_reader_read(struct uring_reader *r, void *buf, size_t len);
+void uring_reader_stop(struct uring_reader *r);
+
+struct uring_writer *uring_writer_start(int fd, size_t bufsize);
+int uring_writer_write(struct uring_writer *w, const void *buf, size_t len);
+/* Waits for the pending writes, returns the first error */
+int uring_writer_stop(struct uring_writer *w);
+
+#endif
@@ -56,10 +56,35 @@ struct filehdr {
 	char filename[MAX_IMAGE_FNAME];
 };
 
+/*
+ * Entry of the index of an archive: header of the file
+ * and offset of its data from the beginning of the archive
+ */
+struct cpio_entry {
+	struct filehdr hdr;
+	off_t offset;
+};
+
+struct cpio_index {
+	struct cpio_entry *entries;
+	unsigned int count;
+};
+
+/*
+ * Only the "crc" format has a checksum of the data, the argument
+ * to copyfile() is NULL otherwise and the sum is not computed
+ */
+static inline uint32_t *cpio_chksum_ptr(const struct filehdr *fhdr, uint32_t *chk)
+{
+	return fhdr->format == CPIO_CRCASCII ? chk : NULL;
+}
+
 int get_cpiohdr(unsigned char *buf, struct filehdr *fhdr);
 int extract_cpio_header(int fd, struct filehdr *fhdr, unsigned long *offset);
 int extract_img_from_cpio(int fd, unsigned long offset, struct filehdr *fdh);
 void extract_padding(int fd, unsigned long *offset);
+int cpio_index(int fd, off_t start, struct cpio_index *idx);
+void cpio_index_free(struct cpio_index *idx);
 bool swupdate_verify_chksum(const uint32_t chk1, struct filehdr *fhdr);
 
 #endif
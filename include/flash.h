@@ -30,7 +30,8 @@ struct mtd_ubi_info {
 	struct mtd_dev_info mtd;
 	int skipubi;	/* set if no UBI scan must run */
 	int has_ubi;	/* set if MTD must always have UBI */
-	int scanned;
+	int scanned;	/* UBI discovery has run */
+	int valid;	/* mtd holds the device information */
 };
 
 struct flash_description {
@@ -49,6 +50,11 @@ void mtd_set_ubiblacklist(char *mtdlist);
 void ubi_init(void);
 int scan_mtd_devices (void);
 void mtd_cleanup (void);
+int mtd_load_table(void);
+struct mtd_ubi_info *mtd_get_device(int mtdnum);
+struct mtd_ubi_info *mtd_get_ubi_device(int mtdnum);
+void mtd_invalidate(int mtdnum);
+void ubi_invalidate(int dev_num);
 int get_mtd_from_device(char *s);
 int get_mtd_from_name(const char *s);
 int flash_erase(int mtdnum);
@@ -7,10 +7,21 @@
 #ifndef _FS_INTERFACE_H
 #define _FS_INTERFACE_H
 
+struct img_type;
+
+/*
+ * Options for diskformat_mkfs(), ignored by
+ * file systems that do not support them
+ */
+#define MKFS_LAZY_ITABLE_INIT		(1 << 0)
+#define MKFS_NO_LAZY_ITABLE_INIT	(1 << 1)
+#define MKFS_LAZY_JOURNAL_INIT		(1 << 2)
+
 char *diskformat_fs_detect(char *device);
 int diskformat_fs_exists(char *device, char *fstype);
 
-int diskformat_mkfs(char *device, char *fstype);
+unsigned int diskformat_mkfs_options(struct img_type *img);
+int diskformat_mkfs(char *device, char *fstype, unsigned int options);
 
 #if defined(CONFIG_FAT_FILESYSTEM)
 extern int fat_mkfs(const char *device_name, const char *fstype);
@@ -18,7 +29,7 @@ extern int fat_mkfs(const char *device_name, const char *fstype);
 
 #if defined (CONFIG_EXT_FILESYSTEM) 
 extern int ext_mkfs(const char *device_name, const char *fstype, unsigned long features,
-		const char *volume_label);
+		const char *volume_label, unsigned int options);
 #endif
 
 #endif
@@ -10,6 +10,8 @@
 #ifndef _HANDLER_H
 #define _HANDLER_H
 
+#include <stdbool.h>
+
 typedef enum {
 	NONE,
 	PREINSTALL,
@@ -26,7 +28,21 @@ typedef enum {
 	SCRIPT_HANDLER = 4,
 	BOOTLOADER_HANDLER = 8,
 	PARTITION_HANDLER = 16,
-	NO_DATA_HANDLER = 32
+	NO_DATA_HANDLER = 32,
+	/* not an input type: the handler reads the image sequentially */
+	STREAM_HANDLER = 64,
+	/* not an input type: the handler runs in dry run without installing */
+	DRYRUN_HANDLER = 128,
+	/*
+	 * Capabilities, not input types either: the handler can run
+	 * concurrently with other handlers (install-group), honours the
+	 * "offset" of the image, the "direct-io" property, and its
+	 * destination can be checked with install-if-content-different
+	 */
+	PARALLEL_HANDLER = 256,
+	SEEKABLE_HANDLER = 512,
+	DIRECTIO_HANDLER = 1024,
+	SKIP_UNCHANGED_HANDLER = 2048
 } HANDLER_MASK;
 
 #define ANY_HANDLER (IMAGE_HANDLER | FILE_HANDLER | SCRIPT_HANDLER | \
@@ -53,9 +69,18 @@ struct script_handler_data {
 int register_handler(const char *desc, 
 		handler installer, HANDLER_MASK mask, void *data);
 
+/*
+ * Handlers can defer work to the end of the installation,
+ * for example to apply several changes atomically.
+ */
+typedef int (*commit_hook)(bool apply);
+int register_commit_hook(commit_hook hook);
+int run_commit_hooks(bool apply);
+
 struct installer_handler *find_handler(struct img_type *img);
 void print_registered_handlers(void);
 struct installer_handler *get_next_handler(void);
 unsigned int get_handler_mask(struct img_type *img);
+struct installer_handler *find_handler_by_name(const char *desc);
 
 #endif
@@ -13,15 +13,30 @@
 #include "swupdate.h"
 #include "handler.h"
 #include "cpiohdr.h"
+#include "state.h"
 
-swupdate_file_t check_if_required(struct imglist *list, struct filehdr *pfdh,
-				const char *destdir,
+int artifact_index_build(struct swupdate_cfg *sw);
+void artifact_index_free(struct swupdate_cfg *sw);
+struct img_type *artifact_next(struct swupdate_cfg *sw, const struct imglist *list,
+			       const char *fname, struct img_type *prev);
+/* images of list for the file fname, in the order of the list */
+#define ARTIFACT_FOREACH(img, sw, list, fname) \
+	for (img = artifact_next(sw, list, fname, NULL); img; \
+	     img = artifact_next(sw, list, fname, img))
+struct img_type *artifact_provided(struct swupdate_cfg *sw, struct imglist *list,
+				   struct filehdr *fdh, off_t offset);
+swupdate_file_t check_if_required(struct swupdate_cfg *sw, struct imglist *list,
+				struct filehdr *pfdh, const char *destdir,
 				struct img_type **pimg);
+bool artifact_required(struct swupdate_cfg *sw, const char *fname);
 int install_images(struct swupdate_cfg *sw);
+bool update_transaction_state(struct swupdate_cfg *software, update_state_t newstate);
 int install_single_image(struct img_type *img, bool dry_run);
+int open_image_data(struct swupdate_cfg *sw, struct img_type *img);
 int install_from_file(const char *filename, bool check);
 int postupdate(struct swupdate_cfg *swcfg, const char *info);
 int preupdatecmd(struct swupdate_cfg *swcfg);
 void cleanup_files(struct swupdate_cfg *software);
+void bundle_drop(void);
 
 #endif
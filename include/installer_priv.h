@@ -19,6 +19,7 @@ struct installer {
 	char	errormsg[64];		/* error message if installation failed */
 	struct swupdate_request req;
 	struct swupdate_cfg *software;
+	bool described;			/* sw-description of the update is parsed */
 };
 
 #endif
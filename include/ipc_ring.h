@@ -0,0 +1,112 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+#ifndef _IPC_RING_H
+#define _IPC_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Instead of writing the SWU into the control connection, a client
+ * can ask for a ring in memory shared with SWUpdate (REQ_INSTALL_SHM).
+ * SWUpdate creates it and passes it with the ACK, the client copies
+ * the data into it and the installer reads it from there: the
+ * connection stays open and stands for the client, it is closed with
+ * ipc_end() at the end of the stream. The installer copies the data
+ * out of the ring, the client has no access to its memory.
+ */
+#define IPC_RING_MAGIC		0x14052004
+#define IPC_RING_SIZE		(1024 * 1024)	/* a power of 2 */
+
+/*
+ * The ring holds no lock: each counter has one writer, the client for
+ * head and eof, SWUpdate for tail and closed. A side waits with a futex
+ * on the event counter bumped by the other one, SWUpdate keeps its own
+ * tail and does not trust anything it reads from the ring.
+ */
+struct ipc_ring {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t head;			/* bytes written, modulo 2^32 */
+	uint32_t tail;			/* bytes read, modulo 2^32 */
+	uint32_t eof;			/* the client sent everything */
+	uint32_t closed;		/* SWUpdate does not read anymore */
+	uint32_t filled;		/* bumped when head or eof change */
+	uint32_t freed;			/* bumped when tail or closed change */
+	unsigned char data[];		/* size bytes */
+};
+
+static inline size_t ipc_ring_len(uint32_t size)
+{
+	return offsetof(struct ipc_ring, data) + size;
+}
+
+static inline uint32_t ipc_ring_get(uint32_t *word)
+{
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+static inline void ipc_ring_set(uint32_t *word, uint32_t val)
+{
+	__atomic_store_n(word, val, __ATOMIC_RELEASE);
+}
+
+/* Wake the peer waiting on an event counter */
+static inline void ipc_ring_post(uint32_t *event)
+{
+	__atomic_add_fetch(event, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, event, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Wait up to a second until the counter is not seen anymore,
+ * returns ETIMEDOUT so that the caller can check its peer
+ */
+static inline int ipc_ring_wait(uint32_t *event, uint32_t seen)
+{
+	struct timespec ts = { .tv_sec = 1 };
+
+	if (syscall(SYS_futex, event, FUTEX_WAIT, seen, &ts, NULL, 0) < 0)
+		return errno;
+
+	return 0;
+}
+
+/*
+ * Installer side, in SWUpdate: the ring of the connection is created
+ * by ipc_ring_attach(), that returns the file descriptor to be passed
+ * to the client. ipc_ring_read() works like read() and reads from the
+ * connection itself if it has no ring.
+ */
+int ipc_ring_attach(int connfd);
+bool ipc_ring_attached(int fd);
+ssize_t ipc_ring_read(int fd, void *buf, size_t count);
+void ipc_ring_detach(int fd);
+
+/*
+ * A thread can drain a connection without ring (a socket or a pipe)
+ * into a buffer of max bytes, so that the sender is not stalled while
+ * the installer parses or waits for a slow device. ipc_ring_read()
+ * takes the data from the buffer and ipc_ring_pending() is true for the
+ * connection, until ipc_ring_detach(). ipc_ring_readahead_stop() only
+ * joins the thread, what it read can still be consumed.
+ */
+#define IPC_READAHEAD_SIZE	(4 * 1024 * 1024)
+
+int ipc_ring_readahead(int fd, size_t max);
+void ipc_ring_readahead_stop(int fd);
+bool ipc_ring_pending(int fd);
+
+#endif
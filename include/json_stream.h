@@ -0,0 +1,57 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _JSON_STREAM_H
+#define _JSON_STREAM_H
+
+#include <stddef.h>
+
+/*
+ * Pull parser to look up a few values in a JSON text without
+ * building an object tree and without allocating memory.
+ *
+ * A path is a NULL terminated list of keys, an element "[n]"
+ * selects the n-th entry of an array, e.g.
+ * (const char *[]){"deployment", "chunks", "[0]", "name", NULL}.
+ * Keys are compared as they are written in the text, escape
+ * sequences in keys are not decoded.
+ */
+
+typedef enum {
+	JSON_STREAM_OBJECT,
+	JSON_STREAM_ARRAY,
+	JSON_STREAM_STRING,
+	JSON_STREAM_NUMBER,
+	JSON_STREAM_BOOL,
+	JSON_STREAM_NULL
+} json_stream_type;
+
+typedef struct {
+	json_stream_type type;
+	const char *start;	/* for strings, after the opening quote */
+	size_t len;		/* for strings, without the quotes */
+} json_stream_value;
+
+/*
+ * The functions return 0 on success, -ENOENT if the path is not in
+ * the text, -EINVAL if the text is malformed and -ENOSPC if the
+ * destination buffer is too small.
+ */
+int json_stream_find(const char *buf, size_t len, const char **path,
+		     json_stream_value *val);
+
+/*
+ * Strings are unescaped into dst, numbers and booleans are copied
+ * as they are written, as json_object_get_string() does.
+ */
+int json_stream_get_string(const char *buf, size_t len, const char **path,
+			   char *dst, size_t size);
+int json_stream_get_int(const char *buf, size_t len, const char **path,
+			long long *val);
+int json_stream_array_length(const char *buf, size_t len, const char **path);
+
+#endif
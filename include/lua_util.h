@@ -23,10 +23,13 @@ typedef enum {
 } root_dev_type;
 
 void LUAstackDump (lua_State *L);
-int run_lua_script(const char *script, const char *function, char *parms);
+int run_lua_script(const char *script, const char *function, const char *parms);
+void lua_scripts_release(void);
 lua_State *lua_parser_init(const char *buf, struct dict *bootenv);
 int lua_parser_fn(lua_State *L, const char *fcn, struct img_type *img);
 int lua_handlers_init(void);
+int lua_handlers_settings(void *settings, void *data);
+lua_State *lua_budget_newstate(void);
 
 int lua_notify_trace(lua_State *L);
 int lua_notify_error(lua_State *L);
@@ -91,6 +94,9 @@ static inline int lua_parser_fn(lua_State __attribute__ ((__unused__)) *L,
 			 const char __attribute__ ((__unused__)) *fcn,
 			 struct img_type __attribute__ ((__unused__)) *img) { return -1; }
 static inline int lua_handlers_init(void) { return 0; }
+static inline int lua_handlers_settings(void __attribute__ ((__unused__)) *settings,
+					void __attribute__ ((__unused__)) *data) { return 0; }
+static inline void lua_scripts_release(void) { }
 #endif
 
 
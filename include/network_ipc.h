@@ -25,6 +25,19 @@ extern "C" {
  */
 
 #define IPC_MAGIC		0x14052001
+#define IPC_MAGIC_V2		0x14052002
+
+/*
+ * Version 1 of the protocol transfers the whole ipc_message.
+ * Version 2 sends a header (IPC_MAGIC_V2, type, length) followed by
+ * the significant part of msgdata only, the trailing zero bytes
+ * are dropped and restored by the receiver. Replies and notifications
+ * use the version of the request.
+ */
+enum {
+	IPC_PROTO_V1 = 1,
+	IPC_PROTO_V2
+};
 
 typedef enum {
 	REQ_INSTALL,
@@ -39,7 +52,15 @@ typedef enum {
 	REQ_INSTALL_EXT,
 	SET_VERSIONS_RANGE,
 	NOTIFY_STREAM,
-	GET_HW_REVISION
+	GET_HW_REVISION,
+	GET_TIMELINE,	/* path of the timeline of the last update */
+	GET_METRICS,	/* path of a snapshot of the metrics */
+	REQ_INSTALL_FD,	/* REQ_INSTALL, the SWU is read from the passed fd */
+	SET_INSTALL_PRIORITY,	/* profile of install-priority, "normal" or "peak" */
+	REFRESH_ROOT_DEVICE,	/* detect again the root device */
+	GET_ARTIFACT_REQUIRED,	/* is an entry of the running update needed ? */
+	GET_PROFILE,	/* path of the profile of the last updates */
+	REQ_INSTALL_SHM	/* REQ_INSTALL, the SWU is sent through shared memory */
 } msgtype;
 
 /*
@@ -59,6 +80,17 @@ enum run_type {
 	RUN_INSTALL
 };
 
+/*
+ * Several SWUs can be installed as one transaction: all of them but
+ * the last are sent with BUNDLE_NEXT, the last one with BUNDLE_LAST.
+ * The bootloader environment is then written once, by the last SWU.
+ */
+enum bundle_type {
+	BUNDLE_NONE,
+	BUNDLE_NEXT,
+	BUNDLE_LAST
+};
+
 #define SWUPDATE_API_VERSION 	0x1
 /*
  * Install structure to be filled before calling
@@ -73,6 +105,7 @@ struct swupdate_request {
 	char software_set[256];
 	char running_mode[256];
 	bool disable_store_swu;
+	unsigned char bundle;	/* enum bundle_type */
 };
 
 typedef union {
@@ -120,6 +153,10 @@ typedef union {
 		char boardname[256];
 		char revision[256];
 	} revisions;
+	struct {
+		char filename[256];
+		int required;	/* 1, 0 or -EAGAIN before sw-description is parsed */
+	} artifact;
 } msgdata;
 	
 typedef struct {
@@ -129,8 +166,17 @@ typedef struct {
 } ipc_message;
 
 char *get_ctrl_socket(void);
+int ipc_send_msg(int connfd, const ipc_message *msg, int version);
+int ipc_send_msg_fd(int connfd, const ipc_message *msg, int version, int fd);
+int ipc_recv_msg(int connfd, ipc_message *msg);
+int ipc_recv_msg_fd(int connfd, ipc_message *msg, int *fd);
+int ipc_pack_msg(const ipc_message *msg, int version, char *buf, size_t size);
+int ipc_unpack_msg(const char *buf, size_t size, ipc_message *msg);
+int ipc_msg_len(const char *buf, size_t size);
 int ipc_inst_start(void);
 int ipc_inst_start_ext(void *priv, ssize_t size);
+int ipc_inst_start_fd(void *priv, ssize_t size, int fd);
+int ipc_inst_start_shm(void *priv, ssize_t size);
 int ipc_send_data(int connfd, char *buf, int size);
 void ipc_end(int connfd);
 int ipc_get_status(ipc_message *msg);
@@ -138,7 +184,9 @@ int ipc_get_status_timeout(ipc_message *msg, unsigned int timeout_ms);
 int ipc_notify_connect(void);
 int ipc_notify_receive(int *connfd, ipc_message *msg);
 int ipc_postupdate(ipc_message *msg);
+int ipc_get_file_path(int type, char *path, size_t len);
 int ipc_send_cmd(ipc_message *msg);
+int ipc_artifact_required(const char *filename);
 
 typedef int (*writedata)(char **buf, int *size);
 typedef int (*getstatus)(ipc_message *msg);
@@ -149,10 +197,39 @@ int swupdate_image_write(char *buf, int size);
 int swupdate_async_start(writedata wr_func, getstatus status_func,
 				terminated end_func,
 				void *priv, ssize_t size);
+int swupdate_async_start_fd(int fd, getstatus status_func,
+				terminated end_func,
+				void *priv, ssize_t size);
 int swupdate_set_aes(char *key, char *ivt);
+int swupdate_set_install_priority(const char *profile);
+int swupdate_refresh_root_device(void);
 int swupdate_set_version_range(const char *minversion,
 				const char *maxversion,
 				const char *currentversion);
+
+/*
+ * Non-blocking interface for clients with an event loop. A context
+ * is started by one of the swupdate_nb_*() functions (NULL and errno
+ * set on failure), the caller waits for swupdate_nb_events() on
+ * swupdate_nb_fd() and calls swupdate_nb_process() with the returned
+ * events. The descriptor changes when a request is completed.
+ */
+enum {
+	SWUPDATE_NB_AGAIN,	/* wait for the next events */
+	SWUPDATE_NB_MSG,	/* a message was received */
+	SWUPDATE_NB_DONE	/* request completed */
+};
+
+struct swupdate_nb;
+struct swupdate_nb *swupdate_nb_install(void *priv, ssize_t size,
+					int imagefd, bool passfd);
+struct swupdate_nb *swupdate_nb_status(void);
+struct swupdate_nb *swupdate_nb_notify(void);
+int swupdate_nb_fd(const struct swupdate_nb *nb);
+int swupdate_nb_events(const struct swupdate_nb *nb);
+int swupdate_nb_process(struct swupdate_nb *nb, int revents);
+const ipc_message *swupdate_nb_message(const struct swupdate_nb *nb);
+void swupdate_nb_free(struct swupdate_nb *nb);
 #ifdef __cplusplus
 }   // extern "C"
 #endif
@@ -94,7 +94,8 @@ void *get_child(parsertype p, void *node, const char *name);
 void iterate_field(parsertype p, void *e, iterate_callback cb, void *data);
 void get_field(parsertype p, void *e, const char *path, void *dest);
 int exist_field_string(parsertype p, void *e, const char *path);
-void get_hash_value(parsertype p, void *elem, unsigned char *hash);
+void get_hash_value(parsertype p, void *elem, unsigned char *hash,
+		    const char **hashalg);
 void check_field_string(const char *src, char *dst, const size_t max_len);
 void *find_root(parsertype p, void *root, const char **nodes);
 void *get_node(parsertype p, void *root, const char **nodes);
@@ -17,10 +17,21 @@
 #endif
 
 typedef int (*parser_fn)(struct swupdate_cfg *swcfg, const char *filename);
+typedef int (*parser_buffer_fn)(struct swupdate_cfg *swcfg, const char *buf,
+				size_t len);
 
 int parse(struct swupdate_cfg *swcfg, const char *filename);
 int parse_cfg (struct swupdate_cfg *swcfg, const char *filename);
 int parse_json(struct swupdate_cfg *swcfg, const char *filename);
 int parse_external(struct swupdate_cfg *swcfg, const char *filename);
+
+/*
+ * Same as above, with sw-description and its signature in memory.
+ * The buffers must be NUL terminated (not counted in the length).
+ */
+int parse_buffer(struct swupdate_cfg *swcfg, const char *desc, size_t desclen,
+		 const char *sig, size_t siglen);
+int parse_cfg_buffer(struct swupdate_cfg *swcfg, const char *buf, size_t len);
+int parse_json_buffer(struct swupdate_cfg *swcfg, const char *buf, size_t len);
 #endif
 
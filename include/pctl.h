@@ -9,10 +9,12 @@
 #define _SWUPDATE_PCTL_H
 
 #include <swupdate_status.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 extern int pid;
-extern int sw_sockfd;
+extern __thread int sw_sockfd;
 
 /*
  * This is used by the core process
@@ -26,6 +28,8 @@ struct swupdate_task {
 };
 
 pthread_t start_thread(void *(* start_routine) (void *), void *arg);
+/* Threads of the install pipeline, returns the error of pthread_create() */
+int start_worker_thread(pthread_t *id, void *(* start_routine) (void *), void *arg);
 
 void thread_ready(void);
 void wait_threads_ready(void);
@@ -44,6 +48,14 @@ void start_subprocess_from_file(sourcetype type, const char *name,
 			int argc, char **argv,
 			const char *cmd);
 
+/*
+ * With threads enabled, the subprocesses that run with the same
+ * user and group as SWUpdate are started as threads. A subprocess
+ * calls subprocess_ready() when it has parsed its command line.
+ */
+void subprocess_set_threads(bool enable);
+void subprocess_ready(void);
+
 void sigchld_handler (int __attribute__ ((__unused__)) signum);
 
 int pctl_getfd_from_type(sourcetype s);
@@ -8,6 +8,8 @@
 #ifndef _INSTALL_PROGRESS_H
 #define _INSTALL_PROGRESS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <swupdate_status.h>
 #include <progress_ipc.h>
 
@@ -18,13 +20,42 @@
  */
 void swupdate_progress_init(unsigned int nsteps);
 void swupdate_progress_update(unsigned int perc);
+void swupdate_progress_stats(unsigned long long bytes_read,
+			     unsigned long long bytes_total,
+			     unsigned long long bytes_written);
 void swupdate_progress_inc_step(const char *image, const char *handler_name);
 void swupdate_progress_step_completed(void);
 void swupdate_progress_end(RECOVERY_STATUS status);
 void swupdate_progress_done(const char *info);
 void swupdate_progress_info(RECOVERY_STATUS status, int cause, const char *msg);
 
+/*
+ * Byte counters of the copy loops. Each running copy owns a counter
+ * and updates it without locking, the progress thread sums all
+ * counters at a fixed tick and reports the combined percentage and
+ * statistics, so that images installed at the same time (install-group)
+ * give a single progress. start() returns NULL if no counter is free,
+ * the caller then reports with swupdate_progress_update() / _stats().
+ */
+struct progress_counter {
+	uint64_t total;
+	uint64_t read;
+	uint64_t written;
+	bool used;
+};
+
+struct progress_counter *swupdate_progress_counter_start(uint64_t total);
+void swupdate_progress_counter_end(struct progress_counter *c);
+
+static inline void swupdate_progress_counter_update(struct progress_counter *c,
+						    uint64_t read, uint64_t written)
+{
+	__atomic_store_n(&c->read, read, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->written, written, __ATOMIC_RELAXED);
+}
+
 void swupdate_download_update(unsigned int perc, unsigned long long totalbytes);
+void swupdate_progress_set_rate(unsigned int interval_ms, unsigned int delta);
 
 void *progress_bar_thread (void *data);
 
@@ -38,7 +38,58 @@ struct progress_msg {
 	char		info[PRINFOSIZE]; /* additional information about install */
 };
 
+/*
+ * Extended messages (version 2) add statistics about the running
+ * step. They are sent only to clients that request them with
+ * progress_ipc_request_ext() after connecting, so that clients
+ * knowing just struct progress_msg keep working. The first part of an
+ * extended message is a struct progress_msg with magic set to
+ * PROGRESS_EXT_MAGIC.
+ */
+#define PROGRESS_EXT_MAGIC	0x53575550	/* "SWUP" */
+#define PROGRESS_API_VERSION	2
+
+struct progress_request {
+	unsigned int	magic;		/* PROGRESS_EXT_MAGIC */
+	unsigned int	version;	/* PROGRESS_API_VERSION */
+};
+
+struct progress_stats {
+	unsigned long long bytes_read;	  /* bytes of the artifact read from the SWU */
+	unsigned long long bytes_total;	  /* size of the artifact in the SWU */
+	unsigned long long bytes_written; /* bytes passed to the handler */
+	unsigned long long elapsed_ms;	  /* time since the step was started */
+	unsigned long long throughput;	  /* bytes/s written, last interval */
+	unsigned long long eta_ms;	  /* estimated time to complete the step */
+};
+
+struct progress_msg_ext {
+	struct progress_msg msg;
+	unsigned int	version;	/* Version of the extension */
+	unsigned int	size;		/* Size of the extension */
+	struct progress_stats stats;
+};
+
+/*
+ * SWUpdate publishes the last message in a shared memory snapshot, a
+ * file next to the progress socket, so that a client can sample the
+ * progress at any time without a connection and without wakeups.
+ * seq is odd while SWUpdate changes the message.
+ */
+#define PROGRESS_SNAPSHOT_MAGIC		0x53575053	/* "SWPS" */
+#define PROGRESS_SNAPSHOT_SUFFIX	".snapshot"
+#define PROGRESS_SNAPSHOT_RETRIES	100
+
+struct progress_snapshot {
+	unsigned int	magic;		/* PROGRESS_SNAPSHOT_MAGIC */
+	unsigned int	version;	/* PROGRESS_API_VERSION */
+	unsigned int	seq;		/* sequence counter */
+	unsigned int	reserved;
+	struct progress_msg_ext msg;
+};
+
 char *get_prog_socket(void);
+char *get_prog_snapshot(void);
 
 /* Standard function to connect to progress interface */
 int progress_ipc_connect(bool reconnect);
@@ -52,6 +103,34 @@ int progress_ipc_connect_with_path(const char *socketpath, bool reconnect);
 /* Retrieve messages from progress interface (it blocks) */
 int progress_ipc_receive(int *connfd, struct progress_msg *msg);
 
+/* Ask SWUpdate to send extended messages on this connection */
+int progress_ipc_request_ext(int connfd);
+
+/*
+ * Retrieve both standard and extended messages, stats are
+ * zeroed if SWUpdate has not (yet) sent an extended one
+ */
+int progress_ipc_receive_ext(int *connfd, struct progress_msg_ext *msg);
+
+/*
+ * Non-blocking connection for an event loop, see swupdate_nb_process()
+ * in network_ipc.h. Each SWUPDATE_NB_MSG returns a message in
+ * progress_ipc_nb_message().
+ */
+struct swupdate_nb;
+struct swupdate_nb *progress_ipc_nb_connect(void);
+const struct progress_msg *progress_ipc_nb_message(const struct swupdate_nb *nb);
+
+/*
+ * Map the snapshot read-only (NULL if SWUpdate does not publish it)
+ * and read the last message, the sequence counter is returned or
+ * -EAGAIN if SWUpdate was busy changing it.
+ */
+struct progress_snapshot *progress_ipc_snapshot_map(void);
+int progress_ipc_snapshot_read(const struct progress_snapshot *snap,
+			       struct progress_msg_ext *msg);
+void progress_ipc_snapshot_unmap(struct progress_snapshot *snap);
+
 #ifdef __cplusplus
 }   // extern "C"
 #endif
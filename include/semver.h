@@ -75,6 +75,12 @@ semver_parse (const char *str, semver_t *ver);
 int
 semver_parse_version (const char *str, semver_t *ver);
 
+int
+semver_parse_inplace (char *buf, semver_t *ver);
+
+int
+semver_compare_str (const char *x, const char *y, int *res);
+
 void
 semver_render (semver_t *x, char *dest);
 
@@ -9,6 +9,11 @@
 #define _SWUPDATE_SSL_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
 
 #define SHA_DEFAULT	"sha256"
 
@@ -93,7 +98,22 @@ struct swupdate_digest {
 	EVP_PKEY *pkey;		/* this is used for RSA key */
 	EVP_PKEY_CTX *ckey;	/* this is used for RSA key */
 	X509_STORE *certs;	/* this is used if CMS is set */
+#ifdef CONFIG_SIGALG_CMS
+	char *certfile;		/* certs are loaded again if it changes */
+	int cert_purpose;
+	dev_t cert_dev;
+	ino_t cert_ino;
+	off_t cert_size;
+	struct timespec cert_mtime;
+#endif
 	EVP_MD_CTX *ctx;
+#ifdef CONFIG_HASH_AFALG
+	bool afalg;		/* hash is computed by the kernel */
+	int afalg_fd;
+#endif
+#ifdef CONFIG_DECRYPT_AFALG
+	struct afalg_cipher *afalg_dec;	/* decryption done by the kernel */
+#endif
 #ifdef CONFIG_PKCS11
 	unsigned char last_decr[AES_BLOCK_SIZE + 1];
 	P11KitUri *p11uri;
@@ -142,6 +162,10 @@ struct swupdate_digest {
 #ifdef CONFIG_HASH_VERIFY
 	mbedtls_md_context_t mbedtls_md_context;
 #endif /* CONFIG_HASH_VERIFY */
+#ifdef CONFIG_HASH_AFALG
+	bool afalg;		/* hash is computed by the kernel */
+	int afalg_fd;
+#endif
 #ifdef CONFIG_SIGNED_IMAGES
 	mbedtls_pk_context mbedtls_pk_context;
 #endif /* CONFIG_SIGNED_IMAGES */
@@ -173,19 +197,50 @@ int swupdate_HASH_update(struct swupdate_digest *dgst, const unsigned char *buf,
 int swupdate_HASH_final(struct swupdate_digest *dgst, unsigned char *md_value,
 	       			unsigned int *md_len);
 void swupdate_HASH_cleanup(struct swupdate_digest *dgst);
+int swupdate_HASH_reset(struct swupdate_digest *dgst);
+int swupdate_HASH_save(struct swupdate_digest *dgst, void *state, size_t *len);
+int swupdate_HASH_restore(struct swupdate_digest *dgst, const void *state,
+				size_t len);
 int swupdate_verify_file(struct swupdate_digest *dgst, const char *sigfile,
 				const char *file, const char *signer_name);
+int swupdate_verify_buffer(struct swupdate_digest *dgst, const char *sig,
+				size_t siglen, const char *data, size_t len,
+				const char *signer_name);
 int swupdate_HASH_compare(const unsigned char *hash1, const unsigned char *hash2);
 
+#ifdef CONFIG_HASH_AFALG
+int swupdate_HASH_set_backend(const char *name);
+bool swupdate_HASH_use_afalg(void);
+const char *swupdate_HASH_backend_name(void);
+int afalg_hash_init(const char *algo);
+int afalg_hash_update(int opfd, const unsigned char *buf, size_t len);
+int afalg_hash_final(int opfd, unsigned char *md_value, unsigned int *md_len);
+void afalg_hash_cleanup(int opfd);
+#else
+static inline int swupdate_HASH_set_backend(const char *name)
+{
+	return (name && strlen(name) && strcmp(name, "default")) ? -EINVAL : 0;
+}
+#define swupdate_HASH_backend_name() "default"
+#endif
 
 #else
 #define swupdate_dgst_init(sw, keyfile) ( 0 )
 #define swupdate_HASH_init(p) ( NULL )
 #define swupdate_verify_file(dgst, sigfile, file) ( 0 )
+#define swupdate_verify_buffer(dgst, sig, siglen, data, len, signer) ( 0 )
 #define swupdate_HASH_update(p, buf, len)	(-1)
 #define swupdate_HASH_final(p, result, len)	(-1)
 #define swupdate_HASH_cleanup(sw)
+#define swupdate_HASH_reset(p)			(-ENOTSUP)
+#define swupdate_HASH_save(p, state, len)	(-ENOTSUP)
+#define swupdate_HASH_restore(p, state, len)	(-ENOTSUP)
 #define swupdate_HASH_compare(hash1,hash2)	(0)
+static inline int swupdate_HASH_set_backend(const char *name)
+{
+	return (name && strlen(name) && strcmp(name, "default")) ? -EINVAL : 0;
+}
+#define swupdate_HASH_backend_name() "none"
 #endif
 
 #ifdef CONFIG_ENCRYPTED_IMAGES
@@ -195,6 +250,31 @@ int swupdate_DECRYPT_update(struct swupdate_digest *dgst, unsigned char *buf,
 int swupdate_DECRYPT_final(struct swupdate_digest *dgst, unsigned char *buf,
 				int *outlen);
 void swupdate_DECRYPT_cleanup(struct swupdate_digest *dgst);
+
+/*
+ * AES-CTR: there is no chaining between blocks, so the decryption
+ * can start at any offset of the artifact. The counter of the first
+ * block is iv, taken as a 128 bit big endian number.
+ */
+struct swupdate_digest *swupdate_DECRYPT_init_ctr(unsigned char *key, char keylen,
+						  unsigned char *iv,
+						  unsigned long long offset);
+
+static inline void swupdate_DECRYPT_ctr_counter(unsigned char *counter,
+						const unsigned char *iv,
+						unsigned long long offset)
+{
+	unsigned long long blocks = offset / 16;
+	unsigned int carry = 0;
+
+	for (int i = 15; i >= 0; i--) {
+		unsigned int sum = iv[i] + (unsigned int)(blocks & 0xff) + carry;
+
+		counter[i] = sum & 0xff;
+		carry = sum >> 8;
+		blocks >>= 8;
+	}
+}
 #else
 /*
  * Note: macro for swupdate_DECRYPT_init is
@@ -204,6 +284,27 @@ void swupdate_DECRYPT_cleanup(struct swupdate_digest *dgst);
 #define swupdate_DECRYPT_update(p, buf, len, cbuf, inlen) (-1)
 #define swupdate_DECRYPT_final(p, buf, len) (-1)
 #define swupdate_DECRYPT_cleanup(p)
+#define swupdate_DECRYPT_init_ctr(key, keylen, iv, offset) \
+	(((key != NULL) | (iv != NULL) | (offset != 0)) ? NULL : NULL)
+#endif
+
+#ifdef CONFIG_DECRYPT_AFALG
+struct afalg_cipher;
+int swupdate_DECRYPT_set_backend(const char *name);
+bool swupdate_DECRYPT_use_afalg(void);
+const char *swupdate_DECRYPT_backend_name(void);
+struct afalg_cipher *afalg_cipher_init(const unsigned char *key, int keylen,
+				       const unsigned char *iv);
+int afalg_cipher_update(struct afalg_cipher *c, unsigned char *out, int *outlen,
+			const unsigned char *in, int inlen);
+int afalg_cipher_final(struct afalg_cipher *c, unsigned char *out, int *outlen);
+void afalg_cipher_cleanup(struct afalg_cipher *c);
+#else
+static inline int swupdate_DECRYPT_set_backend(const char *name)
+{
+	return (name && strlen(name) && strcmp(name, "default")) ? -EINVAL : 0;
+}
+#define swupdate_DECRYPT_backend_name() "default"
 #endif
 
 #ifndef SSL_PURPOSE_DEFAULT
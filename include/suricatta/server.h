@@ -7,26 +7,20 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <network_ipc.h>
 #include "util.h"
 
 /* Suricatta Server Interface.
  *
- * Each suricatta server has to implement this interface.
+ * Each suricatta server has to implement this interface and register
+ * itself with register_server() from a constructor, so that several
+ * servers can be built in and run by one suricatta process.
  * Cf. `server_hawkbit.c` for an example implementation targeted towards the
  * [hawkBit](https://projects.eclipse.org/projects/iot.hawkbit) server.
  */
 
-extern server_op_res_t server_has_pending_action(int *action_id);
-extern server_op_res_t server_install_update(void);
-extern server_op_res_t server_send_target_data(void);
-extern unsigned int server_get_polling_interval(void);
-extern server_op_res_t server_start(const char *cfgfname, int argc, char *argv[]);
-extern server_op_res_t server_stop(void);
-extern server_op_res_t server_ipc(ipc_message *msg);
-extern void server_print_help(void);
-
-static struct server_t {
+typedef struct {
 	server_op_res_t (*has_pending_action)(int *action_id);
 	server_op_res_t (*install_update)(void);
 	server_op_res_t (*send_target_data)(void);
@@ -35,12 +29,6 @@ static struct server_t {
 	server_op_res_t (*stop)(void);
 	server_op_res_t (*ipc)(ipc_message *msg);
 	void (*help)(void);
-} server = {.has_pending_action = &server_has_pending_action,
-	    .install_update = &server_install_update,
-	    .send_target_data = &server_send_target_data,
-	    .get_polling_interval = &server_get_polling_interval,
-	    .start = &server_start,
-	    .stop = &server_stop,
-	    .ipc = &server_ipc,
-	    .help = &server_print_help,
-};
+} server_t;
+
+bool register_server(const char *name, server_t *server);
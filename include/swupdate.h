@@ -21,6 +21,8 @@
  * swupdate uses SHA256 hashes
  */
 #define SHA256_HASH_LENGTH	32
+/* SHA-512/256 has the same length and can replace it */
+#define SHA512_256		"sha512-256"
 
 typedef enum {
 	FLASH,
@@ -53,6 +55,15 @@ enum {
   COMPRESSED_TRUE,
   COMPRESSED_ZLIB,
   COMPRESSED_ZSTD,
+  COMPRESSED_LZ4,
+  COMPRESSED_XZ,
+};
+
+enum {
+  ENCRYPTED_FALSE,
+  ENCRYPTED_TRUE,	/* AES-CBC */
+  ENCRYPTED_AES_CBC,
+  ENCRYPTED_AES_CTR,
 };
 
 struct sw_version {
@@ -65,23 +76,27 @@ struct sw_version {
 
 LIST_HEAD(swver, sw_version);
 
+/*
+ * The strings used by few handlers only are set with img_set_string()
+ * and are NULL if not set, IMG_STRING() returns them as "" then.
+ */
 struct img_type {
 	struct sw_version id;		/* This is used to compare versions */
 	char type[SWUPDATE_GENERAL_STRING_SIZE]; /* Handler name */
 	char fname[MAX_IMAGE_FNAME];	/* Filename in CPIO archive */
-	char volname[MAX_VOLNAME];	/* Useful for UBI	*/
+	const char *volname;		/* Useful for UBI	*/
 	char device[MAX_VOLNAME];	/* device associated with image if any */
 	char path[MAX_IMAGE_FNAME];	/* Path where image must be installed */
-	char mtdname[MAX_IMAGE_FNAME];	/* MTD device where image must be installed */
-	char type_data[SWUPDATE_GENERAL_STRING_SIZE];	/* Data for handler */
+	const char *mtdname;		/* MTD device where image must be installed */
+	const char *type_data;		/* Data for handler */
 	char extract_file[MAX_IMAGE_FNAME];
-	char filesystem[MAX_IMAGE_FNAME];
+	const char *filesystem;
 	unsigned long long seek;
 	skip_t skip;
 	int provided;
 	int compressed;
 	int preserve_attributes; /* whether to preserve attributes in archives */
-	bool is_encrypted;
+	int is_encrypted;
 	char ivt_ascii[33];
 	int install_directly;
 	int is_script;
@@ -93,12 +108,20 @@ struct img_type {
 	off_t offset;	/* offset in cpio file */
 	long long size;
 	unsigned int checksum;
+	bool sum_checksum;	/* copyimage() computes checksum, for Lua */
 	unsigned char sha256[SHA256_HASH_LENGTH];	/* SHA-256 is 32 byte */
+	const char *hashalg;	/* algorithm of sha256[], NULL for SHA-256 */
+	bool hash_verified;	/* sha256 already checked on the copy in TMPDIR */
+	bool install_if_content_different;
+	unsigned char content_sha256[SHA256_HASH_LENGTH];	/* of the decompressed payload */
+	unsigned long long content_size;
 	LIST_ENTRY(img_type) next;
 };
 
 LIST_HEAD(imglist, img_type);
 
+#define IMG_STRING(s)	((s) ? (s) : "")
+
 struct hw_type {
 	char boardname[SWUPDATE_GENERAL_STRING_SIZE];
 	char revision[SWUPDATE_GENERAL_STRING_SIZE];
@@ -134,6 +157,9 @@ struct swupdate_cfg {
 	char version[SWUPDATE_GENERAL_STRING_SIZE];
 	bool bootloader_transaction_marker;
 	bool bootloader_state_marker;
+	char stored_state;	/* update_state_t stored during this update */
+	char bundle;		/* enum bundle_type of this update */
+	bool in_bundle;		/* a previous SWU of the bundle is installed */
 	char output[SWUPDATE_GENERAL_STRING_SIZE];
 	char publickeyfname[SWUPDATE_GENERAL_STRING_SIZE];
 	char aeskeyfname[SWUPDATE_GENERAL_STRING_SIZE];
@@ -153,9 +179,20 @@ struct swupdate_cfg {
 	int verbose;
 	int loglevel;
 	int cert_purpose;
+	size_t copy_buffer_size;
+	size_t writeback_chunk;
+	size_t stream_buffer;
+	bool parallel_hash;
+	bool indexed_install;
+	bool auto_stream;
+	bool subprocess_threads;
+	bool deferred_init;
+	int swu_fd;	/* SWU the images are read from, -1 if copied to TMPDIR */
 	struct hw_type hw;
 	struct hwlist hardware;
 	struct swver installed_sw_list;
+	struct sw_versions_index *installed_sw_index;	/* built on first lookup */
+	struct artifact_index *artifact_index;	/* artifacts hashed by file name */
 	struct imglist images;
 	struct imglist scripts;
 	struct imglist bootscripts;
@@ -167,24 +204,12 @@ struct swupdate_cfg {
 	const char *embscript;
 };
 
-#define SEARCH_FILE(img, list, found, offs) do { \
-	if (!found) { \
-		for (img = list.lh_first; img != NULL; \
-			img = img->next.le_next) { \
-			if (strcmp(img->fname, fdh.filename) == 0) { \
-				found = 1; \
-				img->offset = offs; \
-				img->provided = 1; \
-				img->size = fdh.size; \
-			} \
-		} \
-		if (!found) \
-			img = NULL; \
-	} \
-} while(0)
-
 int cpio_scan(int fd, struct swupdate_cfg *cfg, off_t start);
 struct swupdate_cfg *get_swupdate_cfg(void);
+int swupdate_deferred_init(void);
+struct img_type *alloc_image(void);
 void free_image(struct img_type *img);
+int img_set_string(const char **field, const char *value);
+int img_copy_strings(struct img_type *dst, const struct img_type *src, bool heap);
 
 #endif
@@ -0,0 +1,36 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWARENA_H
+#define _SWARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct arena_chunk;
+
+/*
+ * Memory owned by a single transaction (an update) and
+ * released at once when the transaction ends. The chunks are
+ * mapped separately from the heap, so that they are given back
+ * to the system instead of fragmenting it.
+ */
+struct arena {
+	pthread_mutex_t lock;
+	struct arena_chunk *chunks;
+	size_t allocated;
+};
+
+#define ARENA_INITIALIZER { .lock = PTHREAD_MUTEX_INITIALIZER, .chunks = NULL }
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *s);
+bool arena_owns(struct arena *arena, const void *ptr);
+void arena_release(struct arena *arena);
+
+#endif
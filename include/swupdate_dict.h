@@ -17,10 +17,21 @@ struct dict_list_elem {
 
 LIST_HEAD(dict_list, dict_list_elem);
 
+struct dict_index;
+
+/*
+ * Keys are interned and must be treated as read-only.
+ * Dictionaries growing beyond a few entries get a hash
+ * index, shared by all their entries, so lookups do not
+ * need to scan the whole list.
+ */
 struct dict_entry {
 	char *key;
 	struct dict_list list;
 	LIST_ENTRY(dict_entry) next;
+	unsigned int hash;
+	struct dict_entry *hnext;
+	struct dict_index *index;
 };
 
 LIST_HEAD(dict, dict_entry);
@@ -34,6 +45,7 @@ int dict_set_value(struct dict *dictionary, const char *key, const char *value);
 int dict_insert_value(struct dict *dictionary, const char *key, const char *value);
 void dict_remove(struct dict *dictionary, const char *key);
 void dict_drop_db(struct dict *dictionary);
+int dict_copy(struct dict *dst, struct dict *src);
 int dict_parse_script(struct dict *dictionary, const char *script);
 
 #endif
@@ -0,0 +1,36 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWMEMBUDGET_H
+#define _SWMEMBUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Memory budget of the process, set by "memory-budget" in the
+ * configuration file. The large allocations (pipeline buffers,
+ * channel replies, Lua heaps, the arena) are charged to it and
+ * released when they are freed.
+ *
+ * A user that can work with less memory asks for a reservation and
+ * degrades if it is refused, a user that cannot charges what it
+ * needs unconditionally. Without a limit, the usage is only counted.
+ */
+void membudget_set_limit(size_t limit);
+size_t membudget_limit(void);
+size_t membudget_used(void);
+size_t membudget_peak(void);
+
+/* SIZE_MAX if there is no limit */
+size_t membudget_available(void);
+
+bool membudget_reserve(size_t size);
+void membudget_charge(size_t size);
+void membudget_release(size_t size);
+
+#endif
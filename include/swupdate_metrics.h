@@ -0,0 +1,105 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWMETRICS_H
+#define _SWMETRICS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#define METRICS_FILENAME	"swupdate-metrics.txt"
+
+/*
+ * Cumulative counters of the main process, exported
+ * in the OpenMetrics text format.
+ */
+enum metrics_counter {
+	METRICS_UPDATES_STARTED,
+	METRICS_UPDATES_SUCCEEDED,
+	METRICS_UPDATES_FAILED,
+	METRICS_RECEIVED_BYTES,
+	METRICS_WRITTEN_BYTES,
+	METRICS_FLASH_PAGES_SKIPPED,
+	METRICS_STREAMED_BYTES,
+	METRICS_STAGED_BYTES,
+	METRICS_COUNTERS
+};
+
+/* Data transformations: bytes processed and time spent */
+enum metrics_stage {
+	METRICS_STAGE_HASH,
+	METRICS_STAGE_DECRYPT,
+	METRICS_STAGE_DECOMPRESS,
+	METRICS_STAGES
+};
+
+enum metrics_gauge {
+	METRICS_NOTIFY_SUBSCRIBERS,
+	METRICS_NOTIFY_QUEUED_BYTES,
+	METRICS_NOTIFY_DROPPED,
+	METRICS_SUBPROCESS_QUEUE,
+	METRICS_CACHED_MESSAGES,
+	METRICS_STREAM_BUFFERED,
+	METRICS_STREAM_BUFFER_PEAK,
+	METRICS_GAUGES
+};
+
+/* Snapshot of the counters, the difference of two is an update */
+struct metrics_totals {
+	uint64_t counters[METRICS_COUNTERS];
+	uint64_t stage_bytes[METRICS_STAGES];
+	uint64_t stage_ns[METRICS_STAGES];
+};
+
+#ifdef CONFIG_METRICS
+static inline uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_count(enum metrics_counter counter, uint64_t value);
+void metrics_stage(enum metrics_stage stage, uint64_t bytes, uint64_t start);
+void metrics_handler_duration(const char *name, uint64_t start);
+void metrics_set_gauge(enum metrics_gauge gauge, uint64_t value);
+void metrics_get_totals(struct metrics_totals *t);
+int metrics_write(const char *path);
+#else
+static inline uint64_t metrics_now(void) { return 0; }
+static inline void metrics_count(enum metrics_counter counter, uint64_t value)
+{
+	(void)counter;
+	(void)value;
+}
+static inline void metrics_stage(enum metrics_stage stage, uint64_t bytes, uint64_t start)
+{
+	(void)stage;
+	(void)bytes;
+	(void)start;
+}
+static inline void metrics_handler_duration(const char *name, uint64_t start)
+{
+	(void)name;
+	(void)start;
+}
+static inline void metrics_set_gauge(enum metrics_gauge gauge, uint64_t value)
+{
+	(void)gauge;
+	(void)value;
+}
+static inline void metrics_get_totals(struct metrics_totals *t)
+{
+	memset(t, 0, sizeof(*t));
+}
+static inline int metrics_write(const char *path) { (void)path; return -ENOSYS; }
+#endif
+
+#endif
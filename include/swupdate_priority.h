@@ -0,0 +1,45 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWPRIORITY_H
+#define _SWPRIORITY_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Scheduling of the installation, set in the "install-priority"
+ * section of the configuration file: I/O priority and nice value of
+ * the install threads, and optionally a cgroup v2 for the daemon
+ * with io.max / cpu.max limits applied while an update runs.
+ *
+ * There are two profiles, "normal" and "peak". The application
+ * selects the profile over IPC (SET_INSTALL_PRIORITY), for example
+ * when its own load is high.
+ *
+ * worker-cpus, worker-policy and worker-priority in the same section
+ * set the CPUs and the scheduling of the threads started by SWUpdate
+ * (start_thread() and start_worker_thread()), they do not change with
+ * the profile.
+ */
+int install_priority_settings(void *elem, void *data);
+int install_priority_init(void);
+void install_priority_begin(void);
+void install_priority_end(void);
+int install_priority_set_profile(const char *name);
+
+/*
+ * Set up attr for a new thread, returns true if it sets a scheduling
+ * policy. If the thread cannot be created with it (EPERM), the policy
+ * is dropped with install_priority_sched_denied(). The policies that
+ * cannot be set in attr are applied by install_priority_thread_started().
+ */
+bool install_priority_thread_attr(pthread_attr_t *attr);
+void install_priority_thread_started(pthread_t id);
+void install_priority_sched_denied(void);
+
+#endif
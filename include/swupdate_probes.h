@@ -0,0 +1,38 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWPROBES_H
+#define _SWPROBES_H
+
+/*
+ * Static probes (USDT) of the provider "swupdate". With
+ * CONFIG_USDT_PROBES, each probe is a nop in the code and a note
+ * in the ELF file that bpftrace, perf or SystemTap attach to.
+ * Otherwise they are removed and their arguments are not evaluated.
+ */
+/* Stages reported by copy_chunk */
+enum probe_copy_stage {
+	PROBE_COPY_INPUT,
+	PROBE_COPY_DECRYPT,
+	PROBE_COPY_WRITE
+};
+
+#ifdef CONFIG_USDT_PROBES
+#include <sys/sdt.h>
+
+#define SWU_PROBE(name)			DTRACE_PROBE(swupdate, name)
+#define SWU_PROBE1(name, a)		DTRACE_PROBE1(swupdate, name, a)
+#define SWU_PROBE2(name, a, b)		DTRACE_PROBE2(swupdate, name, a, b)
+#define SWU_PROBE3(name, a, b, c)	DTRACE_PROBE3(swupdate, name, a, b, c)
+#else
+#define SWU_PROBE(name)			do { } while (0)
+#define SWU_PROBE1(name, a)		do { } while (0)
+#define SWU_PROBE2(name, a, b)		do { } while (0)
+#define SWU_PROBE3(name, a, b, c)	do { } while (0)
+#endif
+
+#endif
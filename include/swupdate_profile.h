@@ -0,0 +1,72 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWPROFILE_H
+#define _SWPROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#define PROFILE_FILENAME	"swupdate-profile.json"
+#define PROFILE_UPDATES		8
+
+struct img_type;
+
+/*
+ * Resources used by the thread running a handler, taken
+ * when the handler starts and subtracted when it ends.
+ */
+struct profile_sample {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t rchar;		/* bytes read by syscalls */
+	uint64_t wchar;		/* bytes written by syscalls */
+	uint64_t syscalls;	/* read and write syscalls */
+	uint64_t copied;	/* bytes written by the copy pipeline */
+	long maxrss;		/* peak RSS of the process, KiB */
+};
+
+/*
+ * Each update gets a report, summed up from its handlers and from the
+ * metrics counted meanwhile. The file is written again when an update
+ * ends. profile_count_written() is called by the copy pipeline in the
+ * thread of the handler.
+ */
+#ifdef CONFIG_PROFILE
+void profile_update_begin(void);
+void profile_update_end(const char *version, int result);
+void profile_handler_begin(struct profile_sample *s);
+void profile_handler_end(struct profile_sample *s, const char *hnd,
+			 const struct img_type *img);
+void profile_count_written(uint64_t bytes);
+int profile_write(char *path, size_t len);
+#else
+static inline void profile_update_begin(void) { }
+static inline void profile_update_end(const char *version, int result)
+{
+	(void)version;
+	(void)result;
+}
+static inline void profile_handler_begin(struct profile_sample *s) { (void)s; }
+static inline void profile_handler_end(struct profile_sample *s, const char *hnd,
+				       const struct img_type *img)
+{
+	(void)s;
+	(void)hnd;
+	(void)img;
+}
+static inline void profile_count_written(uint64_t bytes) { (void)bytes; }
+static inline int profile_write(char *path, size_t len)
+{
+	(void)path;
+	(void)len;
+	return -ENOSYS;
+}
+#endif
+
+#endif
@@ -16,8 +16,11 @@ typedef int (*settings_callback)(void *elem, void *data);
 
 #include <libconfig.h>
 
+struct cfg_cache;
+
 typedef struct {
-	config_t cfg;
+	config_t *cfg;			/* parsed file, shared by the handles */
+	struct cfg_cache *cache;
 } swupdate_cfg_handle;
 
 void swupdate_cfg_init(swupdate_cfg_handle *handle);
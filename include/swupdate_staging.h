@@ -0,0 +1,34 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWSTAGING_H
+#define _SWSTAGING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "swupdate.h"
+
+/*
+ * Staging of the images that are not installed from the stream.
+ *
+ * With "staging-ram" in the configuration file, an image that fits
+ * in the budget (and in the memory budget of the process) is kept
+ * in an anonymous memory file instead of TMPDIR. An image staged in
+ * either place is released as soon as the last image using it is
+ * installed, the rest is freed by staging_cleanup().
+ */
+void staging_set_limit(size_t limit);
+
+/* Returns a descriptor to write the image, ram is set if in memory */
+int staging_create(struct swupdate_cfg *sw, struct img_type *img,
+		   size_t size, bool *ram);
+/* -ENOENT if the image is not in memory */
+int staging_open(struct img_type *img);
+void staging_release(struct img_type *img);
+void staging_cleanup(void);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWTIMELINE_H
+#define _SWTIMELINE_H
+
+#include <stdint.h>
+
+#define TIMELINE_FILENAME	"swupdate-timeline.json"
+
+/*
+ * Timeline of an installation: each span is recorded as a
+ * complete event in the Chrome trace format and the whole
+ * timeline is written to TMPDIR when the update ends.
+ */
+struct timeline_span {
+	uint64_t start;
+};
+
+#ifdef CONFIG_TIMELINE
+void timeline_start(void);
+void timeline_begin(struct timeline_span *span);
+void timeline_end(struct timeline_span *span, const char *cat, const char *name);
+int timeline_write(void);
+#else
+static inline void timeline_start(void) { }
+static inline void timeline_begin(struct timeline_span *span) { (void)span; }
+static inline void timeline_end(struct timeline_span *span, const char *cat,
+				const char *name)
+{
+	(void)span;
+	(void)cat;
+	(void)name;
+}
+static inline int timeline_write(void) { return 0; }
+#endif
+
+#endif
@@ -83,6 +83,7 @@ typedef void (*notifier) (RECOVERY_STATUS status, int error, int level, const ch
 void notify(RECOVERY_STATUS status, int error, int level, const char *msg);
 void notify_init(void);
 void notifier_set_color(int level, char *col);
+void notifier_queue_log(int fd, int level, int prio, const char *buf, size_t len);
 #define swupdate_notify(status, format, level, arg...) do { \
 	if (loglevel >= level) { \
 		char tmpbuf[NOTIFY_BUF_SIZE]; \
@@ -166,6 +167,16 @@ typedef int (*writeimage) (void *out, const void *buf, size_t len);
 
 void *saferealloc(void *ptr, size_t size);
 int copy_write(void *out, const void *buf, size_t len);
+
+/*
+ * Output of copy_write_tee(), the same data is written to
+ * each file descriptor. The seek of an image applies to all.
+ */
+struct copy_tee {
+	int *fds;
+	unsigned int count;
+};
+int copy_write_tee(void *out, const void *buf, size_t len);
 #if defined(__FreeBSD__)
 int copy_write_padded(void *out, const void *buf, size_t len);
 #endif
@@ -177,10 +188,19 @@ strlcpy(char *dst, const char * src, size_t size);
 int copyfile(int fdin, void *out, size_t nbytes, unsigned long *offs,
 	unsigned long long seek,
 	int skip_file, int compressed, uint32_t *checksum,
-	unsigned char *hash, bool encrypted, const char *imgivt, writeimage callback);
+	unsigned char *hash, int encrypted, const char *imgivt, writeimage callback);
+/* As copyfile, with the algorithm of hash (NULL for SHA-256) */
+int copyfile_hash(int fdin, void *out, size_t nbytes, unsigned long *offs,
+	unsigned long long seek,
+	int skip_file, int compressed, uint32_t *checksum,
+	unsigned char *hash, const char *hashalg, int encrypted,
+	const char *imgivt, writeimage callback);
 int copyimage(void *out, struct img_type *img, writeimage callback);
+void free_zstd_dictionaries(void);
+size_t copy_buffer_size(int fdout, size_t requested);
+int copy_in_kernel(int fdin, int fdout, size_t nbytes, size_t *copied);
 int copybuffer(unsigned char *inbuf, void *out, size_t nbytes, int compressed,
-	unsigned char *hash, bool encrypted, const char *imgivt, writeimage callback);
+	unsigned char *hash, int encrypted, const char *imgivt, writeimage callback);
 off_t extract_next_file(int fd, int fdout, off_t start, int compressed,
 			int encrypted, char *ivt, unsigned char *hash);
 int openfileoutput(const char *filename);
@@ -200,6 +220,8 @@ void freeargs (char **argv);
 int get_hw_revision(struct hw_type *hw);
 void get_sw_versions(swupdate_cfg_handle *handle, struct swupdate_cfg *sw);
 int compare_versions(const char* left_version, const char* right_version);
+bool is_version_installed(struct swupdate_cfg *sw, const char *name,
+			  const char *version, bool higher);
 int hwid_match(const char* rev, const char* hwrev);
 int check_hw_compatibility(struct swupdate_cfg *cfg);
 int count_elem_list(struct imglist *list);
@@ -209,6 +231,19 @@ int read_lines_notify(int fd, char *buf, int buf_size, int *buf_offset,
 		      LOGLEVEL level);
 long long get_output_size(struct img_type *img, bool strict);
 bool img_check_free_space(struct img_type *img, int fd);
+void img_free_space_reset(void);
+void preallocate_output(int fd, long long size);
+
+enum {
+	DISCARD_NONE,
+	DISCARD_FULL,
+	DISCARD_SECURE,
+	DISCARD_TAIL
+};
+int img_discard_mode(struct img_type *img);
+int blkdev_discard(int fd, unsigned long long start,
+		   unsigned long long len, bool secure);
+int blkdev_discard_device(const char *device, bool secure);
 
 /* Decryption key functions */
 int load_decryption_key(char *fname);
@@ -223,6 +258,7 @@ int get_install_info(sourcetype *source, char *buf, size_t len);
 void get_install_swset(char *buf, size_t len);
 void get_install_running_mode(char *buf, size_t len);
 char *get_root_device(void);
+void refresh_root_device(void);
 
 /* Setting global information */
 void set_version_range(const char *minversion,
@@ -0,0 +1,32 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _VERITY_H
+#define _VERITY_H
+
+#include <stddef.h>
+#include "swupdate.h"
+
+/*
+ * dm-verity hash tree of an image, computed from the data while it is
+ * written. The layout is the one of "veritysetup format" with sha256
+ * and blocks of 4096 bytes, so the device can be opened with
+ * veritysetup or with the dm-verity table built by the bootloader.
+ */
+struct verity_tree;
+
+/*
+ * Returns 0 if the image does not request a tree, 1 if tree
+ * was allocated, a negative value on error
+ */
+int verity_start(struct img_type *img, struct verity_tree **tree);
+int verity_update(struct verity_tree *tree, const void *buf, size_t len);
+/* Writes the tree and stores the root hash for the bootloader */
+int verity_finish(struct verity_tree *tree, struct img_type *img);
+void verity_free(struct verity_tree *tree);
+
+#endif
@@ -143,7 +143,49 @@ int swupdate_async_start(writedata wr_func, getstatus status_func,
 	rq->get = status_func;
 	rq->end = end_func;
 
-	connfd = ipc_inst_start_ext(priv, size);
+	/* the image is only written with ipc_send_data() */
+	connfd = ipc_inst_start_shm(priv, size);
+
+	if (connfd < 0)
+		return connfd;
+
+	rq->connfd = connfd;
+
+	start_ipc_thread(swupdate_async_thread, rq);
+
+	return running != ASYNC_THREAD_INIT;
+}
+
+/*
+ * As swupdate_async_start(), but SWUpdate reads the update itself
+ * from fd, the caller does not copy it through the socket.
+ * Fails if SWUpdate does not support it, the caller can then
+ * fall back to swupdate_async_start().
+ */
+int swupdate_async_start_fd(int fd, getstatus status_func,
+				terminated end_func, void *priv, ssize_t size)
+{
+	struct async_lib *rq;
+	int connfd;
+
+	switch (running) {
+	case ASYNC_THREAD_INIT:
+		break;
+	case ASYNC_THREAD_DONE:
+		pthread_join(async_thread_id, NULL);
+		running = ASYNC_THREAD_INIT;
+		break;
+	default:
+		return -EBUSY;
+	}
+
+	rq = get_request();
+
+	rq->wr = NULL;
+	rq->get = status_func;
+	rq->end = end_func;
+
+	connfd = ipc_inst_start_fd(priv, size, fd);
 
 	if (connfd < 0)
 		return connfd;
@@ -226,6 +268,40 @@ int swupdate_set_version_range(const char *minversion,
 	return ipc_send_cmd(&msg);
 }
 
+/*
+ * Select the install-priority profile of SWUpdate,
+ * e.g. "peak" while the application is under load
+ */
+int swupdate_set_install_priority(const char *profile)
+{
+	ipc_message msg;
+
+	if (!profile || strlen(profile) >= sizeof(msg.data.msg))
+		return -EINVAL;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = SET_INSTALL_PRIORITY;
+	strncpy(msg.data.msg, profile, sizeof(msg.data.msg) - 1);
+
+	return ipc_send_cmd(&msg);
+}
+
+/*
+ * SWUpdate detects the root device once, this is required
+ * only if it has changed, e.g. after a switch_root
+ */
+int swupdate_refresh_root_device(void)
+{
+	ipc_message msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = REFRESH_ROOT_DEVICE;
+
+	return ipc_send_cmd(&msg);
+}
+
 void swupdate_prepare_req(struct swupdate_request *req) {
 	if (!req)
 		return;
@@ -0,0 +1,460 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ *
+ * Non-blocking client interface: each context owns a non-blocking
+ * connection and a small state machine that is run by an event loop
+ * of the caller, so that one thread can drive an update and follow
+ * status, notifications and progress at the same time.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "network_ipc.h"
+#include "progress_ipc.h"
+
+#define NB_DATA_SIZE	(16 * 1024)
+
+enum nb_kind {
+	NB_INSTALL,
+	NB_STATUS,
+	NB_NOTIFY,
+	NB_PROGRESS
+};
+
+enum nb_state {
+	NB_SEND_REQUEST,	/* request queued in out[] */
+	NB_WAIT_ACK,		/* waiting for ACK / NACK */
+	NB_SEND_IMAGE,		/* streaming the image */
+	NB_RECEIVE,		/* reading messages */
+	NB_DONE,
+	NB_FAILED
+};
+
+struct swupdate_nb {
+	enum nb_kind kind;
+	enum nb_state state;
+	int connfd;
+	int imagefd;
+	int passfd;		/* sent with the request (REQ_INSTALL_FD) */
+	char out[sizeof(ipc_message) + 16];
+	size_t outlen, outoff;
+	char in[sizeof(struct progress_msg) > sizeof(ipc_message) + 16 ?
+		sizeof(struct progress_msg) : sizeof(ipc_message) + 16];
+	size_t inlen;
+	char *data;
+	size_t datalen, dataoff;
+	ipc_message msg;
+	struct progress_msg progress;
+};
+
+static int nb_connect(const char *path)
+{
+	struct sockaddr_un servaddr;
+	int connfd;
+
+	connfd = socket(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (connfd < 0)
+		return -errno;
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sun_family = AF_LOCAL;
+	strncpy(servaddr.sun_path, path, sizeof(servaddr.sun_path) - 1);
+
+	/*
+	 * A local socket is connected immediately, EAGAIN means
+	 * that the backlog of SWUpdate is full
+	 */
+	if (connect(connfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+		int ret = -errno;
+		close(connfd);
+		return ret;
+	}
+
+	return connfd;
+}
+
+static struct swupdate_nb *nb_new(enum nb_kind kind, const char *path)
+{
+	struct swupdate_nb *nb = calloc(1, sizeof(*nb));
+	int connfd;
+
+	if (!nb) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	connfd = nb_connect(path);
+	if (connfd < 0) {
+		free(nb);
+		errno = -connfd;
+		return NULL;
+	}
+	nb->kind = kind;
+	nb->connfd = connfd;
+	nb->imagefd = -1;
+	nb->passfd = -1;
+
+	return nb;
+}
+
+static struct swupdate_nb *nb_request(enum nb_kind kind, ipc_message *msg)
+{
+	struct swupdate_nb *nb = nb_new(kind, get_ctrl_socket());
+	int len;
+
+	if (!nb)
+		return NULL;
+
+	msg->magic = IPC_MAGIC;
+	len = ipc_pack_msg(msg, IPC_PROTO_V2, nb->out, sizeof(nb->out));
+	if (len < 0) {
+		swupdate_nb_free(nb);
+		errno = -len;
+		return NULL;
+	}
+	nb->outlen = len;
+	nb->state = NB_SEND_REQUEST;
+
+	return nb;
+}
+
+/*
+ * Start an update: the image is read from imagefd and streamed to
+ * SWUpdate, or imagefd is passed to SWUpdate if passfd is set. As the
+ * context waits for the connection only, imagefd must be readable
+ * without waiting, that is a regular file. The caller owns imagefd.
+ */
+struct swupdate_nb *swupdate_nb_install(void *req, ssize_t size,
+					int imagefd, bool passfd)
+{
+	struct swupdate_request localreq;
+	struct swupdate_nb *nb;
+	ipc_message msg;
+
+	if (req) {
+		if (size != sizeof(struct swupdate_request)) {
+			errno = EINVAL;
+			return NULL;
+		}
+	} else {
+		swupdate_prepare_req(&localreq);
+		req = &localreq;
+	}
+	if (imagefd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = passfd ? REQ_INSTALL_FD : REQ_INSTALL;
+	msg.data.instmsg.req = *(struct swupdate_request *)req;
+
+	nb = nb_request(NB_INSTALL, &msg);
+	if (!nb)
+		return NULL;
+	if (passfd) {
+		nb->passfd = imagefd;
+	} else {
+		nb->imagefd = imagefd;
+		nb->data = malloc(NB_DATA_SIZE);
+		if (!nb->data) {
+			swupdate_nb_free(nb);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	return nb;
+}
+
+/* Ask for the status once (GET_STATUS) */
+struct swupdate_nb *swupdate_nb_status(void)
+{
+	ipc_message msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = GET_STATUS;
+
+	return nb_request(NB_STATUS, &msg);
+}
+
+/* Open the stream of notifications (NOTIFY_STREAM) */
+struct swupdate_nb *swupdate_nb_notify(void)
+{
+	ipc_message msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = NOTIFY_STREAM;
+
+	return nb_request(NB_NOTIFY, &msg);
+}
+
+struct swupdate_nb *progress_ipc_nb_connect(void)
+{
+	struct swupdate_nb *nb = nb_new(NB_PROGRESS, get_prog_socket());
+
+	if (nb)
+		nb->state = NB_RECEIVE;
+
+	return nb;
+}
+
+int swupdate_nb_fd(const struct swupdate_nb *nb)
+{
+	return nb->connfd;
+}
+
+int swupdate_nb_events(const struct swupdate_nb *nb)
+{
+	switch (nb->state) {
+	case NB_SEND_REQUEST:
+	case NB_SEND_IMAGE:
+		return POLLOUT;
+	case NB_WAIT_ACK:
+	case NB_RECEIVE:
+		return POLLIN;
+	default:
+		return 0;
+	}
+}
+
+const ipc_message *swupdate_nb_message(const struct swupdate_nb *nb)
+{
+	return &nb->msg;
+}
+
+const struct progress_msg *progress_ipc_nb_message(const struct swupdate_nb *nb)
+{
+	return &nb->progress;
+}
+
+static int nb_fail(struct swupdate_nb *nb, int err)
+{
+	nb->state = NB_FAILED;
+	return err;
+}
+
+static void nb_finish(struct swupdate_nb *nb)
+{
+	close(nb->connfd);
+	nb->connfd = -1;
+	nb->state = NB_DONE;
+}
+
+/*
+ * Send the queued request, the descriptor to be passed
+ * goes with the first bytes. Returns 0 when all is sent.
+ */
+static int nb_send_request(struct swupdate_nb *nb)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t n;
+
+	while (nb->outoff < nb->outlen) {
+		iov.iov_base = nb->out + nb->outoff;
+		iov.iov_len = nb->outlen - nb->outoff;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		if (!nb->outoff && nb->passfd >= 0) {
+			memset(&control, 0, sizeof(control));
+			mh.msg_control = control.buf;
+			mh.msg_controllen = sizeof(control.buf);
+			cmsg = CMSG_FIRSTHDR(&mh);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &nb->passfd, sizeof(int));
+		}
+		n = sendmsg(nb->connfd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		nb->outoff += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Stream the image until the socket is full,
+ * returns 1 at the end of the image
+ */
+static int nb_send_image(struct swupdate_nb *nb)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (nb->dataoff == nb->datalen) {
+			n = read(nb->imagefd, nb->data, NB_DATA_SIZE);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (!n)
+				return 1;
+			nb->datalen = n;
+			nb->dataoff = 0;
+		}
+		n = send(nb->connfd, nb->data + nb->dataoff,
+			 nb->datalen - nb->dataoff, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		nb->dataoff += n;
+	}
+}
+
+/* Take a complete message from the input buffer, 1 if one was found */
+static int nb_unpack(struct swupdate_nb *nb)
+{
+	int len;
+
+	if (nb->kind == NB_PROGRESS) {
+		if (nb->inlen < sizeof(nb->progress))
+			return 0;
+		memcpy(&nb->progress, nb->in, sizeof(nb->progress));
+		len = sizeof(nb->progress);
+	} else {
+		len = ipc_unpack_msg(nb->in, nb->inlen, &nb->msg);
+		if (len <= 0)
+			return len;
+	}
+	nb->inlen -= len;
+	memmove(nb->in, nb->in + len, nb->inlen);
+
+	return 1;
+}
+
+/*
+ * Read until a message is complete, returns 1 for a message,
+ * -EAGAIN if the socket was drained and -EPIPE if it was closed.
+ */
+static int nb_receive(struct swupdate_nb *nb)
+{
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		ret = nb_unpack(nb);
+		if (ret)
+			return ret;
+		n = read(nb->connfd, nb->in + nb->inlen, sizeof(nb->in) - nb->inlen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!n)
+			return -EPIPE;
+		nb->inlen += n;
+	}
+}
+
+/*
+ * Run the state machine after poll() has reported revents on the
+ * descriptor. It returns:
+ *	SWUPDATE_NB_AGAIN : nothing to report, wait for swupdate_nb_events()
+ *	SWUPDATE_NB_MSG   : a message was received, it is returned by
+ *	                    swupdate_nb_message() or progress_ipc_nb_message().
+ *	                    More messages can be buffered, call again.
+ *	SWUPDATE_NB_DONE  : the request is completed
+ *	< 0               : -errno, -EBUSY if SWUpdate answered with NACK
+ */
+int swupdate_nb_process(struct swupdate_nb *nb, int revents)
+{
+	int ret;
+
+	switch (nb->state) {
+	case NB_SEND_REQUEST:
+		if (revents & (POLLERR | POLLHUP))
+			return nb_fail(nb, -EPIPE);
+		ret = nb_send_request(nb);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+			return SWUPDATE_NB_AGAIN;
+		if (ret)
+			return nb_fail(nb, ret);
+		nb->state = NB_WAIT_ACK;
+		return SWUPDATE_NB_AGAIN;
+
+	case NB_WAIT_ACK:
+		ret = nb_receive(nb);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+			return SWUPDATE_NB_AGAIN;
+		if (ret < 0)
+			return nb_fail(nb, ret);
+		if (nb->kind == NB_STATUS) {
+			nb_finish(nb);
+			return SWUPDATE_NB_MSG;
+		}
+		if (nb->msg.type != ACK)
+			return nb_fail(nb, -EBUSY);
+		if (nb->kind == NB_NOTIFY) {
+			nb->state = NB_RECEIVE;
+			return swupdate_nb_process(nb, revents);
+		}
+		if (nb->passfd >= 0) {
+			/* SWUpdate reads the image itself */
+			nb_finish(nb);
+			return SWUPDATE_NB_DONE;
+		}
+		nb->state = NB_SEND_IMAGE;
+		return SWUPDATE_NB_AGAIN;
+
+	case NB_SEND_IMAGE:
+		if (revents & (POLLERR | POLLHUP))
+			return nb_fail(nb, -EPIPE);
+		ret = nb_send_image(nb);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+			return SWUPDATE_NB_AGAIN;
+		if (ret < 0)
+			return nb_fail(nb, ret);
+		nb_finish(nb);
+		return SWUPDATE_NB_DONE;
+
+	case NB_RECEIVE:
+		ret = nb_receive(nb);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+			return SWUPDATE_NB_AGAIN;
+		if (ret < 0)
+			return nb_fail(nb, ret);
+		return SWUPDATE_NB_MSG;
+
+	case NB_DONE:
+		return SWUPDATE_NB_DONE;
+
+	default:
+		return -EPIPE;
+	}
+}
+
+void swupdate_nb_free(struct swupdate_nb *nb)
+{
+	if (!nb)
+		return;
+	if (nb->connfd >= 0)
+		close(nb->connfd);
+	free(nb->data);
+	free(nb);
+}
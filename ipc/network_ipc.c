@@ -7,15 +7,23 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include "network_ipc.h"
+#include "ipc_ring.h"
 #include "compat.h"
 
 #ifdef CONFIG_SOCKET_CTRL_PATH
@@ -60,6 +68,338 @@ static int prepare_ipc(void) {
 	return connfd;
 }
 
+struct ipc_header {
+	int magic;
+	int type;
+	unsigned int len;
+};
+
+static int ipc_read(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+	ssize_t n;
+	fd_set fds;
+
+	while (done < count) {
+		n = read(fd, (char *)buf + done, count - done);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n == 0)
+			return -EPIPE;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN || !done)
+			return -errno;
+		/* non blocking socket, wait for the rest of the message */
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		if (select(fd + 1, &fds, NULL, NULL, NULL) < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return 0;
+}
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC	0
+#endif
+
+/*
+ * Read the first bytes of a message, collecting a file descriptor
+ * passed with SCM_RIGHTS. An unexpected descriptor is closed.
+ */
+static int ipc_read_fd(int fd, void *buf, size_t count, int *passed)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { buf, count };
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	int rfd;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	do {
+		n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n == 0)
+		return -EPIPE;
+	if (n < 0)
+		return -errno;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(&rfd, CMSG_DATA(cmsg), sizeof(rfd));
+		if (passed && *passed < 0)
+			*passed = rfd;
+		else
+			close(rfd);
+	}
+
+	if ((size_t)n < count)
+		return ipc_read(fd, (char *)buf + n, count - n);
+
+	return 0;
+}
+
+static int ipc_write_fd(int fd, struct iovec *iov, int iovcnt, int passfd)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	ssize_t n;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = iovcnt;
+
+	if (passfd >= 0) {
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+	}
+
+	while (mh.msg_iovlen) {
+		n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* the descriptor goes with the first bytes only */
+		mh.msg_control = NULL;
+		mh.msg_controllen = 0;
+		while (mh.msg_iovlen && (size_t)n >= mh.msg_iov->iov_len) {
+			n -= mh.msg_iov->iov_len;
+			mh.msg_iov++;
+			mh.msg_iovlen--;
+		}
+		if (mh.msg_iovlen) {
+			mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + n;
+			mh.msg_iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static size_t ipc_payload_len(const ipc_message *msg)
+{
+	const char *data = (const char *)&msg->data;
+	size_t len = sizeof(msg->data);
+
+	while (len && !data[len - 1])
+		len--;
+
+	return len;
+}
+
+/*
+ * Store a message as it is sent on the wire,
+ * return its length or -ENOBUFS if it does not fit
+ */
+int ipc_pack_msg(const ipc_message *msg, int version, char *buf, size_t size)
+{
+	struct ipc_header hdr;
+	size_t len;
+
+	if (version == IPC_PROTO_V1) {
+		if (size < sizeof(*msg))
+			return -ENOBUFS;
+		memcpy(buf, msg, sizeof(*msg));
+		return sizeof(*msg);
+	}
+
+	len = ipc_payload_len(msg);
+	if (size < sizeof(hdr) + len)
+		return -ENOBUFS;
+
+	hdr.magic = IPC_MAGIC_V2;
+	hdr.type = msg->type;
+	hdr.len = len;
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &msg->data, len);
+
+	return sizeof(hdr) + len;
+}
+
+/*
+ * Extract a message from data received as a stream, for callers
+ * that do not read the socket themselves. Returns the number of
+ * bytes consumed, 0 if the message is not complete yet.
+ */
+int ipc_unpack_msg(const char *buf, size_t size, ipc_message *msg)
+{
+	struct ipc_header hdr;
+
+	if (size < offsetof(struct ipc_header, len))
+		return 0;
+	memcpy(&hdr, buf, offsetof(struct ipc_header, len));
+
+	switch (hdr.magic) {
+	case IPC_MAGIC:
+		if (size < sizeof(*msg))
+			return 0;
+		memcpy(msg, buf, sizeof(*msg));
+		return sizeof(*msg);
+	case IPC_MAGIC_V2:
+		if (size < sizeof(hdr))
+			return 0;
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.len > sizeof(msg->data))
+			return -EMSGSIZE;
+		if (size < sizeof(hdr) + hdr.len)
+			return 0;
+		msg->magic = IPC_MAGIC;
+		msg->type = hdr.type;
+		memset(&msg->data, 0, sizeof(msg->data));
+		memcpy(&msg->data, buf + sizeof(hdr), hdr.len);
+		return sizeof(hdr) + hdr.len;
+	default:
+		return -EPROTO;
+	}
+}
+
+/*
+ * Length on the wire of the message starting with the size bytes in buf,
+ * or the number of bytes needed to know it. A caller reading the socket
+ * itself uses it not to read past the message.
+ */
+int ipc_msg_len(const char *buf, size_t size)
+{
+	struct ipc_header hdr;
+
+	if (size < offsetof(struct ipc_header, len))
+		return offsetof(struct ipc_header, len);
+	memcpy(&hdr, buf, offsetof(struct ipc_header, len));
+
+	switch (hdr.magic) {
+	case IPC_MAGIC:
+		return sizeof(ipc_message);
+	case IPC_MAGIC_V2:
+		if (size < sizeof(hdr))
+			return sizeof(hdr);
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.len > sizeof(((ipc_message *)0)->data))
+			return -EMSGSIZE;
+		return sizeof(hdr) + hdr.len;
+	default:
+		return -EPROTO;
+	}
+}
+
+/*
+ * Send a message with the framing of the requested protocol version,
+ * and a file descriptor if fd is not negative
+ */
+int ipc_send_msg_fd(int connfd, const ipc_message *msg, int version, int fd)
+{
+	struct ipc_header hdr;
+	struct iovec iov[2];
+	size_t len;
+
+	if (version == IPC_PROTO_V1) {
+		iov[0].iov_base = (void *)msg;
+		iov[0].iov_len = sizeof(*msg);
+		return ipc_write_fd(connfd, iov, 1, fd);
+	}
+
+	len = ipc_payload_len(msg);
+
+	hdr.magic = IPC_MAGIC_V2;
+	hdr.type = msg->type;
+	hdr.len = len;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)&msg->data;
+	iov[1].iov_len = len;
+
+	return ipc_write_fd(connfd, iov, len ? 2 : 1, fd);
+}
+
+int ipc_send_msg(int connfd, const ipc_message *msg, int version)
+{
+	return ipc_send_msg_fd(connfd, msg, version, -1);
+}
+
+/*
+ * Receive a message in any protocol version.
+ * On success, the version used by the peer is returned
+ * and the message is filled as with version 1.
+ */
+int ipc_recv_msg(int connfd, ipc_message *msg)
+{
+	return ipc_recv_msg_fd(connfd, msg, NULL);
+}
+
+/*
+ * As ipc_recv_msg(), a file descriptor sent with the message is
+ * returned in fd (-1 if none), the caller owns it.
+ */
+int ipc_recv_msg_fd(int connfd, ipc_message *msg, int *fd)
+{
+	struct ipc_header hdr;
+	int ret;
+
+	if (fd)
+		*fd = -1;
+	ret = ipc_read_fd(connfd, &hdr, offsetof(struct ipc_header, len), fd);
+	if (ret)
+		goto out;
+
+	switch (hdr.magic) {
+	case IPC_MAGIC:
+		msg->magic = hdr.magic;
+		msg->type = hdr.type;
+		ret = ipc_read(connfd, &msg->data, sizeof(*msg) - offsetof(ipc_message, data));
+		ret = ret ? (ret == -EAGAIN ? -EIO : ret) : IPC_PROTO_V1;
+		break;
+	case IPC_MAGIC_V2:
+		ret = ipc_read(connfd, &hdr.len, sizeof(hdr.len));
+		if (ret) {
+			ret = ret == -EAGAIN ? -EIO : ret;
+			break;
+		}
+		if (hdr.len > sizeof(msg->data)) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		msg->magic = IPC_MAGIC;
+		msg->type = hdr.type;
+		memset(&msg->data, 0, sizeof(msg->data));
+		ret = ipc_read(connfd, &msg->data, hdr.len);
+		ret = ret ? (ret == -EAGAIN ? -EIO : ret) : IPC_PROTO_V2;
+		break;
+	default:
+		ret = -EPROTO;
+	}
+
+out:
+	if (ret < 0 && fd && *fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+	return ret;
+}
+
 int ipc_postupdate(ipc_message *msg) {
 	int connfd = prepare_ipc();
 	if (connfd < 0)
@@ -85,13 +425,79 @@ int ipc_postupdate(ipc_message *msg) {
 	msg->magic = IPC_MAGIC;
 	msg->type = POST_UPDATE;
 
-	int result = write(connfd, msg, sizeof(*msg)) != sizeof(*msg) ||
-		read(connfd, msg, sizeof(*msg)) != sizeof(*msg);
+	int result = ipc_send_msg(connfd, msg, IPC_PROTO_V2) ||
+		ipc_recv_msg(connfd, msg) < 0;
 
 	close(connfd);
 	return -result;
 }
 
+/*
+ * Ask SWUpdate for the path of a file it generates
+ * (GET_TIMELINE, GET_METRICS, GET_PROFILE). Returns -ENOENT if the
+ * file is not available.
+ */
+int ipc_get_file_path(int type, char *path, size_t len)
+{
+	ipc_message msg;
+	int connfd, ret;
+
+	connfd = prepare_ipc();
+	if (connfd < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = type;
+	ret = ipc_send_msg(connfd, &msg, IPC_PROTO_V2);
+	if (!ret)
+		ret = ipc_recv_msg(connfd, &msg) < 0 ? -1 : 0;
+	close(connfd);
+	if (ret)
+		return ret;
+	if (msg.type != ACK)
+		return -ENOENT;
+
+	msg.data.msg[sizeof(msg.data.msg) - 1] = '\0';
+	snprintf(path, len, "%s", msg.data.msg);
+
+	return 0;
+}
+
+/*
+ * Ask the running update if an entry of the SWU is required.
+ * Returns 1 or 0, -EAGAIN if sw-description is not parsed yet
+ * and -ENOENT if no update is running.
+ */
+int ipc_artifact_required(const char *filename)
+{
+	ipc_message msg;
+	int connfd, ret;
+
+	memset(&msg, 0, sizeof(msg));
+	if (strlen(filename) >= sizeof(msg.data.artifact.filename))
+		return -EINVAL;
+
+	connfd = prepare_ipc();
+	if (connfd < 0)
+		return -1;
+
+	msg.magic = IPC_MAGIC;
+	msg.type = GET_ARTIFACT_REQUIRED;
+	strncpy(msg.data.artifact.filename, filename,
+		sizeof(msg.data.artifact.filename) - 1);
+	ret = ipc_send_msg(connfd, &msg, IPC_PROTO_V2);
+	if (!ret)
+		ret = ipc_recv_msg(connfd, &msg) < 0 ? -1 : 0;
+	close(connfd);
+	if (ret)
+		return ret;
+	if (msg.type != ACK)
+		return -ENOENT;
+
+	return msg.data.artifact.required;
+}
+
 static int __ipc_get_status(int connfd, ipc_message *msg, unsigned int timeout_ms)
 {
 	fd_set fds;
@@ -101,7 +507,7 @@ static int __ipc_get_status(int connfd, ipc_message *msg, unsigned int timeout_m
 	msg->magic = IPC_MAGIC;
 	msg->type = GET_STATUS;
 
-	if (write(connfd, msg, sizeof(*msg)) != sizeof(*msg))
+	if (ipc_send_msg(connfd, msg, IPC_PROTO_V2))
 		return -1;
 
 	if (timeout_ms) {
@@ -121,7 +527,7 @@ static int __ipc_get_status(int connfd, ipc_message *msg, unsigned int timeout_m
 			return -ETIMEDOUT;
 	}
 
-	return -(read(connfd, msg, sizeof(*msg)) != sizeof(*msg));
+	return ipc_recv_msg(connfd, msg) < 0 ? -1 : 0;
 }
 
 int ipc_get_status(ipc_message *msg)
@@ -172,7 +578,7 @@ static int __ipc_start_notify(int connfd, ipc_message *msg, unsigned int timeout
 	msg->magic = IPC_MAGIC;
 	msg->type = NOTIFY_STREAM;
 
-	if (write(connfd, msg, sizeof(*msg)) != sizeof(*msg))
+	if (ipc_send_msg(connfd, msg, IPC_PROTO_V2))
 		return -1;
 
 	if (timeout_ms) {
@@ -192,7 +598,7 @@ static int __ipc_start_notify(int connfd, ipc_message *msg, unsigned int timeout
 			return -ETIMEDOUT;
 	}
 
-	return -(read(connfd, msg, sizeof(*msg)) != sizeof(*msg));
+	return ipc_recv_msg(connfd, msg) < 0 ? -1 : 0;
 }
 
 int ipc_notify_connect(void)
@@ -222,26 +628,26 @@ int ipc_notify_connect(void)
 
 int ipc_notify_receive(int *connfd, ipc_message *msg)
 {
-	int ret = read(*connfd, msg, sizeof(*msg));
+	int ret = ipc_recv_msg(*connfd, msg);
 
-	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+	if (ret == -EAGAIN)
 		return 0;
 
-	if (ret != sizeof(*msg)) {
-		fprintf(stdout, "Connection closing..\n");
+	if (ret == -EPROTO) {
+		fprintf(stdout, "Connection closing, invalid magic...\n");
 		close(*connfd);
 		*connfd = -1;
 		return -1;
 	}
 
-	if (msg->magic != IPC_MAGIC) {
-		fprintf(stdout, "Connection closing, invalid magic...\n");
+	if (ret < 0) {
+		fprintf(stdout, "Connection closing..\n");
 		close(*connfd);
 		*connfd = -1;
 		return -1;
 	}
 
-	return ret;
+	return sizeof(*msg);
 }
 
 int ipc_inst_start_ext(void *priv, ssize_t size)
@@ -283,8 +689,8 @@ int ipc_inst_start_ext(void *priv, ssize_t size)
 	msg.type = REQ_INSTALL;
 
 	msg.data.instmsg.req = *req;
-	if (write(connfd, &msg, sizeof(msg)) != sizeof(msg) ||
-		read(connfd, &msg, sizeof(msg)) != sizeof(msg) ||
+	if (ipc_send_msg(connfd, &msg, IPC_PROTO_V2) ||
+		ipc_recv_msg(connfd, &msg) < 0 ||
 		msg.type != ACK)
 		goto cleanup;
 
@@ -295,6 +701,199 @@ cleanup:
 	return -1;
 }
 
+/*
+ * As ipc_inst_start_ext(), but SWUpdate reads the update from fd
+ * instead of the connection: nothing has to be sent with
+ * ipc_send_data(), the connection is only closed with ipc_end().
+ */
+int ipc_inst_start_fd(void *priv, ssize_t size, int fd)
+{
+	int connfd;
+	ipc_message msg;
+	struct swupdate_request localreq;
+
+	if (priv) {
+		if (size != sizeof(struct swupdate_request))
+			return -EINVAL;
+	} else {
+		swupdate_prepare_req(&localreq);
+		priv = &localreq;
+	}
+	connfd = prepare_ipc();
+	if (connfd < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = REQ_INSTALL_FD;
+	msg.data.instmsg.req = *(struct swupdate_request *)priv;
+	if (ipc_send_msg_fd(connfd, &msg, IPC_PROTO_V2, fd) ||
+		ipc_recv_msg(connfd, &msg) < 0 ||
+		msg.type != ACK) {
+		close(connfd);
+		return -1;
+	}
+
+	return connfd;
+}
+
+/*
+ * Connection of the running ipc_inst_start_shm(), only one update
+ * runs at a time
+ */
+static struct {
+	int connfd;
+	struct ipc_ring *ring;
+	size_t len;
+} shm = { .connfd = -1 };
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ipc_ring *shm_map(int fd, size_t *len)
+{
+	struct ipc_ring *ring;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*ring))
+		return NULL;
+	ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+	if (ring->magic != IPC_RING_MAGIC || ring->size != IPC_RING_SIZE ||
+	    (size_t)st.st_size < ipc_ring_len(ring->size)) {
+		munmap(ring, st.st_size);
+		return NULL;
+	}
+	*len = st.st_size;
+
+	return ring;
+}
+
+/*
+ * As ipc_inst_start_ext(), but the data sent with ipc_send_data() is
+ * copied into memory shared with SWUpdate instead of the connection.
+ * If SWUpdate does not support it, the connection is a plain one.
+ * The returned connection must be closed with ipc_end().
+ */
+int ipc_inst_start_shm(void *priv, ssize_t size)
+{
+	int connfd, shmfd;
+	ipc_message msg;
+	struct ipc_ring *ring;
+	struct swupdate_request localreq;
+	size_t len;
+
+	if (priv) {
+		if (size != sizeof(struct swupdate_request))
+			return -EINVAL;
+	} else {
+		swupdate_prepare_req(&localreq);
+		priv = &localreq;
+	}
+
+	pthread_mutex_lock(&shm_lock);
+	if (shm.ring) {
+		pthread_mutex_unlock(&shm_lock);
+		return ipc_inst_start_ext(priv, size);
+	}
+	connfd = prepare_ipc();
+	if (connfd < 0) {
+		pthread_mutex_unlock(&shm_lock);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = REQ_INSTALL_SHM;
+	msg.data.instmsg.req = *(struct swupdate_request *)priv;
+	if (ipc_send_msg(connfd, &msg, IPC_PROTO_V2) ||
+		ipc_recv_msg_fd(connfd, &msg, &shmfd) < 0 ||
+		msg.type != ACK) {
+		pthread_mutex_unlock(&shm_lock);
+		if (shmfd >= 0)
+			close(shmfd);
+		close(connfd);
+		/* an older SWUpdate answers with NACK */
+		return ipc_inst_start_ext(priv, sizeof(struct swupdate_request));
+	}
+
+	/* the update is started, it ends when the connection is closed */
+	ring = shmfd < 0 ? NULL : shm_map(shmfd, &len);
+	if (shmfd >= 0)
+		close(shmfd);
+	if (!ring) {
+		pthread_mutex_unlock(&shm_lock);
+		close(connfd);
+		return -1;
+	}
+	shm.connfd = connfd;
+	shm.ring = ring;
+	shm.len = len;
+	pthread_mutex_unlock(&shm_lock);
+
+	return connfd;
+}
+
+static bool shm_peer_alive(int connfd)
+{
+	struct pollfd pfd = { .fd = connfd, .events = 0 };
+
+	return poll(&pfd, 1, 0) >= 0 && !(pfd.revents & (POLLHUP | POLLERR));
+}
+
+/* Copy into the free space of the ring, the data is published at once */
+static int shm_send_data(int connfd, struct ipc_ring *ring, char *buf, int size)
+{
+	uint32_t head, seen, off, n;
+	int len = size;
+
+	while (len) {
+		seen = ipc_ring_get(&ring->freed);
+		head = ring->head;
+		if (ipc_ring_get(&ring->closed)) {
+			errno = EPIPE;
+			return -1;
+		}
+		n = head - ipc_ring_get(&ring->tail);
+		if (n >= IPC_RING_SIZE) {
+			if (ipc_ring_wait(&ring->freed, seen) == ETIMEDOUT &&
+			    !shm_peer_alive(connfd)) {
+				errno = EPIPE;
+				return -1;
+			}
+			continue;
+		}
+		n = IPC_RING_SIZE - n;
+
+		/* SWUpdate does not read what is not published */
+		if (n > (uint32_t)len)
+			n = len;
+		off = head % IPC_RING_SIZE;
+		if (n > IPC_RING_SIZE - off) {
+			memcpy(ring->data + off, buf, IPC_RING_SIZE - off);
+			memcpy(ring->data, buf + IPC_RING_SIZE - off, n - (IPC_RING_SIZE - off));
+		} else
+			memcpy(ring->data + off, buf, n);
+		buf += n;
+		len -= n;
+
+		ipc_ring_set(&ring->head, head + n);
+		ipc_ring_post(&ring->filled);
+	}
+
+	return size;
+}
+
+static struct ipc_ring *shm_ring(int connfd)
+{
+	struct ipc_ring *ring;
+
+	pthread_mutex_lock(&shm_lock);
+	ring = shm.connfd == connfd ? shm.ring : NULL;
+	pthread_mutex_unlock(&shm_lock);
+
+	return ring;
+}
+
 /*
  * this is for compatibiity to not break external API
  * Use better the _ext() version
@@ -305,16 +904,19 @@ int ipc_inst_start(void)
 }
 
 /*
- * This is not required, it is really a wrapper for
- * write, but make interface consistent
+ * This is a wrapper for write, unless the connection
+ * was started with ipc_inst_start_shm()
  */
 int ipc_send_data(int connfd, char *buf, int size)
 {
+	struct ipc_ring *ring = shm_ring(connfd);
 	ssize_t ret;
 	ssize_t len = size;
 
+	if (ring)
+		return shm_send_data(connfd, ring, buf, size);
 	while (len) {
-		ret = write(connfd, buf, (size_t)size);
+		ret = write(connfd, buf, (size_t)len);
 		if (ret < 0)
 			return ret;
 		len -= ret;
@@ -326,6 +928,15 @@ int ipc_send_data(int connfd, char *buf, int size)
 
 void ipc_end(int connfd)
 {
+	pthread_mutex_lock(&shm_lock);
+	if (shm.ring && shm.connfd == connfd) {
+		ipc_ring_set(&shm.ring->eof, 1);
+		ipc_ring_post(&shm.ring->filled);
+		munmap(shm.ring, shm.len);
+		shm.ring = NULL;
+		shm.connfd = -1;
+	}
+	pthread_mutex_unlock(&shm_lock);
 	close(connfd);
 }
 
@@ -372,8 +983,8 @@ int ipc_send_cmd(ipc_message *msg)
 	/* TODO: Check source type */
 	msg->magic = IPC_MAGIC;
 
-	int ret = write(connfd, msg, sizeof(*msg)) != sizeof(*msg) ||
-		read(connfd, msg, sizeof(*msg))  != sizeof(*msg);
+	int ret = ipc_send_msg(connfd, msg, IPC_PROTO_V2) ||
+		ipc_recv_msg(connfd, msg) < 0;
 
 	close(connfd);
 
@@ -7,6 +7,10 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -37,6 +41,17 @@ char *get_prog_socket(void) {
 	return SOCKET_PROGRESS_PATH;
 }
 
+char *get_prog_snapshot(void) {
+	static char *snapshot_path;
+
+	if (!snapshot_path &&
+	    asprintf(&snapshot_path, "%s%s", get_prog_socket(),
+		     PROGRESS_SNAPSHOT_SUFFIX) == -1)
+		snapshot_path = NULL;
+
+	return snapshot_path;
+}
+
 static int _progress_ipc_connect(const char *socketpath, bool reconnect)
 {
 	struct sockaddr_un servaddr;
@@ -76,6 +91,56 @@ int progress_ipc_connect(bool reconnect)
 	return _progress_ipc_connect(get_prog_socket(), reconnect);
 }
 
+int progress_ipc_request_ext(int connfd)
+{
+	struct progress_request req = {
+		.magic = PROGRESS_EXT_MAGIC,
+		.version = PROGRESS_API_VERSION
+	};
+
+	if (write(connfd, &req, sizeof(req)) != sizeof(req))
+		return -1;
+
+	return 0;
+}
+
+static int progress_ipc_read(int fd, void *buf, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = read(fd, buf, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		count -= (size_t)n;
+	}
+
+	return 0;
+}
+
+int progress_ipc_receive_ext(int *connfd, struct progress_msg_ext *msg) {
+	size_t extlen = sizeof(*msg) - sizeof(msg->msg);
+	int ret = progress_ipc_receive(connfd, &msg->msg);
+
+	if (ret <= 0)
+		return ret;
+
+	memset((char *)msg + sizeof(msg->msg), 0, extlen);
+	if (msg->msg.magic != PROGRESS_EXT_MAGIC)
+		return ret;
+
+	if (progress_ipc_read(*connfd, (char *)msg + sizeof(msg->msg), extlen) < 0) {
+		close(*connfd);
+		*connfd = -1;
+		return -1;
+	}
+
+	return ret + extlen;
+}
+
 int progress_ipc_receive(int *connfd, struct progress_msg *msg) {
 	int ret = read(*connfd, msg, sizeof(*msg));
 
@@ -90,3 +155,63 @@ int progress_ipc_receive(int *connfd, struct progress_msg *msg) {
 
 	return ret;
 }
+
+struct progress_snapshot *progress_ipc_snapshot_map(void)
+{
+	struct progress_snapshot *snap;
+	char *path = get_prog_snapshot();
+	struct stat st;
+	int fd;
+
+	if (!path)
+		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*snap)) {
+		close(fd);
+		return NULL;
+	}
+	snap = mmap(NULL, sizeof(*snap), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (snap == MAP_FAILED)
+		return NULL;
+	if (snap->magic != PROGRESS_SNAPSHOT_MAGIC) {
+		munmap(snap, sizeof(*snap));
+		return NULL;
+	}
+
+	return snap;
+}
+
+/*
+ * Copy the last message, retrying while SWUpdate is changing it.
+ * Returns the sequence number, that is increased by 2 for each
+ * message, so that a client can check if something has changed.
+ */
+int progress_ipc_snapshot_read(const struct progress_snapshot *snap,
+			       struct progress_msg_ext *msg)
+{
+	unsigned int seq;
+	int retry;
+
+	for (retry = 0; retry < PROGRESS_SNAPSHOT_RETRIES; retry++) {
+		seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(msg, (const void *)&snap->msg, sizeof(*msg));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) == seq)
+			return (int)(seq & 0x7fffffff);
+	}
+
+	return -EAGAIN;
+}
+
+void progress_ipc_snapshot_unmap(struct progress_snapshot *snap)
+{
+	if (snap)
+		munmap(snap, sizeof(*snap));
+}
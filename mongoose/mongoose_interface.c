@@ -13,10 +13,13 @@
 #define _XOPEN_SOURCE 600  // For PATH_MAX on linux
 
 #include <stddef.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdbool.h>
 
 #include <getopt.h>
@@ -32,6 +35,7 @@
 #include "mongoose.h"
 #include "mongoose_multipart.h"
 #include "util.h"
+#include "swupdate_timeline.h"
 
 #ifndef MG_ENABLE_SSL
 #define MG_ENABLE_SSL 0
@@ -46,6 +50,9 @@ struct mongoose_options {
 	char *port;
 	char *global_auth_file;
 	char *auth_domain;
+	char *peer_cache;
+	unsigned int cache_max_age;
+	unsigned int cache_size;
 #if MG_ENABLE_SSL
 	char *ssl_cert;
 	char *ssl_key;
@@ -62,59 +69,210 @@ struct file_upload_state {
 	uint64_t last_io_time;
 };
 
+#define UPLOAD_IPC_SNDBUF	(1024 * 1024)
+
+/*
+ * Files of the web application kept in memory,
+ * they are read again when they change on disk.
+ */
+struct cached_asset {
+	char *path;
+	char *data;
+	size_t size;
+	time_t mtime;
+	struct cached_asset *next;
+};
+
+/* a file opened through fs_web_app, either on disk or in memory */
+struct asset_fd {
+	void *fd;
+	struct cached_asset *asset;
+	size_t pos;
+};
+
+static const struct {
+	const char *name;
+	const char *suffix;
+} asset_encodings[] = {
+	{ "br", ".br" },
+	{ "gzip", ".gz" },
+};
+
 static bool run_postupdate;
 static unsigned int watchdog_conn = 0;
 static struct mg_http_serve_opts s_http_server_opts;
 const char *global_auth_domain;
 const char *global_auth_file;
+static const char *peer_cache;
+static bool listing;
+static unsigned int cache_max_age;
+static struct cached_asset *asset_cache;
+static size_t asset_cache_size, asset_cache_max;
+/* pre-compressed variant opened instead of the file, set while serving it */
+static const char *asset_suffix;
 #if MG_ENABLE_SSL
 static bool ssl;
 static struct mg_tls_opts tls_opts;
 #endif
 
-static int ws_pipe;
-
 static int s_signo = 0;
 static void signal_handler(int signo) {
 	s_signo = signo;
 }
 
+static const char *asset_path(const char *path, char *buf, size_t len)
+{
+	if (!asset_suffix)
+		return path;
+	snprintf(buf, len, "%s%s", path, asset_suffix);
+
+	return buf;
+}
+
 static int p_stat(const char *path, size_t *size, time_t *mtime)
 {
-	int flags = mg_fs_posix.st(path, size, mtime);
-	if (flags & MG_FS_DIR && strcmp(s_http_server_opts.root_dir, path) != 0)
+	char variant[MG_PATH_MAX];
+	int flags = mg_fs_posix.st(asset_path(path, variant, sizeof(variant)),
+				   size, mtime);
+	if (!listing && flags & MG_FS_DIR &&
+	    strcmp(s_http_server_opts.root_dir, path) != 0)
 		return 0;
 	return flags;
 }
 
 static void p_list(const char *path, void (*fn)(const char *, void *), void *userdata)
 {
-	(void) path, (void) fn, (void) userdata;
+	if (listing)
+		mg_fs_posix.ls(path, fn, userdata);
+}
+
+static void drop_asset(struct cached_asset *asset)
+{
+	struct cached_asset **pa;
+
+	for (pa = &asset_cache; *pa; pa = &(*pa)->next) {
+		if (*pa == asset) {
+			*pa = asset->next;
+			break;
+		}
+	}
+	asset_cache_size -= asset->size;
+	free(asset->path);
+	free(asset->data);
+	free(asset);
+}
+
+/*
+ * Return the file from the cache, it is read
+ * if it is not there yet and if it fits.
+ */
+static struct cached_asset *get_cached_asset(const char *path)
+{
+	struct cached_asset *asset;
+	size_t size = 0;
+	time_t mtime = 0;
+	int flags;
+	FILE *fp;
+
+	if (!asset_cache_max)
+		return NULL;
+	flags = mg_fs_posix.st(path, &size, &mtime);
+	if (!flags || flags & MG_FS_DIR)
+		return NULL;
+
+	for (asset = asset_cache; asset; asset = asset->next) {
+		if (!strcmp(asset->path, path))
+			break;
+	}
+	if (asset) {
+		if (asset->size == size && asset->mtime == mtime)
+			return asset;
+		drop_asset(asset);
+	}
+	if (size > asset_cache_max - asset_cache_size)
+		return NULL;
+
+	asset = calloc(1, sizeof(*asset));
+	if (!asset)
+		return NULL;
+	asset->path = strdup(path);
+	asset->data = malloc(size ? size : 1);
+	fp = fopen(path, "rb");
+	if (!asset->path || !asset->data || !fp ||
+	    fread(asset->data, 1, size, fp) != size) {
+		if (fp)
+			fclose(fp);
+		free(asset->path);
+		free(asset->data);
+		free(asset);
+		return NULL;
+	}
+	fclose(fp);
+	asset->size = size;
+	asset->mtime = mtime;
+	asset->next = asset_cache;
+	asset_cache = asset;
+	asset_cache_size += size;
+
+	return asset;
 }
 
 static void *p_open(const char *path, int flags)
 {
-	return mg_fs_posix.op(path, flags);
+	char variant[MG_PATH_MAX];
+	struct asset_fd *afd = calloc(1, sizeof(*afd));
+
+	if (!afd)
+		return NULL;
+	path = asset_path(path, variant, sizeof(variant));
+	if (flags == MG_FS_READ)
+		afd->asset = get_cached_asset(path);
+	if (!afd->asset)
+		afd->fd = mg_fs_posix.op(path, flags);
+	if (!afd->asset && !afd->fd) {
+		free(afd);
+		return NULL;
+	}
+	return afd;
 }
 
 static void p_close(void *fp)
 {
-	return mg_fs_posix.cl(fp);
+	struct asset_fd *afd = fp;
+
+	if (afd->fd)
+		mg_fs_posix.cl(afd->fd);
+	free(afd);
 }
 
 static size_t p_read(void *fd, void *buf, size_t len)
 {
-	return mg_fs_posix.rd(fd, buf, len);
+	struct asset_fd *afd = fd;
+
+	if (!afd->asset)
+		return mg_fs_posix.rd(afd->fd, buf, len);
+	if (len > afd->asset->size - afd->pos)
+		len = afd->asset->size - afd->pos;
+	memcpy(buf, afd->asset->data + afd->pos, len);
+	afd->pos += len;
+	return len;
 }
 
 static size_t p_write(void *fd, const void *buf, size_t len)
 {
-	return mg_fs_posix.wr(fd, buf, len);
+	struct asset_fd *afd = fd;
+
+	return afd->asset ? 0 : mg_fs_posix.wr(afd->fd, buf, len);
 }
 
 static size_t p_seek(void *fd, size_t offset)
 {
-	return mg_fs_posix.sk(fd, offset);
+	struct asset_fd *afd = fd;
+
+	if (!afd->asset)
+		return mg_fs_posix.sk(afd->fd, offset);
+	afd->pos = offset < afd->asset->size ? offset : afd->asset->size;
+	return afd->pos;
 }
 
 static bool p_rename(const char *from, const char *to)
@@ -132,8 +290,11 @@ static bool p_mkdir(const char *path)
 	return mg_fs_posix.mkd(path);
 }
 
-/* mg_fs which inhibits directory listing functionality */
-static struct mg_fs fs_posix_no_list = {
+/*
+ * mg_fs of the web application: it inhibits directory listing
+ * unless enabled, serves pre-compressed variants and caches files.
+ */
+static struct mg_fs fs_web_app = {
 		p_stat,
 		p_list,
 		p_open,
@@ -356,19 +517,6 @@ static void restart_handler(struct mg_connection *nc, void *ev_data)
 	mg_http_reply(nc, 201, "", "%s", "Device will reboot now.\n");
 }
 
-static void broadcast_callback(struct mg_connection *nc, int ev,
-		void __attribute__ ((__unused__)) *ev_data, void __attribute__ ((__unused__)) *fn_data)
-{
-	if (ev == MG_EV_READ) {
-		struct mg_connection *t;
-		for (t = nc->mgr->conns; t != NULL; t = t->next) {
-			if (t->data[0] != 'W') continue;
-			mg_ws_send(t,(char *)nc->recv.buf, nc->recv.len, WEBSOCKET_OP_TEXT);
-		}
-		mg_iobuf_del(&nc->recv, 0, nc->recv.len);
-	}
-}
-
 static int level_to_rfc_5424(int level)
 {
 	switch(level) {
@@ -385,149 +533,254 @@ static int level_to_rfc_5424(int level)
 	}
 }
 
-static void broadcast(char *str)
+/*
+ * Send a text to all websocket clients. The frame is built once:
+ * frames sent by a server are not masked, so they are the same for
+ * every client.
+ */
+static void broadcast(struct mg_mgr *mgr, const char *str)
 {
-	send(ws_pipe, str, strlen(str), 0);
+	struct mg_connection *t;
+	size_t len = strlen(str);
+	unsigned char hdr[10];
+	size_t hlen;
+	int i;
+
+	hdr[0] = 0x80 | WEBSOCKET_OP_TEXT;	/* FIN */
+	if (len < 126) {
+		hdr[1] = (unsigned char)len;
+		hlen = 2;
+	} else if (len < 65536) {
+		hdr[1] = 126;
+		hdr[2] = (unsigned char)(len >> 8);
+		hdr[3] = (unsigned char)len;
+		hlen = 4;
+	} else {
+		hdr[1] = 127;
+		for (i = 0; i < 8; i++)
+			hdr[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+		hlen = 10;
+	}
+
+	for (t = mgr->conns; t != NULL; t = t->next) {
+		if (t->data[0] != 'W')
+			continue;
+		mg_send(t, hdr, hlen);
+		mg_send(t, str, len);
+	}
 }
 
-static void *broadcast_message_thread(void __attribute__ ((__unused__)) *data)
-{
-	int fd = -1;
+/*
+ * The notification and the progress sockets are served by the
+ * event loop as any other connection; they are connected again
+ * by a timer if SWUpdate closes them.
+ */
+static struct mg_connection *notify_conn;
+static struct mg_connection *progress_conn;
 
-	for (;;) {
-		ipc_message msg;
-		int ret;
+static struct {
+	RECOVERY_STATUS status;
+	sourcetype source;
+	unsigned int step;
+	uint8_t percent;
+} last_progress = { .status = -1, .source = -1 };
 
-		if (fd < 0)
-			fd = ipc_notify_connect();
-		/*
-		 * if still fails, try later
-		 */
-		if (fd < 0) {
-			sleep(1);
-			continue;
-		}
+/*
+ * The last progress of the update, served by /status without a
+ * request to SWUpdate. status_seq is incremented when it changes
+ * and it is the ETag of the response.
+ */
+static struct progress_msg status_snapshot;
+static unsigned long long status_seq;
 
-		ret = ipc_notify_receive(&fd, &msg);
-		if (ret != sizeof(msg))
-			return NULL;
+static void update_status_snapshot(struct progress_msg *msg)
+{
+	RECOVERY_STATUS status = status_snapshot.status;
 
-		if (strlen(msg.data.notify.msg) != 0 &&
-				msg.data.status.current != PROGRESS) {
-			char text[4096];
-			char str[4160];
+	if (!memcmp(&status_snapshot, msg, sizeof(*msg)))
+		return;
+	status_snapshot = *msg;
+	/* PROGRESS only says that a step goes on */
+	if (msg->status == PROGRESS)
+		status_snapshot.status = status;
+	if (status_snapshot.infolen >= sizeof(status_snapshot.info))
+		status_snapshot.infolen = sizeof(status_snapshot.info) - 1;
+	status_snapshot.info[status_snapshot.infolen] = '\0';
+	status_snapshot.cur_image[sizeof(status_snapshot.cur_image) - 1] = '\0';
+	status_snapshot.hnd_name[sizeof(status_snapshot.hnd_name) - 1] = '\0';
+	status_seq++;
+}
 
-			snescape(text, sizeof(text), msg.data.notify.msg);
+static void broadcast_message(struct mg_mgr *mgr, ipc_message *msg)
+{
+	char text[4096];
+	char str[4160];
 
-			snprintf(str, sizeof(str),
-					 "{\r\n"
-					 "\t\"type\": \"message\",\r\n"
-					 "\t\"level\": \"%d\",\r\n"
-					 "\t\"text\": \"%s\"\r\n"
-					 "}\r\n",
-					 level_to_rfc_5424(msg.data.notify.level), /* RFC 5424 */
-					 text);
+	if (strlen(msg->data.notify.msg) == 0 ||
+	    msg->data.status.current == PROGRESS)
+		return;
 
-			broadcast(str);
-		}
-	}
+	snescape(text, sizeof(text), msg->data.notify.msg);
+
+	snprintf(str, sizeof(str),
+			 "{\r\n"
+			 "\t\"type\": \"message\",\r\n"
+			 "\t\"level\": \"%d\",\r\n"
+			 "\t\"text\": \"%s\"\r\n"
+			 "}\r\n",
+			 level_to_rfc_5424(msg->data.notify.level), /* RFC 5424 */
+			 text);
+
+	broadcast(mgr, str);
 }
 
-static void *broadcast_progress_thread(void __attribute__ ((__unused__)) *data)
+static void broadcast_progress(struct mg_mgr *mgr, struct progress_msg *msg)
 {
-	RECOVERY_STATUS status = -1;
-	sourcetype source = -1;
-	unsigned int step = 0;
-	uint8_t percent = 0;
-	int fd = -1;
+	char str[512];
+	char escaped[512];
+
+	if (msg->status != PROGRESS &&
+	    (msg->status != last_progress.status || msg->status == FAILURE)) {
+		last_progress.status = msg->status;
+
+		snescape(escaped, sizeof(escaped), get_status_string(msg->status));
+
+		snprintf(str, sizeof(str),
+			"{\r\n"
+			"\t\"type\": \"status\",\r\n"
+			"\t\"status\": \"%s\"\r\n"
+			"}\r\n",
+			escaped);
+		broadcast(mgr, str);
+	}
 
-	for (;;) {
-		struct progress_msg msg;
-		char str[512];
-		char escaped[512];
-		int ret;
+	if (msg->source != last_progress.source) {
+		last_progress.source = msg->source;
 
-		if (fd < 0)
-			fd = progress_ipc_connect(true);
-		/*
-		 * if still fails, try later
-		 */
-		if (fd < 0) {
-			sleep(1);
-			continue;
-		}
+		snprintf(str, sizeof(str),
+			"{\r\n"
+			"\t\"type\": \"source\",\r\n"
+			"\t\"source\": \"%s\"\r\n"
+			"}\r\n",
+			get_source_string(msg->source));
+		broadcast(mgr, str);
+	}
 
-		ret = progress_ipc_receive(&fd, &msg);
-		if (ret != sizeof(msg))
-			return NULL;
+	if (msg->status == SUCCESS && msg->source == SOURCE_WEBSERVER && run_postupdate) {
+		ipc_message ipc = {};
 
-		if (msg.status != PROGRESS &&
-		    (msg.status != status || msg.status == FAILURE)) {
-			status = msg.status;
+		ipc_postupdate(&ipc);
+	}
 
-			snescape(escaped, sizeof(escaped), get_status_string(msg.status));
+	if (msg->infolen) {
+		snescape(escaped, sizeof(escaped), msg->info);
 
-			snprintf(str, sizeof(str),
-				"{\r\n"
-				"\t\"type\": \"status\",\r\n"
-				"\t\"status\": \"%s\"\r\n"
-				"}\r\n",
-				escaped);
-			broadcast(str);
-		}
+		snprintf(str, sizeof(str),
+			"{\r\n"
+			"\t\"type\": \"info\",\r\n"
+			"\t\"source\": \"%s\"\r\n"
+			"}\r\n",
+			escaped);
+		broadcast(mgr, str);
+	}
 
-		if (msg.source != source) {
-			source = msg.source;
+	if ((msg->cur_step != last_progress.step ||
+	     msg->cur_percent != last_progress.percent) && msg->cur_step) {
+		last_progress.step = msg->cur_step;
+		last_progress.percent = msg->cur_percent;
+
+		snescape(escaped, sizeof(escaped), msg->cur_step ? msg->cur_image: "");
+
+		snprintf(str, sizeof(str),
+			"{\r\n"
+			"\t\"type\": \"step\",\r\n"
+			"\t\"number\": \"%d\",\r\n"
+			"\t\"step\": \"%d\",\r\n"
+			"\t\"name\": \"%s\",\r\n"
+			"\t\"percent\": \"%d\"\r\n"
+			"}\r\n",
+			msg->nsteps,
+			msg->cur_step,
+			escaped,
+			msg->cur_percent);
+		broadcast(mgr, str);
+	}
+}
 
-			snprintf(str, sizeof(str),
-				"{\r\n"
-				"\t\"type\": \"source\",\r\n"
-				"\t\"source\": \"%s\"\r\n"
-				"}\r\n",
-				get_source_string(msg.source));
-			broadcast(str);
-		}
+static void notify_ev_handler(struct mg_connection *nc, int ev,
+		void __attribute__ ((__unused__)) *ev_data,
+		void __attribute__ ((__unused__)) *fn_data)
+{
+	ipc_message msg;
+	size_t off = 0;
+	int ret;
 
-		if (msg.status == SUCCESS && msg.source == SOURCE_WEBSERVER && run_postupdate) {
-			ipc_message ipc = {};
+	if (ev == MG_EV_CLOSE) {
+		notify_conn = NULL;
+		return;
+	}
+	if (ev != MG_EV_READ)
+		return;
 
-			ipc_postupdate(&ipc);
-		}
+	while ((ret = ipc_unpack_msg((char *)nc->recv.buf + off,
+				     nc->recv.len - off, &msg)) > 0) {
+		off += ret;
+		broadcast_message(nc->mgr, &msg);
+	}
+	mg_iobuf_del(&nc->recv, 0, off);
+	if (ret < 0) {
+		ERROR("Invalid notification, reconnecting");
+		nc->is_closing = 1;
+	}
+}
 
-		if (msg.infolen) {
-			snescape(escaped, sizeof(escaped), msg.info);
+static void progress_ev_handler(struct mg_connection *nc, int ev,
+		void __attribute__ ((__unused__)) *ev_data,
+		void __attribute__ ((__unused__)) *fn_data)
+{
+	struct progress_msg msg;
+	size_t off = 0;
 
-			snprintf(str, sizeof(str),
-				"{\r\n"
-				"\t\"type\": \"info\",\r\n"
-				"\t\"source\": \"%s\"\r\n"
-				"}\r\n",
-				escaped);
-			broadcast(str);
-		}
+	if (ev == MG_EV_CLOSE) {
+		progress_conn = NULL;
+		return;
+	}
+	if (ev != MG_EV_READ)
+		return;
 
-		if ((msg.cur_step != step || msg.cur_percent != percent) &&
-				msg.cur_step) {
-			step = msg.cur_step;
-			percent = msg.cur_percent;
-
-			snescape(escaped, sizeof(escaped), msg.cur_step ? msg.cur_image: "");
-
-			snprintf(str, sizeof(str),
-				"{\r\n"
-				"\t\"type\": \"step\",\r\n"
-				"\t\"number\": \"%d\",\r\n"
-				"\t\"step\": \"%d\",\r\n"
-				"\t\"name\": \"%s\",\r\n"
-				"\t\"percent\": \"%d\"\r\n"
-				"}\r\n",
-				msg.nsteps,
-				msg.cur_step,
-				escaped,
-				msg.cur_percent);
-			broadcast(str);
-		}
+	while (nc->recv.len - off >= sizeof(msg)) {
+		memcpy(&msg, nc->recv.buf + off, sizeof(msg));
+		off += sizeof(msg);
+		update_status_snapshot(&msg);
+		broadcast_progress(nc->mgr, &msg);
 	}
+	mg_iobuf_del(&nc->recv, 0, off);
+}
+
+static struct mg_connection *wrap_ipc_fd(struct mg_mgr *mgr, int fd,
+					 mg_event_handler_t fn)
+{
+	struct mg_connection *c;
+
+	if (fd < 0)
+		return NULL;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c = mg_wrapfd(mgr, fd, fn, NULL);
+	if (!c)
+		close(fd);
+
+	return c;
+}
+
+static void ipc_connect_timer(void *arg)
+{
+	struct mg_mgr *mgr = (struct mg_mgr *)arg;
+
+	if (!notify_conn)
+		notify_conn = wrap_ipc_fd(mgr, ipc_notify_connect(), notify_ev_handler);
+	if (!progress_conn)
+		progress_conn = wrap_ipc_fd(mgr, progress_ipc_connect(false),
+					    progress_ev_handler);
 }
 
 static void timer_ev_handler(void *fn_data)
@@ -589,6 +842,15 @@ static void upload_handler(struct mg_connection *nc, int ev, void *ev_data,
 				WARN("IPC cannot be set in non-blocking, fallback to block mode");
 			}
 
+			/*
+			 * Let the body go from the socket to the installer
+			 * without copies, and in large chunks
+			 */
+			int sndbuf = UPLOAD_IPC_SNDBUF;
+			if (setsockopt(fus->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)))
+				TRACE("Cannot set the size of the IPC buffer");
+			mp->splice_fd = fus->fd;
+
 			mp->user_data = fus;
 
 			fus->last_io_time = mg_millis();
@@ -608,7 +870,11 @@ static void upload_handler(struct mg_connection *nc, int ev, void *ev_data,
 			if (!fus)
 				break;
 
-			written = write(fus->fd, (char *) mp->part.body.ptr, mp->part.body.len);
+			if (!mp->part.body.ptr) {
+				/* already moved to the IPC by splice() */
+				written = mp->part.body.len;
+			} else
+				written = write(fus->fd, (char *) mp->part.body.ptr, mp->part.body.len);
 			/*
 			 * IPC seems to block, wait for a while
 			 */
@@ -652,6 +918,15 @@ static void upload_handler(struct mg_connection *nc, int ev, void *ev_data,
 
 			ipc_end(fus->fd);
 
+			if (mp->status < 0) {
+				mg_http_reply(nc, 400, "", "%s", "Malformed upload\n");
+				nc->is_draining = 1;
+				mp->user_data = NULL;
+				mg_timer_free(&fus->c->mgr->timers, fus->timer);
+				free(fus);
+				break;
+			}
+
 			mg_http_reply(nc, 200, "%s",
 								  "Content-Type: text/plain\r\n"
 								  "Connection: close");
@@ -673,18 +948,230 @@ static void websocket_handler(struct mg_connection *nc, void *ev_data)
 	nc->data[0] = 'W';
 }
 
+/*
+ * Serve the artifact stored by suricatta to other devices,
+ * they are named by their SHA1.
+ */
+static void peer_handler(struct mg_connection *nc, struct mg_http_message *hm)
+{
+	struct mg_http_serve_opts opts = {0};
+	char path[MG_PATH_MAX];
+	size_t prefix = strlen("/peer/");
+	size_t i, len = hm->uri.len - prefix;
+	const char *id = hm->uri.ptr + prefix;
+
+	if (!len || len > 2 * SWUPDATE_SHA_DIGEST_LENGTH) {
+		mg_http_reply(nc, 404, "", "Not found\n");
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		if (!isxdigit((unsigned char)id[i])) {
+			mg_http_reply(nc, 404, "", "Not found\n");
+			return;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/%.*s", peer_cache, (int)len, id);
+	mg_http_serve_file(nc, hm, path, &opts);
+}
+
+static void timeline_handler(struct mg_connection *nc, struct mg_http_message *hm)
+{
+	struct mg_http_serve_opts opts = { .mime_types = "json=application/json" };
+	char path[MG_PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s%s", get_tmpdir(), TIMELINE_FILENAME);
+	mg_http_serve_file(nc, hm, path, &opts);
+}
+
+static void metrics_handler(struct mg_connection *nc, struct mg_http_message *hm)
+{
+	struct mg_http_serve_opts opts = {
+		.mime_types = "txt=application/openmetrics-text; version=1.0.0; charset=utf-8"
+	};
+	char path[MG_PATH_MAX];
+
+	if (ipc_get_file_path(GET_METRICS, path, sizeof(path))) {
+		mg_http_reply(nc, 503, "", "Metrics not available\n");
+		return;
+	}
+	mg_http_serve_file(nc, hm, path, &opts);
+}
+
+static void profile_handler(struct mg_connection *nc, struct mg_http_message *hm)
+{
+	struct mg_http_serve_opts opts = { .mime_types = "json=application/json" };
+	char path[MG_PATH_MAX];
+
+	if (ipc_get_file_path(GET_PROFILE, path, sizeof(path))) {
+		mg_http_reply(nc, 503, "", "Profile not available\n");
+		return;
+	}
+	mg_http_serve_file(nc, hm, path, &opts);
+}
+
+/*
+ * Reply with the last progress, or with 304 if the client
+ * already has it (If-None-Match with the sequence number).
+ */
+static void status_handler(struct mg_connection *nc, struct mg_http_message *hm)
+{
+	struct progress_msg *msg = &status_snapshot;
+	struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+	char etag[32], headers[128];
+	char image[512], handler[128], info[2 * PRINFOSIZE];
+
+	snprintf(etag, sizeof(etag), "\"%llu\"", status_seq);
+	snprintf(headers, sizeof(headers),
+		 "Content-Type: application/json\r\n"
+		 "Cache-Control: no-cache\r\n"
+		 "Etag: %s\r\n", etag);
+	if (inm && !mg_vcmp(inm, etag)) {
+		mg_http_reply(nc, 304, headers, "");
+		return;
+	}
+
+	snescape(image, sizeof(image), msg->cur_image);
+	snescape(handler, sizeof(handler), msg->hnd_name);
+	snescape(info, sizeof(info), msg->info);
+	mg_http_reply(nc, 200, headers,
+		      "{\r\n"
+		      "\t\"sequence\": %llu,\r\n"
+		      "\t\"status\": \"%s\",\r\n"
+		      "\t\"source\": \"%s\",\r\n"
+		      "\t\"download_percent\": %u,\r\n"
+		      "\t\"download_bytes\": %llu,\r\n"
+		      "\t\"steps\": %u,\r\n"
+		      "\t\"step\": %u,\r\n"
+		      "\t\"percent\": %u,\r\n"
+		      "\t\"image\": \"%s\",\r\n"
+		      "\t\"handler\": \"%s\",\r\n"
+		      "\t\"info\": \"%s\"\r\n"
+		      "}\r\n",
+		      status_seq,
+		      get_status_string(msg->status),
+		      get_source_string(msg->source),
+		      msg->dwl_percent, msg->dwl_bytes,
+		      msg->nsteps, msg->cur_step, msg->cur_percent,
+		      image, handler, info);
+}
+
+/*
+ * The encoding is accepted if it is listed
+ * in Accept-Encoding with a quality above 0.
+ */
+static bool accepts_encoding(const struct mg_str *ae, const char *name)
+{
+	const char *p = ae->ptr, *end = ae->ptr + ae->len;
+	char tok[64], coding[32];
+	float q;
+
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+		size_t n = (comma ? comma : end) - p;
+
+		snprintf(tok, sizeof(tok), "%.*s", (int)n, p);
+		q = 1;
+		if (sscanf(tok, " %31[^; \t] ; q = %f", coding, &q) >= 1 &&
+		    (!strcasecmp(coding, name) || !strcmp(coding, "*")) && q > 0)
+			return true;
+		p += n + 1;
+	}
+
+	return false;
+}
+
+/*
+ * Serve a file of the web application. A pre-compressed
+ * variant (file.br or file.gz) is sent instead if it exists
+ * and the client accepts its encoding.
+ */
+static void web_app_handler(struct mg_connection *nc, struct mg_http_message *hm)
+{
+	struct mg_http_serve_opts opts = s_http_server_opts;
+	struct mg_str *ae = mg_http_get_header(hm, "Accept-Encoding");
+	char path[MG_PATH_MAX], variant[MG_PATH_MAX], headers[128];
+	const char *encoding = NULL, *suffix = NULL, *ext;
+	bool vary = false;
+	size_t n, i;
+	int flags;
+
+	n = snprintf(path, sizeof(path), "%s/", s_http_server_opts.root_dir);
+	if (n >= sizeof(path) ||
+	    mg_url_decode(hm->uri.ptr, hm->uri.len, path + n, sizeof(path) - n, 0) < 0) {
+		mg_http_serve_dir(nc, hm, &s_http_server_opts);
+		return;
+	}
+	mg_remove_double_dots(path);
+	n = strlen(path);
+	if (path[n - 1] == '/')
+		snprintf(path + n, sizeof(path) - n, "%s", MG_HTTP_INDEX);
+
+	for (i = 0; i < ARRAY_SIZE(asset_encodings); i++) {
+		snprintf(variant, sizeof(variant), "%s%s", path, asset_encodings[i].suffix);
+		flags = mg_fs_posix.st(variant, NULL, NULL);
+		if (!flags || flags & MG_FS_DIR)
+			continue;
+		vary = true;
+		if (!suffix && ae && accepts_encoding(ae, asset_encodings[i].name)) {
+			encoding = asset_encodings[i].name;
+			suffix = asset_encodings[i].suffix;
+		}
+	}
+
+	/*
+	 * The pages are revalidated with their ETag at each load,
+	 * so that a new web application is used after an update.
+	 */
+	headers[0] = '\0';
+	n = 0;
+	if (cache_max_age) {
+		ext = strrchr(path, '.');
+		if (ext && !strcmp(ext, ".html"))
+			n += snprintf(headers + n, sizeof(headers) - n,
+				      "Cache-Control: no-cache\r\n");
+		else
+			n += snprintf(headers + n, sizeof(headers) - n,
+				      "Cache-Control: max-age=%u\r\n", cache_max_age);
+	}
+	if (vary)
+		n += snprintf(headers + n, sizeof(headers) - n, "Vary: Accept-Encoding\r\n");
+	if (encoding)
+		snprintf(headers + n, sizeof(headers) - n, "Content-Encoding: %s\r\n", encoding);
+	opts.extra_headers = headers;
+
+	if (!suffix) {
+		mg_http_serve_dir(nc, hm, &opts);
+		return;
+	}
+	/* mg_http_serve_file() opens the file and takes its size and mtime */
+	asset_suffix = suffix;
+	mg_http_serve_file(nc, hm, path, &opts);
+	asset_suffix = NULL;
+}
+
 static void ev_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data)
 {
 	if (nc->data[0] != 'M' && ev == MG_EV_HTTP_MSG) {
 		struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-		if (!mg_http_is_authorized(hm, global_auth_domain, global_auth_file))
+		if (peer_cache && mg_http_match_uri(hm, "/peer/*"))
+			peer_handler(nc, hm);
+		else if (!mg_http_is_authorized(hm, global_auth_domain, global_auth_file))
 			mg_http_send_digest_auth_request(nc, global_auth_domain);
 		else if (mg_http_get_header(hm, "Sec-WebSocket-Key") != NULL)
 			websocket_handler(nc, ev_data);
 		else if (mg_http_match_uri(hm, "/restart"))
 			restart_handler(nc, ev_data);
+		else if (mg_http_match_uri(hm, "/timeline"))
+			timeline_handler(nc, hm);
+		else if (mg_http_match_uri(hm, "/metrics"))
+			metrics_handler(nc, hm);
+		else if (mg_http_match_uri(hm, "/profile"))
+			profile_handler(nc, hm);
+		else if (mg_http_match_uri(hm, "/status"))
+			status_handler(nc, hm);
 		else
-			mg_http_serve_dir(nc, ev_data, &s_http_server_opts);
+			web_app_handler(nc, hm);
 	} else if (nc->data[0] != 'M' && ev == MG_EV_READ) {
 		struct mg_http_message hm;
 		int hlen = mg_http_parse((char *) nc->recv.buf, nc->recv.len, &hm);
@@ -756,10 +1243,19 @@ static int mongoose_settings(void *elem, void  __attribute__ ((__unused__)) *dat
 	if (strlen(tmp)) {
 		opts->auth_domain = strdup(tmp);
 	}
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "peer-cache", tmp);
+	if (strlen(tmp)) {
+		opts->peer_cache = strdup(tmp);
+	}
+
 	get_field(LIBCFG_PARSER, elem, "run-postupdate", &run_postupdate);
 
 	get_field(LIBCFG_PARSER, elem, "timeout", &watchdog_conn);
 
+	get_field(LIBCFG_PARSER, elem, "cache-max-age", &opts->cache_max_age);
+
+	get_field(LIBCFG_PARSER, elem, "cache-size", &opts->cache_size);
+
 	return 0;
 }
 
@@ -879,13 +1375,17 @@ int start_mongoose(const char *cfgfname, int argc, char *argv[])
 			return -EINVAL;
 		}
 	}
+	subprocess_ready();
 
 	s_http_server_opts.root_dir =
 		opts.root ? opts.root : MG_ROOT;
-	if (!opts.listing)
-		s_http_server_opts.fs = &fs_posix_no_list;
+	s_http_server_opts.fs = &fs_web_app;
+	listing = opts.listing;
+	cache_max_age = opts.cache_max_age;
+	asset_cache_max = (size_t)opts.cache_size * 1024;
 	global_auth_file = opts.global_auth_file;
 	global_auth_domain = opts.auth_domain;
+	peer_cache = opts.peer_cache;
 
 #if MG_ENABLE_SSL
 	if (ssl) {
@@ -894,12 +1394,13 @@ int start_mongoose(const char *cfgfname, int argc, char *argv[])
 	}
 #endif
 
-	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
+	/* as thread, the signals are handled by SWUpdate */
+	if (pid == getpid()) {
+		signal(SIGINT, signal_handler);
+		signal(SIGTERM, signal_handler);
+	}
 	mg_mgr_init(&mgr);
 
-	ws_pipe = mg_mkpipe(&mgr, broadcast_callback, NULL, true);
-
 	/* Parse url with port only fallback */
 	if (opts.port) {
 		if (mg_url_port(opts.port) != 0) {
@@ -924,8 +1425,8 @@ int start_mongoose(const char *cfgfname, int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	start_thread(broadcast_message_thread, NULL);
-	start_thread(broadcast_progress_thread, NULL);
+	ipc_connect_timer(&mgr);
+	mg_timer_add(&mgr, 1000, MG_TIMER_REPEAT, ipc_connect_timer, &mgr);
 
 	mg_snprintf(buf, sizeof(buf), "%I", 4, &nc->loc);
 	INFO("Mongoose web server version %s with pid %d started on [%s] with web root [%s]",
@@ -19,8 +19,12 @@
  * license, as set out in <https://www.cesanta.com/license>.
  */
 
+#include <fcntl.h>
 #include "mongoose_multipart.h"
 
+#define MP_SPLICE_CHUNK		(256 * 1024)
+#define MP_SPLICE_BUDGET	(4 * 1024 * 1024)	/* per event, keep the loop responsive */
+
 enum mg_http_multipart_stream_state {
 	MPS_BEGIN,
 	MPS_WAITING_FOR_BOUNDARY,
@@ -38,10 +42,21 @@ struct mg_http_multipart_stream {
 	int processing_part;
 	int data_avail;
 	size_t len;
+	int status;
+	int splice_fd;
+	int pipefd[2];
+	size_t piped;		/* bytes in the pipe, not yet written */
+	size_t remaining;	/* bytes of the part not yet delivered */
+	size_t body_len;
+	size_t body_consumed;	/* bytes of the body removed from recv */
 };
 
 static void mg_http_free_proto_data_mp_stream(
 		struct mg_http_multipart_stream *mp) {
+	if (mp->pipefd[0] >= 0)
+		close(mp->pipefd[0]);
+	if (mp->pipefd[1] >= 0)
+		close(mp->pipefd[1]);
 	free((void *) mp->boundary.ptr);
 	free((void *) mp->part.name.ptr);
 	free((void *) mp->part.filename.ptr);
@@ -98,10 +113,16 @@ static void mg_http_multipart_begin(struct mg_connection *c,
 		mp_stream->part.name.ptr = mp_stream->part.filename.ptr = NULL;
 		mp_stream->part.name.len = mp_stream->part.filename.len = 0;
 		mp_stream->len = hm->body.len;
+		mp_stream->body_len = hm->body.len;
+		mp_stream->splice_fd = -1;
+		mp_stream->pipefd[0] = mp_stream->pipefd[1] = -1;
 		c->pfn_data = mp_stream;
 
 		mg_call(c, MG_EV_HTTP_MULTIPART_REQUEST, hm);
 
+		/* the leading "--" of the body goes too, if already received */
+		mp_stream->body_consumed = io->len - hm->head.len < 2 ?
+			io->len - hm->head.len : 2;
 		mg_iobuf_del(io, 0, hm->head.len + 2);
 	}
 }
@@ -122,8 +143,11 @@ static size_t mg_http_multipart_call_handler(struct mg_connection *c, int ev,
 	mp.part.body.len = data_len;
 	mp.num_data_consumed = data_len;
 	mp.len = mp_stream->len;
+	mp.status = mp_stream->status;
+	mp.splice_fd = mp_stream->splice_fd;
 	mg_call(c, ev, &mp);
 	mp_stream->user_data = mp.user_data;
+	mp_stream->splice_fd = mp.splice_fd;
 	mp_stream->data_avail = (mp.num_data_consumed != data_len);
 	return mp.num_data_consumed;
 }
@@ -143,6 +167,128 @@ static void mg_http_multipart_finalize(struct mg_connection *c) {
 	c->data[0] = '\0';
 }
 
+/*
+ * The length of the part is known only if it is the first and
+ * the only one. It is verified by the closing boundary.
+ */
+static void mg_http_multipart_splice_begin(struct mg_connection *c) {
+	struct mg_http_multipart_stream *mp_stream = c->pfn_data;
+	size_t trailer = mp_stream->boundary.len + 8;	/* \r\n--boundary--\r\n */
+
+	if (mp_stream->splice_fd < 0)
+		return;
+#if defined(__linux__)
+	if (!c->is_tls && mp_stream->processing_part == 1 &&
+		mp_stream->body_len > mp_stream->body_consumed + trailer &&
+		pipe2(mp_stream->pipefd, O_NONBLOCK | O_CLOEXEC) == 0) {
+		mp_stream->remaining = mp_stream->body_len -
+			mp_stream->body_consumed - trailer;
+		mp_stream->piped = 0;
+		return;
+	}
+	mp_stream->pipefd[0] = mp_stream->pipefd[1] = -1;
+#endif
+	mp_stream->splice_fd = -1;
+}
+
+#if defined(__linux__)
+/*
+ * Move the pipe content to the installer. Returns 1 when the pipe is
+ * empty, 0 if the installer cannot take more now, -1 on error.
+ */
+static int mg_http_multipart_splice_out(struct mg_connection *c) {
+	struct mg_http_multipart_stream *mp_stream = c->pfn_data;
+	ssize_t ret;
+
+	while (mp_stream->piped) {
+		ret = splice(mp_stream->pipefd[0], NULL, mp_stream->splice_fd, NULL,
+					 mp_stream->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			MG_ERROR(("splice failed: %d", errno));
+			return -1;
+		}
+		mp_stream->piped -= (size_t) ret;
+		mp_stream->remaining -= (size_t) ret;
+		mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_DATA, NULL, (size_t) ret);
+	}
+
+	return 1;
+}
+
+static int mg_http_multipart_splice(struct mg_connection *c) {
+	struct mg_http_multipart_stream *mp_stream = c->pfn_data;
+	struct mg_iobuf *io = &c->recv;
+	int sockfd = (int) (size_t) c->fd;
+	size_t budget = MP_SPLICE_BUDGET;
+	size_t n, consumed;
+	ssize_t ret;
+	int status;
+
+	/*
+	 * Keep the stream in order: the pipe holds data older than
+	 * what mongoose has read into the buffer since.
+	 */
+	status = mg_http_multipart_splice_out(c);
+	if (status <= 0)
+		goto blocked;
+
+	if (io->len && mp_stream->remaining) {
+		n = io->len < mp_stream->remaining ? io->len : mp_stream->remaining;
+		consumed = mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_DATA,
+												  (char *) io->buf, n);
+		mg_iobuf_del(io, 0, consumed);
+		mp_stream->remaining -= consumed;
+		if (consumed < n)
+			return 0;
+	}
+
+	while (mp_stream->remaining > 0 && budget > 0) {
+		n = mp_stream->remaining < MP_SPLICE_CHUNK ?
+			mp_stream->remaining : MP_SPLICE_CHUNK;
+		ret = splice(sockfd, NULL, mp_stream->pipefd[1], NULL, n,
+					 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret <= 0)
+			return 0;	/* wait for the next event, or the close */
+		mp_stream->piped = (size_t) ret;
+		budget = (size_t) ret > budget ? 0 : budget - (size_t) ret;
+		status = mg_http_multipart_splice_out(c);
+		if (status <= 0)
+			goto blocked;
+	}
+	if (mp_stream->remaining > 0) {
+		mp_stream->data_avail = 1;
+		return 0;
+	}
+
+	/* \r\n--boundary--\r\n */
+	if (io->len < mp_stream->boundary.len + 8)
+		return 0;
+	if (memcmp(io->buf, "\r\n--", 4) ||
+		memcmp(io->buf + 4, mp_stream->boundary.ptr, mp_stream->boundary.len) ||
+		memcmp(io->buf + 4 + mp_stream->boundary.len, "--\r\n", 4)) {
+		MG_ERROR(("multipart: part is not followed by the closing boundary"));
+		mp_stream->status = -1;
+	} else {
+		mg_iobuf_del(io, 0, mp_stream->boundary.len + 8);
+	}
+	mp_stream->state = MPS_FINALIZE;
+
+	return 1;
+
+blocked:
+	if (status == 0) {
+		/* the installer is busy, try again at the next poll */
+		mp_stream->data_avail = 1;
+		return 0;
+	}
+	mp_stream->status = -1;
+	mp_stream->state = MPS_FINALIZE;
+	return 1;
+}
+#endif
+
 static int mg_http_multipart_wait_for_boundary(struct mg_connection *c) {
 	const char *boundary;
 	struct mg_iobuf *io = &c->recv;
@@ -222,6 +368,8 @@ static int mg_http_multipart_process_boundary(struct mg_connection *c) {
 			mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_BEGIN, NULL, 0);
 			mp_stream->state = MPS_WAITING_FOR_CHUNK;
 			mp_stream->processing_part++;
+			mp_stream->body_consumed += block_begin - (char *) io->buf + 2;
+			mg_http_multipart_splice_begin(c);
 
 			mg_iobuf_del(io, 0, block_begin - (char *) io->buf + 2);
 			return 1;
@@ -240,6 +388,11 @@ static int mg_http_multipart_continue_wait_for_chunk(struct mg_connection *c) {
 	struct mg_iobuf *io = &c->recv;
 
 	const char *boundary;
+
+#if defined(__linux__)
+	if (mp_stream->splice_fd >= 0)
+		return mg_http_multipart_splice(c);
+#endif
 	if ((int) io->len < mp_stream->boundary.len + 6 /* \r\n, --, -- */) {
 		return 0;
 	}
@@ -43,6 +43,15 @@ struct mg_http_multipart {
 	 */
 	size_t num_data_consumed;
 	size_t len;
+	/*
+	 * The handler can set a file descriptor on MG_EV_HTTP_PART_BEGIN:
+	 * the part is then moved from the socket to it with splice(),
+	 * without passing through the buffers of the connection. This is
+	 * done for a plain connection with a single part (the length of the
+	 * part is known). The handler receives MG_EV_HTTP_PART_DATA with a
+	 * NULL body.ptr for the bytes already written to the descriptor.
+	 */
+	int splice_fd;
 };
 
 void multipart_upload_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data);
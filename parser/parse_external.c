@@ -51,14 +51,11 @@ static void sw_append_stream(struct img_type *img, const char *key,
 			sizeof(img->id.version));
 	}
 	if (!strcmp(key, "mtdname") || !strcmp(key, "dest"))
-		strlcpy(img->mtdname, value,
-			sizeof(img->mtdname));
+		img_set_string(&img->mtdname, value);
 	if (!strcmp(key, "filesystem"))
-		strlcpy(img->filesystem, value,
-			sizeof(img->filesystem));
+		img_set_string(&img->filesystem, value);
 	if (!strcmp(key, "volume"))
-		strlcpy(img->volname, value,
-			sizeof(img->volname));
+		img_set_string(&img->volname, value);
 	if (!strcmp(key, "device_id"))
 		strlcpy(img->device, value,
 			sizeof(img->device));
@@ -79,16 +76,32 @@ static void sw_append_stream(struct img_type *img, const char *key,
 	if (!strcmp(key, "path"))
 		strlcpy(img->path, value,
 			sizeof(img->path));
-	if (!strcmp(key, "sha256"))
+	if (!strcmp(key, "sha256") && !img->hashalg)
 		ascii_to_hash(img->sha256, value);
-	if (!strcmp(key, "encrypted"))
-		img->is_encrypted = true;
+#ifdef CONFIG_HASH_SHA512_256
+	if (!strcmp(key, SHA512_256)) {
+		ascii_to_hash(img->sha256, value);
+		img->hashalg = SHA512_256;
+	}
+#endif
+	if (!strcmp(key, "encrypted")) {
+		if (value != NULL && !strcmp(value, "aes-ctr"))
+			img->is_encrypted = ENCRYPTED_AES_CTR;
+		else if (value != NULL && !strcmp(value, "aes-cbc"))
+			img->is_encrypted = ENCRYPTED_AES_CBC;
+		else
+			img->is_encrypted = ENCRYPTED_TRUE;
+	}
 	if (!strcmp(key, "compressed")) {
 		if (value != NULL) {
 			if (!strcmp(value, "zlib")) {
 				img->compressed = COMPRESSED_ZLIB;
 			} else if (!strcmp(value, "zstd")) {
 				img->compressed = COMPRESSED_ZSTD;
+			} else if (!strcmp(value, "lz4")) {
+				img->compressed = COMPRESSED_LZ4;
+			} else if (!strcmp(value, "xz")) {
+				img->compressed = COMPRESSED_XZ;
 			} else {
 				img->compressed = COMPRESSED_TRUE;
 			}
@@ -111,7 +124,7 @@ int parse_external(struct swupdate_cfg *software, const char *filename)
 	struct img_type *image;
 	struct hw_type hardware;
 
-	lua_State *L = luaL_newstate(); /* opens Lua */
+	lua_State *L = lua_budget_newstate(); /* opens Lua */
 	luaL_openlibs(L); /* opens the standard libraries */
 
 	if (luaL_loadfile(L, LUA_PARSER)) {
@@ -164,7 +177,7 @@ int parse_external(struct swupdate_cfg *software, const char *filename)
 
 		if (lua_type(L, -1) == LUA_TTABLE) {
 			lua_pushnil(L);
-			image = (struct img_type *)calloc(1, sizeof(struct img_type));
+			image = alloc_image();
 			if (!image) {
 				ERROR( "No memory: malloc failed");
 				return -ENOMEM;
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <time.h>
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
 #include "util.h"
@@ -24,6 +25,7 @@
 #include "parsers.h"
 #include "swupdate_dict.h"
 #include "lua_util.h"
+#include "content_check.h"
 
 #define MODULE_NAME	"PARSER"
 
@@ -51,77 +53,133 @@ static bool path_append(const char **nodes, const char *field)
 	return true;
 }
 
+/*
+ * The selection (board, software set and running mode) does not
+ * change while a sw-description is parsed, so the candidate roots
+ * and their paths are resolved once and the fields are then
+ * looked up as their children.
+ */
+#define MAX_SELECTION_ROOTS	4
+
+struct parser_root {
+	void *node;
+	const char *nodes[MAX_PARSED_NODES];
+};
+
+static struct {
+	void *cfg;
+	unsigned int count;
+	struct parser_root roots[MAX_SELECTION_ROOTS];
+} selection;
+
+static bool selection_path(struct swupdate_cfg *swcfg, int i, const char **nodes)
+{
+	struct hw_type *hardware = &swcfg->hw;
+
+	nodes[0] = NULL;
+	switch(i) {
+	case 0:
+		if (strlen(swcfg->parms.running_mode) && strlen(swcfg->parms.software_set) &&
+	        		strlen(hardware->boardname)) {
+			nodes[0] = NODEROOT;
+			nodes[1] = hardware->boardname;
+			nodes[2] = swcfg->parms.software_set;
+			nodes[3] = swcfg->parms.running_mode;
+			nodes[4] = NULL;
+		}
+		break;
+	case 1:
+		/* try with software set and mode */
+		if (strlen(swcfg->parms.running_mode) && strlen(swcfg->parms.software_set)) {
+			nodes[0] = NODEROOT;
+			nodes[1] = swcfg->parms.software_set;
+			nodes[2] = swcfg->parms.running_mode;
+			nodes[3] = NULL;
+		}
+		break;
+	case 2:
+		/* Try with board name */
+		if (strlen(hardware->boardname)) {
+			nodes[0] = NODEROOT;
+			nodes[1] = hardware->boardname;
+			nodes[2] = NULL;
+		}
+		break;
+	case 3:
+		/* Fall back without board entry */
+		nodes[0] = NODEROOT;
+		nodes[1] = NULL;
+		break;
+	}
+
+	return nodes[0] != NULL;
+}
+
+static void parser_select(parsertype p, void *root, struct swupdate_cfg *swcfg)
+{
+	struct parser_root *sel;
+	int i;
+
+	selection.cfg = root;
+	selection.count = 0;
+
+	for (i = 0; i < MAX_SELECTION_ROOTS; i++) {
+		sel = &selection.roots[selection.count];
+		if (!selection_path(swcfg, i, sel->nodes))
+			continue;
+
+		/*
+		 * find_root() follows links, sel->nodes
+		 * is then the path of the resolved root
+		 */
+		sel->node = find_root(p, root, sel->nodes);
+		if (sel->node)
+			selection.count++;
+	}
+}
+
+static void parser_unselect(void)
+{
+	selection.cfg = NULL;
+	selection.count = 0;
+}
+
 static void *find_node_and_path(parsertype p, void *root, const char *field,
 			struct swupdate_cfg *swcfg, const char **nodes)
 {
-	struct hw_type *hardware;
+	struct parser_root *sel;
 	void *node = NULL;
-	int i;
+	unsigned int i, j;
 
 	if (!field)
 		return NULL;
 
-	hardware = &swcfg->hw;
-
-	for (i = 0; i < 4; i++) {
-		nodes[0] = NULL;
-		switch(i) {
-		case 0:
-			if (strlen(swcfg->parms.running_mode) && strlen(swcfg->parms.software_set) &&
-		        		strlen(hardware->boardname)) {
-				nodes[0] = NODEROOT;
-				nodes[1] = hardware->boardname;
-				nodes[2] = swcfg->parms.software_set;
-				nodes[3] = swcfg->parms.running_mode;
-				nodes[4] = NULL;
-			}
-			break;
-		case 1:
-			/* try with software set and mode */
-			if (strlen(swcfg->parms.running_mode) && strlen(swcfg->parms.software_set)) {
-				nodes[0] = NODEROOT;
-				nodes[1] = swcfg->parms.software_set;
-				nodes[2] = swcfg->parms.running_mode;
-				nodes[3] = NULL;
-			}
-			break;
-		case 2:
-			/* Try with board name */
-			if (strlen(hardware->boardname)) {
-				nodes[0] = NODEROOT;
-				nodes[1] = hardware->boardname;
-				nodes[2] = NULL;
-			}
-			break;
-		case 3:
-			/* Fall back without board entry */
-			nodes[0] = NODEROOT;
-			nodes[1] = NULL;
-			break;
-		}
+	if (selection.cfg != root) {
+		parser_select(p, root, swcfg);
+	}
 
-		/*
-		 * If conditions are not set,
-		 * skip to the next option
-		 */
-		if (!nodes[0])
+	for (i = 0; i < selection.count; i++) {
+		sel = &selection.roots[i];
+		for (j = 0; sel->nodes[j]; j++)
+			nodes[j] = sel->nodes[j];
+		nodes[j] = NULL;
+
+		if (!path_append(nodes, field))
+			return NULL;
+
+		node = get_child(p, sel->node, field);
+		if (!node)
 			continue;
 
 		/*
-		 * The first find_root() search for
-		 * the root element from board, selection
-		 * The second one starts from root and follow the tree
-		 * to search for element
+		 * A link must be resolved with its full path, let
+		 * find_root() walk the tree as it is done for the root.
 		 */
-		if (find_root(p, root, nodes)) {
-			if (!path_append(nodes, field))
-				return NULL;
+		if (exist_field_string(p, node, "ref"))
 			node = find_root(p, root, nodes);
 
-			if (node) {
-				return node;
-			}
-		}
+		if (node)
+			return node;
 	}
 
 	return NULL;
@@ -302,63 +360,44 @@ static int parse_hw_compatibility(parsertype __attribute__ ((__unused__))p,
 }
 #endif
 
-static int is_image_installed(struct swver *sw_ver_list,
+static int is_image_installed(struct swupdate_cfg *cfg,
                               struct img_type *img)
 {
-    struct sw_version *swver;
-
-    if (!sw_ver_list)
-        return false;
-
     if (!strlen(img->id.name) || !strlen(img->id.version) ||
         !img->id.install_if_different)
         return false;
 
-    LIST_FOREACH(swver, sw_ver_list, next) {
-        /*
-         * Check if name and version are identical
-         */
-        if (!strncmp(img->id.name, swver->name, sizeof(img->id.name)) &&
-            !compare_versions(img->id.version, swver->version)) {
-            TRACE("%s(%s) already installed, skipping...",
-                  img->id.name,
-                  img->id.version);
-
-            return true;
-        }
+    /*
+     * Check if name and version are identical
+     */
+    if (is_version_installed(cfg, img->id.name, img->id.version, false)) {
+        TRACE("%s(%s) already installed, skipping...",
+              img->id.name,
+              img->id.version);
+
+        return true;
     }
 
     return false;
 }
 
-static int is_image_higher(struct swver *sw_ver_list,
+static int is_image_higher(struct swupdate_cfg *cfg,
                            struct img_type *img)
 {
-    struct sw_version *swver;
-
-    if (!sw_ver_list)
-        return false;
-
     if (!strlen(img->id.name) || !strlen(img->id.version) ||
         !img->id.install_if_higher)
         return false;
 
-    LIST_FOREACH(swver, sw_ver_list, next) {
-        const char* current_version = swver->version;
-        const char* proposed_version = img->id.version;
-
-        /*
-         * Check if name are identical and the new version is lower
-         * or equal.
-         */
-        if (!strncmp(img->id.name, swver->name, sizeof(img->id.name)) &&
-            (compare_versions(proposed_version, current_version) <= 0)) {
-            TRACE("%s(%s) has a higher or same version installed, skipping...",
-                  img->id.name,
-                  img->id.version);
-
-            return true;
-        }
+    /*
+     * Check if name are identical and the new version is lower
+     * or equal.
+     */
+    if (is_version_installed(cfg, img->id.name, img->id.version, true)) {
+        TRACE("%s(%s) has a higher or same version installed, skipping...",
+              img->id.name,
+              img->id.version);
+
+        return true;
     }
 
     return false;
@@ -376,10 +415,27 @@ static int run_embscript(parsertype p, void *elem, struct img_type *img,
 	return lua_parser_fn(L, embfcn, img);
 }
 
+static int get_image_string(parsertype p, void *elem, const char *name,
+			    const char **field)
+{
+	char value[SWUPDATE_GENERAL_STRING_SIZE] = "";
+
+	if (!exist_field_string(p, elem, name))
+		return 0;
+	GET_FIELD_STRING(p, elem, name, value);
+	if (img_set_string(field, value)) {
+		ERROR("No memory: malloc failed");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int parse_common_attributes(parsertype p, void *elem, struct img_type *image, struct swupdate_cfg *cfg)
 {
 	char seek_str[MAX_SEEK_STRING_SIZE];
 	const char* compressed;
+	const char* encrypted;
 	unsigned long offset = 0;
 
 	/*
@@ -392,15 +448,16 @@ static int parse_common_attributes(parsertype p, void *elem, struct img_type *im
 	GET_FIELD_STRING(p, elem, "version", image->id.version);
 	GET_FIELD_STRING(p, elem, "filename", image->fname);
 	GET_FIELD_STRING(p, elem, "path", image->path);
-	GET_FIELD_STRING(p, elem, "volume", image->volname);
 	GET_FIELD_STRING(p, elem, "device", image->device);
-	GET_FIELD_STRING(p, elem, "mtdname", image->mtdname);
-	GET_FIELD_STRING(p, elem, "filesystem", image->filesystem);
 	GET_FIELD_STRING(p, elem, "type", image->type);
 	get_field(p, elem, "offset", &offset);
 	GET_FIELD_STRING(p, elem, "offset", seek_str);
-	GET_FIELD_STRING(p, elem, "data", image->type_data);
-	get_hash_value(p, elem, image->sha256);
+	if (get_image_string(p, elem, "volume", &image->volname) ||
+	    get_image_string(p, elem, "mtdname", &image->mtdname) ||
+	    get_image_string(p, elem, "filesystem", &image->filesystem) ||
+	    get_image_string(p, elem, "data", &image->type_data))
+		return -ENOMEM;
+	get_hash_value(p, elem, image->sha256, &image->hashalg);
 
 	/*
 	 * offset can be set as number or string. As string,
@@ -422,6 +479,10 @@ static int parse_common_attributes(parsertype p, void *elem, struct img_type *im
 			image->compressed = COMPRESSED_ZLIB;
 		} else if (!strcmp(compressed, "zstd")) {
 			image->compressed = COMPRESSED_ZSTD;
+		} else if (!strcmp(compressed, "lz4")) {
+			image->compressed = COMPRESSED_LZ4;
+		} else if (!strcmp(compressed, "xz")) {
+			image->compressed = COMPRESSED_XZ;
 		} else {
 			ERROR("compressed argument: '%s' unknown", compressed);
 			return -1;
@@ -433,12 +494,47 @@ static int parse_common_attributes(parsertype p, void *elem, struct img_type *im
 	get_field(p, elem, "preserve-attributes", &image->preserve_attributes);
 	get_field(p, elem, "install-if-different", &image->id.install_if_different);
 	get_field(p, elem, "install-if-higher", &image->id.install_if_higher);
-	get_field(p, elem, "encrypted", &image->is_encrypted);
+	get_field(p, elem, "install-if-content-different", &image->install_if_content_different);
+	if (image->install_if_content_different) {
+		char hash_ascii[80] = "";
+		char size_str[MAX_SEEK_STRING_SIZE] = "";
+		unsigned long size = 0;
+
+		GET_FIELD_STRING(p, elem, "content-sha256", hash_ascii);
+		if (ascii_to_hash(image->content_sha256, hash_ascii) < 0 ||
+		    !IsValidHash(image->content_sha256)) {
+			ERROR("%s: install-if-content-different needs content-sha256",
+			      image->fname);
+			return -1;
+		}
+		/* as offset, a number or a string with a multiplier suffix */
+		get_field(p, elem, "content-size", &size);
+		GET_FIELD_STRING(p, elem, "content-size", size_str);
+		image->content_size = size ? size : ustrtoull(size_str, NULL, 0);
+	}
+	if ((encrypted = get_field_string(p, elem, "encrypted")) != NULL) {
+		if (!strcmp(encrypted, "aes-cbc")) {
+			image->is_encrypted = ENCRYPTED_AES_CBC;
+		} else if (!strcmp(encrypted, "aes-ctr")) {
+			image->is_encrypted = ENCRYPTED_AES_CTR;
+		} else {
+			ERROR("encrypted argument: '%s' unknown", encrypted);
+			return -1;
+		}
+	} else {
+		get_field(p, elem, "encrypted", &image->is_encrypted);
+	}
 	GET_FIELD_STRING(p, elem, "ivt", image->ivt_ascii);
 
-	if (is_image_installed(&cfg->installed_sw_list, image)) {
+	/* the key stream must never be reused with CTR */
+	if (image->is_encrypted == ENCRYPTED_AES_CTR && !strlen(image->ivt_ascii)) {
+		ERROR("%s: aes-ctr needs an ivt for each artifact", image->fname);
+		return -1;
+	}
+
+	if (is_image_installed(cfg, image)) {
 		image->skip = SKIP_SAME;
-	} else if (is_image_higher(&cfg->installed_sw_list, image)) {
+	} else if (is_image_higher(cfg, image)) {
 		image->skip = SKIP_HIGHER;
 	} else {
 		image->skip = SKIP_NONE;
@@ -474,7 +570,7 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 			continue;
 		}
 
-		partition = (struct img_type *)calloc(1, sizeof(struct img_type));
+		partition = alloc_image();
 		if (!partition) {
 			ERROR("No memory: malloc failed");
 			return -ENOMEM;
@@ -483,7 +579,10 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 			free_image(partition);
 			return -1;
 		}
-		GET_FIELD_STRING(p, elem, "name", partition->volname);
+		if (get_image_string(p, elem, "name", &partition->volname)) {
+			free_image(partition);
+			return -ENOMEM;
+		}
 
 		if (!strlen(partition->type))
 			strlcpy(partition->type, "ubipartition", sizeof(partition->type));
@@ -491,7 +590,7 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 
 		partition->provided = 1;
 
-		if ((!strlen(partition->volname) && !strcmp(partition->type, "ubipartition")) ||
+		if ((!partition->volname && !strcmp(partition->type, "ubipartition")) ||
 				!strlen(partition->device)) {
 			ERROR("Partition incompleted in description file");
 			free_image(partition);
@@ -502,13 +601,16 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 
 		add_properties(p, elem, partition);
 
+		partition->bootloader = &swcfg->bootloader;
+
 		skip = run_embscript(p, elem, partition, L, swcfg->embscript);
 		if (skip < 0) {
 			free_image(partition);
 			return -1;
 		}
 		TRACE("Partition: %s new size %lld bytes",
-			!strcmp(partition->type, "ubipartition") ? partition->volname : partition->device,
+			!strcmp(partition->type, "ubipartition") ? IMG_STRING(partition->volname) :
+			partition->device,
 			partition->partsize);
 
 		LIST_INSERT_HEAD(&swcfg->images, partition, next);
@@ -562,7 +664,7 @@ static int _parse_scripts(parsertype p, void *cfg, void *setting, const char **n
 		if(!(exist_field_string(p, elem, "filename")))
 			TRACE("Script entry without filename field.");
 
-		script = (struct img_type *)calloc(1, sizeof(struct img_type));
+		script = alloc_image();
 		if (!script) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -672,7 +774,7 @@ static int _parse_bootloader(parsertype p, void *cfg, void *setting, const char
 			TRACE("bootloader entry is neither a script nor name/value.");
 			continue;
 		}
-		script = (struct img_type *)calloc(1, sizeof(struct img_type));
+		script = alloc_image();
 		if (!script) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -749,7 +851,7 @@ static int _parse_images(parsertype p, void *cfg, void *setting, const char **no
 			continue;
 		}
 
-		image = (struct img_type *)calloc(1, sizeof(struct img_type));
+		image = alloc_image();
 		if (!image) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -762,7 +864,7 @@ static int _parse_images(parsertype p, void *cfg, void *setting, const char **no
 
 		/* if the handler is not explicit set, try to find the right one */
 		if (!strlen(image->type)) {
-			if (strlen(image->volname))
+			if (image->volname)
 				strcpy(image->type, "ubivol");
 			else if (strlen(image->device))
 				strcpy(image->type, "raw");
@@ -778,20 +880,25 @@ static int _parse_images(parsertype p, void *cfg, void *setting, const char **no
 			return -1;
 		}
 
+		/* the destination may be set by the hook */
+		if (!skip && image->skip == SKIP_NONE && content_check_identical(image))
+			image->skip = SKIP_SAME;
+
 		TRACE("%s %sImage%s%s%s%s: %s in %s : %s for handler %s%s%s",
 			skip ? "Skip" : "Found",
 			image->compressed ? "compressed " : "",
 			strlen(image->id.name) ? " " : "", image->id.name,
 			strlen(image->id.version) ? " " : "", image->id.version,
 			image->fname,
-			strlen(image->volname) ? "volume" : "device",
-			strlen(image->volname) ? image->volname :
+			image->volname ? "volume" : "device",
+			image->volname ? image->volname :
 			strlen(image->path) ? image->path : image->device,
 			strlen(image->type) ? image->type : "NOT FOUND",
 			image->install_directly ? " (installed from stream)" : "",
-			(strlen(image->id.name) && (image->id.install_if_different ||
-						    image->id.install_if_higher) &&
-			 				(skip || image->skip != SKIP_NONE)) ?
+			((strlen(image->id.name) && (image->id.install_if_different ||
+						     image->id.install_if_higher)) ||
+			 image->install_if_content_different) &&
+			 				(skip || image->skip != SKIP_NONE) ?
 							" SKIPPED" : ""
 			);
 		if (skip || image->skip != SKIP_NONE) {
@@ -849,7 +956,7 @@ static int _parse_files(parsertype p, void *cfg, void *setting, const char **nod
 			continue;
 		}
 
-		file = (struct img_type *)calloc(1, sizeof(struct img_type));
+		file = alloc_image();
 		if (!file) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -874,6 +981,9 @@ static int _parse_files(parsertype p, void *cfg, void *setting, const char **nod
 			return -1;
 		}
 
+		if (!skip && file->skip == SKIP_NONE && content_check_identical(file))
+			file->skip = SKIP_SAME;
+
 		TRACE("%s %sFile%s%s%s%s: %s --> %s (%s)%s",
 			skip ? "Skip" : "Found",
 			file->compressed ? "compressed " : "",
@@ -909,10 +1019,30 @@ static int parse_files(parsertype p, void *cfg, struct swupdate_cfg *swcfg, lua_
 	return _parse_files(p, cfg, setting, nodes, swcfg, L);
 }
 
+/*
+ * Return the milliseconds elapsed since the last call
+ * and restart the measure
+ */
+static unsigned long parse_time(struct timespec *last)
+{
+	struct timespec now;
+	unsigned long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - last->tv_sec) * 1000 +
+		(now.tv_nsec - last->tv_nsec) / 1000000;
+	*last = now;
+
+	return ms;
+}
+
 static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 {
 	void *scriptnode;
 	lua_State *L = NULL;
+	struct timespec t;
+	unsigned long t_hw, t_files, t_images, t_scripts;
+	unsigned long t_bootloader, t_partitions;
 	int ret;
 
 	swcfg->embscript = NULL;
@@ -936,17 +1066,28 @@ static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 	}
 
 	/* Now parse the single elements */
-	ret = parse_hw_compatibility(p, cfg, swcfg) ||
-		parse_files(p, cfg, swcfg, L) ||
-		parse_images(p, cfg, swcfg, L) ||
-		parse_scripts(p, cfg, swcfg, L) ||
-		parse_bootloader(p, cfg, swcfg, L);
+	parse_time(&t);
+	ret = parse_hw_compatibility(p, cfg, swcfg);
+	t_hw = parse_time(&t);
+	ret = ret || parse_files(p, cfg, swcfg, L);
+	t_files = parse_time(&t);
+	ret = ret || parse_images(p, cfg, swcfg, L);
+	t_images = parse_time(&t);
+	ret = ret || parse_scripts(p, cfg, swcfg, L);
+	t_scripts = parse_time(&t);
+	ret = ret || parse_bootloader(p, cfg, swcfg, L);
+	t_bootloader = parse_time(&t);
 
 	/*
 	 * Move the partitions at the beginning to be processed
 	 * before other images
 	 */
 	parse_partitions(p, cfg, swcfg, L);
+	t_partitions = parse_time(&t);
+
+	TRACE("Parse time (ms): hw %lu files %lu images %lu scripts %lu "
+	      "bootloader %lu partitions %lu",
+	      t_hw, t_files, t_images, t_scripts, t_bootloader, t_partitions);
 
 	if (L)
 		lua_parser_exit(L);
@@ -963,7 +1104,8 @@ static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 #endif
 
 #ifdef CONFIG_LIBCONFIG
-int parse_cfg (struct swupdate_cfg *swcfg, const char *filename)
+static int parse_cfg_common(struct swupdate_cfg *swcfg, const char *filename,
+			    const char *buf)
 {
 	config_t cfg;
 	parsertype p = LIBCFG_PARSER;
@@ -973,8 +1115,12 @@ int parse_cfg (struct swupdate_cfg *swcfg, const char *filename)
 	config_init(&cfg);
 
 	/* Read the file. If there is an error, report it and exit. */
-	DEBUG("Parsing config file %s", filename);
-	if(config_read_file(&cfg, filename) != CONFIG_TRUE) {
+	DEBUG("Parsing config file %s", filename ? filename : SW_DESCRIPTION_FILENAME);
+	if (filename)
+		ret = config_read_file(&cfg, filename);
+	else
+		ret = config_read_string(&cfg, buf);
+	if (ret != CONFIG_TRUE) {
 		printf("%s ", config_error_file(&cfg));
 		printf("%d ", config_error_line(&cfg));
 		printf("%s ", config_error_text(&cfg));
@@ -985,21 +1131,44 @@ int parse_cfg (struct swupdate_cfg *swcfg, const char *filename)
 		return -1;
 	}
 
-	if (!get_common_fields(p, &cfg, swcfg))
+	parser_select(p, &cfg, swcfg);
+	if (!get_common_fields(p, &cfg, swcfg)) {
+		parser_unselect();
+		config_destroy(&cfg);
 		return -1;
+	}
 
 	ret = parser(p, &cfg, swcfg);
 
+	parser_unselect();
 	config_destroy(&cfg);
 
 	return ret;
 }
+
+int parse_cfg (struct swupdate_cfg *swcfg, const char *filename)
+{
+	return parse_cfg_common(swcfg, filename, NULL);
+}
+
+int parse_cfg_buffer(struct swupdate_cfg *swcfg, const char *buf,
+		     size_t __attribute__ ((__unused__)) len)
+{
+	return parse_cfg_common(swcfg, NULL, buf);
+}
 #else
 int parse_cfg (struct swupdate_cfg __attribute__ ((__unused__)) *swcfg,
 		const char __attribute__ ((__unused__)) *filename)
 {
 	return -1;
 }
+
+int parse_cfg_buffer(struct swupdate_cfg __attribute__ ((__unused__)) *swcfg,
+		     const char __attribute__ ((__unused__)) *buf,
+		     size_t __attribute__ ((__unused__)) len)
+{
+	return -1;
+}
 #endif
 
 #ifdef CONFIG_JSON
@@ -1012,8 +1181,6 @@ int parse_json(struct swupdate_cfg *swcfg, const char *filename)
 	struct stat stbuf;
 	unsigned int size;
 	char *string;
-	json_object *cfg;
-	parsertype p = JSON_PARSER;
 
 	DEBUG("Parsing config file %s", filename);
 	/* Read the file. If there is an error, report it and exit. */
@@ -1045,29 +1212,49 @@ int parse_json(struct swupdate_cfg *swcfg, const char *filename)
 	}
 	string[ret] = '\0';
 
-	cfg = json_tokener_parse(string);
+	ret = parse_json_buffer(swcfg, string, ret);
+	free(string);
+
+	return ret;
+}
+
+int parse_json_buffer(struct swupdate_cfg *swcfg, const char *buf,
+		      size_t __attribute__ ((__unused__)) len)
+{
+	json_object *cfg;
+	parsertype p = JSON_PARSER;
+	int ret;
+
+	cfg = json_tokener_parse(buf);
 	if (!cfg) {
 		ERROR("JSON File corrupted");
-		free(string);
 		return -1;
 	}
 
+	parser_select(p, cfg, swcfg);
 	if (!get_common_fields(p, cfg, swcfg)) {
-		free(string);
+		parser_unselect();
+		json_object_put(cfg);
 		return -1;
 	}
 
 	ret = parser(p, cfg, swcfg);
+	parser_unselect();
 
 	if (json_object_put(cfg) != JSON_OBJECT_FREED) {
 		WARN("Leaking cfg json object");
 	}
 
-	free(string);
-
 	return ret;
 }
 #else
+int parse_json_buffer(struct swupdate_cfg __attribute__ ((__unused__)) *swcfg,
+		      const char __attribute__ ((__unused__)) *buf,
+		      size_t __attribute__ ((__unused__)) len)
+{
+	return -1;
+}
+
 int parse_json(struct swupdate_cfg __attribute__ ((__unused__)) *swcfg,
 		const char __attribute__ ((__unused__)) *filename)
 {
@@ -22,11 +22,49 @@ void suricatta_channel_settings(void *elem, channel_data_t *chan)
 
 	get_field(LIBCFG_PARSER, elem, "retry",
 		&chan->retries);
+	get_field(LIBCFG_PARSER, elem, "idle-timeout",
+		&chan->idle_timeout);
+	get_field(LIBCFG_PARSER, elem, "segments",
+		&chan->segments);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "segment-size", tmp);
+	if (strlen(tmp))
+		chan->segment_size = (unsigned int)ustrtoull(tmp, NULL, 10);
+
+	get_field(LIBCFG_PARSER, elem, "compress-replies",
+		&chan->compress_replies);
+	get_field(LIBCFG_PARSER, elem, "conditional-get",
+		&chan->conditional_get);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "peers", tmp);
+	if (strlen(tmp))
+		SETSTRING(chan->peers, tmp);
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "peer-cache", tmp);
+	if (strlen(tmp))
+		SETSTRING(chan->peer_cache, tmp);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "http-version", tmp);
+	if (strlen(tmp))
+		chan->http_version = channel_http_version(tmp);
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "readahead", tmp);
+	if (strlen(tmp))
+		chan->readahead = (unsigned int)ustrtoull(tmp, NULL, 10);
+	get_field(LIBCFG_PARSER, elem, "readahead-high",
+		&chan->readahead_high);
+	get_field(LIBCFG_PARSER, elem, "readahead-low",
+		&chan->readahead_low);
 
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "max-download-speed", tmp);
 	if (strlen(tmp))
 		chan->max_download_speed = (unsigned int)ustrtoull(tmp, NULL, 10);
 
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "min-download-speed", tmp);
+	if (strlen(tmp))
+		chan->min_download_speed = (unsigned int)ustrtoull(tmp, NULL, 10);
+	get_field(LIBCFG_PARSER, elem, "adaptive-speed",
+		&chan->adaptive_speed);
+
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "retrywait", tmp);
 	if (strlen(tmp))
 		chan->retry_sleep =
@@ -43,6 +81,11 @@ void suricatta_channel_settings(void *elem, channel_data_t *chan)
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "sslcert", tmp);
 	if (strlen(tmp))
 		SETSTRING(chan->sslcert, tmp);
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "tls-session-file", tmp);
+	if (strlen(tmp))
+		SETSTRING(chan->tls_sessions, tmp);
+	get_field(LIBCFG_PARSER, elem, "tls-session-lifetime",
+		&chan->tls_session_lifetime);
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "proxy", tmp);
 	if (strlen(tmp))
 		SETSTRING(chan->proxy, tmp);
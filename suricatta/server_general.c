@@ -25,6 +25,7 @@
 #include <sys/time.h>
 #include <swupdate_status.h>
 #include "suricatta/suricatta.h"
+#include "suricatta/server.h"
 #include "suricatta_private.h"
 #include "parselib.h"
 #include "channel.h"
@@ -38,16 +39,17 @@
 #include <progress_ipc.h>
 #include <pctl.h>
 #include <pthread.h>
+#include <poll.h>
 
 /* Prototypes for "public" functions */
-void server_print_help(void);
-server_op_res_t server_has_pending_action(int *action_id);
-server_op_res_t server_stop(void);
-server_op_res_t server_ipc(ipc_message *msg);
-server_op_res_t server_start(char *fname, int argc, char *argv[]);
-server_op_res_t server_install_update(void);
-server_op_res_t server_send_target_data(void);
-unsigned int server_get_polling_interval(void);
+static void server_print_help(void);
+static server_op_res_t server_has_pending_action(int *action_id);
+static server_op_res_t server_stop(void);
+static server_op_res_t server_ipc(ipc_message *msg);
+static server_op_res_t server_start(const char *fname, int argc, char *argv[]);
+static server_op_res_t server_install_update(void);
+static server_op_res_t server_send_target_data(void);
+static unsigned int server_get_polling_interval(void);
 
 /*
  * This is a "specialized" map_http_retcode() because
@@ -78,6 +80,8 @@ typedef struct {
 	char *url;
 	struct dict *identify;
 	char *fname;
+	unsigned int log_interval;
+	unsigned int log_batch_size;
 } server_progress_data;
 static server_progress_data progdata;
 
@@ -93,12 +97,19 @@ static server_progress_data progdata;
  */
 #define MAX_LOG_SIZE 1024
 
+/*
+ * Default size of a batch of log messages sent in a single request
+ */
+#define DEFAULT_LOG_BATCH_SIZE	(4 * MAX_LOG_SIZE)
+
 extern channel_op_res_t channel_curl_init(void);
 
 server_general_t server_general = {.url = NULL,
 				   .polling_interval = 30,
 				   .debug = false,
 				   .cached_file = NULL,
+				   .log_interval = 0,
+				   .log_batch_size = DEFAULT_LOG_BATCH_SIZE,
 				   .channel = NULL};
 
 static channel_data_t channel_data_defaults = {.debug = false,
@@ -230,12 +241,95 @@ static char *server_format_log(const char *event, struct dict *fmtevents,
 	return log;
 }
 
+/*
+ * Pending log messages, one per line, sent to the server
+ * in a single request
+ */
+struct server_log_batch {
+	char *buf;
+	size_t len;
+	size_t size;
+	struct timespec first;
+};
+
+static void server_flush_log(channel_t *channel, channel_data_t *channel_data,
+			     struct server_log_batch *batch)
+{
+	server_op_res_t result;
+
+	if (!batch->len)
+		return;
+
+	channel_data->request_body = batch->buf;
+	channel_data->method = CHANNEL_PUT;
+	channel_data->content_type = "application/text";
+	result = map_channel_retcode(channel->put(channel, (void *)channel_data));
+	if (result != SERVER_OK)
+		ERROR("Sending log to server failed !");
+	batch->len = 0;
+	batch->buf[0] = '\0';
+}
+
+/*
+ * Queue a formatted log. The batch is sent before if the
+ * new message does not fit into it anymore.
+ */
+static void server_queue_log(channel_t *channel, channel_data_t *channel_data,
+			     struct server_log_batch *batch, const char *log)
+{
+	size_t loglen = strlen(log);
+	char *tmp;
+
+	if (batch->len && batch->len + loglen + 1 >= batch->size)
+		server_flush_log(channel, channel_data, batch);
+
+	if (batch->len + loglen + 2 > batch->size) {
+		tmp = realloc(batch->buf, batch->len + loglen + 2);
+		if (!tmp) {
+			ERROR("Cannot queue log, dropped");
+			return;
+		}
+		batch->buf = tmp;
+		batch->size = batch->len + loglen + 2;
+	}
+
+	if (!batch->len)
+		clock_gettime(CLOCK_MONOTONIC, &batch->first);
+	else
+		batch->buf[batch->len++] = '\n';
+	memcpy(batch->buf + batch->len, log, loglen + 1);
+	batch->len += loglen;
+}
+
+/*
+ * Milliseconds until the queued logs must be sent,
+ * -1 if there is nothing to send
+ */
+static int server_log_timeout(struct server_log_batch *batch, unsigned int interval)
+{
+	struct timespec now;
+	long elapsed;
+
+	if (!batch->len)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - batch->first.tv_sec) * 1000 +
+		(now.tv_nsec - batch->first.tv_nsec) / 1000000;
+	if (elapsed >= (long)interval * 1000)
+		return 0;
+
+	return (int)((long)interval * 1000 - elapsed);
+}
+
 /*
  * progress thread. This is started to get all
  * changes during an install exactly as a separate process
  * via progress interface.
  * It manages to send the LOG to the server with PUT
- * method
+ * method. Logs are collected and sent together every
+ * log_interval seconds or when log_batch_size is reached,
+ * and always at the end of an update.
  */
 
 static void *server_progress_thread (void *data)
@@ -247,8 +341,10 @@ static void *server_progress_thread (void *data)
 	channel_t *channel;
 	channel_data_t channel_data = channel_data_defaults;
 	struct dict fmtevents;
-	server_op_res_t result;
+	struct server_log_batch batch = { .buf = NULL, .len = 0, .size = 0 };
+	struct pollfd pfd;
 	char *logbuffer = NULL;
+	int timeout, ret;
 
 	LIST_INIT(&fmtevents);
 
@@ -260,15 +356,24 @@ static void *server_progress_thread (void *data)
 		pthread_exit((void *)SERVER_EINIT);
 	}
 
+	batch.size = prog->log_batch_size ? prog->log_batch_size : DEFAULT_LOG_BATCH_SIZE;
+	batch.buf = calloc(1, batch.size);
+	if (!batch.buf) {
+		ERROR("Cannot allocate buffer for logs");
+		pthread_exit((void *)SERVER_EINIT);
+	}
+
 	channel = channel_new();
 	if (!channel) {
 		ERROR("Cannot get channel for communication");
+		free(batch.buf);
 		pthread_exit((void *)SERVER_EINIT);
 	}
 	if (channel->open(channel, &channel_data) != CHANNEL_OK) {
 		ERROR("Cannot open channel for progress thread");
 		(void)channel->close(channel);
 		free(channel);
+		free(batch.buf);
 		pthread_exit((void *)SERVER_EINIT);
 	}
 
@@ -298,10 +403,35 @@ static void *server_progress_thread (void *data)
 		 * if still fails, try later
 		 */
 		if (progfd < 0) {
+			if (!server_log_timeout(&batch, prog->log_interval))
+				server_flush_log(channel, &channel_data, &batch);
 			sleep(1);
 			continue;
 		}
 
+		/*
+		 * Wait for the next message, but not longer than
+		 * the pending logs can be kept
+		 */
+		timeout = server_log_timeout(&batch, prog->log_interval);
+		if (timeout) {
+			pfd.fd = progfd;
+			pfd.events = POLLIN;
+			ret = poll(&pfd, 1, timeout);
+			if (ret < 0) {
+				if (errno != EINTR) {
+					close(progfd);
+					progfd = -1;
+				}
+				continue;
+			}
+		} else
+			ret = 0;
+		if (!ret) {
+			server_flush_log(channel, &channel_data, &batch);
+			continue;
+		}
+
 		if (progress_ipc_receive(&progfd, &msg) <= 0) {
 			continue;
 		}
@@ -312,7 +442,11 @@ static void *server_progress_thread (void *data)
 		if ((status == IDLE) && (msg.status != IDLE)) {
 			/* New update started */
 			logbuffer = server_format_log("started", &fmtevents, prog->identify);
-
+			if (logbuffer) {
+				server_queue_log(channel, &channel_data, &batch, logbuffer);
+				free(logbuffer);
+				logbuffer = NULL;
+			}
 		}
 
 		switch (msg.status) {
@@ -330,20 +464,24 @@ static void *server_progress_thread (void *data)
 		}
 
 		if (logbuffer) {
-			channel_data.request_body = logbuffer;
-			channel_data.method = CHANNEL_PUT;
-			channel_data.content_type = "application/text";
-			result = map_channel_retcode(channel->put(channel, (void *)&channel_data));
-			if (result != SERVER_OK)
-				ERROR("Sending log to server failed !");
+			server_queue_log(channel, &channel_data, &batch, logbuffer);
 			free(logbuffer);
 			logbuffer = NULL;
 		}
+
+		/*
+		 * The result of an update is never delayed
+		 */
+		if (!prog->log_interval || msg.status == SUCCESS ||
+		    msg.status == FAILURE)
+			server_flush_log(channel, &channel_data, &batch);
+
 		status = msg.status;
 	}
 
 	(void)channel->close(channel);
 	free(channel);
+	free(batch.buf);
 	pthread_exit((void *)0);
 }
 
@@ -483,7 +621,7 @@ static server_op_res_t server_get_deployment_info(channel_t *channel, channel_da
 	return result;
 }
 
-server_op_res_t server_has_pending_action(int *action_id)
+static server_op_res_t server_has_pending_action(int *action_id)
 {
 	*action_id = 0;
 
@@ -497,17 +635,17 @@ server_op_res_t server_has_pending_action(int *action_id)
 					  &channel_data);
 }
 
-server_op_res_t server_send_target_data(void)
+static server_op_res_t server_send_target_data(void)
 {
 	return SERVER_OK;
 }
 
-unsigned int server_get_polling_interval(void)
+static unsigned int server_get_polling_interval(void)
 {
 	return server_general.polling_interval;
 }
 
-void server_print_help(void)
+static void server_print_help(void)
 {
 	fprintf(
 	    stdout,
@@ -529,7 +667,7 @@ void server_print_help(void)
 	    CHANNEL_DEFAULT_RESUME_DELAY);
 }
 
-server_op_res_t server_install_update(void)
+static server_op_res_t server_install_update(void)
 {
 	channel_data_t channel_data = channel_data_defaults;
 	server_op_res_t result = SERVER_OK;
@@ -600,12 +738,18 @@ static int server_general_settings(void *elem, void  __attribute__ ((__unused__)
 	get_field(LIBCFG_PARSER, elem, "polldelay",
 		&server_general.polling_interval);
 
+	get_field(LIBCFG_PARSER, elem, "loginterval",
+		&server_general.log_interval);
+
+	get_field(LIBCFG_PARSER, elem, "logbatchsize",
+		&server_general.log_batch_size);
+
 	suricatta_channel_settings(elem, &channel_data_defaults);
 
 	return 0;
 }
 
-server_op_res_t server_start(char *fname, int argc, char *argv[])
+static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 {
 	int choice = 0;
 
@@ -705,6 +849,8 @@ server_op_res_t server_start(char *fname, int argc, char *argv[])
 	progdata.fname = (fname) ? strdup(fname) : NULL;
 	progdata.url = server_general.logurl;
 	progdata.identify = &server_general.configdata;
+	progdata.log_interval = server_general.log_interval;
+	progdata.log_batch_size = server_general.log_batch_size;
 
 	start_thread(server_progress_thread, &progdata);
 
@@ -713,7 +859,7 @@ server_op_res_t server_start(char *fname, int argc, char *argv[])
 	return SERVER_OK;
 }
 
-server_op_res_t server_stop(void)
+static server_op_res_t server_stop(void)
 {
 	(void)server_general.channel->close(server_general.channel);
 	free(server_general.channel);
@@ -721,7 +867,24 @@ server_op_res_t server_stop(void)
 	return SERVER_OK;
 }
 
-server_op_res_t server_ipc(ipc_message __attribute__ ((__unused__)) *msg)
+static server_op_res_t server_ipc(ipc_message __attribute__ ((__unused__)) *msg)
 {
 	return SERVER_OK;
 }
+
+static server_t server = {
+	.has_pending_action = &server_has_pending_action,
+	.install_update = &server_install_update,
+	.send_target_data = &server_send_target_data,
+	.get_polling_interval = &server_get_polling_interval,
+	.start = &server_start,
+	.stop = &server_stop,
+	.ipc = &server_ipc,
+	.help = &server_print_help,
+};
+
+__attribute__((constructor))
+static void register_general_server(void)
+{
+	register_server("general", &server);
+}
@@ -22,6 +22,8 @@ typedef struct {
 	unsigned int polling_interval;
 	bool debug;
 	char *cached_file;
+	unsigned int log_interval;
+	unsigned int log_batch_size;
 	struct dict configdata;
 	struct dict received_httpheaders;
 	struct dict httpheaders_to_send;
@@ -13,6 +13,10 @@
 #include <getopt.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include <json-c/json.h>
 #include <generated/autoconf.h>
 #include <util.h>
@@ -21,6 +25,7 @@
 #include <swupdate_status.h>
 #include <pthread.h>
 #include "suricatta/suricatta.h"
+#include "suricatta/server.h"
 #include "suricatta_private.h"
 #include "parselib.h"
 #include "channel.h"
@@ -30,6 +35,7 @@
 #include "parselib.h"
 #include "swupdate_settings.h"
 #include "swupdate_dict.h"
+#include "json_stream.h"
 
 #define INITIAL_STATUS_REPORT_WAIT_DELAY 10
 
@@ -56,10 +62,28 @@ static struct option long_options[] = {
 	{"max-download-speed", required_argument, NULL, 'l'},
     {NULL, 0, NULL, 0}};
 
+/* CPU priority of a download ahead of the maintenance window */
+#define PREFETCH_NICE	19
+
+/*
+ * Feedback queue: details merged into a single message,
+ * queued messages and time to wait for the queue to drain
+ */
+#define FEEDBACK_MAX_DETAILS	48
+#define FEEDBACK_MAX_QUEUED	32
+#define FEEDBACK_WAIT_TIMEOUT	30
+
 static unsigned short mandatory_argument_count = 0;
 static pthread_mutex_t notifylock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t ipc_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * IPC requests talk to the server on their own channel, so they are
+ * neither serialized with nor mixed into a running download
+ */
+static channel_t *ipc_channel;
+static pthread_mutex_t ipc_channel_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * See hawkBit's API for an explanation
  *
@@ -100,7 +124,7 @@ server_op_res_t server_process_update_artifact(int action_id,
 						const char *part,
 						const char *version,
 						const char *name);
-void server_print_help(void);
+static void server_print_help(void);
 server_op_res_t server_set_polling_interval_json(json_object *json_root);
 server_op_res_t server_set_config_data(json_object *json_root);
 server_op_res_t
@@ -110,6 +134,13 @@ server_send_deployment_reply(channel_t *channel,
 			     const char *execution_status, int numdetails, const char *details[]);
 server_op_res_t server_send_cancel_reply(channel_t *channel, const int action_id);
 static int get_target_data_length(bool locked);
+static char *server_prefetched_artifact(const char *sha1);
+static void server_prefetch_drop(void);
+static void server_prefetch_next_start(const char *sha1);
+static void server_prefetch_next_wait(bool abort);
+
+/* SWUs of the deployment still to be installed as part of the bundle */
+static int bundle_remaining;
 
 server_hawkbit_t server_hawkbit = {.url = NULL,
 				   .polling_interval = CHANNEL_DEFAULT_POLLING_INTERVAL,
@@ -121,6 +152,7 @@ server_hawkbit_t server_hawkbit = {.url = NULL,
 				   .update_action = NULL,
 				   .usetokentodwl = true,
 				   .cached_file = NULL,
+				   .prefetched_action = -1,
 				   .channel = NULL};
 
 static channel_data_t channel_data_defaults = {.debug = false,
@@ -144,16 +176,14 @@ static channel_data_t channel_data_defaults = {.debug = false,
 					       .received_headers = NULL
 						};
 
-static struct timeval server_time;
-
 /* Prototypes for "public" functions */
-server_op_res_t server_has_pending_action(int *action_id);
-server_op_res_t server_stop(void);
-server_op_res_t server_ipc(ipc_message *msg);
-server_op_res_t server_start(char *fname, int argc, char *argv[]);
-server_op_res_t server_install_update(void);
-server_op_res_t server_send_target_data(void);
-unsigned int server_get_polling_interval(void);
+static server_op_res_t server_has_pending_action(int *action_id);
+static server_op_res_t server_stop(void);
+static server_op_res_t server_ipc(ipc_message *msg);
+static server_op_res_t server_start(const char *fname, int argc, char *argv[]);
+static server_op_res_t server_install_update(void);
+static server_op_res_t server_send_target_data(void);
+static unsigned int server_get_polling_interval(void);
 
 /*
  * Just called once to setup the tokens
@@ -217,33 +247,22 @@ static bool hawkbit_enum_check(const char *key, const char *value)
 	return false;
 }
 
-static const char *json_get_deployment_update_action(json_object *json_reply)
+static const char *deployment_update_action_from_string(const char *update)
 {
-	if (!json_reply)
-		return NULL;
-
-	json_object *json_deployment_update_action =
-	    json_get_path_key(json_reply,
-			      (const char *[]){"deployment", "update", NULL});
-	assert(json_object_get_type(json_deployment_update_action) ==
-	       json_type_string);
-	if (!json_object_get_string(json_deployment_update_action)) {
+	if (!update) {
 		ERROR("Server delivered empty 'update', skipping..");
 		return deployment_update_action.skip;
 	}
 
-	if (strncmp(json_object_get_string(json_deployment_update_action),
-		    deployment_update_action.forced,
+	if (strncmp(update, deployment_update_action.forced,
 		    strlen(deployment_update_action.forced)) == 0) {
 		return deployment_update_action.forced;
 	}
-	if (strncmp(json_object_get_string(json_deployment_update_action),
-	       	    deployment_update_action.attempt,
+	if (strncmp(update, deployment_update_action.attempt,
 	       	    strlen(deployment_update_action.attempt)) == 0) {
 		return deployment_update_action.attempt;
 	}
-	if (strncmp(json_object_get_string(json_deployment_update_action),
-		    deployment_update_action.skip,
+	if (strncmp(update, deployment_update_action.skip,
 		    strlen(deployment_update_action.skip)) == 0) {
 		return deployment_update_action.skip;
 	}
@@ -255,6 +274,86 @@ static const char *json_get_deployment_update_action(json_object *json_reply)
 	return deployment_update_action.skip;
 }
 
+static const char *json_get_deployment_update_action(json_object *json_reply)
+{
+	if (!json_reply)
+		return NULL;
+
+	json_object *json_deployment_update_action =
+	    json_get_path_key(json_reply,
+			      (const char *[]){"deployment", "update", NULL});
+	assert(json_object_get_type(json_deployment_update_action) ==
+	       json_type_string);
+	return deployment_update_action_from_string(
+	    json_object_get_string(json_deployment_update_action));
+}
+
+/*
+ * Replies that are just checked for the pending action are
+ * fetched as raw text, the few fields are read from the text
+ * without building the JSON tree of the whole deployment.
+ */
+static const char *raw_get_deployment_update_action(const char *raw_reply)
+{
+	char update[16];
+
+	if (!raw_reply)
+		return NULL;
+	if (json_stream_get_string(raw_reply, strlen(raw_reply),
+				   (const char *[]){"deployment", "update", NULL},
+				   update, sizeof(update)))
+		return deployment_update_action_from_string(NULL);
+
+	return deployment_update_action_from_string(update);
+}
+
+static bool reply_get_int(channel_data_t *channel_data, const char **path, int *val)
+{
+	if (channel_data->format == CHANNEL_PARSE_RAW) {
+		long long n;
+
+		if (!channel_data->raw_reply ||
+		    json_stream_get_int(channel_data->raw_reply,
+					strlen(channel_data->raw_reply), path, &n))
+			return false;
+		*val = (int)n;
+		return true;
+	}
+
+	json_object *json_data = json_get_path_key(channel_data->json_reply, path);
+	if (json_data == NULL)
+		return false;
+	*val = json_object_get_int(json_data);
+	return true;
+}
+
+static const char *reply_to_string(channel_data_t *channel_data)
+{
+	if (channel_data->format == CHANNEL_PARSE_RAW)
+		return channel_data->raw_reply ? channel_data->raw_reply : "";
+	return json_object_to_json_string(channel_data->json_reply);
+}
+
+/* "download" has the same values as "update" */
+static const char *json_get_deployment_download(json_object *json_reply)
+{
+	json_object *json_download;
+
+	if (!json_reply)
+		return NULL;
+
+	json_download = json_get_path_key(json_reply,
+			(const char *[]){"deployment", "download", NULL});
+	if (!json_download || !json_object_get_string(json_download))
+		return deployment_update_action.skip;
+	if (!strcmp(json_object_get_string(json_download), deployment_update_action.forced))
+		return deployment_update_action.forced;
+	if (!strcmp(json_object_get_string(json_download), deployment_update_action.attempt))
+		return deployment_update_action.attempt;
+
+	return deployment_update_action.skip;
+}
+
 static void check_action_changed(int action_id, const char *update_action)
 {
 
@@ -503,21 +602,11 @@ server_op_res_t server_set_polling_interval_json(json_object *json_root)
 	return SERVER_OK;
 }
 
-unsigned int server_get_polling_interval(void)
+static unsigned int server_get_polling_interval(void)
 {
 	return server_hawkbit.polling_interval;
 }
 
-static void server_get_current_time(struct timeval *tv)
-{
-	struct timespec ts;
-
-	/* use timespec for monotonic clock */
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-
-	TIMESPEC_TO_TIMEVAL(tv, &ts);
-}
-
 server_op_res_t server_set_config_data(json_object *json_root)
 {
 	char *tmp;
@@ -530,6 +619,8 @@ server_op_res_t server_set_config_data(json_object *json_root)
 			free(server_hawkbit.configData_url);
 		server_hawkbit.configData_url = tmp;
 		server_hawkbit.has_to_send_configData = (get_target_data_length(true) > 0) ? true : false;
+		/* the server asks for the attributes, it may have lost them */
+		server_hawkbit.send_all_configData = server_hawkbit.has_to_send_configData;
 		TRACE("ConfigData: %s", server_hawkbit.configData_url);
 		pthread_mutex_unlock(&ipc_lock);
 	}
@@ -598,6 +689,8 @@ static server_op_res_t server_get_deployment_info(channel_t *channel, channel_da
 	char *url_deployment_base = NULL;
 	char *url_cancel = NULL;
 	channel_data_t channel_data_device_info = channel_data_defaults;
+	/* both requests are conditional if the caller asks for it */
+	channel_data_device_info.conditional_get |= channel_data->conditional_get;
 	if ((result = server_get_device_info(channel, &channel_data_device_info)) !=
 	    SERVER_OK) {
 		goto cleanup;
@@ -625,30 +718,23 @@ static server_op_res_t server_get_deployment_info(channel_t *channel, channel_da
 	    SERVER_OK) {
 		goto cleanup;
 	}
-	json_object *json_data = json_get_path_key(
-	    channel_data->json_reply, (const char *[]){"id", NULL});
-	if (json_data == NULL) {
+	if (!reply_get_int(channel_data, (const char *[]){"id", NULL}, action_id)) {
 		ERROR("Got malformed JSON: Could not find field 'id'.");
-		DEBUG("Got JSON: %s",
-		      json_object_to_json_string(channel_data->json_reply));
+		DEBUG("Got JSON: %s", reply_to_string(channel_data));
 		result = SERVER_EBADMSG;
 		goto cleanup;
 	}
-	*action_id = json_object_get_int(json_data);
 
 	/*
 	 * Read stopId if cancelUpdate is detected
 	 */
 	server_hawkbit.stop_id = *action_id;
 	if (update_status == SERVER_UPDATE_CANCELED) {
-		json_data = json_get_path_key(
-		    channel_data->json_reply, (const char *[]){"cancelAction", "stopId", NULL});
-		if (json_data == NULL) {
+		if (!reply_get_int(channel_data,
+				   (const char *[]){"cancelAction", "stopId", NULL},
+				   &server_hawkbit.stop_id)) {
 			ERROR("Got malformed JSON: Could not find field 'stopId', reuse actionId.");
-			DEBUG("Got JSON: %s",
-			      json_object_to_json_string(channel_data->json_reply));
-		} else {
-			server_hawkbit.stop_id = json_object_get_int(json_data);
+			DEBUG("Got JSON: %s", reply_to_string(channel_data));
 		}
 	}
 	TRACE("Associated Action ID for Update Action is %d", *action_id);
@@ -669,104 +755,158 @@ cleanup:
 	return result;
 }
 
-static size_t server_check_during_dwl(char  __attribute__ ((__unused__)) *streamdata,
-                                      size_t size,
-                                      size_t nmemb,
-                                      void  __attribute__ ((__unused__)) *data)
+/*
+ * The download can take a very long time. In the meantime, a
+ * separate thread checks with the polling interval if the server
+ * cancelled or skipped the update. It keeps its own connection,
+ * and unchanged replies come back as 304 Not Modified.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+	bool stop;
+	volatile bool abort_download;
+} dwl_check = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+static void server_check_action(channel_t *channel)
 {
-	struct timeval now;
 	channel_data_t channel_data = channel_data_defaults;
 	int action_id;
-	int ret = size * nmemb;
 	const char *update_action;
 
-	server_get_current_time(&now);
-
-	/*
-	 * The download can take a very long time
-	 * In the meantime, check with current polling time
-	 * if something on the server was changed and a cancel
-	 * was requested
-	 */
-	if ((now.tv_sec - server_time.tv_sec) < ((int)server_get_polling_interval()))
-		return ret;
-
-	/* Update current server time */
-	server_time = now;
-
-	/*
-	 * We need a separate channel because we want to run
-	 * a connection parallel to the download
-	 */
-	channel_t *channel = channel_new();
-	if (!channel)
-		return ret;
-
-	if (channel->open(channel, &channel_data_defaults) != CHANNEL_OK) {
-		/*
-		 * it is not possible to check for a cancelUpdate,
-		 * go on downloading
-		 */
-		channel->close(channel);
-		free(channel);
-		return ret;
-	}
+	/* just the action and its type are checked */
+	channel_data.format = CHANNEL_PARSE_RAW;
+	channel_data.conditional_get = true;
 
-	/*
-	 * Send a device Info to the hawkBit Server
-	 */
 	server_op_res_t result =
 	    server_get_deployment_info(channel, &channel_data, &action_id);
 	if (result == SERVER_UPDATE_CANCELED) {
 		/* Mark that an update was cancelled by the server */
 		server_hawkbit.cancelDuringUpdate = true;
-		ret = 0;
+		dwl_check.abort_download = true;
 	}
-	update_action = json_get_deployment_update_action(channel_data.json_reply);
+	update_action = raw_get_deployment_update_action(channel_data.raw_reply);
 
 	/* if the deployment is skipped then stop downloading */
 	if (update_action == deployment_update_action.skip)
-		ret = 0;
+		dwl_check.abort_download = true;
 
 	check_action_changed(action_id, update_action);
 
-	/* Cleanup and free resources */
-	if (channel_data.json_reply != NULL &&
-	    json_object_put(channel_data.json_reply) != JSON_OBJECT_FREED) {
-		ERROR("JSON object should be freed but was not.");
+	free(channel_data.raw_reply);
+}
+
+static void *server_check_thread(void __attribute__ ((__unused__)) *data)
+{
+	channel_data_t channel_data = channel_data_defaults;
+	struct timespec deadline;
+	channel_t *channel;
+	bool opened;
+
+	/*
+	 * We need a separate channel because we want to run
+	 * a connection parallel to the download
+	 */
+	channel = channel_new();
+	if (!channel)
+		return NULL;
+	opened = channel->open(channel, &channel_data) == CHANNEL_OK;
+
+	pthread_mutex_lock(&dwl_check.lock);
+	while (!dwl_check.stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += server_get_polling_interval();
+		while (!dwl_check.stop &&
+		       pthread_cond_timedwait(&dwl_check.cond, &dwl_check.lock,
+					      &deadline) != ETIMEDOUT)
+			;
+		if (dwl_check.stop)
+			break;
+		pthread_mutex_unlock(&dwl_check.lock);
+		/*
+		 * it is not possible to check for a cancelUpdate
+		 * without channel, go on downloading
+		 */
+		if (opened)
+			server_check_action(channel);
+		pthread_mutex_lock(&dwl_check.lock);
 	}
+	pthread_mutex_unlock(&dwl_check.lock);
+
 	channel->close(channel);
 	free(channel);
 
-	return ret;
+	return NULL;
 }
 
-server_op_res_t server_has_pending_action(int *action_id)
+static void server_check_start(void)
+{
+	dwl_check.stop = false;
+	dwl_check.abort_download = false;
+	dwl_check.running = !pthread_create(&dwl_check.thread, NULL,
+					    server_check_thread, NULL);
+	if (!dwl_check.running)
+		WARN("Cancel requests cannot be checked during the download");
+}
+
+static void server_check_stop(void)
+{
+	if (!dwl_check.running)
+		return;
+	pthread_mutex_lock(&dwl_check.lock);
+	dwl_check.stop = true;
+	pthread_cond_signal(&dwl_check.cond);
+	pthread_mutex_unlock(&dwl_check.lock);
+	if (pthread_join(dwl_check.thread, NULL))
+		ERROR("return code from pthread_join()");
+	dwl_check.running = false;
+}
+
+static size_t server_check_during_dwl(char  __attribute__ ((__unused__)) *streamdata,
+                                      size_t size,
+                                      size_t nmemb,
+                                      void  __attribute__ ((__unused__)) *data)
+{
+	/* the server cancelled or skipped the update, stop downloading */
+	if (dwl_check.abort_download)
+		return 0;
+
+	return size * nmemb;
+}
+
+static server_op_res_t server_has_pending_action(int *action_id)
 {
 
 	channel_data_t channel_data = channel_data_defaults;
 	const char *update_action = NULL;
-	server_op_res_t result =
-	    server_get_deployment_info(server_hawkbit.channel,
-			    		&channel_data, action_id);
+	server_op_res_t result;
+
+	/*
+	 * The deployment is fetched again by server_install_update(),
+	 * here the JSON tree is not needed
+	 */
+	channel_data.format = CHANNEL_PARSE_RAW;
+	result = server_get_deployment_info(server_hawkbit.channel,
+					    &channel_data, action_id);
 
 	/*
 	 * Retrieve if "update" changed before freeing object, used later
 	 */
 	if (result == SERVER_UPDATE_AVAILABLE) {
-		update_action = json_get_deployment_update_action(channel_data.json_reply);
+		update_action = raw_get_deployment_update_action(channel_data.raw_reply);
 	}
 
-	/* TODO don't throw away reply JSON as it's fetched again by succinct
-	 *      server_install_update() */
-	if (channel_data.json_reply != NULL &&
-	    json_object_put(channel_data.json_reply) != JSON_OBJECT_FREED) {
-		ERROR("JSON object should be freed but was not.");
-	}
+	free(channel_data.raw_reply);
 	if (result == SERVER_UPDATE_CANCELED) {
 		DEBUG("Acknowledging cancelled update.");
 		/* Inform the installer that a CANCEL was received */
 		(void)server_send_cancel_reply(server_hawkbit.channel, *action_id);
+		server_prefetch_drop();
 
 		server_hawkbit.update_state = STATE_OK;
 		/*
@@ -821,7 +961,8 @@ static void add_detail_error(const char *s)
 	}
 }
 
-static server_op_res_t handle_feedback(int action_id, server_op_res_t result,
+static server_op_res_t handle_feedback(channel_t *channel, int action_id,
+					server_op_res_t result,
 					update_state_t state,
 					const char *reply_result,
 					const char *reply_execution,
@@ -852,7 +993,7 @@ static server_op_res_t handle_feedback(int action_id, server_op_res_t result,
 		break;
 	}
 
-	if (server_send_deployment_reply(server_hawkbit.channel, action_id, 0, 0, reply_result,
+	if (server_send_deployment_reply(channel, action_id, 0, 0, reply_result,
 					 reply_execution,
 					 numdetails, details) != SERVER_OK) {
 		ERROR("Error while reporting installation status to server.");
@@ -914,7 +1055,8 @@ server_op_res_t server_handle_initial_state(update_state_t stateovrrd)
 	result =
 	    server_get_deployment_info(server_hawkbit.channel, &channel_data, &action_id);
 
-	result = handle_feedback(action_id, result, state, reply_result,
+	result = handle_feedback(server_hawkbit.channel, action_id, result,
+				 state, reply_result,
 				 reply_execution, 1, &reply_message);
 
 	if (result != SERVER_UPDATE_AVAILABLE)
@@ -939,31 +1081,210 @@ static int server_update_status_callback(ipc_message *msg)
 	return 0;
 }
 
-static void *process_notification_thread(void *data)
+/*
+ * Deployment feedback is sent by a separate thread, so that
+ * a slow or unreachable server never blocks the threads
+ * watching the installation. Intermediate "proceeding" messages
+ * for the same action are merged while they wait in the queue,
+ * terminal states are retried until the server gets them.
+ */
+struct feedback_msg {
+	int action_id;
+	int job_cnt_max;
+	int job_cnt_cur;
+	const char *finished;
+	const char *execution;
+	bool terminal;
+	unsigned int numdetails;
+	char *details[FEEDBACK_MAX_DETAILS];
+	TAILQ_ENTRY(feedback_msg) next;
+};
+TAILQ_HEAD(feedback_queue, feedback_msg);
+
+static struct feedback_queue feedbackq = TAILQ_HEAD_INITIALIZER(feedbackq);
+static unsigned int feedback_queued;
+static bool feedback_busy;
+static pthread_mutex_t feedback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t feedback_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t feedback_once = PTHREAD_ONCE_INIT;
+
+static void feedback_free(struct feedback_msg *fb)
 {
-	const int action_id = *(int *)data;
-	const int MAX_DETAILS = 48;
-	const char *details[MAX_DETAILS];
-	unsigned int numdetails = 0;
-	bool stop = false;
-	channel_data_t channel_data = channel_data_defaults;
-	unsigned int percent = 0;
-	unsigned int step = 0;
+	for (unsigned int i = 0; i < fb->numdetails; i++)
+		free(fb->details[i]);
+	free(fb);
+}
 
+static void *feedback_thread(void __attribute__ ((__unused__)) *data)
+{
+	channel_data_t channel_data = channel_data_defaults;
+	struct feedback_msg *fb;
+	channel_t *channel;
 
-	/*
-	 * Create a new channel to the server. The opened channel is
-	 * used to download the SWU
-	 */
-	channel_t *channel = channel_new();
+	channel = channel_new();
 	if (!channel)
 		return NULL;
 
-	if (channel->open(channel, &channel_data) != CHANNEL_OK) {
-		channel->close(channel);
-		free(channel);
-		return NULL;
+	while (channel->open(channel, &channel_data) != CHANNEL_OK) {
+		ERROR("Cannot open channel for feedback, retrying...");
+		sleep(server_hawkbit.initial_report_resend_period);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&feedback_lock);
+		while (TAILQ_EMPTY(&feedbackq))
+			pthread_cond_wait(&feedback_cond, &feedback_lock);
+		fb = TAILQ_FIRST(&feedbackq);
+		TAILQ_REMOVE(&feedbackq, fb, next);
+		feedback_queued--;
+		feedback_busy = true;
+		pthread_mutex_unlock(&feedback_lock);
+
+		if (server_send_deployment_reply(channel, fb->action_id,
+				fb->job_cnt_max, fb->job_cnt_cur,
+				fb->finished, fb->execution, fb->numdetails,
+				(const char **)fb->details) != SERVER_OK) {
+			if (fb->terminal) {
+				WARN("Cannot report the result of action %d, retrying in %ds",
+				     fb->action_id, server_hawkbit.initial_report_resend_period);
+				sleep(server_hawkbit.initial_report_resend_period);
+				pthread_mutex_lock(&feedback_lock);
+				TAILQ_INSERT_HEAD(&feedbackq, fb, next);
+				feedback_queued++;
+				feedback_busy = false;
+				pthread_mutex_unlock(&feedback_lock);
+				continue;
+			}
+			ERROR("Error while sending log to server.");
+		}
+		feedback_free(fb);
+
+		pthread_mutex_lock(&feedback_lock);
+		feedback_busy = false;
+		pthread_cond_broadcast(&feedback_cond);
+		pthread_mutex_unlock(&feedback_lock);
+	}
+
+	return NULL;
+}
+
+static void feedback_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t id;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&id, &attr, feedback_thread, NULL))
+		ERROR("Cannot start the feedback thread");
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Queue a deployment feedback. A "proceeding" message is merged
+ * into the last queued one of the same action while its details fit.
+ */
+static void feedback_enqueue(int action_id, int job_cnt_max, int job_cnt_cur,
+			     const char *finished, const char *execution,
+			     bool terminal, unsigned int numdetails,
+			     const char *details[])
+{
+	struct feedback_msg *fb;
+
+	pthread_once(&feedback_once, feedback_start);
+
+	if (numdetails > FEEDBACK_MAX_DETAILS)
+		numdetails = FEEDBACK_MAX_DETAILS;
+
+	pthread_mutex_lock(&feedback_lock);
+	fb = TAILQ_LAST(&feedbackq, feedback_queue);
+	if (!terminal && fb && !fb->terminal && fb->action_id == action_id &&
+	    fb->numdetails + numdetails <= FEEDBACK_MAX_DETAILS) {
+		fb->job_cnt_max = job_cnt_max;
+		fb->job_cnt_cur = job_cnt_cur;
+	} else {
+		if (!terminal && feedback_queued >= FEEDBACK_MAX_QUEUED) {
+			pthread_mutex_unlock(&feedback_lock);
+			DEBUG("Feedback queue full, progress of action %d dropped",
+			      action_id);
+			return;
+		}
+		fb = calloc(1, sizeof(*fb));
+		if (!fb) {
+			pthread_mutex_unlock(&feedback_lock);
+			ERROR("hawkBit server reply cannot be queued because of OOM.");
+			return;
+		}
+		fb->action_id = action_id;
+		fb->job_cnt_max = job_cnt_max;
+		fb->job_cnt_cur = job_cnt_cur;
+		fb->finished = finished;
+		fb->execution = execution;
+		fb->terminal = terminal;
+		TAILQ_INSERT_TAIL(&feedbackq, fb, next);
+		feedback_queued++;
+	}
+	for (unsigned int i = 0; i < numdetails; i++) {
+		fb->details[fb->numdetails] = strdup(details[i]);
+		if (fb->details[fb->numdetails])
+			fb->numdetails++;
+	}
+	pthread_cond_broadcast(&feedback_cond);
+	pthread_mutex_unlock(&feedback_lock);
+}
+
+/*
+ * Wait until the queued feedback was sent, so that it reaches
+ * the server before the messages sent directly afterwards
+ */
+static void feedback_wait(void)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += FEEDBACK_WAIT_TIMEOUT;
+
+	pthread_mutex_lock(&feedback_lock);
+	while (!TAILQ_EMPTY(&feedbackq) || feedback_busy) {
+		if (pthread_cond_timedwait(&feedback_cond, &feedback_lock,
+					   &deadline) == ETIMEDOUT) {
+			WARN("Feedback to the server still pending");
+			break;
+		}
 	}
+	pthread_mutex_unlock(&feedback_lock);
+}
+
+/*
+ * A terminal state is sent at once and queued for retry
+ * if the server cannot be reached
+ */
+static server_op_res_t server_send_terminal_reply(int action_id, int job_cnt_max,
+						  int job_cnt_cur, const char *finished,
+						  int numdetails, const char *details[])
+{
+	server_op_res_t result;
+
+	feedback_wait();
+	result = server_send_deployment_reply(server_hawkbit.channel, action_id,
+					      job_cnt_max, job_cnt_cur, finished,
+					      reply_status_execution.closed,
+					      numdetails, details);
+	if (result != SERVER_OK)
+		feedback_enqueue(action_id, job_cnt_max, job_cnt_cur, finished,
+				 reply_status_execution.closed, true,
+				 numdetails, details);
+
+	return result;
+}
+
+static void *process_notification_thread(void *data)
+{
+	const int action_id = *(int *)data;
+	const char *detail;
+	bool stop = false;
+	unsigned int percent = 0;
+	unsigned int step = 0;
 
 	for (;;) {
 		ipc_message msg;
@@ -990,7 +1311,7 @@ static void *process_notification_thread(void *data)
 		 * ret == 0: TIMEOUT, no more messages
 		 * ret < 0 : ERROR, exit
 		 */
-		if (data_avail && numdetails < MAX_DETAILS) {
+		if (data_avail) {
 			for (int c = 0; c < strlen(msg.data.status.desc); c++) {
 				switch (msg.data.status.desc[c]) {
 				case '"':
@@ -1002,26 +1323,16 @@ static void *process_notification_thread(void *data)
 					break;
 				}
 			}
-			details[numdetails++] = strdup(msg.data.status.desc);
-		}
 
-		/*
-		 * Flush to the server
-		 */
-		if (numdetails == MAX_DETAILS || (stop && !data_avail)) {
-			TRACE("Update log to server from thread");
-			if (server_send_deployment_reply(
-				channel,
-				action_id, step, percent,
-				reply_status_result_finished.none,
-				reply_status_execution.proceeding, numdetails,
-				&details[0]) != SERVER_OK) {
-				ERROR("Error while sending log to server.");
-			}
-			for (unsigned int count = 0; count < numdetails; count++) {
-				free((void *)details[count]);
-			}
-			numdetails = 0;
+			/*
+			 * Queue it to the server, it is merged with the
+			 * messages not sent yet
+			 */
+			detail = msg.data.status.desc;
+			feedback_enqueue(action_id, step, percent,
+					 reply_status_result_finished.none,
+					 reply_status_execution.proceeding, false,
+					 1, &detail);
 			percent++;
 			if (percent > 100) {
 				percent = 0;
@@ -1035,12 +1346,6 @@ static void *process_notification_thread(void *data)
 
 	pthread_mutex_unlock(&notifylock);
 
-	/*
-	 * Now close the channel for feedback
-	 */
-	channel->close(channel);
-	free(channel);
-
 	return NULL;
 }
 
@@ -1151,6 +1456,7 @@ server_op_res_t server_process_update_artifact(int action_id,
 		      json_object_get_string(json_data_artifact_url));
 
 		channel_data_t channel_data = channel_data_defaults;
+		char *prefetched = NULL;
 		channel_data.url =
 		    strdup(json_object_get_string(json_data_artifact_url));
 
@@ -1176,6 +1482,14 @@ server_op_res_t server_process_update_artifact(int action_id,
 
 		channel_data.dwlwrdata = server_check_during_dwl;
 
+		if (bundle_remaining)
+			channel_data.bundle = --bundle_remaining ?
+				BUNDLE_NEXT : BUNDLE_LAST;
+
+		/* peers share artifacts by their SHA1 */
+		channel_data.artifact_id =
+		    (char *)json_object_get_string(json_data_artifact_sha1hash);
+
 		/*
 		 * There is no authorizytion token when file is loaded, because SWU
 		 * can be on a different server as hawkBit with a different
@@ -1192,12 +1506,33 @@ server_op_res_t server_process_update_artifact(int action_id,
 			channel_data.cached_file = server_hawkbit.cached_file;
 
 		/*
-		 * Retrieve current time to check download time
-		 * This is used in the callback to ask again the hawkBit
-		 * server if the download is longer as the polling time
+		 * The artifact was downloaded ahead of the maintenance
+		 * window, it is installed from the local copy
 		 */
+		server_prefetch_next_wait(false);
+		prefetched = server_prefetched_artifact(
+		    json_object_get_string(json_data_artifact_sha1hash));
+		if (prefetched) {
+			char *local_url;
+
+			if (ENOMEM_ASPRINTF ==
+			    asprintf(&local_url, "file://%s", prefetched)) {
+				/* just download it again */
+				free(prefetched);
+				prefetched = NULL;
+			} else {
+				free(channel_data.url);
+				channel_data.url = local_url;
+				channel_data.peers = NULL;
+				INFO("Installing prefetched artifact %s", prefetched);
+			}
+		}
 
-		server_get_current_time(&server_time);
+		/*
+		 * The next artifact is downloaded meanwhile
+		 */
+		server_prefetch_next_start(
+		    json_object_get_string(json_data_artifact_sha1hash));
 
 		/*
 		 * Start background task to collect logs and
@@ -1213,8 +1548,14 @@ server_op_res_t server_process_update_artifact(int action_id,
 		thread_ret = pthread_create(&notify_to_hawkbit_thread, &attr,
 				process_notification_thread, &action_id);
 
+		/*
+		 * Ask again the hawkBit server during the download
+		 * if it takes longer as the polling time
+		 */
+		server_check_start();
 		channel_op_res_t cresult =
 		    channel->get_file(channel, (void *)&channel_data);
+		server_check_stop();
 		if ((result = map_channel_retcode(cresult)) != SERVER_OK) {
 			/* this is called to collect errors */
 			ipc_wait_for_complete(server_update_status_callback);
@@ -1260,6 +1601,9 @@ server_op_res_t server_process_update_artifact(int action_id,
 				ERROR("return code from pthread_join()");
 			}
 		}
+		feedback_wait();
+		if (result != SERVER_OK)
+			server_prefetch_next_wait(true);
 		pthread_mutex_destroy(&notifylock);
 		if (channel_data.url != NULL) {
 			free(channel_data.url);
@@ -1267,6 +1611,11 @@ server_op_res_t server_process_update_artifact(int action_id,
 		if (channel_data.info != NULL) {
 			free(channel_data.info);
 		}
+		/* as a cache file, the local copy is used just once */
+		if (prefetched) {
+			unlink(prefetched);
+			free(prefetched);
+		}
 		if (result != SERVER_OK) {
 			break;
 		}
@@ -1285,7 +1634,393 @@ cleanup:
 	return result;
 }
 
-server_op_res_t server_install_update(void)
+/*
+ * Artifacts downloaded ahead of the maintenance window are stored
+ * in the prefetch directory, named by their SHA1
+ */
+static char *prefetch_file(const char *sha1)
+{
+	char *fname;
+
+	if (ENOMEM_ASPRINTF ==
+	    asprintf(&fname, "%s/%s.swu", server_hawkbit.prefetch_dir, sha1))
+		return NULL;
+	return fname;
+}
+
+/*
+ * Chunks of the deployment being installed, used to look up
+ * the artifact downloaded ahead while the current one installs
+ */
+static json_object *deployment_chunks;
+
+static struct {
+	pthread_t thread;
+	bool running;
+	char *url;
+	char *sha1;
+} next_dwl;
+static volatile bool prefetch_abort;
+
+static char *server_prefetched_artifact(const char *sha1)
+{
+	struct stat st;
+	char *fname;
+
+	if (!server_hawkbit.prefetch_dir || !sha1)
+		return NULL;
+	fname = prefetch_file(sha1);
+	if (fname && stat(fname, &st)) {
+		free(fname);
+		fname = NULL;
+	}
+
+	return fname;
+}
+
+static void server_prefetch_drop(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+
+	if (!server_hawkbit.prefetch_dir)
+		return;
+	dir = opendir(server_hawkbit.prefetch_dir);
+	if (!dir)
+		return;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type == DT_REG)
+			unlinkat(dirfd(dir), entry->d_name, 0);
+	}
+	closedir(dir);
+	server_hawkbit.prefetched_action = -1;
+}
+
+static size_t server_prefetch_write(char *streamdata, size_t size, size_t nmemb,
+				    void *data)
+{
+	channel_data_t *channel_data = (channel_data_t *)data;
+	int fd = *(int *)channel_data->user;
+
+	if (prefetch_abort)
+		return 0;
+
+	if (write(fd, streamdata, size * nmemb) != (ssize_t)(size * nmemb)) {
+		ERROR("Prefetched artifact cannot be stored: %s", strerror(errno));
+		return 0;
+	}
+
+	return size * nmemb;
+}
+
+/*
+ * The artifact is not sent to the installer, it is stored and
+ * gets its final name after its checksum was verified
+ */
+static server_op_res_t server_prefetch_artifact(channel_t *channel,
+						const char *url, const char *sha1)
+{
+	channel_data_t channel_data = channel_data_defaults;
+	server_op_res_t result = SERVER_EERR;
+	char *fname, *partfile = NULL;
+	int fd;
+
+	fname = server_prefetched_artifact(sha1);
+	if (fname) {
+		TRACE("Artifact %s already prefetched", fname);
+		free(fname);
+		return SERVER_OK;
+	}
+	fname = prefetch_file(sha1);
+	if (!fname || ENOMEM_ASPRINTF == asprintf(&partfile, "%s.part", fname)) {
+		ERROR("Artifact cannot be prefetched because of OOM.");
+		free(fname);
+		return SERVER_EERR;
+	}
+	fd = open(partfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ERROR("Artifact cannot be stored in %s: %s", partfile, strerror(errno));
+		goto cleanup;
+	}
+
+	channel_data.url = (char *)url;
+	channel_data.noipc = true;
+	channel_data.dwlwrdata = server_prefetch_write;
+	channel_data.user = &fd;
+	channel_data.artifact_id = (char *)sha1;
+	if (server_hawkbit.prefetch_speed)
+		channel_data.max_download_speed = server_hawkbit.prefetch_speed;
+	if (!server_hawkbit.usetokentodwl)
+		channel_data.auth_token = NULL;
+
+	INFO("Prefetching artifact from %s", url);
+	result = map_channel_retcode(channel->get_file(channel, (void *)&channel_data));
+#ifdef CONFIG_SURICATTA_SSL
+	if (result == SERVER_OK &&
+	    strncmp(channel_data.sha1hash, sha1, SWUPDATE_SHA_DIGEST_LENGTH * 2)) {
+		ERROR("Checksum of prefetched artifact does not match: Should be "
+		      "'%s', but actually is '%s'.", sha1, channel_data.sha1hash);
+		result = SERVER_EBADMSG;
+	}
+#endif
+	if (result == SERVER_OK && fsync(fd) < 0)
+		result = SERVER_EERR;
+	close(fd);
+
+	if (result == SERVER_OK && rename(partfile, fname) < 0) {
+		ERROR("Prefetched artifact cannot be renamed to %s: %s",
+		      fname, strerror(errno));
+		result = SERVER_EERR;
+	}
+	if (result == SERVER_OK)
+		INFO("Artifact prefetched into %s", fname);
+	else
+		unlink(partfile);
+
+cleanup:
+	free(partfile);
+	free(fname);
+
+	return result;
+}
+
+/*
+ * URL and SHA1 of an artifact, false if it is not a SWU
+ */
+static bool artifact_download_info(json_object *artifact, const char **url,
+				   const char **sha1)
+{
+	const char *filename = json_get_value(artifact, "filename");
+	json_object *json_sha1 = json_get_path_key(artifact,
+			(const char *[]){"hashes", "sha1", NULL});
+	json_object *json_url = json_get_path_key(artifact,
+			(const char *[]){"_links", "download", "href", NULL});
+	int endfilename;
+
+	if (!json_url)
+		json_url = json_get_path_key(artifact,
+				(const char *[]){"_links", "download-http", "href", NULL});
+	if (!filename || !json_sha1 || !json_url)
+		return false;
+	endfilename = strlen(filename) - strlen(".swu");
+	if (endfilename <= 0 || strncmp(&filename[endfilename], ".swu", 4))
+		return false;
+
+	*url = json_object_get_string(json_url);
+	*sha1 = json_object_get_string(json_sha1);
+
+	return true;
+}
+
+/*
+ * Number of SWUs in all chunks of the deployment
+ */
+static int deployment_swu_count(json_object *chunks)
+{
+	int count = 0;
+
+	for (size_t i = 0; i < json_object_array_length(chunks); i++) {
+		json_object *artifacts = json_get_path_key(
+		    json_object_array_get_idx(chunks, i),
+		    (const char *[]){"artifacts", NULL});
+		const char *url, *sha1;
+
+		if (!artifacts || json_object_get_type(artifacts) != json_type_array)
+			continue;
+		for (size_t j = 0; j < json_object_array_length(artifacts); j++)
+			if (artifact_download_info(json_object_array_get_idx(artifacts, j),
+						   &url, &sha1))
+				count++;
+	}
+
+	return count;
+}
+
+static void *prefetch_next_thread(void __attribute__ ((__unused__)) *data)
+{
+	channel_data_t channel_data = channel_data_defaults;
+	channel_t *channel = channel_new();
+
+	if (!channel)
+		return NULL;
+
+	if (channel->open(channel, &channel_data) == CHANNEL_OK &&
+	    server_prefetch_artifact(channel, next_dwl.url, next_dwl.sha1) != SERVER_OK)
+		INFO("Next artifact not downloaded ahead, it is streamed");
+	channel->close(channel);
+	free(channel);
+
+	return NULL;
+}
+
+/*
+ * Start to download the artifact following sha1 in the deployment,
+ * so that it is ready when the current one is installed
+ */
+static void server_prefetch_next_start(const char *sha1)
+{
+	const char *url, *next_sha1;
+	bool found = false;
+	char *fname;
+
+	if (!server_hawkbit.prefetch_dir || !server_hawkbit.prefetch_next ||
+	    !deployment_chunks || next_dwl.running || !sha1)
+		return;
+
+	for (int i = 0; i < json_object_array_length(deployment_chunks); i++) {
+		json_object *json_data_artifacts = json_get_path_key(
+		    json_object_array_get_idx(deployment_chunks, i),
+		    (const char *[]){"artifacts", NULL});
+
+		if (json_data_artifacts == NULL ||
+		    json_object_get_type(json_data_artifacts) != json_type_array)
+			continue;
+
+		for (int j = 0; j < json_object_array_length(json_data_artifacts); j++) {
+			if (!artifact_download_info(
+				json_object_array_get_idx(json_data_artifacts, j),
+				&url, &next_sha1))
+				continue;
+			if (found)
+				goto start;
+			found = !strcmp(next_sha1, sha1);
+		}
+	}
+	return;
+
+start:
+	fname = server_prefetched_artifact(next_sha1);
+	if (fname) {
+		free(fname);
+		return;
+	}
+	next_dwl.url = strdup(url);
+	next_dwl.sha1 = strdup(next_sha1);
+	prefetch_abort = false;
+	if (!next_dwl.url || !next_dwl.sha1 ||
+	    pthread_create(&next_dwl.thread, NULL, prefetch_next_thread, NULL)) {
+		free(next_dwl.url);
+		free(next_dwl.sha1);
+		return;
+	}
+	next_dwl.running = true;
+	DEBUG("Downloading next artifact %s during the install", next_dwl.sha1);
+}
+
+static void server_prefetch_next_wait(bool abort)
+{
+	if (!next_dwl.running)
+		return;
+	if (abort)
+		prefetch_abort = true;
+	if (pthread_join(next_dwl.thread, NULL))
+		ERROR("return code from pthread_join()");
+	free(next_dwl.url);
+	free(next_dwl.sha1);
+	next_dwl.url = NULL;
+	next_dwl.sha1 = NULL;
+	next_dwl.running = false;
+}
+
+/*
+ * Downloads the artifacts of a deployment while hawkBit does not allow
+ * to install it yet (maintenance window, download only). The download
+ * runs at low priority and with its own speed limit.
+ */
+static server_op_res_t server_prefetch_update(int action_id, json_object *json_reply)
+{
+	server_op_res_t result = SERVER_OK;
+	const char *details = "Artifacts downloaded.";
+	int prio;
+
+	json_object *json_data_chunk =
+	    json_get_path_key(json_reply,
+			      (const char *[]){"deployment", "chunks", NULL});
+	if (json_data_chunk == NULL ||
+	    json_object_get_type(json_data_chunk) != json_type_array) {
+		server_hawkbit_error("Got malformed JSON: Could not find field "
+				     "deployment->chunks.");
+		return SERVER_EBADMSG;
+	}
+
+	errno = 0;
+	prio = getpriority(PRIO_PROCESS, 0);
+	if (prio == -1 && errno)
+		prio = 0;
+	if (setpriority(PRIO_PROCESS, 0, PREFETCH_NICE) < 0)
+		DEBUG("Cannot lower priority for prefetching: %s", strerror(errno));
+
+	for (int i = 0; i < json_object_array_length(json_data_chunk) &&
+	     result == SERVER_OK; i++) {
+		json_object *json_data_artifacts = json_get_path_key(
+		    json_object_array_get_idx(json_data_chunk, i),
+		    (const char *[]){"artifacts", NULL});
+
+		if (json_data_artifacts == NULL ||
+		    json_object_get_type(json_data_artifacts) != json_type_array)
+			continue;
+
+		for (int j = 0; j < json_object_array_length(json_data_artifacts) &&
+		     result == SERVER_OK; j++) {
+			const char *url, *sha1;
+
+			if (!artifact_download_info(
+				json_object_array_get_idx(json_data_artifacts, j),
+				&url, &sha1))
+				continue;
+
+			result = server_prefetch_artifact(server_hawkbit.channel, url, sha1);
+		}
+	}
+
+	if (setpriority(PRIO_PROCESS, 0, prio) < 0)
+		WARN("Cannot restore priority after prefetching: %s", strerror(errno));
+
+	/* hawkBit closes a download only action on this feedback */
+	if (result == SERVER_OK && server_hawkbit.prefetched_action != action_id) {
+		if (server_send_deployment_reply(
+			server_hawkbit.channel,
+			action_id, 0, 0, reply_status_result_finished.none,
+			reply_status_execution.downloaded, 1,
+			&details) != SERVER_OK) {
+			ERROR("Error while reporting download to server.");
+		} else
+			server_hawkbit.prefetched_action = action_id;
+	}
+
+	return result;
+}
+
+/*
+ * Summary of the report of the last update, if SWUpdate profiles
+ * the updates (CONFIG_PROFILE). It has no quotes, it can be sent
+ * as detail of the feedback as it is.
+ */
+static bool server_update_report(char *report, size_t len)
+{
+	char path[MAX_IMAGE_FNAME];
+	json_object *json_root, *json_updates, *json_summary = NULL;
+	size_t n;
+
+	if (ipc_get_file_path(GET_PROFILE, path, sizeof(path)))
+		return false;
+	json_root = json_object_from_file(path);
+	if (!json_root)
+		return false;
+	json_updates = json_get_key(json_root, "updates");
+	if (json_updates && json_object_get_type(json_updates) == json_type_array &&
+	    (n = json_object_array_length(json_updates)) > 0)
+		json_summary = json_get_path_key(
+			json_object_array_get_idx(json_updates, n - 1),
+			(const char *[]){"report", "summary", NULL});
+	if (json_summary)
+		snprintf(report, len, "Report: %s", json_object_get_string(json_summary));
+	json_object_put(json_root);
+
+	return json_summary != NULL;
+}
+
+static server_op_res_t server_install_update(void)
 {
 	int action_id;
 	channel_data_t channel_data = channel_data_defaults;
@@ -1309,12 +2044,17 @@ server_op_res_t server_install_update(void)
 	server_hawkbit.update_action = NULL;
 	const char *update_action = json_get_deployment_update_action(channel_data.json_reply);
 	check_action_changed(action_id, update_action);
+	if (server_hawkbit.update_action == deployment_update_action.skip &&
+	    server_hawkbit.prefetch_dir &&
+	    json_get_deployment_download(channel_data.json_reply) != deployment_update_action.skip) {
+		DEBUG("Update not allowed yet, downloading it ahead.");
+		(void)server_prefetch_update(action_id, channel_data.json_reply);
+		goto cleanup;
+	}
 	if (server_hawkbit.update_action == deployment_update_action.skip) {
 		const char *details = "Skipped Update.";
-		if (server_send_deployment_reply(
-			server_hawkbit.channel,
-			action_id, 0, 0, reply_status_result_finished.success,
-			reply_status_execution.closed, 1,
+		if (server_send_terminal_reply(
+			action_id, 0, 0, reply_status_result_finished.success, 1,
 			&details) != SERVER_OK) {
 			ERROR("Error while reporting installation progress to "
 			      "server.\n");
@@ -1335,6 +2075,15 @@ server_op_res_t server_install_update(void)
 	}
 
 	assert(json_object_get_type(json_data_chunk) == json_type_array);
+	deployment_chunks = json_data_chunk;
+	/*
+	 * The SWUs of the deployment are installed as one transaction,
+	 * the last one commits it
+	 */
+	bundle_remaining = server_hawkbit.bundle ?
+		deployment_swu_count(json_data_chunk) : 0;
+	if (bundle_remaining < 2)
+		bundle_remaining = 0;
 	struct array_list *json_data_chunk_array =
 	    json_object_get_array(json_data_chunk);
 	int json_data_chunk_count = 0;
@@ -1344,6 +2093,8 @@ server_op_res_t server_install_update(void)
 				 "Installing Update Chunk Artifacts failed.",
 				 "Installed Chunk.",
 				 "All Chunks Installed."};
+	char report[1024];
+	const char *installed[] = {details[2], report};
 
 	for (json_data_chunk_count = 0;
 	     json_data_chunk_count < json_data_chunk_max;
@@ -1427,12 +2178,11 @@ server_op_res_t server_install_update(void)
 				json_object_get_string(json_data_chunk_name),
 			        json_object_get_string(json_data_chunk_version),
 			        json_object_get_string(json_data_chunk_part));
-				(void)server_send_deployment_reply(
-				    server_hawkbit.channel,
+				(void)server_send_terminal_reply(
 			 	    action_id, json_data_chunk_max,
 				    json_data_chunk_count,
 				    reply_status_result_finished.failure,
-				    reply_status_execution.closed, server_hawkbit.errorcnt,
+				    server_hawkbit.errorcnt,
 				    (const char **)server_hawkbit.errors);
 			}
 			goto cleanup;
@@ -1442,8 +2192,9 @@ server_op_res_t server_install_update(void)
 			action_id, json_data_chunk_max,
 			json_data_chunk_count + 1,
 			reply_status_result_finished.none,
-			reply_status_execution.proceeding, 1,
-			&details[2]) != SERVER_OK) {
+			reply_status_execution.proceeding,
+			server_update_report(report, sizeof(report)) ? 2 : 1,
+			installed) != SERVER_OK) {
 			ERROR("Error while reporting installation progress to "
 			      "server.\n");
 		}
@@ -1460,6 +2211,9 @@ server_op_res_t server_install_update(void)
 	}
 
 cleanup:
+	server_prefetch_next_wait(true);
+	deployment_chunks = NULL;
+	bundle_remaining = 0;
 	for (int i = 0; i < HAWKBIT_MAX_REPORTED_ERRORS; i++) {
 		if (server_hawkbit.errors[i]) {
 			free(server_hawkbit.errors[i]);
@@ -1503,28 +2257,137 @@ int get_target_data_length(bool locked)
 	return len;
 }
 
-server_op_res_t server_send_target_data(void)
+/*
+ * Order independent hash of the attributes: dict_set_value()
+ * moves the changed entries to the head of the list
+ */
+static unsigned long long configdata_hash(struct dict *dictionary)
+{
+	struct dict_entry *entry;
+	unsigned long long hash = 0;
+
+	LIST_FOREACH(entry, dictionary, next) {
+		unsigned long long h = 0xcbf29ce484222325ULL;
+		const char *key = dict_entry_get_key(entry);
+		const char *value = dict_entry_get_value(entry);
+
+		for (const char *c = key; *c; c++)
+			h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+		h = (h ^ '=') * 0x100000001b3ULL;
+		for (const char *c = value; *c; c++)
+			h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+		hash += h;
+	}
+
+	return hash;
+}
+
+static bool configdata_cache_matches(unsigned long long hash)
+{
+	unsigned long long stored;
+	bool ret = false;
+	FILE *fp;
+
+	if (!server_hawkbit.configdata_cache)
+		return false;
+	fp = fopen(server_hawkbit.configdata_cache, "r");
+	if (!fp)
+		return false;
+	if (fscanf(fp, "%llx", &stored) == 1)
+		ret = (stored == hash);
+	fclose(fp);
+
+	return ret;
+}
+
+static void configdata_cache_store(unsigned long long hash)
+{
+	FILE *fp;
+
+	if (!server_hawkbit.configdata_cache)
+		return;
+	fp = fopen(server_hawkbit.configdata_cache, "w");
+	if (!fp) {
+		WARN("Cannot store target attributes hash in %s: %s",
+		     server_hawkbit.configdata_cache, strerror(errno));
+		return;
+	}
+	fprintf(fp, "%016llx\n", hash);
+	fclose(fp);
+}
+
+/*
+ * Collects the attributes that the server does not know yet.
+ * Must be called with ipc_lock held.
+ */
+static int get_changed_target_data(struct dict *changed)
+{
+	struct dict_entry *entry;
+	int len = 0;
+
+	/*
+	 * The attributes sent by a previous run are not sent again,
+	 * unless the server requests them
+	 */
+	if (!server_hawkbit.send_all_configData &&
+	    LIST_EMPTY(&server_hawkbit.sent_configdata) &&
+	    configdata_cache_matches(configdata_hash(&server_hawkbit.configdata))) {
+		TRACE("Target attributes already sent to the server");
+		if (dict_copy(&server_hawkbit.sent_configdata, &server_hawkbit.configdata))
+			dict_drop_db(&server_hawkbit.sent_configdata);
+	}
+
+	LIST_FOREACH(entry, &server_hawkbit.configdata, next) {
+		char *key = dict_entry_get_key(entry);
+		char *value = dict_entry_get_value(entry);
+		char *sent = dict_get_value(&server_hawkbit.sent_configdata, key);
+
+		if (!server_hawkbit.send_all_configData && sent && !strcmp(sent, value))
+			continue;
+		if (dict_set_value(changed, key, value))
+			return -ENOMEM;
+		len += strlen(key) + strlen(value) + strlen (" : ") + 6;
+	}
+
+	return len;
+}
+
+static server_op_res_t server_send_target_data(void)
 {
 	channel_t *channel = server_hawkbit.channel;
 	struct dict_entry *entry;
+	struct dict changed;
 	bool first = true;
 	int len = 0;
 	server_op_res_t result = SERVER_OK;
 	char *json_reply_string = NULL;
 	char *url = NULL;
+	char *configData = NULL;
 
 	assert(channel != NULL);
-	len = get_target_data_length(false);
+	LIST_INIT(&changed);
 
+	pthread_mutex_lock(&ipc_lock);
+	len = get_changed_target_data(&changed);
+	pthread_mutex_unlock(&ipc_lock);
+
+	if (len < 0) {
+		ERROR("OOM when sending ID data to server");
+		result = SERVER_EERR;
+		goto cleanup;
+	}
 	if (!len) {
+		TRACE("Target attributes unchanged, nothing sent");
 		server_hawkbit.has_to_send_configData = false;
-		return SERVER_OK;
+		server_hawkbit.send_all_configData = false;
+		goto cleanup;
 	}
 
-	char *configData = (char *)(malloc(len + 16));
+	configData = (char *)(malloc(len + 16));
 	if (!configData) {
 		ERROR("OOM when sending ID data to server");
-		return SERVER_EERR;
+		result = SERVER_EERR;
+		goto cleanup;
 	}
 	memset(configData, 0, len + 16);
 
@@ -1533,8 +2396,7 @@ server_op_res_t server_send_target_data(void)
 	);
 
 	char *keyvalue = NULL;
-	pthread_mutex_lock(&ipc_lock);
-	LIST_FOREACH(entry, &server_hawkbit.configdata, next) {
+	LIST_FOREACH(entry, &changed, next) {
 		char *key = dict_entry_get_key(entry);
 		char *value = dict_entry_get_value(entry);
 
@@ -1545,7 +2407,6 @@ server_op_res_t server_send_target_data(void)
 				value)) {
 			ERROR("hawkBit server reply cannot be sent because of OOM.");
 			result = SERVER_EINIT;
-			pthread_mutex_unlock(&ipc_lock);
 			goto cleanup;
 		}
 		first = false;
@@ -1554,7 +2415,6 @@ server_op_res_t server_send_target_data(void)
 		free(keyvalue);
 
 	}
-	pthread_mutex_unlock(&ipc_lock);
 
 	TRACE("CONFIGDATA=%s", configData);
 
@@ -1569,6 +2429,7 @@ server_op_res_t server_send_target_data(void)
 			"execution": "%s",
 			"details" : [ "%s" ]
 		},
+		"mode": "merge",
 		"data" : {
 			%s
 		}
@@ -1604,11 +2465,22 @@ server_op_res_t server_send_target_data(void)
 	channel_data_reply.method = CHANNEL_PUT;
 	result = map_channel_retcode(channel->put(channel, (void *)&channel_data_reply));
 
-	if (result == SERVER_OK)
+	if (result == SERVER_OK) {
+		pthread_mutex_lock(&ipc_lock);
+		LIST_FOREACH(entry, &changed, next) {
+			dict_set_value(&server_hawkbit.sent_configdata,
+				       dict_entry_get_key(entry),
+				       dict_entry_get_value(entry));
+		}
+		configdata_cache_store(configdata_hash(&server_hawkbit.sent_configdata));
 		server_hawkbit.has_to_send_configData = false;
+		server_hawkbit.send_all_configData = false;
+		pthread_mutex_unlock(&ipc_lock);
+	}
 
 cleanup:
 
+	dict_drop_db(&changed);
 	free(configData);
 	if (url != NULL)
 		free(url);
@@ -1619,7 +2491,7 @@ cleanup:
 	return result;
 }
 
-void server_print_help(void)
+static void server_print_help(void)
 {
 	fprintf(
 	    stdout,
@@ -1696,12 +2568,24 @@ static int server_hawkbit_settings(void *elem, void  __attribute__ ((__unused__)
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "gatewaytoken", tmp);
 	if (strlen(tmp))
 		SETSTRING(server_hawkbit.gatewaytoken, tmp);
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "configdata-cache", tmp);
+	if (strlen(tmp))
+		SETSTRING(server_hawkbit.configdata_cache, tmp);
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "prefetch-dir", tmp);
+	if (strlen(tmp))
+		SETSTRING(server_hawkbit.prefetch_dir, tmp);
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "prefetch-speed", tmp);
+	if (strlen(tmp))
+		server_hawkbit.prefetch_speed = (unsigned int)ustrtoull(tmp, NULL, 10);
+	get_field(LIBCFG_PARSER, elem, "prefetch-next",
+		&server_hawkbit.prefetch_next);
+	get_field(LIBCFG_PARSER, elem, "bundle", &server_hawkbit.bundle);
 
 	return 0;
 
 }
 
-server_op_res_t server_start(char *fname, int argc, char *argv[])
+static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 {
 	update_state_t update_state = STATE_NOT_AVAILABLE;
 	int choice = 0;
@@ -1711,6 +2595,7 @@ server_op_res_t server_start(char *fname, int argc, char *argv[])
 	pthread_mutex_lock(&ipc_lock);
 	LIST_INIT(&server_hawkbit.configdata);
 	LIST_INIT(&server_hawkbit.httpheaders);
+	LIST_INIT(&server_hawkbit.sent_configdata);
 
 	server_hawkbit.initial_report_resend_period = INITIAL_STATUS_REPORT_WAIT_DELAY;
 	if (fname) {
@@ -1932,13 +2817,42 @@ server_op_res_t server_start(char *fname, int argc, char *argv[])
 	return SERVER_OK;
 }
 
-server_op_res_t server_stop(void)
+static server_op_res_t server_stop(void)
 {
 	(void)server_hawkbit.channel->close(server_hawkbit.channel);
 	free(server_hawkbit.channel);
+	pthread_mutex_lock(&ipc_channel_lock);
+	if (ipc_channel) {
+		(void)ipc_channel->close(ipc_channel);
+		free(ipc_channel);
+		ipc_channel = NULL;
+	}
+	pthread_mutex_unlock(&ipc_channel_lock);
 	return SERVER_OK;
 }
 
+/*
+ * Channel for the IPC requests, opened on first use.
+ * Must be called with ipc_channel_lock held.
+ */
+static channel_t *server_ipc_channel(void)
+{
+	if (ipc_channel)
+		return ipc_channel;
+
+	ipc_channel = channel_new();
+	if (!ipc_channel)
+		return NULL;
+	if (ipc_channel->open(ipc_channel, &channel_data_defaults) != CHANNEL_OK) {
+		ERROR("Cannot open channel for IPC requests");
+		(void)ipc_channel->close(ipc_channel);
+		free(ipc_channel);
+		ipc_channel = NULL;
+	}
+
+	return ipc_channel;
+}
+
 /*
  * IPC is to control the hawkBit's communication
  */
@@ -2002,32 +2916,41 @@ static server_op_res_t server_activation_ipc(ipc_message *msg)
 
 	channel_data_t channel_data = channel_data_defaults;
 	int server_action_id;
+	server_op_res_t response = SERVER_OK;
+
+	pthread_mutex_lock(&ipc_channel_lock);
+	channel_t *channel = server_ipc_channel();
+	if (!channel) {
+		pthread_mutex_unlock(&ipc_channel_lock);
+		result = SERVER_EINIT;
+		goto cleanup;
+	}
 	result =
-	    server_get_deployment_info(server_hawkbit.channel, &channel_data, &server_action_id);
+	    server_get_deployment_info(channel, &channel_data, &server_action_id);
 
         if (result != SERVER_OK && result != SERVER_UPDATE_AVAILABLE &&
             result != SERVER_NO_UPDATE_AVAILABLE &&
             result != SERVER_UPDATE_CANCELED && result != SERVER_ID_REQUESTED) {
           DEBUG("Hawkbit is not accessible, bailing out (%d)", result);
+          pthread_mutex_unlock(&ipc_channel_lock);
           result = SERVER_EERR;
           goto cleanup;
         }
 
-        server_op_res_t response = SERVER_OK;
-
 	if (result == SERVER_UPDATE_CANCELED) {
 		DEBUG("Acknowledging cancelled update.");
-		(void)server_send_cancel_reply(server_hawkbit.channel, server_action_id);
+		(void)server_send_cancel_reply(channel, server_action_id);
 	}
 
 	if (action_id != server_action_id) {
 		TRACE("Deployment changed on server: our id %d, on server %d",
 			action_id, server_action_id);
 	} else {
-		response = handle_feedback(action_id, result, update_state, reply_result,
-					   reply_execution,
+		response = handle_feedback(channel, action_id, result, update_state,
+					   reply_result, reply_execution,
 					   numdetails == 0 ? 1 : numdetails, details);
 	}
+	pthread_mutex_unlock(&ipc_channel_lock);
 	/*
 	 * Only in case of errors report respond with NAK else send ACK
 	 * It is useful when there is no deployment (deployment might be deleted)
@@ -2069,6 +2992,25 @@ static void server_set_additional_device_attributes_ipc(json_object* json_data)
 	}
 }
 
+static void server_set_download_speed_ipc(json_object *json_data)
+{
+	json_object *json_max, *json_min, *json_adaptive;
+	unsigned int max = 0, min = 0;
+
+	json_max = json_get_path_key(json_data, (const char *[]){"max", NULL});
+	json_min = json_get_path_key(json_data, (const char *[]){"min", NULL});
+	json_adaptive = json_get_path_key(json_data, (const char *[]){"adaptive", NULL});
+
+	/* values are accepted as numbers or as strings like "512k" */
+	if (json_max)
+		max = (unsigned int)ustrtoull(json_object_get_string(json_max), NULL, 10);
+	if (json_min)
+		min = (unsigned int)ustrtoull(json_object_get_string(json_min), NULL, 10);
+
+	channel_set_download_speed(max, min,
+				   json_adaptive ? json_object_get_boolean(json_adaptive) : false);
+}
+
 static server_op_res_t server_configuration_ipc(ipc_message *msg)
 {
 	struct json_object *json_root;
@@ -2100,6 +3042,12 @@ static server_op_res_t server_configuration_ipc(ipc_message *msg)
 		server_hawkbit.has_to_send_configData = true;
 	}
 
+	json_data = json_get_path_key(
+		json_root, (const char*[]){"download-speed", NULL});
+
+	if (json_data)
+		server_set_download_speed_ipc(json_data);
+
 	pthread_mutex_unlock(&ipc_lock);
 	return SERVER_OK;
 }
@@ -2122,7 +3070,7 @@ static server_op_res_t server_status_ipc(ipc_message *msg)
 	return SERVER_OK;
 }
 
-server_op_res_t server_ipc(ipc_message *msg)
+static server_op_res_t server_ipc(ipc_message *msg)
 {
 	server_op_res_t result = SERVER_OK;
 
@@ -2150,3 +3098,20 @@ server_op_res_t server_ipc(ipc_message *msg)
 
 	return SERVER_OK;
 }
+
+static server_t server = {
+	.has_pending_action = &server_has_pending_action,
+	.install_update = &server_install_update,
+	.send_target_data = &server_send_target_data,
+	.get_polling_interval = &server_get_polling_interval,
+	.start = &server_start,
+	.stop = &server_stop,
+	.ipc = &server_ipc,
+	.help = &server_print_help,
+};
+
+__attribute__((constructor))
+static void register_hawkbit_server(void)
+{
+	register_server("hawkbit", &server);
+}
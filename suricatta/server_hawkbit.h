@@ -30,7 +30,10 @@ typedef struct {
 	bool debug;
 	struct dict configdata;
 	struct dict httpheaders;
+	struct dict sent_configdata;	/* attributes known by the server */
 	bool has_to_send_configData;
+	bool send_all_configData;
+	char *configdata_cache;
 	char *configData_url;
 	char *cancel_url;
 	update_state_t update_state;
@@ -43,6 +46,11 @@ typedef struct {
 	char *targettoken;
 	char *gatewaytoken;
 	char *cached_file;
+	char *prefetch_dir;	/* artifacts downloaded ahead of the install */
+	unsigned int prefetch_speed;
+	bool prefetch_next;	/* download the next artifact during an install */
+	bool bundle;		/* install the SWUs of a deployment as one transaction */
+	int prefetched_action;	/* download already reported to the server */
 	bool usetokentodwl;
 	unsigned int initial_report_resend_period;
 	int server_status;
@@ -58,12 +66,14 @@ static const struct {
 	const char *scheduled;
 	const char *rejected;
 	const char *resumed;
+	const char *downloaded;
 } reply_status_execution = {.closed = "closed",
 			    .proceeding = "proceeding",
 			    .canceled = "canceled",
 			    .scheduled = "scheduled",
 			    .rejected = "rejected",
-			    .resumed = "resumed"};
+			    .resumed = "resumed",
+			    .downloaded = "downloaded"};
 
 static const struct {
 	const char *success;
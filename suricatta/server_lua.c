@@ -33,6 +33,8 @@
 #include <bootloader.h>
 #include <swupdate_settings.h>
 #include <swupdate_dict.h>
+#include <swupdate_membudget.h>
+#include <suricatta/server.h>
 #include "suricatta_private.h"
 
 #define CONFIG_SECTION "suricatta"
@@ -81,14 +83,14 @@ static channel_data_t channel_data_defaults = {
  * Prototypes for "public" functions implementing the server
  * interface specified in include/suricatta/server.h.
  */
-void server_print_help(void);
-unsigned int server_get_polling_interval(void);
-server_op_res_t server_has_pending_action(int *action_id);
-server_op_res_t server_start(char *fname, int argc, char *argv[]);
-server_op_res_t server_stop(void);
-server_op_res_t server_install_update(void);
-server_op_res_t server_ipc(ipc_message *msg);
-server_op_res_t server_send_target_data(void);
+static void server_print_help(void);
+static unsigned int server_get_polling_interval(void);
+static server_op_res_t server_has_pending_action(int *action_id);
+static server_op_res_t server_start(const char *fname, int argc, char *argv[]);
+static server_op_res_t server_stop(void);
+static server_op_res_t server_install_update(void);
+static server_op_res_t server_ipc(ipc_message *msg);
+static server_op_res_t server_send_target_data(void);
 
 /* Global Lua state for this Suricatta Lua module implementation. */
 static lua_State *gL = NULL;
@@ -1524,6 +1526,180 @@ static int lua_suricatta_sleep(lua_State *L)
 }
 
 
+/**
+ * @brief Lua heap accounting and garbage collector settings.
+ *
+ * The heap usage is tracked by suricatta_lua_alloc() and allocations
+ * beyond limit fail, which Lua turns into a memory error after a last
+ * emergency collection. The garbage collector settings are read from
+ * the configuration file, see suricatta_lua_settings().
+ */
+static struct {
+	size_t used;
+	size_t peak;
+	size_t limit;
+	bool accounted;
+	char gc[16];
+	int gc_pause;
+	int gc_stepmul;
+} lua_memory;
+
+
+/**
+ * @brief Lua allocator function keeping track of the heap usage.
+ *
+ * @param  ud     Unused user data.
+ * @param  ptr    Block to be reallocated or freed, NULL for a new one.
+ * @param  osize  Size of ptr, or the Lua type of the new object if ptr is NULL.
+ * @param  nsize  New size of the block, 0 to free it.
+ * @return The (re)allocated block or NULL.
+ */
+static void *suricatta_lua_alloc(void __attribute__ ((__unused__)) *ud,
+				 void *ptr, size_t osize, size_t nsize)
+{
+	void *block;
+
+	if (!ptr) {
+		osize = 0;
+	}
+	if (nsize == 0) {
+		free(ptr);
+		lua_memory.used -= osize;
+		membudget_release(osize);
+		return NULL;
+	}
+	if (lua_memory.limit && nsize > osize &&
+	    lua_memory.used - osize + nsize > lua_memory.limit) {
+		return NULL;
+	}
+	if (nsize > osize && !membudget_reserve(nsize - osize)) {
+		return NULL;
+	}
+	if (!(block = realloc(ptr, nsize))) {
+		if (nsize > osize) {
+			membudget_release(nsize - osize);
+		}
+		return NULL;
+	}
+	if (nsize < osize) {
+		membudget_release(osize - nsize);
+	}
+	lua_memory.used = lua_memory.used - osize + nsize;
+	if (lua_memory.used > lua_memory.peak) {
+		lua_memory.peak = lua_memory.used;
+	}
+	return block;
+}
+
+
+/**
+ * @brief Panic function for Lua errors outside of a protected call.
+ *
+ * @param  L  The Lua state.
+ * @return 0
+ */
+static int suricatta_lua_panic(lua_State *L)
+{
+	ERROR("[Lua suricatta] Unprotected Lua error: %s", lua_tostring(L, -1));
+	return 0;
+}
+
+
+/**
+ * @brief Push a Table with the Lua heap usage onto the Lua stack.
+ *
+ * Sizes are in bytes, limit is 0 if there is none. Without the accounting
+ * allocator, only the current usage as known to Lua is available.
+ *
+ * @param  L  The Lua state.
+ */
+static void push_lua_memory(lua_State *L)
+{
+	long used = lua_memory.used;
+
+	if (!lua_memory.accounted) {
+		used = (long)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+		       lua_gc(L, LUA_GCCOUNTB, 0);
+	}
+	lua_newtable(L);
+	push_to_table(L, "used",  used);
+	push_to_table(L, "peak",  (long)lua_memory.peak);
+	push_to_table(L, "limit", (long)lua_memory.limit);
+	push_to_table(L, "accounted", lua_memory.accounted);
+}
+
+
+/**
+ * @brief Get the Lua heap usage.
+ *
+ * @param  L  The Lua state.
+ * @return 1, the Table as pushed by push_lua_memory().
+ */
+static int lua_suricatta_memory(lua_State *L)
+{
+	push_lua_memory(L);
+	return 1;
+}
+
+
+/**
+ * @brief Read the Lua heap and garbage collector settings.
+ *
+ * @param  elem  Pointer to configuration section.
+ * @param  data  Unused.
+ * @return 0
+ */
+static int suricatta_lua_settings(void *elem, void __attribute__ ((__unused__)) *data)
+{
+	int limit = 0;
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "lua-gc", lua_memory.gc);
+	get_field(LIBCFG_PARSER, elem, "lua-gc-pause", &lua_memory.gc_pause);
+	get_field(LIBCFG_PARSER, elem, "lua-gc-stepmul", &lua_memory.gc_stepmul);
+	get_field(LIBCFG_PARSER, elem, "lua-memory-limit", &limit);
+	if (limit > 0) {
+		lua_memory.limit = (size_t)limit * 1024;
+		if (!lua_memory.accounted) {
+			WARN("[Lua suricatta] No Lua heap accounting, lua-memory-limit ignored.");
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Apply the garbage collector settings to the Lua state.
+ *
+ * @param  L  The Lua state.
+ */
+static void suricatta_lua_gc_apply(lua_State *L)
+{
+	if (!strcmp(lua_memory.gc, "generational")) {
+#if LUA_VERSION_NUM >= 504
+		(void)lua_gc(L, LUA_GCGEN, 0, 0);
+		TRACE("[Lua suricatta] Generational garbage collector enabled.");
+#else
+		WARN("[Lua suricatta] " LUA_VERSION " has no generational garbage collector.");
+#endif
+		return;
+	}
+	if (strlen(lua_memory.gc) && strcmp(lua_memory.gc, "incremental")) {
+		WARN("[Lua suricatta] Unknown lua-gc mode \"%s\" ignored.", lua_memory.gc);
+	}
+#if LUA_VERSION_NUM >= 504
+	(void)lua_gc(L, LUA_GCINC, lua_memory.gc_pause, lua_memory.gc_stepmul, 0);
+#else
+	if (lua_memory.gc_pause > 0) {
+		(void)lua_gc(L, LUA_GCSETPAUSE, lua_memory.gc_pause);
+	}
+	if (lua_memory.gc_stepmul > 0) {
+		(void)lua_gc(L, LUA_GCSETSTEPMUL, lua_memory.gc_stepmul);
+	}
+#endif
+}
+
+
 /**
  * @brief Register the 'suricatta' module to Lua.
  *
@@ -1543,6 +1719,7 @@ static int suricatta_lua_module(lua_State *L)
 		{ "download",   lua_suricatta_download   },
 		{ "get_tmpdir", lua_suricatta_get_tmpdir },
 		{ "getversion", lua_get_swupdate_version },
+		{ "memory",     lua_suricatta_memory     },
 		{ NULL, NULL }
 	};
 	luaL_setfuncs(L, lua_funcs_suricatta, 0);
@@ -1722,7 +1899,14 @@ static server_op_res_t suricatta_lua_create(void)
 		TRACE("[Lua suricatta] Lua state already initialized.");
 		return SERVER_OK;
 	}
-	if (!(gL = luaL_newstate())) {
+	lua_memory.used = 0;
+	lua_memory.peak = 0;
+	lua_memory.accounted = false;
+	if ((gL = lua_newstate(suricatta_lua_alloc, NULL))) {
+		lua_memory.accounted = true;
+		lua_atpanic(gL, suricatta_lua_panic);
+	} else if (!(gL = luaL_newstate())) {
+		/* E.g., LuaJIT on 64 bit does not support custom allocators. */
 		ERROR("Unable to register Suricatta Lua module.");
 		return SERVER_EINIT;
 	}
@@ -1827,7 +2011,7 @@ static int config_section_to_table(void *setting, void *data)
  * @param  argv   The array of arguments.
  * @return SERVER_OK, or, in case of errors, SERVER_EINIT or SERVER_EERR.
  */
-server_op_res_t server_start(char *fname, int argc, char *argv[])
+static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 {
 	if (suricatta_lua_create() != SERVER_OK) {
 		suricatta_lua_destroy();
@@ -1861,9 +2045,12 @@ server_op_res_t server_start(char *fname, int argc, char *argv[])
 				ERROR("Error reading module settings \"%s\" from %s",
 				      CONFIG_SECTION, fname);
 			}
+			(void)read_module_settings(&handle, CONFIG_SECTION,
+						   suricatta_lua_settings, NULL);
 		}
 		swupdate_cfg_destroy(&handle);
 	}
+	suricatta_lua_gc_apply(gL);
 	return map_lua_result(call_lua_func(gL, SURICATTA_FUNC_SERVER_START, 3));
 }
 
@@ -1873,7 +2060,7 @@ server_op_res_t server_start(char *fname, int argc, char *argv[])
  *
  * @return SERVER_OK or, in case of errors, any other from server_op_res_t.
  */
-server_op_res_t server_stop(void)
+static server_op_res_t server_stop(void)
 {
 	server_op_res_t result = map_lua_result(
 	    call_lua_func(gL, SURICATTA_FUNC_SERVER_STOP, 0));
@@ -1885,7 +2072,7 @@ server_op_res_t server_stop(void)
 /**
  * @brief Print the Suricatta Lua module's help text.
  */
-void server_print_help(void)
+static void server_print_help(void)
 {
 	if (suricatta_lua_create() != SERVER_OK) {
 		fprintf(stderr, "Error loading Suricatta Lua module.\n");
@@ -1908,7 +2095,7 @@ void server_print_help(void)
  *
  * @return Polling interval in seconds.
  */
-unsigned int server_get_polling_interval(void)
+static unsigned int server_get_polling_interval(void)
 {
 	int result = call_lua_func(gL, SURICATTA_FUNC_GET_POLLING_INTERVAL, 0);
 	return result >= 0 ? (unsigned int)result : CHANNEL_DEFAULT_POLLING_INTERVAL;
@@ -1923,7 +2110,7 @@ unsigned int server_get_polling_interval(void)
  *         in suricatta/suricatta.c, the others result in suricatta
  *         sleeping again.
  */
-server_op_res_t server_has_pending_action(int *action_id)
+static server_op_res_t server_has_pending_action(int *action_id)
 {
 	lua_pushnumber(gL, *action_id);
 	server_op_res_t result = map_lua_result(
@@ -1945,7 +2132,7 @@ server_op_res_t server_has_pending_action(int *action_id)
  *
  * @return SERVER_OK or, in case of errors, any other from server_op_res_t.
  */
-server_op_res_t server_install_update(void)
+static server_op_res_t server_install_update(void)
 {
 	return map_lua_result(call_lua_func(gL, SURICATTA_FUNC_INSTALL_UPDATE, 0));
 }
@@ -1956,7 +2143,7 @@ server_op_res_t server_install_update(void)
  *
  * @return SERVER_OK or, in case of errors, any other from server_op_res_t.
  */
-server_op_res_t server_send_target_data(void)
+static server_op_res_t server_send_target_data(void)
 {
 	return map_lua_result(call_lua_func(gL, SURICATTA_FUNC_SEND_TARGET_DATA, 0));
 }
@@ -1968,7 +2155,7 @@ server_op_res_t server_send_target_data(void)
  * @param  msg  IPC message.
  * @return SERVER_OK or, in case of errors, any other from server_op_res_t.
  */
-server_op_res_t server_ipc(ipc_message *msg)
+static server_op_res_t server_ipc(ipc_message *msg)
 {
 	lua_newtable(gL);
 	push_to_table(gL, "magic",      msg->magic);
@@ -1983,6 +2170,9 @@ server_op_res_t server_ipc(ipc_message *msg)
 	lua_pushstring(gL, "msg");
 	lua_pushlstring(gL, (char *)msg->data.procmsg.buf, msg->data.procmsg.len);
 	lua_settable(gL, -3);
+	lua_pushstring(gL, "memory");
+	push_lua_memory(gL);
+	lua_settable(gL, -3);
 	#ifdef CONFIG_JSON
 	if (msg->data.procmsg.len > 0) {
 		lua_pushstring(gL, "json");
@@ -2014,3 +2204,20 @@ server_op_res_t server_ipc(ipc_message *msg)
 	}
 	return result;
 }
+
+static server_t server = {
+	.has_pending_action = &server_has_pending_action,
+	.install_update = &server_install_update,
+	.send_target_data = &server_send_target_data,
+	.get_polling_interval = &server_get_polling_interval,
+	.start = &server_start,
+	.stop = &server_stop,
+	.ipc = &server_ipc,
+	.help = &server_print_help,
+};
+
+__attribute__((constructor))
+static void register_lua_server(void)
+{
+	register_server("lua", &server);
+}
@@ -6,6 +6,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -15,6 +16,7 @@
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
+#include <sys/random.h>
 #include <getopt.h>
 #include <json-c/json.h>
 #include "pctl.h"
@@ -23,16 +25,126 @@
 #include "suricatta_private.h"
 #include "parselib.h"
 #include "swupdate_settings.h"
+#include "channel.h"
+#include "channel_curl.h"
 #include <network_ipc.h>
 
+#define PUSH_RETRY_MIN 5
+#define PUSH_RETRY_MAX 300
+#define MAX_SERVERS 4
+#define BACKOFF_SHIFT_MAX 16
+
 static bool enable = true;
 static bool trigger = false;
+
+/*
+ * Servers built in register themselves at startup, the ones listed
+ * in "server" run in this process, sorted by priority: the first one
+ * is the primary server.
+ */
+struct server_instance {
+	const char *name;
+	server_t *ops;
+	time_t last_poll;
+	bool polled;		/* in the current round */
+	unsigned int errors;	/* polls failed in a row */
+	int jitter;		/* percent, drawn at each poll */
+	unsigned int retry_after;	/* asked by the server */
+};
+static struct server_instance servers[MAX_SERVERS];
+static unsigned int nservers;
+static struct server_instance *active[MAX_SERVERS];
+static unsigned int nactive;
+static char server_names[SWUPDATE_GENERAL_STRING_SIZE];
+
+/*
+ * Spread the polls of many devices: each interval is changed by a
+ * random amount within polling-jitter percent, and it is doubled
+ * after each failed poll up to backoff-max seconds.
+ */
+static unsigned int polling_jitter;
+static unsigned int backoff_max;
+
+/*
+ * Push channel: a long-poll request to push-url is kept open and
+ * answered by the server when an action is pending. While it is
+ * connected, the server is polled every push-polldelay seconds
+ * only; if it is down, the usual polling interval is used.
+ */
+static channel_data_t push_channel_data = {
+	.retries = 0,
+	.method = CHANNEL_GET,
+	.format = CHANNEL_PARSE_NONE,
+	.nocheckanswer = true,
+};
+static unsigned int push_polldelay;
+static volatile bool push_connected;
 static struct option long_options[] = {
     {"enable", no_argument, NULL, 'e'},
     {"disable", no_argument, NULL, 'd'},
+    {"server", required_argument, NULL, 'S'},
     {NULL, 0, NULL, 0}};
 static sem_t suricatta_enable_sema;
 
+bool register_server(const char *name, server_t *server)
+{
+	if (nservers >= MAX_SERVERS)
+		return false;
+	servers[nservers].name = name;
+	servers[nservers].ops = server;
+	nservers++;
+
+	return true;
+}
+
+static struct server_instance *lookup_server(const char *name)
+{
+	for (unsigned int i = 0; i < nservers; i++) {
+		if (!strcmp(servers[i].name, name))
+			return &servers[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * names is a list separated by spaces or commas, in order of priority.
+ * Without a list, the only server built in is used.
+ */
+static int select_servers(char *names)
+{
+	struct server_instance *srv;
+	char *name, *saveptr;
+
+	if (!strlen(names)) {
+		if (nservers != 1) {
+			ERROR("%s, select one with -S or \"server\"",
+			      nservers ? "Several servers are built in" : "No server built in");
+			return -EINVAL;
+		}
+		active[nactive++] = &servers[0];
+		return 0;
+	}
+
+	for (name = strtok_r(names, " ,", &saveptr); name;
+	     name = strtok_r(NULL, " ,", &saveptr)) {
+		srv = lookup_server(name);
+		if (!srv) {
+			ERROR("Server \"%s\" is not built in", name);
+			return -EINVAL;
+		}
+		for (unsigned int i = 0; i < nactive; i++) {
+			if (active[i] == srv) {
+				ERROR("Server \"%s\" is selected twice", name);
+				return -EINVAL;
+			}
+		}
+		active[nactive++] = srv;
+	}
+
+	return 0;
+}
+
 void suricatta_print_help(void)
 {
 	fprintf(
@@ -40,8 +152,13 @@ void suricatta_print_help(void)
 	    "\tsuricatta arguments (mandatory arguments are marked with '*'):\n"
 	    "\t  -e, --enable      Daemon enabled at startup (default).\n"
 	    "\t  -d, --disable     Daemon disabled at startup.\n"
+	    "\t  -S, --server      Servers to run, by priority (e.g. \"hawkbit,general\").\n"
 	    );
-	server.help();
+	for (unsigned int i = 0; i < nservers; i++) {
+		if (nservers > 1)
+			fprintf(stdout, "\t%s server:\n", servers[i].name);
+		servers[i].ops->help();
+	}
 }
 
 static server_op_res_t suricatta_enable(ipc_message *msg)
@@ -103,7 +220,12 @@ static server_op_res_t suricatta_ipc(int fd)
 		result = suricatta_enable(&msg);
 		break;
 	default:
-		result = server.ipc(&msg);
+		/* the first server, by priority, that handles it answers */
+		for (unsigned int i = 0; i < nactive; i++) {
+			result = active[i]->ops->ipc(&msg);
+			if (result == SERVER_OK)
+				break;
+		}
 		break;
 	}
 
@@ -117,12 +239,205 @@ static server_op_res_t suricatta_ipc(int fd)
 
 static int suricatta_settings(void *elem, void  __attribute__ ((__unused__)) *data)
 {
+	char tmp[128];
+
 	get_field(LIBCFG_PARSER, elem, "enable",
 		&enable);
 
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "push-url", tmp);
+	if (strlen(tmp)) {
+		SETSTRING(push_channel_data.url, tmp);
+		suricatta_channel_settings(elem, &push_channel_data);
+	}
+	get_field(LIBCFG_PARSER, elem, "push-polldelay",
+		&push_polldelay);
+	GET_FIELD_STRING(LIBCFG_PARSER, elem, "server", server_names);
+	get_field(LIBCFG_PARSER, elem, "polling-jitter", &polling_jitter);
+	if (polling_jitter > 100)
+		polling_jitter = 100;
+	get_field(LIBCFG_PARSER, elem, "backoff-max", &backoff_max);
+
 	return 0;
 }
 
+static void *push_thread(void __attribute__ ((__unused__)) *data)
+{
+	channel_t *channel;
+	unsigned int retry = PUSH_RETRY_MIN;
+	channel_op_res_t result;
+
+	channel = channel_new();
+	if (!channel || channel->open(channel, &push_channel_data) != CHANNEL_OK) {
+		ERROR("Push channel cannot be opened, polling only");
+		return NULL;
+	}
+
+	while (1) {
+		push_channel_data.http_response_code = 0;
+		result = channel->get(channel, &push_channel_data);
+		if (result == CHANNEL_OK) {
+			if (!push_connected)
+				TRACE("Push channel to %s connected", push_channel_data.url);
+			push_connected = true;
+			retry = PUSH_RETRY_MIN;
+			/* 204 means timeout of the long-poll, just ask again */
+			if (push_channel_data.http_response_code != 200)
+				continue;
+			TRACE("Server pushed a pending action");
+			trigger = true;
+			if (sem_post(&suricatta_enable_sema))
+				ERROR("sem_post trigger failled");
+			continue;
+		}
+
+		if (push_connected)
+			WARN("Push channel is down, polling every %u seconds",
+			     active[0]->ops->get_polling_interval());
+		push_connected = false;
+		sleep(retry);
+		retry = min(retry * 2, PUSH_RETRY_MAX);
+	}
+
+	return NULL;
+}
+
+static unsigned int suricatta_polling_interval(struct server_instance *srv)
+{
+	unsigned long long interval = srv->ops->get_polling_interval();
+
+	if (push_connected && push_polldelay > interval)
+		interval = push_polldelay;
+
+	if (srv->errors && backoff_max > interval) {
+		unsigned int shift = srv->errors;
+
+		if (shift > BACKOFF_SHIFT_MAX)
+			shift = BACKOFF_SHIFT_MAX;
+		interval <<= shift;
+		if (interval > backoff_max)
+			interval = backoff_max;
+	}
+
+	interval = interval * (100 + srv->jitter) / 100;
+
+	if (srv->retry_after > interval)
+		interval = srv->retry_after;
+
+	return (unsigned int)interval;
+}
+
+static server_op_res_t suricatta_poll_server(struct server_instance *srv,
+					     time_t now, int *action_id)
+{
+	server_op_res_t result;
+
+	(void)channel_retry_after();
+	srv->last_poll = now;
+	srv->polled = true;
+	result = srv->ops->has_pending_action(action_id);
+
+	switch (result) {
+	case SERVER_EERR:
+	case SERVER_EBADMSG:
+	case SERVER_EACCES:
+	case SERVER_EAGAIN:
+		srv->errors++;
+		break;
+	default:
+		srv->errors = 0;
+		break;
+	}
+	srv->retry_after = channel_retry_after();
+	if (polling_jitter)
+		srv->jitter = (int)(random() % (2 * polling_jitter + 1)) - (int)polling_jitter;
+	if (srv->errors && (backoff_max || srv->retry_after))
+		DEBUG("%s failed %u times, next poll in %u seconds", srv->name,
+		      srv->errors, suricatta_polling_interval(srv));
+
+	return result;
+}
+
+static time_t monotonic_seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* Seconds until one of the servers has to be polled */
+static int suricatta_next_poll(void)
+{
+	time_t now = monotonic_seconds();
+	time_t next = -1;
+
+	for (unsigned int i = 0; i < nactive; i++) {
+		time_t t = active[i]->last_poll + suricatta_polling_interval(active[i]);
+
+		if (!active[i]->last_poll)
+			return 0;
+
+		if (next < 0 || t < next)
+			next = t;
+	}
+
+	return next > now ? (int)(next - now) : 0;
+}
+
+/*
+ * Poll the servers that are due, or all of them if forced.
+ * If several servers have an update at the same time, the one
+ * with the highest priority wins: before installing the update
+ * of a server, the ones with higher priority that were not polled
+ * in this round are asked too. The others are asked again in the
+ * next round, that is after the installation.
+ */
+static void suricatta_poll_servers(bool forced)
+{
+	struct server_instance *srv;
+	time_t now = monotonic_seconds();
+	int action_id;
+
+	for (unsigned int i = 0; i < nactive; i++)
+		active[i]->polled = false;
+
+	for (unsigned int i = 0; i < nactive; i++) {
+		srv = active[i];
+		if (!forced && srv->last_poll &&
+		    now - srv->last_poll < (time_t)suricatta_polling_interval(srv))
+			continue;
+
+		switch (suricatta_poll_server(srv, now, &action_id)) {
+		case SERVER_UPDATE_AVAILABLE:
+			for (unsigned int j = 0; j < i; j++) {
+				if (active[j]->polled)
+					continue;
+				if (suricatta_poll_server(active[j], now, &action_id) ==
+				    SERVER_UPDATE_AVAILABLE) {
+					DEBUG("Update of %s has priority over %s",
+					      active[j]->name, srv->name);
+					srv = active[j];
+					break;
+				}
+			}
+			DEBUG("About to process available update from %s.", srv->name);
+			srv->ops->install_update();
+			return;
+		case SERVER_ID_REQUESTED:
+			srv->ops->send_target_data();
+			/* ask it again at once */
+			srv->last_poll = 0;
+			break;
+		case SERVER_EINIT:
+			break;
+		case SERVER_OK:
+		default:
+			DEBUG("No pending action to process on %s.", srv->name);
+			break;
+		}
+	}
+}
+
 int suricatta_wait(int seconds)
 {
 	struct timespec tp;
@@ -163,23 +478,24 @@ int suricatta_wait(int seconds)
 	return 0;
 }
 
-static void *ipc_thread(void __attribute__ ((__unused__)) *data)
+static void *ipc_thread(void *data)
 {
+	int sockfd = (int)(intptr_t)data;
 	fd_set readfds;
 	int retval;
 
 	while (1) {
 		FD_ZERO(&readfds);
-		FD_SET(sw_sockfd, &readfds);
-		retval = select(sw_sockfd + 1, &readfds, NULL, NULL, NULL);
+		FD_SET(sockfd, &readfds);
+		retval = select(sockfd + 1, &readfds, NULL, NULL, NULL);
 
 		if (retval < 0) {
 			TRACE("Suricatta IPC awakened because of: %s", strerror(errno));
 			return 0;
 		}
 
-		if (retval && FD_ISSET(sw_sockfd, &readfds)) {
-			if (suricatta_ipc(sw_sockfd) != SERVER_OK) {
+		if (retval && FD_ISSET(sockfd, &readfds)) {
+			if (suricatta_ipc(sockfd) != SERVER_OK) {
 				DEBUG("Handling IPC failed!");
 			}
 		}
@@ -188,11 +504,13 @@ static void *ipc_thread(void __attribute__ ((__unused__)) *data)
 
 int start_suricatta(const char *cfgfname, int argc, char *argv[])
 {
-	int action_id;
+	bool was_enabled = true;
+	unsigned int seed;
 	sigset_t sigpipe_mask;
 	sigset_t saved_mask;
 	int choice = 0;
 	char **serverargv;
+	int serverargc = 0;
 
 	sigemptyset(&sigpipe_mask);
 	sigaddset(&sigpipe_mask, SIGPIPE);
@@ -209,7 +527,14 @@ int start_suricatta(const char *cfgfname, int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 	for (int i = 0; i < argc; i++) {
-		serverargv[i] = argv[i];
+		/* the servers do not know -S, drop it */
+		if (i && (!strcmp(argv[i], "-S") || !strcmp(argv[i], "--server"))) {
+			i++;
+			continue;
+		}
+		if (i && (!strncmp(argv[i], "-S", 2) || !strncmp(argv[i], "--server=", 9)))
+			continue;
+		serverargv[serverargc++] = argv[i];
 	}
 
 	/*
@@ -227,7 +552,7 @@ int start_suricatta(const char *cfgfname, int argc, char *argv[])
 	optind = 1;
 	opterr = 0;
 
-	while ((choice = getopt_long(argc, argv, "de",
+	while ((choice = getopt_long(argc, argv, "deS:",
 				     long_options, NULL)) != -1) {
 		switch (choice) {
 		case 'e':
@@ -236,11 +561,25 @@ int start_suricatta(const char *cfgfname, int argc, char *argv[])
 		case 'd':
 			enable = false;
 			break;
+		case 'S':
+			strlcpy(server_names, optarg, sizeof(server_names));
+			break;
 		case '?':
 			break;
 		}
 	}
 
+	/*
+	 * The servers parse the arguments again in their start(),
+	 * suricatta is the last subprocess with a command line
+	 */
+	subprocess_ready();
+
+	/* a seed that differs between devices booted at the same time */
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+		seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	srandom(seed);
+
 	if (sem_init(&suricatta_enable_sema, 0, 0)) {
 		ERROR("Initialising suricatta enable semaphore failed");
 		exit(EXIT_FAILURE);
@@ -249,41 +588,47 @@ int start_suricatta(const char *cfgfname, int argc, char *argv[])
 	/*
 	 * Start ipc thread here, because the following server.start might block
 	 */
-	start_thread(ipc_thread, NULL);
+	start_thread(ipc_thread, (void *)(intptr_t)sw_sockfd);
+
+	if (select_servers(server_names))
+		exit(EXIT_FAILURE);
 
 	/*
-	 * Now start a specific implementation of the server
+	 * Now start the implementations of the servers. They share the
+	 * channel_curl connection cache, so connections are reused.
 	 */
-	if (server.start(cfgfname, argc, serverargv) != SERVER_OK) {
-		exit(EXIT_FAILURE);
+	for (unsigned int i = 0; i < nactive; i++) {
+		if (active[i]->ops->start(cfgfname, serverargc, serverargv) != SERVER_OK) {
+			ERROR("Server %s cannot be started", active[i]->name);
+			exit(EXIT_FAILURE);
+		}
+		if (nactive > 1)
+			INFO("Server %s started, priority %u", active[i]->name, i + 1);
 	}
 	free(serverargv);
 
+	if (push_channel_data.url)
+		start_thread(push_thread, NULL);
+
 	TRACE("Server initialized, entering suricatta main loop.");
 	while (true) {
 		if (enable || trigger) {
+			/* enable works as trigger, too */
+			bool forced = trigger || !was_enabled;
+
 			trigger = false;
-			switch (server.has_pending_action(&action_id)) {
-			case SERVER_UPDATE_AVAILABLE:
-				DEBUG("About to process available update.");
-				server.install_update();
-				break;
-			case SERVER_ID_REQUESTED:
-				server.send_target_data();
-				trigger = true;
-				break;
-			case SERVER_EINIT:
-				break;
-			case SERVER_OK:
-			default:
-				DEBUG("No pending action to process.");
-				break;
-			}
+			was_enabled = enable;
+			suricatta_poll_servers(forced);
+		} else {
+			was_enabled = false;
+			/* disabled, wait a polling interval */
+			for (unsigned int i = 0; i < nactive; i++)
+				active[i]->last_poll = monotonic_seconds();
 		}
 
-		for (int wait_seconds = server.get_polling_interval();
+		for (int wait_seconds = suricatta_next_poll();
 			 wait_seconds > 0;
-			 wait_seconds = min(wait_seconds, (int)server.get_polling_interval())) {
+			 wait_seconds = min(wait_seconds, suricatta_next_poll())) {
 			wait_seconds = suricatta_wait(wait_seconds);
 		}
 
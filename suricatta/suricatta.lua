@@ -386,4 +386,17 @@ suricatta.get_tmpdir = function() end
 suricatta.getversion = function() end
 
 
+--- Lua heap usage.
+--- @class suricatta.memory
+--- @field used       number   Bytes in use
+--- @field peak       number   Maximum bytes in use so far
+--- @field limit      number   Heap limit in bytes, 0 if none
+--- @field accounted  boolean  false if only `used` is known
+
+--- Get the Lua heap usage.
+--
+--- @return suricatta.memory
+suricatta.memory = function() end
+
+
 return suricatta
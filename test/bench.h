@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Helpers for the micro-benchmarks built by "make bench".
+ *
+ * Each benchmark prints a single line of key=value pairs:
+ *
+ *	bench=copybuffer/zlib iterations=64 ns_per_op=2811345 mb_per_s=1492.01
+ *
+ * mb_per_s is only printed if an operation processes a known number
+ * of bytes. A benchmark runs for about SWUPDATE_BENCH_MS milliseconds
+ * (200 by default).
+ */
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef int (*bench_fn)(void *ctx);
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Run fn until the time budget is spent, the number of iterations
+ * is doubled so that the clock is read only a few times.
+ * Returns the number of failed benchmarks (0 or 1).
+ */
+static inline int bench_run(const char *name, bench_fn fn, void *ctx, size_t bytes)
+{
+	const char *env = getenv("SWUPDATE_BENCH_MS");
+	uint64_t budget = (env ? strtoull(env, NULL, 10) : 200) * 1000000ULL;
+	uint64_t iterations = 0, n = 1, start, elapsed = 0;
+	double ns;
+
+	/* warm up caches and lazy initialization */
+	if (fn(ctx)) {
+		printf("bench=%s error=1\n", name);
+		return 1;
+	}
+	start = bench_now();
+	while (elapsed < budget) {
+		for (uint64_t i = 0; i < n; i++) {
+			if (fn(ctx)) {
+				printf("bench=%s error=1\n", name);
+				return 1;
+			}
+		}
+		iterations += n;
+		elapsed = bench_now() - start;
+		if (n < (1ULL << 20))
+			n *= 2;
+	}
+
+	ns = (double)elapsed / iterations;
+	printf("bench=%s iterations=%llu ns_per_op=%.0f", name,
+	       (unsigned long long)iterations, ns);
+	if (bytes)
+		printf(" mb_per_s=%.2f", bytes * 1e3 / ns);
+	printf("\n");
+	fflush(stdout);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,302 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Micro-benchmarks of the copy pipeline: copybuffer() with each
+ * compression and encryption supported by the build, with and without
+ * verification of the hash, for a large artifact and for a chunk of a
+ * delta update, and hashing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "swupdate.h"
+#include "util.h"
+#include "sslapi.h"
+#include "bench.h"
+#ifdef CONFIG_GUNZIP
+#include <zlib.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef CONFIG_XZ
+#include <lzma.h>
+#endif
+#if defined(CONFIG_ENCRYPTED_IMAGES) && defined(CONFIG_SSL_IMPL_OPENSSL) && \
+	!defined(CONFIG_PKCS11)
+#include <openssl/evp.h>
+#define BENCH_ENCRYPTION
+#endif
+
+#define DATALEN		(4 * 1024 * 1024)
+#define CHUNKLEN	(64 * 1024)
+#define KEY		"69d54287f856d30b51b812fdf714556778e3ec6d386e8a5b1ec6e5a33b3c0171"
+#define IVT		"e8e8d5d8d2d4c9e2d5dfd1e5c8d6e2d5"
+
+struct copy_bench {
+	unsigned char *in;
+	size_t len;
+	int compressed;
+	int encrypted;
+	unsigned char *hash;	/* of the input, if it is verified */
+	unsigned char digest[SHA256_HASH_LENGTH];
+};
+
+static unsigned char *plain;
+
+/* text-like data, so that the compressors have some work */
+static void fill_data(unsigned char *buf, size_t len)
+{
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (rand() % 8) ? 'a' + rand() % 16 : ' ';
+}
+
+static int discard(void *out, const void *buf, size_t len)
+{
+	(void)out;
+	(void)buf;
+	(void)len;
+	return 0;
+}
+
+static int run_copybuffer(void *ctx)
+{
+	struct copy_bench *b = ctx;
+
+	return copybuffer(b->in, NULL, b->len, b->compressed, b->hash,
+			  b->encrypted, IVT, discard);
+}
+
+#ifdef CONFIG_HASH_VERIFY
+static int hash_data(const unsigned char *buf, size_t len, unsigned char *digest)
+{
+	void *dgst = swupdate_HASH_init(SHA_DEFAULT);
+	unsigned int mdlen;
+	int ret;
+
+	if (!dgst)
+		return -1;
+	ret = swupdate_HASH_update(dgst, buf, len) < 0 ||
+		swupdate_HASH_final(dgst, digest, &mdlen) < 0;
+	swupdate_HASH_cleanup(dgst);
+
+	return ret;
+}
+
+static int run_hash(void *ctx)
+{
+	unsigned char digest[64];
+
+	return hash_data(ctx, DATALEN, digest);
+}
+#endif
+
+static unsigned char *compress_data(int type, size_t datalen, size_t *len)
+{
+	unsigned char *out = NULL;
+
+	switch (type) {
+	case COMPRESSED_FALSE:
+		out = malloc(datalen);
+		if (out) {
+			memcpy(out, plain, datalen);
+			*len = datalen;
+		}
+		break;
+#ifdef CONFIG_GUNZIP
+	case COMPRESSED_ZLIB: {
+		z_stream strm = { 0 };
+
+		out = malloc(compressBound(datalen) + 64);
+		if (!out || deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			break;
+		strm.next_in = plain;
+		strm.avail_in = datalen;
+		strm.next_out = out;
+		strm.avail_out = compressBound(datalen) + 64;
+		if (deflate(&strm, Z_FINISH) == Z_STREAM_END)
+			*len = strm.total_out;
+		deflateEnd(&strm);
+		break;
+	}
+#endif
+#ifdef CONFIG_ZSTD
+	case COMPRESSED_ZSTD:
+		out = malloc(ZSTD_compressBound(datalen));
+		if (out) {
+			size_t n = ZSTD_compress(out, ZSTD_compressBound(datalen),
+						 plain, datalen, 3);
+			if (!ZSTD_isError(n))
+				*len = n;
+		}
+		break;
+#endif
+#ifdef CONFIG_LZ4
+	case COMPRESSED_LZ4:
+		out = malloc(LZ4F_compressFrameBound(datalen, NULL));
+		if (out) {
+			size_t n = LZ4F_compressFrame(out, LZ4F_compressFrameBound(datalen, NULL),
+						      plain, datalen, NULL);
+			if (!LZ4F_isError(n))
+				*len = n;
+		}
+		break;
+#endif
+#ifdef CONFIG_XZ
+	case COMPRESSED_XZ: {
+		size_t pos = 0, size = lzma_stream_buffer_bound(datalen);
+
+		out = malloc(size);
+		if (out && lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL, plain,
+						   datalen, out, &pos, size) == LZMA_OK)
+			*len = pos;
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+
+	return out;
+}
+
+#ifdef BENCH_ENCRYPTION
+static unsigned char *encrypt_data(unsigned char *in, size_t *len)
+{
+	unsigned char key[32], ivt[16];
+	unsigned char *out = malloc(*len + EVP_MAX_BLOCK_LENGTH);
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int n, fin;
+
+	ascii_to_bin(key, sizeof(key), KEY);
+	ascii_to_bin(ivt, sizeof(ivt), IVT);
+	if (!out || !ctx ||
+	    EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, ivt) != 1 ||
+	    EVP_EncryptUpdate(ctx, out, &n, in, *len) != 1 ||
+	    EVP_EncryptFinal_ex(ctx, out + n, &fin) != 1) {
+		free(out);
+		out = NULL;
+	} else
+		*len = n + fin;
+	EVP_CIPHER_CTX_free(ctx);
+
+	return out;
+}
+#endif
+
+static int bench_copy(const char *name, int compressed, int encrypted,
+		      bool hashed, size_t datalen)
+{
+	struct copy_bench b = {
+		.compressed = compressed,
+		.encrypted = encrypted
+	};
+	char label[64];
+	int ret;
+
+	snprintf(label, sizeof(label), "copybuffer/%s%s%s%s", name,
+		 encrypted ? "+aes" : "", hashed ? "+" SHA_DEFAULT : "",
+		 datalen == DATALEN ? "" : "/64k");
+	b.in = compress_data(compressed, datalen, &b.len);
+	if (!b.in || !b.len) {
+		printf("bench=%s error=1\n", label);
+		free(b.in);
+		return 1;
+	}
+#ifdef BENCH_ENCRYPTION
+	if (encrypted) {
+		unsigned char *enc = encrypt_data(b.in, &b.len);
+
+		free(b.in);
+		b.in = enc;
+		if (!b.in) {
+			printf("bench=%s error=1\n", label);
+			return 1;
+		}
+	}
+#endif
+#ifdef CONFIG_HASH_VERIFY
+	if (hashed) {
+		if (hash_data(b.in, b.len, b.digest)) {
+			printf("bench=%s error=1\n", label);
+			free(b.in);
+			return 1;
+		}
+		b.hash = b.digest;
+	}
+#endif
+	/* throughput of the uncompressed data */
+	ret = bench_run(label, run_copybuffer, &b, datalen);
+	free(b.in);
+
+	return ret;
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		int type;
+	} compressors[] = {
+		{ "none", COMPRESSED_FALSE },
+#ifdef CONFIG_GUNZIP
+		{ "zlib", COMPRESSED_ZLIB },
+#endif
+#ifdef CONFIG_ZSTD
+		{ "zstd", COMPRESSED_ZSTD },
+#endif
+#ifdef CONFIG_LZ4
+		{ "lz4", COMPRESSED_LZ4 },
+#endif
+#ifdef CONFIG_XZ
+		{ "xz", COMPRESSED_XZ },
+#endif
+	};
+	int errors = 0;
+
+	loglevel = ERRORLEVEL;
+	plain = malloc(DATALEN);
+	if (!plain)
+		return 1;
+	fill_data(plain, DATALEN);
+
+#ifdef BENCH_ENCRYPTION
+	if (set_aes_key(KEY, IVT)) {
+		fprintf(stderr, "AES key cannot be set\n");
+		return 1;
+	}
+#endif
+	for (unsigned int i = 0; i < sizeof(compressors) / sizeof(compressors[0]); i++) {
+		errors += bench_copy(compressors[i].name, compressors[i].type,
+				     ENCRYPTED_FALSE, false, DATALEN);
+#ifdef BENCH_ENCRYPTION
+		errors += bench_copy(compressors[i].name, compressors[i].type,
+				     ENCRYPTED_TRUE, false, DATALEN);
+#endif
+#ifdef CONFIG_HASH_VERIFY
+		errors += bench_copy(compressors[i].name, compressors[i].type,
+				     ENCRYPTED_FALSE, true, DATALEN);
+#ifdef BENCH_ENCRYPTION
+		errors += bench_copy(compressors[i].name, compressors[i].type,
+				     ENCRYPTED_TRUE, true, DATALEN);
+#endif
+		/* chunks of a delta update are copied from memory */
+		errors += bench_copy(compressors[i].name, compressors[i].type,
+				     ENCRYPTED_FALSE, true, CHUNKLEN);
+#endif
+	}
+#ifdef CONFIG_HASH_VERIFY
+	errors += bench_run("hash/" SHA_DEFAULT, run_hash, plain, DATALEN);
+#endif
+	free(plain);
+
+	return errors;
+}
@@ -0,0 +1,282 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Micro-benchmarks of the parsers and lookups run for each update:
+ * multipart bodies, dictionaries, versions, sw-description and the
+ * lookup of its artifacts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "swupdate.h"
+#include "swupdate_dict.h"
+#include "multipart_parser.h"
+#include "parsers.h"
+#include "installer.h"
+#include "util.h"
+#include "bench.h"
+
+#define BOUNDARY	"--3d6b6a416f9b5"
+#define PARTLEN		(4 * 1024 * 1024)
+#define NKEYS		64
+#define NIMAGES		200
+
+#if defined(CONFIG_LIBCONFIG) && defined(CONFIG_RAW) && !defined(CONFIG_SIGNED_IMAGES)
+#define BENCH_PARSER
+#endif
+
+struct multipart_bench {
+	char *body;
+	size_t len;
+	size_t chunk;
+};
+
+static int on_part_data(multipart_parser *p, const char *at, size_t length)
+{
+	(void)p;
+	(void)at;
+	(void)length;
+	return 0;
+}
+
+static const multipart_parser_settings settings = {
+	.on_part_data = on_part_data,
+};
+
+static int run_multipart(void *ctx)
+{
+	struct multipart_bench *b = ctx;
+	multipart_parser *p = multipart_parser_init(BOUNDARY, &settings);
+	int ret = 0;
+
+	if (!p)
+		return -1;
+	for (size_t off = 0; off < b->len; off += b->chunk) {
+		size_t n = b->len - off < b->chunk ? b->len - off : b->chunk;
+
+		if (multipart_parser_execute(p, b->body + off, n) != n) {
+			ret = -1;
+			break;
+		}
+	}
+	multipart_parser_free(p);
+
+	return ret;
+}
+
+/* The body is passed in buffers of the size the downloader uses and smaller */
+static int bench_multipart(void)
+{
+	static const size_t chunks[] = { 512, 16384, 65536 };
+	struct multipart_bench b;
+	char label[64];
+	size_t off;
+	int ret = 0;
+
+	b.body = malloc(PARTLEN + 256);
+	if (!b.body)
+		return 1;
+	off = sprintf(b.body, "%s\r\nContent-Type: application/octet-stream\r\n"
+		      "Content-Range: bytes 0-%d/%d\r\n\r\n",
+		      BOUNDARY, PARTLEN - 1, PARTLEN);
+	srand(1);
+	for (size_t i = 0; i < PARTLEN; i++)
+		b.body[off + i] = (char)(rand() & 0xff);
+	off += PARTLEN;
+	off += sprintf(b.body + off, "\r\n%s--", BOUNDARY);
+	b.len = off;
+
+	for (unsigned int c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		b.chunk = chunks[c];
+		snprintf(label, sizeof(label), "multipart_parser_execute/%zu", b.chunk);
+		ret += bench_run(label, run_multipart, &b, b.len);
+	}
+	free(b.body);
+
+	return ret;
+}
+
+struct dict_bench {
+	struct dict d;
+	unsigned int nkeys;
+};
+
+static int run_dict(void *ctx)
+{
+	struct dict_bench *b = ctx;
+	char key[16];
+
+	for (unsigned int i = 0; i < b->nkeys; i++) {
+		snprintf(key, sizeof(key), "key%u", (i * 37) % b->nkeys);
+		if (!dict_get_value(&b->d, key))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The lookup dict_get_value() did before the hash index */
+static int run_dict_list(void *ctx)
+{
+	struct dict_bench *b = ctx;
+	struct dict_entry *entry;
+	char key[16];
+
+	for (unsigned int i = 0; i < b->nkeys; i++) {
+		snprintf(key, sizeof(key), "key%u", (i * 37) % b->nkeys);
+		LIST_FOREACH(entry, &b->d, next) {
+			if (!strcmp(key, dict_entry_get_key(entry)))
+				break;
+		}
+		if (!entry || !dict_entry_get_value(entry))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int bench_dict(void)
+{
+	static const unsigned int sizes[] = { 8, NKEYS, 512 };
+	struct dict_bench b;
+	char key[16], value[16], label[64];
+	int ret = 0;
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		LIST_INIT(&b.d);
+		b.nkeys = sizes[s];
+		for (unsigned int i = 0; i < b.nkeys; i++) {
+			snprintf(key, sizeof(key), "key%u", i);
+			snprintf(value, sizeof(value), "value%u", i);
+			if (dict_set_value(&b.d, key, value)) {
+				dict_drop_db(&b.d);
+				return 1;
+			}
+		}
+		/* one operation looks up all keys */
+		snprintf(label, sizeof(label), "dict_get_value/%u", b.nkeys);
+		ret += bench_run(label, run_dict, &b, 0);
+		snprintf(label, sizeof(label), "dict_list_lookup/%u", b.nkeys);
+		ret += bench_run(label, run_dict_list, &b, 0);
+		dict_drop_db(&b.d);
+	}
+
+	return ret;
+}
+
+static int run_versions(void *ctx)
+{
+	static const char *versions[] = {
+		"1.0.0", "1.0.1", "2.3.4-rc1", "2.3.4", "2021.04", "2021.04.1", "10.1.2.3.4"
+	};
+	unsigned int n = sizeof(versions) / sizeof(versions[0]);
+	volatile int *sum = ctx;
+
+	for (unsigned int i = 0; i < n; i++)
+		*sum += compare_versions(versions[i], versions[(i + 1) % n]);
+
+	return 0;
+}
+
+#ifdef BENCH_PARSER
+static void init_cfg(struct swupdate_cfg *sw)
+{
+	memset(sw, 0, sizeof(*sw));
+	LIST_INIT(&sw->images);
+	LIST_INIT(&sw->hardware);
+	LIST_INIT(&sw->scripts);
+	LIST_INIT(&sw->bootscripts);
+	LIST_INIT(&sw->bootloader);
+	LIST_INIT(&sw->extprocs);
+	sw->swu_fd = -1;
+}
+
+static int run_parse(void *ctx)
+{
+	struct swupdate_cfg sw;
+	int ret;
+
+	init_cfg(&sw);
+	ret = parse(&sw, ctx);
+	cleanup_files(&sw);
+
+	return ret;
+}
+
+static int run_lookup(void *ctx)
+{
+	struct swupdate_cfg *sw = ctx;
+	struct filehdr fdh = { .size = 1 };
+
+	/* as for the headers of the SWU, in reverse order */
+	for (unsigned int i = NIMAGES; i-- > 0;) {
+		snprintf(fdh.filename, sizeof(fdh.filename), "image%u.bin", i);
+		if (!artifact_provided(sw, &sw->images, &fdh, 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int bench_parser(void)
+{
+	char desc[] = "/tmp/bench_parse_XXXXXX";
+	char label[64];
+	int fd = mkstemp(desc);
+	FILE *fp;
+	long len;
+	int ret;
+
+	if (fd < 0 || !(fp = fdopen(fd, "w")))
+		return 1;
+	fprintf(fp, "software =\n{\n\tversion = \"1.0.0\";\n\timages: (\n");
+	for (unsigned int i = 0; i < NIMAGES; i++)
+		fprintf(fp, "\t\t{\n\t\t\tfilename = \"image%u.bin\";\n"
+			"\t\t\ttype = \"raw\";\n\t\t\tdevice = \"/dev/null\";\n"
+			"\t\t\tversion = \"1.%u\";\n"
+			"\t\t\tsha256 = \"%064x\";\n"
+			"\t\t\tproperties = { key = \"value%u\"; };\n\t\t}%s\n",
+			i, i, i + 1, i, i + 1 < NIMAGES ? "," : "");
+	fprintf(fp, "\t);\n}\n");
+	len = ftell(fp);
+	fclose(fp);
+
+	snprintf(label, sizeof(label), "parse/%u_images", NIMAGES);
+	ret = bench_run(label, run_parse, desc, len);
+	if (!ret) {
+		struct swupdate_cfg sw;
+
+		init_cfg(&sw);
+		ret = parse(&sw, desc);
+		if (!ret) {
+			/* one operation looks up all images */
+			snprintf(label, sizeof(label), "artifact_provided/%u", NIMAGES);
+			ret = bench_run(label, run_lookup, &sw, 0);
+		}
+		cleanup_files(&sw);
+	}
+	unlink(desc);
+
+	return ret;
+}
+#endif
+
+int main(void)
+{
+	volatile int sum = 0;
+	int errors = 0;
+
+	loglevel = ERRORLEVEL;
+	errors += bench_multipart();
+	errors += bench_dict();
+	/* one operation compares 7 pairs */
+	errors += bench_run("compare_versions/7", run_versions, (void *)&sum, 0);
+#ifdef BENCH_PARSER
+	errors += bench_parser();
+#endif
+
+	return errors;
+}
@@ -0,0 +1,162 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cmocka.h>
+#include "cpiohdr.h"
+#include "util.h"
+
+#define NFILES	4
+
+static const char *names[NFILES] = {
+	"sw-description", "rootfs.ext4", "kernel", "u-boot.bin"
+};
+static const size_t sizes[NFILES] = { 321, 65536, 4097, 2 };
+static char archive[] = "/tmp/test_cpio_XXXXXX";
+static off_t data_offset[NFILES];
+
+static void pad(FILE *fp)
+{
+	while (ftell(fp) % 4)
+		fputc(0, fp);
+}
+
+/* Append a file in "newc" format, returns the offset of its data */
+static off_t add_file(FILE *fp, const char *name, size_t size, char fill)
+{
+	off_t offset;
+
+	fprintf(fp, "070701%08x%08x%08x%08x%08x%08x%08zx%08x%08x%08x%08x%08zx%08x",
+		1, 0100644, 0, 0, 1, 0, size, 0, 0, 0, 0, strlen(name) + 1, 0);
+	fwrite(name, 1, strlen(name) + 1, fp);
+	pad(fp);
+	offset = ftell(fp);
+	for (size_t i = 0; i < size; i++)
+		fputc(fill, fp);
+	pad(fp);
+
+	return offset;
+}
+
+static int cpio_setup(void **state)
+{
+	(void)state;
+	int fd = mkstemp(archive);
+	FILE *fp;
+
+	if (fd < 0)
+		return -1;
+	fp = fdopen(fd, "w");
+	if (!fp)
+		return -1;
+	for (int i = 0; i < NFILES; i++)
+		data_offset[i] = add_file(fp, names[i], sizes[i], 'a' + i);
+	add_file(fp, "TRAILER!!!", 0, 0);
+	fclose(fp);
+	return 0;
+}
+
+static int cpio_teardown(void **state)
+{
+	(void)state;
+	unlink(archive);
+	return 0;
+}
+
+static void test_cpio_index(void **state)
+{
+	(void)state;
+	struct cpio_index idx;
+	char buf[16];
+	off_t start;
+	int fd = open(archive, O_RDONLY);
+
+	assert_true(fd >= 0);
+	assert_int_equal(cpio_index(fd, 0, &idx), 0);
+	assert_int_equal(idx.count, NFILES);
+	for (int i = 0; i < NFILES; i++) {
+		assert_string_equal(idx.entries[i].hdr.filename, names[i]);
+		assert_int_equal(idx.entries[i].hdr.size, sizes[i]);
+		assert_int_equal(idx.entries[i].offset, data_offset[i]);
+		assert_int_equal(pread(fd, buf, 2, idx.entries[i].offset), 2);
+		assert_true(buf[0] == 'a' + i && buf[1] == 'a' + i);
+	}
+	cpio_index_free(&idx);
+	assert_null(idx.entries);
+
+	/* index the rest of the archive from the second file */
+	start = data_offset[0] + (sizes[0] + 3) / 4 * 4;
+	assert_true(lseek(fd, start, SEEK_SET) >= 0);
+	assert_int_equal(cpio_index(fd, start, &idx), 0);
+	assert_int_equal(idx.count, NFILES - 1);
+	assert_int_equal(idx.entries[0].offset, data_offset[1]);
+	cpio_index_free(&idx);
+	close(fd);
+}
+
+static void test_cpio_copy_tee(void **state)
+{
+	(void)state;
+	char outputs[2][sizeof("/tmp/test_tee_XXXXXX")] = {
+		"/tmp/test_tee_XXXXXX", "/tmp/test_tee_XXXXXX"
+	};
+	int fds[2];
+	struct copy_tee tee = { .fds = fds, .count = 2 };
+	unsigned long offs = data_offset[1];
+	char buf[4096];
+	int fd = open(archive, O_RDONLY);
+
+	assert_true(fd >= 0);
+	for (int i = 0; i < 2; i++) {
+		fds[i] = mkstemp(outputs[i]);
+		assert_true(fds[i] >= 0);
+	}
+	assert_true(lseek(fd, offs, SEEK_SET) >= 0);
+	assert_int_equal(copyfile(fd, &tee, sizes[1], &offs, 512, 0, 0, NULL,
+				  NULL, 0, NULL, copy_write_tee), 0);
+
+	/* both outputs get the file at the offset */
+	for (int i = 0; i < 2; i++) {
+		assert_int_equal(lseek(fds[i], 0, SEEK_END), 512 + sizes[1]);
+		assert_int_equal(pread(fds[i], buf, sizeof(buf), 512), sizeof(buf));
+		for (size_t j = 0; j < sizeof(buf); j++)
+			assert_int_equal(buf[j], 'b');
+		close(fds[i]);
+		unlink(outputs[i]);
+	}
+	close(fd);
+}
+
+static void test_cpio_index_truncated(void **state)
+{
+	(void)state;
+	struct cpio_index idx;
+	int fd = open(archive, O_RDWR);
+
+	assert_true(fd >= 0);
+	assert_int_equal(ftruncate(fd, data_offset[1] + 100), 0);
+	assert_true(cpio_index(fd, 0, &idx) < 0);
+	assert_null(idx.entries);
+	close(fd);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest cpio_tests[] = {
+	    cmocka_unit_test(test_cpio_index),
+	    cmocka_unit_test(test_cpio_copy_tee),
+	    cmocka_unit_test(test_cpio_index_truncated)
+	};
+	error_count += cmocka_run_group_tests_name("cpio", cpio_tests,
+						   cpio_setup, cpio_teardown);
+	return error_count;
+}
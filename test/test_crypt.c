@@ -151,6 +151,54 @@ static void test_crypt_failure(void **state)
 	free(crypt.crypttext);
 }
 
+static void test_crypt_ctr(void **state)
+{
+	(void)state;
+
+	/* NIST SP 800-38A, F.5.1 */
+	unsigned char KEY[] = "2B7E151628AED2A6ABF7158809CF4F3C";
+	unsigned char IV[] = "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+	unsigned char CRYPTTEXT[] = "874D6191B620E3261BEF6864990DB6CE"
+				    "9806F66B7970FDFF8617187BB9FFFDFF";
+	unsigned char PLAINTEXT[] = "6BC1BEE22E409F96E93D7E117393172A"
+				    "AE2D8A571E03AC9C9EB76FAC45AF8E51";
+	unsigned char key[16], iv[16], crypttext[32], plaintext[32];
+	unsigned char buffer[32 + EVP_MAX_BLOCK_LENGTH];
+	unsigned char counter[16];
+	unsigned long long offsets[] = { 0, 16, 21 };
+	int len, ret;
+
+	hex2bin(key, KEY);
+	hex2bin(iv, IV);
+	hex2bin(crypttext, CRYPTTEXT);
+	hex2bin(plaintext, PLAINTEXT);
+
+	/* decryption can start anywhere in the artifact */
+	for (unsigned int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+		int off = offsets[i];
+		void *dcrypt = swupdate_DECRYPT_init_ctr(key, 16, iv, off);
+		assert_non_null(dcrypt);
+
+		ret = swupdate_DECRYPT_update(dcrypt, buffer, &len, crypttext + off,
+					      sizeof(crypttext) - off);
+		assert_true(ret == 0);
+		assert_true(len == (int)sizeof(crypttext) - off);
+		assert_memory_equal(buffer, plaintext + off, len);
+
+		ret = swupdate_DECRYPT_final(dcrypt, buffer, &len);
+		assert_true(ret == 0);
+		assert_true(len == 0);
+		swupdate_DECRYPT_cleanup(dcrypt);
+	}
+
+	/* the counter is a 128 bit number */
+	memset(iv, 0xff, sizeof(iv));
+	swupdate_DECRYPT_ctr_counter(counter, iv, 2 * 16);
+	assert_true(counter[15] == 1);
+	for (int i = 0; i < 15; i++)
+		assert_true(counter[i] == 0);
+}
+
 int main(void)
 {
 	int error_count = 0;
@@ -158,7 +206,8 @@ int main(void)
 		cmocka_unit_test(test_crypt_128),
 		cmocka_unit_test(test_crypt_192),
 		cmocka_unit_test(test_crypt_256),
-		cmocka_unit_test(test_crypt_failure)
+		cmocka_unit_test(test_crypt_failure),
+		cmocka_unit_test(test_crypt_ctr)
 	};
 	error_count += cmocka_run_group_tests_name("crypt", crypt_tests, NULL, NULL);
 	return error_count;
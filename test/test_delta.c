@@ -0,0 +1,242 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cmocka.h>
+#include <zck.h>
+#include "swupdate.h"
+#include "handlers/delta_index.h"
+
+/* SHA-256 of "abc", FIPS 180-2 */
+#define ABC_SHA256 "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+
+static char cachedir[64];
+
+/* Temporary file, removed as soon as it is open */
+static int open_tmpfile(const char *suffix)
+{
+	char fname[64];
+	int fd;
+
+	snprintf(fname, sizeof(fname), "/tmp/test_delta_%d%s", getpid(), suffix);
+	fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	assert_true(fd >= 0);
+	unlink(fname);
+
+	return fd;
+}
+
+/*
+ * Write a zck file with one chunk for each of the strings and
+ * open it again for reading, like the delta handler does with
+ * the index it receives.
+ */
+static zckCtx *zck_from_chunks(const char **chunks, unsigned int n)
+{
+	zckCtx *zck;
+	int fd;
+
+	fd = open_tmpfile(".zck");
+
+	zck = zck_create();
+	assert_non_null(zck);
+	assert_true(zck_init_write(zck, fd));
+	assert_true(zck_set_ioption(zck, ZCK_UNCOMP_HEADER, 1));
+	assert_true(zck_set_ioption(zck, ZCK_COMP_TYPE, ZCK_COMP_NONE));
+	assert_true(zck_set_ioption(zck, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256));
+	for (unsigned int i = 0; i < n; i++) {
+		assert_int_equal(zck_write(zck, chunks[i], strlen(chunks[i])),
+				 strlen(chunks[i]));
+		assert_true(zck_end_chunk(zck) >= 0);
+	}
+	assert_true(zck_close(zck));
+	zck_free(&zck);
+
+	assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+	zck = zck_create();
+	assert_non_null(zck);
+	assert_true(zck_init_read(zck, fd));
+
+	return zck;
+}
+
+/* The first chunk of a zck file is the (empty) dictionary */
+static zckChunk *data_chunk(zckCtx *zck, unsigned int n)
+{
+	zckChunk *chunk = zck_get_first_chunk(zck);
+
+	for (unsigned int i = 0; i <= n && chunk; i++)
+		chunk = zck_get_next_chunk(chunk);
+
+	return chunk;
+}
+
+static int delta_setup(void **state)
+{
+	(void)state;
+
+	snprintf(cachedir, sizeof(cachedir), "/tmp/test_delta_XXXXXX");
+	return mkdtemp(cachedir) ? 0 : -1;
+}
+
+static int delta_teardown(void **state)
+{
+	(void)state;
+
+	delta_index_invalidate(cachedir, "/dev/src");
+	return rmdir(cachedir);
+}
+
+static void test_delta_verify_chunk(void **state)
+{
+	(void)state;
+	const char *chunks[] = { "abc" };
+	unsigned char buf[4];
+	zckCtx *zck = zck_from_chunks(chunks, 1);
+	zckChunk *chunk = data_chunk(zck, 0);
+	char *sha;
+
+	assert_non_null(chunk);
+	assert_int_equal(zck_get_chunk_size(chunk), 3);
+	sha = zck_get_chunk_digest_uncompressed(chunk);
+	assert_non_null(sha);
+	assert_string_equal(sha, ABC_SHA256);
+	free(sha);
+
+	memcpy(buf, "abc", 3);
+	assert_true(delta_verify_chunk(chunk, buf, 3));
+	buf[1] ^= 1;
+	assert_false(delta_verify_chunk(chunk, buf, 3));
+	assert_false(delta_verify_chunk(chunk, buf, 2));
+
+	zck_free(&zck);
+}
+
+/*
+ * The index of /dev/src is cached the way the handler saves
+ * the index of the destination: the header only, the data
+ * itself is on the device.
+ */
+static void test_delta_index_cache(void **state)
+{
+	(void)state;
+	const char *chunks[] = { "abc", "defg", "hijkl" };
+	const char *key = "/dev/src 12 1.0\n";
+	char src[] = "abcdefghijkl";
+	zckCtx *zck;
+	char *tmp, *fname;
+	int fd, srcfd;
+
+	fd = delta_index_create(cachedir, "/dev/src", &tmp);
+	assert_true(fd >= 0);
+	assert_non_null(tmp);
+	zck = zck_create();
+	assert_non_null(zck);
+	assert_true(zck_init_write(zck, fd));
+	assert_true(zck_set_ioption(zck, ZCK_UNCOMP_HEADER, 1));
+	assert_true(zck_set_ioption(zck, ZCK_COMP_TYPE, ZCK_COMP_NONE));
+	assert_true(zck_set_ioption(zck, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256));
+	assert_true(zck_set_ioption(zck, ZCK_NO_WRITE, 1));
+	for (unsigned int i = 0; i < 3; i++) {
+		zck_write(zck, chunks[i], strlen(chunks[i]));
+		assert_true(zck_end_chunk(zck) >= 0);
+	}
+	delta_index_save(cachedir, "/dev/src", key, tmp, zck, fd);
+	zck_free(&zck);
+	close(fd);
+	assert_int_equal(access(tmp, F_OK), -1);
+	free(tmp);
+
+	fname = delta_index_key(cachedir, "/dev/src");
+	assert_non_null(fname);
+	assert_string_equal(fname, key);
+	free(fname);
+	/* the name in the cache does not contain the path of the device */
+	fname = delta_index_file(cachedir, "/dev/src", ".zck");
+	assert_non_null(fname);
+	assert_string_equal(fname + strlen(cachedir), "/_dev_src.zck");
+	assert_int_equal(access(fname, F_OK), 0);
+
+	srcfd = open_tmpfile(".src");
+	assert_int_equal(write(srcfd, src, strlen(src)), strlen(src));
+
+	zck = delta_index_load(cachedir, "/dev/src", srcfd);
+	assert_non_null(zck);
+	assert_int_equal(zck_get_chunk_count(zck), 4);
+	assert_int_equal(zck_get_chunk_size(data_chunk(zck, 2)), 5);
+	zck_free(&zck);
+
+	/* a changed source drops the cache */
+	assert_int_equal(pwrite(srcfd, "D", 1, 3), 1);
+	assert_null(delta_index_load(cachedir, "/dev/src", srcfd));
+	assert_null(delta_index_key(cachedir, "/dev/src"));
+	assert_int_equal(access(fname, F_OK), -1);
+
+	free(fname);
+	close(srcfd);
+}
+
+/*
+ * An update is stopped after the first two chunks were written,
+ * while the third one is written. When it is run again, the
+ * chunks found in the destination are not downloaded.
+ */
+static void test_delta_resume(void **state)
+{
+	(void)state;
+	const char *chunks[] = { "abc", "defg", "hijkl" };
+	const char *key = "http://host/update.zck /dev/dst 0123 ";
+	char journal[128];
+	zckCtx *zck = zck_from_chunks(chunks, 3);
+	int dstfd = open_tmpfile(".dst");
+
+	snprintf(journal, sizeof(journal), "%s/journal", cachedir);
+	assert_int_equal(delta_journal_read(journal, key), 0);
+
+	/* the image is written at offset 100 in the device */
+	assert_int_equal(pwrite(dstfd, "abcdefgh?", 9, 100), 9);
+	assert_true(delta_journal_write(journal, key,
+					zck_get_chunk_number(data_chunk(zck, 2))));
+
+	/* resumed */
+	assert_int_equal(delta_journal_read(journal, key), 3);
+	assert_int_equal(delta_verify_prefix(zck, dstfd, 100, 3), 3);
+	/* nothing can be taken from a wrong offset */
+	assert_int_equal(delta_verify_prefix(zck, dstfd, 0, 3), 1);
+	/* the interrupted chunk is downloaded again */
+	assert_int_equal(delta_verify_prefix(zck, dstfd, 100, LONG_MAX), 3);
+
+	/* another update does not use the journal */
+	assert_int_equal(delta_journal_read(journal, "http://host/other.zck /dev/dst 0123 "), 0);
+
+	/* a chunk changed since the update was stopped */
+	assert_int_equal(pwrite(dstfd, "D", 1, 103), 1);
+	assert_int_equal(delta_verify_prefix(zck, dstfd, 100, 3), 2);
+
+	unlink(journal);
+	close(dstfd);
+	zck_free(&zck);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest delta_tests[] = {
+		cmocka_unit_test(test_delta_verify_chunk),
+		cmocka_unit_test(test_delta_index_cache),
+		cmocka_unit_test(test_delta_resume)
+	};
+	error_count += cmocka_run_group_tests_name("delta", delta_tests,
+						   delta_setup, delta_teardown);
+	return error_count;
+}
@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <cmocka.h>
+#include "swupdate_dict.h"
+
+#define NKEYS		512
+
+static char keys[NKEYS][32];
+
+static int dict_setup(void **state)
+{
+	(void)state;
+	for (int i = 0; i < NKEYS; i++)
+		snprintf(keys[i], sizeof(keys[i]), "property-%d", i);
+	return 0;
+}
+
+static int dict_teardown(void **state)
+{
+	(void)state;
+	return 0;
+}
+
+static void test_dict_small(void **state)
+{
+	(void)state;
+	struct dict dictionary;
+
+	LIST_INIT(&dictionary);
+	assert_null(dict_get_value(&dictionary, "a"));
+	assert_int_equal(dict_set_value(&dictionary, "a", "1"), 0);
+	assert_int_equal(dict_insert_value(&dictionary, "a", "2"), 0);
+	assert_int_equal(dict_set_value(&dictionary, "b", "3"), 0);
+	assert_string_equal(dict_get_value(&dictionary, "a"), "2");
+	assert_non_null(LIST_NEXT(LIST_FIRST(dict_get_list(&dictionary, "a")), next));
+	assert_int_equal(dict_set_value(&dictionary, "a", "4"), 0);
+	assert_string_equal(dict_get_value(&dictionary, "a"), "4");
+	dict_remove(&dictionary, "a");
+	assert_null(dict_get_value(&dictionary, "a"));
+	assert_string_equal(dict_get_value(&dictionary, "b"), "3");
+	dict_drop_db(&dictionary);
+	assert_true(LIST_EMPTY(&dictionary));
+}
+
+static void test_dict_indexed(void **state)
+{
+	(void)state;
+	struct dict first, second;
+	struct dict_entry *entry;
+	int count = 0;
+
+	LIST_INIT(&first);
+	LIST_INIT(&second);
+	for (int i = 0; i < NKEYS; i++) {
+		assert_int_equal(dict_set_value(&first, keys[i], keys[i]), 0);
+		assert_int_equal(dict_set_value(&second, keys[i], "x"), 0);
+	}
+
+	/* keys are shared between dictionaries */
+	assert_ptr_equal(dict_entry_get_key(LIST_FIRST(&first)),
+			 dict_entry_get_key(LIST_FIRST(&second)));
+
+	for (int i = 0; i < NKEYS; i++)
+		assert_string_equal(dict_get_value(&first, keys[i]), keys[i]);
+	assert_null(dict_get_value(&first, "property-none"));
+
+	for (int i = 0; i < NKEYS; i += 2)
+		dict_remove(&first, keys[i]);
+	for (int i = 0; i < NKEYS; i++) {
+		if (i % 2)
+			assert_string_equal(dict_get_value(&first, keys[i]), keys[i]);
+		else
+			assert_null(dict_get_value(&first, keys[i]));
+	}
+	LIST_FOREACH(entry, &first, next) {
+		count++;
+	}
+	assert_int_equal(count, NKEYS / 2);
+
+	dict_drop_db(&first);
+	assert_string_equal(dict_get_value(&second, keys[0]), "x");
+	dict_drop_db(&second);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest dict_tests[] = {
+	    cmocka_unit_test(test_dict_small),
+	    cmocka_unit_test(test_dict_indexed)
+	};
+	error_count += cmocka_run_group_tests_name("dict", dict_tests,
+						   dict_setup, dict_teardown);
+	return error_count;
+}
@@ -0,0 +1,134 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+#include "handlers/hamming1_ecc.h"
+
+/*
+ * Bitwise implementation that was used by the handler before,
+ * the table driven one must return the same codes
+ */
+#define EVEN_WHOLE  0xff
+#define EVEN_HALF   0x0f
+#define ODD_HALF    0xf0
+#define EVEN_FOURTH 0x33
+#define ODD_FOURTH  0xcc
+#define EVEN_EIGHTH 0x55
+#define ODD_EIGHTH  0xaa
+
+static unsigned char calc_bitwise_parity(unsigned char val, unsigned char mask)
+{
+	unsigned char result = 0;
+
+	for (int i = 0; i < 8; i++) {
+		if (mask & 0x1)
+			result ^= (val & 1);
+		mask >>= 1;
+		val >>= 1;
+	}
+	return result & 0x1;
+}
+
+static unsigned char calc_row_parity_bits(unsigned char byte_parities[],
+					  int even, int chunk_size,
+					  int sector_size)
+{
+	unsigned char result = 0;
+
+	for (int i = (even ? 0 : chunk_size); i < sector_size; i += (2 * chunk_size)) {
+		for (int j = 0; j < chunk_size; j++)
+			result ^= byte_parities[i + j];
+	}
+	return result & 0x1;
+}
+
+static unsigned int reference_ecc(const unsigned char *buf, int sector_size)
+{
+	unsigned int odd_result = 0, even_result = 0;
+	unsigned char bit_parities = 0;
+	unsigned char byte_parities[sector_size];
+	int i, log2 = 0;
+
+	while ((1 << (log2 + 1)) <= sector_size)
+		log2++;
+
+	for (i = 0; i < sector_size; i++)
+		bit_parities ^= buf[i];
+
+	even_result |= ((calc_bitwise_parity(bit_parities, EVEN_HALF) << 2) |
+			(calc_bitwise_parity(bit_parities, EVEN_FOURTH) << 1) |
+			(calc_bitwise_parity(bit_parities, EVEN_EIGHTH) << 0));
+	odd_result |= ((calc_bitwise_parity(bit_parities, ODD_HALF) << 2) |
+			(calc_bitwise_parity(bit_parities, ODD_FOURTH) << 1) |
+			(calc_bitwise_parity(bit_parities, ODD_EIGHTH) << 0));
+
+	for (i = 0; i < sector_size; i++)
+		byte_parities[i] = calc_bitwise_parity(buf[i], EVEN_WHOLE);
+
+	for (i = 0; i < log2; i++) {
+		even_result |= calc_row_parity_bits(byte_parities, 1, 1 << i, sector_size) << (3 + i);
+		odd_result |= calc_row_parity_bits(byte_parities, 0, 1 << i, sector_size) << (3 + i);
+	}
+
+	return (odd_result << 16) | even_result;
+}
+
+static void test_hamming1_patterns(void **state)
+{
+	(void)state;
+	unsigned char sector[512];
+
+	/* erased and programmed flash */
+	memset(sector, 0xff, sizeof(sector));
+	assert_int_equal(hamming1_calculate_ecc(sector, sizeof(sector)),
+			 reference_ecc(sector, sizeof(sector)));
+	memset(sector, 0, sizeof(sector));
+	assert_int_equal(hamming1_calculate_ecc(sector, sizeof(sector)),
+			 reference_ecc(sector, sizeof(sector)));
+
+	/* every single bit flip gives a different code */
+	for (unsigned int bit = 0; bit < sizeof(sector) * 8; bit++) {
+		memset(sector, 0, sizeof(sector));
+		sector[bit / 8] = 1 << (bit % 8);
+		assert_int_equal(hamming1_calculate_ecc(sector, sizeof(sector)),
+				 reference_ecc(sector, sizeof(sector)));
+	}
+}
+
+static void test_hamming1_random(void **state)
+{
+	(void)state;
+	static const unsigned int sizes[] = { 256, 512, 2048 };
+	unsigned char sector[2048];
+
+	srand(1);
+	for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		for (int round = 0; round < 200; round++) {
+			for (unsigned int i = 0; i < sizes[n]; i++)
+				sector[i] = rand();
+			assert_int_equal(hamming1_calculate_ecc(sector, sizes[n]),
+					 reference_ecc(sector, sizes[n]));
+		}
+		/* unaligned buffer */
+		assert_int_equal(hamming1_calculate_ecc(sector + 1, 128),
+				 reference_ecc(sector + 1, 128));
+	}
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest hamming1_tests[] = {
+	    cmocka_unit_test(test_hamming1_patterns),
+	    cmocka_unit_test(test_hamming1_random)
+	};
+	error_count += cmocka_run_group_tests_name("hamming1", hamming1_tests,
+						   NULL, NULL);
+	return error_count;
+}
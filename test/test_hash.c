@@ -31,6 +31,7 @@ struct testvector {
 	const char *input;
 	const char *sha1;
 	const char *sha256;
+	const char *sha512_256;
 };
 
 // https://www.di-mgt.com.au/sha_testvectors.html
@@ -39,21 +40,25 @@ static const struct testvector testvectors[] = {
 		.input = "abc",
 		.sha1 = "a9993e364706816aba3e25717850c26c9cd0d89d",
 		.sha256 = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+		.sha512_256 = "53048e2681941ef99b2e29b76b4c7dabe4c2d0c634fc6d46e0e2f13107e7af23",
 	},
 	{
 		.input = "",
 		.sha1 = "da39a3ee5e6b4b0d3255bfef95601890afd80709",
 		.sha256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+		.sha512_256 = "c672b8d1ef56ed28ab87c3622c5114069bdd3ad7b8f9737498d0c01ecef0967a",
 	},
 	{
 		.input = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
 		.sha1 = "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
 		.sha256 = "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+		.sha512_256 = "bde8e1f9f19bb9fd3406c90ec6bc47bd36d8ada9f11880dbc8a22a7078b6a461",
 	},
 	{
 		.input = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
 		.sha1 = "a49b2446a02c645bf419f995b67091253a04a259",
 		.sha256 = "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1",
+		.sha512_256 = "3928e184fb8690f840da3988121d31be65cb9d3ef83ee6146feac861e19b563a",
 	},
 };
 
@@ -94,6 +99,9 @@ static void do_hash(const struct testvector *vector)
 {
 	do_concrete_hash("sha1", vector->input, vector->sha1);
 	do_concrete_hash("sha256", vector->input, vector->sha256);
+#ifdef CONFIG_HASH_SHA512_256
+	do_concrete_hash(SHA512_256, vector->input, vector->sha512_256);
+#endif
 }
 
 static void test_hash_vectors(void **state)
@@ -107,6 +115,34 @@ static void test_hash_vectors(void **state)
 	}
 }
 
+static void test_hash_reset(void **state)
+{
+	uint8_t result[32], expected_bin[32];
+	unsigned len = 0;
+	struct swupdate_digest *dgst;
+
+	(void)state;
+
+	dgst = swupdate_HASH_init("sha256");
+	assert_non_null(dgst);
+
+	/* an interrupted digest is discarded by the reset */
+	assert_true(!swupdate_HASH_update(dgst, (uint8_t *)"xyz", 3));
+	assert_int_equal(swupdate_HASH_reset(dgst), 0);
+
+	for (unsigned i = 0; i < sizeof(testvectors) / sizeof(testvectors[0]); ++i) {
+		const char *input = testvectors[i].input;
+
+		assert_true(!swupdate_HASH_update(dgst, (uint8_t *)input, strlen(input)));
+		assert_int_equal(swupdate_HASH_final(dgst, result, &len), 1);
+		hex2bin(expected_bin, (uint8_t *)testvectors[i].sha256);
+		assert_int_equal(swupdate_HASH_compare(expected_bin, result), 0);
+		assert_int_equal(swupdate_HASH_reset(dgst), 0);
+	}
+
+	swupdate_HASH_cleanup(dgst);
+}
+
 static void test_hash_compare(void **state)
 {
 	(void)state;
@@ -123,6 +159,7 @@ int main(void)
 	static const struct CMUnitTest hash_tests[] = {
 		cmocka_unit_test(test_hash_compare),
 		cmocka_unit_test(test_hash_vectors),
+		cmocka_unit_test(test_hash_reset),
 	};
 	return cmocka_run_group_tests_name("hash", hash_tests, NULL, NULL);
 }
@@ -0,0 +1,156 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <errno.h>
+#include <cmocka.h>
+#include "json_stream.h"
+
+#define JSONQUOTE(...) #__VA_ARGS__
+
+/* clang-format off */
+static const char *deployment = JSONQUOTE(
+{
+	"id": "12",
+	"deployment": {
+		"download": "forced",
+		"update": "attempt",
+		"chunks": [
+			{
+				"part": "os",
+				"version": "1.0",
+				"name": "rootfs",
+				"metadata": [ { "key": "a", "value": [ 1, { "x": "]" } ] } ],
+				"artifacts": [
+					{
+						"filename": "image.swu",
+						"hashes": { "sha1": "2d86c2a659e364e9abba49ea6ffcd53dd5559f05" },
+						"size": 4097
+					}
+				]
+			},
+			{ "part": "bl", "artifacts": [] }
+		]
+	},
+	"actionHistory": { "status": "line\ttab \"quoted\" ä😀", "messages": [] },
+	"stopId": -7,
+	"enabled": true
+});
+/* clang-format on */
+
+static void test_json_stream_lookup(void **state)
+{
+	(void)state;
+	size_t len = strlen(deployment);
+	char buf[64];
+	long long n;
+
+	assert_int_equal(json_stream_get_string(deployment, len,
+			 (const char *[]){"deployment", "update", NULL},
+			 buf, sizeof(buf)), 0);
+	assert_string_equal(buf, "attempt");
+
+	assert_int_equal(json_stream_get_string(deployment, len,
+			 (const char *[]){"deployment", "chunks", "[0]", "artifacts",
+					  "[0]", "hashes", "sha1", NULL},
+			 buf, sizeof(buf)), 0);
+	assert_string_equal(buf, "2d86c2a659e364e9abba49ea6ffcd53dd5559f05");
+
+	/* the closing bracket in the nested string is skipped */
+	assert_int_equal(json_stream_get_string(deployment, len,
+			 (const char *[]){"deployment", "chunks", "[1]", "part", NULL},
+			 buf, sizeof(buf)), 0);
+	assert_string_equal(buf, "bl");
+
+	/* numbers are returned as strings, strings as numbers */
+	assert_int_equal(json_stream_get_string(deployment, len,
+			 (const char *[]){"stopId", NULL}, buf, sizeof(buf)), 0);
+	assert_string_equal(buf, "-7");
+	assert_int_equal(json_stream_get_int(deployment, len,
+			 (const char *[]){"id", NULL}, &n), 0);
+	assert_int_equal(n, 12);
+	assert_int_equal(json_stream_get_int(deployment, len,
+			 (const char *[]){"deployment", "chunks", "[0]", "artifacts",
+					  "[0]", "size", NULL}, &n), 0);
+	assert_int_equal(n, 4097);
+
+	assert_int_equal(json_stream_array_length(deployment, len,
+			 (const char *[]){"deployment", "chunks", NULL}), 2);
+	assert_int_equal(json_stream_array_length(deployment, len,
+			 (const char *[]){"deployment", "chunks", "[1]", "artifacts", NULL}), 0);
+}
+
+static void test_json_stream_unescape(void **state)
+{
+	(void)state;
+	const char *escaped = "{\"s\": \"\\u00e4\\ud83d\\ude00\\/\"}";
+	size_t len = strlen(deployment);
+	char buf[64];
+
+	assert_int_equal(json_stream_get_string(deployment, len,
+			 (const char *[]){"actionHistory", "status", NULL},
+			 buf, sizeof(buf)), 0);
+	assert_string_equal(buf, "line\ttab \"quoted\" \xc3\xa4\xf0\x9f\x98\x80");
+
+	assert_int_equal(json_stream_get_string(escaped, strlen(escaped),
+			 (const char *[]){"s", NULL}, buf, sizeof(buf)), 0);
+	assert_string_equal(buf, "\xc3\xa4\xf0\x9f\x98\x80/");
+
+	/* destination too small */
+	assert_int_equal(json_stream_get_string(deployment, len,
+			 (const char *[]){"actionHistory", "status", NULL},
+			 buf, 8), -ENOSPC);
+}
+
+static void test_json_stream_errors(void **state)
+{
+	(void)state;
+	size_t len = strlen(deployment);
+	json_stream_value val;
+	char buf[16];
+	long long n;
+
+	assert_int_equal(json_stream_find(deployment, len,
+			 (const char *[]){"deployment", "cancel", NULL}, &val), -ENOENT);
+	assert_int_equal(json_stream_find(deployment, len,
+			 (const char *[]){"deployment", "chunks", "[2]", NULL}, &val), -ENOENT);
+	/* a key on an array, an index on an object */
+	assert_int_equal(json_stream_find(deployment, len,
+			 (const char *[]){"deployment", "chunks", "part", NULL}, &val), -ENOENT);
+	assert_int_equal(json_stream_find(deployment, len,
+			 (const char *[]){"[0]", NULL}, &val), -ENOENT);
+	assert_int_equal(json_stream_get_int(deployment, len,
+			 (const char *[]){"deployment", "update", NULL}, &n), -EINVAL);
+
+	assert_int_equal(json_stream_find(deployment, len,
+			 (const char *[]){"enabled", NULL}, &val), 0);
+	assert_int_equal(val.type, JSON_STREAM_BOOL);
+	assert_int_equal(json_stream_find(deployment, len,
+			 (const char *[]){"deployment", NULL}, &val), 0);
+	assert_int_equal(val.type, JSON_STREAM_OBJECT);
+
+	/* truncated or malformed text */
+	assert_int_equal(json_stream_get_string(deployment, 40,
+			 (const char *[]){"stopId", NULL}, buf, sizeof(buf)), -EINVAL);
+	assert_int_equal(json_stream_find("{\"a\": [1, 2}", 12,
+			 (const char *[]){"b", NULL}, &val), -EINVAL);
+	assert_int_equal(json_stream_find("{\"a\" 1}", 7,
+			 (const char *[]){"a", NULL}, &val), -EINVAL);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest json_stream_tests[] = {
+	    cmocka_unit_test(test_json_stream_lookup),
+	    cmocka_unit_test(test_json_stream_unescape),
+	    cmocka_unit_test(test_json_stream_errors)
+	};
+	error_count += cmocka_run_group_tests_name("json_stream", json_stream_tests,
+						   NULL, NULL);
+	return error_count;
+}
@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include "swupdate_membudget.h"
+
+static void test_membudget_unlimited(void **state)
+{
+	(void)state;
+
+	membudget_set_limit(0);
+	assert_true(membudget_available() == SIZE_MAX);
+	assert_true(membudget_reserve(1 << 30));
+	assert_true(membudget_used() == 1 << 30);
+	membudget_release(1 << 30);
+	assert_true(membudget_used() == 0);
+	assert_true(membudget_peak() >= 1 << 30);
+}
+
+static void test_membudget_limit(void **state)
+{
+	(void)state;
+
+	membudget_set_limit(1000);
+	assert_true(membudget_reserve(600));
+	assert_true(membudget_available() == 400);
+	assert_false(membudget_reserve(401));
+	assert_true(membudget_reserve(400));
+	assert_false(membudget_reserve(1));
+
+	/* a charge is never refused, the budget is then overdrawn */
+	membudget_charge(100);
+	assert_true(membudget_used() == 1100);
+	assert_true(membudget_available() == 0);
+	assert_false(membudget_reserve(1));
+
+	membudget_release(1100);
+	assert_true(membudget_used() == 0);
+	assert_true(membudget_reserve(1000));
+	membudget_release(1000);
+	membudget_set_limit(0);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest membudget_tests[] = {
+		cmocka_unit_test(test_membudget_unlimited),
+		cmocka_unit_test(test_membudget_limit)
+	};
+	error_count += cmocka_run_group_tests_name("membudget", membudget_tests,
+						   NULL, NULL);
+	return error_count;
+}
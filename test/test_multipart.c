@@ -0,0 +1,211 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+#include "multipart_parser.h"
+
+#define BOUNDARY	"--3d6b6a416f9b5"
+#define PARTLEN		(256 * 1024)
+#define NPARTS		3
+#define SPANLEN		(1024 * 1024)
+
+struct collect {
+	char *data[NPARTS];
+	size_t len[NPARTS];
+	int part;
+	int parts_end;
+	int body_end;
+	unsigned long calls;
+};
+
+static char *parts[NPARTS];
+
+static int on_part_data_begin(multipart_parser *p)
+{
+	struct collect *col = multipart_parser_get_data(p);
+
+	col->part++;
+	return 0;
+}
+
+static int on_part_data(multipart_parser *p, const char *at, size_t length)
+{
+	struct collect *col = multipart_parser_get_data(p);
+	int n = col->part - 1;
+
+	col->calls++;
+	if (!col->data[n])
+		return 0;
+	memcpy(col->data[n] + col->len[n], at, length);
+	col->len[n] += length;
+	return 0;
+}
+
+static int on_part_data_end(multipart_parser *p)
+{
+	struct collect *col = multipart_parser_get_data(p);
+
+	col->parts_end++;
+	return 0;
+}
+
+static int on_body_end(multipart_parser *p)
+{
+	struct collect *col = multipart_parser_get_data(p);
+
+	col->body_end = 1;
+	return 0;
+}
+
+static const multipart_parser_settings settings = {
+	.on_part_data = on_part_data,
+	.on_part_data_begin = on_part_data_begin,
+	.on_part_data_end = on_part_data_end,
+	.on_body_end = on_body_end,
+};
+
+static size_t build_body(char *body, char **data, int nparts, size_t partlen)
+{
+	size_t off = 0;
+
+	for (int i = 0; i < nparts; i++) {
+		off += sprintf(body + off, "%s\r\nContent-Type: application/octet-stream\r\n"
+			       "Content-Range: bytes 0-%zu/%zu\r\n\r\n",
+			       BOUNDARY, partlen - 1, partlen);
+		memcpy(body + off, data[i], partlen);
+		off += partlen;
+		off += sprintf(body + off, "\r\n");
+	}
+	off += sprintf(body + off, "%s--", BOUNDARY);
+
+	return off;
+}
+
+static int multipart_setup(void **state)
+{
+	(void)state;
+	srand(1);
+	for (int i = 0; i < NPARTS; i++) {
+		parts[i] = malloc(PARTLEN);
+		if (!parts[i])
+			return -1;
+		for (size_t j = 0; j < PARTLEN; j++)
+			parts[i][j] = (char)(rand() & 0xff);
+		/* things that look like the delimiter, but are not */
+		memcpy(parts[i] + 100, "\r\n", 2);
+		memcpy(parts[i] + 200, "\r\n" BOUNDARY, sizeof(BOUNDARY) - 2);
+		memcpy(parts[i] + 300, "\r\r\n--", 5);
+		memcpy(parts[i] + PARTLEN - 1, "\r", 1);
+	}
+	return 0;
+}
+
+static int multipart_teardown(void **state)
+{
+	(void)state;
+	for (int i = 0; i < NPARTS; i++)
+		free(parts[i]);
+	return 0;
+}
+
+static void parse_in_chunks(const char *body, size_t len, size_t chunk,
+			    struct collect *col)
+{
+	multipart_parser *p;
+
+	p = multipart_parser_init(BOUNDARY, &settings);
+	assert_non_null(p);
+	multipart_parser_set_data(p, col);
+	for (size_t off = 0; off < len; off += chunk) {
+		size_t n = len - off < chunk ? len - off : chunk;
+
+		assert_int_equal(multipart_parser_execute(p, body + off, n), n);
+	}
+	multipart_parser_free(p);
+}
+
+static void test_multipart_parts(void **state)
+{
+	(void)state;
+	static const size_t chunks[] = { 1, 2, 7, 17, 4096, 65536, (size_t)-1 };
+	char *body = malloc(NPARTS * (PARTLEN + 256));
+	size_t len;
+
+	assert_non_null(body);
+	len = build_body(body, parts, NPARTS, PARTLEN);
+
+	for (unsigned int c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		struct collect col;
+
+		memset(&col, 0, sizeof(col));
+		for (int i = 0; i < NPARTS; i++) {
+			col.data[i] = malloc(PARTLEN);
+			assert_non_null(col.data[i]);
+		}
+		parse_in_chunks(body, len, chunks[c], &col);
+		assert_int_equal(col.part, NPARTS);
+		assert_int_equal(col.parts_end, NPARTS);
+		assert_true(col.body_end);
+		for (int i = 0; i < NPARTS; i++) {
+			assert_int_equal(col.len[i], PARTLEN);
+			assert_memory_equal(col.data[i], parts[i], PARTLEN);
+			free(col.data[i]);
+		}
+	}
+	free(body);
+}
+
+/*
+ * A CR in the part data that does not start the delimiter does not
+ * split the data: it is passed in one span for each buffer, and one
+ * more if a CR is at the end of a buffer
+ */
+static void test_multipart_spans(void **state)
+{
+	(void)state;
+	static const size_t chunks[] = { 16384, 65536 };
+	char *data = malloc(SPANLEN);
+	char *body = malloc(SPANLEN + 256);
+	size_t len;
+
+	assert_non_null(data);
+	assert_non_null(body);
+	for (size_t i = 0; i < SPANLEN; i++)
+		data[i] = (char)(rand() & 0xff);
+	len = build_body(body, &data, 1, SPANLEN);
+
+	for (unsigned int c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		struct collect col;
+
+		memset(&col, 0, sizeof(col));
+		col.data[0] = malloc(SPANLEN);
+		assert_non_null(col.data[0]);
+		parse_in_chunks(body, len, chunks[c], &col);
+		assert_true(col.body_end);
+		assert_int_equal(col.len[0], SPANLEN);
+		assert_memory_equal(col.data[0], data, SPANLEN);
+		assert_true(col.calls <= 2 * ((len + chunks[c] - 1) / chunks[c]));
+		free(col.data[0]);
+	}
+	free(body);
+	free(data);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest multipart_tests[] = {
+	    cmocka_unit_test(test_multipart_parts),
+	    cmocka_unit_test(test_multipart_spans)
+	};
+	error_count += cmocka_run_group_tests_name("multipart", multipart_tests,
+						   multipart_setup, multipart_teardown);
+	return error_count;
+}
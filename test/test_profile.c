@@ -0,0 +1,124 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmocka.h>
+#include "util.h"
+#include "swupdate.h"
+#include "swupdate_profile.h"
+
+static char *read_profile(void)
+{
+	char path[256];
+	char *buf;
+	FILE *fp;
+	long len;
+
+	assert_int_equal(profile_write(path, sizeof(path)), 0);
+	fp = fopen(path, "r");
+	assert_non_null(fp);
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	buf = calloc(1, len + 1);
+	assert_non_null(buf);
+	assert_int_equal(fread(buf, 1, len, fp), len);
+	fclose(fp);
+	unlink(path);
+
+	return buf;
+}
+
+static void test_profile_handler(void **state)
+{
+	(void)state;
+	struct profile_sample s;
+	struct img_type img = { .fname = "rootfs.img" };
+	char *json;
+
+	profile_update_begin();
+	profile_handler_begin(&s);
+	usleep(1000);
+	profile_handler_end(&s, "raw", &img);
+	profile_update_end("1.0", 0);
+
+	json = read_profile();
+	assert_non_null(strstr(json, "\"version\":\"1.0\",\"result\":\"successful\""));
+	assert_non_null(strstr(json, "{\"handler\":\"raw\",\"image\":\"rootfs.img\""));
+	assert_null(strstr(json, "\"wall_us\":0,"));
+	free(json);
+}
+
+static void test_profile_ring(void **state)
+{
+	(void)state;
+	char version[16];
+	char *json;
+
+	for (unsigned int i = 0; i < PROFILE_UPDATES + 2; i++) {
+		snprintf(version, sizeof(version), "2.%u", i);
+		profile_update_begin();
+		profile_update_end(version, i % 2 ? -1 : 0);
+	}
+
+	/* the oldest ones are replaced */
+	json = read_profile();
+	assert_null(strstr(json, "\"version\":\"1.0\""));
+	assert_null(strstr(json, "\"version\":\"2.1\""));
+	assert_non_null(strstr(json, "\"version\":\"2.2\",\"result\":\"successful\""));
+	assert_non_null(strstr(json, "\"version\":\"2.9\",\"result\":\"failed\""));
+	assert_true(strstr(json, "\"2.2\"") < strstr(json, "\"2.9\""));
+	free(json);
+}
+
+static void test_profile_report(void **state)
+{
+	(void)state;
+	struct profile_sample s;
+	struct img_type img = {
+		.fname = "rootfs.img.gz",
+		.device = "/dev/mmcblk0p2",
+		.compressed = COMPRESSED_TRUE,
+		.size = 1024 * 1024
+	};
+	char *json;
+
+	profile_update_begin();
+	profile_handler_begin(&s);
+	usleep(1000);
+	profile_count_written(2 * 1024 * 1024);
+	profile_handler_end(&s, "raw", &img);
+	profile_update_end("3.0", 0);
+
+	/* only what the handler wrote counts for its device */
+	profile_count_written(1024);
+	json = read_profile();
+	assert_non_null(strstr(json, "\"bytes_installed\":2097152,"));
+	assert_non_null(strstr(json, "\"installed_bytes\":2097152,"));
+	assert_non_null(strstr(json, "\"compressed_bytes\":1048576,"));
+	assert_non_null(strstr(json, "{\"device\":\"/dev/mmcblk0p2\",\"bytes\":2097152}"));
+	assert_non_null(strstr(json, "{\"handler\":\"raw\",\"runs\":1,\"bytes\":2097152,"));
+	assert_non_null(strstr(json, "installed 2.0 MiB (/dev/mmcblk0p2 2.0 MiB)"));
+	free(json);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest profile_tests[] = {
+		cmocka_unit_test(test_profile_handler),
+		cmocka_unit_test(test_profile_report),
+		cmocka_unit_test(test_profile_ring)
+	};
+	error_count += cmocka_run_group_tests_name("profile", profile_tests,
+						   NULL, NULL);
+	return error_count;
+}
@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <string.h>
+#include <cmocka.h>
+#include "semver.h"
+#include "util.h"
+
+/* In increasing precedence, from semver.org 11.4 */
+static const char *precedence[] = {
+	"1.0.0-alpha",
+	"1.0.0-alpha.1",
+	"1.0.0-alpha.beta",
+	"1.0.0-beta",
+	"1.0.0-beta.2",
+	"1.0.0-beta.11",
+	"1.0.0-rc.1",
+	"1.0.0",
+	"1.0.1",
+	"1.1.0",
+	"2.0.0-0",
+	"2.0.0",
+	"2.1.1",
+	"10.0.0",
+};
+
+static int sign(int x)
+{
+	return (x > 0) - (x < 0);
+}
+
+static void test_semver_precedence(void **state)
+{
+	(void)state;
+	const size_t n = sizeof(precedence) / sizeof(precedence[0]);
+	int res;
+
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < n; j++) {
+			int expected = sign((int)i - (int)j);
+
+			assert_int_equal(semver_compare_str(precedence[i], precedence[j],
+							    &res), 0);
+			assert_int_equal(sign(res), expected);
+			/* old-style numbers win over semver for "1.0.1" and the like */
+			if (strchr(precedence[i], '-') || strchr(precedence[j], '-'))
+				assert_int_equal(sign(compare_versions(precedence[i],
+								       precedence[j])),
+						 expected);
+		}
+	}
+}
+
+static void test_semver_metadata(void **state)
+{
+	(void)state;
+	int res;
+
+	/* build metadata does not count */
+	assert_int_equal(semver_compare_str("1.0.0+20130313144700", "1.0.0", &res), 0);
+	assert_int_equal(res, 0);
+	assert_int_equal(semver_compare_str("1.0.0-beta+exp.sha.5114f85",
+					    "1.0.0-beta", &res), 0);
+	assert_int_equal(res, 0);
+	assert_int_equal(semver_compare_str("1.0.0-rc.1+build.1", "1.0.0+build.0",
+					    &res), 0);
+	assert_int_equal(res, -1);
+}
+
+static void test_semver_inplace(void **state)
+{
+	(void)state;
+	char buf[] = "3.14.159-rc.2+sha.cafe";
+	semver_t ver = {0};
+
+	assert_int_equal(semver_parse_inplace(buf, &ver), 0);
+	assert_int_equal(ver.major, 3);
+	assert_int_equal(ver.minor, 14);
+	assert_int_equal(ver.patch, 159);
+	assert_string_equal(ver.prerelease, "rc.2");
+	assert_string_equal(ver.metadata, "sha.cafe");
+	/* both point into the buffer, nothing to free */
+	assert_true(ver.prerelease > buf && ver.prerelease < buf + sizeof(buf));
+	assert_true(ver.metadata > buf && ver.metadata < buf + sizeof(buf));
+}
+
+static void test_semver_invalid(void **state)
+{
+	(void)state;
+	char longver[300];
+	int res = 42;
+
+	assert_int_equal(semver_compare_str("1.0.0_beta", "1.0.0", &res), -1);
+	assert_int_equal(semver_compare_str("1.0.0", "v1.0.0~1", &res), -1);
+	assert_int_equal(res, 42);
+
+	memset(longver, '1', sizeof(longver) - 1);
+	longver[sizeof(longver) - 1] = '\0';
+	assert_int_equal(semver_compare_str(longver, "1.0.0", &res), -1);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest semver_tests[] = {
+	    cmocka_unit_test(test_semver_precedence),
+	    cmocka_unit_test(test_semver_metadata),
+	    cmocka_unit_test(test_semver_inplace),
+	    cmocka_unit_test(test_semver_invalid)
+	};
+	error_count += cmocka_run_group_tests_name("semver", semver_tests, NULL, NULL);
+	return error_count;
+}
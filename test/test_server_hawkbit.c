@@ -19,6 +19,7 @@
 #include <util.h>
 #include "pctl.h"
 #include "suricatta/suricatta.h"
+#include "suricatta/server.h"
 #include "../suricatta/server_hawkbit.h"
 #include "channel.h"
 #include "channel_curl.h"
@@ -100,6 +101,15 @@ channel_op_res_t __wrap_channel_get(channel_t *this, void *data)
 	(void)this;
 	channel_data_t *channel_data = (channel_data_t *)data;
 	channel_data->json_reply = mock_ptr_type(json_object *);
+	/* the raw reply is the text of the JSON object */
+	if (channel_data->format == CHANNEL_PARSE_RAW) {
+		if (channel_data->json_reply) {
+			channel_data->raw_reply =
+			    strdup(json_object_to_json_string(channel_data->json_reply));
+			json_object_put(channel_data->json_reply);
+		}
+		channel_data->json_reply = NULL;
+	}
 	return mock_type(channel_op_res_t);
 }
 
@@ -118,7 +128,21 @@ update_state_t __wrap_get_state(void)
 	return mock_type(update_state_t);
 }
 
-extern server_op_res_t server_has_pending_action(int *action_id);
+/* The server interface is reached through the registered operations */
+static server_t *hawkbit;
+bool __wrap_register_server(const char *name, server_t *server);
+bool __wrap_register_server(const char *name, server_t *server)
+{
+	if (!strcmp(name, "hawkbit"))
+		hawkbit = server;
+	return true;
+}
+
+static server_op_res_t server_has_pending_action(int *action_id)
+{
+	return hawkbit->has_pending_action(action_id);
+}
+
 static void test_server_has_pending_action(void **state)
 {
 	(void)state;
@@ -374,7 +398,11 @@ static void test_server_process_update_artifact(void **state)
 #endif
 }
 
-extern server_op_res_t server_install_update(void);
+static server_op_res_t server_install_update(void)
+{
+	return hawkbit->install_update();
+}
+
 static void test_server_install_update(void **state)
 {
 	(void)state;
@@ -0,0 +1,109 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cmocka.h>
+#include "swupdate.h"
+#include "swupdate_staging.h"
+
+static struct swupdate_cfg sw;
+static struct img_type img[3];
+
+static int staging_setup(void **state)
+{
+	(void)state;
+
+	memset(&sw, 0, sizeof(sw));
+	memset(img, 0, sizeof(img));
+	LIST_INIT(&sw.images);
+	/* two images install the same file */
+	for (unsigned int i = 0; i < 3; i++) {
+		const char *name = i < 2 ? "rootfs.img" : "big.img";
+
+		strcpy(img[i].fname, name);
+		snprintf(img[i].extract_file, sizeof(img[i].extract_file),
+			 "/tmp/test_staging_%d_%s", getpid(), name);
+		LIST_INSERT_HEAD(&sw.images, &img[i], next);
+	}
+	staging_set_limit(4096);
+	return 0;
+}
+
+static int staging_teardown(void **state)
+{
+	(void)state;
+	staging_cleanup();
+	staging_set_limit(0);
+	return 0;
+}
+
+static void test_staging_ram(void **state)
+{
+	(void)state;
+	char data[1000], buf[sizeof(data) + 1];
+	bool ram;
+	int fd;
+
+	memset(data, 'x', sizeof(data));
+	fd = staging_create(&sw, &img[0], sizeof(data), &ram);
+	assert_true(fd >= 0);
+	assert_true(ram);
+	assert_int_equal(write(fd, data, sizeof(data)), sizeof(data));
+	close(fd);
+	assert_int_equal(access(img[0].extract_file, F_OK), -1);
+
+	for (unsigned int i = 0; i < 2; i++) {
+		fd = staging_open(&img[i]);
+		assert_true(fd >= 0);
+		assert_int_equal(img[i].size, sizeof(data));
+		assert_int_equal(read(fd, buf, sizeof(buf)), sizeof(data));
+		assert_memory_equal(buf, data, sizeof(data));
+		close(fd);
+	}
+
+	/* freed when the last image using it is installed */
+	staging_release(&img[0]);
+	fd = staging_open(&img[1]);
+	assert_true(fd >= 0);
+	close(fd);
+	staging_release(&img[1]);
+	assert_int_equal(staging_open(&img[1]), -ENOENT);
+}
+
+static void test_staging_disk(void **state)
+{
+	(void)state;
+	bool ram;
+	int fd;
+
+	/* larger than the limit */
+	fd = staging_create(&sw, &img[2], 8192, &ram);
+	assert_true(fd >= 0);
+	assert_false(ram);
+	close(fd);
+	assert_int_equal(access(img[2].extract_file, F_OK), 0);
+	assert_int_equal(staging_open(&img[2]), -ENOENT);
+
+	staging_release(&img[2]);
+	assert_int_equal(access(img[2].extract_file, F_OK), -1);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest staging_tests[] = {
+		cmocka_unit_test(test_staging_ram),
+		cmocka_unit_test(test_staging_disk)
+	};
+	error_count += cmocka_run_group_tests_name("staging", staging_tests,
+						   staging_setup, staging_teardown);
+	return error_count;
+}
@@ -6,8 +6,13 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
 #include <cmocka.h>
 #include "util.h"
+#include "swupdate.h"
 
 static int util_setup(void **state)
 {
@@ -39,12 +44,111 @@ static void test_util_ustrtoull(void **state)
 	assert_string_equal(suffix, ", some fancy things");
 }
 
+static void test_util_compare_versions(void **state)
+{
+	(void)state;
+	/* old-style */
+	assert_true(compare_versions("1.2", "1.2.0.0") == 0);
+	assert_true(compare_versions("1..2", "1.2") == 0);
+	assert_true(compare_versions("1.2.3.4.5", "1.2.3.4") == 0);
+	assert_true(compare_versions("1.10", "1.9") > 0);
+	/* semantic versions */
+	assert_true(compare_versions("1.2.3-rc1", "1.2.3") < 0);
+	assert_true(compare_versions("1.2.3-rc.2", "1.2.3-rc.10") < 0);
+	assert_true(compare_versions("1.2.3+build5", "1.2.3") == 0);
+	assert_true(compare_versions("70000.1.1", "1.2.3") > 0);
+	/* lexicographical */
+	assert_true(compare_versions("abc", "abd") < 0);
+	assert_true(compare_versions("1.2.3-rc1", "1.2.3-rc1") == 0);
+}
+
+static void test_util_version_installed(void **state)
+{
+	(void)state;
+	static const char *installed[][2] = {
+		{ "rootfs", "1.2.3" }, { "kernel", "5.10.0-rt1" },
+		{ "rootfs", "2.0" }, { "bootloader", "2021.04" },
+	};
+	struct swupdate_cfg cfg;
+	struct sw_version *swver;
+	char name[16];
+
+	memset(&cfg, 0, sizeof(cfg));
+	LIST_INIT(&cfg.installed_sw_list);
+	assert_false(is_version_installed(&cfg, "rootfs", "1.2.3", false));
+	for (unsigned int i = 0; i < sizeof(installed) / sizeof(installed[0]); i++) {
+		swver = calloc(1, sizeof(*swver));
+		assert_non_null(swver);
+		strcpy(swver->name, installed[i][0]);
+		strcpy(swver->version, installed[i][1]);
+		LIST_INSERT_HEAD(&cfg.installed_sw_list, swver, next);
+	}
+	/* enough entries to share the buckets */
+	for (int i = 0; i < 100; i++) {
+		swver = calloc(1, sizeof(*swver));
+		assert_non_null(swver);
+		snprintf(name, sizeof(name), "app%d", i);
+		strcpy(swver->name, name);
+		snprintf(swver->version, sizeof(swver->version), "%d.0", i + 1);
+		LIST_INSERT_HEAD(&cfg.installed_sw_list, swver, next);
+	}
+
+	assert_true(is_version_installed(&cfg, "rootfs", "1.2.3", false));
+	assert_true(is_version_installed(&cfg, "rootfs", "2.0.0", false));
+	assert_false(is_version_installed(&cfg, "rootfs", "1.5", false));
+	assert_true(is_version_installed(&cfg, "rootfs", "1.5", true));
+	assert_false(is_version_installed(&cfg, "rootfs", "2.1", true));
+	assert_true(is_version_installed(&cfg, "kernel", "5.10.0-rt1", false));
+	assert_false(is_version_installed(&cfg, "kernel", "5.10.0", true));
+	assert_true(is_version_installed(&cfg, "bootloader", "2020.10", true));
+	assert_false(is_version_installed(&cfg, "u-boot", "2020.10", true));
+	for (int i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "app%d", i);
+		assert_true(is_version_installed(&cfg, name, "0.9", true));
+		assert_false(is_version_installed(&cfg, name, "101.0", true));
+	}
+}
+
+static void test_util_free_space(void **state)
+{
+	(void)state;
+	char fname[] = "/tmp/swupdate-free-XXXXXX";
+	struct img_type img;
+	struct statvfs vfs;
+	long long quarter;
+	int fd;
+
+	fd = mkstemp(fname);
+	assert_true(fd >= 0);
+	unlink(fname);
+	assert_int_equal(fstatvfs(fd, &vfs), 0);
+	quarter = (long long)vfs.f_bfree * vfs.f_bsize / 4;
+
+	memset(&img, 0, sizeof(img));
+	strcpy(img.fname, "test");
+	img_free_space_reset();
+	img.size = quarter;
+	assert_true(img_check_free_space(&img, fd));
+	assert_true(img_check_free_space(&img, fd));
+	assert_true(img_check_free_space(&img, fd));
+	/* the cached value is exhausted, the filesystem is read again */
+	img.size = quarter * 2;
+	assert_true(img_check_free_space(&img, fd));
+	img.size = quarter * 8;
+	assert_false(img_check_free_space(&img, fd));
+	img_free_space_reset();
+	close(fd);
+}
+
 int main(void)
 {
 	int error_count = 0;
 	const struct CMUnitTest util_tests[] = {
 	    cmocka_unit_test(test_util_ustrtoull),
-	    cmocka_unit_test(test_util_size_delimiter_match)
+	    cmocka_unit_test(test_util_size_delimiter_match),
+	    cmocka_unit_test(test_util_compare_versions),
+	    cmocka_unit_test(test_util_version_installed),
+	    cmocka_unit_test(test_util_free_space)
 	};
 	error_count += cmocka_run_group_tests_name("util", util_tests,
 						   util_setup, util_teardown);
@@ -0,0 +1,103 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmocka.h>
+#include "swupdate.h"
+#include "verity.h"
+
+#define NBLOCKS	130	/* two levels of hash blocks */
+
+static const char salt[] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+/* computed with the algorithm of veritysetup format */
+static const char roothash[] =
+	"67a50143ed4b79b1f201e6b2c418a32350a3493e7f7e5159ddfbfa515bb40aba";
+
+static char hashfile[] = "/tmp/test_verity_XXXXXX";
+static struct img_type img;
+static struct dict bootloader;
+
+static int verity_setup(void **state)
+{
+	(void)state;
+	int fd = mkstemp(hashfile);
+
+	if (fd < 0)
+		return -1;
+	close(fd);
+	memset(&img, 0, sizeof(img));
+	LIST_INIT(&img.properties);
+	LIST_INIT(&bootloader);
+	img.bootloader = &bootloader;
+	strcpy(img.fname, "rootfs.ext4");
+	strcpy(img.device, "/dev/null");
+	dict_set_value(&img.properties, "verity", "true");
+	dict_set_value(&img.properties, "verity-salt", salt);
+	dict_set_value(&img.properties, "verity-superblock", "false");
+	dict_set_value(&img.properties, "verity-hash-device", hashfile);
+	dict_set_value(&img.properties, "verity-roothash-var", "roothash");
+	dict_set_value(&img.properties, "verity-salt-var", "salt");
+	return 0;
+}
+
+static int verity_teardown(void **state)
+{
+	(void)state;
+	dict_drop_db(&img.properties);
+	dict_drop_db(&bootloader);
+	unlink(hashfile);
+	return 0;
+}
+
+static void test_verity_tree(void **state)
+{
+	(void)state;
+	struct verity_tree *tree;
+	char block[4096];
+
+	assert_int_equal(verity_start(&img, &tree), 1);
+	for (int i = 0; i < NBLOCKS; i++) {
+		memset(block, i & 0xff, sizeof(block));
+		/* chunks do not need to be aligned to the blocks */
+		assert_int_equal(verity_update(tree, block, 1000), 0);
+		assert_int_equal(verity_update(tree, block + 1000,
+					       sizeof(block) - 1000), 0);
+	}
+	assert_int_equal(verity_finish(tree, &img), 0);
+	verity_free(tree);
+
+	assert_string_equal(dict_get_value(&bootloader, "roothash"), roothash);
+	assert_string_equal(dict_get_value(&bootloader, "salt"), salt);
+}
+
+static void test_verity_unaligned(void **state)
+{
+	(void)state;
+	struct verity_tree *tree;
+	char block[4096] = { 0 };
+
+	assert_int_equal(verity_start(&img, &tree), 1);
+	assert_int_equal(verity_update(tree, block, sizeof(block) - 1), 0);
+	assert_true(verity_finish(tree, &img) < 0);
+	verity_free(tree);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest verity_tests[] = {
+		cmocka_unit_test(test_verity_tree),
+		cmocka_unit_test(test_verity_unaligned)
+	};
+	error_count += cmocka_run_group_tests_name("verity", verity_tests,
+						   verity_setup, verity_teardown);
+	return error_count;
+}
@@ -11,6 +11,7 @@ import logging
 import os
 import sys
 import string
+import uuid
 from swupdateclient import __about__
 from typing import List, Optional, Tuple, Union
 
@@ -20,6 +21,9 @@ from termcolor import colored
 import websockets
 
 
+# Bytes written before waiting for the socket to drain
+DEFAULT_CHUNK_SIZE = 1024 * 1024
+
 LOGGING_MAPPING = {
     "3": logging.ERROR,
     "4": logging.WARNING,
@@ -59,10 +63,13 @@ class SWUpdater:
     url_upload = "http://{}:{}/upload"
     url_status = "ws://{}:{}/ws"
 
-    def __init__(self, path_image, host_name, port=8080, logger=None, log_level=logging.DEBUG):
+    def __init__(self, path_image, host_name, port=8080, logger=None, log_level=logging.DEBUG,
+                 stream=False, chunk_size=DEFAULT_CHUNK_SIZE):
         self._image = path_image
         self._host_name = host_name
         self._port = port
+        self._stream = stream
+        self._chunk_size = chunk_size
         if logger is not None:
             self._logger = logger
         else:
@@ -118,19 +125,72 @@ class SWUpdater:
             timeout=timeout,
         )
 
+    async def stream_upload(self, swu_file):
+        """Send the image as multipart form in chunks, without a thread.
+
+        drain() waits while the socket buffer is full, so the memory used
+        does not depend on the size of the image. Returns the HTTP status.
+        """
+        boundary = uuid.uuid4().hex
+        head = (
+            f"--{boundary}\r\n"
+            f'Content-Disposition: form-data; name="file"; '
+            f'filename="{os.path.basename(self._image)}"\r\n'
+            "Content-Type: application/octet-stream\r\n\r\n"
+        ).encode()
+        tail = f"\r\n--{boundary}--\r\n".encode()
+        size = os.fstat(swu_file.fileno()).st_size
+
+        reader, writer = await asyncio.open_connection(self._host_name, self._port)
+        try:
+            writer.write(
+                (
+                    "POST /upload HTTP/1.1\r\n"
+                    f"Host: {self._host_name}:{self._port}\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    f"Content-Type: multipart/form-data; boundary={boundary}\r\n"
+                    f"Content-Length: {len(head) + size + len(tail)}\r\n"
+                    "\r\n"
+                ).encode()
+                + head
+            )
+            while True:
+                chunk = swu_file.read(self._chunk_size)
+                if not chunk:
+                    break
+                writer.write(chunk)
+                await writer.drain()
+            writer.write(tail)
+            await writer.drain()
+
+            status_line = await reader.readline()
+        finally:
+            writer.close()
+
+        try:
+            return int(status_line.split()[1])
+        except (IndexError, ValueError):
+            raise ConnectionError("invalid HTTP answer")
+
     async def upload(self, timeout):
         self._logger.info("Start uploading image...")
         try:
             with open(self._image, "rb") as swu_file:
-                loop = asyncio.get_event_loop()
-                response = await loop.run_in_executor(
-                    None, self.sync_upload, swu_file, timeout
-                )
-
-            if response.status_code != 200:
+                if self._stream:
+                    status_code = await asyncio.wait_for(
+                        self.stream_upload(swu_file), timeout=timeout
+                    )
+                else:
+                    loop = asyncio.get_event_loop()
+                    response = await loop.run_in_executor(
+                        None, self.sync_upload, swu_file, timeout
+                    )
+                    status_code = response.status_code
+
+            if status_code != 200:
                 self._logger.error(
                     "Cannot upload software image: %s",
-                    response.status_code)
+                    status_code)
                 return False
 
             self._logger.info(
@@ -142,8 +202,10 @@ class SWUpdater:
             self._logger.error("No connection to host, exit")
         except FileNotFoundError:
             self._logger.error("swu file not found")
-        except requests.exceptions.ConnectionError:
+        except (requests.exceptions.ConnectionError, ConnectionError, OSError):
             self._logger.exception("Connection error")
+        except asyncio.TimeoutError:
+            self._logger.error("timeout uploading image")
         return False
 
     async def start_tasks(self, timeout):
@@ -167,10 +229,51 @@ class SWUpdater:
         return asyncio.run(self.start_tasks(timeout))
 
 
+async def fleet_update(path_image, hosts, timeout=300, concurrency=0,
+                       chunk_size=DEFAULT_CHUNK_SIZE, logger=None):
+    """Update several devices from one event loop.
+
+    hosts is a list of (host_name, port). At most concurrency updates run at
+    the same time (0: all). Returns a dict host_name:port -> result.
+    """
+    logger = logger or logging.getLogger("swupdate")
+    limit = asyncio.Semaphore(concurrency or len(hosts))
+
+    async def one(host_name, port):
+        async with limit:
+            updater = SWUpdater(
+                path_image, host_name, port,
+                logger=logger.getChild(f"{host_name}:{port}"),
+                stream=True, chunk_size=chunk_size)
+            return await updater.start_tasks(timeout)
+
+    results = await asyncio.gather(
+        *(one(host_name, port) for host_name, port in hosts),
+        return_exceptions=True)
+
+    return {
+        f"{host_name}:{port}": result is True
+        for (host_name, port), result in zip(hosts, results)
+    }
+
+
+def parse_hosts(hosts: str, default_port: int) -> List[Tuple[str, int]]:
+    """Split "host[:port],host[:port]..." """
+    result = []
+    for entry in filter(None, hosts.split(",")):
+        host_name, _, port = entry.rpartition(":")
+        if not host_name or ":" in host_name or not port.isdigit():
+            host_name, port = entry, default_port
+        result.append((host_name, int(port)))
+    return result
+
+
 def client (args: List[str]) -> None:
     parser = argparse.ArgumentParser()
     parser.add_argument("swu_file", help="Path to swu image")
-    parser.add_argument("host_name", help="Host name")
+    parser.add_argument(
+        "host_name",
+        help="Host name, a comma separated list host[:port],... updates a fleet")
     parser.add_argument("port", help="Port", type=int, default=8080, nargs="?")
     parser.add_argument(
         "--timeout",
@@ -179,6 +282,18 @@ def client (args: List[str]) -> None:
         default=300,
         nargs="?",
     )
+    parser.add_argument(
+        "--stream", help="upload from the event loop in large chunks",
+        action="store_true"
+    )
+    parser.add_argument(
+        "--chunk-size", help="size of the chunks sent with --stream",
+        type=int, default=DEFAULT_CHUNK_SIZE
+    )
+    parser.add_argument(
+        "--concurrency", help="maximum number of devices updated at the same time",
+        type=int, default=0
+    )
     parser.add_argument(
         "--log-level", help="change log level (error, info, warning, debug)",
         type=str, metavar="[LEVEL]",
@@ -197,11 +312,29 @@ def client (args: List[str]) -> None:
     elif args.color == "never":
         os.environ["NO_COLOR"] = "yes"
 
+    hosts = parse_hosts(args.host_name, args.port)
+    if len(hosts) > 1:
+        handler = logging.StreamHandler()
+        handler.setFormatter(ColorFormatter())
+        logger = logging.getLogger("swupdate")
+        logger.addHandler(handler)
+        logger.setLevel(args.log_level.upper())
+        results = asyncio.run(fleet_update(
+            args.swu_file, hosts, timeout=args.timeout,
+            concurrency=args.concurrency, chunk_size=args.chunk_size,
+            logger=logger))
+        for device, result in results.items():
+            logger.info("%s: %s", device, "SUCCESS" if result else "FAILURE")
+        sys.exit(0 if all(results.values()) else 1)
+
+    host_name, port = hosts[0]
     updater = SWUpdater(
         args.swu_file,
-        args.host_name,
-        args.port,
-        log_level=args.log_level.upper())
+        host_name,
+        port,
+        log_level=args.log_level.upper(),
+        stream=args.stream,
+        chunk_size=args.chunk_size)
     updater.update(timeout=args.timeout)
 
 def main():
@@ -0,0 +1,242 @@
+#!/bin/sh
+#
+# (C) Copyright 2026
+# agent <agent@local>
+#
+# SPDX-License-Identifier:     GPL-2.0-only
+#
+# Generate a synthetic SWU, install it with "swupdate -i" and report
+# where the time went, from the timeline of the update (SWUpdate must
+# be built with CONFIG_TIMELINE).
+
+set -e
+
+images=4
+size=64
+compression=none
+encrypt=0
+sign=0
+script=0
+bootenv=0
+delta=
+target=tmpfs
+swupdate=swupdate
+keep=0
+
+usage() {
+	cat <<EOF
+$(basename "$0") [OPTION]...
+	-n <count>        number of images (default $images)
+	-s <MiB>          size of each image (default $size)
+	-c <compression>  none, zlib, zstd, lz4 or xz (default $compression)
+	-e                encrypt the images with AES-256-CBC
+	-S                sign sw-description with CMS
+	-x                add a shell script to the SWU
+	-B                set a variable in the bootloader environment
+	-D <percent>      install again after changing <percent> of each image
+	-t <target>       tmpfs (regular files) or loop (loop devices, needs root)
+	-b <binary>       SWUpdate to run (default $swupdate)
+	-k                keep the work directory
+	-h                print this help
+EOF
+}
+
+while getopts "n:s:c:eSxBD:t:b:kh" opt; do
+	case $opt in
+	n) images=$OPTARG ;;
+	s) size=$OPTARG ;;
+	c) compression=$OPTARG ;;
+	e) encrypt=1 ;;
+	S) sign=1 ;;
+	x) script=1 ;;
+	B) bootenv=1 ;;
+	D) delta=$OPTARG ;;
+	t) target=$OPTARG ;;
+	b) swupdate=$OPTARG ;;
+	k) keep=1 ;;
+	h) usage; exit 0 ;;
+	*) usage; exit 1 ;;
+	esac
+done
+
+if [ -n "$delta" ] && { [ "$delta" -lt 1 ] || [ "$delta" -gt 100 ]; }; then
+	echo "The percentage must be between 1 and 100" >&2
+	exit 1
+fi
+
+case $compression in
+none) compress="cat" ;;
+zlib) compress="gzip -n -c" ;;
+zstd) compress="zstd -q -c" ;;
+lz4) compress="lz4 -q -c" ;;
+xz) compress="xz -c" ;;
+*) echo "Unknown compression $compression" >&2; exit 1 ;;
+esac
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/swupdate-bench-XXXXXX")
+mkdir -p "$work/swu" "$work/tmp" "$work/target"
+loops=
+
+cleanup() {
+	for l in $loops; do
+		losetup -d "$l" 2>/dev/null || true
+	done
+	[ $keep = 1 ] && echo "Work directory: $work" || rm -rf "$work"
+}
+trap cleanup EXIT
+
+if [ $encrypt = 1 ]; then
+	aeskey=$(openssl rand -hex 32)
+	aesivt=$(openssl rand -hex 16)
+	echo "$aeskey $aesivt" > "$work/aes.key"
+fi
+if [ $sign = 1 ]; then
+	openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+		-keyout "$work/sign.key" -out "$work/sign.crt" -subj "/CN=swupdate-bench" \
+		-addext "keyUsage=digitalSignature" \
+		-addext "extendedKeyUsage=emailProtection" 2>/dev/null
+fi
+
+# half random, half zeroes, so that the compressors have some work
+gen_image() {
+	i=0
+	while [ $i -lt $images ]; do
+		head -c $((size * 512 * 1024)) /dev/urandom > "$work/image$i.raw"
+		head -c $((size * 512 * 1024)) /dev/zero >> "$work/image$i.raw"
+		i=$((i + 1))
+	done
+}
+
+# overwrite the given percentage of each image, in 4 KiB blocks spread
+# over the whole image
+change_image() {
+	blocks=$((size * 256))
+	step=$((100 / $1))
+	i=0
+	while [ $i -lt $images ]; do
+		b=0
+		while [ $b -lt $blocks ]; do
+			dd if=/dev/urandom of="$work/image$i.raw" bs=4096 seek=$b count=1 \
+				conv=notrunc 2>/dev/null
+			b=$((b + step))
+		done
+		i=$((i + 1))
+	done
+}
+
+prepare_targets() {
+	i=0
+	while [ $i -lt $images ]; do
+		truncate -s $((size * 1024 * 1024)) "$work/target/image$i"
+		if [ "$target" = loop ]; then
+			l=$(losetup -f --show "$work/target/image$i")
+			loops="$loops $l"
+			echo "$l" > "$work/target/image$i.dev"
+		else
+			echo "$work/target/image$i" > "$work/target/image$i.dev"
+		fi
+		i=$((i + 1))
+	done
+}
+
+make_swu() {
+	rm -f "$work"/swu/*
+	{
+		echo "software ="
+		echo "{"
+		echo "	version = \"1.0.0\";"
+		echo "	images: ("
+		i=0
+		while [ $i -lt $images ]; do
+			f=image$i.bin
+			$compress < "$work/image$i.raw" > "$work/swu/$f"
+			if [ $encrypt = 1 ]; then
+				openssl enc -aes-256-cbc -K "$aeskey" -iv "$aesivt" \
+					-in "$work/swu/$f" -out "$work/swu/$f.enc"
+				mv "$work/swu/$f.enc" "$work/swu/$f"
+			fi
+			echo "		{"
+			echo "			filename = \"$f\";"
+			echo "			type = \"raw\";"
+			echo "			device = \"$(cat "$work/target/image$i.dev")\";"
+			echo "			sha256 = \"$(sha256sum "$work/swu/$f" | cut -d' ' -f1)\";"
+			[ $compression != none ] && echo "			compressed = \"$compression\";"
+			[ $encrypt = 1 ] && echo "			encrypted = \"aes-cbc\";"
+			i=$((i + 1))
+			[ $i -lt $images ] && echo "		}," || echo "		}"
+		done
+		echo "	);"
+		if [ $script = 1 ]; then
+			printf '#!/bin/sh\nexit 0\n' > "$work/swu/bench.sh"
+			echo "	scripts: ( {"
+			echo "		filename = \"bench.sh\";"
+			echo "		type = \"shellscript\";"
+			echo "		sha256 = \"$(sha256sum "$work/swu/bench.sh" | cut -d' ' -f1)\";"
+			echo "	} );"
+		fi
+		if [ $bootenv = 1 ]; then
+			echo "	bootenv: ( { name = \"swupdate_bench\"; value = \"1\"; } );"
+		fi
+		echo "}"
+	} > "$work/swu/sw-description"
+
+	files=sw-description
+	if [ $sign = 1 ]; then
+		openssl cms -sign -in "$work/swu/sw-description" -out "$work/swu/sw-description.sig" \
+			-signer "$work/sign.crt" -inkey "$work/sign.key" -outform DER \
+			-nosmimecap -binary
+		files="$files sw-description.sig"
+	fi
+	files="$files $(cd "$work/swu" && ls image*.bin)"
+	if [ $script = 1 ]; then
+		files="$files bench.sh"
+	fi
+	(cd "$work/swu" && for f in $files; do echo "$f"; done | cpio -o -H crc --quiet) \
+		> "$work/bench.swu"
+}
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# Sum the duration of the events of the timeline by category and name
+report() {
+	timeline="$work/tmp/swupdate-timeline.json"
+	if [ ! -f "$timeline" ]; then
+		echo "No timeline in $work/tmp, is SWUpdate built with CONFIG_TIMELINE ?" >&2
+		return
+	fi
+	sed -n 's/.*"dur":\([0-9]*\),"cat":"\([^"]*\)","name":"\([^"]*\)".*/\2 \3|\1/p' \
+		"$timeline" | awk -F'|' '
+		{ key = $1; if (!(key in dur)) order[n++] = key; dur[key] += $2 }
+		END { for (i = 0; i < n; i++) printf "  %-40s %10.1f ms\n", order[i], dur[order[i]] / 1000 }'
+}
+
+install_swu() {
+	opts="-i $work/bench.swu"
+	[ $encrypt = 1 ] && opts="$opts -K $work/aes.key"
+	[ $sign = 1 ] && opts="$opts -k $work/sign.crt"
+	rm -f "$work/tmp/swupdate-timeline.json"
+	start=$(now_ms)
+	# shellcheck disable=SC2086
+	if ! TMPDIR="$work/tmp/" $swupdate $opts > "$work/swupdate.log" 2>&1; then
+		cat "$work/swupdate.log" >&2
+		echo "Installation failed" >&2
+		exit 1
+	fi
+	echo "$1: $(($(now_ms) - start)) ms, $(stat -c %s "$work/bench.swu") bytes"
+	report
+}
+
+gen_image
+prepare_targets
+make_swu
+echo "SWU: $images images of $size MiB, compression $compression," \
+	"encrypted $encrypt, signed $sign, target $target"
+install_swu "install"
+
+if [ -n "$delta" ]; then
+	change_image "$delta"
+	make_swu
+	install_swu "install after changing $delta%"
+fi
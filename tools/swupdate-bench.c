@@ -0,0 +1,466 @@
+/*
+ * (C) Copyright 2026
+ * agent <agent@local>
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+/*
+ * Measure the copy pipeline (input, hash, decrypt, decompress, output)
+ * on a single artifact or on all artifacts of a SWU, without
+ * running a real installation.
+ * Each stage is measured adding it to the previous ones, so that the
+ * cost of a single stage is the difference to the previous line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "generated/autoconf.h"
+#include "cpiohdr.h"
+#include "swupdate.h"
+#include "util.h"
+#include "sslapi.h"
+#include "parsers.h"
+
+#define MAX_ARTIFACTS	256
+#define NPAD_BYTES(o)	((4 - (o % 4)) % 4)
+
+struct bench_artifact {
+	char name[MAX_IMAGE_FNAME];
+	off_t offset;
+	size_t size;
+	int compressed;
+	int encrypted;
+	unsigned char sha256[SHA256_HASH_LENGTH];
+};
+
+struct bench_sample {
+	struct timespec time;
+	struct rusage usage;
+	unsigned long long syscr, syscw, rchar, wchar;
+};
+
+enum {
+	STAGE_READ,
+	STAGE_HASH,
+	STAGE_DECRYPT,
+	STAGE_DECOMPRESS,
+	STAGE_WRITE,
+	STAGE_LAST
+};
+
+static const char *stage_names[STAGE_LAST] = {
+	[STAGE_READ] = "read",
+	[STAGE_HASH] = "+hash",
+	[STAGE_DECRYPT] = "+decrypt",
+	[STAGE_DECOMPRESS] = "+decompress",
+	[STAGE_WRITE] = "+write",
+};
+
+static struct bench_artifact artifacts[MAX_ARTIFACTS];
+static unsigned int nartifacts;
+
+static struct option long_options[] = {
+	{"swu", no_argument, NULL, 's'},
+	{"compressed", required_argument, NULL, 'z'},
+	{"encrypted", no_argument, NULL, 'e'},
+	{"key-aes", required_argument, NULL, 'k'},
+	{"cipher", required_argument, NULL, 'c'},
+	{"buffer-size", required_argument, NULL, 'b'},
+	{"writeback", required_argument, NULL, 'w'},
+	{"output", required_argument, NULL, 'o'},
+	{"repeat", required_argument, NULL, 'n'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+static void usage(const char *program)
+{
+	fprintf(stdout,
+		"%s (compiled %s)\n"
+		"Usage %s [OPTION] <file>\n"
+		" -s, --swu                 : <file> is a SWU, all artifacts are measured\n"
+		" -z, --compressed <algo>   : artifacts are compressed (zlib, zstd, lz4, xz, auto)\n"
+		"                             (default: none, auto for a SWU)\n"
+		" -e, --encrypted           : artifacts are encrypted\n"
+		" -k, --key-aes <file>      : AES key file for encrypted artifacts\n"
+		" -c, --cipher <mode>       : cipher of encrypted artifacts (aes-cbc, aes-ctr)\n"
+		"                             (default: aes-cbc)\n"
+		" -b, --buffer-size <size>  : size of the pipeline buffers\n"
+		" -w, --writeback <size>    : write back the output every <size> bytes\n"
+		" -o, --output <file>       : sink for the write stage (default /dev/null)\n"
+		" -n, --repeat <count>      : repeat each stage <count> times (default 1)\n"
+		" -h, --help                : print this help and exit\n",
+		program, __DATE__, program);
+}
+
+static int parse_compressed(const char *algo)
+{
+	if (!strcmp(algo, "zlib"))
+		return COMPRESSED_ZLIB;
+	if (!strcmp(algo, "zstd"))
+		return COMPRESSED_ZSTD;
+	if (!strcmp(algo, "lz4"))
+		return COMPRESSED_LZ4;
+	if (!strcmp(algo, "xz"))
+		return COMPRESSED_XZ;
+	if (!strcmp(algo, "auto"))
+		return -1;
+	if (!strcmp(algo, "none"))
+		return COMPRESSED_FALSE;
+
+	fprintf(stderr, "Unknown compression %s\n", algo);
+	exit(EXIT_FAILURE);
+}
+
+static int parse_cipher(const char *mode)
+{
+	if (!strcmp(mode, "aes-cbc"))
+		return ENCRYPTED_AES_CBC;
+	if (!strcmp(mode, "aes-ctr"))
+		return ENCRYPTED_AES_CTR;
+
+	fprintf(stderr, "Unknown cipher %s\n", mode);
+	exit(EXIT_FAILURE);
+}
+
+static int detect_compressed(int fd, off_t offset)
+{
+	unsigned char magic[6];
+
+	if (pread(fd, magic, sizeof(magic), offset) != sizeof(magic))
+		return COMPRESSED_FALSE;
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		return COMPRESSED_ZLIB;
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return COMPRESSED_ZSTD;
+	if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18)
+		return COMPRESSED_LZ4;
+	if (!memcmp(magic, "\xfd" "7zXZ\0", 6))
+		return COMPRESSED_XZ;
+
+	return COMPRESSED_FALSE;
+}
+
+/*
+ * The hash is computed on the data as stored in the SWU,
+ * it is needed to check it in the hash stage
+ */
+static int hash_artifact(int fd, struct bench_artifact *a)
+{
+	struct swupdate_digest *dgst;
+	unsigned char buf[16384];
+	unsigned char md_value[64];
+	unsigned int md_len = 0;
+	size_t count = 0;
+	ssize_t n;
+	int ret = 0;
+
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst)
+		return -EFAULT;
+
+	while (count < a->size) {
+		n = pread(fd, buf, min(sizeof(buf), a->size - count), a->offset + count);
+		if (n <= 0) {
+			ret = -EIO;
+			break;
+		}
+		if (swupdate_HASH_update(dgst, buf, n) < 0) {
+			ret = -EFAULT;
+			break;
+		}
+		count += n;
+	}
+	if (!ret && (swupdate_HASH_final(dgst, md_value, &md_len) < 0 ||
+		     md_len != SHA256_HASH_LENGTH))
+		ret = -EFAULT;
+	if (!ret)
+		memcpy(a->sha256, md_value, sizeof(a->sha256));
+	swupdate_HASH_cleanup(dgst);
+
+	return ret;
+}
+
+static int scan_swu(int fd, int compressed, int encrypted)
+{
+	struct filehdr fdh;
+	unsigned long offset = 0;
+
+	for (;;) {
+		if (extract_cpio_header(fd, &fdh, &offset))
+			return -EINVAL;
+		if (!strcmp(fdh.filename, "TRAILER!!!"))
+			break;
+
+		/* sw-description and its signature are not artifacts */
+		if (strncmp(fdh.filename, SW_DESCRIPTION_FILENAME,
+			    strlen(SW_DESCRIPTION_FILENAME)) && fdh.size) {
+			struct bench_artifact *a;
+
+			if (nartifacts == MAX_ARTIFACTS) {
+				fprintf(stderr, "Too many artifacts, only %u measured\n",
+					nartifacts);
+				break;
+			}
+			a = &artifacts[nartifacts++];
+			strlcpy(a->name, fdh.filename, sizeof(a->name));
+			a->offset = offset;
+			a->size = fdh.size;
+			a->encrypted = encrypted;
+			a->compressed = (compressed < 0) ?
+				(encrypted ? COMPRESSED_FALSE : detect_compressed(fd, offset)) :
+				compressed;
+		}
+
+		offset += fdh.size;
+		offset += NPAD_BYTES(offset);
+		if (lseek(fd, offset, SEEK_SET) < 0)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void read_proc_io(struct bench_sample *s)
+{
+	char key[32];
+	unsigned long long val;
+	FILE *fp = fopen("/proc/self/io", "r");
+
+	s->syscr = s->syscw = s->rchar = s->wchar = 0;
+	if (!fp)
+		return;
+	while (fscanf(fp, "%31[^:]: %llu\n", key, &val) == 2) {
+		if (!strcmp(key, "syscr"))
+			s->syscr = val;
+		else if (!strcmp(key, "syscw"))
+			s->syscw = val;
+		else if (!strcmp(key, "rchar"))
+			s->rchar = val;
+		else if (!strcmp(key, "wchar"))
+			s->wchar = val;
+	}
+	fclose(fp);
+}
+
+static void take_sample(struct bench_sample *s)
+{
+	read_proc_io(s);
+	getrusage(RUSAGE_SELF, &s->usage);
+	clock_gettime(CLOCK_MONOTONIC, &s->time);
+}
+
+static double ms(struct timespec *t)
+{
+	return t->tv_sec * 1000.0 + t->tv_nsec / 1000000.0;
+}
+
+static double tv_ms(struct timeval *t)
+{
+	return t->tv_sec * 1000.0 + t->tv_usec / 1000.0;
+}
+
+static int run_stage(int fd, int stage, const char *output)
+{
+	unsigned int i;
+	int fdout = -1;
+	int ret = 0;
+
+	if (stage == STAGE_WRITE) {
+		fdout = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fdout < 0) {
+			fprintf(stderr, "%s cannot be opened: %s\n", output,
+				strerror(errno));
+			return -ENOENT;
+		}
+	}
+
+	for (i = 0; i < nartifacts && !ret; i++) {
+		struct bench_artifact *a = &artifacts[i];
+		unsigned long offset = a->offset;
+
+		if (lseek(fd, a->offset, SEEK_SET) < 0) {
+			ret = -EIO;
+			break;
+		}
+		/* each artifact overwrites the previous one in the sink */
+		if (fdout >= 0)
+			(void)lseek(fdout, 0, SEEK_SET);
+
+		ret = copyfile(fd, &fdout, a->size, &offset, 0,
+			       stage != STAGE_WRITE,
+			       stage >= STAGE_DECOMPRESS ? a->compressed : COMPRESSED_FALSE,
+			       NULL,
+			       stage >= STAGE_HASH ? a->sha256 : NULL,
+			       stage >= STAGE_DECRYPT ? a->encrypted : ENCRYPTED_FALSE,
+			       NULL, NULL);
+		if (ret < 0)
+			fprintf(stderr, "%s: stage %s failed with %d\n", a->name,
+				stage_names[stage], ret);
+	}
+
+	if (fdout >= 0)
+		close(fdout);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_sample start, end;
+	unsigned long long total = 0;
+	const char *output = "/dev/null";
+	char *aeskeyfname = NULL;
+	bool swu = false;
+	int encrypted = ENCRYPTED_FALSE, cipher = ENCRYPTED_AES_CBC;
+	bool has_compressed = false;
+	int compressed = COMPRESSED_FALSE;
+	bool compressed_set = false;
+	unsigned int repeat = 1, i, r;
+	struct stat st;
+	int c, fd, stage;
+
+	while ((c = getopt_long(argc, argv, "sz:ek:c:b:w:o:n:h", long_options, NULL)) != EOF) {
+		switch (c) {
+		case 's':
+			swu = true;
+			break;
+		case 'z':
+			compressed = parse_compressed(optarg);
+			compressed_set = true;
+			break;
+		case 'e':
+			encrypted = ENCRYPTED_TRUE;
+			break;
+		case 'c':
+			cipher = parse_cipher(optarg);
+			break;
+		case 'k':
+			aeskeyfname = optarg;
+			break;
+		case 'b':
+			get_swupdate_cfg()->copy_buffer_size = ustrtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			get_swupdate_cfg()->writeback_chunk = ustrtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'n':
+			repeat = strtoul(optarg, NULL, 10);
+			if (!repeat)
+				repeat = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	swupdate_crypto_init();
+	if (encrypted) {
+		encrypted = cipher;
+		if (!aeskeyfname || load_decryption_key(aeskeyfname)) {
+			fprintf(stderr, "Encrypted artifacts need a valid AES key (-k)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s cannot be opened: %s\n", argv[optind],
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (swu) {
+		if (scan_swu(fd, compressed_set ? compressed : -1, encrypted) < 0) {
+			fprintf(stderr, "%s is not a valid SWU\n", argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		struct bench_artifact *a = &artifacts[nartifacts++];
+
+		strlcpy(a->name, argv[optind], sizeof(a->name));
+		a->offset = 0;
+		a->size = st.st_size;
+		a->encrypted = encrypted;
+		a->compressed = (compressed < 0) ? detect_compressed(fd, 0) : compressed;
+	}
+
+	for (i = 0; i < nartifacts; i++) {
+		if (hash_artifact(fd, &artifacts[i]) < 0) {
+			fprintf(stderr, "%s cannot be read\n", artifacts[i].name);
+			exit(EXIT_FAILURE);
+		}
+		if (artifacts[i].compressed)
+			has_compressed = true;
+		total += artifacts[i].size;
+		fprintf(stdout, "%-32s %12zu bytes%s%s\n", artifacts[i].name,
+			artifacts[i].size,
+			artifacts[i].encrypted == ENCRYPTED_AES_CTR ? ", aes-ctr" :
+			artifacts[i].encrypted ? ", encrypted" : "",
+			artifacts[i].compressed == COMPRESSED_ZLIB ? ", zlib" :
+			artifacts[i].compressed == COMPRESSED_ZSTD ? ", zstd" :
+			artifacts[i].compressed == COMPRESSED_LZ4 ? ", lz4" :
+			artifacts[i].compressed == COMPRESSED_XZ ? ", xz" : "");
+	}
+
+	fprintf(stdout, "buffer size %zu bytes, %u run(s) per stage\n\n",
+		copy_buffer_size(-1, 0), repeat);
+	fprintf(stdout, "%-12s %10s %9s %10s %10s %9s %9s %12s\n",
+		"stage", "time [ms]", "MB/s", "user [ms]", "sys [ms]",
+		"read()", "write()", "out bytes");
+
+	for (stage = STAGE_READ; stage < STAGE_LAST; stage++) {
+		double elapsed;
+
+		if (stage == STAGE_DECRYPT && !encrypted)
+			continue;
+		if (stage == STAGE_DECOMPRESS && !has_compressed)
+			continue;
+
+		take_sample(&start);
+		for (r = 0; r < repeat; r++) {
+			if (run_stage(fd, stage, output) < 0)
+				exit(EXIT_FAILURE);
+		}
+		take_sample(&end);
+
+		elapsed = (ms(&end.time) - ms(&start.time)) / repeat;
+		fprintf(stdout, "%-12s %10.1f %9.1f %10.1f %10.1f %9llu %9llu %12llu\n",
+			stage_names[stage], elapsed,
+			elapsed > 0 ? (total / 1048576.0) / (elapsed / 1000.0) : 0,
+			(tv_ms(&end.usage.ru_utime) - tv_ms(&start.usage.ru_utime)) / repeat,
+			(tv_ms(&end.usage.ru_stime) - tv_ms(&start.usage.ru_stime)) / repeat,
+			(end.syscr - start.syscr) / repeat,
+			(end.syscw - start.syscw) / repeat,
+			(end.wchar - start.wchar) / repeat);
+	}
+
+	close(fd);
+
+	return EXIT_SUCCESS;
+}
@@ -28,7 +28,9 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include "network_ipc.h"
@@ -45,14 +47,24 @@ static void usage(void) {
 		" -q : go quiet, resets verbosity\n"
 		" -v : go verbose, essentially print upgrade status messages from server\n"
 		" -p : ask the server to run post-update commands if upgrade succeeds\n"
+		" -s : stream the image through the socket instead of passing\n"
+		"      the file descriptor to the server\n"
+		" -b : report the time and the throughput of the update\n"
+		" -t : install all images as a single transaction, the\n"
+		"      bootloader environment is changed after the last one\n"
 		);
 }
 
-char buf[256];
+char buf[64 * 1024];
 int fd = STDIN_FILENO;
 int verbose = 1;
 bool dry_run = false;
 bool run_postupdate = false;
+bool stream_image = false;
+bool bench = false;
+bool transaction = false;
+unsigned char bundle = BUNDLE_NONE;
+unsigned long long sent_bytes;
 int end_status = EXIT_SUCCESS;
 char *software_set = NULL, *running_mode = NULL;
 
@@ -73,6 +85,8 @@ static int readimage(char **p, int *size) {
 	*p = buf;
 
 	*size = ret;
+	if (ret > 0)
+		sent_bytes += ret;
 
 	return ret;
 }
@@ -104,7 +118,8 @@ static int end(RECOVERY_STATUS status)
 		status == FAILURE ? "*failed* !" :
 			"was successful !");
 
-	if (status == SUCCESS && run_postupdate) {
+	/* post-update actions run after the last image of a transaction */
+	if (status == SUCCESS && run_postupdate && bundle != BUNDLE_NEXT) {
 		fprintf(stdout, "Executing post-update actions.\n");
 		ipc_message msg;
 		msg.data.procmsg.len = 0;
@@ -121,11 +136,42 @@ static int end(RECOVERY_STATUS status)
 	return 0;
 }
 
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_bench(const char *filename, bool passed_fd,
+			struct timespec *start)
+{
+	double secs = elapsed(start);
+	struct stat st;
+
+	/* the server read a passed descriptor itself */
+	if (passed_fd)
+		sent_bytes = (!fstat(fd, &st) && S_ISREG(st.st_mode)) ? st.st_size : 0;
+
+	fprintf(stdout, "%s: %s, %.3f s",
+		filename ? filename : "stdin",
+		passed_fd ? "file descriptor passed" : "streamed", secs);
+	if (sent_bytes && secs > 0)
+		fprintf(stdout, ", %llu bytes, %.2f MiB/s",
+			sent_bytes, sent_bytes / secs / (1024 * 1024));
+	fprintf(stdout, "\n");
+}
+
 /*
  * Send file to main swupdate process
  */
 static int send_file(const char* filename) {
-	int rc;
+	int rc = -1;
+	bool passed_fd = false;
+	struct timespec start;
+
 	if (filename && (fd = open(filename, O_RDONLY)) < 0) {
 		fprintf(stderr, "Unable to open %s\n", filename);
 		return EXIT_FAILURE;
@@ -138,12 +184,28 @@ static int send_file(const char* filename) {
 	swupdate_prepare_req(&req);
 	if (dry_run)
 		req.dry_run = RUN_DRYRUN;
+	req.bundle = bundle;
 	if (software_set && strlen(software_set)) {
 		strncpy(req.software_set, software_set, sizeof(req.software_set) - 1);
 		strncpy(req.running_mode, running_mode, sizeof(req.running_mode) - 1);
 	}
-	rc = swupdate_async_start(readimage, printstatus,
-				end, &req, sizeof(req));
+
+	sent_bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/*
+	 * Let SWUpdate read the image itself through the passed file
+	 * descriptor, without copying it through the socket. Stream it
+	 * if this is not possible, for example with an older SWUpdate.
+	 */
+	if (!stream_image) {
+		rc = swupdate_async_start_fd(fd, printstatus, end,
+					     &req, sizeof(req));
+		passed_fd = rc >= 0;
+	}
+	if (rc < 0)
+		rc = swupdate_async_start(readimage, printstatus,
+					  end, &req, sizeof(req));
 
 	/* return if we've hit an error scenario */
 	if (rc < 0) {
@@ -158,6 +220,9 @@ static int send_file(const char* filename) {
 	pthread_cond_wait(&cv_end, &mymutex);
 	pthread_mutex_unlock(&mymutex);
 
+	if (bench)
+		print_bench(filename, passed_fd, &start);
+
 	if (filename)
 		close(fd);
 
@@ -175,7 +240,7 @@ int main(int argc, char *argv[]) {
 	pthread_mutex_init(&mymutex, NULL);
 
 	/* parse command line options */
-	while ((c = getopt(argc, argv, "dhqvpe:")) != EOF) {
+	while ((c = getopt(argc, argv, "dhqvpe:sbt")) != EOF) {
 		switch (c) {
 		case 'd':
 			dry_run = true;
@@ -202,6 +267,15 @@ int main(int argc, char *argv[]) {
 		case 'p':
 			run_postupdate = true;
 			break;
+		case 's':
+			stream_image = true;
+			break;
+		case 'b':
+			bench = true;
+			break;
+		case 't':
+			transaction = true;
+			break;
 		default:
 			usage();
 			return -1;
@@ -215,6 +289,8 @@ int main(int argc, char *argv[]) {
 		if (send_file(NULL)) exit(1);
 	} else {
 		for (int i = 0; i < argc; i++) {
+			if (transaction && argc > 1)
+				bundle = i < argc - 1 ? BUNDLE_NEXT : BUNDLE_LAST;
 			if (send_file(argv[i])) exit(1);
 		}
 	}
@@ -60,6 +60,19 @@ static void usage_setversion(const char *program) {
 	fprintf(stdout, "\t %s <minversion> <maxversion> <current>\n", program);
 }
 
+static void usage_priority(const char *program) {
+	fprintf(stdout, "\t %s <normal|peak>\n", program);
+}
+
+static void usage_refreshroot(const char *program) {
+	fprintf(stdout, "\t %s\n", program);
+}
+
+static void usage_profile(const char *program) {
+	fprintf(stdout, "\t %s : print the profile of the handlers of the last updates\n",
+		program);
+}
+
 static void usage_send_to_hawkbit(const char *program) {
 	fprintf(stdout, "\t %s <action id> <status> <finished> "
 			"<execution> <detail 1> <detail 2> ..\n", program);
@@ -82,6 +95,9 @@ static void usage_hawkbitcfg(const char *program) {
 		"\t\t-e, --enable            : Enable polling of backend server\n"
 		"\t\t-d, --disable           : Disable polling of backend server\n"
 		"\t\t-t, --trigger           : Enable and check for update\n"
+		"\t\t-m, --max-speed <bytes/s> : Limit download speed\n"
+		"\t\t-n, --min-speed <bytes/s> : Lowest download speed in adaptive mode\n"
+		"\t\t-a, --adaptive          : Reduce download speed if the link is congested\n"
 		);
 }
 
@@ -139,6 +155,9 @@ static struct option hawkbitcfg_options[] = {
 	{"enable", no_argument, NULL, 'e'},
 	{"disable", no_argument, NULL, 'd'},
 	{"trigger", no_argument, NULL, 't'},
+	{"max-speed", required_argument, NULL, 'm'},
+	{"min-speed", required_argument, NULL, 'n'},
+	{"adaptive", no_argument, NULL, 'a'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -152,6 +171,9 @@ static int hawkbitcfg(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *a
 	bool trigger = false;
 	int opt_e = 0;
 	int opt_p = 0;
+	int opt_s = 0;
+	unsigned long max_speed = 0, min_speed = 0;
+	bool adaptive = false;
 
 	memset(&msg, 0, sizeof(msg));
 	msg.data.procmsg.source = SOURCE_SURICATTA;
@@ -161,7 +183,7 @@ static int hawkbitcfg(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *a
 	buf = msg.data.procmsg.buf;
 
 	/* Process options with getopt */
-	while ((c = getopt_long(argc, argv, "p:edth",
+	while ((c = getopt_long(argc, argv, "p:edthm:n:a",
 				hawkbitcfg_options, NULL)) != EOF) {
 		switch (c) {
 		case 'p':
@@ -177,6 +199,18 @@ static int hawkbitcfg(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *a
 			trigger = (c == 't');
 			enable = (c == 'e') || trigger;
 			break;
+		case 'm':
+			opt_s = 1;
+			max_speed = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			opt_s = 1;
+			min_speed = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			opt_s = 1;
+			adaptive = true;
+			break;
 		}
 	}
 
@@ -197,6 +231,14 @@ static int hawkbitcfg(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *a
 		msg.data.procmsg.len = strnlen(buf, size);
 		send_msg(&msg);
 	}
+	if (opt_s) {
+		msg.data.procmsg.cmd = CMD_CONFIG;
+		snprintf(buf, size,
+			 "{ \"download-speed\" : { \"max\" : %lu, \"min\" : %lu, \"adaptive\" : %s}}",
+			 max_speed, min_speed, adaptive ? "true" : "false");
+		msg.data.procmsg.len = strnlen(buf, size);
+		send_msg(&msg);
+	}
 
 	exit(0);
 }
@@ -353,6 +395,58 @@ static int setversions(cmd_t *cmd, int argc, char *argv[]) {
 	return 0;
 }
 
+static int setpriority_profile(cmd_t *cmd, int argc, char *argv[]) {
+	if (argc != 2 || (strcmp(argv[1], "normal") && strcmp(argv[1], "peak"))) {
+		cmd->usage(argv[0]);
+		return 1;
+	}
+
+	if (swupdate_set_install_priority(argv[1])) {
+		fprintf(stderr, "Error IPC setting the install priority\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int refreshroot(cmd_t *cmd, int argc, char *argv[]) {
+	if (argc != 1) {
+		cmd->usage(argv[0]);
+		return 1;
+	}
+
+	if (swupdate_refresh_root_device()) {
+		fprintf(stderr, "Error IPC refreshing the root device\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int getprofile(cmd_t *cmd, int argc, char *argv[]) {
+	char path[256], buf[4096];
+	size_t n;
+	FILE *fp;
+
+	if (argc != 1) {
+		cmd->usage(argv[0]);
+		return 1;
+	}
+
+	if (ipc_get_file_path(GET_PROFILE, path, sizeof(path))) {
+		fprintf(stderr, "Error IPC getting the profile\n");
+		return 1;
+	}
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(fp);
+
+	return 0;
+}
+
 #if defined(CONFIG_CURL)
 #include <curl/curl.h>
 
@@ -628,13 +722,18 @@ static int monitor(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *argv
 	}
 
 	int connfd = -1;
-	struct progress_msg msg;
+	struct progress_msg_ext ext;
+	struct progress_msg *msg = &ext.msg;
 	while (1) {
 		if (connfd < 0) {
 			if (!socket_path)
 				connfd = progress_ipc_connect(true);
 			else
 				connfd = progress_ipc_connect_with_path(socket_path, true);
+			if (connfd >= 0 && progress_ipc_request_ext(connfd) < 0) {
+				close(connfd);
+				connfd = -1;
+			}
 		}
 
 		/*
@@ -645,34 +744,41 @@ static int monitor(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *argv
 			continue;
 		}
 
-		if (progress_ipc_receive(&connfd, &msg) <= 0) {
+		if (progress_ipc_receive_ext(&connfd, &ext) <= 0) {
 			continue;
 		}
 
-		if (msg.infolen > 0) {
+		if (msg->infolen > 0) {
 			/*
 			 * check that msg is NULL terminated
 			 */
-			if (msg.infolen > sizeof(msg.info) - 1) {
-				msg.infolen = sizeof(msg.info) - 1;
+			if (msg->infolen > sizeof(msg->info) - 1) {
+				msg->infolen = sizeof(msg->info) - 1;
 			}
-			msg.info[msg.infolen] = '\0';
+			msg->info[msg->infolen] = '\0';
 		}
 
 		/*
 		 * ensure strings are null-terminated (they usually are by construction)
 		 */
-		msg.hnd_name[sizeof(msg.hnd_name) - 1] = '\0';
-		msg.cur_image[sizeof(msg.cur_image) - 1] = '\0';
+		msg->hnd_name[sizeof(msg->hnd_name) - 1] = '\0';
+		msg->cur_image[sizeof(msg->cur_image) - 1] = '\0';
 
 		fprintf(stdout, "[{ \"magic\": %d, \"status\": %u, \"dwl_percent\": %u, \"dwl_bytes\": %llu"
 				", \"nsteps\": %u, \"cur_step\": %u, \"cur_percent\": %u, \"cur_image\": \"%s\""
 				", \"hnd_name\": \"%s\", \"source\": %u, \"infolen\": %u }",
-				msg.magic, msg.status, msg.dwl_percent,
-				msg.dwl_bytes, msg.nsteps, msg.cur_step,
-				msg.cur_percent, msg.cur_image, msg.hnd_name,
-				msg.source, msg.infolen);
-                if (msg.infolen > 0) fprintf(stdout, ", %s]\n", msg.info); else fprintf(stdout, "]\n");
+				msg->magic, msg->status, msg->dwl_percent,
+				msg->dwl_bytes, msg->nsteps, msg->cur_step,
+				msg->cur_percent, msg->cur_image, msg->hnd_name,
+				msg->source, msg->infolen);
+		if (msg->magic == PROGRESS_EXT_MAGIC)
+			fprintf(stdout, ", { \"bytes_read\": %llu, \"bytes_total\": %llu"
+					", \"bytes_written\": %llu, \"elapsed_ms\": %llu"
+					", \"throughput\": %llu, \"eta_ms\": %llu }",
+					ext.stats.bytes_read, ext.stats.bytes_total,
+					ext.stats.bytes_written, ext.stats.elapsed_ms,
+					ext.stats.throughput, ext.stats.eta_ms);
+                if (msg->infolen > 0) fprintf(stdout, ", %s]\n", msg->info); else fprintf(stdout, "]\n");
 
 		fflush(stdout);
 	}
@@ -685,6 +791,9 @@ static int monitor(cmd_t  __attribute__((__unused__)) *cmd, int argc, char *argv
 cmd_t commands[] = {
 	{"aes", sendaes, usage_aes},
 	{"setversion",setversions, usage_setversion},
+	{"priority", setpriority_profile, usage_priority},
+	{"refreshroot", refreshroot, usage_refreshroot},
+	{"profile", getprofile, usage_profile},
 	{"sendtohawkbit", sendtohawkbit, usage_send_to_hawkbit},
 	{"hawkbitcfg", hawkbitcfg, usage_hawkbitcfg},
 	{"gethawkbit", gethawkbitstatus, usage_gethawkbitstatus},
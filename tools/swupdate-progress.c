@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -24,6 +25,7 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <progress_ipc.h>
 
@@ -47,6 +49,40 @@
 #define	WHITE		7
 
 static bool silent = false;
+static bool json_output = false;
+
+static const char *status_names[] = {
+	[IDLE] = "IDLE",
+	[START] = "START",
+	[RUN] = "RUN",
+	[SUCCESS] = "SUCCESS",
+	[FAILURE] = "FAILURE",
+	[DOWNLOAD] = "DOWNLOAD",
+	[DONE] = "DONE",
+	[SUBPROCESS] = "SUBPROCESS",
+	[PROGRESS] = "PROGRESS"
+};
+
+static const char *source_names[] = {
+	[SOURCE_UNKNOWN] = "UNKNOWN",
+	[SOURCE_WEBSERVER] = "WEBSERVER",
+	[SOURCE_SURICATTA] = "BACKEND",
+	[SOURCE_DOWNLOADER] = "DOWNLOADER",
+	[SOURCE_LOCAL] = "LOCAL",
+	[SOURCE_CHUNKS_DOWNLOADER] = "CHUNKS DOWNLOADER"
+};
+
+#define NAME_OF(names, i) \
+	((unsigned int)(i) < sizeof(names) / sizeof(names[0]) && names[i] ? \
+	 names[i] : "UNKNOWN")
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
 
 static void resetterm(void)
 {
@@ -72,6 +108,8 @@ static struct option long_options[] = {
 	{"socket", required_argument, NULL, 's'},
 	{"exec", required_argument, NULL, 'e'},
 	{"quiet", no_argument, NULL, 'q'},
+	{"interval", required_argument, NULL, 'i'},
+	{"json", no_argument, NULL, 'j'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -89,6 +127,8 @@ static void usage(char *programname)
 		" -s, --socket <path>     : path to progress IPC socket\n"
 		" -h, --help              : print this help and exit\n"
 		" -q, --quiet             : do not print progress bar\n"
+		" -i, --interval <ms>     : redraw the bar at most every <ms> milliseconds\n"
+		" -j, --json              : print one JSON object per line for each message\n"
 		);
 }
 
@@ -193,9 +233,54 @@ static void fill_progress_bar(char *bar, size_t size, unsigned int percent)
 	memset(&bar[filled_len], '-', remain);
 }
 
+static void json_string(const char *name, const char *str, size_t len)
+{
+	fprintf(stdout, ",\"%s\":\"", name);
+	for (size_t i = 0; i < len && str[i]; i++) {
+		unsigned char c = (unsigned char)str[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(stdout, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(stdout, "\\u%04x", c);
+		else
+			fputc(c, stdout);
+	}
+	fputc('"', stdout);
+}
+
+/*
+ * Line delimited JSON, the statistics are zero
+ * if SWUpdate does not send extended messages
+ */
+static void print_json(const struct progress_msg_ext *ext)
+{
+	const struct progress_msg *msg = &ext->msg;
+	const struct progress_stats *stats = &ext->stats;
+
+	fprintf(stdout, "{\"status\":\"%s\"", NAME_OF(status_names, msg->status));
+	json_string("source", NAME_OF(source_names, msg->source), SIZE_MAX);
+	fprintf(stdout, ",\"step\":%u,\"nsteps\":%u,\"percent\":%u",
+		msg->cur_step, msg->nsteps, msg->cur_percent);
+	json_string("image", msg->cur_image, sizeof(msg->cur_image));
+	json_string("handler", msg->hnd_name, sizeof(msg->hnd_name));
+	fprintf(stdout, ",\"dwl_percent\":%u,\"dwl_bytes\":%llu",
+		msg->dwl_percent, msg->dwl_bytes);
+	fprintf(stdout, ",\"bytes_read\":%llu,\"bytes_total\":%llu,"
+		"\"bytes_written\":%llu,\"elapsed_ms\":%llu,"
+		"\"throughput\":%llu,\"eta_ms\":%llu",
+		stats->bytes_read, stats->bytes_total, stats->bytes_written,
+		stats->elapsed_ms, stats->throughput, stats->eta_ms);
+	if (msg->infolen > 0)
+		json_string("info", msg->info, msg->infolen);
+	fprintf(stdout, "}\n");
+	fflush(stdout);
+}
+
 int main(int argc, char **argv)
 {
 	int connfd;
+	struct progress_msg_ext ext;
 	struct progress_msg msg;
 	const char *rundir;
 	char psplash_pipe_path[256];
@@ -212,9 +297,14 @@ int main(int argc, char **argv)
 	int ret;
 	char *script = NULL;
 	bool wait_update = true;
+	unsigned long long interval_ms = 0;
+	unsigned long long last_draw = 0, now;
+	unsigned int drawn_step = 0, drawn_percent = 0, drawn_dwl = 0;
+	RECOVERY_STATUS last_status = IDLE;
+	char *endp;
 
 	/* Process options with getopt */
-	while ((c = getopt_long(argc, argv, "cwprhs:e:q",
+	while ((c = getopt_long(argc, argv, "cwprhs:e:qi:j",
 				long_options, NULL)) != EOF) {
 		switch (c) {
 		case 'c':
@@ -242,6 +332,17 @@ int main(int argc, char **argv)
 		case 'q':
 			silent = true;
 			break;
+		case 'i':
+			interval_ms = strtoull(optarg, &endp, 10);
+			if (endp == optarg || *endp) {
+				fprintf(stderr, "Wrong interval %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'j':
+			json_output = true;
+			silent = true;
+			break;
 		default:
 			usage(argv[0]);
 			exit(1);
@@ -259,6 +360,11 @@ int main(int argc, char **argv)
 	while (1) {
 		if (connfd < 0) {
 			connfd = progress_ipc_connect(opt_w);
+			/* statistics are just missing if SWUpdate is older */
+			if (connfd >= 0 && progress_ipc_request_ext(connfd) < 0) {
+				close(connfd);
+				connfd = -1;
+			}
 		}
 
 		/*
@@ -269,36 +375,35 @@ int main(int argc, char **argv)
 			continue;
 		}
 
-		if (progress_ipc_receive(&connfd, &msg) <= 0) {
+		if (progress_ipc_receive_ext(&connfd, &ext) <= 0) {
 			continue;
 		}
+		msg = ext.msg;
+
+		/*
+		 * Percentage updates are dropped if they come faster than
+		 * the interval, changes of status are always reported
+		 */
+		now = now_ms();
+		if (json_output) {
+			if (msg.status != last_status || msg.infolen > 0 ||
+			    msg.cur_step != curstep || msg.cur_percent == 100 ||
+			    now - last_draw >= interval_ms) {
+				print_json(&ext);
+				last_draw = now;
+			}
+			last_status = msg.status;
+		}
 
 		/*
 		 * Something happens, show the info
 		 */
 		if (wait_update) {
 			if (msg.status == START || msg.status == RUN) {
-				fprintf(stdout, "\n\nUpdate started !\n");
-				fprintf(stdout, "Interface: ");
-				switch (msg.source) {
-				case SOURCE_UNKNOWN:
-					fprintf(stdout, "UNKNOWN\n\n");
-					break;
-				case SOURCE_WEBSERVER:
-					fprintf(stdout, "WEBSERVER\n\n");
-					break;
-				case SOURCE_SURICATTA:
-					fprintf(stdout, "BACKEND\n\n");
-					break;
-				case SOURCE_DOWNLOADER:
-					fprintf(stdout, "DOWNLOADER\n\n");
-					break;
-				case SOURCE_CHUNKS_DOWNLOADER:
-					fprintf(stdout, "CHUNKS DOWNLOADER\n\n");
-					break;
-				case SOURCE_LOCAL:
-					fprintf(stdout, "LOCAL\n\n");
-					break;
+				if (!json_output) {
+					fprintf(stdout, "\n\nUpdate started !\n");
+					fprintf(stdout, "Interface: %s\n\n",
+						NAME_OF(source_names, msg.source));
 				}
 				curstep = 0;
 				wait_update = false;
@@ -313,7 +418,8 @@ int main(int argc, char **argv)
 				msg.infolen = sizeof(msg.info) - 1;
 			}
 			msg.info[msg.infolen] = '\0';
-			fprintf(stdout, "INFO : %s\r", msg.info);
+			if (!json_output)
+				fprintf(stdout, "INFO : %s\r", msg.info);
 		}
 		msg.cur_image[sizeof(msg.cur_image) - 1] = '\0';
 
@@ -330,15 +436,27 @@ int main(int argc, char **argv)
 						fflush(stdout);
 					}
 				}
-				fill_progress_bar(bar, sizeof(bar), msg.cur_percent);
-
-				if (!silent) {
+				/*
+				 * Redraw only what changed and not faster than
+				 * the interval, writing to a slow console
+				 * costs more than the update itself
+				 */
+				if (!silent && (msg.cur_step != drawn_step ||
+				    msg.cur_percent != drawn_percent ||
+				    msg.dwl_percent != drawn_dwl) &&
+				    (msg.cur_step != curstep || msg.cur_percent == 100 ||
+				     now - last_draw >= interval_ms)) {
+					fill_progress_bar(bar, sizeof(bar), msg.cur_percent);
 					fprintf(stdout, "[ %.*s ] %d of %d %d%% (%s), dwl %d%% of %llu bytes\r",
 						bar_len,
 						bar,
 						msg.cur_step, msg.nsteps, msg.cur_percent,
 						msg.cur_image, msg.dwl_percent, msg.dwl_bytes);
 					fflush(stdout);
+					last_draw = now;
+					drawn_step = msg.cur_step;
+					drawn_percent = msg.cur_percent;
+					drawn_dwl = msg.dwl_percent;
 				}
 
 				if (psplash_ok && ((msg.cur_step != curstep) || (msg.cur_percent != percent))) {
@@ -359,9 +477,10 @@ int main(int argc, char **argv)
 					textcolor(BRIGHT, GREEN, BLACK);
 			}
 
-			fprintf(stdout, "\n%s !\n", msg.status == SUCCESS
-							  ? "SUCCESS"
-							  : "FAILURE");
+			if (!json_output)
+				fprintf(stdout, "\n%s !\n", msg.status == SUCCESS
+								  ? "SUCCESS"
+								  : "FAILURE");
 			if (script) {
 				char *cmd;
 				if (asprintf(&cmd, "%s %s", script,
@@ -388,9 +507,11 @@ int main(int argc, char **argv)
 				}
 			}
 			wait_update = true;
+			drawn_step = 0;
 			break;
 		case DONE:
-			fprintf(stdout, "\nDONE.\n\n");
+			if (!json_output)
+				fprintf(stdout, "\nDONE.\n\n");
 			break;
 		default:
 			break;